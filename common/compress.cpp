@@ -0,0 +1,129 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/compress.h"
+#include "common/zlib.h"
+#include "common/xz.h"
+#include "common/zstd.h"
+
+#include <string.h>
+
+CompressParams::CompressParams() : level(-1), bufSize(0) {
+#if defined(USE_ZLIB)
+	strategy = Z_DEFAULT_STRATEGY;
+#else
+	strategy = 0;
+#endif
+}
+
+static const char *const codecNames[CODEC_COUNT] = {
+	"gzip",
+	"zstd",
+	"xz"
+};
+
+const char *codecName(int codec) {
+	if (codec < 0 || codec >= CODEC_COUNT)
+		return NULL;
+	return codecNames[codec];
+}
+
+int codecByName(const char *name) {
+	for (int i = 0; i < CODEC_COUNT; i++)
+		if (strcmp(name, codecNames[i]) == 0)
+			return i;
+	return -1;
+}
+
+bool codecSupported(int codec) {
+	switch (codec) {
+#if defined(USE_ZLIB)
+	case CODEC_GZIP:
+		return true;
+#endif
+#if defined(USE_ZSTD)
+	case CODEC_ZSTD:
+		return true;
+#endif
+#if defined(USE_LZMA)
+	case CODEC_XZ:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool codecLevelValid(int codec, int level) {
+	if (level == -1)
+		return true;
+	switch (codec) {
+	case CODEC_GZIP:
+	case CODEC_XZ:
+		return level >= 0 && level <= 9;
+	case CODEC_ZSTD:
+		return level >= 1 && level <= 22;
+	default:
+		return false;
+	}
+}
+
+DecompressStream *openDecompressStream(int codec, const byte *data, uint32 size) {
+	switch (codec) {
+#if defined(USE_ZLIB)
+	case CODEC_GZIP:
+		return new GZipReadStream(data, size);
+#endif
+#if defined(USE_ZSTD)
+	case CODEC_ZSTD:
+		return new ZstdReadStream(data, size);
+#endif
+#if defined(USE_LZMA)
+	case CODEC_XZ:
+		return new XzReadStream(data, size);
+#endif
+	default:
+		return NULL;
+	}
+}
+
+CompressStream *openCompressStream(int codec, std::ofstream *w, const CompressParams &params) {
+	switch (codec) {
+#if defined(USE_ZLIB)
+	case CODEC_GZIP:
+		return new GZipWriteStream(w, params.level == -1 ? Z_DEFAULT_COMPRESSION : params.level, params.strategy,
+		                           params.bufSize ? params.bufSize : (uint32)GZipWriteStream::BUFSIZE);
+#endif
+#if defined(USE_ZSTD)
+	case CODEC_ZSTD:
+		return new ZstdWriteStream(w, params.level == -1 ? 19 : params.level,
+		                           params.bufSize ? params.bufSize : (uint32)ZstdWriteStream::BUFSIZE);
+#endif
+#if defined(USE_LZMA)
+	case CODEC_XZ:
+		return new XzWriteStream(w, params.level == -1 ? 6 : params.level,
+		                         params.bufSize ? params.bufSize : (uint32)XzWriteStream::BUFSIZE);
+#endif
+	default:
+		return NULL;
+	}
+}
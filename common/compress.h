@@ -0,0 +1,86 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_COMPRESS_H
+#define COMMON_COMPRESS_H
+
+#include "common/scummsys.h"
+#include "common/stream.h"
+
+#include <fstream>
+
+/**
+ * Codec IDs of compressed patch streams, as stored in patch headers.
+ * GZip is always available when zlib is, the others depend on the
+ * libraries found by configure.
+ */
+enum {
+	CODEC_GZIP = 0,
+	CODEC_ZSTD = 1,
+	CODEC_XZ = 2,
+	CODEC_COUNT
+};
+
+/**
+ * Tuning of compressed streams. A level of -1 leaves it at the codec
+ * default, a bufSize of 0 keeps the default output buffer size.
+ */
+struct CompressParams {
+	int level;
+	int strategy;	// zlib Z_*_STRATEGY value, gzip only
+	uint32 bufSize;
+
+	CompressParams();
+};
+
+/** A stream inflating compressed data, see openDecompressStream() */
+typedef ReadStream DecompressStream;
+
+/** A stream compressing data on its way to a wrapped std::ofstream */
+class CompressStream {
+public:
+	virtual ~CompressStream() {}
+	virtual bool err() const = 0;
+	virtual void finalize() = 0;
+	virtual uint32 write(const void *dataPtr, uint32 dataSize) = 0;
+};
+
+/** Name of a codec as used on the command line, NULL if unknown */
+const char *codecName(int codec);
+
+/** Codec ID for a name, -1 if there is no codec of that name */
+int codecByName(const char *name);
+
+/** True if this build can read and write streams of codec */
+bool codecSupported(int codec);
+
+/** True if level is a compression level codec accepts */
+bool codecLevelValid(int codec, int level);
+
+/**
+ * Streams of the given codec. Both return NULL if the codec is not
+ * supported by this build; callers delete the stream when done.
+ */
+DecompressStream *openDecompressStream(int codec, const byte *data, uint32 size);
+CompressStream *openCompressStream(int codec, std::ofstream *w, const CompressParams &params = CompressParams());
+
+#endif
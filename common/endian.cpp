@@ -0,0 +1,86 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "common/endian.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define USE_SWAP_NEON
+#include <arm_neon.h>
+#endif
+
+// The vector loops load a whole block before storing it, so dst may be src
+
+void COPY_SWAP_ARRAY_16(void *dst, const void *src, uint32 count) {
+	const uint8 *s = (const uint8 *)src;
+	uint8 *d = (uint8 *)dst;
+	uint32 i = 0;
+
+#if defined(__SSSE3__)
+	const __m128i order = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	for (; i + 8 <= count; i += 8, s += 16, d += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, order));
+	}
+#elif defined(__SSE2__)
+	for (; i + 8 <= count; i += 8, s += 16, d += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined(USE_SWAP_NEON)
+	for (; i + 8 <= count; i += 8, s += 16, d += 16)
+		vst1q_u8(d, vrev16q_u8(vld1q_u8(s)));
+#endif
+
+	for (; i < count; i++, s += 2, d += 2)
+		WRITE_UINT16(d, SWAP_BYTES_16(READ_UINT16(s)));
+}
+
+void COPY_SWAP_ARRAY_32(void *dst, const void *src, uint32 count) {
+	const uint8 *s = (const uint8 *)src;
+	uint8 *d = (uint8 *)dst;
+	uint32 i = 0;
+
+#if defined(__SSSE3__)
+	const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (; i + 4 <= count; i += 4, s += 16, d += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, order));
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= count; i += 4, s += 16, d += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		// Swap the halves of each word, then the bytes of each half
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+		_mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined(USE_SWAP_NEON)
+	for (; i + 4 <= count; i += 4, s += 16, d += 16)
+		vst1q_u8(d, vrev32q_u8(vld1q_u8(s)));
+#endif
+
+	for (; i < count; i++, s += 4, d += 4)
+		WRITE_UINT32(d, SWAP_BYTES_32(READ_UINT32(s)));
+}
@@ -42,6 +42,13 @@
  *  CONSTANT_??_??(a)     - convert LE/BE value v to native, implemented as macro.
  *                              Use with compiletime-constants only, the result will be a compiletime-constant aswell.
  *                              Unlike most other functions these can be used for eg. switch-case labels
+ *
+ *  SWAP_ARRAY_??(a, n)            - inverse byte order of n values at a, in place
+ *  COPY_SWAP_ARRAY_??(d, s, n)    - copy n values from s to d, inverting their byte order
+ *  FROM_??_ARRAY_??(a, n)         - convert n LE/BE values at a to native, in place
+ *  READ_??_ARRAY_??(d, s, n)      - read n LE/BE values from s and store them native at d
+ *                              The array functions convert whole buffers at a time, using vector
+ *                              instructions where available. Neither pointer needs to be aligned.
  */
 
 // Sanity check
@@ -396,6 +403,53 @@ inline uint32 READ_BE_UINT24(const void *ptr) {
 	return (b[0] << 16) | (b[1] << 8) | (b[2]);
 }
 
+// Bulk conversions, see common/endian.cpp
+void COPY_SWAP_ARRAY_16(void *dst, const void *src, uint32 count);
+void COPY_SWAP_ARRAY_32(void *dst, const void *src, uint32 count);
+
+inline void SWAP_ARRAY_16(void *data, uint32 count) {
+	COPY_SWAP_ARRAY_16(data, data, count);
+}
+
+inline void SWAP_ARRAY_32(void *data, uint32 count) {
+	COPY_SWAP_ARRAY_32(data, data, count);
+}
+
+#if defined(SCUMM_LITTLE_ENDIAN)
+
+	inline void FROM_LE_ARRAY_16(void *, uint32) {}
+	inline void FROM_LE_ARRAY_32(void *, uint32) {}
+	inline void FROM_BE_ARRAY_16(void *data, uint32 count) { SWAP_ARRAY_16(data, count); }
+	inline void FROM_BE_ARRAY_32(void *data, uint32 count) { SWAP_ARRAY_32(data, count); }
+
+	inline void READ_LE_ARRAY_16(void *dst, const void *src, uint32 count) { memmove(dst, src, count * 2); }
+	inline void READ_LE_ARRAY_32(void *dst, const void *src, uint32 count) { memmove(dst, src, count * 4); }
+	inline void READ_BE_ARRAY_16(void *dst, const void *src, uint32 count) { COPY_SWAP_ARRAY_16(dst, src, count); }
+	inline void READ_BE_ARRAY_32(void *dst, const void *src, uint32 count) { COPY_SWAP_ARRAY_32(dst, src, count); }
+
+#elif defined(SCUMM_BIG_ENDIAN)
+
+	inline void FROM_LE_ARRAY_16(void *data, uint32 count) { SWAP_ARRAY_16(data, count); }
+	inline void FROM_LE_ARRAY_32(void *data, uint32 count) { SWAP_ARRAY_32(data, count); }
+	inline void FROM_BE_ARRAY_16(void *, uint32) {}
+	inline void FROM_BE_ARRAY_32(void *, uint32) {}
+
+	inline void READ_LE_ARRAY_16(void *dst, const void *src, uint32 count) { COPY_SWAP_ARRAY_16(dst, src, count); }
+	inline void READ_LE_ARRAY_32(void *dst, const void *src, uint32 count) { COPY_SWAP_ARRAY_32(dst, src, count); }
+	inline void READ_BE_ARRAY_16(void *dst, const void *src, uint32 count) { memmove(dst, src, count * 2); }
+	inline void READ_BE_ARRAY_32(void *dst, const void *src, uint32 count) { memmove(dst, src, count * 4); }
+
+#endif
+
+// IEEE floats are stored in the byte order of the integers of their size
+inline void FROM_LE_ARRAY_FLOAT(float *data, uint32 count) {
+	FROM_LE_ARRAY_32(data, count);
+}
+
+inline void READ_LE_ARRAY_FLOAT(float *dst, const void *src, uint32 count) {
+	READ_LE_ARRAY_32(dst, src, count);
+}
+
 // ResidualVM specific:
 #if defined(SCUMM_BIG_ENDIAN)
 
@@ -0,0 +1,116 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/fileread.h"
+#include "common/stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Common {
+
+static const uint32 CHUNK_SIZE = 1024 * 1024;
+// Small reads, like the 5000 byte patch checks, are not worth a mapping
+static const uint32 MIN_MAP_SIZE = 4 * CHUNK_SIZE;
+
+#ifdef POSIX
+// 1 if the file was mapped and fed to func, 0 if it could not be mapped,
+// -1 if it could not be opened
+static int mapFileChunks(const char *name, uint32 length, ChunkFunc func, void *ctx) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < MIN_MAP_SIZE ||
+	        (length != 0 && length < MIN_MAP_SIZE)) {
+		close(fd);
+		return 0;
+	}
+	// Files past what the address space can map are read instead
+	size_t size = (size_t)st.st_size;
+	if ((off_t)size != st.st_size) {
+		close(fd);
+		return 0;
+	}
+	if (length != 0 && length < size)
+		size = length;
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	// Fed in chunks all the same, so callers see the same calls either way
+	for (size_t pos = 0; pos < size; pos += CHUNK_SIZE)
+		func(ctx, (const uint8 *)map + pos, size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE);
+	munmap(map, size);
+	addStatsRead(size);
+	return 1;
+}
+#endif
+
+bool readFileChunks(const char *name, uint32 length, ChunkFunc func, void *ctx) {
+#ifdef POSIX
+	int mapped = mapFileChunks(name, length, func, ctx);
+	if (mapped != 0)
+		return mapped > 0;
+#endif
+
+	FILE *f = fopen(name, "rb");
+	if (f == NULL)
+		return false;
+
+	uint32 bufSize = (length != 0 && length < CHUNK_SIZE) ? length : CHUNK_SIZE;
+	uint8 *buf = (uint8 *)malloc(bufSize);
+	if (!buf) {
+		fclose(f);
+		return false;
+	}
+
+	bool restricted = (length != 0);
+	uint32 i;
+	while ((i = (uint32)fread(buf, 1, restricted && length < bufSize ? length : bufSize, f)) > 0) {
+		addStatsRead(i);
+		func(ctx, buf, i);
+		if (restricted) {
+			length -= i;
+			if (length == 0)
+				break;
+		}
+	}
+
+	bool ok = !ferror(f);
+	free(buf);
+	fclose(f);
+	return ok;
+}
+
+} // End of namespace Common
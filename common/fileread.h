@@ -0,0 +1,41 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_FILEREAD_H
+#define COMMON_FILEREAD_H
+
+#include "common/scummsys.h"
+
+namespace Common {
+
+typedef void (*ChunkFunc)(void *ctx, const uint8 *data, uint32 size);
+
+/**
+ * Hands the first length bytes of a file, or all of it if length is 0, to
+ * func in order. Whole files are mapped where possible, otherwise they are
+ * read through a large buffer. Returns false if the file can not be read.
+ */
+bool readFileChunks(const char *name, uint32 length, ChunkFunc func, void *ctx);
+
+} // End of namespace Common
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "common/md5.h"
 #include "common/endian.h"
+#include "common/fileread.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -227,42 +228,18 @@ void md5_finish(md5_context *ctx, uint8 digest[16]) {
 	PUT_UINT32(ctx->state[3], digest, 12);
 }
 
-bool md5_file(const char *name, uint8 digest[16], uint32 length) {
-	FILE *f;
-
-	f = fopen(name, "rb");
-	if (f == NULL) {
-		printf("md5_file couldn't open '%s'", name);
-		return false;
-	}
+static void md5Chunk(void *ctx, const uint8 *data, uint32 size) {
+	md5_update((md5_context *)ctx, data, size);
+}
 
+bool md5_file(const char *name, uint8 digest[16], uint32 length) {
 	md5_context ctx;
-	uint32 i;
-	unsigned char buf[1000];
-	bool restricted = (length != 0);
-	int readlen;
-
-	if (!restricted || sizeof(buf) <= length)
-		readlen = sizeof(buf);
-	else
-		readlen = length;
-
 	md5_starts(&ctx);
-
-
-	while ((i = (uint32)fread(buf, 1, readlen, f)) > 0) {
-		md5_update(&ctx, buf, i);
-
-		length -= i;
-		if (restricted && length == 0)
-			break;
-
-		if (restricted && sizeof(buf) > length)
-			readlen = length;
+	if (!readFileChunks(name, length, md5Chunk, &ctx)) {
+		printf("md5_file couldn't read '%s'\n", name);
+		return false;
 	}
-
 	md5_finish(&ctx, digest);
-	fclose(f);
 	return true;
 }
 
@@ -1,8 +1,17 @@
 MODULE := common
 
 MODULE_OBJS := \
+	compress.o \
+	endian.o \
+	fileread.o \
 	md5.o \
-	zlib.o
+	pattern.o \
+	stats.o \
+	stream.o \
+	xxhash.o \
+	xz.o \
+	zlib.o \
+	zstd.o
 
 # Include common rules
 include $(srcdir)/rules.mk
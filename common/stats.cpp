@@ -0,0 +1,203 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "common/stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef POSIX
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+namespace Common {
+
+bool g_statsEnabled = false;
+
+static const char *const phaseNames[kStatsNumPhases] = { "open", "index", "decode", "convert", "write" };
+
+struct PhaseStats {
+	uint64 calls;
+	uint64 wallNs;
+	uint64 cpuNs;
+};
+
+// Added to by every thread
+static PhaseStats phases[kStatsNumPhases];
+static uint64 bytesRead, bytesWritten, filesDone, allocations;
+
+static const char *toolName = "";
+static bool json = false;
+static uint64 startWall;
+
+// Without the GCC builtins counts from threads racing each other may be lost
+static inline void add(uint64 &counter, uint64 value) {
+#ifdef __GNUC__
+	__sync_fetch_and_add(&counter, value);
+#else
+	counter += value;
+#endif
+}
+
+uint64 statsWallTime() {
+#if defined(POSIX) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+#ifdef POSIX
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64)tv.tv_sec * 1000000000 + (uint64)tv.tv_usec * 1000;
+#else
+	return (uint64)time(NULL) * 1000000000;
+#endif
+}
+
+uint64 statsCpuTime() {
+#if defined(POSIX) && defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	// The whole process then, which overcounts phases run beside others
+	return (uint64)((double)clock() / CLOCKS_PER_SEC * 1e9);
+}
+
+void addStatsTime(StatsPhaseId phase, uint64 wallNs, uint64 cpuNs) {
+	add(phases[phase].calls, 1);
+	add(phases[phase].wallNs, wallNs);
+	add(phases[phase].cpuNs, cpuNs);
+}
+
+void addStatsRead(uint64 bytes) {
+	if (g_statsEnabled)
+		add(bytesRead, bytes);
+}
+
+void addStatsWritten(uint64 bytes) {
+	if (g_statsEnabled)
+		add(bytesWritten, bytes);
+}
+
+void addStatsFiles(uint32 count) {
+	if (g_statsEnabled)
+		add(filesDone, count);
+}
+
+// CPU time of all threads and the peak resident size in KB, 0 where unknown
+static void processUsage(double &cpu, uint64 &peakKb) {
+#ifdef POSIX
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+			(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+#ifdef __APPLE__
+		peakKb = usage.ru_maxrss / 1024;
+#else
+		peakKb = usage.ru_maxrss;
+#endif
+		return;
+	}
+#endif
+	cpu = (double)clock() / CLOCKS_PER_SEC;
+	peakKb = 0;
+}
+
+static void reportText(double wall, double cpu, uint64 peakKb) {
+	fprintf(stderr, "%s stats:\n", toolName);
+	fprintf(stderr, "%-10s %10s %12s %12s\n", "phase", "calls", "wall s", "cpu s");
+	for (int i = 0; i < kStatsNumPhases; i++) {
+		if (phases[i].calls)
+			fprintf(stderr, "%-10s %10lu %12.3f %12.3f\n", phaseNames[i], (unsigned long)phases[i].calls,
+				phases[i].wallNs / 1e9, phases[i].cpuNs / 1e9);
+	}
+	fprintf(stderr, "%-10s %10s %12.3f %12.3f\n", "total", "", wall, cpu);
+	fprintf(stderr, "read       %lu bytes (%.1f MB/s)\n", (unsigned long)bytesRead, wall > 0 ? bytesRead / wall / 1e6 : 0);
+	fprintf(stderr, "written    %lu bytes (%.1f MB/s)\n", (unsigned long)bytesWritten, wall > 0 ? bytesWritten / wall / 1e6 : 0);
+	fprintf(stderr, "files      %lu (%.1f/s)\n", (unsigned long)filesDone, wall > 0 ? filesDone / wall : 0);
+	fprintf(stderr, "allocs     %lu\n", (unsigned long)allocations);
+	fprintf(stderr, "peak RSS   %lu KB\n", (unsigned long)peakKb);
+}
+
+static void reportJson(double wall, double cpu, uint64 peakKb) {
+	fprintf(stderr, "{\"tool\":\"%s\",\"wall\":%.6f,\"cpu\":%.6f,\"phases\":{", toolName, wall, cpu);
+	bool first = true;
+	for (int i = 0; i < kStatsNumPhases; i++) {
+		if (!phases[i].calls)
+			continue;
+		fprintf(stderr, "%s\"%s\":{\"calls\":%lu,\"wall\":%.6f,\"cpu\":%.6f}", first ? "" : ",", phaseNames[i],
+			(unsigned long)phases[i].calls, phases[i].wallNs / 1e9, phases[i].cpuNs / 1e9);
+		first = false;
+	}
+	fprintf(stderr, "},\"bytes_read\":%lu,\"bytes_written\":%lu,\"files\":%lu,\"files_per_second\":%.3f,"
+		"\"allocations\":%lu,\"peak_rss_kb\":%lu}\n", (unsigned long)bytesRead, (unsigned long)bytesWritten,
+		(unsigned long)filesDone, wall > 0 ? filesDone / wall : 0, (unsigned long)allocations, (unsigned long)peakKb);
+}
+
+// At exit, so the tools which leave through exit() report too
+static void reportStats() {
+	double wall = (statsWallTime() - startWall) / 1e9, cpu;
+	uint64 peakKb;
+	processUsage(cpu, peakKb);
+	if (json)
+		reportJson(wall, cpu, peakKb);
+	else
+		reportText(wall, cpu, peakKb);
+}
+
+bool initStats(const char *tool, int &argc, char **argv) {
+	int out = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--stats") == 0) {
+			g_statsEnabled = true;
+		} else if (strcmp(argv[i], "--stats=json") == 0) {
+			g_statsEnabled = true;
+			json = true;
+		} else if (strcmp(argv[i], "--") == 0) {
+			// Everything past it is left alone
+			while (i < argc)
+				argv[out++] = argv[i++];
+		} else {
+			argv[out++] = argv[i];
+		}
+	}
+	argc = out;
+	argv[argc] = NULL;
+
+	if (g_statsEnabled && !startWall) {
+		toolName = tool;
+		startWall = statsWallTime();
+		atexit(reportStats);
+	}
+	return g_statsEnabled;
+}
+
+void addStatsAllocation() {
+	if (g_statsEnabled)
+		add(allocations, 1);
+}
+
+} // End of namespace Common
@@ -0,0 +1,88 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef COMMON_STATS_H
+#define COMMON_STATS_H
+
+#include "common/scummsys.h"
+
+namespace Common {
+
+/**
+ * What a tool spends its time on. Phases may nest, the time of an inner
+ * one counts for the outer one too, and the time of threads adds up.
+ */
+enum StatsPhaseId {
+	kStatsOpen,		// Opening and reading the input
+	kStatsIndex,	// Reading lab tables and building lookups
+	kStatsDecode,	// Decompressing and parsing game formats
+	kStatsConvert,	// Making the output from what was decoded
+	kStatsWrite,	// Writing the output
+	kStatsNumPhases
+};
+
+/**
+ * Takes --stats or --stats=json out of argv, before getopt sees it. Either
+ * makes the tool print, on stderr when it exits, its time and CPU time per
+ * phase, the bytes it read and wrote, the files it did, the allocations
+ * made with new, if it includes common/statsalloc.h, and its peak memory
+ * use. Returns whether that is on.
+ */
+bool initStats(const char *tool, int &argc, char **argv);
+
+extern bool g_statsEnabled;
+
+void addStatsTime(StatsPhaseId phase, uint64 wallNs, uint64 cpuNs);
+void addStatsRead(uint64 bytes);
+void addStatsWritten(uint64 bytes);
+void addStatsFiles(uint32 count = 1);
+/** Counted by the allocation functions of common/statsalloc.h */
+void addStatsAllocation();
+
+/** Monotonic time and CPU time of the calling thread, in nanoseconds */
+uint64 statsWallTime();
+uint64 statsCpuTime();
+
+/**
+ * Counts the time until it goes out of scope for the phase. It does
+ * nothing unless --stats was given.
+ */
+class StatsPhase {
+	StatsPhaseId _phase;
+	bool _enabled;
+	uint64 _wall, _cpu;
+public:
+	StatsPhase(StatsPhaseId phase) : _phase(phase), _enabled(g_statsEnabled), _wall(0), _cpu(0) {
+		if (_enabled) {
+			_wall = statsWallTime();
+			_cpu = statsCpuTime();
+		}
+	}
+	~StatsPhase() {
+		if (_enabled)
+			addStatsTime(_phase, statsWallTime() - _wall, statsCpuTime() - _cpu);
+	}
+};
+
+} // End of namespace Common
+
+#endif
@@ -0,0 +1,71 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef COMMON_STATSALLOC_H
+#define COMMON_STATSALLOC_H
+
+#include "common/stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+// Replaces the global allocation functions to count the allocations for
+// the --stats report. Only tools reporting them include this, in exactly
+// one file: their main one. C code, such as Lua and the decompressors,
+// allocates with malloc and isn't counted.
+#if __cplusplus < 201103L
+#define STATS_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define STATS_NOTHROW throw()
+#else
+#define STATS_THROW_BAD_ALLOC
+#define STATS_NOTHROW noexcept
+#endif
+
+// Built without exceptions, so running out of memory aborts
+static void *statsAlloc(size_t size) {
+	Common::addStatsAllocation();
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr) {
+		fprintf(stderr, "Out of memory allocating %lu bytes\n", (unsigned long)size);
+		abort();
+	}
+	return ptr;
+}
+
+void *operator new(size_t size) STATS_THROW_BAD_ALLOC {
+	return statsAlloc(size);
+}
+
+void *operator new[](size_t size) STATS_THROW_BAD_ALLOC {
+	return statsAlloc(size);
+}
+
+void operator delete(void *ptr) STATS_NOTHROW {
+	free(ptr);
+}
+
+void operator delete[](void *ptr) STATS_NOTHROW {
+	free(ptr);
+}
+
+#endif
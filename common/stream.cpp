@@ -0,0 +1,328 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/stream.h"
+#include "common/endian.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+byte ReadStream::readByte() {
+	byte b = 0;
+	read(&b, 1);
+	return b;
+}
+
+uint16 ReadStream::readUint16LE() {
+	byte b[2] = { 0, 0 };
+	read(b, 2);
+	return READ_LE_UINT16(b);
+}
+
+uint32 ReadStream::readUint32LE() {
+	byte b[4] = { 0, 0, 0, 0 };
+	read(b, 4);
+	return READ_LE_UINT32(b);
+}
+
+uint16 ReadStream::readUint16BE() {
+	byte b[2] = { 0, 0 };
+	read(b, 2);
+	return READ_BE_UINT16(b);
+}
+
+uint32 ReadStream::readUint32BE() {
+	byte b[4] = { 0, 0, 0, 0 };
+	read(b, 4);
+	return READ_BE_UINT32(b);
+}
+
+float ReadStream::readFloatLE() {
+	uint32 u = readUint32LE();
+	float f;
+	memcpy(&f, &u, 4);
+	return f;
+}
+
+uint32 ReadStream::readUint16LE(uint16 *dest, uint32 count) {
+	count = read(dest, count * 2) / 2;
+	FROM_LE_ARRAY_16(dest, count);
+	return count;
+}
+
+uint32 ReadStream::readUint32LE(uint32 *dest, uint32 count) {
+	count = read(dest, count * 4) / 4;
+	FROM_LE_ARRAY_32(dest, count);
+	return count;
+}
+
+uint32 ReadStream::readUint16BE(uint16 *dest, uint32 count) {
+	count = read(dest, count * 2) / 2;
+	FROM_BE_ARRAY_16(dest, count);
+	return count;
+}
+
+uint32 ReadStream::readUint32BE(uint32 *dest, uint32 count) {
+	count = read(dest, count * 4) / 4;
+	FROM_BE_ARRAY_32(dest, count);
+	return count;
+}
+
+uint32 ReadStream::readFloatLE(float *dest, uint32 count) {
+	// Floats are swapped as the integers of the same size
+	return readUint32LE((uint32 *)dest, count);
+}
+
+
+MemoryReadStream::MemoryReadStream(const byte *data, uint32 size, bool dispose)
+	: _data(data), _size(size), _pos(0), _eos(false), _dispose(dispose) {
+}
+
+MemoryReadStream::~MemoryReadStream() {
+	if (_dispose)
+		free(const_cast<byte *>(_data));
+}
+
+uint32 MemoryReadStream::read(void *dataPtr, uint32 dataSize) {
+	if (dataSize > _size - _pos) {
+		dataSize = _size - _pos;
+		_eos = true;
+	}
+	memcpy(dataPtr, _data + _pos, dataSize);
+	_pos += dataSize;
+	return dataSize;
+}
+
+bool MemoryReadStream::seek(int32 offset, std::ios::seekdir whence) {
+	int32 newPos = offset;
+	if (whence == std::ios::cur)
+		newPos += _pos;
+	else if (whence == std::ios::end)
+		newPos += _size;
+	if (newPos < 0 || (uint32)newPos > _size)
+		return false;
+	_pos = newPos;
+	_eos = false;
+	return true;
+}
+
+
+FileReadStream::FileReadStream(FILE *file, uint32 start, uint32 size, bool close)
+	: _file(file), _close(close), _start(start), _size(size), _pos(0), _eos(false), _err(false),
+	  _buf(new byte[BUFSIZE]), _bufPos(0), _bufLen(0) {
+}
+
+FileReadStream::~FileReadStream() {
+	delete[] _buf;
+	if (_close)
+		fclose(_file);
+}
+
+uint32 FileReadStream::readAt(uint32 offset, byte *dest, uint32 len) {
+	uint32 done = 0;
+#ifdef POSIX
+	int fd = fileno(_file);
+	while (done < len) {
+		ssize_t n = pread(fd, dest + done, len - done, (off_t)_start + offset + done);
+		if (n <= 0) {
+			if (n < 0)
+				_err = true;
+			break;
+		}
+		done += n;
+	}
+#else
+	if (fseek(_file, _start + offset, SEEK_SET) != 0) {
+		_err = true;
+		return 0;
+	}
+	done = fread(dest, 1, len, _file);
+	if (ferror(_file))
+		_err = true;
+#endif
+	return done;
+}
+
+uint32 FileReadStream::read(void *dataPtr, uint32 dataSize) {
+	byte *dest = (byte *)dataPtr;
+	uint32 total = 0;
+	if (dataSize > _size - _pos) {
+		dataSize = _size - _pos;
+		_eos = true;
+	}
+	while (dataSize > 0) {
+		if (_pos >= _bufPos && _pos < _bufPos + _bufLen) {
+			uint32 n = MIN(dataSize, _bufPos + _bufLen - _pos);
+			memcpy(dest, _buf + (_pos - _bufPos), n);
+			dest += n;
+			_pos += n;
+			total += n;
+			dataSize -= n;
+		} else if (dataSize >= BUFSIZE) {
+			// Large reads go straight to the caller
+			uint32 n = readAt(_pos, dest, dataSize);
+			_pos += n;
+			total += n;
+			if (n < dataSize)
+				_eos = true;
+			break;
+		} else {
+			_bufPos = _pos;
+			_bufLen = readAt(_pos, _buf, MIN((uint32)BUFSIZE, _size - _pos));
+			if (_bufLen == 0) {
+				_eos = true;
+				break;
+			}
+		}
+	}
+	return total;
+}
+
+bool FileReadStream::seek(int32 offset, std::ios::seekdir whence) {
+	int32 newPos = offset;
+	if (whence == std::ios::cur)
+		newPos += _pos;
+	else if (whence == std::ios::end)
+		newPos += _size;
+	if (newPos < 0 || (uint32)newPos > _size)
+		return false;
+	_pos = newPos;
+	_eos = false;
+	return true;
+}
+
+
+#ifdef POSIX
+/** A MemoryReadStream over a mapped file, unmapping it when done */
+class MappedReadStream : public MemoryReadStream {
+public:
+	MappedReadStream(const byte *data, uint32 size) : MemoryReadStream(data, size) {}
+	~MappedReadStream() {
+		munmap((void *)const_cast<byte *>(_data), _size);
+	}
+};
+#endif
+
+SeekableReadStream *openFileStream(const char *name) {
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return NULL;
+#ifdef POSIX
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+		if (map != MAP_FAILED) {
+			// The mapping stays valid after the file is closed
+			fclose(f);
+			return new MappedReadStream((const byte *)map, (uint32)st.st_size);
+		}
+	}
+#endif
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size < 0) {
+		fclose(f);
+		return NULL;
+	}
+	return new FileReadStream(f, 0, (uint32)size, true);
+}
+
+
+ReadStreamIStream::Buffer::Buffer(SeekableReadStream *stream) : _stream(stream), _base(0) {
+	const byte *data = stream->getData();
+	if (data) {
+		char *begin = (char *)const_cast<byte *>(data);
+		setg(begin, begin + stream->pos(), begin + stream->size());
+	} else {
+		_base = stream->pos();
+		setg(_buf, _buf, _buf);
+	}
+}
+
+ReadStreamIStream::Buffer::~Buffer() {
+	delete _stream;
+}
+
+ReadStreamIStream::Buffer::int_type ReadStreamIStream::Buffer::underflow() {
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+	if (_stream->getData())
+		return traits_type::eof();
+	_base = _stream->pos();
+	uint32 n = _stream->read(_buf, sizeof(_buf));
+	setg(_buf, _buf, _buf + n);
+	return n ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+}
+
+std::streamsize ReadStreamIStream::Buffer::xsgetn(char *s, std::streamsize n) {
+	std::streamsize done = MIN((std::streamsize)(egptr() - gptr()), n);
+	memcpy(s, gptr(), done);
+	gbump(done);
+	if (done < n && !_stream->getData()) {
+		// Bulk reads skip the buffer
+		done += _stream->read(s + done, n - done);
+		_base = _stream->pos();
+		setg(_buf, _buf, _buf);
+	}
+	return done;
+}
+
+ReadStreamIStream::Buffer::pos_type ReadStreamIStream::Buffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	int32 current;
+	if (_stream->getData())
+		current = gptr() - eback();
+	else
+		current = _base + (gptr() - eback());
+	int32 target = off;
+	if (dir == std::ios_base::cur)
+		target += current;
+	else if (dir == std::ios_base::end)
+		target += _stream->size();
+	if (target < 0 || target > _stream->size())
+		return pos_type(off_type(-1));
+	if (_stream->getData()) {
+		setg(eback(), eback() + target, egptr());
+	} else if (target >= _base && target <= _base + (egptr() - eback())) {
+		setg(eback(), eback() + (target - _base), egptr());
+	} else {
+		_stream->seek(target);
+		_base = target;
+		setg(_buf, _buf, _buf);
+	}
+	return pos_type(target);
+}
+
+ReadStreamIStream::Buffer::pos_type ReadStreamIStream::Buffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+ReadStreamIStream::ReadStreamIStream(SeekableReadStream *stream) : std::istream(0), _buf(stream) {
+	rdbuf(&_buf);
+}
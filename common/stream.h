@@ -0,0 +1,166 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_STREAM_H
+#define COMMON_STREAM_H
+
+#include "common/scummsys.h"
+
+#include <cstdio>
+#include <istream>
+#include <streambuf>
+
+/**
+ * A source of bytes read in order. Besides read(), it offers the integers
+ * of the game files in either byte order, one at a time or in bulk.
+ */
+class ReadStream {
+public:
+	virtual ~ReadStream() {}
+	virtual bool err() const = 0;
+	virtual bool eos() const = 0;
+	virtual uint32 read(void *dataPtr, uint32 dataSize) = 0;
+
+	byte readByte();
+	uint16 readUint16LE();
+	uint32 readUint32LE();
+	uint16 readUint16BE();
+	uint32 readUint32BE();
+	int16 readSint16LE() { return (int16)readUint16LE(); }
+	int32 readSint32LE() { return (int32)readUint32LE(); }
+	int16 readSint16BE() { return (int16)readUint16BE(); }
+	int32 readSint32BE() { return (int32)readUint32BE(); }
+	float readFloatLE();
+
+	/**
+	 * Reads count values straight into dest and converts them in place.
+	 * Returns how many whole values were read.
+	 */
+	uint32 readUint16LE(uint16 *dest, uint32 count);
+	uint32 readUint32LE(uint32 *dest, uint32 count);
+	uint32 readUint16BE(uint16 *dest, uint32 count);
+	uint32 readUint32BE(uint32 *dest, uint32 count);
+	uint32 readFloatLE(float *dest, uint32 count);
+};
+
+/** A stream of known size which can be repositioned */
+class SeekableReadStream : public ReadStream {
+public:
+	virtual int32 pos() const = 0;
+	virtual int32 size() const = 0;
+	virtual bool seek(int32 offset, std::ios::seekdir whence = std::ios::beg) = 0;
+
+	/**
+	 * The whole stream when it is held in memory in one piece, NULL
+	 * otherwise. Decoders can parse it in place instead of reading it.
+	 */
+	virtual const byte *getData() const { return NULL; }
+};
+
+/** Reads data held in memory, by default without taking ownership */
+class MemoryReadStream : public SeekableReadStream {
+protected:
+	const byte *_data;
+	uint32 _size;
+	uint32 _pos;
+	bool _eos;
+	bool _dispose;	// free() the data on destruction
+
+public:
+	MemoryReadStream(const byte *data, uint32 size, bool dispose = false);
+	~MemoryReadStream();
+
+	bool err() const { return false; }
+	bool eos() const { return _eos; }
+	uint32 read(void *dataPtr, uint32 dataSize);
+
+	int32 pos() const { return _pos; }
+	int32 size() const { return _size; }
+	bool seek(int32 offset, std::ios::seekdir whence = std::ios::beg);
+	const byte *getData() const { return _data; }
+};
+
+/**
+ * Reads a range of an open file. On POSIX systems it reads with pread(),
+ * so any number of streams can share the file without disturbing each
+ * other or the file position. Small reads are served from a buffer.
+ */
+class FileReadStream : public SeekableReadStream {
+public:
+	enum {
+		BUFSIZE = 65536
+	};
+
+protected:
+	FILE *_file;
+	bool _close;	// fclose() the file on destruction
+	uint32 _start, _size;
+	uint32 _pos;
+	bool _eos, _err;
+	byte *_buf;
+	uint32 _bufPos, _bufLen;	// The buffer holds [_bufPos, _bufPos + _bufLen)
+
+	uint32 readAt(uint32 offset, byte *dest, uint32 len);
+
+public:
+	FileReadStream(FILE *file, uint32 start, uint32 size, bool close = false);
+	~FileReadStream();
+
+	bool err() const { return _err; }
+	bool eos() const { return _eos; }
+	uint32 read(void *dataPtr, uint32 dataSize);
+
+	int32 pos() const { return _pos; }
+	int32 size() const { return _size; }
+	bool seek(int32 offset, std::ios::seekdir whence = std::ios::beg);
+};
+
+/**
+ * Opens a whole file for reading, mapped into memory where possible and
+ * read with a FileReadStream otherwise. NULL if it can't be opened.
+ */
+SeekableReadStream *openFileStream(const char *name);
+
+/**
+ * A std::istream for the readers that want one, over a seekable stream it
+ * takes ownership of. Streams held in memory are read in place.
+ */
+class ReadStreamIStream : public std::istream {
+	class Buffer : public std::streambuf {
+		SeekableReadStream *_stream;
+		char _buf[4096];
+		int32 _base;	// Position in the stream of the start of the buffer
+	public:
+		Buffer(SeekableReadStream *stream);
+		~Buffer();
+	protected:
+		int_type underflow();
+		std::streamsize xsgetn(char *s, std::streamsize n);
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+	};
+	Buffer _buf;
+public:
+	ReadStreamIStream(SeekableReadStream *stream);
+};
+
+#endif
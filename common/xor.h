@@ -0,0 +1,68 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_XOR_H
+#define COMMON_XOR_H
+
+#include "common/scummsys.h"
+
+#include <string.h>
+
+namespace Common {
+
+/**
+ * Byte loops over patch data, a machine word at a time. The words are
+ * moved with memcpy so the buffers need no alignment, and the compiler is
+ * free to vectorize the main loops.
+ */
+
+/** dest[i] ^= src[i] for len bytes */
+inline void xorBuffer(uint8 *dest, const uint8 *src, uint32 len) {
+	uint32 i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64 a, b;
+		memcpy(&a, dest + i, 8);
+		memcpy(&b, src + i, 8);
+		a ^= b;
+		memcpy(dest + i, &a, 8);
+	}
+	for (; i < len; i++)
+		dest[i] ^= src[i];
+}
+
+/** dest[i] = a[i] ^ b[i] for len bytes */
+inline void xorBuffers(uint8 *dest, const uint8 *a, const uint8 *b, uint32 len) {
+	uint32 i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64 x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		x ^= y;
+		memcpy(dest + i, &x, 8);
+	}
+	for (; i < len; i++)
+		dest[i] = a[i] ^ b[i];
+}
+
+} // End of namespace Common
+
+#endif
@@ -0,0 +1,158 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/xxhash.h"
+#include "common/fileread.h"
+#include "common/endian.h"
+
+#include <string.h>
+
+namespace Common {
+
+// 64-bit constants from two halves, uint64 may be long long
+#define U64(hi, lo) (((uint64)(hi) << 32) | (uint64)(lo))
+
+static const uint64 PRIME1 = U64(0x9E3779B1, 0x85EBCA87);
+static const uint64 PRIME2 = U64(0xC2B2AE3D, 0x27D4EB4F);
+static const uint64 PRIME3 = U64(0x165667B1, 0x9E3779F9);
+static const uint64 PRIME4 = U64(0x85EBCA77, 0xC2B2AE63);
+static const uint64 PRIME5 = U64(0x27D4EB2F, 0x165667C5);
+
+static inline uint64 rotl(uint64 x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 read64(const uint8 *p) {
+	return (uint64)READ_LE_UINT32(p) | ((uint64)READ_LE_UINT32(p + 4) << 32);
+}
+
+static inline uint64 xxhRound(uint64 acc, uint64 input) {
+	acc += input * PRIME2;
+	return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64 mergeRound(uint64 acc, uint64 val) {
+	acc ^= xxhRound(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+void xxh64_starts(xxh64_context *ctx, uint64 seed) {
+	ctx->total = 0;
+	ctx->v[0] = seed + PRIME1 + PRIME2;
+	ctx->v[1] = seed + PRIME2;
+	ctx->v[2] = seed;
+	ctx->v[3] = seed - PRIME1;
+	ctx->memsize = 0;
+}
+
+void xxh64_update(xxh64_context *ctx, const uint8 *input, uint32 length) {
+	ctx->total += length;
+
+	// Top up a partial stripe first
+	if (ctx->memsize + length < 32) {
+		memcpy(ctx->mem + ctx->memsize, input, length);
+		ctx->memsize += length;
+		return;
+	}
+	if (ctx->memsize) {
+		uint32 fill = 32 - ctx->memsize;
+		memcpy(ctx->mem + ctx->memsize, input, fill);
+		for (int i = 0; i < 4; i++)
+			ctx->v[i] = xxhRound(ctx->v[i], read64(ctx->mem + 8 * i));
+		input += fill;
+		length -= fill;
+		ctx->memsize = 0;
+	}
+
+	uint64 v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+	for (; length >= 32; input += 32, length -= 32) {
+		v0 = xxhRound(v0, read64(input));
+		v1 = xxhRound(v1, read64(input + 8));
+		v2 = xxhRound(v2, read64(input + 16));
+		v3 = xxhRound(v3, read64(input + 24));
+	}
+	ctx->v[0] = v0;
+	ctx->v[1] = v1;
+	ctx->v[2] = v2;
+	ctx->v[3] = v3;
+
+	memcpy(ctx->mem, input, length);
+	ctx->memsize = length;
+}
+
+uint64 xxh64_finish(const xxh64_context *ctx) {
+	uint64 h;
+	if (ctx->total >= 32) {
+		h = rotl(ctx->v[0], 1) + rotl(ctx->v[1], 7) + rotl(ctx->v[2], 12) + rotl(ctx->v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = mergeRound(h, ctx->v[i]);
+	} else {
+		h = ctx->v[2] + PRIME5;	// v[2] holds the seed
+	}
+	h += ctx->total;
+
+	const uint8 *p = ctx->mem;
+	uint32 left = ctx->memsize;
+	for (; left >= 8; p += 8, left -= 8) {
+		h ^= xxhRound(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if (left >= 4) {
+		h ^= (uint64)READ_LE_UINT32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; p++, left--) {
+		h ^= *p * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64 xxh64(const uint8 *input, uint32 length, uint64 seed) {
+	xxh64_context ctx;
+	xxh64_starts(&ctx, seed);
+	xxh64_update(&ctx, input, length);
+	return xxh64_finish(&ctx);
+}
+
+static void hashChunk(void *ctx, const uint8 *data, uint32 size) {
+	xxh64_update((xxh64_context *)ctx, data, size);
+}
+
+bool xxh64_file(const char *name, uint64 &hash, uint32 length) {
+	xxh64_context ctx;
+	xxh64_starts(&ctx);
+	if (!readFileChunks(name, length, hashChunk, &ctx))
+		return false;
+	hash = xxh64_finish(&ctx);
+	return true;
+}
+
+} // End of namespace Common
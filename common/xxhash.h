@@ -0,0 +1,50 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_XXHASH_H
+#define COMMON_XXHASH_H
+
+#include "common/scummsys.h"
+
+namespace Common {
+
+/**
+ * XXH64, a fast non-cryptographic hash. Good for telling files apart at
+ * disk speed, not for anything that has to stand up to tampering.
+ */
+typedef struct {
+	uint64 total;
+	uint64 v[4];
+	uint8 mem[32];
+	uint32 memsize;
+} xxh64_context;
+
+void xxh64_starts(xxh64_context *ctx, uint64 seed = 0);
+void xxh64_update(xxh64_context *ctx, const uint8 *input, uint32 length);
+uint64 xxh64_finish(const xxh64_context *ctx);
+
+uint64 xxh64(const uint8 *input, uint32 length, uint64 seed = 0);
+bool xxh64_file(const char *name, uint64 &hash, uint32 length = 0);
+
+} // End of namespace Common
+
+#endif
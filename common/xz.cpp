@@ -0,0 +1,121 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/xz.h"
+
+#if defined(USE_LZMA)
+
+#include <assert.h>
+#include <string.h>
+
+XzReadStream::XzReadStream(const byte *data, uint32 size) {
+	lzma_stream init = LZMA_STREAM_INIT;
+	_stream = init;
+	_lzmaErr = lzma_stream_decoder(&_stream, ~(uint64_t)0, 0);
+	_stream.next_in = data;
+	_stream.avail_in = size;
+}
+
+XzReadStream::~XzReadStream() {
+	lzma_end(&_stream);
+}
+
+bool XzReadStream::err() const {
+	return _lzmaErr != LZMA_OK && _lzmaErr != LZMA_STREAM_END;
+}
+
+bool XzReadStream::eos() const {
+	return _lzmaErr == LZMA_STREAM_END;
+}
+
+uint32 XzReadStream::read(void *dataPtr, uint32 dataSize) {
+	_stream.next_out = (uint8_t *)dataPtr;
+	_stream.avail_out = dataSize;
+
+	// All of the input is there, so anything short of a full read is
+	// the end of the stream or an error
+	while (_stream.avail_out > 0 && _lzmaErr == LZMA_OK)
+		_lzmaErr = lzma_code(&_stream, LZMA_FINISH);
+
+	return dataSize - _stream.avail_out;
+}
+
+XzWriteStream::XzWriteStream(std::ofstream *w, uint32 preset, uint32 bufSize)
+	: _bufSize(bufSize), _wrapped(w), _finalized(false) {
+	assert(w != 0);
+	assert(bufSize > 0);
+	_buf = new byte[_bufSize];
+	lzma_stream init = LZMA_STREAM_INIT;
+	_stream = init;
+	_lzmaErr = lzma_easy_encoder(&_stream, preset, LZMA_CHECK_CRC32);
+	assert(_lzmaErr == LZMA_OK);
+
+	_stream.next_out = _buf;
+	_stream.avail_out = _bufSize;
+}
+
+XzWriteStream::~XzWriteStream() {
+	finalize();
+	lzma_end(&_stream);
+	delete[] _buf;
+}
+
+bool XzWriteStream::err() const {
+	return (_lzmaErr != LZMA_OK && _lzmaErr != LZMA_STREAM_END) || _wrapped->bad();
+}
+
+void XzWriteStream::processData(lzma_action action) {
+	while (_lzmaErr == LZMA_OK && (_stream.avail_in > 0 || action == LZMA_FINISH)) {
+		_lzmaErr = lzma_code(&_stream, action);
+		if (_stream.avail_out == 0 || (_lzmaErr == LZMA_STREAM_END && _stream.avail_out < _bufSize)) {
+			_wrapped->write((char *)_buf, _bufSize - _stream.avail_out);
+			if (_wrapped->bad())
+				_lzmaErr = LZMA_PROG_ERROR;
+			_stream.next_out = _buf;
+			_stream.avail_out = _bufSize;
+		}
+	}
+}
+
+void XzWriteStream::finalize() {
+	if (_finalized || _lzmaErr != LZMA_OK)
+		return;
+	_finalized = true;
+
+	_stream.next_in = NULL;
+	_stream.avail_in = 0;
+	processData(LZMA_FINISH);
+	_wrapped->flush();
+}
+
+uint32 XzWriteStream::write(const void *dataPtr, uint32 dataSize) {
+	if (err() || _finalized)
+		return 0;
+
+	_stream.next_in = (const uint8_t *)dataPtr;
+	_stream.avail_in = dataSize;
+	processData(LZMA_RUN);
+
+	return dataSize - _stream.avail_in;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_XZ_H
+#define COMMON_XZ_H
+
+#include "common/scummsys.h"
+
+#if defined(USE_LZMA)
+
+#include "common/compress.h"
+
+#include <lzma.h>
+
+/**
+ * Decompresses an xz stream held in memory, such as a range of a mapped
+ * patch. The whole input is handed to liblzma at once.
+ */
+class XzReadStream : public DecompressStream {
+	lzma_stream _stream;
+	lzma_ret _lzmaErr;
+
+public:
+	XzReadStream(const byte *data, uint32 size);
+	~XzReadStream();
+
+	bool err() const;
+	bool eos() const;
+	uint32 read(void *dataPtr, uint32 dataSize);
+};
+
+/**
+ * Compresses into an xz stream written to a wrapped std::ofstream. Slow
+ * to write but gives the smallest patches.
+ */
+class XzWriteStream : public CompressStream {
+public:
+	enum {
+		BUFSIZE = 16384
+	};
+
+private:
+	byte *_buf;
+	uint32 _bufSize;
+	std::ofstream *_wrapped;
+	lzma_stream _stream;
+	lzma_ret _lzmaErr;
+	bool _finalized;
+
+	void processData(lzma_action action);
+
+public:
+	XzWriteStream(std::ofstream *w, uint32 preset = 6, uint32 bufSize = BUFSIZE);
+	~XzWriteStream();
+
+	bool err() const;
+	void finalize();
+	uint32 write(const void *dataPtr, uint32 dataSize);
+};
+
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <string.h>
 
 #include "common/scummsys.h"
 #include "common/endian.h"
@@ -32,29 +33,51 @@
 
 #if defined(USE_ZLIB)
 
-GZipReadStream::GZipReadStream(std::ifstream *w, uint32 start, uint32 size_p) : _wrapped(w), _stream(), _start(start), _size(size_p) {
-	char buf[4];
+GZipReadStream::GZipReadStream(SeekableReadStream *w, uint32 start, uint32 size_p) : _wrapped(w), _data(0), _stream(), _start(start), _size(size_p) {
+	byte buf[2];
+	byte trailer[4];
 	assert(w != 0);
 
+	if (w->getData() && _size >= 2 && _start + _size <= (uint32)w->size()) {
+		// Held in memory, inflate it in place
+		_data = w->getData() + _start;
+		_wrapped = 0;
+		init(READ_BE_UINT16(_data), _size >= 4 ? _data + _size - 4 : 0);
+		return;
+	}
+
 	// Verify file header is correct
-	w->seekg(_start, std::ios::beg);
+	w->seek(_start);
 	w->read(buf, 2);
 	uint16 header = READ_BE_UINT16(buf);
-	assert(header == 0x1F8B ||
-			((header & 0x0F00) == 0x0800 && header % 31 == 0));
 
 	if (header == 0x1F8B && _size > 0) {
 		// Retrieve the original file size
-		w->seekg(_start + _size - 4, std::ios::beg);
-		w->read(buf, 4);
-		_origSize = READ_LE_UINT32(buf);
+		w->seek(_start + _size - 4);
+		w->read(trailer, 4);
+	}
+	w->seek(_start);
+	init(header, trailer);
+}
+
+GZipReadStream::GZipReadStream(const byte *data, uint32 size_p) : _wrapped(0), _data(data), _stream(), _start(0), _size(size_p) {
+	assert(data != 0 && _size >= 2);
+	init(READ_BE_UINT16(data), _size >= 4 ? data + _size - 4 : 0);
+}
+
+void GZipReadStream::init(uint16 header, const byte *trailer) {
+	assert(header == 0x1F8B ||
+			((header & 0x0F00) == 0x0800 && header % 31 == 0));
+
+	if (header == 0x1F8B && _size > 0 && trailer) {
+		_origSize = READ_LE_UINT32(trailer);
 	} else {
 		// Original size not available in zlib format
 		_origSize = 0;
 	}
 	_pos = 0;
-	w->seekg(_start, std::ios::beg);
 	_eos = false;
+	_raw = false;
 
 	// Adding 32 to windowBits indicates to zlib that it is supposed to
 	// automatically detect whether gzip or zlib headers are used for
@@ -65,13 +88,167 @@ GZipReadStream::GZipReadStream(std::ifstream *w, uint32 start, uint32 size_p) :
 	if (_zlibErr != Z_OK)
 		return;
 
-	// Setup input buffer
-	_stream.next_in = _buf;
-	_stream.avail_in = 0;
+	rewind();
+}
+
+void GZipReadStream::rewind() {
+	// Setup input buffer, in memory all of the data is input right away
+	if (_data) {
+		_stream.next_in = const_cast<byte *>(_data);
+		_stream.avail_in = _size;
+	} else {
+		_stream.next_in = _buf;
+		_stream.avail_in = 0;
+	}
 }
 
 GZipReadStream::~GZipReadStream() {
 	inflateEnd(&_stream);
+	freeIndex();
+}
+
+// Reads the next input from the wrapped stream into _buf, not past _size
+uint32 GZipReadStream::fill() {
+	uint32 len = BUFSIZE;
+	if (_size > 0) {
+		uint32 end = _start + _size, at = _wrapped->pos();
+		len = at < end ? MIN(len, end - at) : 0;
+	}
+	return len ? _wrapped->read(_buf, len) : 0;
+}
+
+void GZipReadStream::freeIndex() {
+	for (size_t i = 0; i < _index.size(); i++)
+		delete[] _index[i].window;
+	_index.clear();
+}
+
+bool GZipReadStream::restart() {
+	// Back to the start of the stream, with its header
+	if (_raw) {
+		inflateEnd(&_stream);
+		_zlibErr = inflateInit2(&_stream, MAX_WBITS + 32);
+		_raw = false;
+	} else
+		_zlibErr = inflateReset(&_stream);
+	if (_zlibErr != Z_OK)
+		return false;
+
+	_pos = 0;
+	if (_wrapped)
+		_wrapped->seek(_start);
+	rewind();
+	return true;
+}
+
+bool GZipReadStream::resume(const AccessPoint &point) {
+	// Blocks are raw deflate data, whatever the stream header was
+	inflateEnd(&_stream);
+	_zlibErr = inflateInit2(&_stream, -MAX_WBITS);
+	_raw = true;
+	if (_zlibErr != Z_OK)
+		return false;
+
+	byte prev = 0;
+	if (_data) {
+		if (point.bits)
+			prev = _data[point.in - 1];
+		_stream.next_in = const_cast<byte *>(_data) + point.in;
+		_stream.avail_in = _size - point.in;
+	} else {
+		_wrapped->seek(_start + point.in - (point.bits ? 1 : 0));
+		if (point.bits)
+			_wrapped->read(&prev, 1);
+		_stream.next_in = _buf;
+		_stream.avail_in = 0;
+	}
+
+	// A block starting inside a byte needs the bits before it
+	if (point.bits)
+		_zlibErr = inflatePrime(&_stream, point.bits, prev >> (8 - point.bits));
+	if (_zlibErr == Z_OK)
+		_zlibErr = inflateSetDictionary(&_stream, point.window, WINSIZE);
+	if (_zlibErr != Z_OK)
+		return false;
+
+	_pos = point.out;
+	_eos = false;
+	return true;
+}
+
+bool GZipReadStream::buildIndex(uint32 spacing) {
+	if (err())
+		return false;
+	freeIndex();
+
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, MAX_WBITS + 32) != Z_OK)
+		return false;
+
+	if (_data) {
+		strm.next_in = const_cast<byte *>(_data);
+		strm.avail_in = _size;
+	} else
+		_wrapped->seek(_start);
+
+	// The window is inflated into over and over, it holds the last WINSIZE
+	// bytes of output at any block boundary
+	byte *window = new byte[WINSIZE];
+	uint32 totalIn = 0, totalOut = 0, last = 0;
+	int ret = Z_OK;
+	strm.avail_out = 0;
+	while (ret == Z_OK) {
+		if (strm.avail_in == 0 && !_data) {
+			strm.next_in = _buf;
+			strm.avail_in = fill();
+			if (strm.avail_in == 0) {
+				ret = Z_DATA_ERROR;	// Truncated stream
+				break;
+			}
+		}
+		if (strm.avail_out == 0) {
+			strm.next_out = window;
+			strm.avail_out = WINSIZE;
+		}
+
+		totalIn += strm.avail_in;
+		totalOut += strm.avail_out;
+		ret = inflate(&strm, Z_BLOCK);
+		totalIn -= strm.avail_in;
+		totalOut -= strm.avail_out;
+		if (ret == Z_NEED_DICT)
+			ret = Z_DATA_ERROR;
+		else if (ret == Z_BUF_ERROR)
+			ret = (_data && strm.avail_in == 0) ? Z_DATA_ERROR : Z_OK;	// Truncated in memory
+
+		// At the end of a block that is not the last one, with a full
+		// window of output behind it
+		if (ret == Z_OK && (strm.data_type & 128) && !(strm.data_type & 64) &&
+		        totalOut >= WINSIZE && totalOut - last >= spacing) {
+			AccessPoint point;
+			point.out = totalOut;
+			point.in = totalIn;
+			point.bits = strm.data_type & 7;
+			point.window = new byte[WINSIZE];
+			uint32 left = strm.avail_out;
+			memcpy(point.window, window + WINSIZE - left, left);
+			memcpy(point.window + left, window, WINSIZE - left);
+			_index.push_back(point);
+			last = totalOut;
+		}
+	}
+	inflateEnd(&strm);
+	delete[] window;
+
+	if (ret != Z_STREAM_END) {
+		freeIndex();
+		restart();
+		return false;
+	}
+	if (_origSize == 0)
+		_origSize = totalOut;	// Now known for zlib streams too
+	return restart();
 }
 
 bool GZipReadStream::err() const { return (_zlibErr != Z_OK) && (_zlibErr != Z_STREAM_END); }
@@ -86,11 +263,10 @@ uint32 GZipReadStream::read(void *dataPtr, uint32 dataSize) {
 
 	// Keep going while we get no error
 	while (_zlibErr == Z_OK && _stream.avail_out) {
-		if (_stream.avail_in == 0 && !_wrapped->eof()) {
+		if (_stream.avail_in == 0 && _wrapped && !_wrapped->eos()) {
 			// If we are out of input data: Read more data, if available.
-			_wrapped->read((char*)_buf, BUFSIZE);
 			_stream.next_in = _buf;
-			_stream.avail_in = _wrapped->gcount();
+			_stream.avail_in = fill();
 		}
 		_zlibErr = inflate(&_stream, Z_NO_FLUSH);
 	}
@@ -125,34 +301,46 @@ bool GZipReadStream::seek(int32 offset, std::ios::seekdir whence) {
 		break;
 	case std::ios::cur:
 		newPos = _pos + offset;
+		break;
 	default:
 		assert(false);
 	}
 
 	assert(newPos >= 0);
 
-	if ((uint32)newPos < _pos) {
+	// The last access point at or before the new position
+	const AccessPoint *point = NULL;
+	for (size_t lo = 0, hi = _index.size(); lo < hi; ) {
+		size_t mid = (lo + hi) / 2;
+		if (_index[mid].out <= (uint32)newPos) {
+			point = &_index[mid];
+			lo = mid + 1;
+		} else
+			hi = mid;
+	}
+
+	if (point && (point->out > _pos || (uint32)newPos < _pos)) {
+		// Resume from the access point, if it is ahead of us or we are
+		// going back
+		if (!resume(*point))
+			return false;
+	} else if ((uint32)newPos < _pos) {
 		// To search backward, we have to restart the whole decompression
 		// from the start of the file. A rather wasteful operation, best
 		// to avoid it. :/
 #if DEBUG
 		warning("Backward seeking in GZipReadStream detected");
 #endif
-		_pos = 0;
-		_wrapped->seekg(_start, std::ios_base::beg);
-		_zlibErr = inflateReset(&_stream);
-		if (_zlibErr != Z_OK)
+		if (!restart())
 			return false;	// FIXME: STREAM REWRITE
-		_stream.next_in = _buf;
-		_stream.avail_in = 0;
 	}
 
 	offset = newPos - _pos;
 
 	// Skip the given amount of data (very inefficient if one tries to skip
-	// huge amounts of data, but usually client code will only skip a few
-	// bytes, so this should be fine.
-	byte tmpBuf[1024];
+	// huge amounts of data without an index, but usually client code will
+	// only skip a few bytes, so this should be fine.
+	byte tmpBuf[4096];
 	while (!err() && offset > 0) {
 		offset -= read(tmpBuf, MIN((int32)sizeof(tmpBuf), offset));
 	}
@@ -165,36 +353,39 @@ void GZipWriteStream::processData(int flushType) {
 	// This function is called by both write() and finalize().
 	while (_zlibErr == Z_OK && (_stream.avail_in || flushType == Z_FINISH)) {
 		if (_stream.avail_out == 0) {
-			_wrapped->write((char*)_buf, BUFSIZE);
+			_wrapped->write((char*)_buf, _bufSize);
 			if (_wrapped->bad()) {
 				_zlibErr = Z_ERRNO;
 				break;
 			}
 
 			_stream.next_out = _buf;
-			_stream.avail_out = BUFSIZE;
+			_stream.avail_out = _bufSize;
 		}
 		_zlibErr = deflate(&_stream, flushType);
 	}
 }
 
-GZipWriteStream::GZipWriteStream(std::ofstream *w) : _wrapped(w), _stream() {
+GZipWriteStream::GZipWriteStream(std::ofstream *w, int level, int strategy, uint32 bufSize)
+	: _bufSize(bufSize), _wrapped(w), _stream() {
 	assert(w != 0);
+	assert(bufSize > 0);
+	_buf = new byte[_bufSize];
 
 	// Adding 16 to windowBits indicates to zlib that it is supposed to
 	// write gzip headers. This feature was added in zlib 1.2.0.4,
 	// released 10 August 2003.
 	// Note: This is *crucial* for savegame compatibility, do *not* remove!
 	_zlibErr = deflateInit2(&_stream,
-						Z_DEFAULT_COMPRESSION,
+						level,
 						Z_DEFLATED,
 						MAX_WBITS + 16,
 						8,
-				Z_DEFAULT_STRATEGY);
+				strategy);
 	assert(_zlibErr == Z_OK);
 
 	_stream.next_out = _buf;
-	_stream.avail_out = BUFSIZE;
+	_stream.avail_out = _bufSize;
 	_stream.avail_in = 0;
 	_stream.next_in = 0;
 }
@@ -202,6 +393,7 @@ GZipWriteStream::GZipWriteStream(std::ofstream *w) : _wrapped(w), _stream() {
 GZipWriteStream::~GZipWriteStream() {
 	finalize();
 	deflateEnd(&_stream);
+	delete[] _buf;
 }
 
 bool GZipWriteStream::err() const {
@@ -216,9 +408,9 @@ void GZipWriteStream::finalize() {
 	// Process whatever remaining data there is.
 	processData(Z_FINISH);
 
-	// Since processData only writes out blocks of size BUFSIZE,
+	// Since processData only writes out blocks of size _bufSize,
 	// we may have to flush some stragglers.
-	uint remainder = BUFSIZE - _stream.avail_out;
+	uint remainder = _bufSize - _stream.avail_out;
 	if (remainder > 0) {
 		_wrapped->write((char*)_buf, remainder);
 		if (_wrapped->bad())
@@ -25,6 +25,10 @@
 #define COMMON_ZLIB_H
 
 #if defined(USE_ZLIB)
+  #include "common/compress.h"
+
+  #include <vector>
+
   #ifdef __SYMBIAN32__
     #include <zlib\zlib.h>
   #else
@@ -36,28 +40,56 @@
   #endif
 
 /**
- * A simple wrapper class which can be used to wrap around an arbitrary
- * other std::ifstream and will then provide on-the-fly decompression support.
- * Assumes the compressed data to be in gzip format.
+ * A simple wrapper class which can be used to wrap around a range of an
+ * arbitrary other SeekableReadStream and will then provide on-the-fly
+ * decompression support. Assumes the compressed data to be in gzip format.
+ *
+ * It can also inflate straight from compressed data in memory, such as a
+ * mapped file, without copying it or touching a file position. Wrapped
+ * streams held in memory are inflated that way too.
+ *
+ * Seeking inflates from the start to the new position, unless an index of
+ * access points has been built with buildIndex(). Seeks then resume from
+ * the nearest access point before the new position.
  */
-class GZipReadStream {
+class GZipReadStream : public SeekableReadStream {
 protected:
 	enum {
-		BUFSIZE = 16384		// 1 << MAX_WBITS
+		BUFSIZE = 16384,	// 1 << MAX_WBITS
+		WINSIZE = 32768		// Size of the inflate window
+	};
+
+	// A point deflate blocks can be resumed from, see buildIndex()
+	struct AccessPoint {
+		uint32 out;		// Position in the inflated data
+		uint32 in;		// Offset of the block in the compressed data
+		int bits;		// Bits of the byte before in the block starts at
+		byte *window;	// The WINSIZE bytes of output before out
 	};
 
 	byte	_buf[BUFSIZE];
 
-	std::ifstream *_wrapped;
+	SeekableReadStream *_wrapped;
+	const byte *_data;
 	z_stream _stream;
 	int _zlibErr;
 	uint32 _pos;
 	uint32 _origSize;
 	bool _eos;
 	uint32 _start, _size;
+	bool _raw;		// Inflating raw deflate data, after resuming from an access point
+	std::vector<AccessPoint> _index;
+
+	void init(uint16 header, const byte *trailer);
+	void rewind();
+	bool restart();
+	bool resume(const AccessPoint &point);
+	void freeIndex();
+	uint32 fill();
 
 public:
-	GZipReadStream(std::ifstream *w, uint32 start, uint32 size = 0);
+	GZipReadStream(SeekableReadStream *w, uint32 start, uint32 size = 0);
+	GZipReadStream(const byte *data, uint32 size);
 	~GZipReadStream();
 	bool err() const;
 	void clearErr();
@@ -68,20 +100,33 @@ public:
 	int32 pos() const;
 	int32 size() const;
 	bool seek(int32 offset, std::ios::seekdir whence = std::ios::beg);
+
+	/**
+	 * Inflates the whole stream once, saving an access point about every
+	 * spacing bytes of inflated data. Each costs WINSIZE bytes of memory.
+	 * The stream is back at position 0 afterwards.
+	 */
+	bool buildIndex(uint32 spacing = 1024 * 1024);
 };
 
 /**
  * A simple wrapper class which can be used to wrap around an arbitrary
  * other std::ofstream and will then provide on-the-fly compression support.
  * The compressed data is written in the gzip format.
+ *
+ * The deflate level and strategy can be chosen, as can the size of the
+ * buffer compressed data is collected in before each write to the wrapped
+ * stream.
  */
-class GZipWriteStream {
-protected:
+class GZipWriteStream : public CompressStream {
+public:
 	enum {
 		BUFSIZE = 16384		// 1 << MAX_WBITS
 	};
 
-	byte	_buf[BUFSIZE];
+protected:
+	byte	*_buf;
+	uint32	_bufSize;
 	std::ofstream *_wrapped;
 	z_stream _stream;
 	int _zlibErr;
@@ -89,7 +134,8 @@ protected:
 	void processData(int flushType);
 
 public:
-	GZipWriteStream(std::ofstream *w);
+	GZipWriteStream(std::ofstream *w, int level = Z_DEFAULT_COMPRESSION, int strategy = Z_DEFAULT_STRATEGY,
+	                uint32 bufSize = BUFSIZE);
 	~GZipWriteStream();
 
 	bool err() const;
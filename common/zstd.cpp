@@ -0,0 +1,143 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#include "common/zstd.h"
+
+#if defined(USE_ZSTD)
+
+#include <assert.h>
+
+ZstdReadStream::ZstdReadStream(const byte *data, uint32 size) : _err(false), _eos(false) {
+	_stream = ZSTD_createDStream();
+	if (!_stream || ZSTD_isError(ZSTD_initDStream(_stream)))
+		_err = true;
+	_in.src = data;
+	_in.size = size;
+	_in.pos = 0;
+}
+
+ZstdReadStream::~ZstdReadStream() {
+	ZSTD_freeDStream(_stream);
+}
+
+bool ZstdReadStream::err() const {
+	return _err;
+}
+
+bool ZstdReadStream::eos() const {
+	return _eos;
+}
+
+uint32 ZstdReadStream::read(void *dataPtr, uint32 dataSize) {
+	ZSTD_outBuffer out;
+	out.dst = dataPtr;
+	out.size = dataSize;
+	out.pos = 0;
+
+	while (out.pos < out.size && !_err && !_eos) {
+		size_t ret = ZSTD_decompressStream(_stream, &out, &_in);
+		if (ZSTD_isError(ret))
+			_err = true;
+		else if (ret == 0)
+			_eos = true;
+		else if (_in.pos == _in.size && out.pos < out.size)
+			_err = true;	// Truncated frame
+	}
+
+	return out.pos;
+}
+
+ZstdWriteStream::ZstdWriteStream(std::ofstream *w, int level, uint32 bufSize)
+	: _bufSize(bufSize), _wrapped(w), _err(false), _finalized(false) {
+	assert(w != 0);
+	assert(bufSize > 0);
+	_buf = new byte[_bufSize];
+	_stream = ZSTD_createCStream();
+	if (!_stream || ZSTD_isError(ZSTD_initCStream(_stream, level)))
+		_err = true;
+}
+
+ZstdWriteStream::~ZstdWriteStream() {
+	finalize();
+	ZSTD_freeCStream(_stream);
+	delete[] _buf;
+}
+
+bool ZstdWriteStream::err() const {
+	return _err || _wrapped->bad();
+}
+
+bool ZstdWriteStream::flushBuffer(ZSTD_outBuffer &out) {
+	if (out.pos > 0) {
+		_wrapped->write((char *)_buf, out.pos);
+		out.pos = 0;
+	}
+	return !err();
+}
+
+void ZstdWriteStream::finalize() {
+	if (_finalized || err())
+		return;
+	_finalized = true;
+
+	ZSTD_outBuffer out;
+	out.dst = _buf;
+	out.size = _bufSize;
+	out.pos = 0;
+	size_t remaining;
+	do {
+		remaining = ZSTD_endStream(_stream, &out);
+		if (ZSTD_isError(remaining)) {
+			_err = true;
+			return;
+		}
+		if (!flushBuffer(out))
+			return;
+	} while (remaining > 0);
+	_wrapped->flush();
+}
+
+uint32 ZstdWriteStream::write(const void *dataPtr, uint32 dataSize) {
+	if (err() || _finalized)
+		return 0;
+
+	ZSTD_inBuffer in;
+	in.src = dataPtr;
+	in.size = dataSize;
+	in.pos = 0;
+	ZSTD_outBuffer out;
+	out.dst = _buf;
+	out.size = _bufSize;
+	out.pos = 0;
+	while (in.pos < in.size) {
+		if (ZSTD_isError(ZSTD_compressStream(_stream, &out, &in))) {
+			_err = true;
+			break;
+		}
+		if (!flushBuffer(out))
+			break;
+	}
+
+	return in.pos;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/* ScummVM Tools
+ * Copyright (C) 2002-2009 The ScummVM project
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * $URL$
+ * $Id$
+ *
+ */
+
+#ifndef COMMON_ZSTD_H
+#define COMMON_ZSTD_H
+
+#include "common/scummsys.h"
+
+#if defined(USE_ZSTD)
+
+#include "common/compress.h"
+
+#include <zstd.h>
+
+/**
+ * Decompresses a zstd frame held in memory, such as a range of a mapped
+ * patch. Much faster to inflate than gzip.
+ */
+class ZstdReadStream : public DecompressStream {
+	ZSTD_DStream *_stream;
+	ZSTD_inBuffer _in;
+	bool _err, _eos;
+
+public:
+	ZstdReadStream(const byte *data, uint32 size);
+	~ZstdReadStream();
+
+	bool err() const;
+	bool eos() const;
+	uint32 read(void *dataPtr, uint32 dataSize);
+};
+
+/** Compresses into a zstd frame written to a wrapped std::ofstream */
+class ZstdWriteStream : public CompressStream {
+public:
+	enum {
+		BUFSIZE = 16384
+	};
+
+private:
+	byte *_buf;
+	uint32 _bufSize;
+	std::ofstream *_wrapped;
+	ZSTD_CStream *_stream;
+	bool _err, _finalized;
+
+	bool flushBuffer(ZSTD_outBuffer &out);
+
+public:
+	ZstdWriteStream(std::ofstream *w, int level = 19, uint32 bufSize = BUFSIZE);
+	~ZstdWriteStream();
+
+	bool err() const;
+	void finalize();
+	uint32 write(const void *dataPtr, uint32 dataSize);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include "assetloader.h"
+#include "lab.h"
+#include "common/stats.h"
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+AssetStream::Buffer::Buffer(const char *data, uint32 size) {
+	char *begin = const_cast<char *>(data);
+	setg(begin, begin, begin + size);
+}
+
+AssetStream::Buffer::pos_type AssetStream::Buffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	char *target;
+	if (dir == std::ios_base::beg)
+		target = eback() + off;
+	else if (dir == std::ios_base::cur)
+		target = gptr() + off;
+	else
+		target = egptr() + off;
+	if (target < eback() || target > egptr())
+		return pos_type(off_type(-1));
+	setg(eback(), target, egptr());
+	return pos_type(target - eback());
+}
+
+AssetStream::Buffer::pos_type AssetStream::Buffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+AssetStream::AssetStream(const Asset *asset) : std::istream(0), _buf(asset->data, asset->size) {
+	rdbuf(&_buf);
+}
+
+AssetLoader::AssetLoader(Lab *lab, uint32 budget) : _lab(lab), _budget(budget), _cachedBytes(0) {
+}
+
+AssetLoader::~AssetLoader() {
+	for (std::list<Asset *>::iterator it = _lru.begin(); it != _lru.end(); ++it)
+		destroy(*it);
+}
+
+Asset *AssetLoader::readAsset(const std::string &name) {
+	Asset *asset = new Asset();
+	asset->name = name;
+	asset->owned = NULL;
+	asset->refCount = 0;
+
+	if (_lab) {
+		uint32 size;
+		const char *data = _lab->getData(name, size);
+		if (!data) {
+			delete asset;
+			return NULL;
+		}
+		asset->size = size;
+		if (_lab->isMapped()) {
+			asset->data = data;
+		} else {
+			// getData() reuses its buffer, keep a copy of our own
+			asset->owned = new char[size + 1];
+			memcpy(asset->owned, data, size);
+			asset->data = asset->owned;
+		}
+		return asset;
+	}
+
+	Common::StatsPhase phase(Common::kStatsOpen);
+	std::fstream file(name.c_str(), std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << name << std::endl;
+		delete asset;
+		return NULL;
+	}
+	file.seekg(0, std::ios::end);
+	asset->size = (uint32)file.tellg();
+	file.seekg(0, std::ios::beg);
+	asset->owned = new char[asset->size + 1];
+	file.read(asset->owned, asset->size);
+	asset->data = asset->owned;
+	Common::addStatsRead(asset->size);
+	return asset;
+}
+
+void AssetLoader::touch(Asset *asset) {
+	_lru.remove(asset);
+	_lru.push_front(asset);
+}
+
+void AssetLoader::destroy(Asset *asset) {
+	delete[] asset->owned;
+	delete asset;
+}
+
+void AssetLoader::evict(bool all) {
+	std::list<Asset *>::iterator it = _lru.end();
+	while ((all || _cachedBytes > _budget) && it != _lru.begin()) {
+		--it;
+		Asset *asset = *it;
+		if (asset->refCount > 0)
+			continue;
+		if (asset->owned)
+			_cachedBytes -= asset->size;
+		_assets.erase(asset->name);
+		it = _lru.erase(it);
+		destroy(asset);
+	}
+}
+
+const Asset *AssetLoader::load(const std::string &name) {
+	Asset *asset;
+	std::map<std::string, Asset *>::iterator it = _assets.find(name);
+	if (it != _assets.end()) {
+		asset = it->second;
+		touch(asset);
+	} else {
+		asset = readAsset(name);
+		if (!asset)
+			return NULL;
+		_assets[name] = asset;
+		_lru.push_front(asset);
+		// Views into a mapped lab cost nothing to keep
+		if (asset->owned)
+			_cachedBytes += asset->size;
+	}
+	++asset->refCount;
+	evict(false);
+	return asset;
+}
+
+bool AssetLoader::contains(const std::string &name) {
+	if (_assets.find(name) != _assets.end())
+		return true;
+	if (_lab)
+		return _lab->getIndex(name) != -1;
+	FILE *f = fopen(name.c_str(), "rb");
+	if (f)
+		fclose(f);
+	return f != NULL;
+}
+
+void AssetLoader::release(const Asset *asset) {
+	if (!asset)
+		return;
+	std::map<std::string, Asset *>::iterator it = _assets.find(asset->name);
+	if (it == _assets.end() || it->second->refCount == 0)
+		return;
+	--it->second->refCount;
+	evict(false);
+}
+
+void AssetLoader::flush() {
+	evict(true);
+}
+
+void AssetLoader::prefetch(const std::vector<std::string> &names) {
+	for (size_t i = 0; i < names.size(); i++) {
+		// Loaded ones are in memory already
+		if (_assets.find(names[i]) != _assets.end())
+			continue;
+		if (_lab) {
+			int index = _lab->getIndex(names[i]);
+			if (index != -1)
+				_lab->prefetch(index);
+			continue;
+		}
+#if defined(POSIX) && defined(POSIX_FADV_WILLNEED)
+		// The read ahead goes on after the file is closed
+		int fd = open(names[i].c_str(), O_RDONLY);
+		if (fd != -1) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+#endif
+	}
+}
@@ -0,0 +1,101 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef ASSETLOADER_H
+#define ASSETLOADER_H
+
+#include "config.h"
+#include <string>
+#include <istream>
+#include <streambuf>
+#include <list>
+#include <map>
+#include <vector>
+
+class Lab;
+
+struct Asset {
+	std::string name;
+	const char *data;
+	uint32 size;
+	// Storage owned by the loader, NULL when data points into a mapped lab
+	char *owned;
+	int refCount;
+};
+
+/**
+ * Read-only std::istream over an asset, for the readers in emi/filetools.h.
+ * The stream doesn't copy the data, the asset must stay loaded while it is used.
+ */
+class AssetStream : public std::istream {
+	class Buffer : public std::streambuf {
+	public:
+		Buffer(const char *data, uint32 size);
+	protected:
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+	};
+	Buffer _buf;
+public:
+	AssetStream(const Asset *asset);
+};
+
+/**
+ * Loads entries from a lab, or from the file system when no lab is given,
+ * and keeps recently used ones around so a long running converter doesn't
+ * have to reopen or reread the archive for every asset.
+ *
+ * load() returns an asset with a reference taken, hand it back through
+ * release() when done. Only released assets are evicted, least recently used
+ * first, once the cached data exceeds the budget.
+ */
+class AssetLoader {
+	Lab *_lab;
+	uint32 _budget;
+	uint32 _cachedBytes;
+	std::map<std::string, Asset *> _assets;
+	// Most recently used first
+	std::list<Asset *> _lru;
+
+	Asset *readAsset(const std::string &name);
+	void touch(Asset *asset);
+	void evict(bool all);
+	void destroy(Asset *asset);
+public:
+	AssetLoader(Lab *lab, uint32 budget = 64 * 1024 * 1024);
+	~AssetLoader();
+
+	Lab *getLab() const { return _lab; }
+	const Asset *load(const std::string &name);
+	/** Whether load() would find the asset, without reading it */
+	bool contains(const std::string &name);
+	void release(const Asset *asset);
+	/**
+	 * Starts reading the named assets in the background, so the load() of
+	 * each later on doesn't wait for the disk. Nothing is loaded or cached.
+	 */
+	void prefetch(const std::vector<std::string> &names);
+	// Drops every asset which is not referenced
+	void flush();
+};
+
+#endif
@@ -36,6 +36,18 @@
 #include <cstring>
 #include "common/endian.h"
 #include "lab.h"
+#include "assetloader.h"
+#include "codec3.h"
+#include "rgb565.h"
+#include "dds.h"
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
 struct BMPHeader {
 	uint32_t size;
@@ -53,43 +65,103 @@ struct BMPHeader {
 	uint32_t nimpcolors;
 };
 
+/**
+ * Grow-only buffer the compressed images are decoded into before they are
+ * converted, and the output files are assembled in. Keep one around per
+ * thread to reuse it across images and files.
+ */
+class DecodeScratch {
+public:
+	DecodeScratch() : _buf(NULL), _size(0) { }
+	~DecodeScratch() { free(_buf); }
+
+	char *reserve(uint32 size) {
+		if (size > _size) {
+			free(_buf);
+			_buf = (char *)malloc(size);
+			_size = _buf ? size : 0;
+		}
+		return _buf;
+	}
+
+private:
+	char *_buf;
+	uint32 _size;
+};
+
 class Bitmap {
 public:
 	~Bitmap();
 
 	inline uint32_t size() const { return _height * _width * _bpp / 8; }
 
-	static Bitmap *load(const char *data, int len);
+	static Bitmap *load(const char *data, int len, DecodeScratch *scratch = NULL);
+
+	void toBMP(const std::string &fname, DecodeScratch *scratch = NULL);
+	void toPNG(const std::string &fname, DecodeScratch *scratch = NULL);
+	// BC1 compressed, the images are all opaque
+	void toDDS(const std::string &fname, bool mips, DecodeScratch *scratch = NULL);
+	// Depth maps only, 16-bit binary PGM
+	void toPGM(const std::string &fname, DecodeScratch *scratch = NULL);
 
-	void toBMP(const std::string &fname);
+	bool isZBuffer() const { return _format == 5; }
 
 private:
-	Bitmap() { }
+	Bitmap() : _numImages(0), _data(NULL) { }
+
+	char *imageData(int img) const { return _data + img * size(); }
+	void toDepthPNG(const std::string &fname, DecodeScratch *scratch);
 
 	int _numImages;
-	char **_data;
+	// All the images one after the other, colour images converted to 32 bits,
+	// depth maps kept as the 16-bit little-endian values of the file
+	char *_data;
+	int _format;
 	int _bpp;
 	int _width;
 	int _height;
 };
 
 Bitmap::~Bitmap() {
-	for (int i = 0; i < _numImages; ++i) {
-		delete[] _data[i];
-	}
 	delete[] _data;
 }
 
-void Bitmap::toBMP(const std::string &fname) {
+static bool writeWholeFile(const std::string &name, const char *data, uint32 size) {
+	Common::StatsPhase phase(Common::kStatsWrite);
+	FILE *file = fopen(name.c_str(), "wb");
+	if (!file) {
+		printf("Could not open file %s for writing\n", name.c_str());
+		return false;
+	}
+	bool success = fwrite(data, 1, size, file) == size;
+	if (fclose(file) != 0)
+		success = false;
+	if (!success)
+		printf("Could not write file %s\n", name.c_str());
+	else
+		Common::addStatsWritten(size);
+	return success;
+}
+
+void Bitmap::toBMP(const std::string &fname, DecodeScratch *scratch) {
+	DecodeScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+
+	const uint32 rowSize = _width * _bpp / 8;
 	for (int img = 0; img < _numImages; ++img) {
 		std::stringstream name;
 		name << fname << '.' << img << ".bmp";
 		printf("Saving image %d to file %s\n", img, name.str().c_str());
 
-		std::fstream file(name.str().c_str(), std::fstream::out | std::fstream::binary);
+		// Header and bottom-up rows are assembled so the image is written at once
+		char *out = scratch->reserve(54 + size());
+		if (!out) {
+			printf("Could not allocate memory\n");
+			return;
+		}
 		BMPHeader header;
-		unsigned short bm = TO_LE_16(19778);
-		file.write((char*)&bm, 2);
+		WRITE_LE_UINT16(out, 19778);
 		header.size = TO_LE_32(size() + 54);
 		header.reserved = TO_LE_32(0);
 		header.width = TO_LE_32(_width);
@@ -106,211 +178,478 @@ void Bitmap::toBMP(const std::string &fname) {
 		header.vres = TO_LE_32(2835);
 		header.ncolors = TO_LE_32(0);
 		header.nimpcolors = TO_LE_32(0);
-		file.write((char *)&header, sizeof(BMPHeader));
-		for (int i = _height - 1; i >= 0; --i) {
-			char *d = _data[0] + (_width * i * _bpp / 8);
-			file.write(d, _width * _bpp / 8);
+		memcpy(out + 2, &header, sizeof(BMPHeader));
+
+		char *row = out + 54;
+		for (int i = _height - 1; i >= 0; --i, row += rowSize)
+			memcpy(row, imageData(img) + rowSize * i, rowSize);
+		writeWholeFile(name.str(), out, 54 + size());
+	}
+}
+
+void Bitmap::toDDS(const std::string &fname, bool mips, DecodeScratch *scratch) {
+	DecodeScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+
+	const uint32 ddsSize = getDDSSize(_width, _height, kDDSBC1, mips);
+	for (int img = 0; img < _numImages; ++img) {
+		std::stringstream name;
+		name << fname << '.' << img << ".dds";
+		printf("Saving image %d to file %s\n", img, name.str().c_str());
+
+		char *out = scratch->reserve(ddsSize);
+		if (!out) {
+			printf("Could not allocate memory\n");
+			return;
 		}
-		file.close();
+		writeDDS((const uint8 *)imageData(img), _width * 4, _width, _height, kDDSBC1, mips, (uint8 *)out);
+		writeWholeFile(name.str(), out, ddsSize);
 	}
 }
 
-#define GET_BIT do { bit = bitstr_value & 1; \
-bitstr_len--; \
-bitstr_value >>= 1; \
-if (bitstr_len == 0) { \
-	bitstr_value = READ_LE_UINT16(compressed); \
-	bitstr_len = 16; \
-	compressed += 2; \
-	} \
-} while (0)
-
-static bool decompress_codec3(const char *compressed, char *result, int maxBytes) {
-	int bitstr_value = READ_LE_UINT16(compressed);
-	int bitstr_len = 16;
-	compressed += 2;
-	bool bit;
-	
-	int byteIndex = 0;
-	for (;;) {
-		GET_BIT;
-		if (bit == 1) {
-			if (byteIndex >= maxBytes) {
-				printf("Buffer overflow when decoding image: decompress_codec3 walked past the input buffer!\n");
-				return false;
-			}
-			else
-				*result++ = *compressed++;
-			++byteIndex;
+static char *putPNGChunk(char *out, const char *type, uint32 dataSize) {
+	// The data has to be in place already, right after the length and type
+	WRITE_BE_UINT32(out, dataSize);
+	memcpy(out + 4, type, 4);
+	uLong crc = crc32(0L, (const Bytef *)out + 4, dataSize + 4);
+	WRITE_BE_UINT32(out + 8 + dataSize, (uint32)crc);
+	return out + 12 + dataSize;
+}
+
+void Bitmap::toPGM(const std::string &fname, DecodeScratch *scratch) {
+	DecodeScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+
+	for (int img = 0; img < _numImages; ++img) {
+		std::stringstream name;
+		name << fname << '.' << img << ".pgm";
+		printf("Saving image %d to file %s\n", img, name.str().c_str());
+
+		std::stringstream header;
+		header << "P5\n" << _width << " " << _height << "\n65535\n";
+		const std::string &h = header.str();
+		char *out = scratch->reserve(h.size() + size());
+		if (!out) {
+			printf("Could not allocate memory\n");
+			return;
 		}
-		else {
-			GET_BIT;
-			int copy_len, copy_offset;
-			if (bit == 0) {
-				GET_BIT;
-				copy_len = 2 * bit;
-				GET_BIT;
-				copy_len += bit + 3;
-				copy_offset = *(uint8 *)(compressed++) - 0x100;
-			} else {
-				copy_offset = (*(uint8 *)(compressed) | (*(uint8 *)(compressed + 1) & 0xf0) << 4) - 0x1000;
-				copy_len = (*(uint8 *)(compressed + 1) & 0xf) + 3;
-				compressed += 2;
-				if (copy_len == 3) {
-					copy_len = *(uint8 *)(compressed++) + 1;
-					if (copy_len == 1)
-						return true;
-				}
+		memcpy(out, h.c_str(), h.size());
+		// PGM samples wider than a byte are big-endian
+		const uint8 *src = (const uint8 *)imageData(img);
+		uint8 *dst = (uint8 *)out + h.size();
+		for (int i = 0; i < _width * _height; i++, src += 2, dst += 2) {
+			dst[0] = src[1];
+			dst[1] = src[0];
+		}
+		writeWholeFile(name.str(), out, h.size() + size());
+	}
+}
+
+void Bitmap::toPNG(const std::string &fname, DecodeScratch *scratch) {
+	DecodeScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+	if (isZBuffer()) {
+		toDepthPNG(fname, scratch);
+		return;
+	}
+
+	// Every image is opaque, so they are stored as 8-bit RGB
+	const uint32 rawRowSize = 1 + _width * 3;
+	const uint32 rawSize = rawRowSize * _height;
+	const uLong maxCompressed = compressBound(rawSize);
+	for (int img = 0; img < _numImages; ++img) {
+		std::stringstream name;
+		name << fname << '.' << img << ".png";
+		printf("Saving image %d to file %s\n", img, name.str().c_str());
+
+		char *raw = scratch->reserve(rawSize + 8 + 25 + 12 + maxCompressed + 12);
+		if (!raw) {
+			printf("Could not allocate memory\n");
+			return;
+		}
+		// Rows with the Sub filter, which suits the smooth gradients of the backgrounds
+		const uint8 *src = (const uint8 *)imageData(img);
+		uint8 *dst = (uint8 *)raw;
+		for (int y = 0; y < _height; y++) {
+			*dst++ = 1;
+			uint8 prev[3] = { 0, 0, 0 };
+			for (int x = 0; x < _width; x++, src += 4, dst += 3) {
+				dst[0] = src[2] - prev[0];
+				dst[1] = src[1] - prev[1];
+				dst[2] = src[0] - prev[2];
+				prev[0] = src[2];
+				prev[1] = src[1];
+				prev[2] = src[0];
 			}
-			while (copy_len > 0) {
-				if (byteIndex >= maxBytes) {
-					printf("Buffer overflow when decoding image: decompress_codec3 walked past the input buffer!\n");
-					return false;
-				}
-				else {
-					assert(byteIndex + copy_offset >= 0);
-					assert(byteIndex + copy_offset < maxBytes);
-					*result = result[copy_offset];
-					result++;
-				}
-				++byteIndex;
-				copy_len--;
+		}
+
+		char *out = raw + rawSize;
+		char *p = out;
+		memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+		p += 8;
+		WRITE_BE_UINT32(p + 8, _width);
+		WRITE_BE_UINT32(p + 12, _height);
+		p[16] = 8; // bit depth
+		p[17] = 2; // truecolour
+		p[18] = p[19] = p[20] = 0; // deflate, adaptive filtering, no interlace
+		p = putPNGChunk(p, "IHDR", 13);
+
+		uLongf compressedSize = maxCompressed;
+		if (compress2((Bytef *)p + 8, &compressedSize, (const Bytef *)raw, rawSize, Z_BEST_COMPRESSION) != Z_OK) {
+			printf("Could not compress image %d\n", img);
+			continue;
+		}
+		p = putPNGChunk(p, "IDAT", (uint32)compressedSize);
+		p = putPNGChunk(p, "IEND", 0);
+		writeWholeFile(name.str(), out, p - out);
+	}
+}
+
+void Bitmap::toDepthPNG(const std::string &fname, DecodeScratch *scratch) {
+	const uint32 rawRowSize = 1 + _width * 2;
+	const uint32 rawSize = rawRowSize * _height;
+	const uLong maxCompressed = compressBound(rawSize);
+	for (int img = 0; img < _numImages; ++img) {
+		std::stringstream name;
+		name << fname << '.' << img << ".png";
+		printf("Saving image %d to file %s\n", img, name.str().c_str());
+
+		char *raw = scratch->reserve(rawSize + 8 + 25 + 12 + maxCompressed + 12);
+		if (!raw) {
+			printf("Could not allocate memory\n");
+			return;
+		}
+		// 16-bit greyscale, big-endian samples, unfiltered rows
+		const uint8 *src = (const uint8 *)imageData(img);
+		uint8 *dst = (uint8 *)raw;
+		for (int y = 0; y < _height; y++) {
+			*dst++ = 0;
+			for (int x = 0; x < _width; x++, src += 2, dst += 2) {
+				dst[0] = src[1];
+				dst[1] = src[0];
 			}
 		}
+
+		char *out = raw + rawSize;
+		char *p = out;
+		memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+		p += 8;
+		WRITE_BE_UINT32(p + 8, _width);
+		WRITE_BE_UINT32(p + 12, _height);
+		p[16] = 16; // bit depth
+		p[17] = 0; // greyscale
+		p[18] = p[19] = p[20] = 0; // deflate, adaptive filtering, no interlace
+		p = putPNGChunk(p, "IHDR", 13);
+
+		uLongf compressedSize = maxCompressed;
+		if (compress2((Bytef *)p + 8, &compressedSize, (const Bytef *)raw, rawSize, Z_BEST_COMPRESSION) != Z_OK) {
+			printf("Could not compress image %d\n", img);
+			continue;
+		}
+		p = putPNGChunk(p, "IDAT", (uint32)compressedSize);
+		p = putPNGChunk(p, "IEND", 0);
+		writeWholeFile(name.str(), out, p - out);
 	}
-	return true;
 }
 
-Bitmap *Bitmap::load(const char *data, int len) {
+Bitmap *Bitmap::load(const char *data, int len, DecodeScratch *scratch) {
+	Common::StatsPhase phase(Common::kStatsDecode);
 	if (len < 8 || memcmp(data, "BM  F\0\0\0", 8) != 0) {
 		printf("Invalid magic loading bitmap.\n");
 		return NULL;
 	}
 
-	Bitmap *b = new Bitmap();
-
 	int codec = READ_LE_UINT32(data + 8);
 //	_paletteIncluded = READ_LE_UINT32(data + 12);
-	b->_numImages = READ_LE_UINT32(data + 16);
+	int numImages = READ_LE_UINT32(data + 16);
 //	int x = READ_LE_UINT32(data + 20);
 //	int y = READ_LE_UINT32(data + 24);
 //	_transparentColor = READ_LE_UINT32(data + 28);
 	int format = READ_LE_UINT32(data + 32);
 
-	if (format != 1) {
-		printf("ZBuffer images are not supported.\n");
+	if (format != 1 && format != 5) {
+		printf("Unknown image format %d.\n", format);
+		return NULL;
+	}
+	if (codec != 0 && codec != 3) {
+		printf("Unknown image codec in BitmapData ctor!\n");
 		return NULL;
 	}
 
-	b->_bpp = READ_LE_UINT32(data + 36);
+	int bpp = READ_LE_UINT32(data + 36);
 //	_blueBits = READ_LE_UINT32(data + 40);
 //	_greenBits = READ_LE_UINT32(data + 44);
 //	_redBits = READ_LE_UINT32(data + 48);
 //	_blueShift = READ_LE_UINT32(data + 52);
 //	_greenShift = READ_LE_UINT32(data + 56);
 //	_redShift = READ_LE_UINT32(data + 60);
-	b->_width = READ_LE_UINT32(data + 128);
-	b->_height = READ_LE_UINT32(data + 132);
+	int width = READ_LE_UINT32(data + 128);
+	int height = READ_LE_UINT32(data + 132);
+	int imageSize = bpp / 8 * width * height;
+
+	DecodeScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+
+	Bitmap *b = new Bitmap();
+	b->_numImages = numImages;
+	b->_width = width;
+	b->_height = height;
+	b->_format = format;
+	// Every image is converted straight into its final 32-bit slot, depth
+	// maps are decoded straight into theirs
+	b->_bpp = b->isZBuffer() ? 16 : 32;
+	b->_data = new char[numImages * b->size()];
+	if (b->isZBuffer() && imageSize != (int)b->size()) {
+		printf("ZBuffer images must have 16 bits per pixel.\n");
+		delete b;
+		return NULL;
+	}
 
-	b->_data = new char *[b->_numImages];
 	int pos = 0x88;
-	for (int i = 0; i < b->_numImages; i++) {
-		b->_data[i] = new char[b->_bpp / 8 * b->_width * b->_height];
+	for (int i = 0; i < numImages; i++) {
+		const char *pixels;
 		if (codec == 0) {
-			memcpy(b->_data[i], data + pos, b->_bpp / 8 * b->_width * b->_height);
-			pos += b->_bpp / 8 * b->_width * b->_height + 8;
-		} else if (codec == 3) {
+			if (pos + imageSize > len) {
+				printf("Image data truncated when loading bitmap.\n");
+				delete b;
+				return NULL;
+			}
+			pixels = data + pos;
+			pos += imageSize + 8;
+		} else {
 			int compressed_len = READ_LE_UINT32(data + pos);
-			bool success = decompress_codec3(data + pos + 4, b->_data[i], b->_bpp / 8 * b->_width * b->_height);
+			if (compressed_len > len - pos - 4)
+				compressed_len = len - pos - 4;
+			char *decoded = b->isZBuffer() ? b->imageData(i) : scratch->reserve(imageSize);
+			if (!decoded) {
+				printf("Could not allocate memory\n");
+				delete b;
+				return NULL;
+			}
+			bool success = decompress_codec3(data + pos + 4, compressed_len, decoded, imageSize);
 			if (!success)
 				printf(".. when loading image\n");
-			char *temp = new char[b->_bpp / 8 * b->_width * b->_height];
-			memcpy(temp, b->_data[i], b->_bpp / 8 * b->_width * b->_height);
-			delete[] b->_data[i];
-			b->_data[i] = temp;
+			pixels = decoded;
 			pos += compressed_len + 12;
-		} else {
-			printf("Unknown image codec in BitmapData ctor!\n");
-			return NULL;
-		}
-		
-#ifdef SCUMM_BIG_ENDIAN
-		for (int j = 0; j < b->_width * b->_height; ++j) {
-			((uint16 *)b->_data[i])[j] = SWAP_BYTES_16(((uint16 *)b->_data[i])[j]);
 		}
-#endif
-	}
 
-	for (int img = 0; img < b->_numImages; img++) {
-		char *texData = new char[4 * b->_width * b->_height];
-		// Convert data to 32-bit RGBA format
-		char *texDataPtr = texData;
-		uint16 *bitmapData = reinterpret_cast<uint16 *>(b->_data[img]);
-		for (int i = 0; i < b->_width * b->_height; i++, texDataPtr += 4, bitmapData++) {
-			uint16 pixel = *bitmapData;
-			int r = pixel >> 11;
-			int g = (pixel >> 5) & 0x3f;
-			int bb = pixel & 0x1f;
-			texDataPtr[2] = (r << 3) | (r >> 2);
-			texDataPtr[1] = (g << 2) | (g >> 4);
-			texDataPtr[0] = (bb << 3) | (bb >> 2);
+		if (b->isZBuffer()) {
+			if (pixels != b->imageData(i))
+				memcpy(b->imageData(i), pixels, imageSize);
+			continue;
 		}
-		delete[] b->_data[img];
-		b->_data[img] = texData;
-		b->_bpp = 32;
+		// Convert data to 32-bit RGBA format
+		convertRGB565ToBGRA((const uint8 *)pixels, (uint8 *)b->imageData(i), width * height);
 	}
 
 	return b;
 }
 
 void usage() {
-	std::cout << "Usage: bm2bmp [labfilename] <filename>" << std::endl;
+	std::cout << "Usage: bm2bmp [-p | -d [-m]] [labfilename] <filename>" << std::endl;
+	std::cout << "       bm2bmp -b [-p | -d [-m]] [-j N] <labfilename> <pattern>" << std::endl;
+	std::cout << "\t-p\tWrite compressed PNG files instead of BMP" << std::endl;
+	std::cout << "\t-d\tWrite BC1 (DXT1) compressed DDS textures instead of BMP" << std::endl;
+	std::cout << "\t-m\tAdd every mipmap level to the DDS textures" << std::endl;
+	std::cout << "ZBuffer images are written as 16-bit PGM, or 16-bit greyscale PNG with -p" << std::endl;
+	std::cout << "\t-b\tConvert every entry of the lab matching pattern (e.g. '*.bm')" << std::endl;
+	std::cout << "\t-j N\tConvert with N threads in batch mode" << std::endl;
+}
+
+struct BatchJob {
+	Lab *lab;
+	const char *pattern;
+	bool png;
+	bool dds, mips;
+	uint32 nextEntry;
+	int failed;
+#ifdef POSIX
+	pthread_mutex_t lock;
+#endif
+};
+
+static void *batchWorker(void *arg) {
+	BatchJob *job = (BatchJob *)arg;
+	DecodeScratch scratch;
+	for (;;) {
+#ifdef POSIX
+		pthread_mutex_lock(&job->lock);
+#endif
+		uint32 index = job->nextEntry++;
+#ifdef POSIX
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (index >= job->lab->getNumEntries())
+			break;
+
+		const char *name = job->lab->getEntryName(index);
+		if (!Common::matchPattern(job->pattern, name))
+			continue;
+
+		uint32 length;
+		const char *data = job->lab->getData(name, length);
+		Bitmap *b = data ? Bitmap::load(data, length, &scratch) : NULL;
+		if (b) {
+			Common::StatsPhase phase(Common::kStatsConvert);
+			if (job->png)
+				b->toPNG(name, &scratch);
+			else if (b->isZBuffer())
+				b->toPGM(name, &scratch);
+			else if (job->dds)
+				b->toDDS(name, job->mips, &scratch);
+			else
+				b->toBMP(name, &scratch);
+			delete b;
+			Common::addStatsFiles();
+		} else {
+			printf("Could not load file %s.\n", name);
+#ifdef POSIX
+			pthread_mutex_lock(&job->lock);
+#endif
+			++job->failed;
+#ifdef POSIX
+			pthread_mutex_unlock(&job->lock);
+#endif
+		}
+	}
+	return NULL;
+}
+
+// Decodes every matching entry of the lab, parsing the lab only once
+static int convertBatch(const char *labname, const char *pattern, int jobs, bool png, bool dds, bool mips) {
+	BatchJob job;
+	job.lab = new Lab(labname, false, true);
+	job.pattern = pattern;
+	job.png = png;
+	job.dds = dds;
+	job.mips = mips;
+	job.nextEntry = 0;
+	job.failed = 0;
+
+#ifdef POSIX
+	pthread_mutex_init(&job.lock, NULL);
+	// Without a mapping all reads go through one shared buffer
+	if (!job.lab->isMapped())
+		jobs = 1;
+	pthread_t *threads = new pthread_t[jobs];
+	int started = 0;
+	for (int t = 1; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, batchWorker, &job) == 0)
+			++started;
+	}
+	batchWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	delete[] threads;
+	pthread_mutex_destroy(&job.lock);
+#else
+	batchWorker(&job);
+#endif
+
+	delete job.lab;
+	return job.failed ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
+	bool batch = false;
+	bool png = false;
+	bool dds = false, mips = false;
+	int jobs = 1;
+	int c;
+	Common::initStats("bm2bmp", argc, argv);
+	while ((c = getopt(argc, argv, "bpdmj:h")) != -1) {
+		switch (c) {
+		case 'p':
+			png = true;
+			break;
+		case 'd':
+			dds = true;
+			break;
+		case 'm':
+			mips = true;
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (batch) {
+		if (argc < 3) {
+			usage();
+			return 1;
+		}
+		return convertBatch(argv[1], argv[2], jobs, png, dds, mips);
+	}
+
 	if (argc < 2) {
 		std::cout << "No Argument" << std::endl;
 		usage();
 		return 0;
 	}
-	if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+	if (strcmp(argv[1], "--help") == 0) {
 		usage();
 		return 0;
 	}
 
 	Lab *lab = NULL;
 	std::string filename;
-	int length = 0;
 
 	if (argc > 2) {
-		lab = new Lab(argv[1]);
+		lab = new Lab(argv[1], false, true);
 		filename = argv[2];
 	} else {
 		filename = argv[1];
 	}
 
-	std::istream *file = getFile(filename, lab, length);
+	AssetLoader loader(lab);
+	const Asset *asset = loader.load(filename);
 
-	if (!file) {
+	if (!asset) {
 		std::cout << "Could not open file" << std::endl;
 		return 1;
 	}
+	const char *data = asset->data;
+	uint32 length = asset->size;
 
 	int p = filename.rfind('/');
 	std::string outname = filename.substr(p + 1);
 
-	char *data = new char[length];
-	file->read(data, length);
-	delete file;
 	Bitmap *b = Bitmap::load(data, length);
 	if (b) {
-		b->toBMP(filename.substr(p + 1));
+		Common::StatsPhase phase(Common::kStatsConvert);
+		if (png)
+			b->toPNG(filename.substr(p + 1));
+		else if (b->isZBuffer())
+			b->toPGM(filename.substr(p + 1));
+		else if (dds)
+			b->toDDS(filename.substr(p + 1), mips);
+		else
+			b->toBMP(filename.substr(p + 1));
 		delete b;
+		Common::addStatsFiles();
 	} else {
 		printf("Could not load file %s.\n", filename.c_str());
 		return 1;
 	}
 
-	delete[] data;
+	loader.release(asset);
+	delete lab;
 	return 0;
 }
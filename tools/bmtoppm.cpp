@@ -27,6 +27,7 @@
 #include <assert.h>
 
 #include <ppm.h>
+#include "codec3.h"
 
 int32_t read_LEint32(FILE *f) {
 	unsigned char c[4];
@@ -58,62 +59,13 @@ void read_data_codec0(FILE *in, int width, int height, unsigned char *result) {
 	fread(result, 1, width * height * 2, in);
 }
 
-void read_data_codec3(FILE *in, int size, unsigned char *result) {
-	unsigned char *data;
-	const unsigned char *data_ptr;
-	int bitstr_val, bitstr_len;
-	int offset, len;
+void read_data_codec3(FILE *in, int size, unsigned char *result, int maxBytes) {
+	char *data;
 
-	data = malloc(size);
+	data = (char *)malloc(size);
 	fread(data, 1, size, in);
-
-	bitstr_val = data[0] | (data[1] << 8);
-	bitstr_len = 16;
-	data_ptr = data + 2;
-
-#define GET_BIT ({ \
-		int bit_result = bitstr_val & 1; \
-		bitstr_val >>= 1; \
-		bitstr_len--; \
-		if (bitstr_len == 0) { \
-			bitstr_val = data_ptr[0] | (data_ptr[1] << 8); \
-			bitstr_len = 16; \
-			data_ptr += 2; \
-		} \
-		bit_result; \
-	})
-
-	for (;;) {
-		if (GET_BIT == 1)
-			*result++ = *data_ptr++;
-		else {
-			if (GET_BIT == 0) {
-				len = GET_BIT * 2;
-				len += GET_BIT;
-				len += 3;
-				offset = *data_ptr - 0x100;
-				data_ptr++;
-			} else {
-				offset = data_ptr[0] | ((data_ptr[1] & 0xf0) << 4);
-				offset -= 0x1000;
-				len = (data_ptr[1] & 0xf) + 3;
-				data_ptr += 2;
-				if (len == 3) {
-					len = *data_ptr++;
-					len++;
-					if (len == 1) {
-						free(data);
-						return;
-					}
-				}
-			}
-			while (len > 0) {
-				*result = result[offset];
-				result++;
-				len--;
-			}
-		}
-	}
+	decompress_codec3(data, size, (char *)result, maxBytes);
+	free(data);
 }
 
 void write_img(pixel **img, const char *fname, int img_num, int width, int height, int maxval) {
@@ -205,7 +157,7 @@ void process_file(const char *fname) {
 			read_data_codec0(in, width, height, data);
 		else if (codec == 3) {
 			size = read_LEint32(in);
-			read_data_codec3(in, size, data);
+			read_data_codec3(in, size, data, width * height * 2);
 		} else {
 			fprintf(stderr, "%s: unsupported codec %d\n", fname, codec);
 			exit(1);
@@ -0,0 +1,130 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "common/endian.h"
+#include "codec3.h"
+
+// The control bits come in 16-bit words which are interleaved with the
+// literal and offset bytes: the next word is always read right after the last
+// bit of the current one was used. That pins the reservoir to one word, so
+// the speed comes from doing the bounds checks once per token instead of once
+// per byte and from copying whole matches at a time.
+#define CODEC3_BIT(bit) do { \
+	bit = bitstr_value & 1; \
+	bitstr_value >>= 1; \
+	if (--bitstr_len == 0) { \
+		if (srcEnd - src >= 2) { \
+			bitstr_value = READ_LE_UINT16(src); \
+			src += 2; \
+		} else { \
+			/* Only an error if more data is needed, which the byte checks catch */ \
+			bitstr_value = 0; \
+			src = srcEnd; \
+		} \
+		bitstr_len = 16; \
+	} \
+} while (0)
+
+bool decompress_codec3(const char *compressed, uint32 compressedLen, char *result, uint32 maxBytes) {
+	const uint8 *src = (const uint8 *)compressed;
+	const uint8 *srcEnd = src + compressedLen;
+	uint8 *dst = (uint8 *)result;
+	uint8 *const dstStart = dst;
+	uint8 *const dstEnd = dst + maxBytes;
+
+	if (compressedLen < 2)
+		goto truncated;
+
+	{
+		uint32 bitstr_value = READ_LE_UINT16(src);
+		int bitstr_len = 16;
+		src += 2;
+		uint32 bit;
+
+		for (;;) {
+			CODEC3_BIT(bit);
+			if (bit) {
+				if (src >= srcEnd)
+					goto truncated;
+				if (dst >= dstEnd)
+					goto overflow;
+				*dst++ = *src++;
+				continue;
+			}
+
+			int copy_len, copy_offset;
+			CODEC3_BIT(bit);
+			if (bit == 0) {
+				CODEC3_BIT(bit);
+				copy_len = 2 * bit;
+				CODEC3_BIT(bit);
+				copy_len += bit + 3;
+				if (src >= srcEnd)
+					goto truncated;
+				copy_offset = *src++ - 0x100;
+			} else {
+				if (srcEnd - src < 2)
+					goto truncated;
+				copy_offset = (src[0] | (src[1] & 0xf0) << 4) - 0x1000;
+				copy_len = (src[1] & 0xf) + 3;
+				src += 2;
+				if (copy_len == 3) {
+					if (src >= srcEnd)
+						goto truncated;
+					copy_len = *src++ + 1;
+					if (copy_len == 1)
+						return true;
+				}
+			}
+
+			if (dst + copy_offset < dstStart)
+				goto badOffset;
+			if (copy_len > dstEnd - dst)
+				goto overflow;
+
+			const uint8 *from = dst + copy_offset;
+			if (-copy_offset >= copy_len) {
+				memcpy(dst, from, copy_len);
+				dst += copy_len;
+			} else if (copy_offset == -1) {
+				memset(dst, *from, copy_len);
+				dst += copy_len;
+			} else {
+				// Overlapping match, repeats the last -copy_offset bytes
+				while (copy_len-- > 0)
+					*dst++ = *from++;
+			}
+		}
+	}
+
+overflow:
+	printf("Buffer overflow when decoding image: decompress_codec3 walked past the input buffer!\n");
+	return false;
+badOffset:
+	printf("Invalid back reference when decoding image: decompress_codec3 walked before the start of the buffer!\n");
+	return false;
+truncated:
+	printf("Truncated data when decoding image: decompress_codec3 walked past the end of the compressed data!\n");
+	return false;
+}
@@ -0,0 +1,35 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef CODEC3_H
+#define CODEC3_H
+
+#include "common/scummsys.h"
+
+/**
+ * Decodes a codec 3 (LZ77 variant) stream, as used by Grim's bitmaps, into
+ * result. Returns false if the stream is truncated or if it would write past
+ * maxBytes or refer to data before the start of the output.
+ */
+bool decompress_codec3(const char *compressed, uint32 compressedLen, char *result, uint32 maxBytes);
+
+#endif
@@ -0,0 +1,143 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// Checks decompress_codec3() against hand-made streams, each using some
+// kinds of token: literals, short and long matches, runs, overlapping and
+// extended-length copies and offsets as far back as they go. Every stream
+// has to decode to its data, and every truncation of it and every output
+// buffer too small for it has to be rejected. Run by make check.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "common/md5.h"
+#include "codec3.h"
+
+struct Codec3Vector {
+	const char *name;
+	uint32 size;
+	uint32 decodedSize;
+	const char *md5;	// Of the decoded data
+	const char *data;
+};
+
+static const Codec3Vector vectors[] = {
+	{ "literals", 9, 4, "90df6702257d142442f272df8239d80e",
+		"\x2f\x00\x47\x72\x69\x6d\x00\x00\x00" },
+	{ "short match", 11, 13, "5e15fd7e272cfd391be146e66915d279",
+		"\x0f\x2c\x61\x62\x63\x64\xfc\xfe\x00\x00\x00" },
+	{ "long match", 21, 38, "f8ea4cba02b3cb898dcb8cef543845b7",
+		"\xff\xab\x30\x31\x32\x33\x34\x35\x36\x37\x38\x39\xf6\xf7\xec\xff\x00\x00"
+		"\x00\x00\x00" },
+	{ "run", 10, 206, "325b74d24005da92a47d9562a2a2a13f",
+		"\x25\x01\x78\xff\xf0\xc7\xff\x00\x00\x00" },
+	{ "overlap", 12, 47, "d481ae713d9b8053e817cac96686f8eb",
+		"\x17\x05\x61\x62\x63\xfd\xf0\x27\xfe\x00\x00\x00" },
+	{ "extended length", 79, 318, "7735a5f1c88e5961bf83debf09e662ae",
+		"\xff\xff\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\xff"
+		"\xff\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\xff"
+		"\xff\x20\x21\x22\x23\x24\x25\x26\x27\x28\x29\x2a\x2b\x2c\x2d\x2e\x2f\xff"
+		"\xaf\x30\x31\x32\x33\x34\x35\x36\x37\x38\x39\x3a\x3b\x3c\xc4\xf0\x01\x02"
+		"\x00\xc4\xf0\xff\x00\x00\x00" },
+	{ "many words", 65, 71, "c1eac1c5b99dad4cd41476ffa9b78af7",
+		"\xff\xff\x00\x25\x4a\x6f\x94\xb9\xde\x03\x28\x4d\x72\x97\xbc\xe1\x06\xff"
+		"\xff\x2b\x50\x75\x9a\xbf\xe4\x09\x2e\x53\x78\x9d\xc2\xe7\x0c\x31\x56\xff"
+		"\xff\x7b\xa0\xc5\xea\x0f\x34\x59\x7e\xa3\xc8\xed\x12\x37\x5c\x81\xa6\x43"
+		"\x05\xcb\xf0\x15\xce\x21\xca\xfe\x00\x00\x00" },
+	{ "far offset", 77, 4121, "64672525ba2615e36e7886827658da33",
+		"\xff\xff\x03\x0a\x11\x18\x1f\x26\x2d\x34\x3b\x42\x49\x50\x57\x5e\x65\xaa"
+		"\xaa\x6c\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\xf0"
+		"\xf0\xff\xf0\xf0\xff\xaa\xaa\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0"
+		"\xff\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\xf0\xf0\xff\x0a\x00\xf0\xf0\xff"
+		"\x00\x06\x00\x00\x00" },
+	// Matches starting before the output does
+	{ "short offset before the start", 7, 0, NULL,
+		"\x41\x00\x61\xfe\x00\x00\x00" },
+	{ "long offset before the start", 8, 0, NULL,
+		"\x15\x00\x61\x00\x02\x00\x00\x00" }
+};
+
+static int failures = 0;
+
+static void fail(const Codec3Vector &v, const char *what) {
+	fprintf(stderr, "codec3check: %s: %s\n", v.name, what);
+	failures++;
+}
+
+// Decodes the first size bytes of the stream from a buffer of their own,
+// so reads past them are caught by memory checkers
+static bool decode(const Codec3Vector &v, uint32 size, std::vector<char> &out, uint32 maxBytes) {
+	std::vector<char> in(v.data, v.data + size);
+	out.assign(maxBytes + 1, 0);
+	return decompress_codec3(in.empty() ? NULL : &in[0], size, &out[0], maxBytes);
+}
+
+static bool matchesMd5(const std::vector<char> &data, uint32 size, const char *md5) {
+	Common::md5_context ctx;
+	uint8 digest[16];
+	Common::md5_starts(&ctx);
+	Common::md5_update(&ctx, (const uint8 *)&data[0], size);
+	Common::md5_finish(&ctx, digest);
+	char hex[33];
+	for (int i = 0; i < 16; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+	return strcmp(hex, md5) == 0;
+}
+
+int main() {
+	std::vector<char> out;
+	int checks = 0;
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		const Codec3Vector &v = vectors[i];
+		if (!v.md5) {
+			checks++;
+			if (decode(v, v.size, out, 4096))
+				fail(v, "decodes");
+			continue;
+		}
+
+		checks++;
+		if (!decode(v, v.size, out, v.decodedSize))
+			fail(v, "does not decode");
+		else if (!matchesMd5(out, v.decodedSize, v.md5))
+			fail(v, "decodes to the wrong data");
+		else if (out[v.decodedSize] != 0)
+			fail(v, "writes past the output");
+
+		for (uint32 size = 0; size < v.size; size++) {
+			checks++;
+			if (decode(v, size, out, v.decodedSize)) {
+				fail(v, "decodes truncated");
+				break;
+			}
+		}
+		for (uint32 maxBytes = 0; maxBytes < v.decodedSize; maxBytes++) {
+			checks++;
+			if (decode(v, v.size, out, maxBytes) || out[maxBytes] != 0) {
+				fail(v, "decodes into a buffer too small for it");
+				break;
+			}
+		}
+	}
+	fprintf(stderr, "codec3check: %d of %d checks failed\n", failures, checks);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstring>
+#include <vector>
+#include "dds.h"
+#include "common/endian.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// From the DDS_HEADER documentation
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_FOURCC 0x4
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+
+// Per-channel bounds of the 16 pixels, in BGRA order
+static void getBounds(const uint8 *block, uint8 *lo, uint8 *hi) {
+#if defined(__SSE2__)
+	__m128i r0 = _mm_loadu_si128((const __m128i *)block);
+	__m128i r1 = _mm_loadu_si128((const __m128i *)(block + 16));
+	__m128i r2 = _mm_loadu_si128((const __m128i *)(block + 32));
+	__m128i r3 = _mm_loadu_si128((const __m128i *)(block + 48));
+	__m128i mn = _mm_min_epu8(_mm_min_epu8(r0, r1), _mm_min_epu8(r2, r3));
+	__m128i mx = _mm_max_epu8(_mm_max_epu8(r0, r1), _mm_max_epu8(r2, r3));
+	// Fold the four pixels of each row into the first one
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+	uint32 l = (uint32)_mm_cvtsi128_si32(mn), h = (uint32)_mm_cvtsi128_si32(mx);
+	memcpy(lo, &l, 4);
+	memcpy(hi, &h, 4);
+#else
+	memcpy(lo, block, 4);
+	memcpy(hi, block, 4);
+	for (int i = 4; i < 64; i++) {
+		lo[i & 3] = block[i] < lo[i & 3] ? block[i] : lo[i & 3];
+		hi[i & 3] = block[i] > hi[i & 3] ? block[i] : hi[i & 3];
+	}
+#endif
+}
+
+static inline uint16 toRGB565(const uint8 *c) {
+	// Rounded, truncating would pull every endpoint darker
+	return (((c[2] * 31 + 127) / 255) << 11) | (((c[1] * 63 + 127) / 255) << 5) | ((c[0] * 31 + 127) / 255);
+}
+
+static inline void fromRGB565(uint16 v, int *c) {
+	int r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+	c[0] = (b << 3) | (b >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (r << 3) | (r >> 2);
+}
+
+static void encodeColors(const uint8 *block, const uint8 *lo, const uint8 *hi, uint8 *dst) {
+	// Pull the bounds in by a sixteenth of the range, so the endpoints aren't
+	// spent on the extremes of a few pixels
+	uint8 mn[3], mx[3];
+	for (int c = 0; c < 3; c++) {
+		int inset = (hi[c] - lo[c]) >> 4;
+		mn[c] = lo[c] + inset;
+		mx[c] = hi[c] - inset;
+	}
+	// Each channel of mx is at least that of mn, so c0 >= c1 and the block
+	// uses the four colour mode whenever the endpoints differ
+	uint16 c0 = toRGB565(mx), c1 = toRGB565(mn);
+	WRITE_LE_UINT16(dst, c0);
+	WRITE_LE_UINT16(dst + 2, c1);
+
+	uint32 indices = 0;
+	if (c0 != c1) {
+		int e0[3], e1[3];
+		fromRGB565(c0, e0);
+		fromRGB565(c1, e1);
+		int d[3] = { e0[0] - e1[0], e0[1] - e1[1], e0[2] - e1[2] };
+		int dd = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		// How far along from c1 to c0 in thirds, to the index of that colour
+		static const uint32 remap[4] = { 1, 3, 2, 0 };
+		for (int i = 0; i < 16; i++) {
+			const uint8 *p = block + i * 4;
+			int t = (p[0] - e1[0]) * d[0] + (p[1] - e1[1]) * d[1] + (p[2] - e1[2]) * d[2];
+			t = t < 0 ? 0 : (t > dd ? dd : t);
+			indices |= remap[(6 * t + dd) / (2 * dd)] << (2 * i);
+		}
+	}
+	WRITE_LE_UINT32(dst + 4, indices);
+}
+
+void encodeBC1Block(const uint8 *block, uint8 *dst) {
+	uint8 lo[4], hi[4];
+	getBounds(block, lo, hi);
+	encodeColors(block, lo, hi, dst);
+}
+
+void encodeBC3Block(const uint8 *block, uint8 *dst) {
+	uint8 lo[4], hi[4];
+	getBounds(block, lo, hi);
+
+	// a0 > a1 selects the eight level mode, with a1 as index 1 and a0 as 0
+	int a0 = hi[3], a1 = lo[3];
+	dst[0] = a0;
+	dst[1] = a1;
+	memset(dst + 2, 0, 6);
+	if (a0 != a1) {
+		int range = a0 - a1;
+		for (int half = 0; half < 2; half++) {
+			// Eight 3-bit indices fit in three bytes
+			uint32 bits = 0;
+			for (int i = 0; i < 8; i++) {
+				int a = block[(half * 8 + i) * 4 + 3];
+				int q = ((a - a1) * 14 + range) / (2 * range);
+				uint32 index = q == 7 ? 0 : (q == 0 ? 1 : 8 - q);
+				bits |= index << (3 * i);
+			}
+			dst[2 + half * 3] = bits & 0xff;
+			dst[3 + half * 3] = (bits >> 8) & 0xff;
+			dst[4 + half * 3] = (bits >> 16) & 0xff;
+		}
+	}
+	encodeColors(block, lo, hi, dst + 8);
+}
+
+static uint32 getLevelSize(uint32 width, uint32 height, DDSFormat format) {
+	return ((width + 3) / 4) * ((height + 3) / 4) * (format == kDDSBC1 ? 8 : 16);
+}
+
+uint32 getDDSSize(uint32 width, uint32 height, DDSFormat format, bool mips) {
+	uint32 size = 128 + getLevelSize(width, height, format);
+	while (mips && (width > 1 || height > 1)) {
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		size += getLevelSize(width, height, format);
+	}
+	return size;
+}
+
+static uint8 *encodeLevel(const uint8 *src, int32 pitch, uint32 width, uint32 height, DDSFormat format, uint8 *out) {
+	uint8 block[64];
+	for (uint32 by = 0; by < height; by += 4) {
+		for (uint32 bx = 0; bx < width; bx += 4) {
+			// Blocks over the edge repeat its last row and column
+			for (uint32 y = 0; y < 4; y++) {
+				const uint8 *row = src + (int32)(by + y < height ? by + y : height - 1) * pitch;
+				if (bx + 4 <= width) {
+					memcpy(block + y * 16, row + bx * 4, 16);
+					continue;
+				}
+				for (uint32 x = 0; x < 4; x++)
+					memcpy(block + y * 16 + x * 4, row + (bx + x < width ? bx + x : width - 1) * 4, 4);
+			}
+			if (format == kDDSBC1) {
+				encodeBC1Block(block, out);
+				out += 8;
+			} else {
+				encodeBC3Block(block, out);
+				out += 16;
+			}
+		}
+	}
+	return out;
+}
+
+// Halves the image with a box filter, into dst, stored top-down
+static void downsample(const uint8 *src, int32 pitch, uint32 width, uint32 height, uint8 *dst) {
+	uint32 dw = width > 1 ? width / 2 : 1, dh = height > 1 ? height / 2 : 1;
+	for (uint32 y = 0; y < dh; y++) {
+		const uint8 *r0 = src + (int32)(2 * y) * pitch;
+		const uint8 *r1 = height > 1 ? r0 + pitch : r0;
+		uint8 *d = dst + y * dw * 4;
+		uint32 x = 0;
+#if defined(__SSE2__)
+		if (width > 1) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i two = _mm_set1_epi16(2);
+			for (; x + 2 <= dw; x += 2) {
+				__m128i a = _mm_loadu_si128((const __m128i *)(r0 + x * 8));
+				__m128i b = _mm_loadu_si128((const __m128i *)(r1 + x * 8));
+				// The two rows summed, pixels 0 and 1 in lo, 2 and 3 in hi
+				__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+				lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+				hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+				__m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+				_mm_storel_epi64((__m128i *)(d + x * 4), _mm_packus_epi16(sum, sum));
+			}
+		}
+#endif
+		for (; x < dw; x++) {
+			uint32 x0 = 2 * x, x1 = width > 1 ? x0 + 1 : x0;
+			for (int c = 0; c < 4; c++)
+				d[x * 4 + c] = (r0[x0 * 4 + c] + r0[x1 * 4 + c] + r1[x0 * 4 + c] + r1[x1 * 4 + c] + 2) >> 2;
+		}
+	}
+}
+
+void writeDDS(const uint8 *src, int32 pitch, uint32 width, uint32 height, DDSFormat format, bool mips, uint8 *out) {
+	uint32 levels = 1;
+	for (uint32 w = width, h = height; mips && (w > 1 || h > 1); levels++) {
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+
+	memset(out, 0, 128);
+	WRITE_BE_UINT32(out, MKTAG('D','D','S',' '));
+	WRITE_LE_UINT32(out + 4, 124);
+	WRITE_LE_UINT32(out + 8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_LINEARSIZE |
+			(mips ? DDSD_MIPMAPCOUNT : 0));
+	WRITE_LE_UINT32(out + 12, height);
+	WRITE_LE_UINT32(out + 16, width);
+	WRITE_LE_UINT32(out + 20, getLevelSize(width, height, format));
+	WRITE_LE_UINT32(out + 28, levels);
+	// The pixel format, at 76
+	WRITE_LE_UINT32(out + 76, 32);
+	WRITE_LE_UINT32(out + 80, DDPF_FOURCC);
+	WRITE_BE_UINT32(out + 84, format == kDDSBC1 ? MKTAG('D','X','T','1') : MKTAG('D','X','T','5'));
+	WRITE_LE_UINT32(out + 108, DDSCAPS_TEXTURE | (mips ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0));
+
+	uint8 *p = encodeLevel(src, pitch, width, height, format, out + 128);
+	if (levels == 1)
+		return;
+	// Each level is made from the one before, two of them are kept around
+	std::vector<uint8> level[2];
+	for (uint32 i = 1; i < levels; i++) {
+		uint32 dw = width > 1 ? width / 2 : 1, dh = height > 1 ? height / 2 : 1;
+		std::vector<uint8> &next = level[i & 1];
+		next.resize(dw * dh * 4);
+		downsample(src, pitch, width, height, &next[0]);
+		src = &next[0];
+		pitch = dw * 4;
+		width = dw;
+		height = dh;
+		p = encodeLevel(src, pitch, width, height, format, p);
+	}
+}
@@ -0,0 +1,52 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef DDS_H
+#define DDS_H
+
+#include "common/scummsys.h"
+
+enum DDSFormat {
+	kDDSBC1,	// DXT1, opaque, 8 bytes per 4x4 block
+	kDDSBC3		// DXT5, with alpha, 16 bytes per 4x4 block
+};
+
+/**
+ * Encodes a 4x4 block of 32-bit BGRA pixels, given row by row, as BC1 into
+ * 8 bytes or as BC3 into 16. The endpoints are the inset bounds of the
+ * block's colours, which is fast and close enough for the backgrounds.
+ */
+void encodeBC1Block(const uint8 *block, uint8 *dst);
+void encodeBC3Block(const uint8 *block, uint8 *dst);
+
+/** Size of the DDS file for the image, with all its mip levels if mips */
+uint32 getDDSSize(uint32 width, uint32 height, DDSFormat format, bool mips);
+
+/**
+ * Writes the DDS file of the 32-bit BGRA image into out, which holds
+ * getDDSSize() bytes. pitch is the offset from one row to the one shown
+ * below it, negative for images stored bottom-up. When mips is set every
+ * smaller level down to 1x1 is made with a box filter and stored too.
+ */
+void writeDDS(const uint8 *src, int32 pitch, uint32 width, uint32 height, DDSFormat format, bool mips, uint8 *out);
+
+#endif
@@ -24,18 +24,35 @@
 #include <tools/lua/lundump.h>
 #include <tools/lua/lopcodes.h>
 #include <tools/lua/lzio.h>
+#include <tools/lua/lstate.h>
+#include <tools/lab.h>
+#include <common/getopt.h>
+#include <common/pattern.h>
+#include <common/stats.h>
+#include <common/statsalloc.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <algorithm>
 #include <map>
 #include <queue>
 #include <stack>
 #include <list>
-#include <set>
+#include <vector>
+
+#ifdef POSIX
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 // Provide debug.cpp functions which don't call SDL_Quit.
 void warning(const char *fmt, ...) {
@@ -79,6 +96,48 @@ std::string localname(TProtoFunc *tf, int n) {
 	return s.str();
 }
 
+// Expression nodes are bump-allocated from an arena.  Deleting one only
+// runs its destructor; decompile() gives back everything a function
+// allocated in one go once that function has been printed.
+class ExprArena {
+public:
+  ExprArena() : cur(0), used(CHUNK_SIZE) { }
+  ~ExprArena() {
+    for (size_t i = 0; i < chunks.size(); i++)
+      free(chunks[i]);
+  }
+  struct Mark { size_t cur, used; };
+
+  void *alloc(size_t size) {
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (size > CHUNK_SIZE)
+      error("expression node too large");
+    if (used + size > CHUNK_SIZE) {
+      if (cur == chunks.size()) {
+	char *c = (char *)malloc(CHUNK_SIZE);
+	if (c == NULL)
+	  error("out of memory");
+	chunks.push_back(c);
+      }
+      cur++;
+      used = 0;
+    }
+    void *p = chunks[cur - 1] + used;
+    used += size;
+    return p;
+  }
+  Mark mark() const { Mark m = { cur, used }; return m; }
+  void release(const Mark &m) { cur = m.cur; used = m.used; }
+
+private:
+  enum { CHUNK_SIZE = 64 * 1024 };
+  std::vector<char *> chunks;	// kept for reuse by the next function
+  size_t cur, used;		// chunks in use, bytes used in the last one
+};
+
+// One per thread, so batch workers can decompile side by side
+static LUA_THREAD ExprArena *expr_arena;
+
 class Expression {
 public:
   Expression(Byte *p) : pos(p) { }
@@ -87,6 +146,9 @@ public:
   virtual void print(std::ostream &os) const = 0;
   virtual int precedence() const { return 100; }
   virtual ~Expression() { }
+
+  static void *operator new(size_t size) { return expr_arena->alloc(size); }
+  static void operator delete(void *) { }
 };
 
 inline std::ostream& operator <<(std::ostream &os, const Expression &e) {
@@ -339,9 +401,144 @@ public:
 
 typedef std::stack<Expression *> ExprStack;
 
+// Number of local variables whose definition ends at each position of a
+// function's code
+class LocalDefs {
+public:
+  LocalDefs(TProtoFunc *tf);
+  int count(Byte *p) const {
+    size_t i = p - code;
+    return i < counts.size() ? counts[i] : 0;
+  }
+  void add(Byte *p) {
+    size_t i = p - code;
+    if (i < counts.size())
+      counts[i]++;
+  }
+  void erase(Byte *p) {
+    size_t i = p - code;
+    if (i < counts.size())
+      counts[i] = 0;
+  }
+
+private:
+  Byte *code;
+  std::vector<int> counts;
+};
+
+// Opcodes which come in variants: an X with a byte operand, then X0, X1...
+// implying their operand, then, for some, an XW with a 2-byte one
+struct OpcodeFamily {
+  Byte first;
+  Byte num_implied;
+  bool word;
+};
+
+static const OpcodeFamily opcode_families[] = {
+  { PUSHNIL, 1, false },
+  { PUSHNUMBER, 3, true },
+  { PUSHCONSTANT, 8, true },
+  { PUSHUPVALUE, 2, false },
+  { PUSHLOCAL, 8, false },
+  { GETGLOBAL, 8, true },
+  { GETDOTTED, 8, true },
+  { PUSHSELF, 8, true },
+  { CREATEARRAY, 2, true },
+  { SETLOCAL, 8, false },
+  { SETGLOBAL, 8, true },
+  { SETTABLE, 0, false },
+  { SETLIST, 1, true },		// Offset, the count follows
+  { SETMAP, 1, false },
+  { ONTJMP, 0, true },
+  { ONFJMP, 0, true },
+  { JMP, 0, true },
+  { IFFJMP, 0, true },
+  { IFTUPJMP, 0, true },
+  { IFFUPJMP, 0, true },
+  { CLOSURE, 2, false },
+  { CALLFUNC, 2, false },	// Results, the arguments follow
+  { RETCODE, 0, false },
+  { SETLINE, 0, true },
+  { POP, 2, false }
+};
+
+// Read the instruction at pos and its operand into aux, moving pos past
+// them.  Variants are returned as the first opcode of their family, so
+// PUSHLOCAL3 is PUSHLOCAL with aux 3; other opcodes have aux 0.
+static Byte decode_instr(Byte *&pos, int &aux) {
+  Byte opc = *pos++;
+  aux = 0;
+  for (size_t i = 0; i < sizeof(opcode_families) / sizeof(opcode_families[0]);
+       i++) {
+    const OpcodeFamily &f = opcode_families[i];
+    if (opc < f.first || opc > f.first + f.num_implied + f.word)
+      continue;
+    if (opc == f.first)
+      aux = *pos++;
+    else if (opc <= f.first + f.num_implied)
+      aux = opc - f.first - 1;
+    else {
+      aux = pos[0] | (pos[1] << 8);
+      pos += 2;
+    }
+    return f.first;
+  }
+  return opc;
+}
+
+// Stack slots taken and left by the instructions of decode_instr() which
+// only push values or combine the ones on top.  False for the others.
+static bool stack_effect(Byte opc, int aux, int &pops, int &pushes) {
+  pops = 0;
+  pushes = 1;
+  switch (opc) {
+  case PUSHNIL:
+    pushes = aux + 1;
+    return true;
+  case PUSHNUMBER:
+  case PUSHUPVALUE:
+  case PUSHLOCAL:
+  case GETGLOBAL:
+  case CREATEARRAY:
+    return true;
+  case GETDOTTED:
+  case MINUSOP:
+  case NOTOP:
+    pops = 1;
+    return true;
+  case PUSHSELF:
+    pops = 1;
+    pushes = 2;
+    return true;
+  case GETTABLE:
+  case EQOP:
+  case NEQOP:
+  case LTOP:
+  case LEOP:
+  case GTOP:
+  case GEOP:
+  case ADDOP:
+  case SUBOP:
+  case MULTOP:
+  case DIVOP:
+  case POWOP:
+  case CONCOP:
+    pops = 2;
+    return true;
+  case SETLINE:
+    pushes = 0;
+    return true;
+  default:
+    return false;
+  }
+}
+
 class Decompiler {
 public:
   void decompileRange(Byte *start, Byte *end);
+  static bool is_expr_opc(Byte opc);
+  static void get_else_part(Byte *start, Byte *&if_part_end,
+			    bool &has_else, Byte *&else_part_end);
 
   std::ostream *os;
   ExprStack *stk;
@@ -349,15 +546,12 @@ public:
   std::string indent_str;
   Byte *break_pos;
   Expression **upvals; int num_upvals;
-  std::multiset<Byte *> *local_var_defs;
+  LocalDefs *local_var_defs;
 
 private:
   void do_multi_assign(Byte *&start);
   void do_binary_op(Byte *pos, int prec, bool right_assoc, std::string op);
   void do_unary_op(Byte *pos, int prec, std::string op);
-  static bool is_expr_opc(Byte opc);
-  void get_else_part(Byte *start, Byte *&if_part_end,
-		     bool &has_else, Byte *&else_part_end);
 };
 
 // Scan for a series of assignments
@@ -368,62 +562,31 @@ void Decompiler::do_multi_assign(Byte *&start) {
   bool done;
   int num_tables = 0;
   do {
-    int aux, opc;
+    Byte *instr = start;
+    int aux;
     done = false;
 
-    opc = *start++;
-    switch (opc) {
+    switch (decode_instr(start, aux)) {
     case SETLOCAL:
-      aux = *start++;
-      goto setlocal;
-
-    case SETLOCAL0:
-    case SETLOCAL1:
-    case SETLOCAL2:
-    case SETLOCAL3:
-    case SETLOCAL4:
-    case SETLOCAL5:
-    case SETLOCAL6:
-    case SETLOCAL7:
-      aux = opc - SETLOCAL0;
-    setlocal:
       results.push(new VarExpr(start, localname(tf, aux)));
       break;
 
     case SETGLOBAL:
-      aux = *start++;
-      goto setglobal;
-
-    case SETGLOBAL0:
-    case SETGLOBAL1:
-    case SETGLOBAL2:
-    case SETGLOBAL3:
-    case SETGLOBAL4:
-    case SETGLOBAL5:
-    case SETGLOBAL6:
-    case SETGLOBAL7:
-      aux = opc - SETGLOBAL0;
-      goto setglobal;
-
-    case SETGLOBALW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    setglobal:
       results.push(new VarExpr(start, svalue(tf->consts + aux)));
       break;
 
     case SETTABLE:
-      start++;			// assume offset is correct
-      num_tables++;
+      num_tables++;		// assume offset is correct
       // this needs stuff from farther up the stack, wait until
       // it's available
+      // fall through
 
     case SETTABLE0:
       results.push(new IndexExpr(start, NULL, NULL));
       break;
 
     default:
-      start--;
+      start = instr;
       done = true;
     }
 
@@ -559,7 +722,11 @@ int instr_lens[] = {
   2,				// SETLINE
   3,				// SETLINEW
   2,				// POP
-  1, 1				// POP0,1
+  1, 1,				// POP0,1
+  3, 2,				// LOCALDOTTED, LOCALDOTTEDN
+  3,				// CALLGLOBAL
+  3,				// IFFCMPJMP
+  3				// IFTCMPUPJMP
 };
 
 int get_instr_len(Byte opc) {
@@ -569,6 +736,13 @@ int get_instr_len(Byte opc) {
 		return instr_lens[opc];
 }
 
+LocalDefs::LocalDefs(TProtoFunc *tf) : code(tf->code) {
+  Byte *p = tf->code + 2;
+  while (*p != ENDCODE)
+    p += get_instr_len(*p);
+  counts.resize(p + 1 - code, 0);
+}
+
 bool Decompiler::is_expr_opc(Byte opc) {
   if (opc >= PUSHNIL && opc <= CREATEARRAYW)
     return true;
@@ -595,10 +769,11 @@ void Decompiler::get_else_part(Byte *start, Byte *&if_part_end,
     last_instr = instr_scan;
   if (last_instr != NULL &&
       (*last_instr == JMP || *last_instr == JMPW)) {
+    Byte *pos = last_instr;
+    int aux;
+    decode_instr(pos, aux);
     has_else = true;
-    else_part_end = if_part_end + last_instr[1];
-    if (*last_instr == JMPW)
-      else_part_end += (last_instr[2] << 8);
+    else_part_end = if_part_end + aux;
     if_part_end = last_instr;
   }
 }
@@ -612,11 +787,12 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
 
   for (Byte *scan = start; end == NULL || scan < end;
        scan += get_instr_len(*scan)) {
-    if (*scan == IFFUPJMP)
-      rev_iffupjmp_map[scan + 2 - scan[1]] = scan;
-    else if (*scan == IFFUPJMPW)
-      rev_iffupjmp_map[scan + 3 - (scan[1] | (scan[2] << 8))] = scan;
-    else if (*scan == ENDCODE)
+    Byte *next = scan;
+    int aux;
+    Byte opc = decode_instr(next, aux);
+    if (opc == IFFUPJMP)
+      rev_iffupjmp_map[next - aux] = scan;
+    else if (opc == ENDCODE)
       break;
   }
 
@@ -672,60 +848,23 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       continue;
     }
 
-    Byte opc = *start++;
+    Byte *instr = start;
     int aux;
 
-    switch (opc) {
+    switch (decode_instr(start, aux)) {
     case ENDCODE:
       return;
 
     case PUSHNIL:
-      aux = *start++;
-      goto pushnil;
-
-    case PUSHNIL0:
-      aux = 0;
-    pushnil:
       for (int i = 0; i <= aux; i++)
 	stk->push(new VarExpr(start, "nil")); // Cheat a little :)
       break;
 
     case PUSHNUMBER:
-      aux = *start++;
-      goto pushnumber;
-
-    case PUSHNUMBER0:
-    case PUSHNUMBER1:
-    case PUSHNUMBER2:
-      aux = opc - PUSHNUMBER0;
-      goto pushnumber;
-
-    case PUSHNUMBERW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    pushnumber:
       stk->push(new NumberExpr(start, aux));
       break;
 
     case PUSHCONSTANT:
-      aux = *start++;
-      goto pushconst;
-
-    case PUSHCONSTANT0:
-    case PUSHCONSTANT1:
-    case PUSHCONSTANT2:
-    case PUSHCONSTANT3:
-    case PUSHCONSTANT4:
-    case PUSHCONSTANT5:
-    case PUSHCONSTANT6:
-    case PUSHCONSTANT7:
-      aux = opc - PUSHCONSTANT0;
-      goto pushconst;
-
-    case PUSHCONSTANTW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    pushconst:
       switch (ttype(tf->consts + aux)) {
       case LUA_T_STRING:
 	stk->push(new StringExpr(start, tsvalue(tf->consts + aux)));
@@ -743,13 +882,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case PUSHUPVALUE:
-      aux = *start++;
-      goto pushupvalue;
-
-    case PUSHUPVALUE0:
-    case PUSHUPVALUE1:
-      aux = opc - PUSHUPVALUE0;
-    pushupvalue:
       {
 	if (aux >= num_upvals) {
 	  *os << indent_str << "error: invalid upvalue #"
@@ -763,41 +895,10 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case PUSHLOCAL:
-      aux = *start++;
-      goto pushlocal;
-
-    case PUSHLOCAL0:
-    case PUSHLOCAL1:
-    case PUSHLOCAL2:
-    case PUSHLOCAL3:
-    case PUSHLOCAL4:
-    case PUSHLOCAL5:
-    case PUSHLOCAL6:
-    case PUSHLOCAL7:
-      aux = opc - PUSHLOCAL0;
-    pushlocal:
       stk->push(new VarExpr(start, localname(tf, aux)));
       break;
 
     case GETGLOBAL:
-      aux = *start++;
-      goto getglobal;
-
-    case GETGLOBAL0:
-    case GETGLOBAL1:
-    case GETGLOBAL2:
-    case GETGLOBAL3:
-    case GETGLOBAL4:
-    case GETGLOBAL5:
-    case GETGLOBAL6:
-    case GETGLOBAL7:
-      aux = opc - GETGLOBAL0;
-      goto getglobal;
-
-    case GETGLOBALW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    getglobal:
       stk->push(new VarExpr(start, svalue(tf->consts + aux)));
       break;
 
@@ -811,24 +912,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case GETDOTTED:
-      aux = *start++;
-      goto getdotted;
-
-    case GETDOTTED0:
-    case GETDOTTED1:
-    case GETDOTTED2:
-    case GETDOTTED3:
-    case GETDOTTED4:
-    case GETDOTTED5:
-    case GETDOTTED6:
-    case GETDOTTED7:
-      aux = opc - GETDOTTED0;
-      goto getdotted;
-
-    case GETDOTTEDW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    getdotted:
       {
 	Expression *tbl = stk->top(); stk->pop();
 	stk->push(new DotIndexExpr(start, tbl, new StringExpr
@@ -837,24 +920,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case PUSHSELF:
-      aux = *start++;
-      goto pushself;
-
-    case PUSHSELF0:
-    case PUSHSELF1:
-    case PUSHSELF2:
-    case PUSHSELF3:
-    case PUSHSELF4:
-    case PUSHSELF5:
-    case PUSHSELF6:
-    case PUSHSELF7:
-      aux = opc - PUSHSELF0;
-      goto pushself;
-
-    case PUSHSELFW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    pushself:
       {
 	Expression *tbl = stk->top(); stk->pop();
 	stk->push(new SelfExpr(start, tbl, new StringExpr
@@ -865,53 +930,19 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case CREATEARRAY:
-      start++;
-      goto createarray;
-
-    case CREATEARRAY0:
-    case CREATEARRAY1:
-      goto createarray;
-
-    case CREATEARRAYW:
-      start += 2;
-    createarray:
       stk->push(new ArrayExpr(start));
       break;
 
     case SETLOCAL:
-    case SETLOCAL0:
-    case SETLOCAL1:
-    case SETLOCAL2:
-    case SETLOCAL3:
-    case SETLOCAL4:
-    case SETLOCAL5:
-    case SETLOCAL6:
-    case SETLOCAL7:
     case SETGLOBAL:
-    case SETGLOBAL0:
-    case SETGLOBAL1:
-    case SETGLOBAL2:
-    case SETGLOBAL3:
-    case SETGLOBAL4:
-    case SETGLOBAL5:
-    case SETGLOBAL6:
-    case SETGLOBAL7:
-    case SETGLOBALW:
     case SETTABLE0:
     case SETTABLE:
-      start--;
+      start = instr;
       do_multi_assign(start);
       break;
 
     case SETLIST:
-      start++;			// assume offset is correct
-      goto setlist;
-
-    case SETLISTW:
-      start += 2;
-
-    case SETLIST0:
-    setlist:
+      // assume offset is correct
       aux = *start++;
       {
 	ArrayExpr::mapping_list new_mappings;
@@ -931,12 +962,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case SETMAP:
-      aux = *start++;
-      goto setmap;
-
-    case SETMAP0:
-      aux = 0;
-    setmap:
       {
 	ArrayExpr::mapping_list new_mappings;
 	for (int i = 0; i <= aux; i++) {
@@ -1012,13 +1037,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case ONTJMP:
-      aux = *start++;
-      goto ontjmp;
-
-    case ONTJMPW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    ontjmp:
       // push_expr_1 ontjmp(label) push_expr_2 label:  -> expr_1 || expr_2
       decompileRange(start, start + aux);
       do_binary_op(start + aux, 0, false, " or ");
@@ -1026,13 +1044,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case ONFJMP:
-      aux = *start++;
-      goto onfjmp;
-
-    case ONFJMPW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    onfjmp:
       // push_expr_1 onfjmp(label) push_expr_2 label:  -> expr_2 && expr_2
       decompileRange(start, start + aux);
       do_binary_op(start + aux, 0, false, " and ");
@@ -1040,13 +1051,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case JMP:
-      aux = *start++;
-      goto jmp;
-
-    case JMPW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    jmp:
       {
 	Byte *dest = start + aux;
 	if (dest == break_pos) {
@@ -1085,13 +1089,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case IFFJMP:
-      aux = *start++;
-      goto iffjmp;
-
-    case IFFJMPW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    iffjmp:
       {
 	// Output an if/end, if/else/end, if/elseif/else/end, ... statement
 	Byte *if_part_end = start + aux;
@@ -1125,14 +1122,8 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
 	    // the way through
 	    Byte *new_start, *new_if_part_end, *new_else_part_end;
 	    bool new_has_else;
-	    if (*instr_scan == IFFJMP) {
-	      aux = instr_scan[1];
-	      new_start = instr_scan + 2;
-	    }
-	    else {
-	      aux = instr_scan[1] | (instr_scan[2] << 8);
-	      new_start = instr_scan + 3;
-	    }
+	    new_start = instr_scan;
+	    decode_instr(new_start, aux);
 	    new_if_part_end = new_start + aux;
 	    get_else_part(new_start, new_if_part_end, new_has_else,
 			  new_else_part_end);
@@ -1160,13 +1151,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case CLOSURE:
-      aux = *start++;
-      goto closure;
-
-    case CLOSURE0:
-    case CLOSURE1:
-      aux = opc - CLOSURE0;
-    closure:
       {
 	FuncExpr *f = dynamic_cast<FuncExpr *>(stk->top());
 	if (f == NULL) {
@@ -1184,13 +1168,6 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case CALLFUNC:
-      aux = *start++;
-      goto callfunc;
-
-    case CALLFUNC0:
-    case CALLFUNC1:
-      aux = opc - CALLFUNC0;
-    callfunc:
       {
 	int num_args = *start++;
 	FuncCallExpr *e = new FuncCallExpr(start);
@@ -1218,7 +1195,7 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
 
     case RETCODE:
       {
-	int num_rets = stk->size() + tf->code[1] - *start++;
+	int num_rets = stk->size() + tf->code[1] - aux;
 	ExprStack rets;
 
 	for (int i = 0; i < num_rets; i++) {
@@ -1238,25 +1215,11 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
       break;
 
     case SETLINE:
-      aux = *start++;
-      goto setline;
-
-    case SETLINEW:
-      aux = start[0] | (start[1] << 8);
-      start += 2;
-    setline:
       break;			// ignore line info
 
     case POP:
-      aux = *start++;
-      goto pop;
-
-    case POP0:
-    case POP1:
-      aux = opc - POP0;
-    pop:
       for (int i = 0; i <= aux; i++) {
-	local_var_defs->insert(stk->top()->pos);
+	local_var_defs->add(stk->top()->pos);
 	delete stk->top(); stk->pop();
       }
       break;
@@ -1268,20 +1231,275 @@ void Decompiler::decompileRange(Byte *start, Byte *end) {
   }
 }
   
+// Find where local variables are defined without decompiling anything.
+// This follows the same path through the code as
+// Decompiler::decompileRange, but only keeps the position each stack
+// entry was pushed at: whatever a POP removes, or the function leaves
+// on the stack, is a local variable slot.
+class LocalScanner {
+public:
+  void scanRange(Byte *start, Byte *end);
+
+  std::vector<Byte *> *stk;
+  TProtoFunc *tf;
+  Byte *break_pos;
+  LocalDefs *local_var_defs;
+
+private:
+  void scan_multi_assign(Byte *&start);
+  void push(Byte *pos, int n) { stk->insert(stk->end(), n, pos); }
+  void pop(int n) {
+    if (n > (int)stk->size())
+      n = stk->size();
+    if (n > 0)
+      stk->resize(stk->size() - n);
+  }
+};
+
+void LocalScanner::scan_multi_assign(Byte *&start) {
+  int num_indexed = 0, num_tables = 0;
+  bool done;
+  do {
+    Byte *instr = start;
+    int aux;
+    done = false;
+    switch (decode_instr(start, aux)) {
+    case SETLOCAL:
+    case SETGLOBAL:
+      break;
+
+    case SETTABLE:
+      num_tables++;
+      // fall through
+
+    case SETTABLE0:
+      num_indexed++;
+      break;
+
+    default:
+      start = instr;
+      done = true;
+    }
+    if (! done)
+      pop(1);
+  } while (! done);
+
+  if (num_tables > 0 && (*start == POP || *start == POP0 || *start == POP1)) {
+    start++;
+    if (start[-1] == POP)
+      start++;
+  }
+  pop(2 * num_indexed);
+}
+
+void LocalScanner::scanRange(Byte *start, Byte *end) {
+  std::map<Byte *, Byte *> rev_iffupjmp_map;
+
+  for (Byte *scan = start; end == NULL || scan < end;
+       scan += get_instr_len(*scan)) {
+    Byte *next = scan;
+    int aux;
+    Byte opc = decode_instr(next, aux);
+    if (opc == IFFUPJMP)
+      rev_iffupjmp_map[next - aux] = scan;
+    else if (opc == ENDCODE)
+      break;
+  }
+
+  while (end == NULL || start < end) {
+    std::map<Byte *, Byte *>::iterator rep = rev_iffupjmp_map.find(start);
+    if (rep != rev_iffupjmp_map.end()) {
+      LocalScanner body = *this;
+      body.break_pos = rep->second + get_instr_len(*rep->second);
+      body.scanRange(start, rep->second);
+      pop(1);
+      start = body.break_pos;
+      continue;
+    }
+
+    Byte *instr = start;
+    int aux, pops, pushes;
+    Byte opc = decode_instr(start, aux);
+
+    if (stack_effect(opc, aux, pops, pushes)) {
+      pop(pops);
+      push(start, pushes);
+      continue;
+    }
+
+    switch (opc) {
+    case ENDCODE:
+      return;
+
+    case PUSHCONSTANT:
+      switch (ttype(tf->consts + aux)) {
+      case LUA_T_STRING:
+      case LUA_T_NUMBER:
+      case LUA_T_PROTO:
+	push(start, 1);
+	break;
+      default:
+	break;
+      }
+      break;
+
+    case SETLOCAL:
+    case SETGLOBAL:
+    case SETTABLE0:
+    case SETTABLE:
+      start = instr;
+      scan_multi_assign(start);
+      break;
+
+    case SETLIST:
+      // the table keeps its slot but moves its position past the setlist
+      pop(*start++);
+      if (! stk->empty())
+	stk->back() = start;
+      break;
+
+    case SETMAP:
+      pop(2 * (aux + 1));
+      if (! stk->empty())
+	stk->back() = start;
+      break;
+
+    case ONTJMP:
+    case ONFJMP:
+      scanRange(start, start + aux);
+      pop(2);
+      push(start + aux, 1);
+      start = start + aux;
+      break;
+
+    case JMP:
+      {
+	Byte *dest = start + aux;
+	if (dest == break_pos)
+	  break;
+
+	Byte *while_cond_end;
+	for (while_cond_end = dest; end == NULL || while_cond_end < end;
+	     while_cond_end += get_instr_len(*while_cond_end))
+	  if (*while_cond_end == IFTUPJMP || *while_cond_end == IFTUPJMPW)
+	    break;
+
+	scanRange(dest, while_cond_end);
+	pop(1);
+
+	LocalScanner body = *this;
+	body.break_pos = while_cond_end + get_instr_len(*while_cond_end);
+	body.scanRange(start, dest);
+	start = body.break_pos;
+      }
+      break;
+
+    case IFFJMP:
+      {
+	Byte *if_part_end = start + aux;
+	pop(1);
+
+	bool has_else;
+	Byte *else_part_end;
+	Decompiler::get_else_part(start, if_part_end, has_else, else_part_end);
+
+      scan_if:
+	scanRange(start, if_part_end);
+	start = start + aux;
+
+	if (has_else) {
+	  // Same elseif detection as the decompiler, so conditions are
+	  // scanned in the order they will be printed
+	  Byte *instr_scan = start;
+	  while (Decompiler::is_expr_opc(*instr_scan) &&
+		 (end == NULL || instr_scan < else_part_end))
+	    instr_scan += get_instr_len(*instr_scan);
+	  if ((end == NULL || instr_scan < else_part_end) &&
+	      (*instr_scan == IFFJMP || *instr_scan == IFFJMPW)) {
+	    Byte *new_start, *new_if_part_end, *new_else_part_end;
+	    bool new_has_else;
+	    new_start = instr_scan;
+	    decode_instr(new_start, aux);
+	    new_if_part_end = new_start + aux;
+	    Decompiler::get_else_part(new_start, new_if_part_end, new_has_else,
+				      new_else_part_end);
+	    if (new_if_part_end == else_part_end ||
+		(new_has_else && new_else_part_end == else_part_end)) {
+	      scanRange(start, instr_scan);
+	      pop(1);
+
+	      start = new_start;
+	      if_part_end = new_if_part_end;
+	      has_else = new_has_else;
+	      else_part_end = new_else_part_end;
+	      goto scan_if;
+	    }
+	  }
+	  scanRange(start, else_part_end);
+	  start = else_part_end;
+	}
+      }
+      break;
+
+    case CLOSURE:
+      // the function keeps its position, its upvalues go
+      if (! stk->empty()) {
+	Byte *f = stk->back();
+	pop(aux + 1);
+	push(f, 1);
+      }
+      break;
+
+    case CALLFUNC:
+      pop(*start++ + 1);
+      if (aux == 255)
+	aux = 1;
+      push(start, aux);
+      break;
+
+    case RETCODE:
+      pop(stk->size() + tf->code[1] - aux);
+      break;
+
+    case POP:
+      for (int i = 0; i <= aux && ! stk->empty(); i++) {
+	local_var_defs->add(stk->back());
+	pop(1);
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
 // Decompile the body of a function.
 void decompile(std::ostream &os, TProtoFunc *tf, std::string indent_str,
 	       Expression **upvals, int num_upvals) {
   Byte *instr = tf->code + 2;
-  ExprStack s;
-  std::ostringstream first_time;
-  std::multiset<Byte *> loc_vars;
+  if (expr_arena == NULL)
+    expr_arena = new ExprArena;
+  ExprArena::Mark arena_mark = expr_arena->mark();
+  LocalDefs loc_vars(tf);
 
   //set the maximum precision, in order to avoid round errors with float numbers
   os.precision(8);
 
-  // First, do a preliminary pass to see where local variables are defined
+  // First, see where local variables are defined
+  std::vector<Byte *> slots;
+  LocalScanner scan;
+  scan.stk = &slots;
+  scan.tf = tf;
+  scan.break_pos = NULL;
+  scan.local_var_defs = &loc_vars;
+  scan.scanRange(instr, NULL);
+  for (size_t i = 0; i < slots.size(); i++)
+    loc_vars.add(slots[i]);
+
+  ExprStack s;
   Decompiler dc;
-  dc.os = &first_time;
+  dc.os = &os;
   dc.stk = &s;
   dc.tf = tf;
   dc.indent_str = indent_str;
@@ -1291,36 +1509,297 @@ void decompile(std::ostream &os, TProtoFunc *tf, std::string indent_str,
   dc.local_var_defs = &loc_vars;
   dc.decompileRange(instr, NULL);
 
-  if (s.empty() && loc_vars.empty()) {
-    // OK, it didn't actually have any local variables.  Just output
-    // the results right now.
-    os << first_time.str();
+  while (! s.empty()) {
+    delete s.top(); s.pop();
+  }
+  expr_arena->release(arena_mark);
+}
+
+// Batch mode: decompile every script in a lab or a directory tree
+struct BatchFile {
+  std::string name;		// entry name, or path relative to the directory
+  int index;			// entry in the lab, -1 for a file
+  bool ok;
+  uint32 size;
+  double seconds;
+};
+
+struct BatchJob {
+  Lab *lab;
+  std::string in_dir, out_dir;
+  std::vector<BatchFile> files;
+  size_t next;
+#ifdef POSIX
+  pthread_mutex_t lock;
+#endif
+};
+
+static double now() {
+#ifdef POSIX
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static bool byName(const BatchFile &a, const BatchFile &b) {
+  return a.name < b.name;
+}
+
+static void addFile(BatchJob &job, const std::string &name, int index) {
+  if (! Common::matchPattern("*.lua", name.c_str()))
+    return;
+  BatchFile f;
+  f.name = name;
+  f.index = index;
+  f.ok = false;
+  f.size = 0;
+  f.seconds = 0;
+  job.files.push_back(f);
+}
+
+static void collectDir(BatchJob &job, const std::string &prefix) {
+  std::string path = job.in_dir + "/" + prefix;
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL) {
+    warning("can't read directory %s", path.c_str());
     return;
   }
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+      continue;
+    std::string name = prefix + d->d_name;
+    struct stat st;
+    if (stat((job.in_dir + "/" + name).c_str(), &st) != 0)
+      continue;
+    if (st.st_mode & S_IFDIR)
+      collectDir(job, name + "/");
+    else
+      addFile(job, name, -1);
+  }
+  closedir(dir);
+}
 
-  // See where the local variables were defined.
-  while (! s.empty()) {
-    loc_vars.insert(s.top()->pos);
-    delete s.top(); s.pop();
+static bool readFile(const std::string &path, std::vector<char> &buf) {
+  Common::StatsPhase phase(Common::kStatsOpen);
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf.resize(size > 0 ? size : 1);
+  bool ok = size >= 0 && fread(&buf[0], 1, size, f) == (size_t)size;
+  fclose(f);
+  buf.resize(size > 0 ? size : 0);
+  if (ok)
+    Common::addStatsRead(size);
+  return ok;
+}
+
+// Undump a chunk from memory, returning NULL instead of exiting on errors
+static TProtoFunc *undumpBuffer(const char *data, uint32 size,
+				const char *name) {
+  Common::StatsPhase phase(Common::kStatsDecode);
+  jmp_buf errorJmp;
+  TProtoFunc *volatile tf = NULL;
+  jmp_buf *volatile oldErr = L->errorJmp;
+  L->errorJmp = &errorJmp;
+  if (setjmp(errorJmp) == 0) {
+    ZIO z;
+    luaZ_mopen(&z, data, size, name);
+    tf = luaU_undump1(&z);
   }
+  L->errorJmp = oldErr;
+  return tf;
+}
 
-  // Now do the real decompilation
-  dc.os = &os;
-  dc.decompileRange(instr, NULL);
+// Entry names may carry a path, which is flattened into the output directory
+static std::string outputName(const BatchJob *job, const std::string &name) {
+  std::string file = name;
+  for (size_t i = 0; i < file.size(); i++) {
+    if (file[i] == '/' || file[i] == '\\' || file[i] == ':')
+      file[i] = '_';
+  }
+  return job->out_dir + "/" + file;
+}
 
-  while (! s.empty()) {
-    delete s.top(); s.pop();
+static bool decompileFile(const BatchJob *job, BatchFile &f) {
+  std::vector<char> buf;
+  const char *data;
+  if (f.index >= 0)
+    data = job->lab->getEntryData(f.index, f.size);
+  else {
+    if (! readFile(job->in_dir + "/" + f.name, buf) || buf.empty())
+      return false;
+    data = &buf[0];
+    f.size = buf.size();
+  }
+  if (data == NULL || f.size == 0)
+    return false;
+
+  TProtoFunc *tf = undumpBuffer(data, f.size, f.name.c_str());
+  if (tf == NULL)
+    return false;
+  std::ofstream out(outputName(job, f.name).c_str(),
+		    std::ios::out | std::ios::binary);
+  if (! out)
+    return false;
+  {
+    Common::StatsPhase phase(Common::kStatsConvert);
+    decompile(out, tf, "", NULL, 0);
   }
+  Common::addStatsWritten(out.tellp());
+  out.close();
+  Common::addStatsFiles();
+  return ! out.fail();
+}
+
+// Each worker runs its own Lua state, so undumped chunks never meet
+static void *batchWorker(void *arg) {
+  BatchJob *job = (BatchJob *)arg;
+  lua_open();
+  for (;;) {
+#ifdef POSIX
+    pthread_mutex_lock(&job->lock);
+#endif
+    size_t i = job->next++;
+#ifdef POSIX
+    pthread_mutex_unlock(&job->lock);
+#endif
+    if (i >= job->files.size())
+      break;
+
+    BatchFile &f = job->files[i];
+    double start = now();
+    f.ok = decompileFile(job, f);
+    f.seconds = now() - start;
+    lua_collectgarbage(0);	// drop the chunk before the next one
+  }
+  lua_close();
+  delete expr_arena;
+  expr_arena = NULL;
+  return NULL;
+}
+
+static int batch(const char *input, const char *out_dir, int jobs) {
+  BatchJob job;
+  job.lab = NULL;
+  job.out_dir = out_dir;
+  job.next = 0;
+
+  struct stat st;
+  if (stat(input, &st) != 0) {
+    perror(input);
+    return 1;
+  }
+  if (st.st_mode & S_IFDIR) {
+    job.in_dir = input;
+    collectDir(job, "");
+    std::sort(job.files.begin(), job.files.end(), byName);
+  } else {
+    job.lab = new Lab(input, false, true);
+    for (uint32 i = 0; i < job.lab->getNumEntries(); i++)
+      addFile(job, job.lab->getEntryName(i), i);
+  }
+
+  if (stat(out_dir, &st) == 0 ? ! (st.st_mode & S_IFDIR)
+      : mkdir(out_dir, 0755) != 0) {
+    fprintf(stderr, "Unable to create directory %s\n", out_dir);
+    delete job.lab;
+    return 1;
+  }
+
+  double start = now();
+#ifdef POSIX
+  pthread_mutex_init(&job.lock, NULL);
+  // Without a mapping all lab reads go through one shared buffer
+  if (job.lab != NULL && ! job.lab->isMapped())
+    jobs = 1;
+  if (jobs > (int)job.files.size())
+    jobs = job.files.size() > 0 ? job.files.size() : 1;
+  pthread_t *threads = new pthread_t[jobs];
+  int started = 0;
+  for (int t = 1; t < jobs; t++) {
+    if (pthread_create(&threads[started], NULL, batchWorker, &job) == 0)
+      ++started;
+  }
+  batchWorker(&job);
+  for (int t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  delete[] threads;
+  pthread_mutex_destroy(&job.lock);
+  jobs = started + 1;
+#else
+  jobs = 1;
+  batchWorker(&job);
+#endif
+  double elapsed = now() - start;
+
+  int failed = 0;
+  double bytes = 0, seconds = 0;
+  for (size_t i = 0; i < job.files.size(); i++) {
+    const BatchFile &f = job.files[i];
+    printf("%-40s %10u %10.3f%s\n", f.name.c_str(), f.size, f.seconds,
+	   f.ok ? "" : "  FAILED");
+    if (! f.ok)
+      failed++;
+    bytes += f.size;
+    seconds += f.seconds;
+  }
+  printf("%d file%s, %d failed, %.0f bytes, %.3f seconds\n",
+	 (int)job.files.size(), job.files.size() == 1 ? "" : "s", failed,
+	 bytes, seconds);
+  for (size_t i = 0; i < job.files.size(); i++) {
+    if (! job.files[i].ok)
+      printf("Could not decompile %s\n", job.files[i].name.c_str());
+  }
+  printf("%.3f seconds elapsed with %d thread%s\n", elapsed, jobs,
+	 jobs == 1 ? "" : "s");
+
+  delete job.lab;
+  return failed ? 1 : 0;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: delua file.lua\n"
+	  "       delua [-j N] <labfile|directory> <outputdir>\n"
+	  "The second form decompiles every *.lua in the lab or the directory\n"
+	  "tree into outputdir and prints the time taken for each file\n"
+	  "\t-j N\tDecompile with N threads\n");
 }
 
 int main(int argc, char *argv[]) {
-  int filename_pos = 1;
+  int jobs = 1;
+  int c;
+  Common::initStats("delua", argc, argv);
+  while ((c = getopt(argc, argv, "j:h")) != -1) {
+    switch (c) {
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1) {
+	usage();
+	exit(1);
+      }
+      break;
+    default:
+      usage();
+      exit(1);
+    }
+  }
+  argc -= optind;
+  argv += optind;
 
-  if (argc != filename_pos + 1) {
-    fprintf(stderr, "Usage: delua file.lua\n");
+  if (argc == 2)
+    return batch(argv[0], argv[1], jobs);
+  if (argc != 1) {
+    usage();
     exit(1);
   }
-  char *filename = argv[filename_pos];
+  char *filename = argv[0];
   FILE *f = fopen(filename, "rb");
   if (f == NULL) {
     perror(filename);
@@ -1330,7 +1809,12 @@ int main(int argc, char *argv[]) {
   lua_open();
   ZIO z;
   luaZ_Fopen(&z, f, filename);
-  TProtoFunc *tf = luaU_undump1(&z);
+  TProtoFunc *tf;
+  {
+    Common::StatsPhase phase(Common::kStatsDecode);
+    tf = luaU_undump1(&z);
+    Common::addStatsRead(ftell(f));
+  }
   fclose(f);
 
   if (tf == NULL) {
@@ -1338,7 +1822,11 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  decompile(std::cout, tf, "", NULL, 0);
+  {
+    Common::StatsPhase phase(Common::kStatsConvert);
+    decompile(std::cout, tf, "", NULL, 0);
+  }
+  Common::addStatsFiles();
 
   lua_close();
   return 0;
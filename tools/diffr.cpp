@@ -49,158 +49,198 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 #include "common/endian.h"
 #include "common/zlib.h"
+#include "common/compress.h"
 #include "common/md5.h"
+#include "common/xxhash.h"
+#include "common/xor.h"
 #include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+#include "tools/lab.h"
+#include "tools/suffixsort.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(int32 *I, int32 *V, int32 start, int32 len, int32 h) {
-	int32 i, j, k, x, tmp, jj, kk;
-
-	if (len < 16) {
-		for (k = start; k < start + len; k += j) {
-			j = 1;
-			x = V[I[k] + h];
-			for (i = 1; k + i < start + len; i++) {
-				if (V[I[k + i] + h] < x) {
-					x = V[I[k + i] + h];
-					j = 0;
+/**
+ * The patch for one range of the new file, diffed as if the range were a
+ * file of its own. Ranges start at old position 0, the last jump of every
+ * range but the last is fixed up to get back there when they are joined.
+ */
+struct DiffChunk {
+	int32 start, size;
+	std::vector<int32> ctrl;	// triples of diff length, extra length, old jump
+	int32 endOld;				// old position after the diff of the last triple
+	byte *db, *eb;
+	int32 dblen, eblen;
+};
+
+static void diffChunk(int32 *I, byte *old, int32 oldsize, byte *newData, bool mix, DiffChunk *chunk) {
+	Common::StatsPhase phase(Common::kStatsConvert);
+	byte *new_block = newData + chunk->start;
+	int32 newsize = chunk->size;
+	int32 scan, pos, len;
+	int32 lastscan, lastpos, lastoffset;
+	int32 oldscore, scsc;
+	int32 s, Sf, lenf, Sb, lenb;
+	int32 overlap, Ss, lens;
+	int32 i;
+	byte *db = chunk->db, *eb = chunk->eb;
+	int32 dblen = 0, eblen = 0;
+
+	scan = 0;
+	len = 0;
+	pos = 0;
+	lastscan = 0;
+	lastpos = 0;
+	lastoffset = 0;
+	chunk->endOld = 0;
+	while (scan < newsize) {
+		oldscore = 0;
+
+		for (scsc = scan += len; scan < newsize; scan++) {
+			len = search(I, old, oldsize, new_block + scan, newsize - scan, &pos);
+
+			for (; scsc < scan + len; scsc++)
+				if ((scsc + lastoffset < oldsize) &&
+				        (old[scsc + lastoffset] == new_block[scsc]))
+					oldscore++;
+
+			if (((len == oldscore) && (len != 0)) ||
+			        (len > oldscore + 8)) break;
+
+			if ((scan + lastoffset < oldsize) &&
+			        (old[scan + lastoffset] == new_block[scan]))
+				oldscore--;
+		};
+
+		if ((len != oldscore) || (scan == newsize)) {
+			s = 0;
+			Sf = 0;
+			lenf = 0;
+			for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
+				if (old[lastpos + i] == new_block[lastscan + i]) s++;
+				i++;
+				if (s * 2 - i > Sf * 2 - lenf) {
+					Sf = s;
+					lenf = i;
 				};
-				if (V[I[k + i] + h] == x) {
-					tmp = I[k + j];
-					I[k + j] = I[k + i];
-					I[k + i] = tmp;
-					j++;
+			};
+
+			lenb = 0;
+			if (scan < newsize) {
+				s = 0;
+				Sb = 0;
+				for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
+					if (old[pos - i] == new_block[scan - i]) s++;
+					if (s * 2 - i > Sb * 2 - lenb) {
+						Sb = s;
+						lenb = i;
+					};
 				};
 			};
-			for (i = 0; i < j; i++) V[I[k + i]] = k + j - 1;
-			if (j == 1) I[k] = -1;
-		};
-		return;
-	};
 
-	x = V[I[start + len/2] + h];
-	jj = 0;
-	kk = 0;
-	for (i = start; i < start + len; i++) {
-		if (V[I[i] + h] < x) jj++;
-		if (V[I[i] + h] == x) kk++;
-	};
-	jj += start;
-	kk += jj;
-
-	i = start;
-	j = 0;
-	k = 0;
-	while (i < jj) {
-		if (V[I[i] + h] < x) {
-			i++;
-		} else if (V[I[i] + h] == x) {
-			tmp = I[i];
-			I[i] = I[jj + j];
-			I[jj + j] = tmp;
-			j++;
-		} else {
-			tmp = I[i];
-			I[i] = I[kk + k];
-			I[kk + k] = tmp;
-			k++;
-		};
-	};
+			if (lastscan + lenf > scan - lenb) {
+				overlap = (lastscan + lenf) - (scan - lenb);
+				s = 0;
+				Ss = 0;
+				lens = 0;
+				for (i = 0; i < overlap; i++) {
+					if (new_block[lastscan + lenf - overlap + i] ==
+					        old[lastpos + lenf - overlap + i]) s++;
+					if (new_block[scan - lenb + i] ==
+					        old[pos - lenb + i]) s--;
+					if (s > Ss) {
+						Ss = s;
+						lens = i + 1;
+					};
+				};
 
-	while (jj + j < kk) {
-		if (V[I[jj + j] + h] == x) {
-			j++;
-		} else {
-			tmp = I[jj + j];
-			I[jj + j] = I[kk + k];
-			I[kk + k] = tmp;
-			k++;
-		};
-	};
+				lenf += lens - overlap;
+				lenb -= lens;
+			};
 
-	if (jj > start) split(I, V, start, jj - start, h);
+			// The forward extension never runs past the end of old, so
+			// the whole run is XORed in one go
+			Common::xorBuffers(db + dblen, new_block + lastscan, old + lastpos, lenf);
+			dblen += lenf;
 
-	for (i = 0; i < kk - jj; i++) V[I[jj + i]] = kk - 1;
-	if (jj == kk - 1) I[jj] = -1;
+			int32 extra = (scan - lenb) - (lastscan + lenf);
+			if (!mix) {
+				memcpy(eb + eblen, new_block + lastscan + lenf, extra);
+				eblen += extra;
+			} else {
+				memcpy(db + dblen, new_block + lastscan + lenf, extra);
+				dblen += extra;
+			}
 
-	if (start + len > kk) split(I, V, kk, start + len - kk, h);
-}
+			chunk->ctrl.push_back(lenf);
+			chunk->ctrl.push_back((scan - lenb) - (lastscan + lenf));
+			chunk->ctrl.push_back((pos - lenb) - (lastpos + lenf));
+			chunk->endOld = lastpos + lenf;
 
-static void qsufsort(int32 *I, int32 *V, byte *old, int32 oldsize) {
-	int32 buckets[256];
-	int32 i, h, len;
-
-	for (i = 0; i < 256; i++) buckets[i] = 0;
-	for (i = 0; i < oldsize; i++) buckets[old[i]]++;
-	for (i = 1; i < 256; i++) buckets[i] += buckets[i-1];
-	for (i = 255; i > 0; i--) buckets[i] = buckets[i-1];
-	buckets[0] = 0;
-
-	for (i = 0; i < oldsize; i++) I[++buckets[old[i]]] = i;
-	I[0] = oldsize;
-	for (i = 0; i < oldsize; i++) V[i] = buckets[old[i]];
-	V[oldsize] = 0;
-	for (i = 1; i < 256; i++) if (buckets[i] == buckets[i-1] + 1) I[buckets[i]] = -1;
-	I[0] = -1;
-
-	for (h = 1; I[0] != -(oldsize + 1); h += h) {
-		len = 0;
-		for (i = 0; i < oldsize + 1;) {
-			if (I[i] < 0) {
-				len -= I[i];
-				i -= I[i];
-			} else {
-				if (len) I[i-len] = -len;
-				len = V[I[i]] + 1 - i;
-				split(I, V, i, len, h);
-				i += len;
-				len = 0;
-			};
+			lastscan = scan - lenb;
+			lastpos = pos - lenb;
+			lastoffset = pos - scan;
 		};
-		if (len) I[i-len] = -len;
 	};
 
-	for (i = 0; i < oldsize + 1; i++)
-		I[V[i]] = i;
+	chunk->dblen = dblen;
+	chunk->eblen = eblen;
 }
 
-static int32 matchlen(byte *old, int32 oldsize, byte *new_block, int32 new_size) {
-	int32 i;
-
-	for (i = 0; (i < oldsize) && (i < new_size); i++)
-		if (old[i] != new_block[i])
-			break;
+#ifdef POSIX
+// The suffix array and both files are only read once sorting is done, so
+// the chunks are diffed by one thread each
+struct DiffJob {
+	int32 *I;
+	byte *old;
+	int32 oldsize;
+	byte *new_block;
+	bool mix;
+	DiffChunk *chunk;
+};
 
-	return i;
+static void *diffWorker(void *arg) {
+	DiffJob *job = (DiffJob *)arg;
+	diffChunk(job->I, job->old, job->oldsize, job->new_block, job->mix, job->chunk);
+	return NULL;
 }
 
-static int32 search(int32 *I, byte *old, int32 oldsize,
-                    byte *new_block, int32 newsize, int32 st, int32 en, int32 *pos) {
-	int32 x, y;
-
-	if (en - st < 2) {
-		x = matchlen(old + I[st], oldsize - I[st], new_block, newsize);
-		y = matchlen(old + I[en], oldsize - I[en], new_block, newsize);
-
-		if (x > y) {
-			*pos = I[st];
-			return x;
-		} else {
-			*pos = I[en];
-			return y;
-		}
-	};
+static void diffParallel(int32 *I, byte *old, int32 oldsize, byte *new_block, bool mix, DiffChunk *chunks, int numChunks) {
+	DiffJob *jobs = new DiffJob[numChunks];
+	pthread_t *threads = new pthread_t[numChunks];
+	bool *started = new bool[numChunks];
+
+	for (int i = 0; i < numChunks; i++) {
+		jobs[i].I = I;
+		jobs[i].old = old;
+		jobs[i].oldsize = oldsize;
+		jobs[i].new_block = new_block;
+		jobs[i].mix = mix;
+		jobs[i].chunk = &chunks[i];
+		started[i] = pthread_create(&threads[i], NULL, diffWorker, &jobs[i]) == 0;
+	}
+	// Chunks no thread could be spawned for are diffed on this one
+	for (int i = 0; i < numChunks; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			diffWorker(&jobs[i]);
+	}
 
-	x = st + (en - st) / 2;
-	if (memcmp(old + I[x], new_block, MIN(oldsize - I[x], newsize)) < 0) {
-		return search(I, old, oldsize, new_block, newsize, x, en, pos);
-	} else {
-		return search(I, old, oldsize, new_block, newsize, st, x, pos);
-	};
+	delete[] started;
+	delete[] threads;
+	delete[] jobs;
 }
+#endif
 
 typedef struct {
 	char *oldfile;
@@ -208,19 +248,54 @@ typedef struct {
 	char *patchfile;
 	bool mix;
 	bool comp_ctrl;
+	bool qsufsort;
+	bool lab;
+	int jobs;
+	int codec;
+	CompressParams params;
+	bool fingerprint;
+	uint32 window;	// Bytes of the old file per window, 0 to diff whole files
 } arguments;
 
+static const struct {
+	const char *name;
+	int strategy;
+} strategies[] = {
+	{ "default", Z_DEFAULT_STRATEGY },
+	{ "filtered", Z_FILTERED },
+	{ "huffman", Z_HUFFMAN_ONLY },
+	{ "rle", Z_RLE },
+#ifdef Z_FIXED
+	{ "fixed", Z_FIXED },
+#endif
+	{ NULL, 0 }
+};
+
 void show_usage(char *name) {
-	printf("usage: %s [-m][-n] oldfile newfile patchfile\n", name);
+	printf("usage: %s [-m][-n][-f][-l][-w MB][-s sais|qsufsort][-j N][-z gzip|zstd|xz][-c LEVEL][-g STRATEGY][-b KB]\n"
+	       "       oldfile newfile patchfile\n", name);
+	printf("\t-f\tStore a fingerprint of the whole old file for patchr to check\n");
+	printf("\t-l\tDiff two labs entry by entry\n");
+	printf("\t-w\tDiff in windows of MB of the old file, for files of any size\n");
+	printf("\t-z\tCompression of the patch streams, gzip by default\n");
+	printf("\t-c\tCompression level, 0-9 (1-22 for zstd)\n");
+	printf("\t-g\tgzip strategy: default, filtered, huffman, rle or fixed\n");
+	printf("\t-b\tSize in KB of the buffer compressed data is written through\n");
 }
 
 arguments parse_args(int argc, char *argv[]) {
 	arguments arg;
 	arg.comp_ctrl = true;
 	arg.mix = false;
+	arg.qsufsort = false;
+	arg.lab = false;
+	arg.jobs = 1;
+	arg.codec = CODEC_GZIP;
+	arg.fingerprint = false;
+	arg.window = 0;
 
 	int c;
-	while ((c = getopt (argc, argv, "nm")) != -1)
+	while ((c = getopt (argc, argv, "nmflw:s:j:z:c:g:b:")) != -1)
 		switch (c) {
 		case 'n':
 			arg.comp_ctrl = false;
@@ -228,6 +303,73 @@ arguments parse_args(int argc, char *argv[]) {
 		case 'm':
 			arg.mix = true;
 			break;
+		case 'f':
+			arg.fingerprint = true;
+			break;
+		case 'l':
+			arg.lab = true;
+			break;
+		case 'w':
+			// The suffix array of a window takes four times its size
+			if (atoi(optarg) < 1 || atoi(optarg) > 256) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			arg.window = atoi(optarg) * 1024 * 1024;
+			break;
+		case 's':
+			if (strcmp(optarg, "qsufsort") == 0)
+				arg.qsufsort = true;
+			else if (strcmp(optarg, "sais") == 0)
+				arg.qsufsort = false;
+			else {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			break;
+		case 'j':
+			arg.jobs = atoi(optarg);
+			if (arg.jobs < 1) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			break;
+		case 'z':
+			arg.codec = codecByName(optarg);
+			if (arg.codec < 0) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			if (!codecSupported(arg.codec)) {
+				fprintf(stderr, "%s compression is not supported by this build\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			arg.params.level = atoi(optarg);
+			if (arg.params.level < 0) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			break;
+		case 'g': {
+			int i = 0;
+			while (strategies[i].name && strcmp(optarg, strategies[i].name) != 0)
+				i++;
+			if (!strategies[i].name) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			arg.params.strategy = strategies[i].strategy;
+			break;
+		}
+		case 'b':
+			arg.params.bufSize = atoi(optarg) * 1024;
+			if (atoi(optarg) < 1 || atoi(optarg) > 1024 * 1024) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			break;
 		case '?':
 			show_usage(argv[0]);
 			exit(0);
@@ -241,6 +383,16 @@ arguments parse_args(int argc, char *argv[]) {
 		exit(0);
 	}
 
+	if (arg.lab && arg.window) {
+		fprintf(stderr, "Labs are always diffed entry by entry, -w does not apply to them\n");
+		exit(1);
+	}
+
+	if (!codecLevelValid(arg.codec, arg.params.level)) {
+		fprintf(stderr, "Invalid %s compression level %d\n", codecName(arg.codec), arg.params.level);
+		exit(1);
+	}
+
 	arg.oldfile = argv[optind++];
 	arg.newfile = argv[optind++];
 	arg.patchfile = argv[optind++];
@@ -248,311 +400,800 @@ arguments parse_args(int argc, char *argv[]) {
 	return arg;
 }
 
-int main(int argc, char *argv[]) {
-	byte *old, *new_block;
-	int32 oldsize, newsize, newsize2;
-	int32 *I, *V;
-	int32 scan, pos, len;
-	int32 lastscan, lastpos, lastoffset;
-	int32 oldscore, scsc;
-	int32 s, Sf, lenf, Sb, lenb;
-	int32 overlap, Ss, lens;
-	int32 i;
-	int32 dblen, eblen;
+static bool writeError(const char *patchfile) {
+	std::cerr << "Write error on " << patchfile << std::endl;
+	return false;
+}
+
+/**
+ * Patch flags. Version x.1 patches also keep the codec of each compressed
+ * stream in them, version x.0 ones are gzip throughout.
+ *
+ * FLAG_FINGERPRINT patches end with the XXH64 of the whole old file, after
+ * all of their streams. Readers that only check the md5 of the first 5000
+ * bytes can ignore it.
+ */
+enum {
+	FLAG_MIX = 1 << 0,
+	FLAG_COMP_CTRL = 1 << 1,
+	FLAG_FINGERPRINT = 1 << 2,
+	CODEC_SHIFT_CTRL = 8,
+	CODEC_SHIFT_DIFF = 12,
+	CODEC_SHIFT_EXTRA = 16
+};
+
+static uint32 patchFlags(const arguments &args) {
 	uint32 flags = 0;
-	byte *db, *eb;
-	byte buf[4];
+	if (args.mix)
+		flags |= FLAG_MIX;
+	if (args.comp_ctrl)
+		flags |= FLAG_COMP_CTRL;
+	flags |= args.codec << CODEC_SHIFT_CTRL;
+	flags |= args.codec << CODEC_SHIFT_DIFF;
+	flags |= args.codec << CODEC_SHIFT_EXTRA;
+	return flags;
+}
+
+// Gzip only patches stay readable by older patchr versions
+static uint16 minorVersion(const arguments &args) {
+	return args.codec == CODEC_GZIP ? 0 : 1;
+}
+
+static void writeLE64(byte *buf, uint64 value) {
+	WRITE_LE_UINT32(buf, (uint32)value);
+	WRITE_LE_UINT32(buf + 4, (uint32)(value >> 32));
+}
+
+static bool writeFingerprint(std::ofstream &patch, const char *patchfile, uint64 fingerprint) {
+	byte buf[8];
+	writeLE64(buf, fingerprint);
+	patch.write((char *)buf, 8);
+	if (patch.bad())
+		return writeError(patchfile);
+	return true;
+}
+
+// Finishes a compressed stream, false on a write error
+static bool closeStream(CompressStream *stream) {
+	stream->finalize();
+	bool ok = !stream->err();
+	delete stream;
+	return ok;
+}
+
+static void md5Prefix(const byte *data, int32 size, byte digest[16]) {
+	// Same as Common::md5_file(name, digest, 5000) on a file holding data
+	Common::md5_context ctx;
+	Common::md5_starts(&ctx);
+	Common::md5_update(&ctx, data, MIN(size, 5000));
+	Common::md5_finish(&ctx, digest);
+}
+
+static int32 *sortSuffixes(byte *old, int32 oldsize, bool useQsufsort) {
+	Common::StatsPhase phase(Common::kStatsIndex);
+	int32 *I = new int32[oldsize + 1];
+	if (useQsufsort) {
+		int32 *V = new int32[oldsize + 1];
+		qsufsort(I, V, old, oldsize);
+		delete[] V;
+	} else
+		saissort(I, old, oldsize);
+	return I;
+}
+
+/**
+ * Writes a PATR v2 patch built from the diffed chunks at the current
+ * position of patch, leaving the position at its end. If fingerprint is
+ * given it is stored at the end of the patch.
+ */
+static bool writePatr(std::ofstream &patch, const char *patchfile, const arguments &args, const byte md5[16],
+                      int32 oldsize, int32 newsize, DiffChunk *chunks, int numChunks, const uint64 *fingerprint) {
+	Common::StatsPhase phase(Common::kStatsWrite);
 	byte header[48];
-	std::ofstream patch;
-	std::ifstream in;
-	arguments args;
+	int32 i;
 
-	args = parse_args(argc, argv);
+	std::streamoff base = patch.tellp();
+	if (base == -1)
+		return writeError(patchfile);
 
-	//Set flags
-	if (args.mix)
-		flags |= 1 << 0;
+	memcpy(header, "PATR", 4);							//Signature
+	WRITE_LE_UINT16(header + 4, 2);						//Version major
+	WRITE_LE_UINT16(header + 6, minorVersion(args));	//Version minor
+	WRITE_LE_UINT32(header + 8, patchFlags(args) | (fingerprint ? FLAG_FINGERPRINT : 0));	//flags
+	memcpy(header + 12, md5, 16);						//Md5sum
+	WRITE_LE_UINT32(header + 28, oldsize);				//oldsize
+	WRITE_LE_UINT32(header + 32, newsize);				//newsize
+	//WRITE_LE_UINT32(header + 36, 0);					//ctrl compressed size
+	//WRITE_LE_UINT32(header + 40, 0);					//diff compressed size
+	//WRITE_LE_UINT32(header + 44, 0);					//extra compressed size
+	patch.write((char *)header, 48);
+	if (patch.bad())
+		return writeError(patchfile);
+
+	// Return to old position 0 where the next range starts
+	for (i = 0; i + 1 < numChunks; i++) {
+		std::vector<int32> &ctrl = chunks[i].ctrl;
+		ctrl[ctrl.size() - 1] = -chunks[i].endOld;
+	}
+
+	/* Write ctrl */
+	CompressStream *ctrlBlock = NULL;
 	if (args.comp_ctrl)
-		flags |= 1 << 1;
+		ctrlBlock = openCompressStream(args.codec, &patch, args.params);
+
+	for (i = 0; i < numChunks; i++) {
+		const std::vector<int32> &ctrl = chunks[i].ctrl;
+		std::vector<byte> buf(ctrl.size() * 4);
+		for (size_t j = 0; j < ctrl.size(); j++)
+			WRITE_LE_UINT32(&buf[j * 4], ctrl[j]);
+		if (buf.empty())
+			continue;
+
+		if (args.comp_ctrl) {
+			ctrlBlock->write(&buf[0], buf.size());
+			if (ctrlBlock->err())
+				return writeError(patchfile);
+		} else
+			patch.write((char *)&buf[0], buf.size());
+	}
+	if (args.comp_ctrl && !closeStream(ctrlBlock))
+		return writeError(patchfile);
 
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-	    that we never try to alloc zero elements and get a NULL pointer */
+	/* Compute size of ctrl data (compressed or not)*/
+	std::streamoff ctrlEnd = patch.tellp();
+	if (ctrlEnd == -1)
+		return writeError(patchfile);
+	WRITE_LE_UINT32(header + 36, ctrlEnd - base - 48);
 
-	//Read old file
-	in.open(args.oldfile, std::ios::in | std::ios::binary);
-	if (in.fail()) {
-		std::cerr << "Unable to open " << args.oldfile << std::endl;
-		return 1;
+	/* Write compressed diff data */
+	CompressStream *diffBlock = openCompressStream(args.codec, &patch, args.params);
+	for (i = 0; i < numChunks; i++) {
+		diffBlock->write(chunks[i].db, chunks[i].dblen);
+		if (diffBlock->err())
+			return writeError(patchfile);
 	}
-	in.seekg(0, std::ios::end);
-	oldsize = in.tellg();
-	in.seekg(0);
-	if ((old = new byte[oldsize + 1]) == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
+	if (!closeStream(diffBlock))
+		return writeError(patchfile);
+
+	/* Compute size of compressed diff data */
+	std::streamoff diffEnd = patch.tellp();
+	if (diffEnd == -1)
+		return writeError(patchfile);
+	WRITE_LE_UINT32(header + 40, diffEnd - ctrlEnd);
+
+	/* Write compressed extra data */
+	std::streamoff extraEnd = diffEnd;
+	if (!args.mix) {
+		CompressStream *extraBlock = openCompressStream(args.codec, &patch, args.params);
+		for (i = 0; i < numChunks; i++) {
+			extraBlock->write(chunks[i].eb, chunks[i].eblen);
+			if (extraBlock->err())
+				return writeError(patchfile);
+		}
+		if (!closeStream(extraBlock))
+			return writeError(patchfile);
+
+		/* Compute size of compressed extra data */
+		if ((extraEnd = patch.tellp()) == -1)
+			return writeError(patchfile);
+		WRITE_LE_UINT32(header + 44, extraEnd - diffEnd);
 	}
-	in.read((char*)old, oldsize);
-	if (in.fail()) {
-		std::cerr << "Unable to read from " << args.oldfile << std::endl;
-		return 1;
+	else
+		WRITE_LE_UINT32(header + 44, 0);
+
+	if (fingerprint && !writeFingerprint(patch, patchfile, *fingerprint))
+		return false;
+	std::streamoff end = patch.tellp();
+	if (end == -1)
+		return writeError(patchfile);
+
+	/* Seek back, write the header, and return to the end */
+	patch.seekp(base, std::ios::beg);
+	patch.write((char *)header, 48);
+	patch.seekp(end, std::ios::beg);
+	if (patch.bad())
+		return writeError(patchfile);
+	Common::addStatsWritten(end - base);
+	return true;
+}
+
+static bool allocChunk(DiffChunk &chunk, int32 start, int32 size, bool mix) {
+	chunk.start = start;
+	chunk.size = size;
+	chunk.db = new byte[size + 1];
+	chunk.eb = mix ? NULL : new byte[size + 1];
+	return chunk.db != NULL && (mix || chunk.eb != NULL);
+}
+
+static void freeChunk(DiffChunk &chunk) {
+	delete[] chunk.db;
+	delete[] chunk.eb;
+	chunk.db = chunk.eb = NULL;
+	chunk.ctrl.clear();
+}
+
+/*
+ * Lab mode. Both labs are opened mapped, the new one is covered front to
+ * back by records, each record rebuilding one piece of it:
+ *
+ * header (48 bytes):
+ *   "PATL", version major 1, minor 0 or 1 (2 bytes each), flags as in PATR,
+ *   md5 of the first 5000 bytes of the old lab, old size, new size,
+ *   number of records, reserved. With FLAG_FINGERPRINT the records are
+ *   followed by the fingerprint of the old lab.
+ * record header (16 bytes):
+ *   type, size in the new lab, offset in the old lab, size of the payload
+ *   that follows.
+ *
+ * LAB_COPY records take an unchanged entry from the old lab, LAB_PATCH
+ * records carry a PATR v2 patch against an entry of the old lab with the
+ * same name and LAB_LITERAL records compress everything else, such as
+ * tables, padding and entries new to the lab, with the diff stream codec.
+ */
+enum {
+	LAB_LITERAL = 0,
+	LAB_COPY = 1,
+	LAB_PATCH = 2
+};
+
+struct LabRecord {
+	int type;
+	uint32 newOffset, newSize;
+	uint32 oldOffset, oldSize;
+	const byte *oldData, *newData;
+	DiffChunk chunk;
+};
+
+// Suffix sorts and diffs one LAB_PATCH record, only the record's own
+// suffix array is alive while it runs
+static void diffRecord(LabRecord *rec, bool mix, bool useQsufsort) {
+	byte *old = const_cast<byte *>(rec->oldData);
+	int32 *I = sortSuffixes(old, rec->oldSize, useQsufsort);
+	diffChunk(I, old, rec->oldSize, const_cast<byte *>(rec->newData), mix, &rec->chunk);
+	delete[] I;
+	Common::addStatsFiles();
+}
+
+#ifdef POSIX
+struct RecordJob {
+	LabRecord **records;
+	int numRecords;
+	int nextRecord;
+	bool mix, useQsufsort;
+	pthread_mutex_t lock;
+};
+
+static void *recordWorker(void *arg) {
+	RecordJob *job = (RecordJob *)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int i = job->nextRecord++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->numRecords)
+			break;
+		diffRecord(job->records[i], job->mix, job->useQsufsort);
 	}
-	in.close();
+	return NULL;
+}
+#endif
+
+static void diffRecords(LabRecord **records, int numRecords, const arguments &args) {
+#ifdef POSIX
+	if (args.jobs > 1 && numRecords > 1) {
+		RecordJob job;
+		job.records = records;
+		job.numRecords = numRecords;
+		job.nextRecord = 0;
+		job.mix = args.mix;
+		job.useQsufsort = args.qsufsort;
+		pthread_mutex_init(&job.lock, NULL);
+
+		int numThreads = MIN(args.jobs, numRecords);
+		pthread_t *threads = new pthread_t[numThreads];
+		int started = 0;
+		for (int t = 0; t < numThreads; t++)
+			if (pthread_create(&threads[started], NULL, recordWorker, &job) == 0)
+				++started;
+		// If no thread could be spawned do the work on this one
+		if (started == 0)
+			recordWorker(&job);
+		for (int t = 0; t < started; t++)
+			pthread_join(threads[t], NULL);
+
+		delete[] threads;
+		pthread_mutex_destroy(&job.lock);
+		return;
+	}
+#endif
+	for (int i = 0; i < numRecords; i++)
+		diffRecord(records[i], args.mix, args.qsufsort);
+}
 
-	I = new int32[oldsize + 1];
-	V = new int32[oldsize + 1];
-	if (I == NULL || V == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
+static bool writeRecord(std::ofstream &patch, const arguments &args, LabRecord &rec) {
+	byte header[16];
+	std::streamoff base = patch.tellp();
+	if (base == -1)
+		return writeError(args.patchfile);
+
+	WRITE_LE_UINT32(header, rec.type);
+	WRITE_LE_UINT32(header + 4, rec.newSize);
+	WRITE_LE_UINT32(header + 8, rec.oldOffset);
+	WRITE_LE_UINT32(header + 12, 0);
+	patch.write((char *)header, 16);
+
+	if (rec.type == LAB_LITERAL) {
+		CompressStream *literal = openCompressStream(args.codec, &patch, args.params);
+		literal->write(rec.newData, rec.newSize);
+		if (!closeStream(literal))
+			return writeError(args.patchfile);
+	} else if (rec.type == LAB_PATCH) {
+		byte md5[16];
+		md5Prefix(rec.oldData, rec.oldSize, md5);
+		if (!writePatr(patch, args.patchfile, args, md5, rec.oldSize, rec.newSize, &rec.chunk, 1, NULL))
+			return false;
 	}
-	qsufsort(I, V, old, oldsize);
 
-	delete[] V;
+	std::streamoff end = patch.tellp();
+	if (end == -1)
+		return writeError(args.patchfile);
+	WRITE_LE_UINT32(header + 12, end - base - 16);
+	patch.seekp(base, std::ios::beg);
+	patch.write((char *)header, 16);
+	patch.seekp(end, std::ios::beg);
+	if (patch.bad())
+		return writeError(args.patchfile);
+	return true;
+}
 
-	//Read new file
-	in.open(args.newfile, std::ios::in | std::ios::binary);
-	if (in.fail()) {
-		std::cerr << "Unable to open " << args.newfile << std::endl;
+static bool offsetLess(const std::pair<uint32, uint32> &a, const std::pair<uint32, uint32> &b) {
+	return a.first < b.first || (a.first == b.first && a.second < b.second);
+}
+
+static int diffLabs(const arguments &args) {
+	Lab oldLab(args.oldfile, false, true);
+	Lab newLab(args.newfile, false, true);
+	if (!oldLab.isMapped() || !newLab.isMapped()) {
+		std::cerr << "Unable to map the labs" << std::endl;
 		return 1;
 	}
-	in.seekg(0, std::ios::end);
-	newsize = in.tellg();
-	in.seekg(0);
-	if ((new_block = new byte[newsize + 1]) == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
+
+	uint32 oldsize, newsize;
+	const byte *oldBase = (const byte *)oldLab.getMappedData(oldsize);
+	const byte *newBase = (const byte *)newLab.getMappedData(newsize);
+
+	// Cover the new lab in offset order, bytes not in any entry and
+	// entries without an old counterpart go in literals
+	std::vector<std::pair<uint32, uint32> > order;
+	for (uint32 i = 0; i < newLab.getNumEntries(); i++)
+		order.push_back(std::make_pair(newLab.getEntryOffset(i), i));
+	std::sort(order.begin(), order.end(), offsetLess);
+
+	std::vector<LabRecord> records;
+	uint32 covered = 0;
+	for (size_t k = 0; k <= order.size(); k++) {
+		uint32 start = newsize, size = 0;
+		int oldIndex = -1;
+		if (k < order.size()) {
+			uint32 index = order[k].second;
+			start = order[k].first;
+			size = newLab.getEntrySize(index);
+			if (start > newsize || size > newsize - start) {
+				std::cerr << newLab.getEntryName(index) << " past the end of " << args.newfile << std::endl;
+				return 1;
+			}
+			// Entries sharing data with one already covered
+			if (start + size <= covered)
+				continue;
+			if (start >= covered)
+				oldIndex = oldLab.getIndex(newLab.getEntryName(index));
+			if (oldIndex != -1) {
+				uint32 oldStart = oldLab.getEntryOffset(oldIndex);
+				uint32 oldSize = oldLab.getEntrySize(oldIndex);
+				if (oldStart > oldsize || oldSize > oldsize - oldStart)
+					oldIndex = -1;
+			}
+		}
+
+		LabRecord rec;
+		rec.oldOffset = rec.oldSize = 0;
+		rec.oldData = NULL;
+		rec.chunk.db = rec.chunk.eb = NULL;
+
+		// Everything up to the entry, or the part of it not covered yet
+		uint32 literalEnd = (oldIndex == -1) ? start + size : start;
+		if (literalEnd > covered) {
+			if (!records.empty() && records.back().type == LAB_LITERAL) {
+				records.back().newSize = literalEnd - records.back().newOffset;
+			} else {
+				rec.type = LAB_LITERAL;
+				rec.newOffset = covered;
+				rec.newSize = literalEnd - covered;
+				rec.newData = newBase + covered;
+				records.push_back(rec);
+			}
+			covered = literalEnd;
+		}
+		if (oldIndex == -1)
+			continue;
+
+		rec.newOffset = start;
+		rec.newSize = size;
+		rec.newData = newBase + start;
+		rec.oldOffset = oldLab.getEntryOffset(oldIndex);
+		rec.oldSize = oldLab.getEntrySize(oldIndex);
+		rec.oldData = oldBase + rec.oldOffset;
+		if (rec.oldSize == size && memcmp(rec.oldData, rec.newData, size) == 0) {
+			rec.type = LAB_COPY;
+			// Runs of entries kept in place become one copy
+			LabRecord *prev = records.empty() ? NULL : &records.back();
+			if (prev && prev->type == LAB_COPY && prev->newOffset + prev->newSize == start &&
+			        prev->oldOffset + prev->newSize == rec.oldOffset) {
+				prev->newSize += size;
+				covered = start + size;
+				continue;
+			}
+		} else
+			rec.type = LAB_PATCH;
+		records.push_back(rec);
+		covered = start + size;
+	}
+
+	std::ofstream patch;
+	patch.open(args.patchfile, std::ios::out | std::ios::binary);
+	if (patch.fail()) {
+		std::cerr << "Unable to open " << args.patchfile << std::endl;
 		return 1;
 	}
-	in.read((char*)new_block, newsize);
-	if (in.fail()) {
-		std::cerr << "Unable to read from " << args.newfile << std::endl;
+
+	byte header[48];
+	memcpy(header, "PATL", 4);
+	WRITE_LE_UINT16(header + 4, 1);
+	WRITE_LE_UINT16(header + 6, minorVersion(args));
+	WRITE_LE_UINT32(header + 8, patchFlags(args) | (args.fingerprint ? FLAG_FINGERPRINT : 0));
+	Common::md5_file(args.oldfile, header + 12, 5000);
+	WRITE_LE_UINT32(header + 28, oldsize);
+	WRITE_LE_UINT32(header + 32, newsize);
+	WRITE_LE_UINT32(header + 36, records.size());
+	WRITE_LE_UINT32(header + 40, 0);
+	WRITE_LE_UINT32(header + 44, 0);
+	patch.write((char *)header, 48);
+	if (patch.bad()) {
+		writeError(args.patchfile);
 		return 1;
 	}
-	in.close();
 
+	// Diff as many entries at a time as there are jobs, then write them out
+	// in order so only their diffs are held in memory
+	size_t batch = args.jobs;
+	for (size_t first = 0; first < records.size(); ) {
+		std::vector<LabRecord *> pending;
+		size_t end = first;
+		while (end < records.size() && pending.size() < batch) {
+			LabRecord &rec = records[end++];
+			if (rec.type != LAB_PATCH)
+				continue;
+			if (!allocChunk(rec.chunk, 0, rec.newSize, args.mix)) {
+				std::cerr << "Unable to allocate memory" << std::endl;
+				return 1;
+			}
+			pending.push_back(&rec);
+		}
+		if (!pending.empty())
+			diffRecords(&pending[0], pending.size(), args);
 
-	db = new byte[newsize + 1];
-	if (db == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
+		for (; first < end; first++) {
+			if (!writeRecord(patch, args, records[first]))
+				return 1;
+			freeChunk(records[first].chunk);
+		}
+	}
+	if (args.fingerprint && !writeFingerprint(patch, args.patchfile, Common::xxh64(oldBase, oldsize)))
+		return 1;
+	patch.close();
+
+	return 0;
+}
+
+/*
+ * Window mode, for files too large to hold in memory with their suffix
+ * array. The new file is cut into segments of half a window, each diffed
+ * against the window of the old file around the same relative position, so
+ * memory only depends on the window size and the number of jobs:
+ *
+ * header (48 bytes):
+ *   "PATR", version major 3, minor 0 or 1 (2 bytes each), flags as in v2,
+ *   md5 of the first 5000 bytes of the old file, old size and new size
+ *   (8 bytes each), number of windows. With FLAG_FINGERPRINT the windows
+ *   are followed by the fingerprint of the old file.
+ * window header (24 bytes):
+ *   offset of the window in the old file (8 bytes), size of the window,
+ *   size of the segment of the new file, size of the payload that follows
+ *   (8 bytes). The payload is a PATR v2 patch of the segment against the
+ *   window.
+ */
+static bool readRange(std::ifstream &in, uint64 offset, byte *buf, uint32 size) {
+	Common::StatsPhase phase(Common::kStatsOpen);
+	in.seekg((std::streamoff)offset, std::ios::beg);
+	in.read((char *)buf, size);
+	Common::addStatsRead(size);
+	return !in.fail();
+}
+
+static bool writeWindow(std::ofstream &patch, const arguments &args, uint64 oldOffset, LabRecord &rec) {
+	byte header[24];
+	std::streamoff base = patch.tellp();
+	if (base == -1)
+		return writeError(args.patchfile);
+
+	writeLE64(header, oldOffset);
+	WRITE_LE_UINT32(header + 8, rec.oldSize);
+	WRITE_LE_UINT32(header + 12, rec.newSize);
+	writeLE64(header + 16, 0);
+	patch.write((char *)header, 24);
+
+	byte md5[16];
+	md5Prefix(rec.oldData, rec.oldSize, md5);
+	if (!writePatr(patch, args.patchfile, args, md5, rec.oldSize, rec.newSize, &rec.chunk, 1, NULL))
+		return false;
+
+	std::streamoff end = patch.tellp();
+	if (end == -1)
+		return writeError(args.patchfile);
+	writeLE64(header + 16, end - base - 24);
+	patch.seekp(base, std::ios::beg);
+	patch.write((char *)header, 24);
+	patch.seekp(end, std::ios::beg);
+	if (patch.bad())
+		return writeError(args.patchfile);
+	return true;
+}
+
+static int diffWindows(const arguments &args) {
+	std::ifstream oldIn(args.oldfile, std::ios::in | std::ios::binary);
+	if (oldIn.fail()) {
+		std::cerr << "Unable to open " << args.oldfile << std::endl;
 		return 1;
 	}
-	if (!args.mix) {
-		eb = new byte[newsize + 1];
-		if (eb == NULL) {
-			std::cerr << "Unable to allocate memory" << std::endl;
-			return 1;
-		}
+	std::ifstream newIn(args.newfile, std::ios::in | std::ios::binary);
+	if (newIn.fail()) {
+		std::cerr << "Unable to open " << args.newfile << std::endl;
+		return 1;
 	}
-	dblen = 0;
-	eblen = 0;
+	oldIn.seekg(0, std::ios::end);
+	uint64 oldsize = (std::streamoff)oldIn.tellg();
+	newIn.seekg(0, std::ios::end);
+	uint64 newsize = (std::streamoff)newIn.tellg();
 
-	/* Create the patch file */
+	uint32 window = args.window;
+	uint32 segment = window / 2;
+	uint64 numWindows = (newsize + segment - 1) / segment;
+
+	std::ofstream patch;
 	patch.open(args.patchfile, std::ios::out | std::ios::binary);
 	if (patch.fail()) {
 		std::cerr << "Unable to open " << args.patchfile << std::endl;
 		return 1;
 	}
 
-	memcpy(header, "PATR", 4);							//Signature
-	WRITE_LE_UINT16(header + 4, 2);						//Version major
-	WRITE_LE_UINT16(header + 6, 0);						//Version minor
-	WRITE_LE_UINT32(header + 8, flags);					//flags
-	Common::md5_file(args.oldfile, header + 12, 5000);	//Md5sum
-	WRITE_LE_UINT32(header + 28, oldsize);				//oldsize
-	WRITE_LE_UINT32(header + 32, newsize);				//newsize
-	//WRITE_LE_UINT32(header + 36, 0);					//ctrl compressed size
-	//WRITE_LE_UINT32(header + 40, 0);					//diff compressed size
-	//WRITE_LE_UINT32(header + 44, 0);					//extra compressed size
+	byte header[48];
+	memcpy(header, "PATR", 4);
+	WRITE_LE_UINT16(header + 4, 3);
+	WRITE_LE_UINT16(header + 6, minorVersion(args));
+	WRITE_LE_UINT32(header + 8, patchFlags(args) | (args.fingerprint ? FLAG_FINGERPRINT : 0));
+	Common::md5_file(args.oldfile, header + 12, 5000);
+	writeLE64(header + 28, oldsize);
+	writeLE64(header + 36, newsize);
+	WRITE_LE_UINT32(header + 44, (uint32)numWindows);
 	patch.write((char *)header, 48);
 	if (patch.bad()) {
-		std::cerr << "Write error on " << args.patchfile << std::endl;
+		writeError(args.patchfile);
 		return 1;
 	}
 
-	/* Compute the differences, writing ctrl as we go */
-	GZipWriteStream *ctrlBlock;
-	if (args.comp_ctrl)
-		ctrlBlock = new GZipWriteStream(&patch);
-
-	scan = 0;
-	len = 0;
-	lastscan = 0;
-	lastpos = 0;
-	lastoffset = 0;
-	while (scan < newsize) {
-		oldscore = 0;
-
-		for (scsc = scan += len; scan < newsize; scan++) {
-			len = search(I, old, oldsize, new_block + scan, newsize - scan,
-			             0, oldsize, &pos);
-
-			for (; scsc < scan + len; scsc++)
-				if ((scsc + lastoffset < oldsize) &&
-				        (old[scsc + lastoffset] == new_block[scsc]))
-					oldscore++;
+	// As many windows as there are jobs are diffed at a time, the buffers
+	// they are read into are reused for the next ones
+	size_t batch = args.jobs;
+	std::vector<LabRecord> records(batch);
+	std::vector<uint64> oldOffsets(batch);
+	std::vector<byte *> oldBufs(batch), newBufs(batch);
+	for (size_t k = 0; k < batch; k++) {
+		oldBufs[k] = new byte[window + 1];
+		newBufs[k] = new byte[segment + 1];
+		records[k].type = LAB_PATCH;
+		records[k].chunk.db = records[k].chunk.eb = NULL;
+	}
 
-			if (((len == oldscore) && (len != 0)) ||
-			        (len > oldscore + 8)) break;
+	int result = 0;
+	for (uint64 first = 0; first < numWindows && result == 0; first += batch) {
+		std::vector<LabRecord *> pending;
+		for (size_t k = 0; k < batch && first + k < numWindows; k++) {
+			LabRecord &rec = records[k];
+			uint64 newStart = (first + k) * segment;
+			rec.newSize = (uint32)MIN((uint64)segment, newsize - newStart);
+			rec.oldSize = (uint32)MIN((uint64)window, oldsize);
+
+			// Around where the segment would be if the new file were the
+			// old one stretched to its size
+			uint64 centre = (uint64)((double)newStart / newsize * oldsize);
+			uint64 margin = (rec.oldSize - MIN(rec.oldSize, rec.newSize)) / 2;
+			uint64 oldStart = centre > margin ? centre - margin : 0;
+			if (oldStart > oldsize - rec.oldSize)
+				oldStart = oldsize - rec.oldSize;
+			oldOffsets[k] = oldStart;
+
+			if (!readRange(oldIn, oldStart, oldBufs[k], rec.oldSize)) {
+				std::cerr << "Unable to read from " << args.oldfile << std::endl;
+				result = 1;
+				break;
+			}
+			if (!readRange(newIn, newStart, newBufs[k], rec.newSize)) {
+				std::cerr << "Unable to read from " << args.newfile << std::endl;
+				result = 1;
+				break;
+			}
+			rec.oldData = oldBufs[k];
+			rec.newData = newBufs[k];
+			if (!allocChunk(rec.chunk, 0, rec.newSize, args.mix)) {
+				std::cerr << "Unable to allocate memory" << std::endl;
+				result = 1;
+				break;
+			}
+			pending.push_back(&rec);
+		}
+		if (result == 0)
+			diffRecords(&pending[0], pending.size(), args);
 
-			if ((scan + lastoffset < oldsize) &&
-			        (old[scan + lastoffset] == new_block[scan]))
-				oldscore--;
-		};
+		for (size_t k = 0; k < pending.size(); k++) {
+			if (result == 0 && !writeWindow(patch, args, oldOffsets[k], *pending[k]))
+				result = 1;
+			freeChunk(pending[k]->chunk);
+		}
+	}
 
-		if ((len != oldscore) || (scan == newsize)) {
-			s = 0;
-			Sf = 0;
-			lenf = 0;
-			for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
-				if (old[lastpos + i] == new_block[lastscan + i]) s++;
-				i++;
-				if (s * 2 - i > Sf * 2 - lenf) {
-					Sf = s;
-					lenf = i;
-				};
-			};
+	for (size_t k = 0; k < batch; k++) {
+		delete[] oldBufs[k];
+		delete[] newBufs[k];
+	}
+	if (result != 0)
+		return result;
 
-			lenb = 0;
-			if (scan < newsize) {
-				s = 0;
-				Sb = 0;
-				for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
-					if (old[pos - i] == new_block[scan - i]) s++;
-					if (s * 2 - i > Sb * 2 - lenb) {
-						Sb = s;
-						lenb = i;
-					};
-				};
-			};
+	if (args.fingerprint) {
+		uint64 fingerprint;
+		if (!Common::xxh64_file(args.oldfile, fingerprint)) {
+			std::cerr << "Unable to read from " << args.oldfile << std::endl;
+			return 1;
+		}
+		if (!writeFingerprint(patch, args.patchfile, fingerprint))
+			return 1;
+	}
+	patch.close();
 
-			if (lastscan + lenf > scan - lenb) {
-				overlap = (lastscan + lenf) - (scan - lenb);
-				s = 0;
-				Ss = 0;
-				lens = 0;
-				for (i = 0; i < overlap; i++) {
-					if (new_block[lastscan + lenf - overlap + i] ==
-					        old[lastpos + lenf - overlap + i]) s++;
-					if (new_block[scan - lenb + i] ==
-					        old[pos - lenb + i]) s--;
-					if (s > Ss) {
-						Ss = s;
-						lens = i + 1;
-					};
-				};
+	return 0;
+}
 
-				lenf += lens - overlap;
-				lenb -= lens;
-			};
+/**
+ * The size of a file opened by in, which has to fit the int32 offsets of
+ * whole file diffs.
+ */
+static bool wholeFileSize(std::ifstream &in, const char *name, int32 &size) {
+	in.seekg(0, std::ios::end);
+	std::streamoff end = in.tellg();
+	in.seekg(0);
+	if (end < 0 || end >= 0x7fffffff) {
+		std::cerr << name << " is too large to diff whole, diff it with -w" << std::endl;
+		return false;
+	}
+	size = (int32)end;
+	return true;
+}
 
-			for (i = 0; i < lenf; i++)
-				db[dblen + i] = new_block[lastscan + i] ^ old[lastpos + i];
-			dblen += lenf;
+int main(int argc, char *argv[]) {
+	byte *old, *new_block;
+	int32 oldsize, newsize;
+	int32 *I;
+	int32 i;
+	byte md5[16];
+	std::ofstream patch;
+	std::ifstream in;
+	arguments args;
 
-			if (!args.mix) {
-				for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
-					eb[eblen + i] = new_block[lastscan + lenf + i];
-				eblen += (scan - lenb) - (lastscan + lenf);
-			} else {
-				for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
-					db[dblen + i] = new_block[lastscan + lenf + i];
-				dblen += (scan - lenb) - (lastscan + lenf);
-			}
+	Common::initStats("diffr", argc, argv);
+	args = parse_args(argc, argv);
 
-			WRITE_LE_UINT32(buf, lenf);
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
-
-
-			WRITE_LE_UINT32(buf, (scan - lenb) - (lastscan + lenf));
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
-
-			WRITE_LE_UINT32(buf, int32((pos - lenb) - (lastpos + lenf)));
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
+	if (args.lab)
+		return diffLabs(args);
+	if (args.window)
+		return diffWindows(args);
 
-			lastscan = scan - lenb;
-			lastpos = pos - lenb;
-			lastoffset = pos - scan;
-		};
-	};
-	if (args.comp_ctrl)
-		delete ctrlBlock;
+	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
+	    that we never try to alloc zero elements and get a NULL pointer */
 
-	/* Compute size of ctrl data (compressed or not)*/
-	if ((len = patch.tellp()) == -1) {
-		std::cerr << "Read error on " << args.patchfile << std::endl;
+	//Read old file
+	in.open(args.oldfile, std::ios::in | std::ios::binary);
+	if (in.fail()) {
+		std::cerr << "Unable to open " << args.oldfile << std::endl;
 		return 1;
 	}
+	if (!wholeFileSize(in, args.oldfile, oldsize))
+		return 1;
+	if ((old = new byte[oldsize + 1]) == NULL) {
+		std::cerr << "Unable to allocate memory" << std::endl;
+		return 1;
+	}
+	if (!readRange(in, 0, old, oldsize)) {
+		std::cerr << "Unable to read from " << args.oldfile << std::endl;
+		return 1;
+	}
+	in.close();
 
-	WRITE_LE_UINT32(header + 36, len - 48);
-
-	/* Write compressed diff data */
-	GZipWriteStream *diffBlock = new GZipWriteStream(&patch);
-	diffBlock->write(db, dblen);
-	if (diffBlock->err()) {
-		std::cerr << "Write error on " << args.patchfile << std::endl;
+	I = sortSuffixes(old, oldsize, args.qsufsort);
+	if (I == NULL) {
+		std::cerr << "Unable to allocate memory" << std::endl;
 		return 1;
 	}
-	delete diffBlock;
 
-	/* Compute size of compressed diff data */
-	if ((newsize = patch.tellp()) == -1) {
-		std::cerr << "Read error on " << args.patchfile << std::endl;
+	//Read new file
+	in.open(args.newfile, std::ios::in | std::ios::binary);
+	if (in.fail()) {
+		std::cerr << "Unable to open " << args.newfile << std::endl;
 		return 1;
 	}
-	WRITE_LE_UINT32(header + 40, newsize - len);
+	if (!wholeFileSize(in, args.newfile, newsize))
+		return 1;
+	if ((new_block = new byte[newsize + 1]) == NULL) {
+		std::cerr << "Unable to allocate memory" << std::endl;
+		return 1;
+	}
+	if (!readRange(in, 0, new_block, newsize)) {
+		std::cerr << "Unable to read from " << args.newfile << std::endl;
+		return 1;
+	}
+	in.close();
 
-	/* Write compressed extra data */
-	if (!args.mix) {
-		GZipWriteStream *extraBlock = new GZipWriteStream(&patch);
-		extraBlock->write(eb, eblen);
-		if (extraBlock->err()) {
-			std::cerr << "Write error on " << args.patchfile << std::endl;
-			return 1;
-		}
-		delete extraBlock;
 
-		/* Compute size of compressed extra data */
-		if ((newsize2 = patch.tellp()) == -1) {
-			std::cerr << "Read error on " << args.patchfile << std::endl;
+	// Split the new file into one range per job
+	int numChunks = args.jobs;
+	if (numChunks > newsize)
+		numChunks = newsize > 0 ? newsize : 1;
+	DiffChunk *chunks = new DiffChunk[numChunks];
+	for (i = 0; i < numChunks; i++) {
+		int32 start = int32((int64)newsize * i / numChunks);
+		int32 end = int32((int64)newsize * (i + 1) / numChunks);
+		if (!allocChunk(chunks[i], start, end - start, args.mix)) {
+			std::cerr << "Unable to allocate memory" << std::endl;
 			return 1;
 		}
-		WRITE_LE_UINT32(header + 44, newsize2 - newsize);
-
-		delete[] eb;
 	}
-	else
-		WRITE_LE_UINT32(header + 44, 0);
 
-	/* Seek to the beginning, write the header, and close the file */
-	patch.seekp(0, std::ios::beg);
-	patch.write((char *)header, 48);
-	if (patch.bad()) {
-		std::cerr << "Write error on " << args.patchfile << std::endl;
+	/* Create the patch file */
+	patch.open(args.patchfile, std::ios::out | std::ios::binary);
+	if (patch.fail()) {
+		std::cerr << "Unable to open " << args.patchfile << std::endl;
 		return 1;
 	}
+
+	/* Compute the differences */
+#ifdef POSIX
+	if (numChunks > 1)
+		diffParallel(I, old, oldsize, new_block, args.mix, chunks, numChunks);
+	else
+#endif
+	for (i = 0; i < numChunks; i++)
+		diffChunk(I, old, oldsize, new_block, args.mix, &chunks[i]);
+
+	Common::md5_file(args.oldfile, md5, 5000);
+	uint64 fingerprint = Common::xxh64(old, oldsize);
+	if (!writePatr(patch, args.patchfile, args, md5, oldsize, newsize, chunks, numChunks,
+	               args.fingerprint ? &fingerprint : NULL))
+		return 1;
 	patch.close();
+	Common::addStatsFiles();
 
 	/* Free the memory we used */
-	delete[] db;
+	for (i = 0; i < numChunks; i++)
+		freeChunk(chunks[i]);
+	delete[] chunks;
 	delete[] I;
 	delete[] old;
 	delete[] new_block;
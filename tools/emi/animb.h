@@ -0,0 +1,67 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_ANIMB_H
+#define EMI_ANIMB_H
+
+#include <ostream>
+#include <string>
+#include "filetools.h"
+
+// Based on Benjamin Haischs filetype-information.
+
+// Prints the bones of an animb with their keyframes
+void animbToText(DataReader &file, std::ostream &out) {
+	std::string animName = readString(file);
+	float duration = readFloat(file);
+	int bones = readInt(file);
+	out << "animName: " << animName << " duration: " << duration << " bones: " << bones << '\n';
+	float time = 0.0f;
+	Vector3d vec3d;
+	Vector4d vec4d;
+	for (int i = 0; i < bones; i++) {
+		std::string boneName = readString(file);
+		int operation = readInt(file);
+		int unknown1 = readInt(file);
+		int unknown2 = readInt(file);
+		int numKeyframes = readInt(file);
+		out << "Bone: " << boneName << " Operation: " << operation << " Unknown1: " << unknown1 <<
+			" Unknown2: " << unknown2 << " numKeyframes: " << numKeyframes << '\n';
+
+		if (operation == 3) { // Translation
+			for(int j = 0; j < numKeyframes; j++) {
+				readVector3d(file, &vec3d, 1);
+				time = readFloat(file);
+				out << "Time : " << time << " Vector: " << vec3d.toString() << '\n';
+			}
+		} else if (operation == 4) { // Rotation
+			for(int j = 0; j < numKeyframes; j++) {
+				readVector4d(file, &vec4d, 1);
+				time = readFloat(file);
+				out << "Time : " << time << " Vector: " << vec4d.toString() << '\n';
+			}
+		}
+
+	}
+}
+
+#endif
@@ -20,12 +20,49 @@
 #include <fstream>
 #include <string>
 #include <iostream>
-#include "filetools.h"
+#include <cstdlib>
+#include "animb.h"
+#include "animcache.h"
 #include "tools/lab.h"
+#include "tools/assetloader.h"
+#include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 using namespace std;
 
+void usage() {
+	std::cout << "Usage: animb2txt [-b output] [-q] [-t tolerance] [labName] <animb-name>" << std::endl;
+	std::cout << "\t-b output\tWrite a binary animation cache instead of text" << std::endl;
+	std::cout << "\t-q\tWith -b, store the values quantized to 16 bits" << std::endl;
+	std::cout << "\t-t tolerance\tWith -b, drop the keys interpolation gets within tolerance of" << std::endl;
+}
+
 int main(int argc, char **argv) {
+	const char *cacheName = NULL;
+	bool quantize = false;
+	float tolerance = -1.0f;
+	int c;
+	Common::initStats("animb2txt", argc, argv);
+	while ((c = getopt(argc, argv, "b:qt:h")) != -1) {
+		switch (c) {
+		case 'b':
+			cacheName = optarg;
+			break;
+		case 'q':
+			quantize = true;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 2) {
 		std::cout << "Error: filename not specified" << std::endl;
 		return 0;
@@ -35,49 +72,49 @@ int main(int argc, char **argv) {
 	std::string filename;
 	
 	if (argc > 2) {
-		lab = new Lab(argv[1]);
+		lab = new Lab(argv[1], false, true);
 		filename = argv[2];
 	} else {
 		filename = argv[1];
 	}
 	
-	std::istream *file = getFile(filename, lab);
+	AssetLoader loader(lab);
+	const Asset *asset = loader.load(filename);
 	
-	if (!file) {
+	if (!asset) {
 		std::cout << "Unable to open file " << filename << std::endl;
 		return 0;
 	}
-	std::string animName = readString(*file);
-	float duration = readFloat(*file);
-	int bones = readInt(*file);
-	std::cout << "animName: " << animName << " duration: " << duration << " bones: " << bones << std::endl;
-	float time = 0.0f;
-	Vector3d *vec3d;
-	Vector4d *vec4d;
-	for (int i = 0; i < bones; i++) {
-		std::string boneName = readString(*file);
-		int operation = readInt(*file);
-		int unknown1 = readInt(*file);
-		int unknown2 = readInt(*file);
-		int numKeyframes = readInt(*file);
-		std::cout << "Bone: " << boneName << " Operation: " << operation << " Unknown1: " << unknown1 <<
-			" Unknown2: " << unknown2 << " numKeyframes: " << numKeyframes << std::endl;
+	DataReader file(asset->data, asset->size);
+	if (!cacheName) {
+		Common::StatsPhase phase(Common::kStatsConvert);
+		animbToText(file, std::cout);
+		Common::addStatsFiles();
+		return 0;
+	}
 
-		if (operation == 3) { // Translation
-			for(int j = 0; j < numKeyframes; j++) {
-				vec3d = readVector3d(*file);
-				time = readFloat(*file);
-				std::cout << "Time : " << time << " Vector: " << vec3d->toString() << std::endl;
-				delete vec3d;
-			}
-		} else if (operation == 4) { // Rotation
-			for(int j = 0; j < numKeyframes; j++) {
-				vec4d = readVector4d(*file);
-				time = readFloat(*file);
-				std::cout << "Time : " << time << " Vector: " << vec4d->toString() << std::endl;
-				delete vec4d;
-			}		
+	AnimCache cache;
+	uint32 numKeys;
+	{
+		Common::StatsPhase phase(Common::kStatsDecode);
+		if (!readAnimb(file, cache))
+			std::cout << "Warning: " << filename << " is truncated" << std::endl;
+		numKeys = cache.getNumKeys();
+	}
+	if (tolerance >= 0) {
+		Common::StatsPhase phase(Common::kStatsConvert);
+		compactAnimCache(cache, tolerance);
+	}
+	{
+		Common::StatsPhase phase(Common::kStatsWrite);
+		std::ofstream out(cacheName, std::ios::out | std::ios::binary);
+		if (!out || !writeAnimCache(cache, out, quantize)) {
+			std::cout << "Unable to write " << cacheName << std::endl;
+			return 1;
 		}
-
+		Common::addStatsWritten(out.tellp());
 	}
+	Common::addStatsFiles();
+	std::cout << cache._tracks.size() << " tracks, " << cache.getNumKeys() << " of " << numKeys << " keys kept" << std::endl;
+	return 0;
 }
@@ -0,0 +1,376 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_ANIMCACHE_H
+#define EMI_ANIMCACHE_H
+
+#include <cmath>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "filetools.h"
+
+/*
+ * Binary cache of an animb, written by animb2txt -b and read by renderModel
+ * in place of the animb. All values are little-endian 32-bit unless noted:
+ *
+ * header	"ANMC", version, flags, duration, numTracks, numKeys,
+ *		numValues, namesSize
+ * tracks	nameOffset, operation, unknown1, unknown2, numKeys, firstKey,
+ *		firstValue, then base[4] and scale[4] of the quantized values
+ * times	one float per key, each track's keys contiguous
+ * values	3 (translations) or 4 (rotations) per key, contiguous per
+ *		track, floats or with kAnimCacheQuantized 16-bit steps of scale
+ *		above base
+ * names	NUL-terminated, the animation's name at offset 0
+ *
+ * Only translations (3) and rotations (4) have keys, as in the animb.
+ */
+
+enum {
+	kAnimCacheVersion = 1,
+	kAnimCacheQuantized = 1,
+	kAnimCacheHeaderSize = 32,
+	kAnimCacheTrackSize = 60
+};
+
+struct AnimTrack {
+	std::string _bone;
+	int _operation;
+	int _unknown1;
+	int _unknown2;
+	uint32 _numKeys;
+	uint32 _firstKey;
+	uint32 _firstValue;
+};
+
+/**
+ * An animation with the keys of all its tracks in two arrays, the times and
+ * the values, so sampling walks contiguous memory.
+ */
+struct AnimCache {
+	std::string _name;
+	float _duration;
+	std::vector<AnimTrack> _tracks;
+	std::vector<float> _times;
+	std::vector<float> _values;
+
+	AnimCache() : _duration(0) {}
+	uint32 getNumKeys() const { return _times.size(); }
+};
+
+// Values stored per key of a track with operation
+inline int animComponents(int operation) {
+	return operation == 3 ? 3 : operation == 4 ? 4 : 0;
+}
+
+// Interpolates between two keys like renderModel's KeyframeList::sample()
+static void interpolateKey(int operation, const float *a, const float *b, float t, float *out) {
+	if (operation == 4) {
+		// Normalized lerp along the shorter arc
+		float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+		float s = dot < 0 ? -t : t;
+		float len = 0;
+		for (int c = 0; c < 4; c++) {
+			out[c] = a[c] * (1 - t) + b[c] * s;
+			len += out[c] * out[c];
+		}
+		len = sqrtf(len);
+		if (len > 0) {
+			for (int c = 0; c < 4; c++)
+				out[c] /= len;
+		}
+	} else {
+		for (int c = 0; c < 3; c++)
+			out[c] = a[c] + (b[c] - a[c]) * t;
+	}
+}
+
+/**
+ * Reads an animb into cache. Returns false if the data ends early, cache
+ * then holds the tracks read so far.
+ */
+bool readAnimb(DataReader &file, AnimCache &cache) {
+	cache._name = readString(file);
+	cache._duration = readFloat(file);
+	int bones = readInt(file);
+	cache._tracks.clear();
+	cache._times.clear();
+	cache._values.clear();
+	for (int i = 0; i < bones && !file.eos(); i++) {
+		AnimTrack track;
+		track._bone = readString(file);
+		track._operation = readInt(file);
+		track._unknown1 = readInt(file);
+		track._unknown2 = readInt(file);
+		int numKeyframes = readInt(file);
+		int components = animComponents(track._operation);
+		// Each keyframe is the value followed by its time
+		uint32 keySize = (components + 1) * 4;
+		if (!components || numKeyframes < 0)
+			numKeyframes = 0;
+		if ((uint32)numKeyframes > file.remaining() / keySize) {
+			file.skip(file.remaining() + 1);
+			break;
+		}
+		track._numKeys = numKeyframes;
+		track._firstKey = cache._times.size();
+		track._firstValue = cache._values.size();
+		cache._times.resize(track._firstKey + numKeyframes);
+		cache._values.resize(track._firstValue + numKeyframes * components);
+		for (int j = 0; j < numKeyframes; j++) {
+			readFloats(file, &cache._values[track._firstValue + j * components], components);
+			cache._times[track._firstKey + j] = readFloat(file);
+		}
+		cache._tracks.push_back(track);
+	}
+	return !file.eos();
+}
+
+/**
+ * Drops the keys of each track that interpolating their neighbours
+ * reproduces to within tolerance, in every component. The first and last
+ * keys are always kept. Returns the number of keys dropped.
+ */
+uint32 compactAnimCache(AnimCache &cache, float tolerance) {
+	std::vector<float> times, values;
+	times.reserve(cache._times.size());
+	values.reserve(cache._values.size());
+	uint32 dropped = 0;
+	for (size_t i = 0; i < cache._tracks.size(); i++) {
+		AnimTrack &track = cache._tracks[i];
+		int components = animComponents(track._operation);
+		if (!track._numKeys) {
+			track._firstKey = times.size();
+			track._firstValue = values.size();
+			continue;
+		}
+		const float *t = &cache._times[0] + track._firstKey;
+		const float *v = &cache._values[0] + track._firstValue;
+		uint32 firstKey = times.size(), firstValue = values.size();
+		uint32 last = 0;
+		for (uint32 k = 0; k < track._numKeys; k++) {
+			// Keep k if the segment from the last key kept to the one after k
+			// strays too far from any of the keys it would replace
+			bool keep = k == 0 || k + 1 == track._numKeys;
+			for (uint32 j = last + 1; j <= k && !keep; j++) {
+				float span = t[k + 1] - t[last];
+				float f = span > 0 ? (t[j] - t[last]) / span : 0.0f;
+				float p[4];
+				interpolateKey(track._operation, v + last * components, v + (k + 1) * components, f, p);
+				for (int c = 0; c < components; c++) {
+					if (fabs(p[c] - v[j * components + c]) > tolerance)
+						keep = true;
+				}
+			}
+			if (keep) {
+				times.push_back(t[k]);
+				values.insert(values.end(), v + k * components, v + (k + 1) * components);
+				last = k;
+			} else {
+				dropped++;
+			}
+		}
+		track._numKeys = times.size() - firstKey;
+		track._firstKey = firstKey;
+		track._firstValue = firstValue;
+	}
+	cache._times.swap(times);
+	cache._values.swap(values);
+	return dropped;
+}
+
+static inline void writeCacheInt(std::vector<char> &out, uint32 v) {
+	char buf[4];
+	WRITE_LE_UINT32(buf, v);
+	out.insert(out.end(), buf, buf + 4);
+}
+
+static inline void writeCacheFloat(std::vector<char> &out, float f) {
+	uint32 bits;
+	memcpy(&bits, &f, 4);
+	writeCacheInt(out, bits);
+}
+
+/**
+ * Writes cache in the format above, with 16-bit values if quantize is set.
+ * The quantization step of each component is its range in the track over
+ * 65535.
+ */
+bool writeAnimCache(const AnimCache &cache, std::ostream &os, bool quantize) {
+	std::string names = cache._name;
+	names += '\0';
+	std::vector<char> out;
+	out.insert(out.end(), "ANMC", "ANMC" + 4);
+	writeCacheInt(out, kAnimCacheVersion);
+	writeCacheInt(out, quantize ? kAnimCacheQuantized : 0);
+	writeCacheFloat(out, cache._duration);
+	writeCacheInt(out, cache._tracks.size());
+	writeCacheInt(out, cache._times.size());
+	writeCacheInt(out, cache._values.size());
+	uint32 namesSizeAt = out.size();
+	writeCacheInt(out, 0); // patched below
+
+	std::vector<float> bases(cache._tracks.size() * 4), scales(cache._tracks.size() * 4);
+	for (size_t i = 0; i < cache._tracks.size(); i++) {
+		const AnimTrack &track = cache._tracks[i];
+		int components = animComponents(track._operation);
+		float *base = &bases[i * 4], *scale = &scales[i * 4];
+		for (int c = 0; c < 4; c++) {
+			float lo = 0, hi = 0;
+			for (uint32 k = 0; k < track._numKeys && c < components; k++) {
+				float f = cache._values[track._firstValue + k * components + c];
+				if (k == 0 || f < lo)
+					lo = f;
+				if (k == 0 || f > hi)
+					hi = f;
+			}
+			base[c] = quantize ? lo : 0.0f;
+			scale[c] = quantize ? (hi - lo) / 65535.0f : 1.0f;
+		}
+
+		writeCacheInt(out, names.size());
+		names += track._bone;
+		names += '\0';
+		writeCacheInt(out, track._operation);
+		writeCacheInt(out, track._unknown1);
+		writeCacheInt(out, track._unknown2);
+		writeCacheInt(out, track._numKeys);
+		writeCacheInt(out, track._firstKey);
+		writeCacheInt(out, track._firstValue);
+		for (int c = 0; c < 4; c++)
+			writeCacheFloat(out, base[c]);
+		for (int c = 0; c < 4; c++)
+			writeCacheFloat(out, scale[c]);
+	}
+	for (size_t i = 0; i < cache._times.size(); i++)
+		writeCacheFloat(out, cache._times[i]);
+	for (size_t i = 0; i < cache._tracks.size(); i++) {
+		const AnimTrack &track = cache._tracks[i];
+		int components = animComponents(track._operation);
+		const float *base = &bases[i * 4], *scale = &scales[i * 4];
+		for (uint32 k = 0; k < track._numKeys * components; k++) {
+			float f = cache._values[track._firstValue + k];
+			if (!quantize) {
+				writeCacheFloat(out, f);
+				continue;
+			}
+			int c = k % components;
+			uint16 q = scale[c] > 0 ? (uint16)floor((f - base[c]) / scale[c] + 0.5f) : 0;
+			char buf[2];
+			WRITE_LE_UINT16(buf, q);
+			out.insert(out.end(), buf, buf + 2);
+		}
+	}
+	out.insert(out.end(), names.begin(), names.end());
+	WRITE_LE_UINT32(&out[namesSizeAt], names.size());
+
+	os.write(&out[0], out.size());
+	return !os.fail();
+}
+
+// True if data starts like an animation cache, rather than an animb
+inline bool isAnimCache(const char *data, uint32 size) {
+	return size >= 4 && memcmp(data, "ANMC", 4) == 0;
+}
+
+/**
+ * Reads a cache written by writeAnimCache(), checking every count and
+ * offset. Quantized values are expanded back to floats.
+ */
+bool loadAnimCache(DataReader &file, AnimCache &cache) {
+	const char *start = file.ptr();
+	uint32 size = file.remaining();
+	if (size < kAnimCacheHeaderSize || !isAnimCache(start, size))
+		return false;
+	file.skip(4);
+	if ((uint32)readInt(file) != kAnimCacheVersion)
+		return false;
+	uint32 flags = readInt(file);
+	cache._duration = readFloat(file);
+	uint32 numTracks = readInt(file);
+	uint32 numKeys = readInt(file);
+	uint32 numValues = readInt(file);
+	uint32 namesSize = readInt(file);
+	uint32 valueSize = flags & kAnimCacheQuantized ? 2 : 4;
+	uint64 total = kAnimCacheHeaderSize + (uint64)numTracks * kAnimCacheTrackSize + (uint64)numKeys * 4 +
+		(uint64)numValues * valueSize + namesSize;
+	if (total > size || namesSize == 0 || start[total - 1] != 0)
+		return false;
+	const char *names = start + total - namesSize;
+	cache._name = names;
+
+	cache._tracks.resize(numTracks);
+	std::vector<float> bases(numTracks * 4), scales(numTracks * 4);
+	for (uint32 i = 0; i < numTracks; i++) {
+		AnimTrack &track = cache._tracks[i];
+		uint32 nameOffset = readInt(file);
+		track._operation = readInt(file);
+		track._unknown1 = readInt(file);
+		track._unknown2 = readInt(file);
+		track._numKeys = readInt(file);
+		track._firstKey = readInt(file);
+		track._firstValue = readInt(file);
+		readFloats(file, &bases[i * 4], 4);
+		readFloats(file, &scales[i * 4], 4);
+		uint32 components = animComponents(track._operation);
+		if (nameOffset >= namesSize || track._firstKey > numKeys || numKeys - track._firstKey < track._numKeys ||
+				track._firstValue > numValues || (numValues - track._firstValue) / (components ? components : 1) < track._numKeys ||
+				(!components && track._numKeys))
+			return false;
+		track._bone = names + nameOffset;
+	}
+
+	cache._times.resize(numKeys);
+	if (numKeys)
+		readFloats(file, &cache._times[0], numKeys);
+	cache._values.resize(numValues);
+	if (!(flags & kAnimCacheQuantized)) {
+		if (numValues)
+			readFloats(file, &cache._values[0], numValues);
+	} else {
+		// Values outside every track are left at 0
+		const char *q = file.ptr();
+		for (uint32 i = 0; i < numTracks; i++) {
+			const AnimTrack &track = cache._tracks[i];
+			int components = animComponents(track._operation);
+			for (uint32 k = 0; k < track._numKeys * components; k++) {
+				uint32 v = track._firstValue + k;
+				int c = k % components;
+				cache._values[v] = bases[i * 4 + c] + scales[i * 4 + c] * READ_LE_UINT16(q + v * 2);
+			}
+		}
+		file.skip(numValues * 2);
+	}
+	file.skip(namesSize);
+	return true;
+}
+
+// Reads either an animation cache or an animb
+bool readAnimation(DataReader &file, AnimCache &cache) {
+	if (isAnimCache(file.ptr(), file.remaining()))
+		return loadAnimCache(file, cache);
+	return readAnimb(file, cache);
+}
+
+#endif
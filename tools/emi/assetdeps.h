@@ -0,0 +1,206 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_ASSETDEPS_H
+#define EMI_ASSETDEPS_H
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "cosb.h"
+#include "tools/lab.h"
+#include "tools/assetloader.h"
+#include "common/pattern.h"
+
+enum AssetKind {
+	kAssetSet,
+	kAssetCostume,
+	kAssetMesh,
+	kAssetOther
+};
+
+struct AssetNode {
+	std::string name;
+	AssetKind kind;
+	bool found;	// False when the loader doesn't have it
+	std::vector<int> deps;
+};
+
+static AssetKind assetKind(const std::string &name) {
+	if (Common::matchPattern("*.setb", name.c_str()))
+		return kAssetSet;
+	if (Common::matchPattern("*.cosb", name.c_str()))
+		return kAssetCostume;
+	if (Common::matchPattern("*.meshb", name.c_str()))
+		return kAssetMesh;
+	return kAssetOther;
+}
+
+/**
+ * What the assets of a scene need, read from their data: the background
+ * tiles of the set's setups, the meshes, skeletons, animations, textures
+ * and sounds named by the tracks of the costumes, and the textures of the
+ * meshes. Which costumes a set shows is up to the scripts, so a scene is
+ * given as its set and its costumes.
+ */
+class AssetGraph {
+	AssetLoader &_loader;
+	std::vector<AssetNode> _nodes;
+	std::map<std::string, int> _index;
+
+	int node(const std::string &name) {
+		std::map<std::string, int>::const_iterator it = _index.find(name);
+		if (it != _index.end())
+			return it->second;
+		AssetNode n;
+		n.name = name;
+		n.kind = assetKind(name);
+		n.found = false;
+		_nodes.push_back(n);
+		_index[name] = _nodes.size() - 1;
+		return _nodes.size() - 1;
+	}
+
+	void addDep(int from, const std::string &name) {
+		if (name.empty())
+			return;
+		int to = node(name);
+		std::vector<int> &deps = _nodes[from].deps;
+		for (size_t i = 0; i < deps.size(); i++) {
+			if (deps[i] == to)
+				return;
+		}
+		deps.push_back(to);
+	}
+
+	// The setups, as setb2set reads them: a 128 byte name, a number, the
+	// tile and ten floats
+	void scanSet(int n, DataReader file) {
+		uint32 numSetups = readInt(file);
+		for (uint32 i = 0; i < numSetups && !file.eos(); i++) {
+			file.skip(128 + 4);
+			const char *nul = (const char *)memchr(file.ptr(), 0, file.remaining());
+			std::string tile(file.ptr(), nul ? nul : file.ptr() + file.remaining());
+			file.skip(tile.size() + 1 + 10 * 4);
+			addDep(n, tile);
+		}
+	}
+
+	// Those of the tracks which name a file
+	void scanCostume(int n, DataReader file) {
+		int numChores = readInt(file);
+		for (int i = 0; i < numChores && !file.eos(); i++) {
+			Chore chore;
+			chore.readHeader(file);
+			for (int j = 0; j < chore._numTracks && !file.eos(); j++) {
+				ChoreTrack track;
+				track.readHeader(file, false);
+				track.readKeys(file, NULL);
+				// The name keeps the separator after the tag
+				std::string::size_type start = track._trackName.find_first_not_of("/\\");
+				if (start != std::string::npos && track._trackName.find('.', start) != std::string::npos)
+					addDep(n, track._trackName.substr(start));
+			}
+		}
+	}
+
+	// The start of readMesh(), up to the texture names
+	void scanMesh(int n, DataReader file) {
+		readString(file);
+		file.skip(4 * 4 + 2 * 3 * 4 + 2 * 4);
+		int numTextures = readInt(file);
+		for (int i = 0; i < numTextures && !file.eos(); i++) {
+			addDep(n, readString(file));
+			readInt(file);
+		}
+	}
+
+	void scan(int n) {
+		// Only the formats read here are loaded, of the others it is enough
+		// to know they are there
+		if (_nodes[n].kind == kAssetOther) {
+			_nodes[n].found = _loader.contains(_nodes[n].name);
+			return;
+		}
+		const Asset *asset = _loader.load(_nodes[n].name);
+		if (!asset)
+			return;
+		_nodes[n].found = true;
+		DataReader file(asset->data, asset->size);
+		if (_nodes[n].kind == kAssetSet)
+			scanSet(n, file);
+		else if (_nodes[n].kind == kAssetCostume)
+			scanCostume(n, file);
+		else if (_nodes[n].kind == kAssetMesh)
+			scanMesh(n, file);
+		_loader.release(asset);
+	}
+
+public:
+	AssetGraph(AssetLoader &loader) : _loader(loader) {}
+
+	/** Adds the asset and everything it needs, returns its node */
+	int add(const std::string &name) {
+		size_t first = _nodes.size();
+		int root = node(name);
+		// Every node added since is scanned once, in the order found
+		for (size_t i = first; i < _nodes.size(); i++)
+			scan(i);
+		return root;
+	}
+
+	size_t size() const { return _nodes.size(); }
+	const AssetNode &operator[](size_t i) const { return _nodes[i]; }
+
+	/** The names of the assets found which the roots need, roots first */
+	std::vector<std::string> closure(const std::vector<int> &roots) const {
+		std::vector<bool> seen(_nodes.size(), false);
+		std::vector<int> queue;
+		for (size_t i = 0; i < roots.size(); i++) {
+			if (!seen[roots[i]]) {
+				seen[roots[i]] = true;
+				queue.push_back(roots[i]);
+			}
+		}
+		std::vector<std::string> names;
+		for (size_t i = 0; i < queue.size(); i++) {
+			const AssetNode &n = _nodes[queue[i]];
+			if (n.found)
+				names.push_back(n.name);
+			for (size_t j = 0; j < n.deps.size(); j++) {
+				if (!seen[n.deps[j]]) {
+					seen[n.deps[j]] = true;
+					queue.push_back(n.deps[j]);
+				}
+			}
+		}
+		return names;
+	}
+
+	/** Starts reading everything the roots need in the background */
+	void prefetch(const std::vector<int> &roots) {
+		_loader.prefetch(closure(roots));
+	}
+};
+
+#endif
@@ -0,0 +1,265 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_COSB_H
+#define EMI_COSB_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "filetools.h"
+#include "tools/lab.h"
+
+std::string getTag(std::string str) {
+	if (str.at(0) != '!')
+		std::cout << "Erroneous Tag\n";
+	std::string tag = str.substr(1,4);
+	return tag;
+}
+
+std::string getCompName(std::string str) {
+	return str.substr(5);
+}
+
+/**
+ * The costume's tags in the order they were first seen. Lookups go through
+ * the same name index as the lab's, so costumes with thousands of tracks
+ * don't rescan the list for each of them.
+ */
+class TagSet {
+	std::vector<std::string> _tags;
+	NameIndex _index;
+
+public:
+	void insert(const std::string &tag) {
+		if (_index.insert(tag.c_str(), _tags.size(), *this))
+			_tags.push_back(tag);
+	}
+
+	void clear() {
+		_tags.clear();
+		_index.reset();
+	}
+
+	size_t size() const { return _tags.size(); }
+	const std::string &operator[](size_t i) const { return _tags[i]; }
+	/** For the index, which reads the tags back through it */
+	const char *getEntryName(uint32 i) const { return _tags[i].c_str(); }
+};
+
+struct TrackKey {
+	float _time;
+	float _value;
+};
+
+// Keys are read as a run of floats
+typedef char TrackKeyIsPacked[sizeof(TrackKey) == 2 * sizeof(float) ? 1 : -1];
+
+struct ChoreTrack {
+	std::string _tag;
+	std::string _trackName;
+	int _hash;
+	int _parentID;
+	int _numKeys;
+
+	ChoreTrack() : _hash(0), _parentID(0), _numKeys(0) {}
+
+	// Reads everything but the keys, which follow, reporting a bad tag if asked
+	void readHeader(DataReader &file, bool checkTag) {
+		// Split this into tag & name later.
+		_trackName = readString(file);
+		_tag = checkTag ? getTag(_trackName) : _trackName.substr(1, 4);
+		_trackName = getCompName(_trackName);
+		_hash = readInt(file);
+		_parentID = readInt(file);
+		_numKeys = readInt(file);
+	}
+	// Reads the keys into keys when given, skips them otherwise
+	void readKeys(DataReader &file, std::vector<TrackKey> *keys) {
+		uint32 avail = file.remaining() / sizeof(TrackKey);
+		uint32 count = _numKeys < 0 ? avail + 1 : (uint32)_numKeys;
+		if (count > avail) {
+			_numKeys = avail;
+			file.skip(file.remaining() + 1);
+			if (keys)
+				keys->clear();
+			return;
+		}
+		if (keys) {
+			keys->resize(count);
+			if (count)
+				readFloats(file, &(*keys)[0]._time, count * 2);
+		} else {
+			file.skip(count * sizeof(TrackKey));
+		}
+	}
+	void printComponent(std::ostream &out, int &count) {
+		out << count << "\t" << _tag << "\t" << _hash << "\t" <<_parentID << "\t" << _trackName << '\n';
+	}
+};
+
+struct Chore {
+	std::string _choreName;
+	float _length;
+	int _numTracks;
+
+	Chore() : _length(0), _numTracks(0) {}
+
+	// Reads everything but the tracks, which follow
+	void readHeader(DataReader &file) {
+		_choreName = readString(file);
+		_length = readFloat(file);
+		_numTracks = readInt(file);
+	}
+
+	void print(std::ostream &out, int count) {
+		out << count << "\t" << _length << "\t" << _numTracks << "\t" << _choreName << '\n';
+	}
+};
+
+/**
+ * A costume read straight from its data. readFromFile() only gathers the
+ * tags, the print functions then walk the chores again and write each one
+ * as it is parsed, so neither tracks nor keys are held for the
+ * whole costume.
+ */
+struct Costume {
+	DataReader _data;
+	int _numChores;
+	TagSet _tags;
+	// Reused for the keys of each track printed
+	std::vector<TrackKey> _keys;
+
+	Costume() : _data(NULL, 0), _numChores(0) {}
+
+	void readFromFile(DataReader &file) {
+		_data = file;
+		_tags.clear();
+		DataReader reader = begin();
+		for (int i = 0; i < _numChores && !reader.eos(); i++) {
+			Chore chore;
+			chore.readHeader(reader);
+			for (int j = 0; j < chore._numTracks && !reader.eos(); j++) {
+				ChoreTrack track;
+				track.readHeader(reader, true);
+				_tags.insert(track._tag);
+				track.readKeys(reader, NULL);
+			}
+		}
+	}
+
+	void print(std::ostream &out) {
+		out << "section: tags\n";
+		out << "\tnumtags " << _tags.size() << '\n';
+		for (size_t i = 0; i < _tags.size(); i++) {
+			out << i << "\t" << _tags[i] << '\n';
+		}
+		out << '\n';
+		out << "section: components\n";
+		out << "\tnumcomponents: x\n";
+
+		int count = 0;
+		DataReader reader = begin();
+		for (int i = 0; i < _numChores && !reader.eos(); i++) {
+			Chore chore;
+			chore.readHeader(reader);
+			for (int j = 0; j < chore._numTracks && !reader.eos(); j++) {
+				ChoreTrack track;
+				readTrack(reader, track, NULL);
+				track.printComponent(out, count);
+				count++;
+			}
+		}
+		out << '\n';
+		out << "section: chores\n";
+		out << "\tnumchores: x\n";
+		count = 0;
+		reader = begin();
+		for (int i = 0; i < _numChores && !reader.eos(); i++) {
+			Chore chore;
+			chore.readHeader(reader);
+			chore.print(out, count);
+			count++;
+			for (int j = 0; j < chore._numTracks && !reader.eos(); j++) {
+				ChoreTrack track;
+				readTrack(reader, track, NULL);
+			}
+		}
+		out << '\n';
+		out << "section: keys\n";
+		out << "\tnumkeys: x\n";
+		// TODO
+	}
+
+	void printChore(std::ostream &out, const char *choreName) {
+		DataReader reader = begin();
+		for (int i = 0; i < _numChores && !reader.eos(); i++) {
+			Chore chore;
+			chore.readHeader(reader);
+			bool found = chore._choreName == choreName;
+			if (found) {
+				out << "Chore " << choreName << " (" << chore._numTracks << " tracks) ";
+				if (chore._length == 1000)
+					out << "(instant)";
+				else
+					out << 1000.0 * chore._length << " ms";
+
+				out << '\n';
+			}
+			for (int t = 0; t < chore._numTracks && !reader.eos(); t++) {
+				ChoreTrack track;
+				readTrack(reader, track, found ? &_keys : NULL);
+				if (!found)
+					continue;
+				out << "Track " << t << ": tag " << track._tag << ", data [" << track._trackName << "]" << '\n';
+
+				for (int k = 0; k < track._numKeys; k++) {
+					TrackKey &tk = _keys[k];
+					out << "\t";
+					out << std::right << std::setw(5);
+					out << (1000.0 * tk._time) << " ms";
+					out << "\t" << tk._value << '\n';
+				}
+			}
+			if (found)
+				return;
+		}
+		out << "Error: chore " << choreName << " not found!" << '\n';
+	}
+
+private:
+	// A reader at the first chore, its count read again
+	DataReader begin() {
+		DataReader reader = _data;
+		_numChores = readInt(reader);
+		return reader;
+	}
+
+	// Bad tags were reported by readFromFile() already
+	static void readTrack(DataReader &reader, ChoreTrack &track, std::vector<TrackKey> *keys) {
+		track.readHeader(reader, false);
+		track.readKeys(reader, keys);
+	}
+};
+
+#endif
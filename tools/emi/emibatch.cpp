@@ -0,0 +1,319 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "meshb.h"
+#include "sklb.h"
+#include "animb.h"
+#include "cosb.h"
+#include "tools/lab.h"
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#ifdef WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+enum AssetType {
+	kMeshb,
+	kSklb,
+	kAnimb,
+	kCosb,
+	kNumAssetTypes
+};
+
+struct AssetFormat {
+	const char *pattern;
+	const char *dir;
+	const char *ext;
+};
+
+static const AssetFormat formats[kNumAssetTypes] = {
+	{ "*.meshb", "meshb", ".obj" },
+	{ "*.sklb", "sklb", ".txt" },
+	{ "*.animb", "animb", ".txt" },
+	{ "*.cosb", "cosb", ".cos" }
+};
+
+struct TypeStats {
+	int count;
+	int failed;
+	double bytes;
+	double seconds;
+};
+
+static double now() {
+#ifdef POSIX
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void usage() {
+	std::cout << "Usage: emibatch [-j N] [-c] <labfilename> <outputdir>" << std::endl;
+	std::cout << "Converts every meshb, sklb, animb and cosb in the lab into" << std::endl;
+	std::cout << "outputdir/meshb/*.obj, sklb/*.txt, animb/*.txt and cosb/*.cos" << std::endl;
+	std::cout << "\t-j N\tConvert with N threads" << std::endl;
+	std::cout << "\t-c\tLeave the comment lines out of the obj files" << std::endl;
+}
+
+struct BatchJob {
+	Lab *lab;
+	std::string outDir;
+	bool comments;
+	uint32 nextEntry;
+	TypeStats stats[kNumAssetTypes];
+#ifdef POSIX
+	pthread_mutex_t lock;
+#endif
+};
+
+static int assetType(const char *name) {
+	for (int i = 0; i < kNumAssetTypes; i++) {
+		if (Common::matchPattern(formats[i].pattern, name))
+			return i;
+	}
+	return -1;
+}
+
+// Entry names may carry a path, which is flattened into the type's directory
+static std::string outputName(const BatchJob *job, int type, const char *name) {
+	std::string file = name;
+	file.erase(file.rfind('.'));
+	for (size_t i = 0; i < file.size(); i++) {
+		if (file[i] == '/' || file[i] == '\\' || file[i] == ':')
+			file[i] = '_';
+	}
+	return job->outDir + "/" + formats[type].dir + "/" + file + formats[type].ext;
+}
+
+static bool convert(const BatchJob *job, int type, const char *name, const char *data, uint32 size) {
+	std::string outName = outputName(job, type, name);
+	DataReader file(data, size);
+
+	if (type == kMeshb) {
+		MeshData mesh;
+		{
+			Common::StatsPhase phase(Common::kStatsDecode);
+			readMesh(file, mesh);
+		}
+		FILE *f = fopen(outName.c_str(), "wb");
+		if (!f)
+			return false;
+		{
+			Common::StatsPhase phase(Common::kStatsConvert);
+			TextWriter out(f);
+			writeObj(out, mesh, job->comments);
+		}
+		return fclose(f) == 0;
+	}
+
+	std::ofstream out(outName.c_str(), std::ios::out | std::ios::binary);
+	if (!out)
+		return false;
+	Common::StatsPhase phase(Common::kStatsConvert);
+	if (type == kSklb) {
+		sklbToText(file, out);
+	} else if (type == kAnimb) {
+		animbToText(file, out);
+	} else {
+		Costume c;
+		c.readFromFile(file);
+		c.print(out);
+	}
+	out.close();
+	return !out.fail();
+}
+
+static void *batchWorker(void *arg) {
+	BatchJob *job = (BatchJob *)arg;
+	// Gathered locally and merged once at the end
+	TypeStats stats[kNumAssetTypes];
+	memset(stats, 0, sizeof(stats));
+	for (;;) {
+#ifdef POSIX
+		pthread_mutex_lock(&job->lock);
+#endif
+		uint32 index = job->nextEntry++;
+#ifdef POSIX
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (index >= job->lab->getNumEntries())
+			break;
+
+		const char *name = job->lab->getEntryName(index);
+		int type = assetType(name);
+		if (type < 0)
+			continue;
+
+		double start = now();
+		uint32 size;
+		const char *data = job->lab->getEntryData(index, size);
+		if (data && convert(job, type, name, data, size)) {
+			stats[type].count++;
+			stats[type].bytes += size;
+			Common::addStatsFiles();
+		} else {
+			printf("Could not convert file %s.\n", name);
+			stats[type].failed++;
+		}
+		stats[type].seconds += now() - start;
+	}
+
+#ifdef POSIX
+	pthread_mutex_lock(&job->lock);
+#endif
+	for (int i = 0; i < kNumAssetTypes; i++) {
+		job->stats[i].count += stats[i].count;
+		job->stats[i].failed += stats[i].failed;
+		job->stats[i].bytes += stats[i].bytes;
+		job->stats[i].seconds += stats[i].seconds;
+	}
+#ifdef POSIX
+	pthread_mutex_unlock(&job->lock);
+#endif
+	return NULL;
+}
+
+static bool makeDir(const std::string &path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0)
+		return (st.st_mode & S_IFDIR) != 0;
+	return mkdir(path.c_str(), 0755) == 0;
+}
+
+static void printSummary(const BatchJob &job, int jobs, double elapsed) {
+	TypeStats total;
+	memset(&total, 0, sizeof(total));
+	printf("%-8s %8s %8s %12s %10s\n", "type", "files", "failed", "bytes", "seconds");
+	for (int i = 0; i < kNumAssetTypes; i++) {
+		const TypeStats &s = job.stats[i];
+		printf("%-8s %8d %8d %12.0f %10.3f\n", formats[i].dir, s.count, s.failed, s.bytes, s.seconds);
+		total.count += s.count;
+		total.failed += s.failed;
+		total.bytes += s.bytes;
+		total.seconds += s.seconds;
+	}
+	printf("%-8s %8d %8d %12.0f %10.3f\n", "total", total.count, total.failed, total.bytes, total.seconds);
+	printf("%.3f seconds elapsed with %d thread%s\n", elapsed, jobs, jobs == 1 ? "" : "s");
+}
+
+int main(int argc, char **argv) {
+	bool comments = true;
+	int jobs = 1;
+	int c;
+	Common::initStats("emibatch", argc, argv);
+	while ((c = getopt(argc, argv, "cj:h")) != -1) {
+		switch (c) {
+		case 'c':
+			comments = false;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 3) {
+		usage();
+		return 1;
+	}
+
+	BatchJob job;
+	job.outDir = argv[2];
+	job.comments = comments;
+	job.nextEntry = 0;
+	memset(job.stats, 0, sizeof(job.stats));
+
+	if (!makeDir(job.outDir)) {
+		std::cout << "Unable to create directory " << job.outDir << std::endl;
+		return 1;
+	}
+	for (int i = 0; i < kNumAssetTypes; i++) {
+		if (!makeDir(job.outDir + "/" + formats[i].dir)) {
+			std::cout << "Unable to create directory " << job.outDir << "/" << formats[i].dir << std::endl;
+			return 1;
+		}
+	}
+
+	job.lab = new Lab(argv[1], false, true);
+	double start = now();
+
+#ifdef POSIX
+	pthread_mutex_init(&job.lock, NULL);
+	// Without a mapping all reads go through one shared buffer
+	if (!job.lab->isMapped())
+		jobs = 1;
+	pthread_t *threads = new pthread_t[jobs];
+	int started = 0;
+	for (int t = 1; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, batchWorker, &job) == 0)
+			++started;
+	}
+	batchWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	delete[] threads;
+	pthread_mutex_destroy(&job.lock);
+	jobs = started + 1;
+#else
+	jobs = 1;
+	batchWorker(&job);
+#endif
+
+	printSummary(job, jobs, now() - start);
+
+	int failed = 0;
+	for (int i = 0; i < kNumAssetTypes; i++)
+		failed += job.stats[i].failed;
+	delete job.lab;
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "assetdeps.h"
+#include "tools/assetloader.h"
+#include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+void usage() {
+	printf("Usage: emideps [-l | -p] <labfilename> <asset>...\n");
+	printf("Prints what each asset of a scene needs, e.g. its set and costumes,\n");
+	printf("and the assets they need in turn, marking those not in the lab\n");
+	printf("\t-l\tOnly list every asset the scene needs, one per line\n");
+	printf("\t-p\tStart reading every asset the scene needs into memory and exit\n");
+}
+
+int main(int argc, char **argv) {
+	bool list = false, prefetch = false;
+	int c;
+	Common::initStats("emideps", argc, argv);
+	while ((c = getopt(argc, argv, "lph")) != -1) {
+		switch (c) {
+		case 'l':
+			list = true;
+			break;
+		case 'p':
+			prefetch = true;
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	if (argc - optind < 2) {
+		usage();
+		return 1;
+	}
+
+	// The names in the assets aren't consistently cased
+	Lab lab(argv[optind], true, true);
+	AssetLoader loader(&lab);
+	AssetGraph graph(loader);
+	std::vector<int> roots;
+	{
+		Common::StatsPhase phase(Common::kStatsDecode);
+		for (int i = optind + 1; i < argc; i++)
+			roots.push_back(graph.add(argv[i]));
+	}
+	Common::addStatsFiles(graph.size());
+
+	if (prefetch) {
+		graph.prefetch(roots);
+		return 0;
+	}
+	if (list) {
+		std::vector<std::string> names = graph.closure(roots);
+		for (size_t i = 0; i < names.size(); i++)
+			printf("%s\n", names[i].c_str());
+		return 0;
+	}
+
+	int missing = 0;
+	for (size_t i = 0; i < graph.size(); i++) {
+		const AssetNode &n = graph[i];
+		if (!n.found) {
+			missing++;
+			continue;
+		}
+		if (n.deps.empty())
+			continue;
+		printf("%s\n", n.name.c_str());
+		for (size_t j = 0; j < n.deps.size(); j++) {
+			const AssetNode &dep = graph[n.deps[j]];
+			printf("\t%s%s\n", dep.name.c_str(), dep.found ? "" : " (missing)");
+		}
+	}
+	for (size_t i = 0; i < roots.size(); i++) {
+		if (!graph[roots[i]].found)
+			printf("%s is not in the lab\n", graph[roots[i]].name.c_str());
+	}
+	return missing ? 1 : 0;
+}
@@ -26,6 +26,7 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <string.h>
 #include "common/endian.h"
 
 template<typename T>
@@ -73,6 +74,54 @@ struct Vector4d {
 	}
 };
 
+// The array readers fill vectors as runs of floats
+typedef char Vector2dIsPacked[sizeof(Vector2d) == 2 * sizeof(float) ? 1 : -1];
+typedef char Vector3dIsPacked[sizeof(Vector3d) == 3 * sizeof(float) ? 1 : -1];
+typedef char Vector4dIsPacked[sizeof(Vector4d) == 4 * sizeof(float) ? 1 : -1];
+
+/**
+ * Cursor over little-endian data in memory, such as an asset mapped from a
+ * lab, with the same readers as std::istream below. Reading past the end
+ * gives zeroes, as a failed read of the stream does, and sets eos().
+ */
+class DataReader {
+	const char *_pos;
+	const char *_end;
+	bool _eos;
+public:
+	DataReader(const char *data, uint32 size) : _pos(data), _end(data + size), _eos(false) {}
+
+	void read(void *dest, uint32 len) {
+		uint32 avail = remaining();
+		if (len > avail) {
+			memset((char *)dest + avail, 0, len - avail);
+			len = avail;
+			_eos = true;
+		}
+		memcpy(dest, _pos, len);
+		_pos += len;
+	}
+	void skip(uint32 len) {
+		if (len > remaining()) {
+			len = remaining();
+			_eos = true;
+		}
+		_pos += len;
+	}
+	const char *ptr() const { return _pos; }
+	uint32 remaining() const { return _end - _pos; }
+	bool eos() const { return _eos; }
+};
+
+// Decodes count little-endian floats, swapping them in place on big-endian hosts
+void decodeFloats(float *dest, int count) {
+	FROM_LE_ARRAY_FLOAT(dest, count);
+}
+
+void decodeShorts(short *dest, int count) {
+	FROM_LE_ARRAY_16(dest, count);
+}
+
 float readFloat(std::istream& file) {
 	float retVal = 0.0f;
 	file.read((char*)&retVal, 4);
@@ -98,6 +147,70 @@ int readByte(std::istream& file) {
 	return retVal;
 }
 
+void readFloats(std::istream& file, float *dest, int count) {
+	memset(dest, 0, count * sizeof(float));
+	file.read((char *)dest, count * sizeof(float));
+	decodeFloats(dest, count);
+}
+
+void readShorts(std::istream& file, short *dest, int count) {
+	memset(dest, 0, count * sizeof(short));
+	file.read((char *)dest, count * sizeof(short));
+	decodeShorts(dest, count);
+}
+
+float readFloat(DataReader& file) {
+	float retVal = 0.0f;
+	file.read(&retVal, 4);
+	decodeFloats(&retVal, 1);
+	return retVal;
+}
+
+int readInt(DataReader& file) {
+	int retVal = 0;
+	file.read(&retVal, 4);
+	return FROM_LE_32(retVal);
+}
+
+short readShort(DataReader& file) {
+	short retVal = 0;
+	file.read(&retVal, 2);
+	return FROM_LE_16(retVal);
+}
+
+int readByte(DataReader& file) {
+	char retVal = 0;
+	file.read(&retVal, 1);
+	return retVal;
+}
+
+void readFloats(DataReader& file, float *dest, int count) {
+	file.read(dest, count * sizeof(float));
+	decodeFloats(dest, count);
+}
+
+void readShorts(DataReader& file, short *dest, int count) {
+	file.read(dest, count * sizeof(short));
+	decodeShorts(dest, count);
+}
+
+// Strings are taken up to their terminator, without a copy through the heap
+std::string readCString(DataReader &file, int len) {
+	uint32 avail = len < 0 ? 0 : (uint32)len;
+	if (avail > file.remaining())
+		avail = file.remaining();
+	const char *str = file.ptr();
+	const char *nul = (const char *)memchr(str, 0, avail);
+	std::string retVal(str, nul ? nul - str : avail);
+	file.skip(len);
+	return retVal;
+}
+
+std::string readString(DataReader& file) {
+	int strLength = readInt(file);
+	return readCString(file, strLength);
+}
+
 std::string readString(std::istream& file) {
 	int strLength = readInt(file);
 	char* readString = new char[strLength];
@@ -117,31 +230,108 @@ std::string readCString(std::istream &file, int len) {
 	return retVal;
 }
 
+// Vectors decoded into storage of the caller, file is a std::istream or a DataReader
+template<typename Reader>
+void readVector2d(Reader& file, Vector2d *dest, int count) {
+	readFloats(file, &dest[0].x, count * 2);
+}
+
+template<typename Reader>
+void readVector3d(Reader& file, Vector3d *dest, int count) {
+	readFloats(file, &dest[0].x, count * 3);
+}
+
+template<typename Reader>
+void readVector4d(Reader& file, Vector4d *dest, int count) {
+	readFloats(file, &dest[0].x, count * 4);
+}
+
+/**
+ * Decodes count vectors into separate arrays of coordinates, a layout the
+ * loops transforming or printing them can be vectorized over. The vectors
+ * go through a small buffer, so nothing is allocated.
+ */
+template<typename Reader>
+void readVector2dSoA(Reader& file, float *x, float *y, int count) {
+	float buf[2 * 256];
+	while (count > 0) {
+		int n = count < 256 ? count : 256;
+		readFloats(file, buf, n * 2);
+		for (int i = 0; i < n; i++) {
+			x[i] = buf[2 * i];
+			y[i] = buf[2 * i + 1];
+		}
+		x += n; y += n;
+		count -= n;
+	}
+}
+
+template<typename Reader>
+void readVector3dSoA(Reader& file, float *x, float *y, float *z, int count) {
+	float buf[3 * 256];
+	while (count > 0) {
+		int n = count < 256 ? count : 256;
+		readFloats(file, buf, n * 3);
+		for (int i = 0; i < n; i++) {
+			x[i] = buf[3 * i];
+			y[i] = buf[3 * i + 1];
+			z[i] = buf[3 * i + 2];
+		}
+		x += n; y += n; z += n;
+		count -= n;
+	}
+}
+
+template<typename Reader>
+void readVector4dSoA(Reader& file, float *x, float *y, float *z, float *w, int count) {
+	float buf[4 * 256];
+	while (count > 0) {
+		int n = count < 256 ? count : 256;
+		readFloats(file, buf, n * 4);
+		for (int i = 0; i < n; i++) {
+			x[i] = buf[4 * i];
+			y[i] = buf[4 * i + 1];
+			z[i] = buf[4 * i + 2];
+			w[i] = buf[4 * i + 3];
+		}
+		x += n; y += n; z += n; w += n;
+		count -= n;
+	}
+}
+
 Vector2d *readVector2d(std::istream& file, int count = 1) {
 	Vector2d *vec2d = new Vector2d[count];
-	for (int i = 0; i < count; i++) {
-		vec2d[i].x = readFloat(file);
-		vec2d[i].y = readFloat(file);
-	}
+	readVector2d(file, vec2d, count);
 	return vec2d;
 }
 
 Vector3d *readVector3d(std::istream& file, int count = 1) {
 	Vector3d *vec3d = new Vector3d[count];
-	for (int i = 0; i < count; i++) {
-		vec3d[i].x = readFloat(file);
-		vec3d[i].y = readFloat(file);
-		vec3d[i].z = readFloat(file);
-	}
+	readVector3d(file, vec3d, count);
 	return vec3d;
 }
 
 Vector4d *readVector4d(std::istream& file) {
 	Vector4d *vec4d = new Vector4d();
-	vec4d->x = readFloat(file);
-	vec4d->y = readFloat(file);
-	vec4d->z = readFloat(file);
-	vec4d->w = readFloat(file);
+	readVector4d(file, vec4d, 1);
+	return vec4d;
+}
+
+Vector2d *readVector2d(DataReader& file, int count = 1) {
+	Vector2d *vec2d = new Vector2d[count];
+	readVector2d(file, vec2d, count);
+	return vec2d;
+}
+
+Vector3d *readVector3d(DataReader& file, int count = 1) {
+	Vector3d *vec3d = new Vector3d[count];
+	readVector3d(file, vec3d, count);
+	return vec3d;
+}
+
+Vector4d *readVector4d(DataReader& file) {
+	Vector4d *vec4d = new Vector4d();
+	readVector4d(file, vec4d, 1);
 	return vec4d;
 }
 
@@ -0,0 +1,390 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_MESHB_H
+#define EMI_MESHB_H
+
+#include <string>
+#include <vector>
+#include "filetools.h"
+#include "textwriter.h"
+
+struct MeshFace {
+	int flags;
+	int hasTexture;
+	int texID;
+	int faceLength;
+	// Whole triangles, faceLength rounded up to a multiple of 3
+	std::vector<short> indexes;
+};
+
+struct BoneData {
+	int unknownVal;
+	int boneNum;
+	float weight;
+};
+
+struct MeshData {
+	std::string name;
+	Vector4d sphere;
+	Vector3d box[2];
+	int numTexSets;
+	int setType;
+	std::vector<std::string> texNames;
+	int numVertices;
+	// Each coordinate in its own array
+	std::vector<float> vx, vy, vz;
+	std::vector<float> nx, ny, nz;
+	std::vector<float> tu, tv;
+	std::vector<unsigned char> colors;
+	std::vector<MeshFace> faces;
+	int hasBones;
+	std::vector<std::string> boneNames;
+	std::vector<BoneData> boneData;
+};
+
+void readMesh(DataReader &file, MeshData &mesh) {
+	mesh.name = readString(file);
+	readVector4d(file, &mesh.sphere, 1);
+	readVector3d(file, mesh.box, 2);
+
+	mesh.numTexSets = readInt(file);
+	mesh.setType = readInt(file);
+	int numTextures = readInt(file);
+	for(int i = 0;i < numTextures; i++) {
+		mesh.texNames.push_back(readString(file));
+		// Every texname seems to be followed by 4 0-bytes (Ref mk1.mesh,
+		// this is intentional)
+		readInt(file);
+	}
+	// 4 unknown bytes - usually with value 19
+	readInt(file);
+
+	mesh.numVertices = readInt(file);
+	int n = mesh.numVertices > 0 ? mesh.numVertices : 0;
+	mesh.vx.resize(n + 1); mesh.vy.resize(n + 1); mesh.vz.resize(n + 1);
+	mesh.nx.resize(n + 1); mesh.ny.resize(n + 1); mesh.nz.resize(n + 1);
+	mesh.tu.resize(n + 1); mesh.tv.resize(n + 1);
+	mesh.colors.resize(n * 4 + 1);
+	readVector3dSoA(file, &mesh.vx[0], &mesh.vy[0], &mesh.vz[0], n);
+	readVector3dSoA(file, &mesh.nx[0], &mesh.ny[0], &mesh.nz[0], n);
+	// Color map-data, dunno how to interpret them right now.
+	file.read(&mesh.colors[0], n * 4);
+	readVector2dSoA(file, &mesh.tu[0], &mesh.tv[0], n);
+
+	// Faces
+	// The head of this section needs quite a bit of rechecking
+	int numFaces = readInt(file);
+	int texID = 0;
+	for(int j = 0; j < numFaces; j++){
+		MeshFace face;
+		face.flags = readInt(file);
+		face.hasTexture = readInt(file);
+		if(face.hasTexture)
+			texID = readInt(file);
+		face.texID = texID;
+		face.faceLength = readInt(file);
+		// Indexes come in whole triangles
+		int numIndexes = face.faceLength > 0 ? (face.faceLength + 2) / 3 * 3 : 0;
+		face.indexes.resize(numIndexes + 1);
+		readShorts(file, &face.indexes[0], numIndexes);
+		face.indexes.resize(numIndexes);
+		mesh.faces.push_back(face);
+	}
+
+	mesh.hasBones = readInt(file);
+	if (mesh.hasBones == 1) {
+		int numBones = readInt(file);
+		for(int i = 0;i < numBones; i++) {
+			int strLength = readInt(file);
+			mesh.boneNames.push_back(readCString(file, strLength));
+		}
+
+		int numBoneData = readInt(file);
+		for(int i = 0;i < numBoneData; i++) {
+			BoneData data;
+			data.unknownVal = readInt(file);
+			data.boneNum = readInt(file);
+			data.weight = readFloat(file);
+			mesh.boneData.push_back(data);
+		}
+	}
+}
+
+void writeObj(TextWriter &out, const MeshData &mesh, bool comments) {
+	if (comments) {
+		out << "# Spheredata: " << mesh.sphere.x << " " << mesh.sphere.y << " " << mesh.sphere.z << " " << mesh.sphere.w << '\n';
+		out << "# Boxdata: " << mesh.box[0].x << " " << mesh.box[0].y << " " << mesh.box[0].z;
+		out << mesh.box[1].x << " " << mesh.box[1].y << " " << mesh.box[1].z << '\n';
+		out << "# NumTexSets: " << mesh.numTexSets << " setType: " << mesh.setType << '\n';
+		for (size_t i = 0; i < mesh.texNames.size(); i++)
+			out << "# TexName " << mesh.texNames[i] << '\n';
+	}
+
+	// Should create an empty mtl
+	out << "mtllib quit.mtl" << '\n' << "o Arrow" << '\n';
+
+	int numVertices = mesh.numVertices;
+	if (comments)
+		out << "#File has " << numVertices << " Vertices" << '\n';
+
+	for (int i = 0; i < numVertices; ++i)
+		out << "v " << mesh.vx[i] << " " << mesh.vy[i] << " " << mesh.vz[i] << '\n';
+	for (int i = 0; i < numVertices; ++i)
+		out << "vn " << mesh.nx[i] << " " << mesh.ny[i] << " " << mesh.nz[i] << '\n';
+	for (int i = 0; i < numVertices && comments; ++i) {
+		const unsigned char *c = &mesh.colors[i * 4];
+		// Printed as the signed bytes readByte returns
+		out << "# R: " << (int)(char)c[0] << " G: " << (int)(char)c[1] << " B: " << (int)(char)c[2]
+			<< " A: " << (int)(char)c[3] << '\n';
+	}
+	for (int i = 0; i < numVertices; ++i)
+		out << "vt " << mesh.tu[i] << " " << mesh.tv[i] << '\n';
+
+	out << "usemtl (null)"<< '\n';
+
+	for (size_t j = 0; j < mesh.faces.size(); j++) {
+		const MeshFace &face = mesh.faces[j];
+		if (comments)
+			out << "#Face-header: flags: " << face.flags << " hasTexture: " << face.hasTexture
+				<< " texId: " << face.texID << " faceLength: " << face.faceLength << '\n';
+		short xCoord = 0, yCoord = 0, zCoord = 0;
+		out << "g " << (int)j << '\n';
+		for (int i = 0; i < face.faceLength; i += 3) {
+			xCoord = face.indexes[i] + 1;
+			yCoord = face.indexes[i + 1] + 1;
+			zCoord = face.indexes[i + 2] + 1;
+			out << "f " << xCoord << "//" << xCoord << " " << yCoord << "//" << yCoord << " " << zCoord << "//" << zCoord << '\n';
+		}
+	}
+
+	if (mesh.hasBones == 1 && comments) {
+		for (size_t i = 0; i < mesh.boneNames.size(); i++)
+			out << "# BoneName " << mesh.boneNames[i] << '\n';
+		int vertex = 0;
+		for (size_t i = 0; i < mesh.boneData.size(); i++) {
+			if (mesh.boneData[i].unknownVal)
+				vertex++;
+			out << "# BoneData: Vertex: " << vertex << " boneNum: "
+				<< mesh.boneData[i].boneNum << " weight: " << mesh.boneData[i].weight << '\n';
+		}
+	}
+}
+
+enum {
+	GLTF_UNSIGNED_BYTE = 5121,
+	GLTF_UNSIGNED_SHORT = 5123,
+	GLTF_FLOAT = 5126,
+	GLTF_ARRAY_BUFFER = 34962,
+	GLTF_ELEMENT_ARRAY_BUFFER = 34963
+};
+
+// The binary chunk of a GLB file and the JSON describing what is in it
+struct GlbBuffer {
+	std::vector<char> bin;
+	std::string views;
+	std::string accessors;
+	int numViews;
+	int numAccessors;
+
+	GlbBuffer() : numViews(0), numAccessors(0) {}
+
+	// Appends len bytes of data as one accessor, padded to 4 bytes, and
+	// returns its index
+	int add(const void *data, size_t len, int target, int componentType, bool normalized,
+			int count, const char *type, const char *bounds = "") {
+		char json[512];
+		size_t offset = bin.size();
+		bin.insert(bin.end(), (const char *)data, (const char *)data + len);
+		bin.resize((bin.size() + 3) & ~3, 0);
+		sprintf(json, "%s{\"buffer\":0,\"byteOffset\":%u,\"byteLength\":%u,\"target\":%d}",
+			numViews ? "," : "", (unsigned int)offset, (unsigned int)len, target);
+		views += json;
+		sprintf(json, "%s{\"bufferView\":%d,\"componentType\":%d,%s\"count\":%d,\"type\":\"%s\"%s}",
+			numAccessors ? "," : "", numViews++, componentType, normalized ? "\"normalized\":true," : "",
+			count, type, bounds);
+		accessors += json;
+		return numAccessors++;
+	}
+};
+
+static std::string quote(const std::string &str) {
+	std::string quoted = "\"";
+	for (size_t i = 0; i < str.size(); i++) {
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+			quoted += c;
+		} else if (c < 0x20) {
+			char esc[8];
+			sprintf(esc, "\\u%04x", c);
+			quoted += esc;
+		} else
+			quoted += c;
+	}
+	return quoted + "\"";
+}
+
+/**
+ * Writes the mesh as binary glTF 2.0: packed position, normal, texcoord and
+ * colour arrays shared by one triangle primitive per face. Faces keep the
+ * index data of the meshb. With bone data, every vertex gets up to four of
+ * its joints with the weights normalized, and the bones become the joint
+ * nodes of a skin.
+ */
+bool writeGlb(const char *name, const MeshData &mesh) {
+	int n = mesh.numVertices;
+	if (n <= 0)
+		return false;
+	GlbBuffer buf;
+	char json[512];
+
+	std::vector<float> packed(n * 3 + 1);
+	float minPos[3] = { 0, 0, 0 }, maxPos[3] = { 0, 0, 0 };
+	for (int i = 0; i < n; i++) {
+		float v[3] = { mesh.vx[i], mesh.vy[i], mesh.vz[i] };
+		for (int c = 0; c < 3; c++) {
+			packed[i * 3 + c] = v[c];
+			if (i == 0 || v[c] < minPos[c]) minPos[c] = v[c];
+			if (i == 0 || v[c] > maxPos[c]) maxPos[c] = v[c];
+		}
+	}
+	sprintf(json, ",\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]",
+		minPos[0], minPos[1], minPos[2], maxPos[0], maxPos[1], maxPos[2]);
+	int position = buf.add(&packed[0], n * 12, GLTF_ARRAY_BUFFER, GLTF_FLOAT, false, n, "VEC3", json);
+
+	for (int i = 0; i < n; i++) {
+		packed[i * 3] = mesh.nx[i];
+		packed[i * 3 + 1] = mesh.ny[i];
+		packed[i * 3 + 2] = mesh.nz[i];
+	}
+	int normal = buf.add(&packed[0], n * 12, GLTF_ARRAY_BUFFER, GLTF_FLOAT, false, n, "VEC3");
+
+	for (int i = 0; i < n; i++) {
+		packed[i * 2] = mesh.tu[i];
+		packed[i * 2 + 1] = mesh.tv[i];
+	}
+	int texcoord = buf.add(&packed[0], n * 8, GLTF_ARRAY_BUFFER, GLTF_FLOAT, false, n, "VEC2");
+	int color = buf.add(&mesh.colors[0], n * 4, GLTF_ARRAY_BUFFER, GLTF_UNSIGNED_BYTE, true, n, "VEC4");
+
+	sprintf(json, "\"POSITION\":%d,\"NORMAL\":%d,\"TEXCOORD_0\":%d,\"COLOR_0\":%d",
+		position, normal, texcoord, color);
+	std::string attributes = json;
+	int numBones = mesh.boneNames.size();
+	bool skinned = mesh.hasBones == 1 && numBones > 0 && n > 0;
+	if (skinned) {
+		// Same reading of the bone data as the OBJ comments: a set first
+		// value moves on to the next vertex
+		std::vector<uint16> joints(n * 4, 0);
+		std::vector<float> weights(n * 4, 0.0f);
+		std::vector<int> used(n, 0);
+		int vertex = 0;
+		for (size_t i = 0; i < mesh.boneData.size(); i++) {
+			const BoneData &data = mesh.boneData[i];
+			if (data.unknownVal)
+				vertex++;
+			if (vertex >= n || data.boneNum < 0 || data.boneNum >= numBones || used[vertex] == 4)
+				continue;
+			joints[vertex * 4 + used[vertex]] = data.boneNum;
+			weights[vertex * 4 + used[vertex]] = data.weight;
+			used[vertex]++;
+		}
+		for (int i = 0; i < n; i++) {
+			float sum = weights[i * 4] + weights[i * 4 + 1] + weights[i * 4 + 2] + weights[i * 4 + 3];
+			if (sum > 0.0f) {
+				for (int c = 0; c < 4; c++)
+					weights[i * 4 + c] /= sum;
+			} else
+				weights[i * 4] = 1.0f;
+		}
+		int jointsIndex = buf.add(&joints[0], n * 8, GLTF_ARRAY_BUFFER, GLTF_UNSIGNED_SHORT, false, n, "VEC4");
+		int weightsIndex = buf.add(&weights[0], n * 16, GLTF_ARRAY_BUFFER, GLTF_FLOAT, false, n, "VEC4");
+		sprintf(json, ",\"JOINTS_0\":%d,\"WEIGHTS_0\":%d", jointsIndex, weightsIndex);
+		attributes += json;
+	}
+
+	// The triangle indexes are stored as they are in the meshb, little-endian shorts
+	std::string primitives;
+	for (size_t j = 0; j < mesh.faces.size(); j++) {
+		const MeshFace &face = mesh.faces[j];
+		if (face.indexes.empty())
+			continue;
+		std::vector<uint16> indexes(face.indexes.size());
+		for (size_t i = 0; i < indexes.size(); i++)
+			indexes[i] = TO_LE_16(face.indexes[i]);
+		int accessor = buf.add(&indexes[0], indexes.size() * 2, GLTF_ELEMENT_ARRAY_BUFFER,
+			GLTF_UNSIGNED_SHORT, false, indexes.size(), "SCALAR");
+		sprintf(json, "%s{\"attributes\":{%s},\"indices\":%d,\"mode\":4}",
+			primitives.empty() ? "" : ",", attributes.c_str(), accessor);
+		primitives += json;
+	}
+	// A mesh needs a primitive, without faces the vertices make one of points
+	if (primitives.empty())
+		primitives = "{\"attributes\":{" + attributes + "},\"mode\":0}";
+
+	std::string nodes = "{\"name\":" + quote(mesh.name) + ",\"mesh\":0";
+	std::string scene = "0";
+	std::string skin;
+	if (skinned) {
+		nodes += ",\"skin\":0";
+		skin = ",\"skins\":[{\"joints\":[";
+		for (int i = 0; i < numBones; i++) {
+			sprintf(json, ",%d", i + 1);
+			skin += json + (i ? 0 : 1);
+			scene += json;
+		}
+		skin += "]}]";
+	}
+	nodes += "}";
+	for (int i = 0; i < numBones && skinned; i++)
+		nodes += ",{\"name\":" + quote(mesh.boneNames[i]) + "}";
+
+	std::string gltf = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"meshb2obj\"},\"scene\":0,"
+		"\"scenes\":[{\"nodes\":[" + scene + "]}],\"nodes\":[" + nodes + "],"
+		"\"meshes\":[{\"name\":" + quote(mesh.name) + ",\"primitives\":[" + primitives + "]}]" + skin + ","
+		"\"accessors\":[" + buf.accessors + "],\"bufferViews\":[" + buf.views + "],";
+	sprintf(json, "\"buffers\":[{\"byteLength\":%u}]}", (unsigned int)buf.bin.size());
+	gltf += json;
+	while (gltf.size() % 4)
+		gltf += ' ';
+
+	Common::StatsPhase phase(Common::kStatsWrite);
+	FILE *out = fopen(name, "wb");
+	if (!out)
+		return false;
+	uint32 header[5] = {
+		TO_LE_32(0x46546C67), TO_LE_32(2), TO_LE_32(12 + 8 + gltf.size() + 8 + buf.bin.size()),
+		TO_LE_32(gltf.size()), TO_LE_32(0x4E4F534A)
+	};
+	uint32 binHeader[2] = { TO_LE_32(buf.bin.size()), TO_LE_32(0x004E4942) };
+	fwrite(header, 4, 5, out);
+	fwrite(gltf.data(), 1, gltf.size(), out);
+	fwrite(binHeader, 4, 2, out);
+	if (!buf.bin.empty())
+		fwrite(&buf.bin[0], 1, buf.bin.size(), out);
+	Common::addStatsWritten(20 + gltf.size() + 8 + buf.bin.size());
+	bool ok = !ferror(out);
+	fclose(out);
+	return ok;
+}
+
+#endif
@@ -23,12 +23,33 @@
 #include <fstream>
 #include <string>
 #include <iostream>
-#include "filetools.h"
+#include "meshb.h"
 #include "tools/lab.h"
+#include "tools/assetloader.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 int main(int argc, char **argv) {
+	Common::initStats("meshb2obj", argc, argv);
+	// Comment lines are only diagnostics and can be left out
+	bool comments = true;
+	const char *glbName = NULL;
+	while (argc > 1) {
+		if (strcmp(argv[1], "--no-comments") == 0) {
+			comments = false;
+		} else if (strcmp(argv[1], "--glb") == 0 && argc > 2) {
+			glbName = argv[2];
+			argv++;
+			argc--;
+		} else
+			break;
+		argv++;
+		argc--;
+	}
+
 	if (argc < 2) {
 		std::cout << "Error: filename not specified" << std::endl;
+		std::cout << "Usage: meshb2obj [--no-comments] [--glb OUTPUT.glb] [LAB] MESHB" << std::endl;
 		return 0;
 	}
 	
@@ -36,140 +57,44 @@ int main(int argc, char **argv) {
 	std::string filename;
 	
 	if (argc > 2) {
-		lab = new Lab(argv[1]);
+		lab = new Lab(argv[1], false, true);
 		filename = argv[2];
 	} else {
 		filename = argv[1];
 	}
 
-	std::istream *file = getFile(filename, lab);
+	AssetLoader loader(lab);
+	const Asset *asset = loader.load(filename);
 	
-	if (!file) {
+	if (!asset) {
 		std::cout << "Unable to open file " << filename << std::endl;
 		return 0;
 	}
-	int strLength = 0;
-	
-	std::string nameString = readString(*file);
-	
-	Vector4d *vec4d;
-	Vector3d *vec3d;
-	
-	vec4d = readVector4d(*file);
-	std::cout << "# Spheredata: " << vec4d->toString() << std::endl;
-	delete vec4d;
-	vec3d = readVector3d(*file);
-	std::cout << "# Boxdata: " << vec3d->toString();
-	delete vec3d;
-	vec3d = readVector3d(*file);
-	std::cout << vec3d->toString() << std::endl;
-	delete vec3d;
-
-	int numTexSets = readInt(*file);
-	int setType = readInt(*file);
-	std::cout << "# NumTexSets: " << numTexSets << " setType: " << setType << std::endl;
-	int numTextures = readInt(*file);
-	
-	std::string *texNames = new std::string[numTextures];
-	for(int i = 0;i < numTextures; i++) {
-		texNames[i] = readString(*file);
-		// Every texname seems to be followed by 4 0-bytes (Ref mk1.mesh,
-		// this is intentional)
-		readInt(*file);
-	}
-	for(int i = 0;i < numTextures;i++){
-		std::cout << "# TexName " << texNames[i] << std::endl;
+	DataReader file(asset->data, asset->size);
+	MeshData mesh;
+	{
+		Common::StatsPhase phase(Common::kStatsDecode);
+		readMesh(file, mesh);
 	}
-	// 4 unknown bytes - usually with value 19
-	readInt(*file);
-	
-	// Should create an empty mtl
-	std::cout << "mtllib quit.mtl" << std::endl << "o Arrow" << std::endl;
 
-	int numVertices = readInt(*file);
-	std::cout << "#File has " << numVertices << " Vertices" << std::endl;
-	
-	float x = 0, y = 0;
-	int r = 0, g = 0, b = 0, a = 0;	
-	// Vertices
-	for (int i = 0; i < numVertices; ++i) {
-		vec3d = readVector3d(*file);
-		std::cout << "v " << vec3d->x << " " << vec3d->y << " " << vec3d->z << std::endl;
-		delete vec3d;
-	}
-	// Vertex-normals
-	for (int i = 0; i < numVertices; ++i) {
-		vec3d = readVector3d(*file);
-		std::cout << "vn " << vec3d->x << " " << vec3d->y << " " << vec3d->z << std::endl;
-		delete vec3d;
-	}
-	// Color map-data, dunno how to interpret them right now.
-	for (int i = 0; i < numVertices; ++i) {
-		r = readByte(*file);
-		g = readByte(*file);
-		b = readByte(*file);
-		a = readByte(*file);
-		std::cout << "# R: " << r << " G: " << g << " B: " << b << " A: " << a << std::endl;
-	}
-	// Texture-vertices
-	for (int i = 0; i < numVertices; ++i) {
-		x = readFloat(*file);
-		y = readFloat(*file);
-		std::cout << "vt " << x << " " << y << std::endl;
-	}
-	
-	std::cout << "usemtl (null)"<< std::endl;
-	
-	// Faces
-	// The head of this section needs quite a bit of rechecking
-	int numFaces = 0;
-	int hasTexture = 0;
-	int texID = 0;
-	int flags = 0;
-	numFaces = readInt(*file);
-	int faceLength = 0;
-	for(int j = 0; j < numFaces; j++){
-		flags = readInt(*file);
-		hasTexture = readInt(*file);
-		if(hasTexture)
-			texID = readInt(*file);
-		faceLength = readInt(*file);
-		std::cout << "#Face-header: flags: " << flags << " hasTexture: " << hasTexture
-			<< " texId: " << texID << " faceLength: " << faceLength << std::endl;
-		short xCoord = 0, yCoord = 0, zCoord = 0;
-		std::cout << "g " << j << std::endl;
-		for (int i = 0; i < faceLength; i += 3) {
-			xCoord = readShort(*file) + 1;
-			yCoord = readShort(*file) + 1;
-			zCoord = readShort(*file) + 1;
-			std::cout << "f " << xCoord << "//" << xCoord << " " << yCoord << "//" << yCoord << " " << zCoord << "//" << zCoord <<  std::endl;
+	if (glbName) {
+		if (mesh.numVertices <= 0) {
+			std::cout << "No vertices in " << filename << std::endl;
+			return 1;
 		}
-	}
-	int hasBones = readInt(*file);
-	
-	if (hasBones == 1) {
-		int numBones = readInt(*file);
-		char **boneNames = new char*[numBones];
-		for(int i = 0;i < numBones; i++) {
-			strLength = readInt(*file);
-			boneNames[i] = new char[strLength];
-			file->read(boneNames[i], strLength);
-			std::cout << "# BoneName " << boneNames[i] << std::endl;
-		}
-		
-		int numBoneData = readInt(*file);
-		int unknownVal = 0;
-		int boneDatanum;
-		float boneDataWgt;
-		int vertex = 0;
-		for(int i = 0;i < numBoneData; i++) {
-			unknownVal = readInt(*file);
-			boneDatanum = readInt(*file);
-			boneDataWgt = readFloat(*file);
-			if(unknownVal)
-				vertex++;
-			std::cout << "# BoneData: Vertex: " << vertex << " boneNum: "
-				<< boneDatanum << " weight: " << boneDataWgt << std::endl;
+		if (!writeGlb(glbName, mesh)) {
+			std::cout << "Unable to write " << glbName << std::endl;
+			return 1;
 		}
+		Common::addStatsFiles();
+		return 0;
+	}
+
+	TextWriter out(stdout);
+	{
+		Common::StatsPhase phase(Common::kStatsConvert);
+		writeObj(out, mesh, comments);
 	}
+	Common::addStatsFiles();
+	return 0;
 }
@@ -34,20 +34,24 @@ struct Colormap {
 
 class Mesh;
 class Lab;
+class DataReader;
 
 class Material {
-	uint32_t *_texIDs;
-	uint32_t _numTextures;
-	Lab *_lab;
-	void loadTGATexture(std::string filename);
-	void loadSURTexture(std::string filename);
+	uint32_t _texID;
 public:
-	Material() { _lab = 0; }
-	void setLab(Lab *lab) { _lab = lab; }
-	void loadTexture(std::string filename);
-	void bindTexture(int index = 0);
+	Material() : _texID(0) {}
+	void setTexture(uint32_t texID) { _texID = texID; }
+	void bindTexture();
 };
 
+/**
+ * Looks up count textures in a process-wide cache keyed by lab and name and
+ * writes their GL names to texIDs, 0 for those that fail to load. The ones
+ * not cached yet are decoded on up to jobs threads, and only uploaded on the
+ * calling thread, which has to own the GL context.
+ */
+void loadTextures(Lab *lab, const std::string *names, uint32_t count, uint32_t *texIDs, int jobs);
+
 class MeshFace {
 	Vector3<int> *_indexes;
 	uint32_t _faceLength;
@@ -58,16 +62,27 @@ class MeshFace {
 	Mesh *_parent;
 public:
 	MeshFace() : _numFaces(0), _hasTexture(0), _texID(0), _flags(0) { }
-	void loadFace(std::istream *file);
+	void loadFace(DataReader &file);
 	void setParent(Mesh *m) { _parent = m; }
-	void render();
+	/** Texture the face group is drawn with, or -1 if it is untextured */
+	int getTexture() const { return _hasTexture ? (int)_texID : -1; }
+	uint32_t getNumTriangles() const { return (_faceLength + 2) / 3; }
+	/** Appends the face group's triangles to dest as 16- or 32-bit indices */
+	template<typename T> void copyIndices(T *dest) const;
 };
 
+// A run of triangles in the index buffer sharing one texture
+struct DrawBatch {
+	int _texture;
+	uint32_t _first;
+	uint32_t _count;
+};
+
+// Translations use x, y and z of the value, rotations are quaternions
 class Keyframe {
 public:
 	float _time;
-	Vector3d *_vec3d;
-	Vector4d *_vec4d;
+	Vector4d _value;
 };
 
 class KeyframeList {
@@ -79,6 +94,9 @@ public:
 	KeyframeList(int num, int op) : _numFrames(num), _operation(op) {
 		_frames = new Keyframe[_numFrames];
 	}
+	~KeyframeList() { delete[] _frames; }
+	/** Interpolates the value at time, which is clamped to the keyframes */
+	Vector4d sample(float time) const;
 };
 
 class Bone {
@@ -89,11 +107,11 @@ class Bone {
 	Vector3d *_pos;
 	Vector3d *_rot;
 	float _angle;
-	std::vector<int> _verts;
-	std::vector<float> _wgts;
-	KeyframeList *_keyframes;
+	KeyframeList *_translations;
+	KeyframeList *_rotations;
 public:
-	Bone() : _parent(0), _child(0), _sibling(0), _angle(0.0f), _keyframes(0) {}
+	Bone() : _parent(0), _child(0), _sibling(0), _pos(0), _rot(0), _angle(0.0f),
+		_translations(0), _rotations(0) {}
 	void addParent(Bone *node);
 	void addChild(Bone *node);
 	void addSibling(Bone *node);
@@ -103,10 +121,19 @@ public:
 	void setPos(Vector3d *pos) { _pos = pos; }
 	void setRot(Vector3d *rot) { _rot = rot; }
 	void setAngle(float angle) { _angle = angle; }
-	void addVertex(int num, float wgt);
-	void setKeyFrames(KeyframeList* keyframes) { _keyframes = keyframes; }
+	void setKeyFrames(KeyframeList* keyframes);
 
 	std::string getName() { return _name; }
+	Bone *getParent() const { return _parent; }
+	Bone *getChild() const { return _child; }
+	Bone *getSibling() const { return _sibling; }
+	bool hasPose() const { return _pos && _rot; }
+	/**
+	 * Writes the bone's transform relative to its parent into matrix, which
+	 * is column-major. Without keyframes (or with time < 0) it is the rest pose
+	 * from the skeleton.
+	 */
+	void getLocalMatrix(float time, float *matrix) const;
 };
 
 class Animation {
@@ -118,6 +145,12 @@ public:
 	std::vector<Bone*> _bones;
 };
 
+// Counted by Mesh::render(), for the benchmark
+struct RenderCounters {
+	uint32_t drawCalls;
+	uint32_t bufferUploads;
+};
+
 class Mesh {
 	int _numVertices;
 	Vector3d *_vertices;
@@ -135,10 +168,38 @@ class Mesh {
 	int _numBones;
 	std::map<std::string, Bone*> _boneMap;
 
+	// One entry per bone influence, in the order of the meshb, so skinning
+	// runs over flat arrays
+	int _numInfluences;
+	int *_influenceVertex;
+	int *_influenceBone;
+	float *_influenceWeight;
+
+	// Column-major matrices, 16 floats per bone
+	float *_bindInverse;
+	float *_boneMatrices;
+	float *_palette;
+	// Skinned position and normal of every vertex, 8 floats each
+	float *_skinBuffer;
+	Vector3d *_skinnedVertices;
+	Vector3d *_skinnedNormals;
+	bool _skinDirty;
+
 	Animation *_anim;
 
 	Lab *_lab;
 
+	// Uploaded by prepare(), positions and normals first so they can be
+	// respecified on their own
+	uint32_t _vertexBuffer;
+	uint32_t _indexBuffer;
+	bool _shortIndices;
+	uintptr_t _normalOffset;
+	uintptr_t _colorOffset;
+	uintptr_t _texOffset;
+	std::vector<DrawBatch> _batches;
+	RenderCounters _counters;
+
 	// Stuff I dont know how to use:
 	Vector4d *_sphereData;
 	Vector3d *_boxData;
@@ -147,14 +208,32 @@ class Mesh {
 	int _setType;
 
 public:
-	Mesh() { _lab = 0; }
+	Mesh() : _bones(0), _numBones(0), _numInfluences(0), _bindInverse(0), _skinBuffer(0), _skinDirty(false),
+		_anim(0), _lab(0), _vertexBuffer(0), _indexBuffer(0), _shortIndices(true) {
+		resetCounters();
+	}
 	void setLab(Lab *lab) { _lab = lab; }
 	void setTex(int index) { _mats[index].bindTexture(); }
 	void loadMesh(std::string fileName);
 	void loadSkeleton(std::string filename);
 	void loadAnimation(std::string filename);
-	void prepare();
+	void prepare(int jobs = 1);
+	/** Sets up skinning once the mesh and its skeleton are loaded */
+	bool prepareSkin();
+	/**
+	 * Poses the skeleton at time in the loaded animation, or in the rest
+	 * pose if there is none, and skins the vertices on the CPU
+	 */
+	void animate(float time);
+	bool hasAnimation() const { return _anim != 0; }
+	float getAnimationLength() const { return _anim ? _anim->_timelen : 0.0f; }
 	void render();
+	const RenderCounters &getCounters() const { return _counters; }
+	void resetCounters() { _counters.drawCalls = _counters.bufferUploads = 0; }
+
+private:
+	void poseBone(const Bone *bone, const float *parent, float time);
+	void skinVertices();
 };
 
 #endif
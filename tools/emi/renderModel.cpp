@@ -28,20 +28,41 @@
 #include <ctime>
 #include <cstring> // for lab
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glfw.h>
+#include <GL/glext.h>
 #include "filetools.h"
+#include "animcache.h"
 #include "model.h"
 #include "lab.h"
+#include "tools/assetloader.h"
+#include "common/getopt.h"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
 using namespace std;
 
 /*
  * Model-viewer for EMI, usage:
- * renderModel [labName] [mesh-name] [skel-name]
+ * renderModel [-f fps] [-b frames] [-n] [-j N] [labName] [mesh-name] [skel-name] [anim-name]
  *
  * If no labName is specified, then all files will be searched for
  * in the current working directory. (and no skeleton will be loaded)
  *
+ * -b renders the given number of frames offscreen as fast as possible and
+ * reports the timings, -n does the same for skinning alone, without opening
+ * a window.
+ *
  * This is quite possibly not endian-safe yet, and requires GLFW for
  * rendering. (And is thus not built by default)
  */
@@ -76,7 +97,7 @@ void Bone::addChild(Bone *node) {
 void Bone::addSibling(Bone *node) {
 	if (!_sibling) {
 		_sibling = node;
-		_sibling->addParent(this);
+		_sibling->addParent(_parent);
 	} else {
 		_sibling->addSibling(node);
 	}
@@ -86,165 +107,424 @@ void Bone::addParent(Bone *node) {
 	_parent = node;
 }
 
-void Bone::addVertex(int num, float wgt) {
-	_verts.push_back(num);
-	_verts.push_back(wgt);
+void Bone::setKeyFrames(KeyframeList *keyframes) {
+	if (keyframes->_operation == 3) {
+		delete _translations;
+		_translations = keyframes;
+	} else if (keyframes->_operation == 4) {
+		delete _rotations;
+		_rotations = keyframes;
+	} else {
+		delete keyframes;
+	}
 }
 
-void Material::bindTexture(int index) {
-	glBindTexture(GL_TEXTURE_2D, _texIDs[index]);
-	glEnable(GL_TEXTURE_2D);
+Vector4d KeyframeList::sample(float time) const {
+	if (time <= _frames[0]._time || _numFrames == 1)
+		return _frames[0]._value;
+	if (time >= _frames[_numFrames - 1]._time)
+		return _frames[_numFrames - 1]._value;
+
+	// The last keyframe at or before time
+	int lo = 0, hi = _numFrames - 1;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if (_frames[mid]._time <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	const Keyframe &a = _frames[lo];
+	const Keyframe &b = _frames[hi];
+	float t = b._time > a._time ? (time - a._time) / (b._time - a._time) : 0.0f;
+
+	Vector4d v;
+	if (_operation == 4) {
+		// Normalized lerp along the shorter arc
+		float dot = a._value.x * b._value.x + a._value.y * b._value.y + a._value.z * b._value.z + a._value.w * b._value.w;
+		float s = dot < 0 ? -t : t;
+		v.x = a._value.x * (1 - t) + b._value.x * s;
+		v.y = a._value.y * (1 - t) + b._value.y * s;
+		v.z = a._value.z * (1 - t) + b._value.z * s;
+		v.w = a._value.w * (1 - t) + b._value.w * s;
+		float len = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z + v.w * v.w);
+		if (len > 0) {
+			v.x /= len; v.y /= len; v.z /= len; v.w /= len;
+		}
+	} else {
+		v.x = a._value.x + (b._value.x - a._value.x) * t;
+		v.y = a._value.y + (b._value.y - a._value.y) * t;
+		v.z = a._value.z + (b._value.z - a._value.z) * t;
+		v.w = 0;
+	}
+	return v;
 }
 
-void Material::loadTexture(string filename) {
-	string s = filename.substr(filename.length()-3);
-	if (s == "sur")
-		loadSURTexture(filename);
-	else
-		loadTGATexture(filename);
+// Column-major rotation and translation, as OpenGL uses
+static void composeMatrix(float x, float y, float z, float w, const Vector3d &pos, float *m) {
+	m[0] = 1 - 2 * (y * y + z * z);
+	m[1] = 2 * (x * y + w * z);
+	m[2] = 2 * (x * z - w * y);
+	m[3] = 0;
+	m[4] = 2 * (x * y - w * z);
+	m[5] = 1 - 2 * (x * x + z * z);
+	m[6] = 2 * (y * z + w * x);
+	m[7] = 0;
+	m[8] = 2 * (x * z + w * y);
+	m[9] = 2 * (y * z - w * x);
+	m[10] = 1 - 2 * (x * x + y * y);
+	m[11] = 0;
+	m[12] = pos.x;
+	m[13] = pos.y;
+	m[14] = pos.z;
+	m[15] = 1;
 }
 
-void Material::loadSURTexture(string filename) {
-	istream *file = getFile(filename, _lab);
+// dest = a * b, dest may not alias either
+static void multiplyMatrix(const float *a, const float *b, float *dest) {
+	for (int c = 0; c < 4; c++) {
+		for (int r = 0; r < 4; r++) {
+			dest[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] +
+				a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+		}
+	}
+}
 
-	_texIDs = new uint[1]; // TODO: Handle the rest of the sur-items.
+// Inverse of a rotation and translation
+static void invertRigidMatrix(const float *m, float *dest) {
+	for (int c = 0; c < 3; c++) {
+		for (int r = 0; r < 3; r++)
+			dest[c * 4 + r] = m[r * 4 + c];
+		dest[c * 4 + 3] = 0;
+	}
+	for (int r = 0; r < 3; r++)
+		dest[12 + r] = -(dest[r] * m[12] + dest[4 + r] * m[13] + dest[8 + r] * m[14]);
+	dest[15] = 1;
+}
 
-	string data;
-	getline(*file, data);
-	getline(*file, data);
-	getline(*file, data);
-	*file >> data;
-	cout << "Only reading first surface-TGA for " << filename << endl;
-	*file >> data;
+void Bone::getLocalMatrix(float time, float *matrix) const {
+	// The skeleton stores the rest rotation as a quaternion split in _rot and _angle
+	Vector4d rot;
+	rot.x = _rot->x;
+	rot.y = _rot->y;
+	rot.z = _rot->z;
+	rot.w = _angle;
+	Vector3d pos = *_pos;
+	if (time >= 0 && _rotations && _rotations->_numFrames > 0)
+		rot = _rotations->sample(time);
+	if (time >= 0 && _translations && _translations->_numFrames > 0) {
+		Vector4d t = _translations->sample(time);
+		pos.x = t.x;
+		pos.y = t.y;
+		pos.z = t.z;
+	}
+	composeMatrix(rot.x, rot.y, rot.z, rot.w, pos, matrix);
+}
 
-	string test = data;//.substr(5);
-	test[3] = '\\';
+void Material::bindTexture() {
+	glBindTexture(GL_TEXTURE_2D, _texID);
+	glEnable(GL_TEXTURE_2D);
+}
+
+// A texture decoded into memory, waiting to be uploaded
+struct TextureImage {
+	std::string name;
+	int width;
+	int height;
+	int bpp;
+	char *pixels;
+};
+
+// An asset's bytes, pointing into the lab's mapping when possible
+struct TextureData {
+	const char *data;
+	uint32 size;
+	std::vector<char> copy;
+};
+
+static bool readTextureData(Lab *lab, const std::string &filename, TextureData &out) {
+	if (lab && lab->isMapped()) {
+		out.data = lab->getData(filename, out.size);
+		return out.data != NULL;
+	}
+	std::istream *file;
+	int length = 0;
+	file = getFile(filename, lab, length);
+	if (!file || length <= 0) {
+		delete file;
+		return false;
+	}
+	out.copy.resize(length);
+	file->read(&out.copy[0], length);
+	out.size = (uint32)file->gcount();
+	out.data = &out.copy[0];
 	delete file;
-	loadTGATexture(test);
+	return true;
 }
 
-// TODO: This needs a bit more specific handling for indexes
-void Material::loadTGATexture(string filename) {
-	std::istream *file = getFile(filename, _lab);
+static bool decodeTGA(Lab *lab, const std::string &filename, TextureImage &image) {
+	TextureData tga;
+	if (!readTextureData(lab, filename, tga) || tga.size < 18) {
+		std::cout << "Unable to open file " << filename << std::endl;
+		return false;
+	}
+	DataReader file(tga.data, tga.size);
+
+	file.skip(2);
+	char type = readByte(file);
+	if (type != 2) {
+		std::cout << filename << " is not an uncompressed true-color TGA" << std::endl;
+		return false;
+	}
+	file.skip(9);
+	image.width = readShort(file);
+	image.height = readShort(file);
+	image.bpp = readByte(file);
+	file.skip(1);
+	if (image.bpp != 24 && image.bpp != 32) {
+		std::cout << image.bpp << " BPP in " << filename << std::endl;
+		return false;
+	}
+
+	// Rows are stored bottom-up
+	int pitch = image.width * (image.bpp / 8);
+	if (image.width <= 0 || image.height <= 0 || file.remaining() < (size_t)pitch * image.height) {
+		std::cout << "Truncated TGA " << filename << std::endl;
+		return false;
+	}
+	image.pixels = new char[pitch * image.height];
+	char *target = image.pixels + pitch * (image.height - 1);
+	for (int i = 0; i < image.height; i++) {
+		file.read(target, pitch);
+		target -= pitch;
+	}
+	return true;
+}
 
-	if (!((fstream*)file)->is_open()) {
+// A SUR lists the surface's TGAs, only the first of which is used
+static bool decodeSUR(Lab *lab, const std::string &filename, TextureImage &image) {
+	TextureData sur;
+	if (!readTextureData(lab, filename, sur)) {
 		std::cout << "Unable to open file " << filename << std::endl;
-		return;
+		return false;
 	}
+	std::istringstream file(std::string(sur.data, sur.size));
 
-	_texIDs = new uint[1];
-	glGenTextures(1, _texIDs);
+	string data;
+	getline(file, data);
+	getline(file, data);
+	getline(file, data);
+	file >> data;
+	file >> data;
+	if (data.size() < 4)
+		return false;
 
-	file->seekg(2, std::ios::cur);
-	char type = readByte(*file);
-	assert(type == 2);
+	string test = data;//.substr(5);
+	test[3] = '\\';
+	return decodeTGA(lab, test, image);
+}
 
+static bool decodeTexture(Lab *lab, TextureImage &image) {
+	image.pixels = NULL;
+	const std::string &filename = image.name;
+	if (filename.length() >= 3 && filename.substr(filename.length() - 3) == "sur")
+		return decodeSUR(lab, filename, image);
+	return decodeTGA(lab, filename, image);
+}
 
-	int width, height = 0;
-	int bpp;
-	file->seekg(9, std::ios::cur);
-
-	width = readShort(*file);
-	height = readShort(*file);
-	bpp = readByte(*file);
-	file->seekg(1, std::ios::cur);
-	if(bpp!=24)
-		cout << bpp <<" BPP " << endl;
-	int len = width * height * bpp/8;
-	char *newData = new char[len];
-	char *target = newData + len - width * bpp/8;
-	for (int i = 0; i < height; i++) {
-		file->read(target, width*(bpp/8));
-		target -= width * (bpp/8);
-	}
-	glBindTexture(GL_TEXTURE_2D, _texIDs[0]);
+static uint32_t uploadTexture(const TextureImage &image) {
+	GLuint id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, newData);
-	delete newData;
+	if (image.bpp == 32)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, image.pixels);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.width, image.height, 0, GL_BGR, GL_UNSIGNED_BYTE, image.pixels);
+	return id;
+}
+
+struct TextureJob {
+	Lab *lab;
+	std::vector<TextureImage> *images;
+	std::vector<bool> *decoded;
+	size_t next;
+#ifdef POSIX
+	pthread_mutex_t lock;
+#endif
+};
+
+static void *textureWorker(void *arg) {
+	TextureJob *job = (TextureJob *)arg;
+	for (;;) {
+#ifdef POSIX
+		pthread_mutex_lock(&job->lock);
+#endif
+		size_t index = job->next++;
+#ifdef POSIX
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (index >= job->images->size())
+			break;
+		bool ok = decodeTexture(job->lab, (*job->images)[index]);
+#ifdef POSIX
+		pthread_mutex_lock(&job->lock);
+#endif
+		(*job->decoded)[index] = ok;
+#ifdef POSIX
+		pthread_mutex_unlock(&job->lock);
+#endif
+	}
+	return NULL;
 }
 
-void MeshFace::loadFace(std::istream *file) {
-	_flags = readInt(*file);
-	_hasTexture = readInt(*file);
+static std::map<std::string, uint32_t> textureCache;
+
+void loadTextures(Lab *lab, const std::string *names, uint32_t count, uint32_t *texIDs, int jobs) {
+	std::string prefix = lab ? lab->getFileName() + ":" : std::string();
+
+	// The textures to decode, each name only once
+	std::vector<TextureImage> images;
+	std::map<std::string, size_t> pending;
+	for (uint32_t i = 0; i < count; i++) {
+		std::string key = prefix + names[i];
+		if (textureCache.count(key) || pending.count(key))
+			continue;
+		pending[key] = images.size();
+		TextureImage image;
+		image.name = names[i];
+		image.pixels = NULL;
+		images.push_back(image);
+	}
+
+	std::vector<bool> decoded(images.size(), false);
+	TextureJob job;
+	job.lab = lab;
+	job.images = &images;
+	job.decoded = &decoded;
+	job.next = 0;
+#ifdef POSIX
+	// Reading an unmapped lab goes through its shared buffer
+	if (lab && !lab->isMapped())
+		jobs = 1;
+	if ((size_t)jobs > images.size())
+		jobs = images.size();
+	pthread_mutex_init(&job.lock, NULL);
+	std::vector<pthread_t> threads(jobs > 1 ? jobs - 1 : 0);
+	int started = 0;
+	for (int t = 1; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, textureWorker, &job) == 0)
+			++started;
+	}
+	textureWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&job.lock);
+#else
+	textureWorker(&job);
+#endif
+
+	// Failures are cached too, so they are not retried for every mesh
+	for (size_t i = 0; i < images.size(); i++) {
+		textureCache[prefix + images[i].name] = decoded[i] ? uploadTexture(images[i]) : 0;
+		delete[] images[i].pixels;
+	}
+	for (uint32_t i = 0; i < count; i++)
+		texIDs[i] = textureCache[prefix + names[i]];
+}
+
+void MeshFace::loadFace(DataReader &file) {
+	_flags = readInt(file);
+	_hasTexture = readInt(file);
 	if(_hasTexture > 1) {
 		cout << "We have this many textures: " <<  _hasTexture << endl;
 	}
 	if(_hasTexture)
-		_texID = readInt(*file);
-	_faceLength = readInt(*file);
+		_texID = readInt(file);
+	_faceLength = readInt(file);
 	short x = 0, y = 0, z = 0;
 	_indexes = new Vector3<int>[_faceLength];
 
 	for (int i = 0; i < _faceLength; i += 3) {
-		file->read((char *)&x, 2);
-		file->read((char *)&y, 2);
-		file->read((char *)&z, 2);
+		x = readShort(file);
+		y = readShort(file);
+		z = readShort(file);
 		_indexes[i].setVal(x,y,z);
 	}
 }
 
-void MeshFace::render() {
-	if(_hasTexture) {
-		_parent->setTex(_texID);
+template<typename T>
+void MeshFace::copyIndices(T *dest) const {
+	// One triangle is stored for every three indices, the indices are
+	// unsigned shorts in the file
+	for (uint32_t i = 0; i < _faceLength; i += 3) {
+		*dest++ = (uint16_t)_indexes[i]._x;
+		*dest++ = (uint16_t)_indexes[i]._y;
+		*dest++ = (uint16_t)_indexes[i]._z;
 	}
-	glDrawElements(GL_TRIANGLES, _faceLength * 3, GL_UNSIGNED_INT, _indexes);
 }
 
 
 void Mesh::loadMesh(string filename) {
-	std::istream *file = getFile(filename, _lab);
+	AssetLoader loader(_lab);
+	const Asset *asset = loader.load(filename);
+	if (!asset) {
+		std::cout << "Unable to open file " << filename << std::endl;
+		return;
+	}
+	DataReader file(asset->data, asset->size);
 
 	int strLength = 0;
 
-	std::string nameString = readString(*file);
+	std::string nameString = readString(file);
 
-	_sphereData = readVector4d(*file);
+	_sphereData = readVector4d(file);
 	std::cout << "# Spheredata: " << _sphereData->toString() << std::endl;
-	_boxData = readVector3d(*file);
-	_boxData2 = readVector3d(*file);
+	_boxData = readVector3d(file);
+	_boxData2 = readVector3d(file);
 	std::cout << "# Boxdata: " << _boxData->toString()
 			<< _boxData2->toString() << std::endl;
 
-	_numTexSets = readInt(*file);
-	_setType = readInt(*file);
+	_numTexSets = readInt(file);
+	_setType = readInt(file);
 	std::cout << "# NumTexSets: " << _numTexSets << " setType: " << _setType << std::endl;
-	_numTextures = readInt(*file);
+	_numTextures = readInt(file);
 
 	_texNames = new string[_numTextures];
 
 	for(int i = 0;i < _numTextures; i++) {
-		_texNames[i] = readString(*file);
+		_texNames[i] = readString(file);
 		// Every texname seems to be followed by 4 0-bytes (Ref mk1.mesh,
 		// this is intentional)
-		file->seekg(4, std::ios::cur);
+		file.skip(4);
 	}
 
 	// 4 unknown bytes - usually with value 19
-	file->seekg(4, std::ios::cur);
+	file.skip(4);
 
-	_numVertices = readInt(*file);
+	_numVertices = readInt(file);
 	std::cout << "#File has " << _numVertices << " Vertices" << std::endl;
 
 	float x = 0, y = 0;
 	int r = 0, g = 0, b = 0, a = 0;
 	// Vertices
-	_vertices = readVector3d(*file, _numVertices);
-	_normals = readVector3d(*file, _numVertices);
+	_vertices = readVector3d(file, _numVertices);
+	_normals = readVector3d(file, _numVertices);
 	_colorMap = new Colormap[_numVertices];
 	for (int i = 0; i < _numVertices; ++i) {
-		_colorMap[i].r = readByte(*file) ;
-		_colorMap[i].g = readByte(*file) ;
-		_colorMap[i].b = readByte(*file) ;
-		_colorMap[i].a = readByte(*file) ;
+		_colorMap[i].r = readByte(file) ;
+		_colorMap[i].g = readByte(file) ;
+		_colorMap[i].b = readByte(file) ;
+		_colorMap[i].a = readByte(file) ;
 	}
-	_texVerts = readVector2d(*file, _numVertices);
+	_texVerts = readVector2d(file, _numVertices);
 
 	// Faces
 
-	file->read((char *) &_numFaces, 4);
+	_numFaces = readInt(file);
 	_faces = new MeshFace[_numFaces];
 	int faceLength = 0;
 	for(int j = 0;j < _numFaces; j++) {
@@ -253,37 +533,52 @@ void Mesh::loadMesh(string filename) {
 	}
 
 	int hasBones = 0;
-	file->read((char*)&hasBones, 4);
+	hasBones = readInt(file);
 
 	if (hasBones == 1) {
-		_numBones = readInt(*file);
+		_numBones = readInt(file);
 		_bones = new Bone[_numBones];
 		for(int i = 0;i < _numBones; i++) {
-			_bones[i].setName(readString(*file));
+			_bones[i].setName(readString(file));
 			_boneMap[_bones[i].getName()] = _bones + i;
 		}
 
-		int numBoneData = readInt(*file);
+		int numBoneData = readInt(file);
 		int unknownVal = 0;
 		int boneDatanum;
 		float boneDataWgt;
 		int vertex = 0;
+		_influenceVertex = new int[numBoneData];
+		_influenceBone = new int[numBoneData];
+		_influenceWeight = new float[numBoneData];
+		_numInfluences = 0;
 		for(int i = 0;i < numBoneData; i++) {
-			unknownVal = readInt(*file);
-			boneDatanum = readInt(*file);
-			boneDataWgt = readFloat(*file);
+			unknownVal = readInt(file);
+			boneDatanum = readInt(file);
+			boneDataWgt = readFloat(file);
 			if(unknownVal)
 				vertex++;
-			_bones[boneDatanum].addVertex(vertex, boneDataWgt);
+			if (vertex >= _numVertices || boneDatanum < 0 || boneDatanum >= _numBones)
+				continue;
+			_influenceVertex[_numInfluences] = vertex;
+			_influenceBone[_numInfluences] = boneDatanum;
+			_influenceWeight[_numInfluences] = boneDataWgt;
+			_numInfluences++;
 		}
 	}
-	delete file;
+	loader.release(asset);
 }
 
 void Mesh::loadSkeleton(std::string filename) {
-	std::istream *file = getFile(filename, _lab);
+	AssetLoader loader(_lab);
+	const Asset *asset = loader.load(filename);
+	if (!asset) {
+		std::cout << "Unable to open file " << filename << std::endl;
+		return;
+	}
+	DataReader file(asset->data, asset->size);
 
-	int numBones = readInt(*file);
+	int numBones = readInt(file);
 
 	string boneName;
 	string parentName;
@@ -293,8 +588,8 @@ void Mesh::loadSkeleton(std::string filename) {
 	// Bones are listed in the same order as in the meshb.
 	Vector3d *vec = 0;
 	for(int i = 0;i < numBones; i++) {
-		boneName = readCString(*file,32);
-		parentName = readCString(*file,32);
+		boneName = readCString(file,32);
+		parentName = readCString(file,32);
 
 		bone = _boneMap[boneName];
 
@@ -320,85 +615,298 @@ void Mesh::loadSkeleton(std::string filename) {
 			if (!parent->hasChild(bone))
 				parent->addChild(bone);
 		}
-		bone->setPos(readVector3d(*file));
-		bone->setRot(readVector3d(*file));
-		bone->setAngle(readFloat(*file));
+		bone->setPos(readVector3d(file));
+		bone->setRot(readVector3d(file));
+		bone->setAngle(readFloat(file));
 	}
+	loader.release(asset);
 }
 
 void Mesh::loadAnimation(std::string filename) {
-	std::istream *file = getFile(filename, _lab);
-
-	_anim = new Animation();
-	_anim->_name = readString(*file);
+	AssetLoader loader(_lab);
+	const Asset *asset = loader.load(filename);
+	if (!asset) {
+		std::cout << "Unable to open file " << filename << std::endl;
+		return;
+	}
+	DataReader file(asset->data, asset->size);
 
+	// An animb or its binary cache, with the keys of all bones in two arrays
+	AnimCache cache;
+	readAnimation(file, cache);
+	loader.release(asset);
 
-	_anim->_timelen = readFloat(*file);
-	_anim->_numBones = readInt(*file);
+	_anim = new Animation();
+	_anim->_name = cache._name;
+	_anim->_timelen = cache._duration;
+	_anim->_numBones = cache._tracks.size();
 	std::cout << "animName: " << _anim->_name << " duration: " << _anim->_timelen << " bones: " << _anim->_numBones << std::endl;
-	float time = 0.0f;
-
-	KeyframeList *keyList;
-	Keyframe *key;
-	Bone *bone;
 
 	for (int i = 0; i < _anim->_numBones; i++) {
-		std::string boneName = readString(*file);
-		int operation = readInt(*file);
-		int unknown1 = readInt(*file);
-		int unknown2 = readInt(*file);
-		int numKeyframes = readInt(*file);
-
-		bone = _boneMap[boneName];
-		keyList = new KeyframeList(numKeyframes, operation);
-
-		std::cout << "Bone: " << boneName << " Operation: " << operation << " Unknown1: " << unknown1 <<
-			" Unknown2: " << unknown2 << " numKeyframes: " << numKeyframes << std::endl;
-
-		if (operation == 3) { // Translation
-			for(int i = 0; i < numKeyframes; i++) {
-				key = keyList->_frames + i;
-				key->_time = readFloat(*file);
-				key->_vec3d = readVector3d(*file);
-			}
-		} else if (operation == 4) { // Rotation
-			for(int i = 0; i < numKeyframes; i++) {
-				key = keyList->_frames + i;
-				key->_time = readFloat(*file);
-				key->_vec4d = readVector4d(*file);
-			}
+		const AnimTrack &track = cache._tracks[i];
+		int components = animComponents(track._operation);
+
+		std::map<std::string, Bone*>::iterator it = _boneMap.find(track._bone);
+		Bone *bone = it != _boneMap.end() ? it->second : NULL;
+
+		std::cout << "Bone: " << track._bone << " Operation: " << track._operation << " Unknown1: " << track._unknown1 <<
+			" Unknown2: " << track._unknown2 << " numKeyframes: " << track._numKeys << std::endl;
+		if (!bone || !track._numKeys)
+			continue;
+
+		KeyframeList *keyList = new KeyframeList(track._numKeys, track._operation);
+		const float *times = &cache._times[track._firstKey];
+		const float *values = &cache._values[track._firstValue];
+		for (uint32 k = 0; k < track._numKeys; k++) {
+			Keyframe *key = keyList->_frames + k;
+			key->_time = times[k];
+			key->_value.x = values[k * components];
+			key->_value.y = values[k * components + 1];
+			key->_value.z = values[k * components + 2];
+			key->_value.w = components == 4 ? values[k * components + 3] : 0;
 		}
+		bone->setKeyFrames(keyList);
+	}
+}
 
+// Orders face groups by texture, keeping untextured ones first
+struct FaceOrder {
+	const MeshFace *_faces;
+	FaceOrder(const MeshFace *faces) : _faces(faces) {}
+	bool operator()(uint32_t a, uint32_t b) const {
+		return _faces[a].getTexture() < _faces[b].getTexture();
 	}
+};
+
+template<typename T>
+static void buildIndices(const MeshFace *faces, const std::vector<uint32_t> &order,
+		uint32_t numIndices, std::vector<DrawBatch> &batches) {
+	T *indices = new T[numIndices];
+	uint32_t pos = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		const MeshFace &face = faces[order[i]];
+		uint32_t count = face.getNumTriangles() * 3;
+		if (!count)
+			continue;
+		face.copyIndices(indices + pos);
+		if (!batches.empty() && batches.back()._texture == face.getTexture()) {
+			batches.back()._count += count;
+		} else {
+			DrawBatch batch;
+			batch._texture = face.getTexture();
+			batch._first = pos;
+			batch._count = count;
+			batches.push_back(batch);
+		}
+		pos += count;
+	}
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(T), indices, GL_STATIC_DRAW);
+	delete[] indices;
 }
 
-void Mesh::prepare() {
+void Mesh::prepare(int jobs) {
 	_mats = new Material[_numTextures];
-	for (int i = 0; i < _numTextures; i++) {
-		_mats[i].setLab(_lab);
-		_mats[i].loadTexture(_texNames[i]);
+	std::vector<uint32_t> texIDs(_numTextures + 1);
+	loadTextures(_lab, _texNames, _numTextures, &texIDs[0], jobs);
+	for (uint32_t i = 0; i < _numTextures; i++)
+		_mats[i].setTexture(texIDs[i]);
+
+	uintptr_t vec3Size = _numVertices * sizeof(Vector3d);
+	_normalOffset = vec3Size;
+	_colorOffset = _normalOffset + vec3Size;
+	_texOffset = _colorOffset + _numVertices * sizeof(Colormap);
+	uintptr_t size = _texOffset + _numVertices * sizeof(Vector2d);
+
+	glGenBuffers(1, &_vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, vec3Size, _vertices);
+	glBufferSubData(GL_ARRAY_BUFFER, _normalOffset, vec3Size, _normals);
+	glBufferSubData(GL_ARRAY_BUFFER, _colorOffset, _numVertices * sizeof(Colormap), _colorMap);
+	glBufferSubData(GL_ARRAY_BUFFER, _texOffset, _numVertices * sizeof(Vector2d), _texVerts);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Face groups sharing a texture are drawn with a single call
+	std::vector<uint32_t> order(_numFaces);
+	uint32_t numIndices = 0;
+	for (uint32_t i = 0; i < _numFaces; i++) {
+		order[i] = i;
+		numIndices += _faces[i].getNumTriangles() * 3;
 	}
+	std::stable_sort(order.begin(), order.end(), FaceOrder(_faces));
+
+	_batches.clear();
+	_shortIndices = _numVertices <= 65536;
+	glGenBuffers(1, &_indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+	if (_shortIndices)
+		buildIndices<uint16_t>(_faces, order, numIndices, _batches);
+	else
+		buildIndices<uint32_t>(_faces, order, numIndices, _batches);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 void Mesh::render() {
+	glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+	if (_skinDirty) {
+		uintptr_t vec3Size = _numVertices * sizeof(Vector3d);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, vec3Size, _skinnedVertices);
+		glBufferSubData(GL_ARRAY_BUFFER, _normalOffset, vec3Size, _skinnedNormals);
+		_counters.bufferUploads += 2;
+		_skinDirty = false;
+	}
+
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 	glEnableClientState(GL_COLOR_ARRAY);
 
-	glVertexPointer(3, GL_FLOAT, 0, _vertices);
-	glTexCoordPointer(2, GL_FLOAT, 0, _texVerts);
-	glNormalPointer(GL_FLOAT, 0, _normals);
-	glColorPointer(4, GL_UNSIGNED_BYTE, 0, _colorMap);
-
-	for(int i = 0; i < _numFaces; i++) {
-		_faces[i].render();
+	glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *)0);
+	glNormalPointer(GL_FLOAT, 0, (const GLvoid *)_normalOffset);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, (const GLvoid *)_colorOffset);
+	glTexCoordPointer(2, GL_FLOAT, 0, (const GLvoid *)_texOffset);
+
+	GLenum type = _shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	uintptr_t indexSize = _shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+	for (size_t i = 0; i < _batches.size(); i++) {
+		const DrawBatch &batch = _batches[i];
+		if (batch._texture >= 0)
+			setTex(batch._texture);
+		else
+			glDisable(GL_TEXTURE_2D);
+		glDrawElements(GL_TRIANGLES, batch._count, type, (const GLvoid *)(batch._first * indexSize));
+		_counters.drawCalls++;
 	}
 
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 	glDisableClientState(GL_COLOR_ARRAY);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+bool Mesh::prepareSkin() {
+	if (!_numBones || !_numInfluences)
+		return false;
+	for (int i = 0; i < _numBones; i++) {
+		if (!_bones[i].hasPose()) {
+			std::cout << "Bone " << _bones[i].getName() << " is not in the skeleton, not skinning" << std::endl;
+			return false;
+		}
+	}
+
+	_bindInverse = new float[16 * _numBones];
+	_boneMatrices = new float[16 * _numBones];
+	_palette = new float[16 * _numBones];
+	_skinBuffer = new float[8 * _numVertices];
+	_skinnedVertices = new Vector3d[_numVertices];
+	_skinnedNormals = new Vector3d[_numVertices];
+
+	// The mesh is in the rest pose, skinning moves it relative to that
+	for (int i = 0; i < _numBones; i++) {
+		if (!_bones[i].getParent())
+			poseBone(_bones + i, NULL, -1.0f);
+	}
+	for (int i = 0; i < _numBones; i++)
+		invertRigidMatrix(_boneMatrices + 16 * i, _bindInverse + 16 * i);
+	return true;
+}
+
+void Mesh::poseBone(const Bone *bone, const float *parent, float time) {
+	// Siblings share the parent, so they are walked here rather than recursively
+	for (; bone; bone = bone->getSibling()) {
+		float *matrix = _boneMatrices + 16 * (bone - _bones);
+		if (parent) {
+			float local[16];
+			bone->getLocalMatrix(time, local);
+			multiplyMatrix(parent, local, matrix);
+		} else {
+			bone->getLocalMatrix(time, matrix);
+		}
+		if (bone->getChild())
+			poseBone(bone->getChild(), matrix, time);
+		if (!parent)
+			break;
+	}
+}
+
+void Mesh::animate(float time) {
+	if (!_skinBuffer)
+		return;
+	if (_anim && _anim->_timelen > 0) {
+		time = fmodf(time, _anim->_timelen);
+		if (time < 0)
+			time += _anim->_timelen;
+	} else {
+		time = -1.0f;
+	}
+
+	for (int i = 0; i < _numBones; i++) {
+		if (!_bones[i].getParent())
+			poseBone(_bones + i, NULL, time);
+	}
+	for (int i = 0; i < _numBones; i++)
+		multiplyMatrix(_boneMatrices + 16 * i, _bindInverse + 16 * i, _palette + 16 * i);
+	skinVertices();
+}
+
+void Mesh::skinVertices() {
+	memset(_skinBuffer, 0, 8 * _numVertices * sizeof(float));
+
+	// Each influence adds its weighted transform of the vertex. The fourth
+	// lane of the position sums up the weights.
+#if defined(__SSE__)
+	for (int i = 0; i < _numInfluences; i++) {
+		const float *m = _palette + 16 * _influenceBone[i];
+		const Vector3d &v = _vertices[_influenceVertex[i]];
+		const Vector3d &n = _normals[_influenceVertex[i]];
+		float *dest = _skinBuffer + 8 * _influenceVertex[i];
+		__m128 c0 = _mm_loadu_ps(m);
+		__m128 c1 = _mm_loadu_ps(m + 4);
+		__m128 c2 = _mm_loadu_ps(m + 8);
+		__m128 c3 = _mm_loadu_ps(m + 12);
+		__m128 w = _mm_set1_ps(_influenceWeight[i]);
+
+		__m128 pos = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(v.x)), _mm_mul_ps(c1, _mm_set1_ps(v.y))),
+			_mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(v.z)), c3));
+		__m128 nrm = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(n.x)), _mm_mul_ps(c1, _mm_set1_ps(n.y))),
+			_mm_mul_ps(c2, _mm_set1_ps(n.z)));
+		_mm_storeu_ps(dest, _mm_add_ps(_mm_loadu_ps(dest), _mm_mul_ps(w, pos)));
+		_mm_storeu_ps(dest + 4, _mm_add_ps(_mm_loadu_ps(dest + 4), _mm_mul_ps(w, nrm)));
+	}
+#else
+	for (int i = 0; i < _numInfluences; i++) {
+		const float *m = _palette + 16 * _influenceBone[i];
+		const Vector3d &v = _vertices[_influenceVertex[i]];
+		const Vector3d &n = _normals[_influenceVertex[i]];
+		float *dest = _skinBuffer + 8 * _influenceVertex[i];
+		float w = _influenceWeight[i];
+		for (int r = 0; r < 4; r++) {
+			dest[r] += w * (m[r] * v.x + m[4 + r] * v.y + m[8 + r] * v.z + m[12 + r]);
+			dest[4 + r] += w * (m[r] * n.x + m[4 + r] * n.y + m[8 + r] * n.z);
+		}
+	}
+#endif
+
+	for (int i = 0; i < _numVertices; i++) {
+		const float *src = _skinBuffer + 8 * i;
+		if (src[3] == 0.0f) {
+			// Not attached to any bone
+			_skinnedVertices[i] = _vertices[i];
+			_skinnedNormals[i] = _normals[i];
+			continue;
+		}
+		_skinnedVertices[i].x = src[0];
+		_skinnedVertices[i].y = src[1];
+		_skinnedVertices[i].z = src[2];
+		_skinnedNormals[i].x = src[4];
+		_skinnedNormals[i].y = src[5];
+		_skinnedNormals[i].z = src[6];
+	}
+	_skinDirty = true;
 }
 
 void renderInit() {
@@ -409,24 +917,167 @@ void renderInit() {
 
 Mesh m;
 
-void renderLoop() {
-	float rot = 0.5f;
-	while(true) {
-		renderInit();
-		glTranslatef(0.0,-0.9f, 0.0f);
-		glRotatef(rot,0.0f,0.1f,0.0f);
-		rot+=0.1f;
-		m.render();
-		glFlush();
+struct FrameStats {
+	int frames;
+	double skinTime;
+	double drawTime;
+	uint32_t drawCalls;
+	uint32_t bufferUploads;
+};
+
+// Poses and draws the mesh at time seconds, adding the CPU time of both to stats
+void renderFrame(double time, FrameStats &stats) {
+	double start = glfwGetTime();
+	if (m.hasAnimation())
+		m.animate((float)time);
+	double skinned = glfwGetTime();
+
+	m.resetCounters();
+	renderInit();
+	glTranslatef(0.0,-0.9f, 0.0f);
+	glRotatef(0.5f + 20.0f * (float)time,0.0f,0.1f,0.0f);
+	m.render();
+	glFlush();
+	double drawn = glfwGetTime();
+
+	stats.frames++;
+	stats.skinTime += skinned - start;
+	stats.drawTime += drawn - skinned;
+	stats.drawCalls += m.getCounters().drawCalls;
+	stats.bufferUploads += m.getCounters().bufferUploads;
+}
+
+void printStats(const FrameStats &stats, double elapsed) {
+	int n = stats.frames ? stats.frames : 1;
+	std::cout << stats.frames << " frames in " << elapsed << " s, " << (elapsed > 0 ? stats.frames / elapsed : 0.0) << " frames per second" << std::endl;
+	std::cout << "per frame: skinning " << 1000.0 * stats.skinTime / n << " ms, draw " << 1000.0 * stats.drawTime / n << " ms, " <<
+		(double)stats.drawCalls / n << " draw calls, " << (double)stats.bufferUploads / n << " buffer uploads" << std::endl;
+}
+
+// Draws at no more than fps frames per second until the window is closed
+void renderLoop(double fps) {
+	FrameStats stats;
+	memset(&stats, 0, sizeof(stats));
+	double frameTime = 1.0 / fps;
+	double next = glfwGetTime();
+	while (glfwGetWindowParam(GLFW_OPENED) && !glfwGetKey(GLFW_KEY_ESC)) {
+		renderFrame(glfwGetTime(), stats);
 		glfwSwapBuffers();
-		usleep(5000);
+
+		next += frameTime;
+		double now = glfwGetTime();
+		if (next > now)
+			glfwSleep(next - now);
+		else
+			next = now;
+	}
+}
+
+// Renders frames at a fixed animation step into an offscreen framebuffer
+int benchmark(int frames) {
+	GLuint fbo = 0, color = 0, depth = 0;
+	if (glfwExtensionSupported("GL_EXT_framebuffer_object")) {
+		glGenFramebuffersEXT(1, &fbo);
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+		glGenRenderbuffersEXT(1, &color);
+		glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, color);
+		glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, 1024, 768);
+		glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, color);
+		glGenRenderbuffersEXT(1, &depth);
+		glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depth);
+		glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, 1024, 768);
+		glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, depth);
+		if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT) {
+			std::cout << "Offscreen framebuffer incomplete, rendering to the window" << std::endl;
+			glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+		}
+	} else {
+		std::cout << "No framebuffer objects, rendering to the window" << std::endl;
+	}
+
+	FrameStats stats;
+	memset(&stats, 0, sizeof(stats));
+	double start = glfwGetTime();
+	for (int i = 0; i < frames; i++)
+		renderFrame(i / 30.0, stats);
+	// Wait for the GPU, so the frame rate includes it
+	glFinish();
+	printStats(stats, glfwGetTime() - start);
+
+	if (fbo) {
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+		glDeleteRenderbuffersEXT(1, &depth);
+		glDeleteRenderbuffersEXT(1, &color);
+		glDeleteFramebuffersEXT(1, &fbo);
 	}
+	return 0;
+}
+
+// Times the animation and skinning alone, no GL context is needed
+int benchmarkSkinning(int frames) {
+	FrameStats stats;
+	memset(&stats, 0, sizeof(stats));
+	double start = glfwGetTime();
+	for (int i = 0; i < frames; i++) {
+		double t = glfwGetTime();
+		m.animate(i / 30.0f);
+		stats.skinTime += glfwGetTime() - t;
+		stats.frames++;
+	}
+	printStats(stats, glfwGetTime() - start);
+	return 0;
+}
+
+void usage() {
+	cout << "Usage: renderModel [-f fps] [-b frames] [-n] [-j N] [labName] <mesh-name> [skel-name] [anim-name]" << endl;
+	cout << "\t-f fps\tLimit the viewer to fps frames per second (default 60)" << endl;
+	cout << "\t-b frames\tRender frames offscreen and print the timings" << endl;
+	cout << "\t-j N\tDecode textures with N threads (default 4)" << endl;
+	cout << "\t-n\tWith -b, only animate and skin, without opening a window" << endl;
 }
 
 int main(int argc, char **argv) {
+	int benchFrames = 0;
+	int jobs = 4;
+	bool headless = false;
+	double fps = 60.0;
+	int c;
+	while ((c = getopt(argc, argv, "b:f:j:nh")) != -1) {
+		switch (c) {
+		case 'b':
+			benchFrames = atoi(optarg);
+			break;
+		case 'f':
+			fps = atof(optarg);
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'n':
+			headless = true;
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2 || fps <= 0 || benchFrames < 0) {
+		usage();
+		return 1;
+	}
+	if (headless && !benchFrames)
+		benchFrames = 100;
+
 	if (argc > 2) {
 		cout << "Using LAB!" << endl;
-		Lab *lab = new Lab(string(argv[1]));
+		// Mapped, so textures can be decoded in parallel
+		Lab *lab = new Lab(string(argv[1]), false, true);
 		m.setLab(lab);
 		m.loadMesh(argv[2]);
 	} else {
@@ -438,10 +1089,29 @@ int main(int argc, char **argv) {
 	}
 
 	glfwInit();
+	if (headless) {
+		if (!m.prepareSkin()) {
+			cout << "Nothing to skin" << endl;
+			return 1;
+		}
+		return benchmarkSkinning(benchFrames);
+	}
+
 	glfwOpenWindow(1024, 768, 8, 8, 8, 8, 8, 8, GLFW_WINDOW);
-	m.prepare();
+	// Sync to the display, the frame limit covers drivers that ignore it
+	glfwSwapInterval(benchFrames ? 0 : 1);
+	m.prepare(jobs);
+	if (argc > 3 && m.prepareSkin())
+		m.animate(0.0f);
 	glEnable(GL_DEPTH_TEST);
-	renderLoop();
+	// Skinned normals are not renormalized
+	glEnable(GL_NORMALIZE);
 
-	return 0;
+	int result = 0;
+	if (benchFrames)
+		result = benchmark(benchFrames);
+	else
+		renderLoop(fps);
+	glfwTerminate();
+	return result;
 }
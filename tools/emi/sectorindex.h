@@ -0,0 +1,405 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_SECTORINDEX_H
+#define EMI_SECTORINDEX_H
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "common/endian.h"
+#include "common/stats.h"
+
+/*
+ * Binary index of a set's sectors, written by setb2set --index and read by
+ * sectorquery. All values are little-endian 32-bit:
+ *
+ * header	"SIDX", version, numSectors, numNodes, numVertices, namesSize
+ * sectors	id, type, height, firstVertex, numVertices, nameOffset,
+ *		normal[3], then the bounds min[3] and max[3]
+ * nodes	min[3], max[3], first, count. Leaves hold count sectors from
+ *		first in the sector order, inner nodes have count 0, the left
+ *		child following them and the right one at first.
+ * vertices	x, y, z for each
+ * names	NUL-terminated, the set's name at offset 0
+ *
+ * The normal is the polygon's (Newell's method), not the one setb2set prints.
+ */
+
+enum {
+	kSectorIndexVersion = 1,
+	kSectorIndexHeaderSize = 24,
+	kSectorIndexSectorSize = 60,
+	kSectorIndexNodeSize = 32,
+	kSectorIndexLeafSize = 4
+};
+
+struct IndexSector {
+	std::string name;
+	int id;
+	int type;
+	float height;
+	std::vector<float> vertices;
+};
+
+struct SectorIndexEntry {
+	uint32 id;
+	uint32 type;
+	float height;
+	uint32 firstVertex;
+	uint32 numVertices;
+	uint32 nameOffset;
+	float normal[3];
+	float min[3];
+	float max[3];
+};
+
+struct SectorIndexNode {
+	float min[3];
+	float max[3];
+	uint32 first;
+	uint32 count;
+};
+
+// A loaded index, the arrays point into data
+struct SectorIndex {
+	std::vector<char> data;
+	uint32 numSectors;
+	uint32 numNodes;
+	uint32 numVertices;
+	const char *sectors;
+	const char *nodes;
+	const char *vertices;
+	const char *names;
+	uint32 namesSize;
+};
+
+static inline float readIndexFloat(const char *p) {
+	uint32 bits = READ_LE_UINT32(p);
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+static inline void writeIndexFloat(std::vector<char> &out, float f) {
+	uint32 bits;
+	memcpy(&bits, &f, 4);
+	char buf[4];
+	WRITE_LE_UINT32(buf, bits);
+	out.insert(out.end(), buf, buf + 4);
+}
+
+static inline void writeIndexInt(std::vector<char> &out, uint32 v) {
+	char buf[4];
+	WRITE_LE_UINT32(buf, v);
+	out.insert(out.end(), buf, buf + 4);
+}
+
+// Orders sectors by the centre of their bounds along one axis
+struct SectorCentreOrder {
+	const std::vector<SectorIndexEntry> *entries;
+	int axis;
+	bool operator()(uint32 a, uint32 b) const {
+		const SectorIndexEntry &ea = (*entries)[a], &eb = (*entries)[b];
+		return ea.min[axis] + ea.max[axis] < eb.min[axis] + eb.max[axis];
+	}
+};
+
+// Builds the nodes over order[first, first + count), splitting at the median
+// of the longest axis
+static void buildSectorNodes(const std::vector<SectorIndexEntry> &entries, std::vector<uint32> &order,
+		uint32 first, uint32 count, std::vector<SectorIndexNode> &nodes) {
+	SectorIndexNode node;
+	for (int a = 0; a < 3; a++) {
+		node.min[a] = 1e30f;
+		node.max[a] = -1e30f;
+	}
+	for (uint32 i = first; i < first + count; i++) {
+		const SectorIndexEntry &e = entries[order[i]];
+		for (int a = 0; a < 3; a++) {
+			node.min[a] = std::min(node.min[a], e.min[a]);
+			node.max[a] = std::max(node.max[a], e.max[a]);
+		}
+	}
+	uint32 index = nodes.size();
+	node.first = first;
+	node.count = count;
+	nodes.push_back(node);
+	if (count <= kSectorIndexLeafSize)
+		return;
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++) {
+		if (node.max[a] - node.min[a] > node.max[axis] - node.min[axis])
+			axis = a;
+	}
+	SectorCentreOrder less;
+	less.entries = &entries;
+	less.axis = axis;
+	uint32 half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count, less);
+
+	nodes[index].count = 0;
+	buildSectorNodes(entries, order, first, half, nodes);
+	nodes[index].first = nodes.size();
+	buildSectorNodes(entries, order, first + half, count - half, nodes);
+}
+
+// Writes the sectors of setName with their hierarchy, returns false on errors
+bool writeSectorIndex(const char *filename, const std::string &setName, const std::vector<IndexSector> &sectors) {
+	std::vector<SectorIndexEntry> entries(sectors.size());
+	std::string names = setName;
+	names += '\0';
+	uint32 numVertices = 0;
+	for (size_t i = 0; i < sectors.size(); i++) {
+		const IndexSector &s = sectors[i];
+		SectorIndexEntry &e = entries[i];
+		e.id = s.id;
+		e.type = s.type;
+		e.height = s.height;
+		e.numVertices = s.vertices.size() / 3;
+		e.nameOffset = names.size();
+		names += s.name;
+		names += '\0';
+
+		float n[3] = { 0, 0, 0 };
+		for (int a = 0; a < 3; a++) {
+			e.min[a] = e.numVertices ? 1e30f : 0;
+			e.max[a] = e.numVertices ? -1e30f : 0;
+		}
+		for (uint32 v = 0; v < e.numVertices; v++) {
+			const float *p = &s.vertices[3 * v];
+			const float *q = &s.vertices[3 * ((v + 1) % e.numVertices)];
+			n[0] += (p[1] - q[1]) * (p[2] + q[2]);
+			n[1] += (p[2] - q[2]) * (p[0] + q[0]);
+			n[2] += (p[0] - q[0]) * (p[1] + q[1]);
+			for (int a = 0; a < 3; a++) {
+				e.min[a] = std::min(e.min[a], p[a]);
+				e.max[a] = std::max(e.max[a], p[a]);
+			}
+		}
+		float len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		for (int a = 0; a < 3; a++)
+			e.normal[a] = len > 0 ? n[a] / len : 0;
+		// A point may lie up to height away from the plane, any distance at
+		// heights of 9000 and more
+		float h = s.height < 9000.0f ? std::max(s.height, 0.0f) + 0.01f : 1e30f;
+		for (int a = 0; a < 3; a++) {
+			e.min[a] -= h * fabs(e.normal[a]);
+			e.max[a] += h * fabs(e.normal[a]);
+		}
+	}
+
+	std::vector<uint32> order(entries.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::vector<SectorIndexNode> nodes;
+	if (!entries.empty())
+		buildSectorNodes(entries, order, 0, entries.size(), nodes);
+
+	std::vector<char> out;
+	out.insert(out.end(), "SIDX", "SIDX" + 4);
+	writeIndexInt(out, kSectorIndexVersion);
+	writeIndexInt(out, entries.size());
+	writeIndexInt(out, nodes.size());
+	writeIndexInt(out, 0); // patched below
+	writeIndexInt(out, names.size());
+
+	// Leaves refer to the sectors in the hierarchy's order, vertices follow suit
+	for (size_t i = 0; i < order.size(); i++) {
+		const SectorIndexEntry &e = entries[order[i]];
+		writeIndexInt(out, e.id);
+		writeIndexInt(out, e.type);
+		writeIndexFloat(out, e.height);
+		writeIndexInt(out, numVertices);
+		writeIndexInt(out, e.numVertices);
+		writeIndexInt(out, e.nameOffset);
+		for (int a = 0; a < 3; a++)
+			writeIndexFloat(out, e.normal[a]);
+		for (int a = 0; a < 3; a++)
+			writeIndexFloat(out, e.min[a]);
+		for (int a = 0; a < 3; a++)
+			writeIndexFloat(out, e.max[a]);
+		numVertices += e.numVertices;
+	}
+	for (size_t i = 0; i < nodes.size(); i++) {
+		for (int a = 0; a < 3; a++)
+			writeIndexFloat(out, nodes[i].min[a]);
+		for (int a = 0; a < 3; a++)
+			writeIndexFloat(out, nodes[i].max[a]);
+		writeIndexInt(out, nodes[i].first);
+		writeIndexInt(out, nodes[i].count);
+	}
+	for (size_t i = 0; i < order.size(); i++) {
+		const std::vector<float> &v = sectors[order[i]].vertices;
+		for (size_t j = 0; j < entries[order[i]].numVertices * 3; j++)
+			writeIndexFloat(out, v[j]);
+	}
+	out.insert(out.end(), names.begin(), names.end());
+	WRITE_LE_UINT32(&out[16], numVertices);
+
+	Common::StatsPhase phase(Common::kStatsWrite);
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+	Common::addStatsWritten(out.size());
+	return fclose(f) == 0 && ok;
+}
+
+// Reads an index written by writeSectorIndex(), checking every count and offset
+bool loadSectorIndex(const char *filename, SectorIndex &index) {
+	Common::StatsPhase phase(Common::kStatsOpen);
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size < kSectorIndexHeaderSize) {
+		fclose(f);
+		return false;
+	}
+	index.data.resize(size);
+	bool ok = fread(&index.data[0], 1, size, f) == (size_t)size;
+	fclose(f);
+	Common::addStatsRead(size);
+	const char *p = &index.data[0];
+	if (!ok || memcmp(p, "SIDX", 4) != 0 || READ_LE_UINT32(p + 4) != kSectorIndexVersion)
+		return false;
+
+	index.numSectors = READ_LE_UINT32(p + 8);
+	index.numNodes = READ_LE_UINT32(p + 12);
+	index.numVertices = READ_LE_UINT32(p + 16);
+	index.namesSize = READ_LE_UINT32(p + 20);
+	uint64 total = kSectorIndexHeaderSize + (uint64)index.numSectors * kSectorIndexSectorSize +
+		(uint64)index.numNodes * kSectorIndexNodeSize + (uint64)index.numVertices * 12 + index.namesSize;
+	if (total != (uint64)size || index.namesSize == 0 || p[size - 1] != 0)
+		return false;
+	index.sectors = p + kSectorIndexHeaderSize;
+	index.nodes = index.sectors + index.numSectors * kSectorIndexSectorSize;
+	index.vertices = index.nodes + index.numNodes * kSectorIndexNodeSize;
+	index.names = index.vertices + index.numVertices * 12;
+
+	for (uint32 i = 0; i < index.numSectors; i++) {
+		const char *s = index.sectors + i * kSectorIndexSectorSize;
+		uint32 first = READ_LE_UINT32(s + 12), count = READ_LE_UINT32(s + 16);
+		if (first > index.numVertices || index.numVertices - first < count || READ_LE_UINT32(s + 20) >= index.namesSize)
+			return false;
+	}
+	for (uint32 i = 0; i < index.numNodes; i++) {
+		const char *n = index.nodes + i * kSectorIndexNodeSize;
+		uint32 first = READ_LE_UINT32(n + 24), count = READ_LE_UINT32(n + 28);
+		if (count ? first > index.numSectors || index.numSectors - first < count : first <= i + 1 || first >= index.numNodes)
+			return false;
+	}
+	return true;
+}
+
+inline const char *sectorIndexName(const SectorIndex &index, uint32 offset) {
+	return index.names + offset;
+}
+
+// Tests the point against one sector the way the engine does, within height
+// of its plane and inside all of its edges, whichever their winding
+static bool sectorContains(const SectorIndex &index, const char *s, const float *point) {
+	float height = readIndexFloat(s + 8);
+	uint32 first = READ_LE_UINT32(s + 12), count = READ_LE_UINT32(s + 16);
+	if (count < 3)
+		return false;
+	float normal[3];
+	for (int a = 0; a < 3; a++)
+		normal[a] = readIndexFloat(s + 24 + 4 * a);
+	const char *v = index.vertices + first * 12;
+
+	float p0[3];
+	for (int a = 0; a < 3; a++)
+		p0[a] = readIndexFloat(v + 4 * a);
+	if (height < 9000.0f) {
+		float dist = 0;
+		for (int a = 0; a < 3; a++)
+			dist += (point[a] - p0[a]) * normal[a];
+		if (fabs(dist) > (height > 0 ? height : 0) + 0.01f)
+			return false;
+	}
+
+	int side = 0;
+	for (uint32 i = 0; i < count; i++) {
+		float a[3], b[3], edge[3], delta[3];
+		for (int c = 0; c < 3; c++) {
+			a[c] = readIndexFloat(v + 12 * i + 4 * c);
+			b[c] = readIndexFloat(v + 12 * ((i + 1) % count) + 4 * c);
+			edge[c] = b[c] - a[c];
+			delta[c] = point[c] - a[c];
+		}
+		float cross = (edge[1] * delta[2] - edge[2] * delta[1]) * normal[0] +
+			(edge[2] * delta[0] - edge[0] * delta[2]) * normal[1] +
+			(edge[0] * delta[1] - edge[1] * delta[0]) * normal[2];
+		if (cross > 1e-6f) {
+			if (side < 0)
+				return false;
+			side = 1;
+		} else if (cross < -1e-6f) {
+			if (side > 0)
+				return false;
+			side = -1;
+		}
+	}
+	return true;
+}
+
+/**
+ * Appends the sectors containing point to result, as indices in the file.
+ * Only the hierarchy's nodes around the point are visited.
+ */
+void querySectorIndex(const SectorIndex &index, const float *point, std::vector<uint32> &result) {
+	if (!index.numNodes)
+		return;
+	uint32 stack[64];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		const char *n = index.nodes + stack[--depth] * kSectorIndexNodeSize;
+		bool inside = true;
+		for (int a = 0; a < 3 && inside; a++) {
+			inside = point[a] >= readIndexFloat(n + 4 * a) - 0.01f &&
+				point[a] <= readIndexFloat(n + 12 + 4 * a) + 0.01f;
+		}
+		if (!inside)
+			continue;
+		uint32 first = READ_LE_UINT32(n + 24), count = READ_LE_UINT32(n + 28);
+		if (count) {
+			for (uint32 i = first; i < first + count; i++) {
+				if (sectorContains(index, index.sectors + i * kSectorIndexSectorSize, point))
+					result.push_back(i);
+			}
+		} else if (depth + 2 <= 64) {
+			stack[depth++] = first;
+			stack[depth++] = (n - index.nodes) / kSectorIndexNodeSize + 1;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,112 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// Looks up which sectors contain a point, in indexes made by setb2set --index
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "sectorindex.h"
+#include "common/statsalloc.h"
+
+static const char *typeName(uint32 type) {
+	switch (type) {
+	case 0x1000:
+		return "walk";
+	case 0x1100:
+		return "funnel";
+	case 0x2000:
+		return "camera";
+	case 0x4000:
+		return "special";
+	case 0x8000:
+		return "hot";
+	default:
+		return "none";
+	}
+}
+
+static void usage() {
+	std::cout << "Usage: sectorquery [-p X Y Z] INDEX..." << std::endl;
+	std::cout << "Prints the sectors of all indexes containing the point, or each" << std::endl;
+	std::cout << "point read from stdin as \"X Y Z\" lines" << std::endl;
+}
+
+static void query(const std::vector<SectorIndex *> &indexes, const float *point) {
+	std::vector<uint32> found;
+	for (size_t i = 0; i < indexes.size(); i++) {
+		const SectorIndex &index = *indexes[i];
+		found.clear();
+		querySectorIndex(index, point, found);
+		for (size_t j = 0; j < found.size(); j++) {
+			const char *s = index.sectors + found[j] * kSectorIndexSectorSize;
+			printf("%f %f %f\t%s\t%s\tID %d\t%s\n", point[0], point[1], point[2], sectorIndexName(index, 0),
+				sectorIndexName(index, READ_LE_UINT32(s + 20)), (int)READ_LE_UINT32(s), typeName(READ_LE_UINT32(s + 4)));
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	Common::initStats("sectorquery", argc, argv);
+	bool havePoint = false;
+	float point[3];
+	if (argc > 4 && strcmp(argv[1], "-p") == 0) {
+		for (int a = 0; a < 3; a++)
+			point[a] = (float)atof(argv[2 + a]);
+		havePoint = true;
+		argv += 4;
+		argc -= 4;
+	}
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	std::vector<SectorIndex *> indexes;
+	for (int i = 1; i < argc; i++) {
+		SectorIndex *index = new SectorIndex;
+		if (!loadSectorIndex(argv[i], *index)) {
+			std::cerr << "Unable to read sector index " << argv[i] << std::endl;
+			delete index;
+			continue;
+		}
+		indexes.push_back(index);
+		Common::addStatsFiles();
+	}
+
+	Common::StatsPhase phase(Common::kStatsConvert);
+	if (havePoint) {
+		query(indexes, point);
+	} else {
+		char line[256];
+		while (fgets(line, sizeof(line), stdin)) {
+			if (sscanf(line, "%f %f %f", &point[0], &point[1], &point[2]) == 3)
+				query(indexes, point);
+		}
+	}
+
+	for (size_t i = 0; i < indexes.size(); i++)
+		delete indexes[i];
+	return 0;
+}
@@ -0,0 +1,469 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_SETB_H
+#define EMI_SETB_H
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "common/endian.h"
+#include "sectorindex.h"
+
+/*
+ * The reader of EMI's binary sets, shared by setb2set and set2fig. Only the
+ * setups and sectors are parsed, the lights are skipped.
+ */
+
+enum SectorType {
+	NoneType = 0,
+	WalkType = 0x1000,
+	FunnelType = 0x1100,
+	CameraType = 0x2000,
+	SpecialType = 0x4000,
+	HotType = 0x8000
+};
+
+
+enum LightType{
+	omni,
+	direct
+};
+
+// Reads little-endian values from a buffer without going past its end. Reads
+// at the end give zeroes and set eos().
+class Data {
+public:
+	Data(const char *data, uint32 size);
+	float GetFloat();
+	int GetInt();
+	bool GetBool();
+	std::string GetString(int length);
+	std::string GetNullTerminatedString();
+	void Skip(int val);
+	uint32 Remaining() const { return end - buf; }
+	bool eos() const { return _eos; }
+private:
+	const char *buf;
+	const char *end;
+	bool _eos;
+};
+
+Data::Data(const char *data, uint32 size)
+{
+	buf = data;
+	end = data + size;
+	_eos = false;
+}
+
+float Data::GetFloat()
+{
+	uint32 bits = (uint32)GetInt();
+	float retVal;
+	memcpy(&retVal, &bits, 4);
+	return retVal;
+}
+
+int Data::GetInt()
+{
+	if (Remaining() < 4) {
+		Skip(4);
+		return 0;
+	}
+	int retVal = (int)READ_LE_UINT32(buf);
+	buf += 4;
+	return retVal;
+}
+
+bool Data::GetBool()
+{
+	if (Remaining() < 1) {
+		_eos = true;
+		return false;
+	}
+	bool retVal = *buf != 0;
+	buf += 1;
+	return retVal;
+}
+
+std::string Data::GetString(int length)
+{
+	//kind of a hack
+	uint32 len = length < 0 ? 0 : (uint32)length;
+	if (len > Remaining())
+		len = Remaining();
+	const char *nul = (const char *)memchr(buf, 0, len);
+	std::string s = std::string(buf, nul ? nul - buf : len);
+	Skip(length);
+	return s;
+}
+
+std::string Data::GetNullTerminatedString()
+{
+	const char *nul = (const char *)memchr(buf, 0, Remaining());
+	std::string s = std::string(buf, nul ? nul : end);
+	Skip(s.length()+1);
+	return s;
+}
+
+void Data::Skip(int val)
+{
+	if (val < 0 || (uint32)val > Remaining()) {
+		buf = end;
+		_eos = true;
+		return;
+	}
+	buf += val;
+}
+
+struct Section {
+public:
+	Section(Data *data);
+	virtual ~Section() {};
+	//virtual uint32 load() = 0;
+	virtual void Write(std::ostream &out) = 0;
+protected:
+	Data *data;
+};
+
+Section::Section(Data *data)
+{
+	this->data = data;
+}
+
+class Sector : public Section
+{
+public:
+	Sector(Data *data);
+	~Sector() { delete[] vertices; }
+
+	virtual void Write(std::ostream &out);
+	void Export(IndexSector &out) const;
+
+	const std::string &getName() const { return name; }
+	SectorType getType() const { return type; }
+	bool isVisible() const { return visible; }
+	int getNumVertices() const { return numVertices; }
+	// x, y, z of each vertex
+	const float *getVertices() const { return vertices; }
+private:
+	std::string name;
+	int ID; // byte;
+	SectorType type;
+	float height;
+	int numVertices; // byte;
+	float* vertices; // 3 * numVertices.
+	float normal[3];
+	bool visible;
+};
+
+Sector::Sector(Data *data) : Section(data)
+{
+	numVertices = data->GetInt();
+	// Corrupt counts would allocate more than the file holds
+	if (numVertices < 0 || (uint32)numVertices > data->Remaining() / 12) {
+		data->Skip(-1);
+		numVertices = 0;
+	}
+	vertices = new float[3*numVertices + 6];
+	memset(vertices, 0, (3*numVertices + 6) * sizeof(float));
+	for(int i=0; i < numVertices; i++)
+	{
+		vertices[0+3*i] = data->GetFloat();
+		vertices[1+3*i] = data->GetFloat();
+		vertices[2+3*i] = data->GetFloat();
+	}
+	int nameLength = data->GetInt();
+
+	name = data->GetString(nameLength);
+	ID = data->GetInt();
+	visible = data->GetBool();
+	type = (SectorType)data->GetInt();
+	int skip = data->GetInt();
+	data->Skip(skip*4);
+	height = data->GetFloat();
+
+	float cross1[3], cross2[3];
+	cross1[0] = vertices[3] - vertices[0];
+	cross1[1] = vertices[4] - vertices[1];
+	cross1[2] = vertices[5] - vertices[2];
+
+	int x = 3 * (numVertices > 1 ? numVertices - 1 : 0);
+	cross2[0] = vertices[x+0] - vertices[0];
+	cross2[1] = vertices[x+1] - vertices[1];
+	cross2[2] = vertices[x+2] - vertices[2];
+
+	float &nx = normal[0];
+	float &ny = normal[1];
+	float &nz = normal[2];
+	nx = cross1[1] * cross2[2] - cross2[1] * cross1[2];
+	ny = cross1[0] * cross2[2] - cross2[0] * cross1[2];
+	nz = cross1[0] * cross2[1] - cross2[0] * cross1[1];
+
+	float norm = nx * nx + ny * ny + nz * nz;
+	norm = ::sqrt(norm);
+	nx /= norm;
+	ny /= norm;
+	nz /= norm;
+}
+
+void Sector::Write(std::ostream &ss)
+{
+	ss.precision(6);
+	ss.setf(std::ios::fixed,std::ios::floatfield);
+	ss << "\tsector\t" << name << '\n';
+	ss << "\tID\t" << ID << '\n';
+	ss << "\ttype\t";
+	switch (type) {
+	case WalkType:
+		ss << "walk";
+		break;
+	case FunnelType:
+		ss << "funnel";
+		break;
+	case CameraType:
+		ss << "camera";
+		break;
+	case SpecialType:
+		ss << "special";
+		break;
+	case HotType:
+		ss << "hot";
+		break;
+	};
+	ss << '\n';
+	ss << "\tdefault visibility\t";
+	if (visible)
+		ss << "visible";
+	else
+		ss << "invisible";
+	ss << '\n';
+	ss << "\theight\t" << height << '\n';
+	ss << "\tnumvertices\t" << numVertices << '\n';
+	ss << "\tnormal\t\t\t" << normal[0] << "\t" << normal[1] << "\t" << normal[2] << '\n';
+	ss << "\tvertices:\t\t";
+	for (int i = 0; i < numVertices*3; i+=3) {
+		if (i != 0)
+			ss << "\t\t\t\t";
+		ss << vertices[i] << "\t" << vertices[i+1] << "\t" << vertices[i+2] << '\n';
+	}
+}
+
+void Sector::Export(IndexSector &out) const
+{
+	out.name = name;
+	out.id = ID;
+	out.type = type;
+	out.height = height;
+	out.vertices.assign(vertices, vertices + 3 * numVertices);
+}
+
+class Setup : public Section
+{
+public:
+	Setup(Data *data);
+	~Setup() { delete[] position; delete[] interest; }
+
+	virtual void Write(std::ostream &out);
+private:
+	std::string name;
+	std::string tile;
+	std::string background;
+	std::string zbuffer;
+	float* position;
+	float* interest;
+	float roll;
+	float fov;
+	float nclip;
+	float fclip;
+};
+
+Setup::Setup(Data *data) : Section(data)
+{
+	name = data->GetString(128); // Parse a string really
+
+	// Skip an unknown number
+	int unknown = data->GetInt();
+
+
+	tile = data->GetNullTerminatedString();
+
+	position = new float[3];
+
+	position[0] = data->GetFloat();
+	position[1] = data->GetFloat();
+	position[2] = data->GetFloat();
+
+	interest = new float[3];
+
+	interest[0] = data->GetFloat();
+	interest[1] = data->GetFloat();
+	interest[2] = data->GetFloat();
+
+	roll = data->GetFloat();
+	fov  = data->GetFloat();
+	nclip = data->GetFloat();
+	fclip = data->GetFloat();
+}
+
+void Setup::Write(std::ostream &ss)
+{
+	ss.precision(6);
+	ss.setf(std::ios::fixed,std::ios::floatfield);
+	ss << "\tname\t" << name << '\n';
+	// background
+	// zbuffer
+	ss << "\tposition\t" << position[0] << "\t" << position[1] << "\t" << position[2] << '\n';
+	ss << "\tinterest\t" << interest[0] << "\t" << interest[1] << "\t" << interest[2] << '\n';
+	ss << "\troll\t" << roll << '\n';
+	ss << "\tfov\t" << fov << '\n';
+	ss << "\tnclip\t" << nclip << '\n';
+	ss << "\tfclip\t" << fclip << '\n';
+}
+
+class Light : public Section
+{
+public:
+	Light(Data *data);
+	virtual void Write(std::ostream &out);
+
+private:
+	std::string name;
+	LightType type;
+	float* position;
+	float* direction;
+	float intensity;
+	float umbraangla;
+	float penumbraangle;
+	int* color; // Byte
+
+};
+
+Light::Light(Data *data) : Section(data)
+{
+	data->Skip(100);
+}
+
+void Light::Write(std::ostream &out)
+{
+}
+
+class Set {
+public:
+	virtual void Write(std::ostream &out);
+	void ExportSectors(std::vector<IndexSector> &out) const;
+	const std::vector<Sector *> &getSectors() const { return sectors; }
+	Set(Data *data);
+	virtual ~Set();
+private:
+	std::string setName;
+	uint32 numSetups;
+	uint32 numColormaps;
+	uint32 numLights;
+	uint32 numSectors;
+	std::vector<Section *> setups;
+	std::vector<std::string> colormaps;
+	std::vector<Section *> lights;
+	std::vector<Sector *> sectors;
+};
+
+Set::Set(Data *data)
+{
+	// Every count is checked against the smallest size of its entries
+	numSetups = data->GetInt();
+	if (numSetups > data->Remaining() / 173) {
+		data->Skip(-1);
+		numSetups = 0;
+	}
+	setups.reserve(numSetups);
+	for(uint32 i = 0; i < numSetups && !data->eos(); i++) {
+		setups.push_back(new Setup(data));
+	}
+
+	numLights = data->GetInt();
+	if (numLights > data->Remaining() / 100) {
+		data->Skip(-1);
+		numLights = 0;
+	}
+	lights.reserve(numLights);
+	for(uint32 i = 0; i < numLights && !data->eos(); i++) {
+		lights.push_back(new Light(data));
+	}
+
+	numSectors = data->GetInt();
+	if (numSectors > data->Remaining() / 25) {
+		data->Skip(-1);
+		numSectors = 0;
+	}
+	sectors.reserve(numSectors);
+	for(uint32 i = 0; i < numSectors && !data->eos(); i++) {
+		sectors.push_back(new Sector(data));
+	}
+}
+Set::~Set()
+{
+	for(size_t i = 0; i < setups.size(); i++)
+		delete setups[i];
+	for(size_t i = 0; i < lights.size(); i++)
+		delete lights[i];
+	for(size_t i = 0; i < sectors.size(); i++)
+		delete sectors[i];
+}
+
+void Set::Write(std::ostream &ss)
+{
+	// colormaps
+	ss << "section: colormaps" << '\n'; // we don't have any.
+	// setups
+	ss << "section: setups" << '\n';
+	std::vector<Section*>::iterator it;
+	ss << "\tnumsetups " << setups.size() << '\n';
+	for(it = setups.begin(); it != setups.end(); ++it) {
+		(*it)->Write(ss);
+		ss << '\n' << '\n';
+	}
+
+	// lights
+	ss << "section: lights" << '\n';
+	ss << "\tnumlights 0" << '\n';
+	for(it = lights.begin();it!=lights.end();it++) {
+		(*it)->Write(ss);
+		ss << '\n' << '\n';
+	}
+	// sectors
+	ss << "section: sectors\n";
+	for(size_t i = 0; i < sectors.size(); i++) {
+		sectors[i]->Write(ss);
+		ss << '\n' << '\n';
+	}
+}
+
+void Set::ExportSectors(std::vector<IndexSector> &out) const
+{
+	out.resize(sectors.size());
+	for(size_t i = 0; i < sectors.size(); i++)
+		sectors[i]->Export(out[i]);
+}
+
+#endif
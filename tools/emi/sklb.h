@@ -0,0 +1,58 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef EMI_SKLB_H
+#define EMI_SKLB_H
+
+#include <ostream>
+#include "filetools.h"
+
+// Based on Benjamin Haischs work on sklb-files.
+
+// Prints every bone of an sklb with its parent and rest pose
+void sklbToText(DataReader &file, std::ostream &out) {
+	int numBones = readInt(file);
+	
+	char boneString[32];
+	char parentString[32];
+
+	float angle = 0;
+	// Bones are listed in the same order as in the meshb.
+	Vector3d vec;
+	for(int i=0;i<numBones;i++) {
+		file.read(boneString, 32);
+		file.read(parentString, 32);
+		
+		out << "# BoneName " << boneString << "\twith parent: " << parentString << "\t"; 
+		out << " position: ";
+		readVector3d(file, &vec, 1);
+		out << vec.toString();
+		out << " rotation: ";
+		readVector3d(file, &vec, 1);
+		out << vec.toString();
+		angle = readFloat(file);
+		out << angle << '\n';
+
+	}
+}
+
+#endif
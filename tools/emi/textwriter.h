@@ -0,0 +1,224 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef TEXTWRITER_H
+#define TEXTWRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include "common/stats.h"
+
+/**
+ * Formats value the way std::ostream does by default, as printf's "%g"
+ * with six significant digits, and returns the length. The digits are found
+ * in double arithmetic. That is exact for floats unless the dropped part
+ * is within rounding error of a half, and only printf settles those.
+ */
+int formatFloat(float value, char *out) {
+	// A constant table, so several threads may format at once
+	static const double pow10[2 * 60 + 1] = {
+		1e-60, 1e-59, 1e-58, 1e-57, 1e-56, 1e-55, 1e-54, 1e-53,
+		1e-52, 1e-51, 1e-50, 1e-49, 1e-48, 1e-47, 1e-46, 1e-45,
+		1e-44, 1e-43, 1e-42, 1e-41, 1e-40, 1e-39, 1e-38, 1e-37,
+		1e-36, 1e-35, 1e-34, 1e-33, 1e-32, 1e-31, 1e-30, 1e-29,
+		1e-28, 1e-27, 1e-26, 1e-25, 1e-24, 1e-23, 1e-22, 1e-21,
+		1e-20, 1e-19, 1e-18, 1e-17, 1e-16, 1e-15, 1e-14, 1e-13,
+		1e-12, 1e-11, 1e-10, 1e-9, 1e-8, 1e-7, 1e-6, 1e-5,
+		1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3,
+		1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+		1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27,
+		1e28, 1e29, 1e30, 1e31, 1e32, 1e33, 1e34, 1e35,
+		1e36, 1e37, 1e38, 1e39, 1e40, 1e41, 1e42, 1e43,
+		1e44, 1e45, 1e46, 1e47, 1e48, 1e49, 1e50, 1e51,
+		1e52, 1e53, 1e54, 1e55, 1e56, 1e57, 1e58, 1e59,
+		1e60
+	};
+
+	double d = value;
+	if (d != d || d - d != 0.0 || d == 0.0)
+		return sprintf(out, "%g", d);
+
+	char *p = out;
+	if (d < 0) {
+		*p++ = '-';
+		d = -d;
+	}
+
+	int exp10 = (int)floor(log10(d));
+	if (exp10 < -50 || exp10 > 50)
+		return sprintf(out, "%g", value);
+	if (d < pow10[60 + exp10])
+		exp10--;
+	else if (d >= pow10[60 + exp10 + 1])
+		exp10++;
+
+	// Six digits before the point, the exponent of ten is exact up to 1e22
+	double scaled = exp10 <= 5 ? d * pow10[60 + 5 - exp10] : d / pow10[60 + exp10 - 5];
+	double whole = floor(scaled);
+	double frac = scaled - whole;
+	if (fabs(frac - 0.5) < 1e-6)
+		return sprintf(out, "%g", (double)value);
+	unsigned int digits = (unsigned int)whole + (frac > 0.5 ? 1 : 0);
+	if (digits >= 1000000) {
+		digits /= 10;
+		exp10++;
+	}
+
+	char buf[6];
+	for (int i = 5; i >= 0; i--) {
+		buf[i] = '0' + digits % 10;
+		digits /= 10;
+	}
+	int last = 5;
+	while (last > 0 && buf[last] == '0')
+		last--;
+
+	if (exp10 < -4 || exp10 >= 6) {
+		*p++ = buf[0];
+		if (last > 0) {
+			*p++ = '.';
+			for (int i = 1; i <= last; i++)
+				*p++ = buf[i];
+		}
+		*p++ = 'e';
+		*p++ = exp10 < 0 ? '-' : '+';
+		int e = exp10 < 0 ? -exp10 : exp10;
+		if (e >= 100)
+			*p++ = '0' + e / 100;
+		*p++ = '0' + e / 10 % 10;
+		*p++ = '0' + e % 10;
+	} else if (exp10 < 0) {
+		*p++ = '0';
+		*p++ = '.';
+		for (int i = -1; i > exp10; i--)
+			*p++ = '0';
+		for (int i = 0; i <= last; i++)
+			*p++ = buf[i];
+	} else {
+		for (int i = 0; i <= exp10; i++)
+			*p++ = buf[i];
+		if (last > exp10) {
+			*p++ = '.';
+			for (int i = exp10 + 1; i <= last; i++)
+				*p++ = buf[i];
+		}
+	}
+	return p - out;
+}
+
+int formatInt(int value, char *out) {
+	char buf[12];
+	char *p = out;
+	unsigned int u = value;
+	if (value < 0) {
+		*p++ = '-';
+		u = 0 - u;
+	}
+	int n = 0;
+	do {
+		buf[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n)
+		*p++ = buf[--n];
+	return p - out;
+}
+
+/**
+ * Text output to a FILE through a large buffer, with the << operators of
+ * std::ostream for the types the converters print. Nothing is flushed
+ * until the buffer fills or the writer goes away.
+ */
+class TextWriter {
+	FILE *_out;
+	char *_buf;
+	size_t _size;
+	size_t _len;
+
+	// Makes room for len more bytes
+	void reserve(size_t len) {
+		if (_len + len > _size)
+			flush();
+	}
+public:
+	TextWriter(FILE *out, size_t size = 1024 * 1024) : _out(out), _size(size), _len(0) {
+		_buf = new char[size];
+	}
+	~TextWriter() {
+		flush();
+		delete[] _buf;
+	}
+
+	void flush() {
+		if (_len) {
+			Common::StatsPhase phase(Common::kStatsWrite);
+			fwrite(_buf, 1, _len, _out);
+			Common::addStatsWritten(_len);
+		}
+		_len = 0;
+	}
+
+	void write(const char *str, size_t len) {
+		if (len > _size) {
+			flush();
+			Common::StatsPhase phase(Common::kStatsWrite);
+			fwrite(str, 1, len, _out);
+			Common::addStatsWritten(len);
+			return;
+		}
+		reserve(len);
+		memcpy(_buf + _len, str, len);
+		_len += len;
+	}
+
+	TextWriter &operator<<(const char *str) {
+		write(str, strlen(str));
+		return *this;
+	}
+	TextWriter &operator<<(const std::string &str) {
+		write(str.data(), str.size());
+		return *this;
+	}
+	TextWriter &operator<<(char c) {
+		reserve(1);
+		_buf[_len++] = c;
+		return *this;
+	}
+	TextWriter &operator<<(int value) {
+		reserve(16);
+		_len += formatInt(value, _buf + _len);
+		return *this;
+	}
+	TextWriter &operator<<(short value) {
+		return *this << (int)value;
+	}
+	TextWriter &operator<<(float value) {
+		reserve(32);
+		_len += formatFloat(value, _buf + _len);
+		return *this;
+	}
+};
+
+#endif
@@ -30,8 +30,19 @@
 #include <stdint.h>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
+#include <vector>
 #include "common/endian.h"
 #include "tools/lab.h"
+#include "tools/assetloader.h"
+#include "tools/dds.h"
+#include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
 This tool converts EMI-TILEs into BMP-files, and supports both the format used in the Windows
@@ -41,12 +52,18 @@ since it's much easier to swap RGB to BGR that way. I might add down-converting
 when I get the time. The upconverting-function MAY be off by a bit, but as far as I could understand,
 the PS2-format uses 16-bit, with alpha-bit first, then 5 bits per channel.
 
-The current implementation also has a few limitation w.r.t. if there should be TILEs that aren't 640x480.
+The picture is assembled from the quads listed in the TIL header, each of which maps a rectangle
+of one sub-image onto the screen, so any grid or size of TILE works. The quads are drawn a layer
+at a time, back to front, like the engine does. TILEs without that table get the 640x480 layout
+of 5 256x256 images.
 
 Also, I _THINK_ that it should work on Big-Endian-systems now, but I haven't gotten around to testing that yet.
 
+With -d the picture is written as a BC1 compressed DDS texture instead, or BC3 with -a to keep
+the alpha channel, and -m adds the mipmap levels.
+
 Usage:
-til2bmp <filename> 
+til2bmp [-d [-a] [-m]] [labfilename] <filename>
 
 somaen.
 */
@@ -83,54 +100,15 @@ public:
 		_data = new char[size()]; 
 	
 	}
-	void BGR2RGB();
-	void MoreBits();
 	void LessBits();
 	void WriteBMP(const char* name);
+	void WriteDDS(const char* name, DDSFormat format, bool mips);
 };
 
 void LucasBitMap::LessBits(){
 	printf("Not implemented\n");
 }
 
-void LucasBitMap::MoreBits(){
-	if(_bpp==2){
-		char* newData = new char[_width*_height*4];
-		char* to = newData;
-		char red=0,green=0,blue=0;
-		for(unsigned int i=0;i<_height;i++){
-			for(unsigned int j=0;j<_width;j++){
-				char byte2 = _data[i*_width*_bpp+j*2];
-				char byte1 = _data[i*_width*_bpp+j*2+1];
-			// Probably Alpha, then 555.
-			// Red
-				red = (byte1 >> 2) & 31;
-				red = red << 3 | red >> 2;
-			// Green
-				char green1 = (byte1 & 3);
-				char green2 = (((byte2) >> 5) & 7);
-				char green3 = green1 << 3 | green2;
-				green = green3 << 3 | green3 >> 2 ;
-			// Blue
-				blue = (byte2) & 31;
-				blue = blue << 3 | blue >> 2;
-			// Some more magic to stretch the values 
-				*to = red;
-				to++;
-				*to = green;
-				to++;
-				*to = blue;
-				to++;
-				*to = 0;
-				to++;
-			}
-		}
-		delete _data;
-		_data = newData;
-		_bpp = 4;
-	}
-}
-
 LucasBitMap::LucasBitMap(char* data, uint32_t width, uint32_t height,uint32_t bpp, bool copy)  : _data(data), _width(width), _height(height), _bpp(bpp){
 	if(data == 0)
 		MakeNewData();
@@ -164,18 +142,63 @@ else if(_bpp == 2)
 	file.write((char *)&header, sizeof(BMPHeader));
 	file.write(_data, size());
 	file.close();
+	Common::addStatsWritten(size() + 54);
 }
 
-void LucasBitMap::BGR2RGB(){
-	if(_bpp == 4){
-		uint32_t end = size();
-		for(uint32_t i = 0; i < end; i += 4){
-			char temp = _data[i + 2];
-			_data[i + 2] = _data[i];
-			_data[i] = temp;
-		}
-	}else if(_bpp==2){
-		MoreBits();	
+void LucasBitMap::WriteDDS(const char* name, DDSFormat format, bool mips){
+	uint32 ddsSize = getDDSSize(_width, _height, format, mips);
+	std::vector<uint8> out(ddsSize);
+	// The rows are kept bottom-up for the BMP, the texture starts at the top
+	int32 pitch = _width * _bpp;
+	writeDDS((const uint8 *)_data + (_height - 1) * pitch, -pitch, _width, _height, format, mips, &out[0]);
+	std::fstream file(name, std::fstream::out | std::fstream::binary);
+	file.write((const char *)&out[0], ddsSize);
+	file.close();
+	Common::addStatsWritten(ddsSize);
+}
+
+// A sub-image inside the decompressed TIL
+struct TileImage {
+	const char *data;
+	uint32_t width, height;
+};
+
+typedef void (*RowConverter)(const char *src, char *dst, uint32_t width);
+
+// Copies width 32-bit pixels, swapping red and blue
+static void convertRow32(const char *src, char *dst, uint32_t width) {
+	uint32_t i = 0;
+#if defined(__SSE2__)
+	const __m128i maskGA = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i maskB = _mm_set1_epi32(0xff);
+	for (; i + 4 <= width; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		__m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), maskB);
+		__m128i b = _mm_slli_epi32(_mm_and_si128(p, maskB), 16);
+		_mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_or_si128(_mm_and_si128(p, maskGA), _mm_or_si128(r, b)));
+	}
+#endif
+	for (; i < width; i++) {
+		dst[4 * i] = src[4 * i + 2];
+		dst[4 * i + 1] = src[4 * i + 1];
+		dst[4 * i + 2] = src[4 * i];
+		dst[4 * i + 3] = src[4 * i + 3];
+	}
+}
+
+// Expands width PS2 16-bit pixels to 32 bits, the upconversion might be
+// off by a bit, but as far as I could understand it's alpha bit first, then
+// 5 bits per channel.
+static void convertRow16(const char *src, char *dst, uint32_t width) {
+	for (uint32_t i = 0; i < width; i++) {
+		uint32_t pixel = (uint8_t)src[2 * i] | ((uint8_t)src[2 * i + 1] << 8);
+		uint32_t red = (pixel >> 10) & 31;
+		uint32_t green = (pixel >> 5) & 31;
+		uint32_t blue = pixel & 31;
+		dst[4 * i] = (char)(red << 3 | red >> 2);
+		dst[4 * i + 1] = (char)(green << 3 | green >> 2);
+		dst[4 * i + 2] = (char)(blue << 3 | blue >> 2);
+		dst[4 * i + 3] = 0;
 	}
 }
 
@@ -188,123 +211,301 @@ char* GetLine(int lineNum, char* data, unsigned int width,int bpp){
 	return data + (lineNum * (width * bpp));
 }
 
-// Expects 5 LucasBitmaps, and returns a LucasBitmap untiled.
-LucasBitMap* MakeFullPicture(LucasBitMap** bits){
-	LucasBitMap* fullImage = new LucasBitMap(0, 640, 480, bits[0]->_bpp);
-	
-	const int tWidth = 256 * bits[0]->_bpp; // All of them should have the same bpp. (32)
-	int bpp = bits[0]->_bpp;
-	
-	char* target = fullImage->_data;
-	for(int i = 0;i < 256;i++){
-		/* This can be modified to actually use the last 32 lines.
-		 * We simply put the lower half on line 223 and down to line 32, 
-		 * then skip the last 32.
-		 * While the upper half is put on line 479 and down to line 224.
-		 */
-		if(i < 224){ // Skip blank space
-			target = GetLine(223 - i,fullImage);
-			
-			memcpy(target, GetLine(i, bits[3]), tWidth);
-			target += bits[3]->_width * bpp;
-		
-			memcpy(target, GetLine(i, bits[4]), tWidth);
-			target += bits[4]->_width * bpp;
-			
-			memcpy(target,GetLine(i,bits[2])+128*bpp,128*bpp);
-			target += bpp * bits[2]->_width / 2;
+// A corner of a quad, in screen and texture coordinates
+struct TileVertex {
+	float x, y;
+	float s, t;
+};
+
+// A polygon textured with one of the sub-images, usually a rectangle
+struct TileQuad {
+	uint32_t image;
+	uint32_t first;
+	uint32_t count;
+};
+
+static const char *GetLine(int lineNum, const TileImage &tile, uint32_t bpp) {
+	return tile.data + lineNum * tile.width * bpp;
+}
+
+static void addRect(const TileImage *images, uint32_t image, float x0, float y0, float x1, float y1,
+		float s0, float s1, uint32_t rows, std::vector<TileVertex> &verts, std::vector<TileQuad> &quads) {
+	float t1 = (float)rows / images[image].height;
+	TileQuad quad = { image, (uint32_t)verts.size(), 4 };
+	TileVertex corners[4] = {
+		{ x0, y0, s0, 0 }, { x1, y0, s1, 0 }, { x1, y1, s1, t1 }, { x0, y1, s0, t1 }
+	};
+	verts.insert(verts.end(), corners, corners + 4);
+	quads.push_back(quad);
+}
+
+// The layout of TILEs without their own table. The third image holds the
+// right edge of both halves, and the last 32 lines of the lower images are
+// blank space.
+static void makeDefaultLayout(const TileImage *images, std::vector<TileVertex> &verts, std::vector<TileQuad> &quads) {
+	addRect(images, 0, 0, 0, 256, 256, 0, 1, 256, verts, quads);
+	addRect(images, 1, 256, 0, 512, 256, 0, 1, 256, verts, quads);
+	addRect(images, 2, 512, 0, 640, 256, 0, 0.5f, 256, verts, quads);
+	addRect(images, 3, 0, 256, 256, 480, 0, 1, 224, verts, quads);
+	addRect(images, 4, 256, 256, 512, 480, 0, 1, 224, verts, quads);
+	addRect(images, 2, 512, 256, 640, 480, 0.5f, 1, 224, verts, quads);
+}
+
+static int roundToInt(float f) {
+	return (int)floor(f + 0.5f);
+}
+
+static int clampInt(int value, int min, int max) {
+	return value < min ? min : (value > max ? max : value);
+}
+
+// Draws the quads in order into a 32-bit LucasBitmap, converting the pixels as
+// they're copied. The scale and direction of the screen coordinates are taken
+// from how the first quad maps its texture.
+LucasBitMap* MakeFullPicture(const TileImage *images, const std::vector<TileVertex> &verts,
+		const std::vector<TileQuad> &quads, uint32_t bpp){
+	RowConverter convert = bpp == 2 ? convertRow16 : convertRow32;
+
+	float minX = 0, maxX = 0, minY = 0, maxY = 0;
+	float scaleX = 0, scaleY = 0;
+	bool flipX = false, flipY = false;
+	for (size_t q = 0; q < quads.size(); q++) {
+		const TileImage &image = images[quads[q].image];
+		const TileVertex *v = &verts[quads[q].first];
+		uint32_t minS = 0, maxS = 0, minT = 0, maxT = 0;
+		for (uint32_t i = 0; i < quads[q].count; i++) {
+			if (q == 0 && i == 0) {
+				minX = maxX = v[i].x;
+				minY = maxY = v[i].y;
+			}
+			minX = v[i].x < minX ? v[i].x : minX;
+			maxX = v[i].x > maxX ? v[i].x : maxX;
+			minY = v[i].y < minY ? v[i].y : minY;
+			maxY = v[i].y > maxY ? v[i].y : maxY;
+			minS = v[i].s < v[minS].s ? i : minS;
+			maxS = v[i].s > v[maxS].s ? i : maxS;
+			minT = v[i].t < v[minT].t ? i : minT;
+			maxT = v[i].t > v[maxT].t ? i : maxT;
+		}
+		// Texture rows run down the picture
+		float dx = v[maxS].x - v[minS].x, dy = v[maxT].y - v[minT].y;
+		if (scaleX == 0 && fabs(dx) > 1e-6f) {
+			scaleX = (v[maxS].s - v[minS].s) * image.width / fabs(dx);
+			flipX = dx < 0;
+		}
+		if (scaleY == 0 && fabs(dy) > 1e-6f) {
+			scaleY = (v[maxT].t - v[minT].t) * image.height / fabs(dy);
+			flipY = dy < 0;
+		}
+	}
+
+	int width = roundToInt((maxX - minX) * scaleX);
+	int height = roundToInt((maxY - minY) * scaleY);
+	if (width <= 0 || height <= 0 || width > 16384 || height > 16384) {
+		printf("Can't work out the picture size from the tile table\n");
+		return NULL;
+	}
+	LucasBitMap* fullImage = new LucasBitMap(0, width, height, 4);
+	memset(fullImage->_data, 0, fullImage->size());
+
+	for (size_t q = 0; q < quads.size(); q++) {
+		const TileImage &image = images[quads[q].image];
+		const TileVertex *v = &verts[quads[q].first];
+		float x0 = 1e30f, x1 = -1e30f, y0 = 1e30f, y1 = -1e30f;
+		float s0 = 1e30f, s1 = -1e30f, t0 = 1e30f, t1 = -1e30f;
+		uint32_t minS = 0, maxS = 0, minT = 0, maxT = 0;
+		for (uint32_t i = 0; i < quads[q].count; i++) {
+			float px = (flipX ? maxX - v[i].x : v[i].x - minX) * scaleX;
+			float py = (flipY ? maxY - v[i].y : v[i].y - minY) * scaleY;
+			x0 = px < x0 ? px : x0;
+			x1 = px > x1 ? px : x1;
+			y0 = py < y0 ? py : y0;
+			y1 = py > y1 ? py : y1;
+			s0 = v[i].s < s0 ? v[i].s : s0;
+			s1 = v[i].s > s1 ? v[i].s : s1;
+			t0 = v[i].t < t0 ? v[i].t : t0;
+			t1 = v[i].t > t1 ? v[i].t : t1;
+			minS = v[i].s < v[minS].s ? i : minS;
+			maxS = v[i].s > v[maxS].s ? i : maxS;
+			minT = v[i].t < v[minT].t ? i : minT;
+			maxT = v[i].t > v[maxT].t ? i : maxT;
+		}
+		// Quads drawn mirrored relative to the first one
+		bool mirrorX = (v[maxS].x < v[minS].x) != flipX;
+		bool mirrorY = (v[maxT].y < v[minT].y) != flipY;
+
+		int dx0 = clampInt(roundToInt(x0), 0, width), dx1 = clampInt(roundToInt(x1), 0, width);
+		int dy0 = clampInt(roundToInt(y0), 0, height), dy1 = clampInt(roundToInt(y1), 0, height);
+		int sx0 = clampInt(roundToInt(s0 * image.width), 0, image.width);
+		int sx1 = clampInt(roundToInt(s1 * image.width), 0, image.width);
+		int sy0 = clampInt(roundToInt(t0 * image.height), 0, image.height);
+		int sy1 = clampInt(roundToInt(t1 * image.height), 0, image.height);
+		if (dx0 >= dx1 || dy0 >= dy1 || sx0 >= sx1 || sy0 >= sy1)
+			continue;
+
+		int destWidth = dx1 - dx0, srcWidth = sx1 - sx0;
+		for (int y = dy0; y < dy1; y++) {
+			int row = sy0 + (int)((y - dy0 + 0.5f) * (sy1 - sy0) / (dy1 - dy0));
+			if (mirrorY)
+				row = sy1 - 1 - (row - sy0);
+			const char *src = GetLine(row, image, bpp);
+			// The BMP is stored bottom-up
+			char *target = GetLine(height - 1 - y, fullImage) + dx0 * 4;
+			if (!mirrorX && srcWidth == destWidth) {
+				convert(src + sx0 * bpp, target, destWidth);
+				continue;
+			}
+			for (int x = 0; x < destWidth; x++) {
+				int col = sx0 + (int)((x + 0.5f) * srcWidth / destWidth);
+				if (mirrorX)
+					col = sx1 - 1 - (col - sx0);
+				convert(src + col * bpp, target + x * 4, 1);
+			}
 		}
-		
-		// Top half of course
-		
-		target = GetLine(479-i, fullImage);
-		
-		memcpy(target, GetLine(i, bits[0]), tWidth);
-		target += bits[0]->_width * bpp;
-		
-		memcpy(target, GetLine(i, bits[1]), tWidth);
-		target += bits[1]->_width * bpp;
-		
-		memcpy(target,GetLine(i, bits[2]), 128 * bpp);
-		target += bpp * bits[2]->_width / 2;
-		
 	}
-	fullImage->BGR2RGB();
 	
 	return fullImage;
 }
 
-void ProcessFile(const char *_data, uint32_t size, std::string name){
-	std::stringstream til;
-	uint32_t outsize = 0, bpp = 4;
-	Bytef *data = decompress((Bytef *)_data, size, outsize);
+void ProcessFile(const char *_data, uint32_t size, std::string name, bool dds, DDSFormat format, bool mips){
+	uint32_t outsize = 0;
+	Bytef *data;
+	{
+		Common::StatsPhase phase(Common::kStatsDecode);
+		data = decompress((Bytef *)_data, size, outsize);
+	}
 	if(!data)
 		return;
-	til.write((const char *)data, outsize);
-	delete[] data;
-	uint32_t id, bmoffset, rects, b, c, numImages;
-
-	til.read((char *)&id, 4);
-	id = FROM_LE_32(id);
-	til.read((char *)&bmoffset, 4);
-	bmoffset = FROM_LE_32(bmoffset);
-	til.read((char *)&rects, 4);
-	rects = FROM_LE_32(rects);
-	til.read((char *)&b, 4);
-	b = FROM_LE_32(b);
-	til.read((char *)&c, 4);
-	c = FROM_LE_32(c);
-
-// We want to actually read numImages and bpp
-	til.seekg(bmoffset + 16,std::ios::beg);
-	til.read((char*)&numImages, 4);
-	numImages = FROM_LE_32(numImages);
+	// The headers are read in place
+	const char *til = (const char *)data;
 
-	if(numImages < 5){
-		printf("This tile has less than 5 tiles, I don't know how to parse it\n");
+	uint32_t bmoffset = outsize >= 20 ? READ_LE_UINT32(til + 4) : 0;
+	if (outsize < 20 || bmoffset > outsize || outsize - bmoffset < 128) {
+		printf("Truncated tile\n");
+		delete[] data;
+		return;
 	}
 
-	til.seekg(16,std::ios::cur);
-	til.read((char*) &bpp, 4);
-	bpp = FROM_LE_32(bpp);
-	bpp = bpp / 8;
-
+// We want to actually read numImages and bpp
+	uint32_t numImages = READ_LE_UINT32(til + bmoffset + 16);
+	uint32_t bpp = READ_LE_UINT32(til + bmoffset + 36) / 8;
 	printf("Detected %d bpp\n",bpp*8);
+	if (bpp != 2 && bpp != 4) {
+		printf("Unsupported bpp\n");
+		delete[] data;
+		return;
+	}
 
-	til.seekg(bmoffset + 128, std::ios::beg);
+	std::vector<TileImage> images;
+	uint32_t pos = bmoffset + 128;
+	for (uint32_t i = 0; i < numImages; ++i) {
+		TileImage image;
+		if (outsize - pos < 8) {
+			printf("Truncated tile\n");
+			delete[] data;
+			return;
+		}
+		image.width = READ_LE_UINT32(til + pos);
+		image.height = READ_LE_UINT32(til + pos + 4);
+		pos += 8;
+		uint64_t dataSize = (uint64_t)image.width * image.height * bpp;
+		if (outsize - pos < dataSize) {
+			printf("Truncated tile\n");
+			delete[] data;
+			return;
+		}
+		image.data = til + pos;
+		pos += (uint32_t)dataSize;
+		images.push_back(image);
+	}
 
-	uint32_t width = 0, height = 0;
-	
-	LucasBitMap **allTheData = new LucasBitMap*[5];
-	
-	for (uint32_t i = 0; i < 5; ++i) {
-		til.read((char *)&width, 4);
-		width = FROM_LE_32(width);
-		til.read((char *)&height, 4);
-		height = FROM_LE_32(height);
-		uint32_t dataSize = width*height*bpp;
-		char *imageData = new char[dataSize];
-		char *outnamet = new char[64];
-		sprintf(outnamet,"%d.bmp",i);
-		til.read(imageData, dataSize);
-		
-		allTheData[i] = new LucasBitMap(imageData, width, height,bpp,false);
+	// The header counts the quad corners, the layers and the quads. Their
+	// tables follow 16 bytes after it, which the engine skips.
+	uint32_t numCoords = READ_LE_UINT32(til + 8);
+	uint32_t numLayers = READ_LE_UINT32(til + 12);
+	uint32_t numQuads = READ_LE_UINT32(til + 16);
+	std::vector<TileVertex> verts;
+	std::vector<TileQuad> quads;
+	uint64_t tableEnd = 36 + (uint64_t)numCoords * 16 + (uint64_t)numLayers * 8 + (uint64_t)numQuads * 12;
+	if (numQuads && tableEnd <= bmoffset) {
+		const char *coords = til + 36;
+		verts.resize(numCoords);
+		if (numCoords)
+			READ_LE_ARRAY_FLOAT(&verts[0].x, coords, numCoords * 4);
+		const char *layers = coords + numCoords * 16;
+		const char *table = layers + numLayers * 8;
+		std::vector<TileQuad> all;
+		std::vector<bool> valid;
+		for (uint32_t i = 0; i < numQuads; i++) {
+			TileQuad quad;
+			quad.image = READ_LE_UINT32(table + i * 12);
+			quad.first = READ_LE_UINT32(table + i * 12 + 4);
+			quad.count = READ_LE_UINT32(table + i * 12 + 8);
+			bool ok = quad.image < numImages && quad.count >= 3 && quad.first <= numCoords && numCoords - quad.first >= quad.count;
+			if (!ok)
+				printf("Skipping bad quad %d\n", i);
+			all.push_back(quad);
+			valid.push_back(ok);
+		}
+		// Each layer is a run of quads, drawn like the engine does: the last
+		// layer first, as it is the farthest back
+		for (uint32_t l = numLayers; l-- > 0; ) {
+			uint32_t offset = READ_LE_UINT32(layers + l * 8);
+			uint32_t count = READ_LE_UINT32(layers + l * 8 + 4);
+			if (offset > numQuads || numQuads - offset < count) {
+				printf("Skipping bad layer %d\n", l);
+				continue;
+			}
+			for (uint32_t i = offset; i < offset + count; i++)
+				if (valid[i])
+					quads.push_back(all[i]);
+		}
+	} else if (numImages >= 5) {
+		for (uint32_t i = 0; i < 5; ++i) {
+			if (images[i].width != 256 || images[i].height < 256) {
+				printf("Sub-image %d is %dx%d, only 256x256 is supported without a tile table\n", i, images[i].width, images[i].height);
+				delete[] data;
+				return;
+			}
+		}
+		makeDefaultLayout(&images[0], verts, quads);
 	}
-	LucasBitMap* bit = MakeFullPicture(allTheData);
-	bit->WriteBMP(name.c_str());
-	
-	for (uint32_t i = 0; i < 5; ++i) {
-		delete allTheData[i];
+	if (quads.empty()) {
+		printf("This tile has less than 5 tiles and no tile table, I don't know how to parse it\n");
+		delete[] data;
+		return;
 	}
 
+	LucasBitMap* bit;
+	{
+		Common::StatsPhase phase(Common::kStatsConvert);
+		bit = MakeFullPicture(&images[0], verts, quads, bpp);
+	}
+	{
+		Common::StatsPhase phase(Common::kStatsWrite);
+		if (bit && dds)
+			bit->WriteDDS(name.c_str(), format, mips);
+		else if (bit)
+			bit->WriteBMP(name.c_str());
+	}
+	if (bit)
+		Common::addStatsFiles();
+
 	delete bit;
-	delete[] allTheData;
+	delete[] data;
 }
 
 
+// Inflates a gzip stream into a buffer sized from its ISIZE trailer,
+// growing it if the trailer turns out to be wrong.
 Bytef *decompress(Bytef *in, int size, uint32_t &outsize){
-	const uint32_t block = 8 * 1024 * 1024;
-	Bytef *dest = new Bytef[block]; // 8 MiB ought to be enough.
+	outsize = 0;
+	// ISIZE is the size modulo 4 GiB, deflate can't compress more than 1032:1
+	uint32_t block = 0;
+	if (size >= 18 && in[0] == 0x1F && in[1] == 0x8B)
+		block = READ_LE_UINT32(in + size - 4);
+	if (block == 0 || block / 1032 > (uint32_t)size)
+		block = size * 4 + 1024;
 	
 	int success = 0;
 	z_stream_s zStream;
@@ -320,54 +521,103 @@ Bytef *decompress(Bytef *in, int size, uint32_t &outsize){
 		std::cout << "ZLIB failed to initialize\n";
 		return 0;
 	}
+	// One spare byte, so a correct trailer finishes in the first call
+	Bytef *dest = new Bytef[block + 1];
+	uint32_t capacity = block + 1;
 	zStream.avail_in = size;
 	zStream.next_in = in;
-	zStream.avail_out = block;
+	zStream.avail_out = capacity;
 	zStream.next_out = dest;
 	
-	success = inflate(&zStream, Z_NO_FLUSH);
+	for (;;) {
+		success = inflate(&zStream, Z_NO_FLUSH);
+		if (success != Z_OK || zStream.avail_out != 0)
+			break;
+		// Out of room, double the buffer and carry on
+		uint32_t grown = capacity * 2;
+		Bytef *newDest = new Bytef[grown];
+		memcpy(newDest, dest, capacity);
+		delete[] dest;
+		dest = newDest;
+		zStream.next_out = dest + capacity;
+		zStream.avail_out = grown - capacity;
+		capacity = grown;
+	}
 	
 	outsize = zStream.total_out;
+	inflateEnd(&zStream);
 	
 	if(success != Z_STREAM_END) {
-		std::cout << "ERROR: decompressed size bigger than 8 MiB\n";
+		std::cout << "ERROR: decompression failed: " << (zStream.msg ? zStream.msg : "truncated stream") << "\n";
+		delete[] dest;
+		outsize = 0;
 		return 0;
 	}
 	return dest;
 }
 
+static void usage() {
+	std::cout << "Usage: til2bmp [-d [-a] [-m]] [labfilename] <filename>" << std::endl;
+	std::cout << "\t-d\tWrite a BC1 (DXT1) compressed DDS texture instead of a BMP" << std::endl;
+	std::cout << "\t-a\tKeep the alpha channel, as BC3 (DXT5)" << std::endl;
+	std::cout << "\t-m\tAdd every mipmap level to the texture" << std::endl;
+}
+
 int main(int argc, char **argv){
+	bool dds = false, mips = false;
+	DDSFormat format = kDDSBC1;
+	int c;
+	Common::initStats("til2bmp", argc, argv);
+	while ((c = getopt(argc, argv, "damh")) != -1) {
+		switch (c) {
+		case 'd':
+			dds = true;
+			break;
+		case 'a':
+			format = kDDSBC3;
+			break;
+		case 'm':
+			mips = true;
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 2) {
 		std::cout << "No Argument" << std::endl;
-		std::cout << "Usage: til2bmp [labfilename] <filename>" << std::endl;
+		usage();
 		return 0;
 	}
 	
 	Lab *lab = NULL;
 	std::string filename;
-	int length = 0;
 	
 	if (argc > 2) {
-		lab = new Lab(argv[1]);
+		lab = new Lab(argv[1], false, true);
 		filename = argv[2];
 	} else {
 		filename = argv[1];
 	}
 	
-	std::istream *file = getFile(filename, lab, length);
+	AssetLoader loader(lab);
+	const Asset *asset = loader.load(filename);
 	
-	if (!file) {
+	if (!asset) {
 		std::cout << "Could not open file" << std::endl;
 		return 0;
 	}
+	const char *data = asset->data;
+	uint32 length = asset->size;
 	
 	std::string outname = filename;
-	outname += ".bmp";
+	outname += dds ? ".dds" : ".bmp";
 	
-	char *data = new char[length];
-	file->read(data, length);
-	delete file;
-	ProcessFile(data, length, outname);
+	ProcessFile(data, length, outname, dds, format, mips);
 	
-	delete[] data;
+	loader.release(asset);
+	delete lab;
 }
@@ -22,6 +22,8 @@
 
 #include <cstdio>
 #include <cstring>
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 int get_be_uint32(char *pos) {
 	unsigned char *ucpos = reinterpret_cast<unsigned char *>(pos);
@@ -40,7 +42,9 @@ void write_le_uint16(unsigned short val) {
 	putc(val >> 8, stdout);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+	Common::initStats("imc2wav", argc, argv);
+	Common::StatsPhase phase(Common::kStatsConvert);
 	char block[1024];
 	fread(block, 8, 1, stdin);	// skip iMUS header
 	fread(block, 8, 1, stdin);	// read MAP header
@@ -72,6 +76,8 @@ int main() {
 	write_le_uint16(numBits);
 	fputs("data", stdout);
 	write_le_uint32(dataSize);
+	Common::addStatsRead(dataSize);
+	Common::addStatsWritten(44 + dataSize);
 	while (dataSize > 1024) {
 		fread(block, 1024, 1, stdin);
 		fwrite(block, 1024, 1, stdout);
@@ -79,5 +85,6 @@ int main() {
 	}
 	fread(block, dataSize, 1, stdin);
 	fwrite(block, dataSize, 1, stdout);
+	Common::addStatsFiles();
 	return 0;
 }
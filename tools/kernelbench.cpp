@@ -0,0 +1,934 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+// Times the hot kernels of the tools on a corpus of game files: labs and
+// the bitmaps, scripts and other entries in them, MCMP audio and any other
+// files as plain data. What the corpus lacks is made up, so every kernel
+// runs without one. Each kernel reports MB/s and ns/op; a previous run
+// saved with -o can be given with -b, and kernels slower than it by more
+// than the threshold make the run fail. "make bench" runs it.
+
+#include <tools/lua/lua.h>
+#include <tools/lua/lualib.h>
+#include <tools/lua/lvm.h>
+#include <tools/lua/lstate.h>
+#include <tools/lua/lparser.h>
+#include <tools/lua/lundump.h>
+#include <tools/lua/lzio.h>
+#include <tools/luac/luac.h>
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#ifdef POSIX
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#include "tools/lab.h"
+#include "common/zlib.h"
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "tools/codec3.h"
+#include "tools/mcmp.h"
+#include "tools/suffixsort.h"
+#include "tools/patchex/mszip.h"
+
+extern void DumpChunk(TProtoFunc *Main, DumpBuffer *D, int fused);
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
+
+// Plain data beyond this is left out, the suffix sorts take a part of it
+#define MAX_DATA (16 * 1024 * 1024)
+#define MAX_SORT (4 * 1024 * 1024)
+
+static double now() {
+#ifdef POSIX
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+struct Codec3Stream {
+	std::string data;
+	uint32 decodedSize;
+};
+
+struct VimaBlock {
+	std::string data;
+	uint32 decodedSize;
+};
+
+/**
+ * The inputs of the kernels, from the corpus and made up where it has
+ * none of a kind.
+ */
+struct Corpus {
+	std::string data;	// Every file and lab entry back to back, up to MAX_DATA
+	std::vector<Codec3Stream> codec3;
+	std::vector<VimaBlock> vima;
+	std::vector<std::string> scripts;	// Precompiled Lua chunks
+	std::vector<std::string> labs;
+	std::vector<std::string> mszip;		// Deflated data split in MSZIP frames
+	std::vector<uint32> mszipSizes;
+	std::vector<std::string> gzip;
+	std::vector<uint32> gzipSizes;
+};
+
+// The compressed images of a codec 3 bitmap
+static void addBitmap(Corpus &corpus, const char *data, uint32 size) {
+	if (size < 0x88 || memcmp(data, "BM  F\0\0\0", 8) != 0 || READ_LE_UINT32(data + 8) != 3)
+		return;
+	uint32 numImages = READ_LE_UINT32(data + 16);
+	uint32 imageSize = READ_LE_UINT32(data + 36) / 8 * READ_LE_UINT32(data + 128) * READ_LE_UINT32(data + 132);
+	uint32 pos = 0x88;
+	for (uint32 i = 0; i < numImages && pos + 4 <= size; i++) {
+		uint32 len = READ_LE_UINT32(data + pos);
+		if (len > size - pos - 4)
+			break;
+		Codec3Stream s;
+		s.data.assign(data + pos + 4, len);
+		s.decodedSize = imageSize;
+		corpus.codec3.push_back(s);
+		pos += len + 12;
+	}
+}
+
+static void addData(Corpus &corpus, const char *name, const char *data, uint32 size) {
+	if (Common::matchPattern("*.bm", name) || Common::matchPattern("*.zbm", name))
+		addBitmap(corpus, data, size);
+	else if (Common::matchPattern("*.lua", name) && size > 0 && data[0] == ID_CHUNK)
+		corpus.scripts.push_back(std::string(data, size));
+	if (corpus.data.size() < MAX_DATA)
+		corpus.data.append(data, MIN(size, (uint32)(MAX_DATA - corpus.data.size())));
+}
+
+// The VIMA blocks of an MCMP file
+static void addMcmp(Corpus &corpus, const char *filename) {
+	McmpStream stream;
+	if (!stream.open(filename) || stream.getNumBlocks() == 0)
+		return;
+	std::vector<byte> compressed(stream.getCompressedSize() + 1);
+	if (!stream.readCompressed(&compressed[0]))
+		return;
+	uint32 base = stream.getBlock(0).fileOffset;
+	for (int i = 0; i < stream.getNumBlocks(); i++) {
+		const McmpBlock &block = stream.getBlock(i);
+		if (block.codec != MCMP_CODEC_VIMA)
+			continue;
+		VimaBlock b;
+		b.data.assign((const char *)&compressed[block.fileOffset - base], block.compSize);
+		b.decodedSize = block.uncompSize;
+		corpus.vima.push_back(b);
+	}
+}
+
+static bool readWholeFile(const char *filename, std::string &contents) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	char buf[65536];
+	size_t count;
+	while ((count = fread(buf, 1, sizeof(buf), f)) > 0)
+		contents.append(buf, count);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+static void addFile(Corpus &corpus, const std::string &filename) {
+#ifdef POSIX
+	struct stat st;
+	if (stat(filename.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(filename.c_str());
+		if (!dir)
+			return;
+		struct dirent *d;
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] != '.')
+				addFile(corpus, filename + "/" + d->d_name);
+		}
+		closedir(dir);
+		return;
+	}
+#endif
+	const char *name = filename.c_str();
+	if (Common::matchPattern("*.lab", name)) {
+		corpus.labs.push_back(filename);
+		Lab lab(filename, false, true);
+		for (uint32 i = 0; i < lab.getNumEntries(); i++) {
+			uint32 size;
+			const char *data = lab.getEntryData(i, size);
+			if (data)
+				addData(corpus, lab.getEntryName(i), data, size);
+		}
+	} else if (Common::matchPattern("*.imc", name) || Common::matchPattern("*.IMC", name)) {
+		addMcmp(corpus, name);
+	} else {
+		std::string contents;
+		if (readWholeFile(name, contents))
+			addData(corpus, name, contents.data(), contents.size());
+		else
+			perror(name);
+	}
+}
+
+// A repeatable stream of pseudo random numbers for the made up inputs
+static uint32 nextRandom(uint32 &seed) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/**
+ * Stands in for game data: script-like text, records of little endian
+ * numbers and runs of repeated bytes, as are found in the labs.
+ */
+static void makeData(std::string &data, uint32 size) {
+	static const char *const words[] = {
+		"function", "local", "manny", "glottis", "if", "then", "end", "return", "nil",
+		"start_script", "set_pos", "actor", "while", "do", "wait_for_message", "="
+	};
+	uint32 seed = 1;
+	while (data.size() < size) {
+		uint32 kind = nextRandom(seed) % 3;
+		if (kind == 0) {
+			for (int i = 0; i < 64; i++) {
+				data += words[nextRandom(seed) % 16];
+				data += (i % 8 == 7) ? '\n' : ' ';
+			}
+		} else if (kind == 1) {
+			for (int i = 0; i < 64; i++) {
+				uint32 value = nextRandom(seed) % 1024;
+				data.append((const char *)&value, 4);
+			}
+		} else {
+			data.append(16 + nextRandom(seed) % 256, (char)nextRandom(seed));
+		}
+	}
+	data.resize(size);
+}
+
+/**
+ * A codec 3 encoder with a single candidate per position, only good enough
+ * to give the decoder a realistic mix of literals, short matches and long
+ * ones. Control bits are packed in 16-bit words placed where the decoder
+ * reads them: right after the last bit of the previous word is used.
+ */
+class Codec3Encoder {
+	std::string &_out;
+	size_t _wordPos;
+	uint32 _word;
+	int _bits;
+
+	void putBit(int bit) {
+		_word |= bit << _bits;
+		if (++_bits == 16) {
+			flushWord();
+			_wordPos = _out.size();
+			_out.append(2, '\0');
+		}
+	}
+
+	void flushWord() {
+		_out[_wordPos] = (char)(_word & 0xff);
+		_out[_wordPos + 1] = (char)(_word >> 8);
+		_word = 0;
+		_bits = 0;
+	}
+
+	void putLong(uint32 dist, uint32 len) {
+		uint32 value = 0x1000 - dist;
+		putBit(0);
+		putBit(1);
+		_out += (char)(value & 0xff);
+		if (len >= 4 && len <= 18) {
+			_out += (char)(((value >> 4) & 0xf0) | (len - 3));
+		} else {
+			_out += (char)((value >> 4) & 0xf0);
+			_out += (char)(len - 1);
+		}
+	}
+
+public:
+	Codec3Encoder(std::string &out) : _out(out), _wordPos(out.size()), _word(0), _bits(0) {
+		_out.append(2, '\0');
+	}
+
+	void encode(const uint8 *data, uint32 size) {
+		std::vector<int32> head(4096, -1);
+		uint32 i = 0;
+		while (i < size) {
+			uint32 len = 0, dist = 0;
+			if (i + 3 <= size) {
+				uint32 h = ((data[i] << 8) ^ (data[i + 1] << 4) ^ data[i + 2]) & 4095;
+				int32 candidate = head[h];
+				head[h] = i;
+				if (candidate >= 0 && i - candidate <= 4096) {
+					while (len < 256 && i + len < size && data[candidate + len] == data[i + len])
+						len++;
+					dist = i - candidate;
+				}
+			}
+			if (len >= 3 && len <= 6 && dist <= 256) {
+				putBit(0);
+				putBit(0);
+				putBit((len - 3) >> 1);
+				putBit((len - 3) & 1);
+				_out += (char)(0x100 - dist);
+			} else if (len >= 3) {
+				putLong(dist, len);
+			} else {
+				len = 1;
+				putBit(1);
+				_out += (char)data[i];
+			}
+			i += len;
+		}
+		// A long match of length 1 ends the stream
+		putBit(0);
+		putBit(1);
+		_out.append(3, '\0');
+		flushWord();
+	}
+};
+
+// An image like the backgrounds, smooth 16-bit gradients with some noise
+static void makeBitmaps(Corpus &corpus) {
+	const uint32 width = 640, height = 480;
+	std::vector<uint8> image(width * height * 2);
+	uint32 seed = 7;
+	for (uint32 y = 0; y < height; y++) {
+		for (uint32 x = 0; x < width; x++) {
+			uint32 r = (x * 31 / width + (nextRandom(seed) % 4 == 0)) & 31;
+			uint32 g = (y * 63 / height) & 63;
+			uint32 b = ((x + y) / 40) & 31;
+			uint16 pixel = (r << 11) | (g << 5) | b;
+			image[(y * width + x) * 2] = pixel & 0xff;
+			image[(y * width + x) * 2 + 1] = pixel >> 8;
+		}
+	}
+	Codec3Stream s;
+	Codec3Encoder(s.data).encode(&image[0], image.size());
+	s.decodedSize = image.size();
+
+	// The decoder is the reference, an image it reads back differently
+	// would time something else
+	std::vector<char> check(s.decodedSize);
+	if (decompress_codec3(s.data.data(), s.data.size(), &check[0], s.decodedSize) &&
+	        memcmp(&check[0], &image[0], s.decodedSize) == 0)
+		corpus.codec3.push_back(s);
+	else
+		fprintf(stderr, "The made up codec 3 image does not decode, codec3 is skipped\n");
+}
+
+// VIMA decodes any bits, so random blocks the size of MCMP ones will do
+static void makeVima(Corpus &corpus) {
+	uint32 seed = 3;
+	for (int i = 0; i < 64; i++) {
+		VimaBlock b;
+		for (int j = 0; j < 0x1000; j++)
+			b.data += (char)nextRandom(seed);
+		b.data[0] = (char)(nextRandom(seed) % 89);
+		b.decodedSize = 0x2000;
+		corpus.vima.push_back(b);
+	}
+}
+
+// Deflates data the way cabinets store it: frames of up to 32 KB, each
+// starting with "CK" and ending the deflate stream
+static bool makeMszip(const std::string &data, std::string &out) {
+	for (size_t pos = 0; pos < data.size(); pos += MSZIP_FRAME_SIZE) {
+		uint32 len = MIN((size_t)MSZIP_FRAME_SIZE, data.size() - pos);
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		std::vector<Bytef> frame(deflateBound(&z, len));
+		z.next_in = (Bytef *)const_cast<char *>(data.data() + pos);
+		z.avail_in = len;
+		z.next_out = &frame[0];
+		z.avail_out = frame.size();
+		int result = deflate(&z, Z_FINISH);
+		uint32 size = frame.size() - z.avail_out;
+		deflateEnd(&z);
+		if (result != Z_STREAM_END)
+			return false;
+		out += "CK";
+		out.append((const char *)&frame[0], size);
+	}
+	// The decoder reads a little ahead of the last frame
+	out.append(8, '\0');
+	return true;
+}
+
+static bool makeGzip(const std::string &data, std::string &out) {
+	uLongf size = compressBound(data.size());
+	std::vector<Bytef> buf(size);
+	if (compress2(&buf[0], &size, (const Bytef *)data.data(), data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+		return false;
+	out.assign((const char *)&buf[0], size);
+	return true;
+}
+
+// The Lua VM workload, and the script precompiled when the corpus has none
+static const char *script =
+	"function add(a, b)\n"
+	"  return a + b\n"
+	"end\n"
+	"function bench_vm(n)\n"
+	"  local actor = { x = 0, y = 0, name = \"manny\" }\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    actor.x = add(actor.x, 1)\n"
+	"    if actor.x > 100 then actor.x = 0; actor.y = actor.y + 1 end\n"
+	"    local s = actor.name\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"  return actor.y\n"
+	"end\n";
+
+// luaY_parser and luaU_undump1 raise Lua errors, which return here
+static TProtoFunc *protectedLoad(ZIO *z, bool bin) {
+	jmp_buf errorJmp;
+	jmp_buf *oldErr = lua_state->errorJmp;
+	TProtoFunc *volatile tf = NULL;
+	lua_state->errorJmp = &errorJmp;
+	if (setjmp(errorJmp) == 0)
+		tf = bin ? luaU_undump1(z) : luaY_parser(z);
+	lua_state->errorJmp = oldErr;
+	return tf;
+}
+
+static void makeScripts(Corpus &corpus) {
+	ZIO z;
+	luaZ_mopen(&z, script, strlen(script), "bench");
+	TProtoFunc *tf = protectedLoad(&z, false);
+	if (!tf)
+		return;
+	DumpBuffer d;
+	d.b = NULL;
+	d.n = d.size = 0;
+	DumpChunk(tf, &d, 0);
+	corpus.scripts.push_back(std::string((const char *)d.b, d.n));
+	free(d.b);
+}
+
+#ifdef POSIX
+// A lab of made up names, written next to the other temporary files
+static bool makeLab(Corpus &corpus) {
+	const char *dir = getenv("TMPDIR");
+	std::string name = std::string(dir ? dir : "/tmp") + "/kernelbenchXXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	int fd = mkstemp(&path[0]);
+	if (fd < 0)
+		return false;
+	const uint32 numEntries = 4096;
+	std::string names;
+	std::string table;
+	for (uint32 i = 0; i < numEntries; i++) {
+		char entry[64];
+		sprintf(entry, "%s_%u.%s", (i & 1) ? "actor" : "set", i * 2654435761u >> 16, (i % 3) ? "lua" : "bm");
+		uint32 fields[4] = { TO_LE_32((uint32)names.size()), TO_LE_32(0), TO_LE_32(0), 0 };
+		table.append((const char *)fields, 16);
+		names.append(entry, strlen(entry) + 1);
+	}
+	uint32 header[4] = { 0, TO_LE_32(0x10000), TO_LE_32(numEntries), TO_LE_32((uint32)names.size()) };
+	memcpy(header, "LABN", 4);
+	std::string file((const char *)header, 16);
+	file += table + names;
+	bool ok = write(fd, file.data(), file.size()) == (ssize_t)file.size();
+	close(fd);
+	if (ok)
+		corpus.labs.push_back(&path[0]);
+	else
+		unlink(&path[0]);
+	return ok;
+}
+#endif
+
+// Bytes and operations of one round of a kernel
+struct Round {
+	double bytes;
+	double ops;
+};
+
+struct Kernel;
+typedef bool (*PrepareFunc)(Corpus &corpus, Kernel &kernel);
+typedef Round (*RunFunc)(Corpus &corpus, Kernel &kernel);
+
+struct Kernel {
+	const char *name;
+	const char *op;		// What one operation is
+	PrepareFunc prepare;
+	RunFunc run;
+	// Work state of the kernel between rounds
+	std::vector<char> out;
+	std::vector<int32> I, V;
+	std::vector<std::string> names;
+	Lab *lab;
+};
+
+static bool prepareCodec3(Corpus &corpus, Kernel &k) {
+	if (corpus.codec3.empty())
+		makeBitmaps(corpus);
+	uint32 largest = 0;
+	for (size_t i = 0; i < corpus.codec3.size(); i++)
+		largest = MAX(largest, corpus.codec3[i].decodedSize);
+	k.out.resize(largest + 1);
+	return !corpus.codec3.empty();
+}
+
+static Round runCodec3(Corpus &corpus, Kernel &k) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < corpus.codec3.size(); i++) {
+		const Codec3Stream &s = corpus.codec3[i];
+		decompress_codec3(s.data.data(), s.data.size(), &k.out[0], s.decodedSize);
+		r.bytes += s.decodedSize;
+		r.ops++;
+	}
+	return r;
+}
+
+static bool prepareVima(Corpus &corpus, Kernel &k) {
+	vimaInit();
+	if (corpus.vima.empty())
+		makeVima(corpus);
+	uint32 largest = 0;
+	for (size_t i = 0; i < corpus.vima.size(); i++)
+		largest = MAX(largest, corpus.vima[i].decodedSize);
+	k.out.resize(largest + 2);
+	return true;
+}
+
+static Round runVima(Corpus &corpus, Kernel &k) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < corpus.vima.size(); i++) {
+		const VimaBlock &b = corpus.vima[i];
+		decompressVima((const byte *)b.data.data(), b.data.size(), (int16 *)&k.out[0], b.decodedSize);
+		r.bytes += b.decodedSize;
+		r.ops++;
+	}
+	return r;
+}
+
+// Plain data, the corpus' own or made up
+static const std::string &plainData(Corpus &corpus) {
+	if (corpus.data.empty())
+		makeData(corpus.data, MAX_SORT);
+	return corpus.data;
+}
+
+/**
+ * mspack I/O on memory: reads come from the compressed frames, writes go
+ * to the output buffer of the kernel.
+ */
+struct MemoryFile {
+	mspack_file file;
+	const char *data;
+	uint32 size, pos;
+};
+
+static int memoryRead(mspack_file *file, void *buffer, int bytes) {
+	MemoryFile *f = (MemoryFile *)file;
+	uint32 count = MIN((uint32)bytes, f->size - f->pos);
+	memcpy(buffer, f->data + f->pos, count);
+	f->pos += count;
+	return count;
+}
+
+static int memoryWrite(mspack_file *file, void *buffer, int bytes) {
+	MemoryFile *f = (MemoryFile *)file;
+	uint32 count = MIN((uint32)bytes, f->size - f->pos);
+	memcpy(const_cast<char *>(f->data) + f->pos, buffer, count);
+	f->pos += count;
+	return count;
+}
+
+static mspack_system memorySystem = { NULL, NULL, &memoryRead, &memoryWrite, NULL, NULL, NULL };
+
+// The data in pieces of a megabyte, as the streams of cabinets and patches
+static void splitData(const std::string &data, std::vector<std::string> &pieces) {
+	for (size_t pos = 0; pos < data.size(); pos += 1024 * 1024)
+		pieces.push_back(data.substr(pos, 1024 * 1024));
+}
+
+static bool prepareMszip(Corpus &corpus, Kernel &k) {
+	std::vector<std::string> pieces;
+	splitData(plainData(corpus), pieces);
+	for (size_t i = 0; i < pieces.size(); i++) {
+		std::string frames;
+		if (!makeMszip(pieces[i], frames))
+			return false;
+		corpus.mszip.push_back(frames);
+		corpus.mszipSizes.push_back(pieces[i].size());
+	}
+	k.out.resize(1024 * 1024);
+	return true;
+}
+
+static Round runMszip(Corpus &corpus, Kernel &k) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < corpus.mszip.size(); i++) {
+		MemoryFile in = { { 0 }, corpus.mszip[i].data(), (uint32)corpus.mszip[i].size(), 0 };
+		MemoryFile out = { { 0 }, &k.out[0], (uint32)k.out.size(), 0 };
+		mszipd_stream *zip = mszipd_init(&memorySystem, &in.file, &out.file, 4096, 0);
+		if (!zip)
+			continue;
+		if (mszipd_decompress(zip, corpus.mszipSizes[i]) == MSPACK_ERR_OK)
+			r.bytes += corpus.mszipSizes[i];
+		mszipd_free(zip);
+		r.ops++;
+	}
+	return r;
+}
+
+static bool prepareGzip(Corpus &corpus, Kernel &k) {
+	std::vector<std::string> pieces;
+	splitData(plainData(corpus), pieces);
+	for (size_t i = 0; i < pieces.size(); i++) {
+		std::string stream;
+		if (!makeGzip(pieces[i], stream))
+			return false;
+		corpus.gzip.push_back(stream);
+		corpus.gzipSizes.push_back(pieces[i].size());
+	}
+	k.out.resize(65536);
+	return true;
+}
+
+// In 64 KB reads, as the lab and patch readers do
+static Round runGzip(Corpus &corpus, Kernel &k) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < corpus.gzip.size(); i++) {
+		GZipReadStream stream((const byte *)corpus.gzip[i].data(), corpus.gzip[i].size());
+		for (;;) {
+			uint32 count = stream.read(&k.out[0], k.out.size());
+			r.ops++;
+			r.bytes += count;
+			if (count < k.out.size() || stream.err())
+				break;
+		}
+	}
+	return r;
+}
+
+static uint32 sortSize(Corpus &corpus) {
+	return MIN((uint32)plainData(corpus).size(), (uint32)MAX_SORT);
+}
+
+static bool prepareQsufsort(Corpus &corpus, Kernel &k) {
+	k.I.resize(sortSize(corpus) + 1);
+	k.V.resize(sortSize(corpus) + 1);
+	return true;
+}
+
+static Round runQsufsort(Corpus &corpus, Kernel &k) {
+	uint32 size = sortSize(corpus);
+	qsufsort(&k.I[0], &k.V[0], (byte *)const_cast<char *>(corpus.data.data()), size);
+	Round r = { (double)size, 1 };
+	return r;
+}
+
+static bool prepareSais(Corpus &corpus, Kernel &k) {
+	k.I.resize(sortSize(corpus) + 1);
+	return true;
+}
+
+static Round runSais(Corpus &corpus, Kernel &k) {
+	uint32 size = sortSize(corpus);
+	saissort(&k.I[0], (const byte *)corpus.data.data(), size);
+	Round r = { (double)size, 1 };
+	return r;
+}
+
+// A new version of the data, with a byte in every 64 changed, to be found
+// in the suffix array of the old one
+static bool prepareSearch(Corpus &corpus, Kernel &k) {
+	uint32 size = sortSize(corpus);
+	k.I.resize(size + 1);
+	saissort(&k.I[0], (const byte *)corpus.data.data(), size);
+	k.out.assign(corpus.data.begin(), corpus.data.begin() + size);
+	uint32 seed = 5;
+	for (uint32 i = 0; i + 64 <= size; i += 64)
+		k.out[i + nextRandom(seed) % 64] ^= 0x55;
+	return size > 0;
+}
+
+static Round runSearch(Corpus &corpus, Kernel &k) {
+	Round r = { 0, 0 };
+	byte *old = (byte *)const_cast<char *>(corpus.data.data());
+	int32 size = k.out.size();
+	for (int32 scan = 0; scan < size; scan += 61) {
+		int32 pos;
+		search(&k.I[0], old, size, (byte *)&k.out[scan], size - scan, &pos);
+		r.ops++;
+	}
+	return r;
+}
+
+// The names of the first lab, every other one changed so half are misses
+static bool prepareGetIndex(Corpus &corpus, Kernel &k) {
+#ifdef POSIX
+	if (corpus.labs.empty())
+		makeLab(corpus);
+#endif
+	if (corpus.labs.empty())
+		return false;
+	k.lab = new Lab(corpus.labs[0]);
+	for (uint32 i = 0; i < k.lab->getNumEntries(); i++) {
+		k.names.push_back(k.lab->getEntryName(i));
+		if (i & 1)
+			k.names.back() += "x";
+	}
+	return !k.names.empty();
+}
+
+static Round runGetIndex(Corpus &, Kernel &k) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < k.names.size(); i++) {
+		k.lab->getIndex(k.names[i]);
+		r.ops++;
+	}
+	return r;
+}
+
+static bool prepareUndump(Corpus &corpus, Kernel &) {
+	if (corpus.scripts.empty())
+		makeScripts(corpus);
+	// Only the chunks that load are timed
+	std::vector<std::string> valid;
+	for (size_t i = 0; i < corpus.scripts.size(); i++) {
+		ZIO z;
+		luaZ_mopen(&z, corpus.scripts[i].data(), corpus.scripts[i].size(), "bench");
+		if (protectedLoad(&z, true))
+			valid.push_back(corpus.scripts[i]);
+	}
+	lua_collectgarbage(0);
+	corpus.scripts.swap(valid);
+	return !corpus.scripts.empty();
+}
+
+static Round runUndump(Corpus &corpus, Kernel &) {
+	Round r = { 0, 0 };
+	for (size_t i = 0; i < corpus.scripts.size(); i++) {
+		ZIO z;
+		luaZ_mopen(&z, corpus.scripts[i].data(), corpus.scripts[i].size(), "bench");
+		protectedLoad(&z, true);
+		r.bytes += corpus.scripts[i].size();
+		r.ops++;
+	}
+	// The functions are garbage once loaded
+	lua_collectgarbage(0);
+	return r;
+}
+
+static bool prepareExecute(Corpus &, Kernel &) {
+	return lua_dostring(script) == 0;
+}
+
+// One operation is one opcode
+static Round runExecute(Corpus &, Kernel &) {
+	uint32 before = luaV_opcount;
+	lua_beginblock();
+	lua_pushnumber(10000);
+	lua_callfunction(lua_getglobal("bench_vm"));
+	lua_endblock();
+	Round r = { 0, (double)(uint32)(luaV_opcount - before) };
+	return r;
+}
+
+static Kernel kernels[] = {
+	{ "decompress_codec3", "image", prepareCodec3, runCodec3, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "decompressVima", "block", prepareVima, runVima, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "mszipd_inflate", "stream", prepareMszip, runMszip, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "GZipReadStream::read", "read", prepareGzip, runGzip, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "qsufsort", "sort", prepareQsufsort, runQsufsort, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "saissort", "sort", prepareSais, runSais, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "search", "search", prepareSearch, runSearch, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "Lab::getIndex", "lookup", prepareGetIndex, runGetIndex, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "luaU_undump1", "chunk", prepareUndump, runUndump, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL },
+	{ "luaV_execute", "opcode", prepareExecute, runExecute, std::vector<char>(), std::vector<int32>(), std::vector<int32>(), std::vector<std::string>(), NULL }
+};
+static const int numKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+struct Baseline {
+	std::string name;
+	double nsPerOp;
+};
+
+// Lines of kernel name and ns/op, as written by -o
+static bool readBaseline(const char *filename, std::vector<Baseline> &baseline) {
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return false;
+	char name[128];
+	double ns;
+	while (fscanf(f, "%127s %lf %*[^\n]", name, &ns) == 2) {
+		Baseline b;
+		b.name = name;
+		b.nsPerOp = ns;
+		baseline.push_back(b);
+	}
+	fclose(f);
+	return true;
+}
+
+static void usage() {
+	printf("Usage: kernelbench [-t seconds] [-k pattern] [-b baseline] [-r percent] [-o file] [corpus...]\n");
+	printf("Times the decoding, diffing, lookup and Lua kernels of the tools on the\n");
+	printf("corpus files and directories, making up the inputs it has none of. The\n");
+	printf("kernels are:\n");
+	for (int i = 0; i < numKernels; i++)
+		printf("\t%s\n", kernels[i].name);
+	printf("-t\tRun each kernel for at least this long (default 0.5 seconds)\n");
+	printf("-k\tOnly run the kernels matching pattern\n");
+	printf("-b\tFail if a kernel is slower than in the baseline file\n");
+	printf("-r\tHow much slower, in percent, counts as a regression (default 10)\n");
+	printf("-o\tWrite the results to file, for use as a baseline\n");
+}
+
+int main(int argc, char **argv) {
+	double duration = 0.5, threshold = 10;
+	const char *pattern = "*", *baselineFile = NULL, *outFile = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "t:k:b:r:o:h")) != -1) {
+		switch (c) {
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 'k':
+			pattern = optarg;
+			break;
+		case 'b':
+			baselineFile = optarg;
+			break;
+		case 'r':
+			threshold = atof(optarg);
+			break;
+		case 'o':
+			outFile = optarg;
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	if (duration <= 0 || threshold < 0) {
+		usage();
+		return 1;
+	}
+
+	std::vector<Baseline> baseline;
+	if (baselineFile && !readBaseline(baselineFile, baseline)) {
+		perror(baselineFile);
+		return 1;
+	}
+	FILE *out = NULL;
+	if (outFile && !(out = fopen(outFile, "w"))) {
+		perror(outFile);
+		return 1;
+	}
+
+	lua_open();
+	lua_strlibopen();
+	lua_mathlibopen();
+
+	Corpus corpus;
+	for (int i = optind; i < argc; i++)
+		addFile(corpus, argv[i]);
+	// The made up lab is only there for this run
+	size_t corpusLabs = corpus.labs.size();
+
+	int regressions = 0;
+	printf("%-22s %10s %12s %14s %8s\n", "kernel", "MB/s", "ns/op", "ops", "op");
+	for (int i = 0; i < numKernels; i++) {
+		Kernel &k = kernels[i];
+		if (!Common::matchPattern(pattern, k.name))
+			continue;
+		if (!k.prepare(corpus, k)) {
+			printf("%-22s %10s\n", k.name, "skipped");
+			continue;
+		}
+
+		// One round unmeasured to warm the caches and tables
+		k.run(corpus, k);
+		double bytes = 0, ops = 0, start = now(), elapsed = 0;
+		while (elapsed < duration) {
+			Round r = k.run(corpus, k);
+			bytes += r.bytes;
+			ops += r.ops;
+			elapsed = now() - start;
+		}
+		double nsPerOp = ops > 0 ? elapsed * 1e9 / ops : 0;
+		char rate[32] = "-";
+		if (bytes > 0)
+			sprintf(rate, "%.1f", bytes / elapsed / 1e6);
+		printf("%-22s %10s %12.1f %14.0f %8s", k.name, rate, nsPerOp, ops, k.op);
+		for (size_t b = 0; b < baseline.size(); b++) {
+			if (baseline[b].name != k.name || baseline[b].nsPerOp <= 0)
+				continue;
+			double change = (nsPerOp / baseline[b].nsPerOp - 1) * 100;
+			printf("  %+.1f%%", change);
+			if (change > threshold) {
+				printf(" REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+		if (out)
+			fprintf(out, "%s %.3f %s\n", k.name, nsPerOp, rate);
+
+		delete k.lab;
+		k.lab = NULL;
+		k.out.clear();
+		k.I.clear();
+		k.V.clear();
+		k.names.clear();
+	}
+
+#ifdef POSIX
+	for (size_t i = corpusLabs; i < corpus.labs.size(); i++)
+		unlink(corpus.labs[i].c_str());
+#else
+	(void)corpusLabs;
+#endif
+	lua_close();
+	if (out && fclose(out) != 0) {
+		perror(outFile);
+		return 1;
+	}
+	if (regressions) {
+		printf("%d kernel%s slower than the baseline by more than %.0f%%\n", regressions, regressions > 1 ? "s" : "", threshold);
+		return 1;
+	}
+	return 0;
+}
@@ -28,6 +28,15 @@
 #include <fstream>
 #include <string>
 #include "lab.h"
+#include "common/stream.h"
+#include "common/stats.h"
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // TODO: Use common/endian for this
 uint16 READ_LE_UINT16(const void *ptr) {
@@ -41,6 +50,7 @@ uint32 READ_LE_UINT32(const void *ptr) {
 }
 
 void Lab::Load(std::string filename) {
+	Common::StatsPhase phase(Common::kStatsIndex);
 	infile = fopen(filename.c_str(), "rb");
 	if (infile == 0) {
 		std::cout << "Can not open source file: " << filename << std::endl;
@@ -98,72 +108,204 @@ void Lab::Load(std::string filename) {
 				str_table[j] ^= 0x96;
 		fread(entries, 1, head.num_entries * sizeof(lab_entry), infile);
 	}
+	Common::addStatsRead(20 + head.num_entries * sizeof(lab_entry) + head.string_table_size);
+
+	buildIndex();
 }
 
-int Lab::getIndex(std::string filename) {
-	for (i = 0; i < head.num_entries; i++) {
-		const char *fname = str_table + READ_LE_UINT32(&entries[i].fname_offset);
-		std::string test = std::string(fname);
-		if (test != filename)
-			continue;
-		else
-		{
-			return i;
+Lab::~Lab() {
+#ifdef POSIX
+	if (_map)
+		munmap((void *)const_cast<char *>(_map), _mapSize);
+#endif
+	if (infile)
+		fclose(infile);
+	free(buf);
+	delete[] str_table;
+	delete[] entries;
+}
+
+void Lab::mapArchive() {
+#ifdef POSIX
+	struct stat st;
+	if (fstat(fileno(infile), &st) != 0 || st.st_size == 0)
+		return;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(infile), 0);
+	if (map == MAP_FAILED)
+		return;
+	_map = (const char *)map;
+	_mapSize = (uint32)st.st_size;
+#endif
+	// Without mmap we silently keep reading through infile
+}
+
+const char *Lab::getData(std::string filename, uint32 &size) {
+	int index = getIndex(filename);
+	if (index == -1)
+		return NULL;
+	return getEntryData(index, size);
+}
+
+const char *Lab::getEntryData(uint32 index, uint32 &size) {
+	if (index >= head.num_entries)
+		return NULL;
+
+	const char *filename = getEntryName(index);
+	uint32 start = READ_LE_UINT32(&entries[index].start);
+	size = READ_LE_UINT32(&entries[index].size);
+	if (_map) {
+		if (start > _mapSize || size > _mapSize - start) {
+			std::cout << "File " << filename << " past the end of lab " << _filename << std::endl;
+			return NULL;
+		}
+		Common::addStatsRead(size);
+		return _map + start;
+	}
+
+	Common::StatsPhase phase(Common::kStatsOpen);
+
+	if (bufSize < size) {
+		char *newBuf = (char *)realloc(buf, size);
+		if (!newBuf) {
+			printf("Could not reallocate memory\n");
+			exit(1);
 		}
+		buf = newBuf;
+		bufSize = size;
+	}
+	fseek(infile, start, SEEK_SET);
+	if (fread(buf, 1, size, infile) != size) {
+		std::cout << "Short read of " << filename << " from lab " << _filename << std::endl;
+		return NULL;
 	}
-	return -1;
+	Common::addStatsRead(size);
+	return buf;
 }
 
-std::istream* Lab::getFile(std::string filename) {
-	if (!buf) {
-		printf("Could not allocate memory\n");
-		exit(1);
+bool Lab::prefetch(uint32 index) {
+	if (index >= head.num_entries)
+		return false;
+	uint32 start = READ_LE_UINT32(&entries[index].start);
+	uint32 size = READ_LE_UINT32(&entries[index].size);
+#ifdef POSIX
+	if (_map) {
+		if (start > _mapSize || size > _mapSize - start)
+			return false;
+		// The mapping starts on a page, so rounding the offset down aligns it
+		uint32 begin = start - start % (uint32)sysconf(_SC_PAGESIZE);
+		return madvise((void *)const_cast<char *>(_map + begin), start + size - begin, MADV_WILLNEED) == 0;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	return posix_fadvise(fileno(infile), start, size, POSIX_FADV_WILLNEED) == 0;
+#endif
+#endif
+	return false;
+}
+
+static inline char foldCase(char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+const char *Lab::getEntryName(uint32 index) const {
+	if (index >= head.num_entries)
+		return NULL;
+	return str_table + READ_LE_UINT32(&entries[index].fname_offset);
+}
+
+uint32 Lab::getEntryOffset(uint32 index) const {
+	return READ_LE_UINT32(&entries[index].start);
+}
+
+uint32 Lab::getEntrySize(uint32 index) const {
+	return READ_LE_UINT32(&entries[index].size);
+}
+
+uint32 hashName(const char *name, bool fold) {
+	uint32 hash = 2166136261u;
+	for (; *name; ++name) {
+		hash ^= (uint8)(fold ? foldCase(*name) : *name);
+		hash *= 16777619u;
 	}
+	return hash;
+}
+
+bool matchName(const char *a, const char *b, bool ignoreCase) {
+	if (!ignoreCase)
+		return strcmp(a, b) == 0;
+	for (; *a && *b; ++a, ++b) {
+		if (foldCase(*a) != foldCase(*b))
+			return false;
+	}
+	return *a == *b;
+}
+
+void Lab::buildIndex() {
+	_nameIndex.reset(head.num_entries);
+	// On duplicate names the first entry wins, as with the old linear scan
+	for (i = 0; i < head.num_entries; i++)
+		_nameIndex.insert(getEntryName(i), i, *this);
+}
+
+int Lab::getIndex(std::string filename) {
+	return _nameIndex.find(filename.c_str(), *this);
+}
+
+SeekableReadStream *Lab::getStream(std::string filename) {
 	int index = getIndex(filename);
-	if (index == -1) {
+	if (index == -1)
+		return NULL;
+	return getEntryStream(index);
+}
+
+SeekableReadStream *Lab::getEntryStream(uint32 index) {
+	if (index >= head.num_entries)
 		return NULL;
-	} else {
-		offset = READ_LE_UINT32(&entries[i].start);
-		uint32 size = READ_LE_UINT32(&entries[i].size);
-		if (bufSize < size) {
-			bufSize = size;
-			char *newBuf = (char *)realloc(buf, bufSize);
-			if (!newBuf) {
-				printf("Could not reallocate memory\n");
-				exit(1);
-			} else {
-				buf = newBuf;
-			}
+	uint32 start = READ_LE_UINT32(&entries[index].start);
+	uint32 size = READ_LE_UINT32(&entries[index].size);
+	if (_map) {
+		if (start > _mapSize || size > _mapSize - start) {
+			std::cout << "File " << getEntryName(index) << " past the end of lab " << _filename << std::endl;
+			return NULL;
 		}
-		std::fstream *stream;
-		stream = new std::fstream(_filename.c_str(), std::ios::in | std::ios::binary);
-		stream->seekg(offset, std::ios::beg);
-		return stream;
+		return new MemoryReadStream((const byte *)_map + start, size);
 	}
-	
-	return NULL;
+	return new FileReadStream(infile, start, size);
+}
+
+std::istream* Lab::getFile(std::string filename) {
+	SeekableReadStream *stream = getStream(filename);
+	if (!stream)
+		return NULL;
+	return new ReadStreamIStream(stream);
+}
+
+std::istream *Lab::getEntryFile(uint32 index) {
+	SeekableReadStream *stream = getEntryStream(index);
+	if (!stream)
+		return NULL;
+	return new ReadStreamIStream(stream);
 }
 
 int Lab::getLength(std::string filename) {
 	int index = getIndex(filename);
 	if (index == -1)
 		return 0;
-	return entries[i].size;
+	return READ_LE_UINT32(&entries[index].size);
+}
+
+static std::istream *openFile(const std::string &filename) {
+	SeekableReadStream *stream = openFileStream(filename.c_str());
+	if (!stream) {
+		std::cout << "Unable to open file " << filename << std::endl;
+		return 0;
+	}
+	return new ReadStreamIStream(stream);
 }
 
 std::istream *getFile(std::string filename, Lab* lab) {
-	std::istream *stream;
-	if (lab) {
+	if (lab)
 		return lab->getFile(filename);
-	} else {
-		stream = new std::fstream(filename.c_str(), std::ios::in | std::ios::binary);
-		
-		if (!((std::fstream*)stream)->is_open()) {
-			std::cout << "Unable to open file " << filename << std::endl;
-			return 0;
-		}
-		return stream;
-	}
+	return openFile(filename);
 }
 
 std::istream *getFile(std::string filename, Lab* lab, int& length) {
@@ -171,16 +313,12 @@ std::istream *getFile(std::string filename, Lab* lab, int& length) {
 	if (lab) {
 		length = lab->getLength(filename);
 		return lab->getFile(filename);
-	} else {
-		stream = new std::fstream(filename.c_str(), std::ios::in | std::ios::binary);
-		
-		if (!((std::fstream*)stream)->is_open()) {
-			std::cout << "Unable to open file " << filename << std::endl;
-			return 0;
-		}
+	}
+	stream = openFile(filename);
+	if (stream) {
 		stream->seekg(0, std::ios::end);
 		length = (int)stream->tellg();
 		stream->seekg(0, std::ios::beg);
-		return stream;
 	}
+	return stream;
 }
@@ -26,10 +26,86 @@
 #include "config.h"
 #include <string>
 #include <iostream>
+#include <vector>
+
+class SeekableReadStream;
 
 #define GT_GRIM 1
 #define GT_EMI 2
 
+/** FNV-1a of the name, with its case folded first if asked */
+uint32 hashName(const char *name, bool fold);
+/** Whether the names are the same, ignoring case if asked */
+bool matchName(const char *a, const char *b, bool ignoreCase);
+
+/**
+ * Open addressing index of names, mapping each to the number it was
+ * added with. The names themselves aren't copied: the calls take the
+ * owner, whose getEntryName(number) gives back the name of a number.
+ * Adding a name already in the index keeps the first number.
+ */
+class NameIndex {
+	// Numbers of the names, -1 marks a free slot
+	std::vector<int> _slots;
+	uint32 _mask;
+	uint32 _count;
+	bool _caseInsensitive;
+
+	template<class Names>
+	uint32 findSlot(const char *name, const Names &names) const {
+		uint32 slot = hashName(name, _caseInsensitive) & _mask;
+		while (_slots[slot] != -1 && !matchName(names.getEntryName(_slots[slot]), name, _caseInsensitive))
+			slot = (slot + 1) & _mask;
+		return slot;
+	}
+
+public:
+	NameIndex(bool caseInsensitive = false) : _slots(16, -1), _mask(15), _count(0), _caseInsensitive(caseInsensitive) {}
+
+	/** Empties the index, making room for count names */
+	void reset(uint32 count = 0) {
+		// Keep the load factor at or below 1/2 so probe chains stay short
+		uint32 slots = 16;
+		while (slots < count * 2)
+			slots <<= 1;
+		_slots.assign(slots, -1);
+		_mask = slots - 1;
+		_count = 0;
+	}
+
+	/**
+	 * Adds name as number, which names needn't know about yet. Returns
+	 * false if the index already has the name.
+	 */
+	template<class Names>
+	bool insert(const char *name, int number, const Names &names) {
+		if ((_count + 1) * 2 > _slots.size()) {
+			std::vector<int> old;
+			old.swap(_slots);
+			_slots.assign(old.size() * 2, -1);
+			_mask = _slots.size() - 1;
+			for (size_t i = 0; i < old.size(); i++) {
+				if (old[i] != -1)
+					_slots[findSlot(names.getEntryName(old[i]), names)] = old[i];
+			}
+		}
+		uint32 slot = findSlot(name, names);
+		if (_slots[slot] != -1)
+			return false;
+		_slots[slot] = number;
+		_count++;
+		return true;
+	}
+
+	/** The number of the name, -1 if it isn't in the index */
+	template<class Names>
+	int find(const char *name, const Names &names) const {
+		return _slots[findSlot(name, names)];
+	}
+
+	uint32 size() const { return _count; }
+};
+
 struct lab_header {
 	uint32 magic;
 	uint32 magic2;
@@ -49,28 +125,65 @@ class Lab {
 	std::string _filename;
 	uint8 g_type;
 	uint32 i;
-	uint32 offset;
 	uint32 bufSize;
 	lab_header head;
 	lab_entry *entries;
 	char *buf;
 	char *str_table;
 	FILE *infile;
+	bool _caseInsensitive;
+	NameIndex _nameIndex;
+	// Whole archive mapped read-only, or NULL when reading through infile
+	const char *_map;
+	uint32 _mapSize;
 	void Load(std::string filename);
+	void mapArchive();
+	void buildIndex();
 public:
-	Lab(std::string filename) : _filename(filename) {
+	Lab(std::string filename, bool caseInsensitive = false, bool mapped = false) : _filename(filename), _caseInsensitive(caseInsensitive), _nameIndex(caseInsensitive), _map(0), _mapSize(0) {
 		// allocate a 1mb buffer to start with
 		bufSize = 1024*1024;
 		buf = (char *)malloc(bufSize);
 		Load(filename);
+		if (mapped)
+			mapArchive();
 	}
-	~Lab() {
-		free(buf);
-		delete[] str_table;
-		delete[] entries;
-	}
+	~Lab();
 
+	const std::string &getFileName() const { return _filename; }
+	bool isMapped() const { return _map != 0; }
+	/** The whole mapped archive, NULL when it isn't mapped */
+	const char *getMappedData(uint32 &size) const { size = _mapSize; return _map; }
+	/**
+	 * Returns a read-only view of the entry's data, or NULL if it isn't in the lab.
+	 * When the lab is mapped the view points into the mapping and stays valid for
+	 * the lifetime of the Lab, otherwise it is an internal buffer which is reused
+	 * by the next call.
+	 */
+	const char *getData(std::string filename, uint32 &size);
+	/** Same as getData(), for the entry at index in the table */
+	const char *getEntryData(uint32 index, uint32 &size);
+	uint32 getNumEntries() const { return head.num_entries; }
+	const char *getEntryName(uint32 index) const;
+	uint32 getEntryOffset(uint32 index) const;
+	uint32 getEntrySize(uint32 index) const;
+	/**
+	 * A stream over the entry, NULL if it isn't in the lab. It reads the
+	 * mapping in place, or the entry's range of the archive with pread(), so
+	 * any number of them can be open at once. The caller deletes it.
+	 */
+	SeekableReadStream *getStream(std::string filename);
+	/** Same as getStream(), for the entry at index in the table */
+	SeekableReadStream *getEntryStream(uint32 index);
+	/**
+	 * Asks the system to start reading the entry at index in the background,
+	 * so a later getData() finds it in memory. Returns false where it can't.
+	 */
+	bool prefetch(uint32 index);
+	/** Same as getStream(), as a std::istream for the readers that want one */
 	std::istream *getFile(std::string filename);
+	/** Same as getFile(), for the entry at index in the table */
+	std::istream *getEntryFile(uint32 index);
 	int getIndex(std::string filename);
 	int getLength(std::string filename);
 };
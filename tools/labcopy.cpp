@@ -31,9 +31,12 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include "common/endian.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
-#define BUFFER_SIZE 		0x100000
+#define BUFFER_SIZE 		0x800000
 FILE *inLab = NULL, *outLab = NULL;
 void *buffer = NULL;
 
@@ -45,19 +48,44 @@ struct lab_entry {
 };
 
 
-bool copyFile(uint32 offset, uint32 lenght) {
+struct lab_run {
+	uint32 start;
+	uint32 end;
+};
+
+static bool runBefore(const lab_run &a, const lab_run &b) {
+	return a.start < b.start;
+}
+
+// Copy [offset, offset + lenght). Both files only get seeked when the run
+// doesn't continue where the previous one ended, so the input is read front
+// to back and skipped ranges become holes in the output.
+bool copyRun(uint32 offset, uint32 lenght) {
 	uint32 copied_bytes, count, bytesToRead;
 
 	copied_bytes = 0;
-	fseek(inLab, offset, SEEK_SET);
-	fseek(outLab, offset, SEEK_SET);
+	if ((uint32)ftell(inLab) != offset)
+		fseek(inLab, offset, SEEK_SET);
+	if ((uint32)ftell(outLab) != offset)
+		fseek(outLab, offset, SEEK_SET);
 
 	while (copied_bytes < lenght) {
-		bytesToRead = (lenght - copied_bytes < BUFFER_SIZE) ? lenght - copied_bytes : BUFFER_SIZE;
-		count = (uint32)fread(buffer, 1, bytesToRead, inLab);
-		fwrite(buffer, count, 1, outLab);
+		// Read up to the next block boundary first, so the following reads are aligned
+		bytesToRead = BUFFER_SIZE - (offset + copied_bytes) % BUFFER_SIZE;
+		if (lenght - copied_bytes < bytesToRead)
+			bytesToRead = lenght - copied_bytes;
+		{
+			Common::StatsPhase phase(Common::kStatsOpen);
+			count = (uint32)fread(buffer, 1, bytesToRead, inLab);
+			Common::addStatsRead(count);
+		}
+		{
+			Common::StatsPhase phase(Common::kStatsWrite);
+			fwrite(buffer, count, 1, outLab);
+			Common::addStatsWritten(count);
+		}
 		copied_bytes += count;
-		if(ferror(inLab) != 0 || ferror(outLab) != 0)
+		if(ferror(inLab) != 0 || ferror(outLab) != 0 || count == 0)
 			return false;
 	}
 
@@ -69,31 +97,35 @@ bool copyLab() {
 	uint32 num_entries, string_table_size;
 	char *string_table;
 	lab_entry *lab_entries;
-
-	//Read and parse header
-	fseek(inLab, 0, SEEK_SET);
-	fread(header, 16, 1, inLab);
-	if (READ_BE_UINT32(header) != MKTAG('L','A','B','N')) {
-		printf("This isn't a valid .lab file!\n");
-		exit(1);
+	{
+		Common::StatsPhase phase(Common::kStatsIndex);
+		//Read and parse header
+		fseek(inLab, 0, SEEK_SET);
+		fread(header, 16, 1, inLab);
+		if (READ_BE_UINT32(header) != MKTAG('L','A','B','N')) {
+			printf("This isn't a valid .lab file!\n");
+			exit(1);
+		}
+
+		num_entries = READ_LE_UINT32(header + 8);
+		string_table_size = READ_LE_UINT32(header + 12);
+
+		//Read files entries
+		lab_entries = (lab_entry *)calloc(sizeof(lab_entry), num_entries);
+		fread(lab_entries, 1, num_entries * sizeof(struct lab_entry), inLab);
+		
+		//Read string table
+		string_table = (char *)malloc(string_table_size);
+		fread(string_table, 1, string_table_size, inLab);
+
+		//Write out new lab
+		fwrite(header, 16, 1, outLab);
+		fwrite(lab_entries, sizeof(struct lab_entry), num_entries, outLab);
+		fwrite(string_table, string_table_size, 1, outLab);
+		Common::addStatsRead(16 + num_entries * sizeof(struct lab_entry) + string_table_size);
+		Common::addStatsWritten(16 + num_entries * sizeof(struct lab_entry) + string_table_size);
 	}
 
-	num_entries = READ_LE_UINT32(header + 8);
-	string_table_size = READ_LE_UINT32(header + 12);
-
-	//Read files entries
-	lab_entries = (lab_entry *)calloc(sizeof(lab_entry), num_entries);
-	fread(lab_entries, 1, num_entries * sizeof(struct lab_entry), inLab);
-	
-	//Read string table
-	string_table = (char *)malloc(string_table_size);
-	fread(string_table, 1, string_table_size, inLab);
-
-	//Write out new lab
-	fwrite(header, 16, 1, outLab);
-	fwrite(lab_entries, sizeof(struct lab_entry), num_entries, outLab);
-	fwrite(string_table, string_table_size, 1, outLab);
-
 	//Check for errors
 	if(ferror(inLab) != 0 || ferror(outLab) != 0) {
 		free(lab_entries);
@@ -101,15 +133,39 @@ bool copyLab() {
 		return false;
 	}
 
-	//Copy the files, except cp_0_intha.bm
-	for (uint32 i = 0; i < num_entries; i++)
-		if(strcmp(string_table + READ_LE_UINT32(&lab_entries[i].fname_offset), "cp_0_intha.bm") != 0)
-			if (!copyFile(lab_entries[i].start, lab_entries[i].size)) {
-				free(lab_entries);
-				free(string_table);
-				return false;
-			}
+	//Copy the files, except cp_0_intha.bm, merging them into contiguous runs
+	lab_run *runs = (lab_run *)malloc(sizeof(lab_run) * (num_entries + 1));
+	uint32 num_runs = 0;
+	for (uint32 i = 0; i < num_entries; i++) {
+		if (strcmp(string_table + READ_LE_UINT32(&lab_entries[i].fname_offset), "cp_0_intha.bm") == 0)
+			continue;
+		runs[num_runs].start = READ_LE_UINT32(&lab_entries[i].start);
+		runs[num_runs].end = runs[num_runs].start + READ_LE_UINT32(&lab_entries[i].size);
+		num_runs++;
+	}
+	std::sort(runs, runs + num_runs, runBefore);
+
+	uint32 merged = 0;
+	for (uint32 i = 1; i < num_runs; i++) {
+		if (runs[i].start <= runs[merged].end) {
+			if (runs[i].end > runs[merged].end)
+				runs[merged].end = runs[i].end;
+		} else {
+			runs[++merged] = runs[i];
+		}
+	}
+	if (num_runs > 0)
+		num_runs = merged + 1;
+
+	for (uint32 i = 0; i < num_runs; i++)
+		if (!copyRun(runs[i].start, runs[i].end - runs[i].start)) {
+			free(runs);
+			free(lab_entries);
+			free(string_table);
+			return false;
+		}
 
+	free(runs);
 	free(lab_entries);
 	free(string_table);
 	return true;
@@ -127,6 +183,8 @@ void cleanup() {
 }
 
 int main(int argc, char *argv[]) {
+	// Reported after cleanup() has closed the output
+	Common::initStats("labcopy", argc, argv);
 	atexit(cleanup);
 	
 	//Argument checks and usage display
@@ -154,12 +212,15 @@ int main(int argc, char *argv[]) {
 		printf("Unable to allocate memory!\n");
 		return 1;
 	}
+	// Our reads are large already, let them go straight to the device
+	setvbuf(inLab, NULL, _IONBF, 0);
 
 	if (!copyLab()) {
 		printf("I/O error!\n");
 		return 1;
 	}
 
+	Common::addStatsFiles();
 	printf("%s successfully copied to %s.\n", argv[1], argv[2]);
 	return 0;
 }
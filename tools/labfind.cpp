@@ -0,0 +1,87 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ Tells which of the labs of a game directory holds an asset, resolving
+ the names the way the overlay of all the labs does.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "lab.h"
+#include "labset.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+static void usage() {
+	printf("Usage: labfind [-c CACHE] DIRECTORY [PATTERN]...\n");
+	printf("\t-c CACHE\tKeep the index of the labs in CACHE for the next run\n");
+	printf("Prints the entries matching any PATTERN (e.g. '*.bm'), or all of them,\n");
+	printf("with the lab they are read from and their size.\n");
+}
+
+int main(int argc, char **argv) {
+	const char *cacheFile = NULL;
+	int opt;
+	Common::initStats("labfind", argc, argv);
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cacheFile = optarg;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		exit(1);
+	}
+
+	LabSet labs;
+	if (!labs.addDirectory(argv[optind])) {
+		printf("Can not read directory %s\n", argv[optind]);
+		exit(1);
+	}
+	labs.buildIndex(cacheFile);
+	Common::addStatsFiles(labs.getNumArchives());
+
+	std::vector<const char *> patterns(argv + optind + 1, argv + argc);
+	int found = 0;
+	for (uint32 i = 0; i < labs.getNumEntries(); i++) {
+		const char *name = labs.getEntryName(i);
+		bool match = patterns.empty();
+		for (size_t j = 0; j < patterns.size() && !match; j++)
+			match = Common::matchPattern(patterns[j], name);
+		if (!match)
+			continue;
+		printf("%s\t%s\t%u\n", name, labs.getLabPath(i).c_str(), labs.getEntrySize(i));
+		found++;
+	}
+	return found || patterns.empty() ? 0 : 1;
+}
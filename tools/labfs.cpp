@@ -0,0 +1,295 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ Mounts lab files as a read-only filesystem, so they can be browsed
+ without extracting them with unlab.
+
+ One lab is mounted at the root of the mount point, several get a
+ directory each, named after the lab. The tables are read and the EMI
+ string tables decrypted once when mounting; reads are then served from
+ the mapped archive, or with pread() at the entries' offsets where it
+ can't be mapped, so the data only ever sits in the page cache of the
+ lab files.
+*/
+
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include "lab.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+struct LabNode {
+	std::string name;
+	int lab;	// Index in mounted, -1 for the root of several labs
+	int entry;	// Index of the entry in the lab, -1 for a directory
+	std::vector<int> children;
+};
+
+struct MountedLab {
+	Lab *lab;
+	int fd;	// For the reads when the lab isn't mapped
+	const char *map;
+	uint32 mapSize;
+	time_t mtime;
+};
+
+static std::vector<MountedLab> mounted;
+static std::vector<LabNode> nodes;
+// Full path of every node, the lookup of all the operations
+static std::map<std::string, int> paths;
+
+static int addNode(int parent, const std::string &path, const std::string &name, int lab, int entry) {
+	std::map<std::string, int>::const_iterator it = paths.find(path);
+	if (it != paths.end())
+		return it->second;
+	LabNode node;
+	node.name = name;
+	node.lab = lab;
+	node.entry = entry;
+	nodes.push_back(node);
+	int index = (int)nodes.size() - 1;
+	paths[path] = index;
+	if (parent >= 0)
+		nodes[parent].children.push_back(index);
+	return index;
+}
+
+// Entry names may contain directories, with either separator
+static void addEntries(int root, const std::string &prefix, int lab) {
+	Lab *l = mounted[lab].lab;
+	for (uint32 i = 0; i < l->getNumEntries(); i++) {
+		std::string name = l->getEntryName(i);
+		for (std::string::size_type j = 0; j < name.size(); j++)
+			if (name[j] == '\\')
+				name[j] = '/';
+		int dir = root;
+		std::string path = prefix;
+		std::string::size_type start = 0, end;
+		while ((end = name.find('/', start)) != std::string::npos) {
+			if (end > start) {
+				path += "/" + name.substr(start, end - start);
+				dir = addNode(dir, path, name.substr(start, end - start), lab, -1);
+			}
+			start = end + 1;
+		}
+		if (start == name.size())
+			continue;
+		path += "/" + name.substr(start);
+		if (paths.find(path) != paths.end()) {
+			printf("Skipping duplicate entry %s in %s\n", l->getEntryName(i), l->getFileName().c_str());
+			continue;
+		}
+		addNode(dir, path, name.substr(start), lab, i);
+	}
+}
+
+static int findNode(const char *path) {
+	if (strcmp(path, "/") == 0)
+		return 0;
+	std::map<std::string, int>::const_iterator it = paths.find(path);
+	return it == paths.end() ? -1 : it->second;
+}
+
+static int labfs_getattr(const char *path, struct stat *st) {
+	int n = findNode(path);
+	if (n < 0)
+		return -ENOENT;
+	const LabNode &node = nodes[n];
+	memset(st, 0, sizeof(*st));
+	if (node.lab >= 0)
+		st->st_mtime = st->st_atime = st->st_ctime = mounted[node.lab].mtime;
+	if (node.entry < 0) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	} else {
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = mounted[node.lab].lab->getEntrySize(node.entry);
+	}
+	return 0;
+}
+
+static int labfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *) {
+	int n = findNode(path);
+	if (n < 0)
+		return -ENOENT;
+	if (nodes[n].entry >= 0)
+		return -ENOTDIR;
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	for (size_t i = 0; i < nodes[n].children.size(); i++)
+		filler(buf, nodes[nodes[n].children[i]].name.c_str(), NULL, 0);
+	return 0;
+}
+
+static int labfs_open(const char *path, struct fuse_file_info *fi) {
+	int n = findNode(path);
+	if (n < 0)
+		return -ENOENT;
+	if (nodes[n].entry < 0)
+		return -EISDIR;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	fi->fh = n;
+	// The archive never changes under the mount
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int labfs_read(const char *, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	const LabNode &node = nodes[fi->fh];
+	const MountedLab &ml = mounted[node.lab];
+	uint32 start = ml.lab->getEntryOffset(node.entry);
+	uint32 length = ml.lab->getEntrySize(node.entry);
+	if (offset >= (off_t)length)
+		return 0;
+	if (size > (size_t)(length - offset))
+		size = length - offset;
+	if (ml.map) {
+		if (start > ml.mapSize || length > ml.mapSize - start)
+			return -EIO;
+		memcpy(buf, ml.map + start + offset, size);
+		return (int)size;
+	}
+	size_t done = 0;
+	while (done < size) {
+		ssize_t count = pread(ml.fd, buf + done, size - done, (off_t)start + offset + done);
+		if (count < 0)
+			return -errno;
+		if (count == 0)
+			break;
+		done += count;
+	}
+	return (int)done;
+}
+
+static int labfs_statfs(const char *, struct statvfs *st) {
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = 4096;
+	st->f_namemax = 255;
+	st->f_files = nodes.size();
+	return 0;
+}
+
+static void usage() {
+	printf("Usage: labfs [-f] [-d] [-o OPTION]... LABFILE... MOUNTPOINT\n");
+	printf("\t-f\t\tStay in the foreground\n");
+	printf("\t-d\t\tPrint the FUSE requests, implies -f\n");
+	printf("\t-o OPTION\tPass a mount option to FUSE (e.g. allow_other)\n");
+	printf("One lab is mounted at MOUNTPOINT, several each get a directory in it.\n");
+	printf("Unmount with 'fusermount -u MOUNTPOINT'.\n");
+}
+
+int main(int argc, char **argv) {
+	std::vector<char *> fuseArgs;
+	std::vector<const char *> labFiles;
+	// Reported when it is unmounted, run it with -f to see it
+	Common::initStats("labfs", argc, argv);
+	fuseArgs.push_back(argv[0]);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			usage();
+			return 0;
+		}
+		if (argv[i][0] == '-') {
+			fuseArgs.push_back(argv[i]);
+			if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+				fuseArgs.push_back(argv[++i]);
+		} else {
+			labFiles.push_back(argv[i]);
+		}
+	}
+	if (labFiles.size() < 2) {
+		usage();
+		exit(1);
+	}
+	const char *mountPoint = labFiles.back();
+	labFiles.pop_back();
+
+	// The root, a directory of the lab when there is only one
+	LabNode root;
+	root.lab = labFiles.size() == 1 ? 0 : -1;
+	root.entry = -1;
+	nodes.push_back(root);
+
+	for (size_t i = 0; i < labFiles.size(); i++) {
+		MountedLab ml;
+		ml.lab = new Lab(labFiles[i], false, true);
+		ml.map = ml.lab->getMappedData(ml.mapSize);
+		ml.fd = -1;
+		if (!ml.map && (ml.fd = open(labFiles[i], O_RDONLY)) < 0) {
+			printf("Can not open %s\n", labFiles[i]);
+			exit(1);
+		}
+		struct stat st;
+		ml.mtime = stat(labFiles[i], &st) == 0 ? st.st_mtime : 0;
+		mounted.push_back(ml);
+
+		if (labFiles.size() == 1) {
+			addEntries(0, "", 0);
+			continue;
+		}
+		const char *base = strrchr(labFiles[i], '/');
+		std::string name = base ? base + 1 : labFiles[i];
+		std::string path = "/" + name;
+		if (paths.find(path) != paths.end()) {
+			printf("Two labs are named %s, mount them separately\n", name.c_str());
+			exit(1);
+		}
+		addEntries(addNode(0, path, name, (int)i, -1), path, (int)i);
+	}
+
+	struct fuse_operations ops;
+	memset(&ops, 0, sizeof(ops));
+	ops.getattr = labfs_getattr;
+	ops.readdir = labfs_readdir;
+	ops.open = labfs_open;
+	ops.read = labfs_read;
+	ops.statfs = labfs_statfs;
+
+	fuseArgs.push_back(const_cast<char *>("-o"));
+	fuseArgs.push_back(const_cast<char *>("ro"));
+	fuseArgs.push_back(const_cast<char *>(mountPoint));
+	int ret = fuse_main((int)fuseArgs.size(), &fuseArgs[0], &ops, NULL);
+
+	for (size_t i = 0; i < mounted.size(); i++) {
+		if (mounted[i].fd >= 0)
+			close(mounted[i].fd);
+		delete mounted[i].lab;
+	}
+	return ret;
+}
@@ -0,0 +1,291 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "labset.h"
+#include "lab.h"
+#include "common/endian.h"
+#include "common/stats.h"
+
+// The cache starts with this and a version, then the labs as path, size
+// and mtime, then the entries as lab, index in it and size, then their names
+#define CACHE_MAGIC MKTAG('L','S','E','T')
+#define CACHE_VERSION 1
+
+static inline char foldCase(char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool hasSuffix(const std::string &name, const char *suffix) {
+	size_t len = strlen(suffix);
+	if (name.size() < len)
+		return false;
+	for (size_t i = 0; i < len; i++) {
+		if (foldCase(name[name.size() - len + i]) != suffix[i])
+			return false;
+	}
+	return true;
+}
+
+static bool containsFolded(const std::string &name, const char *word) {
+	std::string folded = name;
+	for (size_t i = 0; i < folded.size(); i++)
+		folded[i] = foldCase(folded[i]);
+	return folded.find(word) != std::string::npos;
+}
+
+LabSet::LabSet() : _index(true) {
+}
+
+LabSet::~LabSet() {
+	for (size_t i = 0; i < _archives.size(); i++)
+		delete _archives[i].lab;
+}
+
+void LabSet::addLab(const std::string &path, int priority) {
+	Archive a;
+	a.path = path;
+	a.priority = priority;
+	a.size = a.mtime = 0;
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0) {
+		a.size = (uint32)st.st_size;
+		a.mtime = (uint32)st.st_mtime;
+	}
+	a.lab = NULL;
+	_archives.push_back(a);
+}
+
+bool LabSet::addDirectory(const std::string &dirname) {
+	DIR *dir = opendir(dirname.c_str());
+	if (!dir)
+		return false;
+	std::vector<std::string> names;
+	struct dirent *dirfile;
+	while ((dirfile = readdir(dir))) {
+		std::string name = dirfile->d_name;
+		if (hasSuffix(name, ".lab") || hasSuffix(name, ".m4b"))
+			names.push_back(name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	for (size_t i = 0; i < names.size(); i++)
+		addLab(dirname + "/" + names[i], containsFolded(names[i], "patch") ? 1 : 0);
+	return true;
+}
+
+void LabSet::addEntry(const char *name, uint32 archive, uint32 index, uint32 size) {
+	Entry e;
+	e.name = _names.size();
+	e.archive = archive;
+	e.index = index;
+	e.size = size;
+	_names.insert(_names.end(), name, name + strlen(name) + 1);
+	_entries.push_back(e);
+}
+
+void LabSet::buildTable() {
+	std::vector<Entry> entries;
+	entries.swap(_entries);
+	_index.reset(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		// The entries come in priority order, so the first of a name wins
+		if (_index.insert(&_names[entries[i].name], _entries.size(), *this))
+			_entries.push_back(entries[i]);
+	}
+}
+
+static bool archiveBefore(const std::pair<int, uint32> &a, const std::pair<int, uint32> &b) {
+	// Higher priority first, then in the order added
+	return a.first != b.first ? a.first > b.first : a.second < b.second;
+}
+
+void LabSet::buildIndex(const char *cacheFile) {
+	Common::StatsPhase phase(Common::kStatsIndex);
+	_entries.clear();
+	_names.clear();
+	_index.reset();
+	if (cacheFile && readCache(cacheFile))
+		return;
+
+	std::vector<std::pair<int, uint32> > order;
+	for (uint32 i = 0; i < _archives.size(); i++)
+		order.push_back(std::make_pair(_archives[i].priority, i));
+	std::sort(order.begin(), order.end(), archiveBefore);
+	for (size_t i = 0; i < order.size(); i++) {
+		uint32 a = order[i].second;
+		if (!_archives[a].lab)
+			_archives[a].lab = new Lab(_archives[a].path, true, true);
+		Lab *lab = _archives[a].lab;
+		for (uint32 j = 0; j < lab->getNumEntries(); j++)
+			addEntry(lab->getEntryName(j), a, j, lab->getEntrySize(j));
+	}
+	buildTable();
+
+	if (cacheFile && !writeCache(cacheFile))
+		printf("Could not write the index cache %s\n", cacheFile);
+}
+
+bool LabSet::readCache(const char *cacheFile) {
+	FILE *f = fopen(cacheFile, "rb");
+	if (!f)
+		return false;
+	std::vector<byte> data;
+	byte chunk[65536];
+	size_t count;
+	while ((count = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		data.insert(data.end(), chunk, chunk + count);
+	fclose(f);
+	Common::addStatsRead(data.size());
+
+	const byte *p = data.empty() ? NULL : &data[0];
+	const byte *end = p + data.size();
+	// Any mismatch or truncation just means rebuilding the index
+	if (end - p < 12 || READ_BE_UINT32(p) != CACHE_MAGIC || READ_LE_UINT32(p + 4) != CACHE_VERSION)
+		return false;
+	if (READ_LE_UINT32(p + 8) != _archives.size())
+		return false;
+	p += 12;
+	for (size_t i = 0; i < _archives.size(); i++) {
+		if (end - p < 4)
+			return false;
+		uint32 len = READ_LE_UINT32(p);
+		if ((uint32)(end - p) < 12 + len)
+			return false;
+		const Archive &a = _archives[i];
+		if (a.path.size() != len || memcmp(p + 4, a.path.data(), len) != 0 ||
+				READ_LE_UINT32(p + 4 + len) != a.size || READ_LE_UINT32(p + 8 + len) != a.mtime)
+			return false;
+		p += 12 + len;
+	}
+	if (end - p < 8)
+		return false;
+	uint32 numEntries = READ_LE_UINT32(p);
+	uint32 namesSize = READ_LE_UINT32(p + 4);
+	p += 8;
+	if ((uint32)(end - p) / 12 < numEntries || (uint32)(end - p) - numEntries * 12 != namesSize)
+		return false;
+	if (namesSize > 0 && p[numEntries * 12 + namesSize - 1] != 0)
+		return false;
+
+	_names.assign(p + numEntries * 12, end);
+	_entries.resize(numEntries);
+	uint32 name = 0;
+	for (uint32 i = 0; i < numEntries; i++, p += 12) {
+		Entry &e = _entries[i];
+		e.archive = READ_LE_UINT32(p);
+		e.index = READ_LE_UINT32(p + 4);
+		e.size = READ_LE_UINT32(p + 8);
+		e.name = name;
+		if (e.archive >= _archives.size() || name >= namesSize) {
+			_entries.clear();
+			_names.clear();
+			return false;
+		}
+		name += strlen(&_names[name]) + 1;
+	}
+	buildTable();
+	return true;
+}
+
+bool LabSet::writeCache(const char *cacheFile) const {
+	std::vector<byte> data(12);
+	WRITE_BE_UINT32(&data[0], CACHE_MAGIC);
+	WRITE_LE_UINT32(&data[4], CACHE_VERSION);
+	WRITE_LE_UINT32(&data[8], _archives.size());
+	for (size_t i = 0; i < _archives.size(); i++) {
+		const Archive &a = _archives[i];
+		size_t pos = data.size();
+		data.resize(pos + 12 + a.path.size());
+		WRITE_LE_UINT32(&data[pos], a.path.size());
+		memcpy(&data[pos + 4], a.path.data(), a.path.size());
+		WRITE_LE_UINT32(&data[pos + 4 + a.path.size()], a.size);
+		WRITE_LE_UINT32(&data[pos + 8 + a.path.size()], a.mtime);
+	}
+	size_t pos = data.size();
+	data.resize(pos + 8 + _entries.size() * 12);
+	size_t namesPos = pos + 8 + _entries.size() * 12;
+	WRITE_LE_UINT32(&data[pos], _entries.size());
+	pos += 8;
+	for (size_t i = 0; i < _entries.size(); i++, pos += 12) {
+		WRITE_LE_UINT32(&data[pos], _entries[i].archive);
+		WRITE_LE_UINT32(&data[pos + 4], _entries[i].index);
+		WRITE_LE_UINT32(&data[pos + 8], _entries[i].size);
+	}
+	// Only the names of the entries kept, one after the other in their order
+	for (size_t i = 0; i < _entries.size(); i++) {
+		const char *name = &_names[_entries[i].name];
+		data.insert(data.end(), name, name + strlen(name) + 1);
+	}
+	WRITE_LE_UINT32(&data[namesPos - _entries.size() * 12 - 4], data.size() - namesPos);
+
+	FILE *f = fopen(cacheFile, "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+	Common::addStatsWritten(data.size());
+	return fclose(f) == 0 && ok;
+}
+
+int LabSet::getIndex(const std::string &filename) const {
+	return _index.find(filename.c_str(), *this);
+}
+
+Lab *LabSet::getLab(uint32 index, uint32 &labIndex) {
+	Archive &a = _archives[_entries[index].archive];
+	if (!a.lab)
+		a.lab = new Lab(a.path, true, true);
+	labIndex = _entries[index].index;
+	return a.lab;
+}
+
+const char *LabSet::getData(const std::string &filename, uint32 &size) {
+	int index = getIndex(filename);
+	if (index == -1)
+		return NULL;
+	uint32 labIndex;
+	Lab *lab = getLab(index, labIndex);
+	return lab->getEntryData(labIndex, size);
+}
+
+SeekableReadStream *LabSet::getStream(const std::string &filename) {
+	int index = getIndex(filename);
+	if (index == -1)
+		return NULL;
+	uint32 labIndex;
+	Lab *lab = getLab(index, labIndex);
+	return lab->getEntryStream(labIndex);
+}
+
+std::istream *LabSet::getFile(const std::string &filename) {
+	int index = getIndex(filename);
+	if (index == -1)
+		return NULL;
+	uint32 labIndex;
+	Lab *lab = getLab(index, labIndex);
+	return lab->getEntryFile(labIndex);
+}
@@ -0,0 +1,103 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef LABSET_H
+#define LABSET_H
+
+#include "config.h"
+#include <string>
+#include <iostream>
+#include <vector>
+#include "lab.h"
+
+class SeekableReadStream;
+
+/**
+ * All the labs of a game seen as one archive. Every name resolves to the
+ * lab of the highest priority holding it, so patch labs override the base
+ * ones; between labs of the same priority the one added first wins.
+ *
+ * The entry tables are read once into a single name index, which can be
+ * saved to a cache file. While the labs are unchanged the next run loads
+ * the index from there, and the labs are only opened when data is read
+ * from them. Names are matched case-insensitively, like the game does.
+ */
+class LabSet {
+	struct Archive {
+		std::string path;
+		int priority;
+		uint32 size, mtime;	// Tell whether a cached index is still valid
+		Lab *lab;	// Opened on first use
+	};
+	struct Entry {
+		uint32 name;	// Offset in _names
+		uint32 archive;
+		uint32 index;	// Of the entry in its lab
+		uint32 size;
+	};
+	std::vector<Archive> _archives;
+	std::vector<Entry> _entries;
+	std::vector<char> _names;
+	// Of the indices in _entries
+	NameIndex _index;
+
+	void addEntry(const char *name, uint32 archive, uint32 index, uint32 size);
+	void buildTable();
+	bool readCache(const char *cacheFile);
+	bool writeCache(const char *cacheFile) const;
+public:
+	LabSet();
+	~LabSet();
+
+	/** Adds a lab, not read until buildIndex() */
+	void addLab(const std::string &path, int priority = 0);
+	/**
+	 * Adds every .lab and .m4b file of the directory, in name order, the
+	 * ones with "patch" in their name with priority 1 and the others with 0.
+	 * Returns false if the directory can't be read.
+	 */
+	bool addDirectory(const std::string &dirname);
+	/**
+	 * Reads the entry tables of all the labs, or the cache file when one is
+	 * given and it matches the labs, writing it otherwise.
+	 */
+	void buildIndex(const char *cacheFile = NULL);
+
+	uint32 getNumArchives() const { return _archives.size(); }
+	uint32 getNumEntries() const { return _entries.size(); }
+	const char *getEntryName(uint32 index) const { return &_names[_entries[index].name]; }
+	uint32 getEntrySize(uint32 index) const { return _entries[index].size; }
+	/** Index of the entry named filename, -1 if no lab has it */
+	int getIndex(const std::string &filename) const;
+	/** The lab holding the entry, opening it if needed, and the entry's index in it */
+	Lab *getLab(uint32 index, uint32 &labIndex);
+	const std::string &getLabPath(uint32 index) const { return _archives[_entries[index].archive].path; }
+
+	/** Same as Lab::getData(), from whichever lab holds the entry */
+	const char *getData(const std::string &filename, uint32 &size);
+	/** Same as Lab::getStream(), from whichever lab holds the entry */
+	SeekableReadStream *getStream(const std::string &filename);
+	/** Same as Lab::getFile(), from whichever lab holds the entry */
+	std::istream *getFile(const std::string &filename);
+};
+
+#endif
@@ -437,8 +437,8 @@ void lua_settag (int32 tag)
 
 
 /* Hooks */
-lua_CHFunction lua_callhook = NULL;
-lua_LHFunction lua_linehook = NULL;
+LUA_THREAD lua_CHFunction lua_callhook = NULL;
+LUA_THREAD lua_LHFunction lua_linehook = NULL;
 
 
 lua_Function lua_stackedfunction (int32 level)
@@ -86,7 +86,7 @@ lua_Object luaL_nonnullarg (int32 numArg)
   return o;
 }
 
-luaL_libList *list_of_libs = NULL;
+LUA_THREAD luaL_libList *list_of_libs = NULL;
 
 void luaL_addlibtolist(luaL_reg *l, int32 n) {
   luaL_libList *list = (luaL_libList *)luaM_malloc(sizeof(luaL_libList));
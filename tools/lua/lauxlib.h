@@ -23,7 +23,7 @@ struct luaL_libList {
   luaL_libList *next;
 };
 
-extern luaL_libList *list_of_libs;
+extern LUA_THREAD luaL_libList *list_of_libs;
 
 #define luaL_arg_check(cond,numarg,extramsg) if (!(cond)) \
                                                luaL_argerror(numarg,extramsg)
@@ -91,23 +91,32 @@ static void next (void)
 }
 
 
+/* call f on node nd if it is live; true if f returned non-nil */
+static int32 foreachnode (TObject *f, Node *nd)
+{
+  if (ttype(ref(nd)) != LUA_T_NIL && ttype(val(nd)) != LUA_T_NIL) {
+    luaA_pushobject(f);
+    luaA_pushobject(ref(nd));
+    luaA_pushobject(val(nd));
+    luaD_call((L->stack.top-L->stack.stack)-2, 1);
+    if (ttype(L->stack.top-1) != LUA_T_NIL)
+      return 1;
+    L->stack.top--;
+  }
+  return 0;
+}
+
 static void foreach (void)
 {
   TObject t = *luaA_Address(luaL_tablearg(1));
   TObject f = *luaA_Address(luaL_functionarg(2));
   int32 i;
-  for (i=0; i<avalue(&t)->nhash; i++) {
-    Node *nd = &(avalue(&t)->node[i]);
-    if (ttype(ref(nd)) != LUA_T_NIL && ttype(val(nd)) != LUA_T_NIL) {
-      luaA_pushobject(&f);
-      luaA_pushobject(ref(nd));
-      luaA_pushobject(val(nd));
-      luaD_call((L->stack.top-L->stack.stack)-2, 1);
-      if (ttype(L->stack.top-1) != LUA_T_NIL)
-        return;
-      L->stack.top--;
-    }
-  }
+  for (i=0; i<avalue(&t)->narray; i++)
+    if (foreachnode(&f, &(avalue(&t)->array[i])))
+      return;
+  for (i=0; i<avalue(&t)->nhash; i++)
+    if (foreachnode(&f, &(avalue(&t)->node[i])))
+      return;
 }
 
 
@@ -402,6 +411,10 @@ static void mem_query (void)
 {
   lua_pushnumber(totalmem);
   lua_pushnumber(numblocks);
+#ifndef LUA_NOPOOL
+  lua_pushnumber(poolmem);
+  lua_pushnumber(poolinuse);
+#endif
 }
 
 
@@ -516,7 +529,8 @@ static struct luaL_reg int_funcs[] = {
   {"pause_scripts", pause_scripts},
   {"unpause_scripts", unpause_scripts},
   {"find_script", find_script},
-  {"break_here", break_here}
+  {"break_here", break_here},
+  {"sleep_here", sleep_here}
 };
 
 
@@ -12,6 +12,8 @@
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lparser.h"
+#include "lprofile.h"
+#include "lsample.h"
 #include "lstate.h"
 #include "ltask.h"
 #include "ltm.h"
@@ -55,30 +57,56 @@ void luaD_init (void)
   fvalue(&L->errorim) = stderrorim;
 }
 
+static void clearthr (void)
+{
+  L->stack.top = L->stack.stack;
+  memset(L->base_ci, 0, L->base_ci_size);
+  L->ci = L->base_ci;
+  L->ci->tf = NULL;
+}
+
 void luaD_initthr (void)
 {
   L->stack.stack = luaM_newvector(STACK_UNIT, TObject);
-  L->stack.top = L->stack.stack;
   L->stack.last = L->stack.stack+(STACK_UNIT-1);
   L->base_ci = luaM_newvector(BASIC_CI_SIZE, struct CallInfo);
-  memset(L->base_ci, 0, sizeof(CallInfo) * BASIC_CI_SIZE);
   L->base_ci_size = sizeof(CallInfo) * BASIC_CI_SIZE; 
-  L->ci = L->base_ci;
-  L->ci->tf = NULL;
   L->end_ci = L->base_ci + BASIC_CI_SIZE;
+  clearthr();
 }
 
+/* Start the thread on the stack and CallInfo array of a finished task */
+void luaD_reusethr (struct lua_Task *t)
+{
+  L->stack = t->stack;
+  L->base_ci = t->base_ci;
+  L->base_ci_size = t->base_ci_size;
+  L->end_ci = t->end_ci;
+  clearthr();
+}
 
+
+/*
+** The stack at least doubles, so a deep recursion reallocates it a few
+** times instead of once per STACK_UNIT; past STACK_LIMIT it grows only as
+** needed, so the overflow is still caught near the limit.
+*/
 void luaD_checkstack (int32 n)
 {
   struct Stack *S = &L->stack;
   if (S->last-S->top <= n) {
     StkId top = S->top-S->stack;
-    int32 stacksize = (S->last-S->stack)+1+STACK_UNIT+n;
+    int32 size = (S->last-S->stack)+1;
+    int32 needed = size+STACK_UNIT+n;
+    int32 stacksize = 2*size;
+    if (stacksize > STACK_LIMIT)
+      stacksize = (needed > STACK_LIMIT) ? needed : STACK_LIMIT;
+    if (stacksize < needed)
+      stacksize = needed;
     S->stack = luaM_reallocvector(S->stack, stacksize, TObject);
     S->last = S->stack+(stacksize-1);
     S->top = S->stack + top;
-    if (stacksize >= STACK_LIMIT) {  /* stack overflow? */
+    if (needed >= STACK_LIMIT) {  /* stack overflow? */
       if (lua_stackedfunction(100) == LUA_NOOBJECT)  /* 100 funcs on stack? */
         lua_error("Lua2C - C2Lua overflow"); /* doesn't look like a rec. loop */
       else
@@ -208,6 +236,7 @@ static void adjust_varargs (StkId first_extra_arg)
 */
 void luaD_precall (TObject *f, StkId base, int32 nResults)
 {
+  luaP_checksample();  /* before the callee, so its caller's line is current */
   /* Create a new CallInfo record */
   if (L->ci+1 == L->end_ci) {
     int32 size_ci = L->end_ci - L->base_ci;
@@ -249,6 +278,7 @@ void luaD_precall (TObject *f, StkId base, int32 nResults)
     L->ci->tf = tfvalue(f);
     L->ci->pc = pc;
   }
+  luaP_call();
 }
 
 /*
@@ -451,22 +481,61 @@ static int32 do_main (ZIO *z, int32 bin)
 
 void luaD_gcIM (TObject *o)
 {
-  TObject *im = luaT_getimbyObj(o, IM_GC);
-  if (ttype(im) != LUA_T_NIL) {
+  int32 tg = luaT_efectivetag(o);
+  if (luaT_hasim(tg, IM_GC)) {
     *L->stack.top = *o;
     incr_top;
-    luaD_callTM(im, 1, 0);
+    luaD_callTM(luaT_getim(tg, IM_GC), 1, 0);
   }
 }
 
 
+/*
+** Read a whole file into a new block; NULL if its size is unknown.
+*/
+static char *loadfile (FILE *f, int32 *size)
+{
+  char *buff;
+  long n;
+  if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) <= 0 ||
+      fseek(f, 0, SEEK_SET) != 0)
+    return NULL;
+  buff = (char *)luaM_malloc(n);
+  if (buff == NULL || (long)fread(buff, 1, n, f) != n) {
+    luaM_free(buff);
+    fseek(f, 0, SEEK_SET);
+    return NULL;
+  }
+  *size = (int32)n;
+  return buff;
+}
+
+
+lua_FileReader lua_setfilereader (lua_FileReader reader)
+{
+  lua_FileReader old = L->filereader;
+  L->filereader = reader;
+  return old;
+}
+
+
 int32 lua_dofile (const char *filename)
 {
   ZIO z;
   int32 status;
   int32 c;
   int32 bin;
-  FILE *f = (filename == NULL) ? stdin : fopen(filename, "r");
+  int32 size = 0;
+  char *buff;
+  FILE *f;
+  if (filename != NULL && L->filereader != NULL) {
+    const char *data = L->filereader(filename, &size);
+    if (data != NULL) {  /* run it in place, as lua_dobuffer does */
+      luaZ_mopen(&z, data, size, filename);
+      return do_main(&z, size > 0 && data[0] == ID_CHUNK);
+    }
+  }
+  f = (filename == NULL) ? stdin : fopen(filename, "r");
   if (f == NULL)
     return 2;
   if (filename == NULL)
@@ -476,8 +545,13 @@ int32 lua_dofile (const char *filename)
   bin = (c == ID_CHUNK);
   if (bin)
     f = freopen(filename, "rb", f);  /* set binary mode */
-  luaZ_Fopen(&z, f, filename);
+  buff = (bin && f != stdin) ? loadfile(f, &size) : NULL;
+  if (buff)  /* undump from memory, where lundump reads fields in place */
+    luaZ_mopen(&z, buff, size, filename);
+  else
+    luaZ_Fopen(&z, f, filename);
   status = do_main(&z, bin);
+  luaM_free(buff);
   if (f != stdin)
     fclose(f);
   return status;
@@ -32,6 +32,7 @@
 
 void luaD_init (void);
 void luaD_initthr (void);
+void luaD_reusethr (struct lua_Task *t);
 void luaD_adjusttop (StkId newtop);
 void luaD_openstack (int32 nelems);
 void luaD_lineHook (int32 line);
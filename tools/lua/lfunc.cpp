@@ -13,11 +13,13 @@
 #define gcsizeproto(p)	5  /* approximate "weight" for a prototype */
 #define gcsizeclosure(c) 1  /* approximate "weight" for a closure */
 
+#define closuresize(n)	(sizeof(Closure)+(n)*sizeof(TObject))
+
 
 
 Closure *luaF_newclosure (int32 nelems)
 {
-  Closure *c = (Closure *)luaM_malloc(sizeof(Closure)+nelems*sizeof(TObject));
+  Closure *c = (Closure *)luaM_newobj(closuresize(nelems));
   luaO_insertlist(&(L->rootcl), (GCnode *)c);
   L->nblocks += gcsizeclosure(c);
   c->nelems = nelems;
@@ -27,13 +29,17 @@ Closure *luaF_newclosure (int32 nelems)
 
 TProtoFunc *luaF_newproto (void)
 {
-  TProtoFunc *f = luaM_new(TProtoFunc);
+  TProtoFunc *f = (TProtoFunc *)luaM_newobj(sizeof(TProtoFunc));
   f->code = NULL;
   f->lineDefined = 0;
   f->fileName = NULL;
   f->consts = NULL;
   f->nconsts = 0;
   f->locvars = NULL;
+  f->fieldcache = NULL;
+#ifdef LUA_PROFILER
+  f->prof = NULL;
+#endif
   luaO_insertlist(&(L->rootproto), (GCnode *)f);
   L->nblocks += gcsizeproto(f);
   return f;
@@ -46,7 +52,22 @@ static void freefunc (TProtoFunc *f)
   luaM_free(f->code);
   luaM_free(f->locvars);
   luaM_free(f->consts);
-  luaM_free(f);
+  luaM_free(f->fieldcache);
+  luaM_freeobj(f, sizeof(TProtoFunc));
+}
+
+
+/*
+** Made when the function first reads a field; its constants do not
+** change once it runs.
+*/
+int32 *luaF_newfieldcache (TProtoFunc *f)
+{
+  int32 i;
+  f->fieldcache = luaM_newvector(f->nconsts, int32);
+  for (i=0; i<f->nconsts; i++)
+    f->fieldcache[i] = 0;
+  return f->fieldcache;
 }
 
 
@@ -66,7 +87,7 @@ void luaF_freeclosure (Closure *l)
   while (l) {
     Closure *next = (Closure *)l->head.next;
     L->nblocks -= gcsizeclosure(l);
-    luaM_free(l);
+    luaM_freeobj(l, closuresize(l->nelems));
     l = next;
   }
 }
@@ -10,6 +10,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lprofile.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -156,6 +157,31 @@ static GCnode *listcollect (GCnode *l)
 }
 
 
+/*
+** Marking is tri-color: white objects have marked==0, gray ones (GRAY)
+** are reached but have children left to visit and sit on L->gray, and
+** black ones (marked==1) are done.  Strings have no children and go
+** straight to black.  A cycle can be run in steps (lua_gcstep); tables
+** are the only mutable containers reached from black objects, and
+** luaH_set turns a black table gray again (luaC_barrierback).  Every
+** other root (stacks, globals, locks, tag methods) is rescanned by the
+** atomic step that ends marking and unlinks the dead objects.  Calling
+** their GC tag methods and freeing them, which is where most of a
+** collection's time goes, then proceeds in steps again.
+*/
+
+#define GRAY		3
+
+static void pushgray (TObject *o)
+{
+  if (L->ngray >= L->graysize) {
+    L->graysize = (L->graysize == 0) ? 64 : 2*L->graysize;
+    L->gray = luaM_reallocvector(L->gray, L->graysize, TObject);
+  }
+  L->gray[L->ngray++] = *o;
+}
+
+
 static void strmark (TaggedString *s)
 {
   if (!s->head.marked)
@@ -163,49 +189,64 @@ static void strmark (TaggedString *s)
 }
 
 
-static void protomark (TProtoFunc *f)
+static void shade (GCnode *head, lua_Type t, void *v)
 {
-  if (!f->head.marked) {
-    LocVar *v = f->locvars;
-    int32 i;
-    f->head.marked = 1;
-    if (f->fileName)
-      strmark(f->fileName);
-    for (i=0; i<f->nconsts; i++)
-      markobject(&f->consts[i]);
-    if (v) {
-      for (; v->line != -1; v++)
-        if (v->varname)
-          strmark(v->varname);
+  if (!head->marked) {
+    TObject o;
+    head->marked = GRAY;
+    ttype(&o) = t;
+    switch (t) {
+      case LUA_T_ARRAY: avalue(&o) = (Hash *)v; break;
+      case LUA_T_CLOSURE: o.value.cl = (Closure *)v; break;
+      default: o.value.tf = (TProtoFunc *)v; break;
     }
+    pushgray(&o);
   }
 }
 
 
-static void closuremark (Closure *f)
+static int32 protomark (TProtoFunc *f)
 {
-  if (!f->head.marked) {
-    int32 i;
-    f->head.marked = 1;
-    for (i=f->nelems; i>=0; i--)
-      markobject(&f->consts[i]);
+  LocVar *v = f->locvars;
+  int32 i;
+  f->head.marked = 1;
+  if (f->fileName)
+    strmark(f->fileName);
+  for (i=0; i<f->nconsts; i++)
+    markobject(&f->consts[i]);
+  if (v) {
+    for (; v->line != -1; v++)
+      if (v->varname)
+        strmark(v->varname);
   }
+  return 1+f->nconsts;
+}
+
+
+static int32 closuremark (Closure *f)
+{
+  int32 i;
+  f->head.marked = 1;
+  for (i=f->nelems; i>=0; i--)
+    markobject(&f->consts[i]);
+  return 2+f->nelems;
 }
 
 
-static void hashmark (Hash *h)
+static int32 hashmark (Hash *h)
 {
-  if (!h->head.marked) {
-    int32 i;
-    h->head.marked = 1;
-    for (i=0; i<nhash(h); i++) {
-      Node *n = node(h,i);
-      if (ttype(ref(n)) != LUA_T_NIL) {
-        markobject(&n->ref);
-        markobject(&n->val);
-      }
+  int32 i;
+  h->head.marked = 1;
+  for (i=0; i<narray(h); i++)
+    markobject(val(anode(h,i)));
+  for (i=0; i<nhash(h); i++) {
+    Node *n = node(h,i);
+    if (ttype(ref(n)) != LUA_T_NIL) {
+      markobject(&n->ref);
+      markobject(&n->val);
     }
   }
+  return 1+narray(h)+nhash(h);
 }
 
 
@@ -229,13 +270,13 @@ static int32 markobject (TObject *o)
       strmark(tsvalue(o));
       break;
     case LUA_T_ARRAY:
-      hashmark(avalue(o));
+      shade(&avalue(o)->head, LUA_T_ARRAY, avalue(o));
       break;
     case LUA_T_CLOSURE:  case LUA_T_CLMARK:
-      closuremark(o->value.cl);
+      shade(&o->value.cl->head, LUA_T_CLOSURE, o->value.cl);
       break;
     case LUA_T_PROTO: case LUA_T_PMARK:
-      protomark(o->value.tf);
+      shade(&o->value.tf->head, LUA_T_PROTO, o->value.tf);
       break;
     default: break;  /* numbers, cprotos, etc */
   }
@@ -243,6 +284,27 @@ static int32 markobject (TObject *o)
 }
 
 
+/*
+** Blacken gray objects until about 'work' slots have been visited, or
+** until the gray list is empty if work is negative.  Returns true when
+** it is empty.
+*/
+static int32 propagate (int32 work)
+{
+  int32 all = (work < 0);
+  while (L->ngray > 0) {
+    TObject o = L->gray[--L->ngray];
+    switch (ttype(&o)) {
+      case LUA_T_ARRAY: work -= hashmark(avalue(&o)); break;
+      case LUA_T_CLOSURE: work -= closuremark(o.value.cl); break;
+      default: work -= protomark(o.value.tf); break;
+    }
+    if (!all && work <= 0)
+      break;
+  }
+  return L->ngray == 0;
+}
+
 
 static void markall (void)
 {
@@ -253,36 +315,185 @@ static void markall (void)
 }
 
 
-int32 lua_collectgarbage (int32 limit)
+void luaC_barrierback (Hash *t)
+{
+  TObject o;
+  t->head.marked = GRAY;
+  ttype(&o) = LUA_T_ARRAY;
+  avalue(&o) = t;
+  pushgray(&o);
+}
+
+
+/*
+** End marking: rescan the roots, finish the gray list and unlink every
+** dead object into the lists that callIMs and release work through.
+*/
+static void atomic (void)
 {
-  int32 recovered = L->nblocks;  /* to subtract nblocks after gc */
-  Hash *freetable;
-  TaggedString *freestr;
-  TProtoFunc *freefunc;
-  Closure *freeclos;
   markall();
+  propagate(-1);
   invalidaterefs();
-  freestr = luaS_collector();
-  freetable = (Hash *)listcollect(&(L->roottable));
-  freefunc = (TProtoFunc *)listcollect(&(L->rootproto));
-  freeclos = (Closure *)listcollect(&(L->rootcl));
-  L->GCthreshold *= 4;  /* to avoid GC during GC */
-  luaC_hashcallIM(freetable);  /* GC tag methods for tables */
-  luaC_strcallIM(freestr);  /* GC tag methods for userdata */
+  L->freestr = luaS_collector();
+  L->freetable = (Hash *)listcollect(&(L->roottable));
+  L->freeproto = (TProtoFunc *)listcollect(&(L->rootproto));
+  L->freecl = (Closure *)listcollect(&(L->rootcl));
+  L->imtable = L->freetable;
+  L->imudata = L->freestr;
+  L->GCstate = GCcallIM;
+}
+
+
+/*
+** Call the GC tag methods of up to 'work' dead tables and userdata; all
+** of them run before anything is freed.  Returns true when done.
+*/
+static int32 callIMs (int32 work)
+{
+  TObject o;
+  while (L->imtable && work-- > 0) {
+    ttype(&o) = LUA_T_ARRAY;
+    avalue(&o) = L->imtable;
+    L->imtable = (Hash *)L->imtable->head.next;
+    luaD_gcIM(&o);
+  }
+  while (L->imudata && work-- > 0) {
+    TaggedString *ts = L->imudata;
+    L->imudata = (TaggedString *)ts->head.next;
+    if (ts->constindex == -1) {  /* is userdata? */
+      ttype(&o) = LUA_T_USERDATA;
+      tsvalue(&o) = ts;
+      luaD_gcIM(&o);
+    }
+  }
+  if (L->imtable || L->imudata)
+    return 0;
   luaD_gcIM(&luaO_nilobject);  /* GC tag method for nil (signal end of GC) */
-  luaH_free(freetable);
-  luaS_free(freestr);
-  luaF_freeproto(freefunc);
-  luaF_freeclosure(freeclos);
-  recovered = recovered-L->nblocks;
-  L->GCthreshold = (limit == 0) ? 2*L->nblocks : L->nblocks+limit;
-  return recovered;
+  return 1;
+}
+
+
+/*
+** Free up to 'work' dead objects.  Returns true when none are left.
+*/
+static int32 release (int32 work)
+{
+  while (L->freetable && work-- > 0) {
+    Hash *t = L->freetable;
+    L->freetable = (Hash *)t->head.next;
+    t->head.next = NULL;
+    luaH_free(t);
+  }
+  while (L->freestr && work-- > 0) {
+    TaggedString *ts = L->freestr;
+    L->freestr = (TaggedString *)ts->head.next;
+    ts->head.next = NULL;
+    luaS_free(ts);
+  }
+  while (L->freeproto && work-- > 0) {
+    TProtoFunc *f = L->freeproto;
+    L->freeproto = (TProtoFunc *)f->head.next;
+    f->head.next = NULL;
+    luaF_freeproto(f);
+  }
+  while (L->freecl && work-- > 0) {
+    Closure *c = L->freecl;
+    L->freecl = (Closure *)c->head.next;
+    c->head.next = NULL;
+    luaF_freeclosure(c);
+  }
+  return !L->freetable && !L->freestr && !L->freeproto && !L->freecl;
+}
+
+
+/*
+** Do about 'work' units of collection (negative: finish the cycle).
+** Returns true if the cycle ended.
+*/
+static int32 gcstep (int32 work, int32 limit)
+{
+  int32 threshold = L->GCthreshold;
+  if (L->GCbusy)
+    return 0;  /* called from a GC tag method */
+  L->GCbusy = 1;
+  L->GCthreshold = MAX_INT;  /* to avoid GC during GC */
+  switch (L->GCstate) {
+    case GCpause:
+      markall();
+      L->GCstate = GCpropagate;
+      /* fall through */
+    case GCpropagate:
+      if (!propagate(work))
+        break;
+      atomic();
+      /* fall through */
+    case GCcallIM:
+      if (!callIMs(work < 0 ? MAX_INT : work))
+        break;
+      L->GCstate = GCrelease;
+      /* fall through */
+    case GCrelease:
+      if (!release(work < 0 ? MAX_INT : work))
+        break;
+      L->GCstate = GCpause;
+      L->GCthreshold = (limit == 0) ? 2*L->nblocks : L->nblocks+limit;
+      L->GCbusy = 0;
+      return 1;
+  }
+  L->GCthreshold = threshold;
+  L->GCbusy = 0;
+  return 0;
+}
+
+
+#ifdef LUA_PROFILER
+/* Every step keeps the scripts waiting, so each one counts as a pause */
+static int32 timedgcstep (int32 work, int32 limit)
+{
+  double start = luaP_clock();
+  int32 done = gcstep(work, limit);
+  luaP_gcpause(luaP_clock()-start);
+  return done;
+}
+
+#define gcstep	timedgcstep
+#endif
+
+
+int32 lua_collectgarbage (int32 limit)
+{
+  int32 recovered = L->nblocks;  /* to subtract nblocks after gc */
+  if (L->GCstate == GCcallIM || L->GCstate == GCrelease)
+    gcstep(-1, 0);  /* finish the last cycle before starting one */
+  gcstep(-1, limit);
+  return recovered-L->nblocks;
+}
+
+
+/*
+** Advance the collector by about 'work' slots or objects, starting a
+** cycle if none is in progress.  Meant for the host's idle time; returns
+** 1 when this step finished a cycle.
+*/
+int32 lua_gcstep (int32 work)
+{
+  return gcstep(work > 0 ? work : 1, 0);
+}
+
+
+void lua_setgcstepsize (int32 work)
+{
+  L->GCstepsize = work;
 }
 
 
 void luaC_checkGC (void)
 {
-  if (L->nblocks >= L->GCthreshold)
+  if (L->GCstepsize > 0) {
+    /* a running cycle keeps pace with allocation */
+    if (L->GCstate != GCpause || L->nblocks >= L->GCthreshold)
+      lua_gcstep(L->GCstepsize);
+  }
+  else if (L->nblocks >= L->GCthreshold)
     lua_collectgarbage(0);
 }
-
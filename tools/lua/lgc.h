@@ -16,6 +16,17 @@ TObject* luaC_getref (int32 ref);
 int32 luaC_ref (TObject *o, int32 lock);
 void luaC_hashcallIM (Hash *l);
 void luaC_strcallIM (TaggedString *l);
+void luaC_barrierback (Hash *t);
+
+/* values of L->GCstate */
+#define GCpause		0	/* no cycle in progress */
+#define GCpropagate	1	/* roots shaded, working through the gray list */
+#define GCcallIM	2	/* dead objects unlinked, calling GC tag methods */
+#define GCrelease	3	/* freeing the dead objects */
+
+/* a black table being written to must be visited again */
+#define luaC_barrier(t) \
+	{ if ((t)->head.marked == 1 && L->GCstate == GCpropagate) luaC_barrierback(t); }
 
 
 #endif
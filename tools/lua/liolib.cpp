@@ -163,15 +163,66 @@ static void io_appendto (void)
 #define NEED_OTHER (EOF-1)  /* just some flag different from EOF */
 
 
-static void read_until (FILE *f, int32 lim) {
+#define READ_STEP	1024
+
+
+/*
+** Read a line, without its '\n'.  With POSIX, getline scans the stdio
+** buffer for the '\n' block by block; otherwise the characters go
+** straight into the buffer, which grows READ_STEP at a time.
+*/
+static void read_line (FILE *f) {
+#ifdef POSIX
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t l = getline(&line, &size, f);
+  if (l > 0 && line[l-1] == '\n')
+    l--;
+  if (l >= 0)  /* read anything? */
+    lua_pushlstring(line, l);
+  free(line);
+#else
   int32 l = 0;
-  int32 c;
-  for (c = getc(f); c != EOF && c != lim; c = getc(f)) {
-    luaL_addchar(c);
-    l++;
+  int32 c = EOF;
+  for (;;) {
+    char *b = luaL_openspace(READ_STEP);
+    int32 n = 0;
+    while (n < READ_STEP && (c = getc(f)) != EOF && c != '\n')
+      b[n++] = (char)c;
+    luaL_addsize(n);
+    l += n;
+    if (n < READ_STEP)
+      break;
   }
-  if (l > 0 || c == lim)  /* read anything? */
+  if (l > 0 || c == '\n')  /* read anything? */
     lua_pushlstring(luaL_buffer(), l);
+#endif
+}
+
+
+/*
+** Read the rest of the file.  For a file that can seek, the first block
+** is what remains of it, so a single fread usually does.
+*/
+static void read_all (FILE *f) {
+  int32 l = 0;
+  int32 step = READ_STEP;
+  long here = ftell(f);
+  if (here >= 0 && fseek(f, 0, SEEK_END) == 0) {
+    long end = ftell(f);
+    if (fseek(f, here, SEEK_SET) == 0 && end > here && end-here < 0x7ffffffeL)
+      step = (int32)(end-here)+1;  /* +1 to see the end of file */
+  }
+  for (;;) {
+    char *b = luaL_openspace(step);
+    int32 n = (int32)fread(b, 1, step, f);
+    luaL_addsize(n);
+    l += n;
+    if (n < step)
+      break;
+    step = READ_STEP;
+  }
+  lua_pushlstring(luaL_buffer(), l);
 }
 
 static void io_read (void) {
@@ -180,9 +231,9 @@ static void io_read (void) {
   const char *p = luaL_opt_string(arg, NULL);
   luaL_resetbuffer();
   if (p == NULL)  /* default: read a line */
-    read_until(f, '\n');
+    read_line(f);
   else if (p[0] == '.' && p[1] == '*' && p[2] == 0)  /* p = ".*" */
-    read_until(f, EOF);
+    read_all(f);
   else {
     int32 l = 0;  /* number of chars read in buffer */
     int32 inskip = 0;  /* to control {skips} */
@@ -0,0 +1,151 @@
+/*
+** Jump table of luaV_execute with USE_COMPUTED_GOTO, included in its body
+** One label per opcode, in the order of OpCode in lopcodes.h
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljumptab_h
+#define ljumptab_h
+
+static const void *const disptab[] = {
+  &&L_ENDCODE,
+  &&L_PUSHNIL,
+  &&L_PUSHNIL0,
+  &&L_PUSHNUMBER,
+  &&L_PUSHNUMBER0,
+  &&L_PUSHNUMBER1,
+  &&L_PUSHNUMBER2,
+  &&L_PUSHNUMBERW,
+  &&L_PUSHCONSTANT,
+  &&L_PUSHCONSTANT0,
+  &&L_PUSHCONSTANT1,
+  &&L_PUSHCONSTANT2,
+  &&L_PUSHCONSTANT3,
+  &&L_PUSHCONSTANT4,
+  &&L_PUSHCONSTANT5,
+  &&L_PUSHCONSTANT6,
+  &&L_PUSHCONSTANT7,
+  &&L_PUSHCONSTANTW,
+  &&L_PUSHUPVALUE,
+  &&L_PUSHUPVALUE0,
+  &&L_PUSHUPVALUE1,
+  &&L_PUSHLOCAL,
+  &&L_PUSHLOCAL0,
+  &&L_PUSHLOCAL1,
+  &&L_PUSHLOCAL2,
+  &&L_PUSHLOCAL3,
+  &&L_PUSHLOCAL4,
+  &&L_PUSHLOCAL5,
+  &&L_PUSHLOCAL6,
+  &&L_PUSHLOCAL7,
+  &&L_GETGLOBAL,
+  &&L_GETGLOBAL0,
+  &&L_GETGLOBAL1,
+  &&L_GETGLOBAL2,
+  &&L_GETGLOBAL3,
+  &&L_GETGLOBAL4,
+  &&L_GETGLOBAL5,
+  &&L_GETGLOBAL6,
+  &&L_GETGLOBAL7,
+  &&L_GETGLOBALW,
+  &&L_GETTABLE,
+  &&L_GETDOTTED,
+  &&L_GETDOTTED0,
+  &&L_GETDOTTED1,
+  &&L_GETDOTTED2,
+  &&L_GETDOTTED3,
+  &&L_GETDOTTED4,
+  &&L_GETDOTTED5,
+  &&L_GETDOTTED6,
+  &&L_GETDOTTED7,
+  &&L_GETDOTTEDW,
+  &&L_PUSHSELF,
+  &&L_PUSHSELF0,
+  &&L_PUSHSELF1,
+  &&L_PUSHSELF2,
+  &&L_PUSHSELF3,
+  &&L_PUSHSELF4,
+  &&L_PUSHSELF5,
+  &&L_PUSHSELF6,
+  &&L_PUSHSELF7,
+  &&L_PUSHSELFW,
+  &&L_CREATEARRAY,
+  &&L_CREATEARRAY0,
+  &&L_CREATEARRAY1,
+  &&L_CREATEARRAYW,
+  &&L_SETLOCAL,
+  &&L_SETLOCAL0,
+  &&L_SETLOCAL1,
+  &&L_SETLOCAL2,
+  &&L_SETLOCAL3,
+  &&L_SETLOCAL4,
+  &&L_SETLOCAL5,
+  &&L_SETLOCAL6,
+  &&L_SETLOCAL7,
+  &&L_SETGLOBAL,
+  &&L_SETGLOBAL0,
+  &&L_SETGLOBAL1,
+  &&L_SETGLOBAL2,
+  &&L_SETGLOBAL3,
+  &&L_SETGLOBAL4,
+  &&L_SETGLOBAL5,
+  &&L_SETGLOBAL6,
+  &&L_SETGLOBAL7,
+  &&L_SETGLOBALW,
+  &&L_SETTABLE0,
+  &&L_SETTABLE,
+  &&L_SETLIST,
+  &&L_SETLIST0,
+  &&L_SETLISTW,
+  &&L_SETMAP,
+  &&L_SETMAP0,
+  &&L_EQOP,
+  &&L_NEQOP,
+  &&L_LTOP,
+  &&L_LEOP,
+  &&L_GTOP,
+  &&L_GEOP,
+  &&L_ADDOP,
+  &&L_SUBOP,
+  &&L_MULTOP,
+  &&L_DIVOP,
+  &&L_POWOP,
+  &&L_CONCOP,
+  &&L_MINUSOP,
+  &&L_NOTOP,
+  &&L_ONTJMP,
+  &&L_ONTJMPW,
+  &&L_ONFJMP,
+  &&L_ONFJMPW,
+  &&L_JMP,
+  &&L_JMPW,
+  &&L_IFFJMP,
+  &&L_IFFJMPW,
+  &&L_IFTUPJMP,
+  &&L_IFTUPJMPW,
+  &&L_IFFUPJMP,
+  &&L_IFFUPJMPW,
+  &&L_CLOSURE,
+  &&L_CLOSURE0,
+  &&L_CLOSURE1,
+  &&L_CALLFUNC,
+  &&L_CALLFUNC0,
+  &&L_CALLFUNC1,
+  &&L_RETCODE,
+  &&L_SETLINE,
+  &&L_SETLINEW,
+  &&L_POP,
+  &&L_POP0,
+  &&L_POP1,
+  &&L_LOCALDOTTED,
+  &&L_LOCALDOTTEDN,
+  &&L_CALLGLOBAL,
+  &&L_IFFCMPJMP,
+  &&L_IFTCMPUPJMP
+};
+
+/* A new opcode needs a label here as well */
+typedef char disptab_matches_opcodes[sizeof(disptab)/sizeof(disptab[0]) == IFTCMPUPJMP+1 ? 1 : -1];
+(void)sizeof(disptab_matches_opcodes);
+
+#endif
@@ -17,7 +17,7 @@
 
 
 
-int32 lua_debug=0;
+LUA_THREAD int32 lua_debug=0;
 
 
 #define next(LS) (LS->current = zgetc(LS->lex_z))
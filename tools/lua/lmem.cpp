@@ -26,6 +26,78 @@ int32 luaM_growaux (void **block, int32 nelems, int32 size,
 
 
 
+#ifndef LUA_NOPOOL
+
+/*
+** Blocks of up to POOLMAX bytes are rounded up to a multiple of POOLGRAIN
+** and carved out of POOLCHUNK-byte chunks, one size class per chunk.
+** Freed blocks go to the free list of their class and are reused; chunks
+** are never given back.  Larger blocks go straight to luaM_realloc.
+** The free lists are per thread, like the state whose objects they hold.
+*/
+#define POOLGRAIN	16
+#define POOLMAX		256
+#define POOLCHUNK	16384
+
+typedef union PoolBlock {
+  union PoolBlock *next;  /* while in a free list */
+  double align;
+} PoolBlock;
+
+static LUA_THREAD PoolBlock *freeblocks[POOLMAX/POOLGRAIN];
+
+LUA_THREAD int32 poolmem = 0;
+LUA_THREAD int32 poolinuse = 0;
+
+
+static void newchunk (int32 c)
+{
+  int32 size = (c+1)*POOLGRAIN;
+  char *chunk = (char *)luaM_realloc(NULL, POOLCHUNK);
+  int32 i;
+  for (i=POOLCHUNK/size-1; i>=0; i--) {  /* lower addresses first out */
+    PoolBlock *b = (PoolBlock *)(chunk+i*size);
+    b->next = freeblocks[c];
+    freeblocks[c] = b;
+  }
+  poolmem += POOLCHUNK;
+}
+
+
+void *luaM_poolalloc (int32 size)
+{
+  int32 c = (size-1)/POOLGRAIN;
+  PoolBlock *b;
+  if (size > POOLMAX)
+    return luaM_realloc(NULL, size);
+  if (freeblocks[c] == NULL)
+    newchunk(c);
+  b = freeblocks[c];
+  freeblocks[c] = b->next;
+  poolinuse += (c+1)*POOLGRAIN;
+  return b;
+}
+
+
+void luaM_poolfree (void *block, int32 size)
+{
+  int32 c = (size-1)/POOLGRAIN;
+  PoolBlock *b = (PoolBlock *)block;
+  if (block == NULL)
+    return;
+  if (size > POOLMAX) {
+    luaM_realloc(block, 0);
+    return;
+  }
+  b->next = freeblocks[c];
+  freeblocks[c] = b;
+  poolinuse -= (c+1)*POOLGRAIN;
+}
+
+#endif
+
+
+
 #ifndef DEBUG
 
 /*
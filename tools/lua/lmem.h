@@ -7,7 +7,7 @@
 #ifndef lmem_h
 #define lmem_h
 
-#include "common/scummsys.h"
+#include "lua.h"
 
 
 #ifndef NULL
@@ -34,6 +34,24 @@ int32 luaM_growaux (void **block, int32 nelems, int32 size,
           (luaM_growaux((void**)old,n,sizeof(t),e,l))
 #define luaM_reallocvector(v,n,t) ((t *)realloc(v,(n)*sizeof(t)))
 
+/*
+** GC objects (strings, tables and their nodes, closures, prototypes) come
+** from size classes; the size must be given back when freeing them.
+** Define LUA_NOPOOL to use plain malloc instead.
+*/
+#ifndef LUA_NOPOOL
+void *luaM_poolalloc (int32 size);
+void luaM_poolfree (void *block, int32 size);
+extern LUA_THREAD int32 poolmem;  /* bytes taken from malloc for the size classes */
+extern LUA_THREAD int32 poolinuse;  /* bytes of them handed out */
+#define luaM_newobj(s)		luaM_poolalloc(s)
+#define luaM_freeobj(b,s)	luaM_poolfree((b),(s))
+#else
+#define luaM_newobj(s)		luaM_malloc(s)
+#define luaM_freeobj(b,s)	luaM_free(b)
+#endif
+#define luaM_newobjvector(n,t)	((t *)luaM_newobj((n)*sizeof(t)))
+
 
 #ifdef DEBUG
 extern int32 numblocks;
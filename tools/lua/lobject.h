@@ -134,6 +134,10 @@ typedef struct TProtoFunc {
   int32 lineDefined;
   TaggedString  *fileName;
   struct LocVar *locvars;  /* ends with line = -1 */
+  int32 *fieldcache;  /* per constant, the hash node it was last found at */
+#ifdef LUA_PROFILER
+  struct ProfProto *prof;  /* NULL until first called */
+#endif
 } TProtoFunc;
 
 typedef struct LocVar {
@@ -180,6 +184,8 @@ typedef struct Hash {
   int32 nhash;
   int32 nuse;
   int32 htag;
+  Node *array;  /* keys 1..narray; ref holds the key, nil val is absent */
+  int32 narray;
 } Hash;
 
 
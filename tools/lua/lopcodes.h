@@ -169,7 +169,19 @@ SETLINEW,/*	w	-		-		LINE=w  */
 
 POP,/*		b	-		-		TOP-=(b+1)  */
 POP0,/*		-	-		-		TOP-=1  */
-POP1/*		-	-		-		TOP-=2  */
+POP1,/*		-	-		-		TOP-=2  */
+
+/*
+** Superinstructions: fused pairs emitted only by "luac -F", in chunks
+** dumped with VERSION_FUSED.  They must stay after every stock opcode.
+*/
+LOCALDOTTED,/*	b c	-		LOC[b][CNST[c]]  */
+LOCALDOTTEDN,/*	b	-		LOC[b&15][CNST[b>>4]]  */
+
+CALLGLOBAL,/*	b c	-		r_c...r_1	VAR[CNST[b]]()  */
+
+IFFCMPJMP,/*	b c	y x		-		(x op_b y)==nil? PC+=c  */
+IFTCMPUPJMP/*	b c	y x		-		(x op_b y)!=nil? PC-=c  */
 
 } OpCode;
 
@@ -0,0 +1,318 @@
+/*
+** $Id$
+** Profiling counters of the Lua VM (configure --enable-lua-profiler)
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lmem.h"
+#include "lopcodes.h"
+#include "lprofile.h"
+#include "lstate.h"
+#include "lua.h"
+#include "luadebug.h"
+
+#ifdef LUA_PROFILER
+
+#ifdef POSIX
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+
+/*
+** luaD_precall counts every call of a Lua function and charges it to a
+** node of the call tree; its RETCODE adds the time since the call.  Times
+** run on a clock per task, which stands still while the task is
+** suspended, so a script waiting in break_here is not charged for the
+** tasks that ran meanwhile.  Calls cut short by an error are counted, but
+** their time is lost.
+*/
+
+static const struct { const char *name; int32 size, op, op_class, arg, arg2; }
+opinfo[] = {			/* ORDER lopcodes.h */
+#include "tools/luac/opcode.h"
+};
+
+#define NOPCODES	((int32)(sizeof(opinfo)/sizeof(opinfo[0])))
+
+
+double luaP_clock (void)
+{
+#ifdef POSIX
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+void luaP_open (void)
+{
+  ProfState *P = luaM_new(ProfState);
+  memset(P, 0, sizeof(ProfState));
+  L->prof = P;
+}
+
+
+static void freenodes (ProfNode *n)
+{
+  while (n) {
+    ProfNode *next = n->sibling;
+    freenodes(n->child);
+    luaM_free(n);
+    n = next;
+  }
+}
+
+void luaP_close (void)
+{
+  ProfState *P = L->prof;
+  while (P->protos) {
+    ProfProto *next = P->protos->next;
+    luaM_free(P->protos->name);
+    luaM_free(P->protos);
+    P->protos = next;
+  }
+  freenodes(P->root.child);
+  luaM_free(P);
+  L->prof = NULL;
+}
+
+
+static ProfProto *newproto (TProtoFunc *tf)
+{
+  ProfProto *p = luaM_new(ProfProto);
+  const char *file = tf->fileName ? tf->fileName->str : "?";
+  p->name = (char *)luaM_malloc(strlen(file)+16);
+  if (tf->lineDefined == 0)
+    sprintf(p->name, "%s:main", file);
+  else
+    sprintf(p->name, "%s:%d", file, (int)tf->lineDefined);
+  p->calls = 0;
+  p->time = 0;
+  p->next = L->prof->protos;
+  L->prof->protos = p;
+  return p;
+}
+
+static ProfNode *newnode (ProfNode *parent, ProfProto *p)
+{
+  ProfNode *n = luaM_new(ProfNode);
+  ProfNode *up;
+  n->proto = p;
+  n->parent = parent;
+  n->child = NULL;
+  n->sibling = parent->child;
+  parent->child = n;
+  n->recursive = 0;
+  for (up = parent; up != NULL; up = up->parent)
+    if (up->proto == p)
+      n->recursive = 1;
+  n->calls = 0;
+  n->time = 0;
+  return n;
+}
+
+
+/*
+** Called by luaD_precall once L->ci is set up; C functions take the node
+** of their caller, so the Lua functions they call hang below it.
+*/
+void luaP_call (void)
+{
+  ProfState *P = L->prof;
+  struct CallInfo *ci = L->ci;
+  ProfNode *parent = (ci-1)->profnode;
+  ProfNode *n;
+  ProfProto *p;
+  if (parent == NULL)  /* first call of a task */
+    parent = &P->root;
+  if (ci->tf == NULL) {
+    ci->profnode = parent;
+    return;
+  }
+  p = ci->tf->prof;
+  if (p == NULL)
+    p = ci->tf->prof = newproto(ci->tf);
+  for (n = parent->child; n != NULL && n->proto != p; n = n->sibling)
+    ;
+  if (n == NULL)
+    n = newnode(parent, p);
+  p->calls++;
+  n->calls++;
+  ci->profnode = n;
+  ci->profstart = luaP_clock() - P->skew;
+}
+
+
+void luaP_return (struct CallInfo *ci)
+{
+  ProfNode *n = ci->profnode;
+  double t = luaP_clock() - L->prof->skew - ci->profstart;
+  n->time += t;
+  if (!n->recursive)
+    n->proto->time += t;
+}
+
+
+void luaP_gcpause (double seconds)
+{
+  ProfState *P = L->prof;
+  double us = seconds * 1000000.0;
+  int32 b = 0;
+  while (b < PROF_GCBUCKETS-1 && us >= (double)(1L<<b))
+    b++;
+  P->gcpauses[b]++;
+  P->ngc++;
+  P->gctime += seconds;
+}
+
+
+void luaP_savetask (struct lua_Task *t)
+{
+  t->profskew = L->prof->skew;
+  t->profclock = luaP_clock();
+}
+
+void luaP_loadtask (struct lua_Task *t)
+{
+  L->prof->skew = t->profskew + (luaP_clock() - t->profclock);
+}
+
+
+static void resetnodes (ProfNode *n)
+{
+  for (; n != NULL; n = n->sibling) {
+    n->calls = 0;
+    n->time = 0;
+    resetnodes(n->child);
+  }
+}
+
+/* Zero the counters; functions and call paths already seen stay known */
+void lua_resetprofile (void)
+{
+  ProfState *P = L->prof;
+  ProfProto *p;
+  memset(P->ops, 0, sizeof(P->ops));
+  for (p = P->protos; p != NULL; p = p->next) {
+    p->calls = 0;
+    p->time = 0;
+  }
+  resetnodes(P->root.child);
+  memset(P->gcpauses, 0, sizeof(P->gcpauses));
+  P->ngc = 0;
+  P->gctime = 0;
+  P->taskswitches = 0;
+}
+
+
+static void dumpname (FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < ' ')
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void dumpjson (FILE *f)
+{
+  ProfState *P = L->prof;
+  ProfProto *p;
+  const char *sep = "";
+  int32 i, last;
+  fprintf(f, "{\n  \"opcodes\": {");
+  for (i = 0; i < NOPCODES; i++) {
+    if (P->ops[opinfo[i].op] == 0)
+      continue;
+    fprintf(f, "%s\n    \"%s\": %lu", sep, opinfo[i].name,
+            (unsigned long)P->ops[opinfo[i].op]);
+    sep = ",";
+  }
+  fprintf(f, "\n  },\n  \"functions\": [");
+  sep = "";
+  for (p = P->protos; p != NULL; p = p->next) {
+    if (p->calls == 0)
+      continue;
+    fprintf(f, "%s\n    { \"name\": ", sep);
+    dumpname(f, p->name);
+    fprintf(f, ", \"calls\": %lu, \"time\": %.6f }",
+            (unsigned long)p->calls, p->time);
+    sep = ",";
+  }
+  fprintf(f, "\n  ],\n  \"gc\": {\n    \"pauses\": %lu,\n    \"time\": %.6f,\n"
+          "    \"histogram\": [", (unsigned long)P->ngc, P->gctime);
+  for (last = PROF_GCBUCKETS-1; last >= 0 && P->gcpauses[last] == 0; last--)
+    ;
+  for (i = 0; i <= last; i++)
+    fprintf(f, "%s\n      { \"under_us\": %ld, \"count\": %lu }",
+            i ? "," : "", 1L<<i, (unsigned long)P->gcpauses[i]);
+  fprintf(f, "\n    ]\n  },\n  \"taskswitches\": %lu\n}\n",
+          (unsigned long)P->taskswitches);
+}
+
+
+/*
+** One line per call path with its self time in microseconds; frames that
+** are still running have no time yet.
+*/
+static void dumpstacks (FILE *f, ProfNode *n, char **path, size_t *size,
+                        size_t len)
+{
+  ProfNode *c;
+  for (c = n->child; c != NULL; c = c->sibling) {
+    size_t l = len + (len ? 1 : 0) + strlen(c->proto->name);
+    double self = c->time;
+    ProfNode *g;
+    long us;
+    char *s;
+    if (l+1 > *size) {
+      *size = 2*(l+1);
+      *path = (char *)luaM_realloc(*path, *size);
+    }
+    s = *path + len;
+    if (len)
+      *s++ = ';';
+    strcpy(s, c->proto->name);
+    for (; *s; s++)
+      if (*s == ';') *s = ':';  /* the frame separator */
+    for (g = c->child; g != NULL; g = g->sibling)
+      self -= g->time;
+    us = (long)(self * 1000000.0 + 0.5);
+    if (us > 0)
+      fprintf(f, "%s %ld\n", *path, us);
+    dumpstacks(f, c, path, size, l);
+  }
+}
+
+
+/*
+** Write the counters in the given format; returns 0 on success
+*/
+int32 lua_dumpprofile (FILE *f, int32 format)
+{
+  if (format == LUA_PROFILE_STACKS) {
+    size_t size = 256;
+    char *path = (char *)luaM_malloc(size);
+    dumpstacks(f, &L->prof->root, &path, &size, 0);
+    luaM_free(path);
+  }
+  else
+    dumpjson(f);
+  return ferror(f) ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+** $Id$
+** Profiling counters of the Lua VM (configure --enable-lua-profiler)
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lprofile_h
+#define lprofile_h
+
+
+#include "lstate.h"
+
+
+#ifdef LUA_PROFILER
+
+#define PROF_GCBUCKETS	24	/* GC pauses under 1us, 2us, ... 2^23us */
+
+/* Totals for one function; kept after the function is collected */
+typedef struct ProfProto {
+  struct ProfProto *next;
+  char *name;  /* "file:line" */
+  uint32 calls;
+  double time;  /* inclusive seconds, not counting recursive calls twice */
+} ProfProto;
+
+/* A node of the call tree: one function reached through one call path */
+typedef struct ProfNode {
+  ProfProto *proto;
+  struct ProfNode *parent;
+  struct ProfNode *child;  /* first callee */
+  struct ProfNode *sibling;  /* next callee of the parent */
+  int32 recursive;  /* proto is also on the path above */
+  uint32 calls;
+  double time;
+} ProfNode;
+
+typedef struct ProfState {
+  uint32 ops[256];  /* opcodes executed */
+  ProfProto *protos;
+  ProfNode root;
+  double skew;  /* time the current task has spent suspended */
+  uint32 gcpauses[PROF_GCBUCKETS];
+  uint32 ngc;
+  double gctime;
+  uint32 taskswitches;
+} ProfState;
+
+void luaP_open (void);
+void luaP_close (void);
+double luaP_clock (void);
+void luaP_call (void);
+void luaP_return (struct CallInfo *ci);
+void luaP_gcpause (double seconds);
+void luaP_savetask (struct lua_Task *t);
+void luaP_loadtask (struct lua_Task *t);
+
+#define luaP_taskswitch()	(L->prof->taskswitches++)
+
+#else
+
+#define luaP_call()		((void)0)
+#define luaP_return(ci)		((void)0)
+#define luaP_taskswitch()	((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/*
+** $Id$
+** Sampling profiler of the Lua VM
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lmem.h"
+#include "lsample.h"
+#include "lstate.h"
+#include "lua.h"
+#include "luadebug.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#include <time.h>
+#endif
+
+
+/*
+** A thread only raises luaP_sampledue; the VM takes the sample at its
+** next call, return or backward jump, where L->ci and the stack are
+** consistent.  A sample is the chain of Lua frames of the running task,
+** each as "file:linedefined@currentline", folded into one string that
+** counts how often it was seen.  The thread paces itself on the CPU clock of the
+** sampled thread, so a host waiting between frames adds nothing.  (An
+** interval timer would be simpler, but the kernel fires those at most
+** once a tick.)
+*/
+
+volatile int32 luaP_sampledue = 0;
+
+typedef struct Sample {
+  char *stack;  /* NULL for a free slot */
+  uint32 hash;
+  uint32 count;
+} Sample;
+
+struct Sampler {
+  Sample *samples;
+  int32 size;  /* power of two */
+  int32 nuse;
+  char *buff;  /* the stack being folded */
+  int32 buffsize;
+};
+
+static lua_State *owner = NULL;  /* state sampled, the flag is process-wide */
+
+#ifdef POSIX
+static pthread_t sampler;
+static volatile int32 sampling;
+static long interval;  /* nanoseconds between samples */
+static clockid_t cpuclock;
+static int32 hascpuclock;
+
+static double nanoseconds (clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void *samplerthread (void *arg)
+{
+  struct timespec wait;
+  double due = 0;
+  (void)arg;
+  wait.tv_sec = interval / 1000000000L;
+  wait.tv_nsec = interval % 1000000000L;
+  if (hascpuclock)
+    due = nanoseconds(cpuclock) + interval;
+  while (sampling) {
+    nanosleep(&wait, NULL);
+    if (!hascpuclock)
+      luaP_sampledue = 1;
+    else if (nanoseconds(cpuclock) >= due) {
+      luaP_sampledue = 1;
+      due = nanoseconds(cpuclock) + interval;
+    }
+  }
+  return NULL;
+}
+#endif
+
+
+static uint32 hashstack (const char *s)
+{
+  uint32 h = 5381;
+  for (; *s; s++)
+    h = h*33 ^ (unsigned char)*s;
+  return h;
+}
+
+static void growsamples (struct Sampler *S)
+{
+  Sample *old = S->samples;
+  int32 oldsize = S->size;
+  int32 i;
+  S->size = oldsize ? 2*oldsize : 256;
+  S->samples = luaM_newvector(S->size, Sample);
+  memset(S->samples, 0, S->size*sizeof(Sample));
+  for (i=0; i<oldsize; i++) {
+    if (old[i].stack) {
+      int32 h = old[i].hash & (S->size-1);
+      while (S->samples[h].stack)
+        h = (h+1) & (S->size-1);
+      S->samples[h] = old[i];
+    }
+  }
+  luaM_free(old);
+}
+
+static void addsample (struct Sampler *S, const char *stack)
+{
+  uint32 hash = hashstack(stack);
+  int32 h;
+  if (S->nuse+1 > S->size/2)
+    growsamples(S);
+  h = hash & (S->size-1);
+  while (S->samples[h].stack) {
+    if (S->samples[h].hash == hash && strcmp(S->samples[h].stack, stack) == 0) {
+      S->samples[h].count++;
+      return;
+    }
+    h = (h+1) & (S->size-1);
+  }
+  S->samples[h].stack = (char *)luaM_malloc(strlen(stack)+1);
+  strcpy(S->samples[h].stack, stack);
+  S->samples[h].hash = hash;
+  S->samples[h].count = 1;
+  S->nuse++;
+}
+
+
+/* The line a frame is at, kept in the LINE slot SETLINE opens at its base */
+static int32 frameline (struct CallInfo *ci)
+{
+  TObject *o = L->stack.stack + ci->base;
+  return (o < L->stack.top && ttype(o) == LUA_T_LINE) ? o->value.i : 0;
+}
+
+void luaP_sample (void)
+{
+  struct Sampler *S = L->sampler;
+  struct CallInfo *ci;
+  int32 len = 0;
+  if (S == NULL)
+    return;  /* another thread's state; leave the flag to the sampler */
+  luaP_sampledue = 0;
+  for (ci = L->base_ci; ci <= L->ci; ci++) {
+    TProtoFunc *tf = ci->tf;
+    const char *file;
+    char *s;
+    if (tf == NULL)
+      continue;
+    file = tf->fileName ? tf->fileName->str : "?";
+    if (len + (int32)strlen(file) + 32 > S->buffsize) {
+      S->buffsize = 2*(len + strlen(file) + 32);
+      S->buff = (char *)luaM_realloc(S->buff, S->buffsize);
+    }
+    s = S->buff + len;
+    if (len)
+      *s++ = ';';
+    strcpy(s, file);
+    for (; *s; s++)
+      if (*s == ';') *s = ':';  /* the frame separator */
+    if (tf->lineDefined == 0)
+      strcpy(s, ":main");
+    else
+      sprintf(s, ":%d", (int)tf->lineDefined);
+    s += strlen(s);
+    if (frameline(ci) > 0)  /* compiled with line information */
+      sprintf(s, "@%d", (int)frameline(ci));
+    len = (s - S->buff) + strlen(s);
+  }
+  if (len > 0)
+    addsample(S, S->buff);
+}
+
+
+static void clearsamples (struct Sampler *S)
+{
+  int32 i;
+  for (i=0; i<S->size; i++)
+    luaM_free(S->samples[i].stack);
+  luaM_free(S->samples);
+  S->samples = NULL;
+  S->size = S->nuse = 0;
+}
+
+
+/*
+** Start sampling the Lua stack of this thread hz times per second of its
+** CPU time, dropping the samples of any earlier run; returns 0 on success
+*/
+int32 lua_startsampling (int32 hz)
+{
+#ifdef POSIX
+  if (hz <= 0 || (owner != NULL && owner != L))
+    return 1;
+  lua_stopsampling();
+  if (L->sampler == NULL) {
+    L->sampler = luaM_new(struct Sampler);
+    memset(L->sampler, 0, sizeof(struct Sampler));
+  }
+  else
+    clearsamples(L->sampler);
+  interval = 1000000000L / hz;
+  hascpuclock = pthread_getcpuclockid(pthread_self(), &cpuclock) == 0;
+  sampling = 1;
+  if (pthread_create(&sampler, NULL, samplerthread, NULL) != 0) {
+    sampling = 0;
+    return 1;
+  }
+  owner = L;
+  return 0;
+#else
+  (void)hz;
+  return 1;  /* no thread to sample with */
+#endif
+}
+
+
+/* Stop the sampling thread; the samples stay for lua_dumpsamples */
+void lua_stopsampling (void)
+{
+#ifdef POSIX
+  if (owner != L)
+    return;
+  sampling = 0;
+  pthread_join(sampler, NULL);
+  owner = NULL;
+  luaP_sampledue = 0;
+#endif
+}
+
+
+void luaP_freesampler (void)
+{
+  if (L->sampler == NULL)
+    return;
+  lua_stopsampling();
+  clearsamples(L->sampler);
+  luaM_free(L->sampler->buff);
+  luaM_free(L->sampler);
+  L->sampler = NULL;
+}
+
+
+/*
+** Write one line per stack seen with the number of times it was seen, as
+** flamegraph.pl reads them; returns 0 on success
+*/
+int32 lua_dumpsamples (FILE *f)
+{
+  struct Sampler *S = L->sampler;
+  int32 i;
+  if (S == NULL)
+    return 0;
+  for (i=0; i<S->size; i++)
+    if (S->samples[i].stack)
+      fprintf(f, "%s %lu\n", S->samples[i].stack,
+              (unsigned long)S->samples[i].count);
+  return ferror(f) ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+/*
+** $Id$
+** Sampling profiler of the Lua VM
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lsample_h
+#define lsample_h
+
+
+#include "lua.h"
+
+
+/* Set by the sampling thread; any thread may see it, only the sampled acts */
+extern volatile int32 luaP_sampledue;
+
+void luaP_sample (void);
+void luaP_freesampler (void);
+
+/*
+** Called where the VM may run for long: on calls, returns and backward jumps.
+** Time spent between two of these points is charged to the second one.
+*/
+#define luaP_checksample() \
+	{ if (luaP_sampledue) luaP_sample(); }
+
+
+#endif
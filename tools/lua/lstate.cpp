@@ -12,6 +12,8 @@
 #include "lgc.h"
 #include "llex.h"
 #include "lmem.h"
+#include "lprofile.h"
+#include "lsample.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -19,9 +21,9 @@
 #include "ltm.h"
 
 
-lua_State *lua_state = NULL;
+LUA_THREAD lua_State *lua_state = NULL;
 
-int32 globalTaskSerialId;
+LUA_THREAD int32 globalTaskSerialId;
 
 void stderrorim (void);
 
@@ -45,6 +47,22 @@ static void lua_openthr (void)
 
 void lua_resetglobals(void) {
   globalTaskSerialId = 1;
+  L->root_task = luaM_new(struct lua_Task);
+  L->root_task->next = NULL;
+  L->root_task->prev = NULL;
+  L->last_task = L->root_task;
+  L->curr_task = L->root_task;
+  L->Cblocks = L->root_task->Cblocks;
+  L->taskid = NULL;
+  L->taskfunc = NULL;
+  L->taskhsize = 0;
+  L->ntasks = 0;
+  L->run_first = L->run_last = NULL;
+  L->sleepheap = NULL;
+  L->nsleep = 0;
+  L->sleepsize = 0;
+  L->taskclock = 0;
+  L->hostclock = 0;
   lua_openthr();
   L->rootproto.next = NULL;
   L->rootproto.marked = 0;
@@ -58,10 +76,16 @@ void lua_resetglobals(void) {
   L->refSize = 0;
   L->GCthreshold = GARBAGE_BLOCK;
   L->nblocks = 0;
-  L->root_task = luaM_new(struct lua_Task);
-  L->root_task->next = NULL;
-  L->last_task = L->root_task;
-  L->curr_task = L->root_task;
+  L->GCstate = GCpause;
+  L->GCstepsize = 0;
+  L->GCbusy = 0;
+  L->gray = NULL;
+  L->ngray = 0;
+  L->graysize = 0;
+  L->freetable = L->imtable = NULL;
+  L->freestr = L->imudata = NULL;
+  L->freeproto = NULL;
+  L->freecl = NULL;
   luaD_init();
   luaD_initthr();
   luaS_init();
@@ -72,6 +96,13 @@ void lua_open (void)
 {
   if (lua_state) return;
   lua_state = luaM_new(lua_State);
+  L->sampler = NULL;
+  L->filereader = NULL;
+  L->sparetask = NULL;
+  L->nspare = 0;
+#ifdef LUA_PROFILER
+  luaP_open();
+#endif
   lua_resetglobals();
   luaT_init();
   luaB_predefine();
@@ -80,7 +111,10 @@ void lua_open (void)
 
 void lua_close (void)
 {
-  TaggedString *alludata = luaS_collectudata();
+  TaggedString *alludata;
+  if (L->GCstate != GCpause)
+    lua_collectgarbage(0);  /* release the dead objects of a running cycle */
+  alludata = luaS_collectudata();
   L->GCthreshold = MAX_INT;  /* to avoid GC during GC */
   luaC_hashcallIM((Hash *)L->roottable.next);  /* GC t.methods for tables */
   luaC_strcallIM(alludata);  /* GC tag methods for userdata */
@@ -93,7 +127,22 @@ void lua_close (void)
   luaM_free(L->stack.stack);
   luaM_free(L->IMtable);
   luaM_free(L->refArray);
+  luaM_free(L->gray);
+  luaM_free(L->taskid);
+  luaM_free(L->taskfunc);
+  luaM_free(L->sleepheap);
   luaM_free(L->Mbuffer);
+  while (L->sparetask) {
+    struct lua_Task *t = L->sparetask;
+    L->sparetask = t->next;
+    luaM_free(t->stack.stack);
+    luaM_free(t->base_ci);
+    luaM_free(t);
+  }
+  luaP_freesampler();
+#ifdef LUA_PROFILER
+  luaP_close();
+#endif
   luaM_free(L);
   L = NULL;
 #ifdef DEBUG
@@ -122,9 +171,11 @@ static void savetask (struct lua_Task *t) {
   t->Mbuffbase = L->Mbuffbase;
   t->Mbuffsize = L->Mbuffsize;
   t->Mbuffnext = L->Mbuffnext;
-  memcpy(t->Cblocks, L->Cblocks, sizeof(L->Cblocks));
   t->numCblocks = L->numCblocks;
   t->Tstate = L->Tstate;
+#ifdef LUA_PROFILER
+  luaP_savetask(t);
+#endif
 }
 
 static void loadtask (struct lua_Task *t) {
@@ -139,26 +190,60 @@ static void loadtask (struct lua_Task *t) {
   L->Mbuffbase = t->Mbuffbase;
   L->Mbuffsize = t->Mbuffsize;
   L->Mbuffnext = t->Mbuffnext;
-  memcpy(L->Cblocks, t->Cblocks, sizeof(L->Cblocks));
+  L->Cblocks = t->Cblocks;  /* each task keeps its own */
   L->numCblocks = t->numCblocks;
   L->Tstate = t->Tstate;
+#ifdef LUA_PROFILER
+  luaP_loadtask(t);
+#endif
 }
 
 void luaI_switchtask(struct lua_Task *t) {
+  if (t == L->curr_task)
+    return;
   savetask(L->curr_task);
   L->curr_task = t;
   loadtask(t);
 }
 
+/*
+** Up to MAX_SPARE finished tasks keep their stack and CallInfo array, so
+** a script that starts a task every frame does not allocate them anew.
+*/
+#define MAX_SPARE	16
+
 struct lua_Task *luaI_newtask (void) {
-  struct lua_Task *result;
+  struct lua_Task *result = L->sparetask;
+  int32 spare = (result != NULL);
 
   savetask(L->curr_task);
-  result = luaM_new(struct lua_Task);
+  if (spare) {
+    L->sparetask = result->next;
+    L->nspare--;
+  }
+  else
+    result = luaM_new(struct lua_Task);
   L->curr_task = result;
-  result->next = NULL;
+  L->Cblocks = result->Cblocks;
   lua_openthr();
-  luaD_initthr();
+  if (spare)
+    luaD_reusethr(result);
+  else
+    luaD_initthr();
+  result->next = NULL;
   result->id = globalTaskSerialId++;
   return result;
 }
+
+void luaI_freetask (struct lua_Task *t) {
+  luaM_free(t->Mbuffer);
+  if (L->nspare >= MAX_SPARE) {
+    luaM_free(t->stack.stack);
+    luaM_free(t->base_ci);
+    luaM_free(t);
+    return;
+  }
+  t->next = L->sparetask;
+  L->sparetask = t;
+  L->nspare++;
+}
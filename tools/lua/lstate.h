@@ -37,6 +37,7 @@ struct C_Lua_Stack {
 typedef struct {
   int32 size;
   int32 nuse;  /* number of elements (including EMPTYs) */
+  int32 nlive;  /* number of elements (excluding EMPTYs) */
   TaggedString **hash;
 } stringtable;
 
@@ -55,6 +56,10 @@ struct CallInfo {
   StkId base;
   Byte *pc;
   int32 nResults;
+#ifdef LUA_PROFILER
+  struct ProfNode *profnode;  /* call tree node, the caller's for C functions */
+  double profstart;  /* task clock at the call */
+#endif
 };
 
 
@@ -76,9 +81,25 @@ struct lua_Task {
   int32 numCblocks;
   enum TaskState Tstate;
   struct lua_Task *next;
+  struct lua_Task *prev;
   int32 id;
+  GCnode *func;  /* closure or proto the task was started with */
+  struct lua_Task *idnext;  /* chains of L->taskid and L->taskfunc */
+  struct lua_Task *funcnext;
+  struct lua_Task *runnext;  /* list of the tasks lua_runtasks resumes */
+  struct lua_Task *runprev;
+  int32 heapidx;  /* position in L->sleepheap, or one of the values below */
+  int32 wake;  /* clock value at which a sleeping task resumes */
+  Byte *idlepc;  /* last yield point found not to be an idle loop */
+#ifdef LUA_PROFILER
+  double profskew;  /* time spent suspended, up to profclock */
+  double profclock;  /* when the task was last suspended */
+#endif
 };
 
+#define TASK_RUNNABLE	-1  /* in the run list */
+#define TASK_PARKED	-2  /* idles forever, in neither the run list nor the heap */
+
 struct lua_State {
   /* thread-specific state */
   struct Stack stack;  /* Lua stack */
@@ -92,13 +113,26 @@ struct lua_State {
   char *Mbuffbase;  /* current first position of Mbuffer */
   int32 Mbuffsize;  /* size of Mbuffer */
   int32 Mbuffnext;  /* next position to fill in Mbuffer */
-  struct C_Lua_Stack Cblocks[MAX_C_BLOCKS];
+  struct C_Lua_Stack *Cblocks;  /* Cblocks of the current task */
   int32 numCblocks;  /* number of nested Cblocks */
   enum TaskState Tstate;  /* state of current thread */
   /* global state */
   struct lua_Task *root_task;  /* first task created */
   struct lua_Task *curr_task;
   struct lua_Task *last_task;
+  struct lua_Task **taskid;  /* tasks hashed by id */
+  struct lua_Task **taskfunc;  /* tasks hashed by func */
+  int32 taskhsize;  /* size of both */
+  int32 ntasks;  /* tasks in them */
+  struct lua_Task *run_first;  /* tasks not sleeping, in list order */
+  struct lua_Task *run_last;
+  struct lua_Task **sleepheap;  /* sleeping tasks, earliest wake first */
+  int32 nsleep;
+  int32 sleepsize;
+  int32 taskclock;  /* counts lua_runtasks calls unless set by the host */
+  int32 hostclock;  /* whether lua_settaskclock drives taskclock */
+  struct lua_Task *sparetask;  /* finished tasks kept for their stacks */
+  int32 nspare;
   TObject errorim;  /* error tag method */
   GCnode rootproto;  /* list of all prototypes */
   GCnode rootcl;  /* list of all closures */
@@ -112,12 +146,29 @@ struct lua_State {
   int32 refSize;  /* size of refArray */
   int32 GCthreshold;
   int32 nblocks;  /* number of 'blocks' currently allocated */
+  int32 GCstate;  /* whether an incremental cycle is in progress */
+  int32 GCstepsize;  /* work per luaC_checkGC step; 0 collects at once */
+  int32 GCbusy;  /* in a step (GC tag methods may allocate) */
+  TObject *gray;  /* objects marked but not yet traversed */
+  int32 ngray;
+  int32 graysize;
+  Hash *freetable;  /* dead objects of the last cycle, not yet freed */
+  TaggedString *freestr;
+  TProtoFunc *freeproto;
+  Closure *freecl;
+  Hash *imtable;  /* next dead table/udata whose GC tag method is due */
+  TaggedString *imudata;
+  struct Sampler *sampler;  /* samples of lua_startsampling, or NULL */
+  lua_FileReader filereader;  /* consulted by lua_dofile, or NULL */
+#ifdef LUA_PROFILER
+  struct ProfState *prof;
+#endif
 };
 
 
-extern lua_State *lua_state;
+extern LUA_THREAD lua_State *lua_state;
 
-extern int32 globalTaskSerialId;
+extern LUA_THREAD int32 globalTaskSerialId;
 
 #define L	lua_state
 
@@ -126,7 +177,13 @@ void lua_resetglobals(void);
 /* Switch to the given task */
 void luaI_switchtask(struct lua_Task *t);
 
+/* State of a task, without switching to it */
+#define luaI_taskstate(t)	((t) == L->curr_task ? L->Tstate : (t)->Tstate)
+
 /* Create a new task and switch to it */
 struct lua_Task *luaI_newtask(void);
 
+/* Release a finished task that is no longer linked or current */
+void luaI_freetask(struct lua_Task *t);
+
 #endif
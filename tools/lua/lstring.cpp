@@ -16,6 +16,11 @@
 
 #define gcsizestring(l)	(1+(l/64))  /* "weight" for a string with length 'l' */
 
+/* bytes taken by a string or userdata */
+#define tssize(ts)	(sizeof(TaggedString)+((ts)->constindex == -1 ? 0 : (ts)->u.s.len))
+
+#define MINSTRTABSIZE	8	/* string tables are powers of two from here */
+
 
 
 TaggedString EMPTY = {{NULL, 2}, 0L, 0,
@@ -29,63 +34,87 @@ void luaS_init (void)
   for (i=0; i<NUM_HASHS; i++) {
     L->string_root[i].size = 0;
     L->string_root[i].nuse = 0;
+    L->string_root[i].nlive = 0;
     L->string_root[i].hash = NULL;
   }
 }
 
 
+/*
+** Strings up to HASHLIMIT bytes are hashed whole.  Longer ones hash
+** their first and last HASHLIMIT/2 bytes, where generated strings
+** ("line 12: ...", "...#3") differ, and a stride of about HASHLIMIT
+** bytes in between, so long dialogue lines cost no more to intern than
+** short names.  The length seeds the hash.
+*/
+#define HASHLIMIT	32
+
 static uint32 hash_s (const char *s, int32 l)
 {
-  uint32 h = 0;
-  while (l--)
-    h = ((h<<5)-h)^(byte)*(s++);
+  uint32 h = (uint32)l;
+  if (l <= HASHLIMIT) {
+    while (l--)
+      h = h ^ ((h<<5)+(h>>2)+(byte)*(s++));
+  }
+  else {
+    int32 i, step = (l-HASHLIMIT)/HASHLIMIT+1;
+    for (i=0; i<HASHLIMIT/2; i++)
+      h = h ^ ((h<<5)+(h>>2)+(byte)s[i]);
+    for (; i<l-HASHLIMIT/2; i+=step)
+      h = h ^ ((h<<5)+(h>>2)+(byte)s[i]);
+    for (i=l-HASHLIMIT/2; i<l; i++)
+      h = h ^ ((h<<5)+(h>>2)+(byte)s[i]);
+  }
   return h;
 }
 
-static int32 newsize (stringtable *tb)
+/*
+** Spread udata pointers, whose low bits are alignment, over the mask
+*/
+static uint32 hash_u (void *buff)
 {
-  int32 size = tb->size;
-  int32 realuse = 0;
-  int32 i;
-  /* count how many entries are really in use */
-  for (i=0; i<size; i++)
-    if (tb->hash[i] != NULL && tb->hash[i] != &EMPTY)
-      realuse++;
-  if (2*(realuse+1) <= size)  /* +1 is the new element */
-    return size;  /* don't need to grow, just rehash to clear EMPTYs */
-  else
-    return luaO_redimension(size);
+  unsigned long p = (unsigned long)buff;
+  uint32 h = (uint32)(p ^ ((p >> 16) >> 16));
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  return h;
 }
 
-
+/*
+** Rehash tb, dropping its EMPTYs.  The size doubles only when the live
+** entries (plus the new one) would fill more than half of it, so a
+** table clogged by collected strings is just cleaned in place.
+*/
 static void grow (stringtable *tb)
 {
-  
-  int32 ns = newsize(tb);
-  TaggedString **newhash = luaM_newvector(ns, TaggedString *);
+  int32 ns = (tb->size > 0) ? tb->size : MINSTRTABSIZE;
+  TaggedString **newhash;
   int32 i;
+  while (2*(tb->nlive+1) > ns)
+    ns *= 2;
+  newhash = luaM_newvector(ns, TaggedString *);
   for (i=0; i<ns; i++)
     newhash[i] = NULL;
-  /* rehash */
-  tb->nuse = 0;
   for (i=0; i<tb->size; i++) {
-    if (tb->hash[i] != NULL && tb->hash[i] != &EMPTY) {
-      int32 h = tb->hash[i]->hash%ns;
+    TaggedString *ts = tb->hash[i];
+    if (ts != NULL && ts != &EMPTY) {
+      int32 h = ts->hash&(ns-1);
       while (newhash[h])
-        h = (h+1)%ns;
-      newhash[h] = tb->hash[i];
-      tb->nuse++;
+        h = (h+1)&(ns-1);
+      newhash[h] = ts;
     }
   }
   luaM_free(tb->hash);
   tb->size = ns;
+  tb->nuse = tb->nlive;
   tb->hash = newhash;
 }
 
 
 static TaggedString *newone_s (const char *str, int32 l, uint32 h)
 {
-  TaggedString *ts = (TaggedString *)luaM_malloc(sizeof(TaggedString)+l);
+  TaggedString *ts = (TaggedString *)luaM_newobj(sizeof(TaggedString)+l);
   memcpy(ts->str, str, l);
   ts->str[l] = 0;  /* ending 0 */
   ts->u.s.globalval.ttype = LUA_T_NIL;  /* initialize global value */
@@ -100,7 +129,7 @@ static TaggedString *newone_s (const char *str, int32 l, uint32 h)
 
 static TaggedString *newone_u (char *buff, int32 tag, uint32 h)
 {
-  TaggedString *ts = luaM_new(TaggedString);
+  TaggedString *ts = (TaggedString *)luaM_newobj(sizeof(TaggedString));
   ts->u.d.v = buff;
   ts->u.d.tag = (tag == LUA_ANYTAG) ? 0 : tag;
   ts->constindex = -1;  /* tag -> this is a userdata */
@@ -115,26 +144,27 @@ static TaggedString *insert_s (const char *str, int32 l, stringtable *tb)
 {
   TaggedString *ts;
   uint32 h = hash_s(str, l);
-  int32 size = tb->size;
+  int32 mask;
   int32 i;
   int32 j = -1;
-  if ((int32)tb->nuse*3 >= size*2) {
+  if ((int32)tb->nuse*3 >= tb->size*2)
     grow(tb);
-    size = tb->size;
-  }
-  for (i = h%size; (ts = tb->hash[i]) != NULL; ) {
-    if (ts == &EMPTY)
-      j = i;
-    else if (ts->constindex >= 0 &&
+  mask = tb->size-1;
+  for (i = h&mask; (ts = tb->hash[i]) != NULL; i = (i+1)&mask) {
+    if (ts == &EMPTY) {
+      if (j == -1) j = i;  /* first EMPTY keeps the chain short */
+    }
+    else if (ts->hash == h &&
+             ts->constindex >= 0 &&
              ts->u.s.len == l &&
              (memcmp(str, ts->str, l) == 0)) return ts;
-    if (++i == size) i=0;
   }
   /* not found */
   if (j != -1)  /* is there an EMPTY space? */
     i = j;
   else
     tb->nuse++;
+  tb->nlive++;
   ts = tb->hash[i] = newone_s(str, l, h);
   return ts;
 }
@@ -142,28 +172,28 @@ static TaggedString *insert_s (const char *str, int32 l, stringtable *tb)
 static TaggedString *insert_u (void *buff, int32 tag, stringtable *tb)
 {
   TaggedString *ts;
-  unsigned long h = (unsigned long)buff;
-  int32 size = tb->size;
+  uint32 h = hash_u(buff);
+  int32 mask;
   int32 i;
   int32 j = -1;
-  if (tb->nuse*3 >= size*2) {
+  if (tb->nuse*3 >= tb->size*2)
     grow(tb);
-    size = tb->size;
-  }
-  for (i = h%size; (ts = tb->hash[i]) != NULL; ) {
-    if (ts == &EMPTY)
-      j = i;
+  mask = tb->size-1;
+  for (i = h&mask; (ts = tb->hash[i]) != NULL; i = (i+1)&mask) {
+    if (ts == &EMPTY) {
+      if (j == -1) j = i;
+    }
     else if (ts->constindex < 0 &&  /* is a udata? */
              (tag == ts->u.d.tag || tag == LUA_ANYTAG) &&
              buff == ts->u.d.v)
       return ts;
-    if (++i == size) i=0;
   }
   /* not found */
   if (j != -1)  /* is there an EMPTY space? */
     i = j;
   else
     tb->nuse++;
+  tb->nlive++;
   ts = tb->hash[i] = newone_u((char*)buff, tag, h);
   return ts;
 }
@@ -198,7 +228,7 @@ void luaS_free (TaggedString *l)
   while (l) {
     TaggedString *next = (TaggedString *)l->head.next;
     L->nblocks -= (l->constindex == -1) ? 1 : gcsizestring(l->u.s.len);
-    luaM_free(l);
+    luaM_freeobj(l, tssize(l));
     l = next;
   }
 }
@@ -236,6 +266,7 @@ TaggedString *luaS_collector (void)
         t->head.next = (GCnode *)frees;
         frees = t;
         tb->hash[j] = &EMPTY;
+        tb->nlive--;
       }
     }
   }
@@ -258,6 +289,7 @@ TaggedString *luaS_collectudata (void)
       t->head.next = (GCnode *)frees;
       frees = t;
       tb->hash[j] = &EMPTY;
+      tb->nlive--;
     }
   }
   return frees;
@@ -272,8 +304,8 @@ void luaS_freeall (void)
     int32 j;
     for (j=0; j<tb->size; j++) {
       TaggedString *t = tb->hash[j];
-      if (t == &EMPTY) continue;
-      luaM_free(t);
+      if (t == NULL || t == &EMPTY) continue;
+      luaM_freeobj(t, tssize(t));
     }
     luaM_free(tb->hash);
   }
@@ -129,6 +129,76 @@ struct Capture {
 #define ESC	'%'
 #define SPECIALS  "^$*?.([%-"
 
+#define MAXLITERAL	256
+
+
+/*
+** Length of the plain string that p matches, copied to lit, or -1 if p
+** has magic characters or is too long.  Escaped punctuation ("%.") is
+** plain.  The ')' that would end a capture is not, so the pattern still
+** gets its error.
+*/
+static int32 literal (const char *p, char *lit)
+{
+  int32 l = 0;
+  for (; *p; p++) {
+    if (l >= MAXLITERAL)
+      return -1;
+    if (*p == ESC) {
+      if (*(p+1) == '\0' || isalnum((byte)*(p+1)))
+        return -1;  /* a class, capture or %b, or the error of a final % */
+      lit[l++] = *++p;
+    }
+    else if (*p == ')' || strchr(SPECIALS, *p))
+      return -1;
+    else
+      lit[l++] = *p;
+  }
+  return l;
+}
+
+
+/*
+** The character every match of p starts with, or -1 if there is none
+** simple to tell: p starts with a plain or escaped character that is not
+** optional or repeated.
+*/
+static int32 firstchar (const char *p)
+{
+  int32 c;
+  const char *ep = p+1;
+  if (*p == ESC) {
+    if (*(p+1) == '\0' || isalnum((byte)*(p+1)))
+      return -1;
+    c = (byte)*(p+1);
+    ep = p+2;
+  }
+  else if (*p == '\0' || *p == ')' || strchr(SPECIALS, *p))
+    return -1;
+  else
+    c = (byte)*p;
+  if (*ep == '*' || *ep == '?' || *ep == '-')
+    return -1;
+  return c;
+}
+
+
+/* First occurrence of the l bytes at p in [s, e), or NULL */
+static const char *lmemfind (const char *s, const char *e, const char *p, int32 l)
+{
+  if (l == 0)
+    return s;
+  while (e-s >= l) {
+    const char *c = (const char *)memchr(s, *p, (e-s)-l+1);
+    if (c == NULL)
+      return NULL;
+    if (memcmp(c+1, p+1, l-1) == 0)
+      return c;
+    s = c+1;
+  }
+  return NULL;
+}
+
 
 static void push_captures (struct Capture *cap)
 {
@@ -334,22 +404,32 @@ static void str_find (void)
   const char *p = luaL_check_string(2);
   int32 init = posrelat((int32)luaL_opt_number(3, 1), l) - 1;
   struct Capture cap;
+  char lit[MAXLITERAL];
+  int32 ll = -1;
   luaL_arg_check(0 <= init && init <= l, 3, "out of range");
   if (lua_getparam(4) != LUA_NOOBJECT ||
-      strpbrk(p, SPECIALS) == NULL) {  /* no special characters? */
-    const char *s2 = strstr(s+init, p);
+      strpbrk(p, SPECIALS) == NULL)  /* no special characters? */
+    ll = strlen(p);
+  else if ((ll = literal(p, lit)) >= 0)
+    p = lit;
+  if (ll >= 0) {
+    const char *s2 = lmemfind(s+init, s+l, p, ll);
     if (s2) {
       lua_pushnumber(s2-s+1);
-      lua_pushnumber(s2-s+strlen(p));
+      lua_pushnumber(s2-s+ll);
       return;
     }
   }
   else {
     int32 anchor = (*p == '^') ? (p++, 1) : 0;
+    int32 c = anchor ? -1 : firstchar(p);
     const char *s1=s+init;
     cap.src_end = s+l;
     do {
       const char *res;
+      if (c >= 0 &&  /* skip to where a match can start */
+          (s1 = (const char *)memchr(s1, c, cap.src_end-s1)) == NULL)
+        break;
       cap.level = 0;
       if ((res=match(s1, p, &cap)) != NULL) {
         lua_pushnumber(s1-s+1);  /* start */
@@ -367,20 +447,22 @@ static void add_s (lua_Object newp, struct Capture *cap)
 {
   if (lua_isstring(newp)) {
     const char *news = lua_getstring(newp);
-    int32 l = lua_strlen(newp);
-    int32 i;
-    for (i=0; i<l; i++) {
-      if (news[i] != ESC)
-        luaL_addchar(news[i]);
+    const char *end = news+lua_strlen(newp);
+    while (news < end) {
+      const char *e = (const char *)memchr(news, ESC, end-news);
+      if (e == NULL)
+        e = end;
+      addnchar(news, e-news);  /* the run up to the next ESC */
+      if (e == end)
+        break;
+      news = e+1;  /* skip ESC */
+      if (!isdigit((byte)*news))
+        luaL_addchar(*news);
       else {
-        i++;  /* skip ESC */
-        if (!isdigit((byte)news[i]))
-          luaL_addchar(news[i]);
-        else {
-          int32 level = check_cap(news[i], cap);
-          addnchar(cap->capture[level].init, cap->capture[level].len);
-        }
+        int32 level = check_cap(*news, cap);
+        addnchar(cap->capture[level].init, cap->capture[level].len);
       }
+      news++;
     }
   }
   else {  /* is a function */
@@ -416,11 +498,26 @@ static void str_gsub (void)
   int32 anchor = (*p == '^') ? (p++, 1) : 0;
   int32 n = 0;
   struct Capture cap;
+  char lit[MAXLITERAL];
+  int32 ll = anchor ? -1 : literal(p, lit);
+  int32 c = anchor ? -1 : firstchar(p);
   luaL_arg_check(lua_isstring(newp) || lua_isfunction(newp), 3,
                  "string or function expected");
   luaL_resetbuffer();
   cap.src_end = src+srcl;
-  while (n < max_s) {
+  if (ll > 0) {  /* a plain string: no captures, matches never empty */
+    while (n < max_s) {
+      const char *e = lmemfind(src, cap.src_end, lit, ll);
+      if (e == NULL)
+        break;
+      addnchar(src, e-src);
+      n++;
+      cap.level = 0;
+      add_s(newp, &cap);
+      src = e+ll;
+    }
+  }
+  else while (n < max_s) {
     const char *e;
     cap.level = 0;
     e = match(src, p, &cap);
@@ -430,8 +527,17 @@ static void str_gsub (void)
     }
     if (e && e>src) /* non empty match? */
       src = e;  /* skip it */
-    else if (src < cap.src_end)
-      luaL_addchar(*src++);
+    else if (src < cap.src_end) {
+      /* copy up to where the next match can start */
+      const char *next = c < 0 ? NULL :
+          (const char *)memchr(src+1, c, cap.src_end-(src+1));
+      if (c < 0)
+        next = src+1;
+      else if (next == NULL)
+        next = cap.src_end;
+      addnchar(src, next-src);
+      src = next;
+    }
     else break;
     if (anchor) break;
   }
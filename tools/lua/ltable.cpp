@@ -7,6 +7,7 @@
 #include <stdlib.h>
 
 #include "lauxlib.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -15,6 +16,7 @@
 
 
 #define gcsize(n)	(1+(n/16))
+#define tablesize(t)	(nhash(t)+narray(t))
 
 #define nuse(t)		((t)->nuse)
 #define nodevector(t)	((t)->node)
@@ -24,56 +26,122 @@
 
 #define TagDefault LUA_T_ARRAY;
 
+#define MAXABITS	26	/* largest array part is 2^MAXABITS */
+#define MINHASH		4	/* hash parts are powers of two from here */
+#define MAXHASH		(1L<<30)
 
 
-static long int hashindex (TObject *ref)
+
+/*
+** Pointers are aligned and sequential numbers stride, so their low bits
+** cluster; fold everything in and mix (murmur3 finalizer) before the
+** caller masks to the power-of-two table size.
+*/
+static uint32 hashindex (TObject *ref)
 {
-  long int h;
+  IntPoint p;
+  uint32 h;
   switch (ttype(ref)) {
     case LUA_T_NUMBER:
-      h = (long int)nvalue(ref);
+      p = (IntPoint)(long int)nvalue(ref);
       break;
     case LUA_T_STRING: case LUA_T_USERDATA:
-      h = (IntPoint)tsvalue(ref);
+      p = (IntPoint)tsvalue(ref);
       break;
     case LUA_T_ARRAY:
-      h = (IntPoint)avalue(ref);
+      p = (IntPoint)avalue(ref);
       break;
     case LUA_T_PROTO:
-      h = (IntPoint)tfvalue(ref);
+      p = (IntPoint)tfvalue(ref);
       break;
     case LUA_T_CPROTO:
-      h = (IntPoint)fvalue(ref);
+      p = (IntPoint)fvalue(ref);
       break;
     case LUA_T_CLOSURE:
-      h = (IntPoint)clvalue(ref);
+      p = (IntPoint)clvalue(ref);
       break;
     case LUA_T_TASK:
-      h = (long int)nvalue(ref);
+      p = (IntPoint)(long int)nvalue(ref);
       break;
     default:
       lua_error("unexpected type to index table");
-      h = 0;  /* to avoid warnings */
+      p = 0;  /* to avoid warnings */
   }
-  return (h >= 0 ? h : -(h+1));
+  h = (uint32)(p ^ ((p >> 16) >> 16));
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+
+/*
+** Smallest power of two that holds n keys under REHASH_LIMIT
+*/
+static int32 hashsize (int32 n)
+{
+  int32 size = MINHASH;
+  while ((float)size*REHASH_LIMIT < (float)n) {
+    if (size >= MAXHASH)
+      lua_error("table overflow");
+    size *= 2;
+  }
+  return size;
+}
+
+
+/*
+** Slot of ref in the array part of t, or -1 if ref is not an integer
+** in 1..narray.
+*/
+static int32 arrayindex (Hash *t, TObject *ref)
+{
+  if (ttype(ref) == LUA_T_NUMBER) {
+    real n = nvalue(ref);
+    if (n >= 1 && n <= narray(t)) {
+      int32 k = (int32)n;
+      if ((real)k == n)
+        return k-1;
+    }
+  }
+  return -1;
+}
+
+
+/*
+** Bucket of an array candidate key for rehash: keys in (2^(b-1), 2^b]
+** share bucket b.  Returns -1 if ref cannot live in an array part.
+*/
+static int32 arraybucket (TObject *ref)
+{
+  if (ttype(ref) == LUA_T_NUMBER) {
+    real n = nvalue(ref);
+    if (n >= 1 && n <= (real)(1L<<MAXABITS)) {
+      int32 k = (int32)n;
+      if ((real)k == n) {
+        int32 b = 0;
+        while ((1L<<b) < k) b++;
+        return b;
+      }
+    }
+  }
+  return -1;
 }
 
 
 int32 present (Hash *t, TObject *key)
 {
-  int32 tsize = nhash(t);
-  long int h = hashindex(key);
-  int32 h1 = h%tsize;
-  TObject *rf = ref(node(t, h1));
-  if (ttype(rf) != LUA_T_NIL && !luaO_equalObj(key, rf)) {
-    int32 h2 = h%(tsize-2) + 1;
-    do {
-      h1 += h2;
-      if (h1 >= tsize) h1 -= tsize;
-      rf = ref(node(t, h1));
-    } while (ttype(rf) != LUA_T_NIL && !luaO_equalObj(key, rf));
+  int32 mask = nhash(t)-1;
+  int32 h = hashindex(key)&mask;
+  TObject *rf = ref(node(t, h));
+  while (ttype(rf) != LUA_T_NIL &&
+         (ttype(rf) != ttype(key) || !luaO_equalObj(key, rf))) {
+    h = (h+1)&mask;  /* linear probing: neighbours share cache lines */
+    rf = ref(node(t, h));
   }
-  return h1;
+  return h;
 }
 
 
@@ -82,20 +150,36 @@ int32 present (Hash *t, TObject *key)
 */
 Node *hashnodecreate (int32 nhash)
 {
-  Node *v = luaM_newvector(nhash, Node);
+  Node *v = luaM_newobjvector(nhash, Node);
   int32 i;
   for (i=0; i<nhash; i++)
     ttype(ref(&v[i])) = LUA_T_NIL;
   return v;
 }
 
+/*
+** Alloc an array part: node i holds key i+1
+*/
+static Node *arraynodecreate (int32 narray)
+{
+  Node *v = luaM_newobjvector(narray, Node);
+  int32 i;
+  for (i=0; i<narray; i++) {
+    ttype(ref(&v[i])) = LUA_T_NUMBER;
+    nvalue(ref(&v[i])) = (real)(i+1);
+    ttype(val(&v[i])) = LUA_T_NIL;
+  }
+  return v;
+}
+
 /*
 ** Delete a hash
 */
 static void hashdelete (Hash *t)
 {
-  luaM_free(nodevector(t));
-  luaM_free(t);
+  luaM_freeobj(nodevector(t), nhash(t)*sizeof(Node));
+  luaM_freeobj(t->array, narray(t)*sizeof(Node));
+  luaM_freeobj(t, sizeof(Hash));
 }
 
 
@@ -103,7 +187,7 @@ void luaH_free (Hash *frees)
 {
   while (frees) {
     Hash *next = (Hash *)frees->head.next;
-    L->nblocks -= gcsize(frees->nhash);
+    L->nblocks -= gcsize(tablesize(frees));
     hashdelete(frees);
     frees = next;
   }
@@ -112,11 +196,13 @@ void luaH_free (Hash *frees)
 
 Hash *luaH_new (int32 nhash)
 {
-  Hash *t = luaM_new(Hash);
-  nhash = luaO_redimension((int32)((float)nhash/REHASH_LIMIT));
+  Hash *t = (Hash *)luaM_newobj(sizeof(Hash));
+  nhash = hashsize(nhash);
   nodevector(t) = hashnodecreate(nhash);
   nhash(t) = nhash;
   nuse(t) = 0;
+  t->array = NULL;
+  narray(t) = 0;
   t->htag = TagDefault;
   luaO_insertlist(&(L->roottable), (GCnode *)t);
   L->nblocks += gcsize(nhash);
@@ -124,64 +210,176 @@ Hash *luaH_new (int32 nhash)
 }
 
 
-static int32 newsize (Hash *t)
+/*
+** A table with an array part for keys 1..na and room for nhash more keys
+*/
+Hash *luaH_newsized (int32 na, int32 nhash)
 {
-  Node *v = t->node;
-  int32 size = nhash(t);
-  int32 realuse = 0;
+  Hash *t = luaH_new(nhash);
+  if (na > 0) {
+    int32 oldsize = tablesize(t);
+    narray(t) = na;
+    t->array = arraynodecreate(na);
+    L->nblocks += gcsize(tablesize(t))-gcsize(oldsize);
+  }
+  return t;
+}
+
+
+/*
+** Count the live keys of t plus the pending key ref, bucketing the ones
+** that could go to an array part.  Live hash nodes are packed to the
+** front of the node vector on the way, so rehash reinserts from that
+** prefix instead of scanning the whole vector again.  Returns the total;
+** *nlive gets the size of the packed prefix.
+*/
+static int32 countkeys (Hash *t, TObject *ref, int32 *nums, int32 *nlive)
+{
+  int32 total = 1;  /* the new element */
+  int32 i, b;
+  Node *v = nodevector(t);
+  int32 live = 0;
+  for (i=0; i<=MAXABITS; i++)
+    nums[i] = 0;
+  if ((b = arraybucket(ref)) >= 0)
+    nums[b]++;
+  for (i=0; i<narray(t); i++) {
+    if (ttype(val(anode(t, i))) != LUA_T_NIL) {
+      total++;
+      nums[arraybucket(ref(anode(t, i)))]++;
+    }
+  }
+  for (i=0; i<nhash(t); i++) {
+    Node *n = v+i;
+    if (ttype(ref(n)) != LUA_T_NIL && ttype(val(n)) != LUA_T_NIL) {
+      if ((b = arraybucket(ref(n))) >= 0)
+        nums[b]++;
+      v[live++] = *n;
+    }
+  }
+  *nlive = live;
+  return total+live;
+}
+
+/*
+** Largest power of two n such that more than half of the slots 1..n
+** would be in use; *na gets how many keys that moves into the array.
+*/
+static int32 arraysize (int32 *nums, int32 *na)
+{
+  int32 a = 0, size = 0, twotoi = 1;
   int32 i;
-  for (i=0; i<size; i++) {
-    if (ttype(ref(v+i)) != LUA_T_NIL && ttype(val(v+i)) != LUA_T_NIL)
-      realuse++;
+  *na = 0;
+  for (i=0; i<=MAXABITS; i++, twotoi *= 2) {
+    a += nums[i];
+    if (a > twotoi/2) {
+      size = twotoi;
+      *na = a;
+    }
+  }
+  return size;
+}
+
+static void reinsert (Hash *t, Node *n)
+{
+  int32 k = arrayindex(t, ref(n));
+  if (k >= 0)
+    *val(anode(t, k)) = *val(n);
+  else {
+    *node(t, present(t, ref(n))) = *n;
+    nuse(t)++;
   }
-  if (2*(realuse+1) <= size)  /* +1 is the new element */
-    return size;  /* don't need to grow, just rehash */
-  else
-    return luaO_redimension(size);
 }
 
-static void rehash (Hash *t)
+/*
+** Resize both parts of t to fit its live keys plus ref, which is about
+** to be inserted.  Dense integer keys 1..n move to the array part.
+*/
+static void rehash (Hash *t, TObject *ref)
 {
-  int32 nold = nhash(t);
+  int32 nums[MAXABITS+1];
+  int32 aold = narray(t);
+  int32 hold = nhash(t);
+  int32 oldsize = tablesize(t);
   Node *vold = nodevector(t);
-  int32 nnew = newsize(t);
+  Node *aoldv = t->array;
+  int32 na, nlive;
+  int32 total = countkeys(t, ref, nums, &nlive);
+  int32 asize = arraysize(nums, &na);
   int32 i;
-  nodevector(t) = hashnodecreate(nnew);
-  nhash(t) = nnew;
-  for (i=0; i<nold; i++) {
-    Node *n = vold+i;
-    if (ttype(ref(n)) != LUA_T_NIL && ttype(val(n)) != LUA_T_NIL)
-      *node(t, present(t, ref(n))) = *n;  /* copy old node to luaM_new hash */
+  nhash(t) = hashsize(total-na);
+  nodevector(t) = hashnodecreate(nhash(t));
+  nuse(t) = 0;
+  if (asize != aold) {
+    narray(t) = asize;
+    t->array = asize ? arraynodecreate(asize) : NULL;
+    for (i=0; i<aold; i++) {
+      if (ttype(val(aoldv+i)) != LUA_T_NIL)
+        reinsert(t, aoldv+i);
+    }
+    luaM_freeobj(aoldv, aold*sizeof(Node));
   }
-  L->nblocks += gcsize(nnew)-gcsize(nold);
-  luaM_free(vold);
+  for (i=0; i<nlive; i++)
+    reinsert(t, vold+i);  /* copy old node to luaM_new hash */
+  L->nblocks += gcsize(tablesize(t))-gcsize(oldsize);
+  luaM_freeobj(vold, hold*sizeof(Node));
 }
 
 /*
 ** If the hash node is present, return its pointer, otherwise return
-** null.
+** null.  Keys in the array part are always present, maybe with a nil
+** value.
 */
 TObject *luaH_get (Hash *t, TObject *ref)
 {
- int32 h = present(t, ref);
+ int32 k = arrayindex(t, ref);
+ int32 h;
+ if (k >= 0) return val(anode(t, k));
+ h = present(t, ref);
  if (ttype(ref(node(t, h))) != LUA_T_NIL) return val(node(t, h));
  else return NULL;
 }
 
 
+/*
+** luaH_get for a string key, first trying the node *slot, where the key
+** was last found in any table: tables built alike keep their fields at
+** the same nodes, and a slot that is stale or from another table just
+** fails the key check.  Returns NULL for an absent or nil field.
+*/
+TObject *luaH_getfield (Hash *t, TObject *key, int32 *slot)
+{
+  int32 h = *slot;
+  Node *n;
+  if (h >= nhash(t) || ttype(ref(n = node(t, h))) != LUA_T_STRING ||
+      tsvalue(ref(n)) != tsvalue(key)) {
+    h = present(t, key);
+    n = node(t, h);
+    if (ttype(ref(n)) == LUA_T_NIL)
+      return NULL;
+    *slot = h;
+  }
+  return ttype(val(n)) == LUA_T_NIL ? NULL : val(n);
+}
+
+
 /*
 ** If the hash node is present, return its pointer, otherwise create a luaM_new
 ** node for the given reference and also return its pointer.
 */
 TObject *luaH_set (Hash *t, TObject *ref)
 {
-  Node *n = node(t, present(t, ref));
+  int32 k = arrayindex(t, ref);
+  Node *n;
+  luaC_barrier(t);
+  if (k >= 0) return val(anode(t, k));
+  n = node(t, present(t, ref));
   if (ttype(ref(n)) == LUA_T_NIL) {
-    nuse(t)++;
-    if ((float)nuse(t) > (float)nhash(t)*REHASH_LIMIT) {
-      rehash(t);
-      n = node(t, present(t, ref));
+    if ((float)(nuse(t)+1) > (float)nhash(t)*REHASH_LIMIT) {
+      rehash(t, ref);
+      return luaH_set(t, ref);  /* ref may now belong to the array part */
     }
+    nuse(t)++;
     *ref(n) = *ref;
     ttype(val(n)) = LUA_T_NIL;
   }
@@ -204,16 +402,27 @@ static Node *hashnext (Hash *t, int32 i)
   return node(t, i);
 }
 
+/*
+** Traversal visits the array part first, then the hash part.
+*/
 Node *luaH_next (TObject *o, TObject *r)
 {
   Hash *t = avalue(o);
+  int32 i;
   if (ttype(r) == LUA_T_NIL)
-    return hashnext(t, 0);
+    i = 0;
+  else if ((i = arrayindex(t, r)) >= 0)
+    i++;
   else {
-    int32 i = present(t, r);
-    Node *n = node(t, i);
+    int32 h = present(t, r);
+    Node *n = node(t, h);
     luaL_arg_check(ttype(ref(n))!=LUA_T_NIL && ttype(val(n))!=LUA_T_NIL,
                    2, "key not found");
-    return hashnext(t, i+1);
+    return hashnext(t, h+1);
+  }
+  for (; i<narray(t); i++) {
+    if (ttype(val(anode(t, i))) != LUA_T_NIL)
+      return anode(t, i);
   }
+  return hashnext(t, 0);
 }
@@ -14,10 +14,14 @@
 #define ref(n)		(&(n)->ref)
 #define val(n)		(&(n)->val)
 #define nhash(t)	((t)->nhash)
+#define anode(t,i)	(&(t)->array[i])
+#define narray(t)	((t)->narray)
 
 Hash *luaH_new (int32 nhash);
+Hash *luaH_newsized (int32 na, int32 nhash);
 void luaH_free (Hash *frees);
 TObject *luaH_get (Hash *t, TObject *ref);
+TObject *luaH_getfield (Hash *t, TObject *key, int32 *slot);
 TObject *luaH_set (Hash *t, TObject *ref);
 Node *luaH_next (TObject *o, TObject *r);
 Node *hashnodecreate (int32 nhash);
@@ -6,6 +6,198 @@
 #include "lmem.h"
 #include "ldo.h"
 #include "lvm.h"
+#include "lopcodes.h"
+#include "lprofile.h"
+
+/*
+** Tasks started by start_script are hashed by id and by the function
+** they were started with, so lookups do not walk the task list.  Both
+** tables chain through the tasks and are rebuilt from the list when the
+** number of tasks outgrows them.
+*/
+#define MINTASKHASH	32
+
+static uint32 idbucket (int32 id) {
+	return (uint32)id & (L->taskhsize - 1);
+}
+
+static uint32 funcbucket (GCnode *f) {
+	IntPoint p = (IntPoint)f;
+	return (uint32)((p >> 4) ^ (p >> 12)) & (L->taskhsize - 1);
+}
+
+static GCnode *funcof (TObject *o) {
+	if (ttype(o) == LUA_T_CLOSURE || ttype(o) == LUA_T_CLMARK || ttype(o) == LUA_T_CMARK)
+		return (GCnode *)clvalue(o);
+	return (GCnode *)tfvalue(o);
+}
+
+static void hashtask (struct lua_Task *t) {
+	uint32 h = idbucket(t->id);
+	t->idnext = L->taskid[h];
+	L->taskid[h] = t;
+	h = funcbucket(t->func);
+	t->funcnext = L->taskfunc[h];
+	L->taskfunc[h] = t;
+}
+
+static void resizetasks (int32 size) {
+	struct lua_Task *t;
+	int32 i;
+
+	luaM_free(L->taskid);
+	luaM_free(L->taskfunc);
+	L->taskid = luaM_newvector(size, struct lua_Task *);
+	L->taskfunc = luaM_newvector(size, struct lua_Task *);
+	for (i = 0; i < size; i++)
+		L->taskid[i] = L->taskfunc[i] = NULL;
+	L->taskhsize = size;
+	for (t = L->root_task->next; t != NULL; t = t->next)
+		hashtask(t);
+}
+
+/* Append a new task to the task list */
+static void linktask (struct lua_Task *t) {
+	t->next = NULL;
+	t->prev = L->last_task;
+	L->last_task->next = t;
+	L->last_task = t;
+	t->runnext = NULL;
+	t->runprev = L->run_last;
+	if (L->run_last != NULL)
+		L->run_last->runnext = t;
+	else
+		L->run_first = t;
+	L->run_last = t;
+	t->heapidx = TASK_RUNNABLE;
+	t->wake = L->taskclock;
+	t->idlepc = NULL;
+	if (++L->ntasks > L->taskhsize)
+		resizetasks(L->taskhsize ? 2 * L->taskhsize : MINTASKHASH);
+	else
+		hashtask(t);
+}
+
+/*
+** The run list holds the tasks lua_runtasks resumes, in task list order.
+** Sleeping tasks leave it for L->sleepheap, a binary heap on wake time,
+** and idle ones (see idleloop) leave it for good.
+*/
+static void runremove (struct lua_Task *t) {
+	if (t->runprev != NULL)
+		t->runprev->runnext = t->runnext;
+	else
+		L->run_first = t->runnext;
+	if (t->runnext != NULL)
+		t->runnext->runprev = t->runprev;
+	else
+		L->run_last = t->runprev;
+	t->runnext = t->runprev = NULL;
+}
+
+static void runinsert (struct lua_Task *t) {
+	struct lua_Task *p = L->run_last;
+
+	while (p != NULL && p->id > t->id)
+		p = p->runprev;
+	t->runprev = p;
+	t->runnext = (p != NULL) ? p->runnext : L->run_first;
+	if (t->runnext != NULL)
+		t->runnext->runprev = t;
+	else
+		L->run_last = t;
+	if (p != NULL)
+		p->runnext = t;
+	else
+		L->run_first = t;
+	t->heapidx = TASK_RUNNABLE;
+}
+
+/* whether a wakes up before b (the clock may wrap) */
+#define wakesbefore(a, b)	((int32)((uint32)(a)->wake - (uint32)(b)->wake) < 0)
+
+static void heapset (int32 i, struct lua_Task *t) {
+	L->sleepheap[i] = t;
+	t->heapidx = i;
+}
+
+static void heapup (int32 i, struct lua_Task *t) {
+	while (i > 0 && wakesbefore(t, L->sleepheap[(i - 1) / 2])) {
+		heapset(i, L->sleepheap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heapset(i, t);
+}
+
+static void heapdown (int32 i, struct lua_Task *t) {
+	for (;;) {
+		int32 c = 2 * i + 1;
+		if (c >= L->nsleep)
+			break;
+		if (c + 1 < L->nsleep && wakesbefore(L->sleepheap[c + 1], L->sleepheap[c]))
+			c++;
+		if (!wakesbefore(L->sleepheap[c], t))
+			break;
+		heapset(i, L->sleepheap[c]);
+		i = c;
+	}
+	heapset(i, t);
+}
+
+static void sleeptask (struct lua_Task *t) {
+	runremove(t);
+	if (L->nsleep >= L->sleepsize)
+		L->sleepsize = luaM_growvector(&L->sleepheap, L->sleepsize, struct lua_Task *, "task overflow", MAX_INT);
+	heapup(L->nsleep++, t);
+}
+
+static void heapremove (struct lua_Task *t) {
+	int32 i = t->heapidx;
+	struct lua_Task *last = L->sleepheap[--L->nsleep];
+
+	if (last != t) {
+		if (i > 0 && wakesbefore(last, L->sleepheap[(i - 1) / 2]))
+			heapup(i, last);
+		else
+			heapdown(i, last);
+	}
+}
+
+/* Remove a task from the task list */
+static void unlinktask (struct lua_Task *t) {
+	struct lua_Task **p;
+
+	if (t->heapidx == TASK_RUNNABLE)
+		runremove(t);
+	else if (t->heapidx >= 0)
+		heapremove(t);
+	t->heapidx = TASK_PARKED;
+	t->prev->next = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	else
+		L->last_task = t->prev;
+	t->next = NULL;
+	for (p = &L->taskid[idbucket(t->id)]; *p != t; p = &(*p)->idnext)
+		;
+	*p = t->idnext;
+	for (p = &L->taskfunc[funcbucket(t->func)]; *p != t; p = &(*p)->funcnext)
+		;
+	*p = t->funcnext;
+	L->ntasks--;
+}
+
+static struct lua_Task *findtask (int32 id) {
+	struct lua_Task *t = NULL;
+
+	if (L->taskhsize > 0) {
+		for (t = L->taskid[idbucket(id)]; t != NULL; t = t->idnext) {
+			if (t->id == id)
+				break;
+		}
+	}
+	return t;
+}
 
 void pause_scripts (void) {
 	struct lua_Task *t;
@@ -52,6 +244,7 @@ void start_script (void) {
 	/* Create a CallInfo frame */
 	luaD_precall(L->stack.stack, 1, MULT_RET);
 	ttype(L->stack.stack) = (ttype(L->stack.stack) == LUA_T_CLOSURE) ? LUA_T_CLMARK : LUA_T_PMARK;
+	new_task->func = funcof(L->stack.stack);
 
 	/* Switch back to the old task */
 	L->Tstate = YIELD;
@@ -59,8 +252,7 @@ void start_script (void) {
 	L->curr_task = old_task;
 
 	/* Insert new task at end of list */
-	L->last_task->next = new_task;
-	L->last_task = new_task;
+	linktask(new_task);
 
 	/* Return task handle */
 	ttype(L->stack.top) = LUA_T_TASK;
@@ -68,63 +260,64 @@ void start_script (void) {
 	incr_top;
 }
 
+static void stoptask (struct lua_Task *t) {
+	if (t->next == NULL) {
+		if (t == L->curr_task) {
+			L->Tstate = DONE;
+		}
+	} else {
+		t->Tstate = DONE;
+	}
+	unlinktask(t);  /* Remove from list of active tasks */
+}
+
 void stop_script (void) {
-	struct lua_Task *prev, *t;
+	struct lua_Task *t;
 	TObject *f = L->stack.stack + L->Cstack.lua2C;
-	int32 match = 0;
+	GCnode *func;
 
 	if ((f == LUA_NOOBJECT) || (ttype(f) != LUA_T_CLOSURE && ttype(f) != LUA_T_PROTO && ttype(f) != LUA_T_TASK))
 		lua_error("Bad argument to stop_script");
 
-	prev = L->root_task;
-	while ((t = prev->next) != NULL) {
-		switch (ttype(f)) {
-		case LUA_T_CLOSURE:
-			match = (ttype(t->stack.stack) == LUA_T_CLMARK && clvalue(t->stack.stack) == clvalue(f));
-			break;
-		case LUA_T_PROTO:
-			match = (ttype(t->stack.stack) == LUA_T_PMARK && tfvalue(t->stack.stack) == tfvalue(f));
-			break;
-		case LUA_T_TASK:
-			match = (t->id == (int32)nvalue(f));
-			break;
-		default:  /* Shut up gcc */
-			break;
-		}
-
-		if (match) {
-			prev->next = t->next;  /* Remove from list of active tasks */
-			t->next = NULL;
-			if (prev->next == NULL) {
-				L->last_task = prev;
-				if (t == L->curr_task) {
-					L->Tstate = DONE;
-				}
-			} else {
-				t->Tstate = DONE;
+	if (ttype(f) == LUA_T_TASK) {
+		t = findtask((int32)nvalue(f));
+		if (t != NULL)
+			stoptask(t);
+		return;
+	}
+	if (L->taskhsize == 0)
+		return;
+	func = funcof(f);
+	// Stop the matches in list order (oldest first), as stoptask
+	// looks at whether the task is the last one
+	for (;;) {
+		struct lua_Task *first = NULL;
+		for (t = L->taskfunc[funcbucket(func)]; t != NULL; t = t->funcnext) {
+			if (t->func != func)
+				continue;
+			if (ttype(f) == LUA_T_CLOSURE ? ttype(t->stack.stack) == LUA_T_CLMARK && clvalue(t->stack.stack) == clvalue(f)
+			                              : ttype(t->stack.stack) == LUA_T_PMARK && tfvalue(t->stack.stack) == tfvalue(f)) {
+				if (first == NULL || t->id < first->id)
+					first = t;
 			}
-		} else {
-			prev = t;
 		}
+		if (first == NULL)
+			break;
+		stoptask(first);
 	}
 }
 
 void next_script (void) {
-	struct lua_Task *t = NULL, *prev;
+	struct lua_Task *t = NULL;
 	TObject *f = L->stack.stack + L->Cstack.lua2C;
 
 	if (f == LUA_NOOBJECT)
 		lua_error("Bad argument to next_script: no obeject");
 
-	prev = L->root_task;
 	if (ttype(f) == LUA_T_NIL) {
 		t = L->root_task;
 	} else if (ttype(f) == LUA_T_TASK) {
-		int32 taskId = (int32)nvalue(f);
-		for (t = L->root_task->next; t != NULL; t = t->next) {
-			if (t->id == taskId)
-				break;
-		}
+		t = findtask((int32)nvalue(f));
 	} else {
 		lua_error("Bad argument to next_script.");
 	}
@@ -150,13 +343,8 @@ void identify_script (void) {
 		lua_error("Bad argument to identify_script");
 	}
 
-	int32 taskId = (int32)nvalue(f);
-	for (t = L->root_task->next; t != NULL; t = t->next) {
-		if (t->id == taskId)
-			break;
-	}
-
-	if ((t == NULL) || (t->Tstate == DONE)) {
+	t = findtask((int32)nvalue(f));
+	if ((t == NULL) || (luaI_taskstate(t) == DONE)) {
 			ttype(L->stack.top) = LUA_T_NIL;
 	} else {
 		*L->stack.top = *t->stack.stack;
@@ -167,38 +355,38 @@ void identify_script (void) {
 void find_script (void) {
 	struct lua_Task *t = NULL, *foundTask = NULL;
 	TObject *f = L->stack.stack + L->Cstack.lua2C;
-	int32 countTasks = 0, taskId;
+	int32 countTasks = 0;
+	GCnode *func;
 
 	switch (ttype(f)) {
 	case LUA_T_CLOSURE:
-		for (t = L->root_task->next; t != NULL; t = t->next) {
-			if ((ttype(t->stack.stack) == LUA_T_CLOSURE || ttype(t->stack.stack) == LUA_T_CMARK) && clvalue(t->stack.stack) == clvalue(f)) {
-				foundTask = t;
-				countTasks++;
-			}
-		}
-		t = foundTask;
-		break;
 	case LUA_T_PROTO:
-		for (t = L->root_task->next; t != NULL; t = t->next) {
-			if ((ttype(t->stack.stack) == LUA_T_PROTO || ttype(t->stack.stack) == LUA_T_PMARK) && tfvalue(t->stack.stack) == tfvalue(f)) {
-				foundTask = t;
+		if (L->taskhsize == 0)
+			break;
+		// The last match in list order is the newest, i.e. the highest id
+		func = funcof(f);
+		for (t = L->taskfunc[funcbucket(func)]; t != NULL; t = t->funcnext) {
+			if (t->func != func)
+				continue;
+			if (ttype(f) == LUA_T_CLOSURE ? (ttype(t->stack.stack) == LUA_T_CLOSURE || ttype(t->stack.stack) == LUA_T_CMARK) && clvalue(t->stack.stack) == clvalue(f)
+			                              : (ttype(t->stack.stack) == LUA_T_PROTO || ttype(t->stack.stack) == LUA_T_PMARK) && tfvalue(t->stack.stack) == tfvalue(f)) {
+				if (foundTask == NULL || t->id > foundTask->id)
+					foundTask = t;
 				countTasks++;
 			}
 		}
 		t = foundTask;
 		break;
 	case LUA_T_TASK:
-		taskId = (int32)nvalue(f);
-		for (t = L->root_task->next; t != NULL; t = t->next) {
-			if ((t->id == taskId) && (t->Tstate != DONE)) {
-				ttype(L->stack.top) = LUA_T_TASK;
-				nvalue(L->stack.top) = nvalue(f);
-				incr_top;
-				lua_pushnumber(1.0f);
-				return;
-			}
+		t = findtask((int32)nvalue(f));
+		if ((t != NULL) && (luaI_taskstate(t) != DONE)) {
+			ttype(L->stack.top) = LUA_T_TASK;
+			nvalue(L->stack.top) = nvalue(f);
+			incr_top;
+			lua_pushnumber(1.0f);
+			return;
 		}
+		t = NULL;
 		break;
 	default:
 		lua_error("Bad argument to find_script");
@@ -229,6 +417,103 @@ void break_here (void) {
 	L->Tstate = YIELD;
 }
 
+// Like break_here, but the task is not resumed until the task clock has
+// advanced by the given number of ticks (frames, unless the host sets
+// the clock with lua_settaskclock)
+void sleep_here (void) {
+	int32 ticks = (int32)luaL_check_number(1);
+
+	break_here();
+	L->curr_task->wake = L->taskclock + (ticks > 0 ? ticks : 0);
+}
+
+void lua_settaskclock (int32 now) {
+	L->taskclock = now;
+	L->hostclock = 1;
+}
+
+/*
+** Tell whether code resuming at pc is a loop that does nothing but call
+** break_here, such as "while 1 do break_here() end" or "repeat
+** break_here() until nil".  The loop may only test constants, jump, and
+** call the builtin break_here with no arguments and no results.
+*/
+#define IDLESTEPS	16
+
+static int32 isbreakhere (TObject *consts, int32 k) {
+	TObject *g = &tsvalue(&consts[k])->u.s.globalval;
+
+	return ttype(g) == LUA_T_CPROTO && fvalue(g) == break_here;
+}
+
+static int32 idleloop (Byte *resume, TObject *consts) {
+	Byte *pc = resume;
+	int32 stack[4], top = 0, steps, aux;
+
+	for (steps = 0; steps < IDLESTEPS; steps++) {
+		OpCode op = (OpCode)*pc++;
+		switch (op) {
+		case PUSHNIL0:
+		case PUSHNUMBER0: case PUSHNUMBER1: case PUSHNUMBER2:
+		case PUSHNUMBER:
+			if (top == 4)
+				return 0;
+			if (op == PUSHNUMBER)
+				pc++;
+			stack[top++] = (op != PUSHNIL0);
+			break;
+		case GETGLOBAL0: case GETGLOBAL1: case GETGLOBAL2: case GETGLOBAL3:
+		case GETGLOBAL4: case GETGLOBAL5: case GETGLOBAL6: case GETGLOBAL7:
+			if (top == 4 || !isbreakhere(consts, op - GETGLOBAL0))
+				return 0;
+			stack[top++] = 2;  /* break_here */
+			break;
+		case GETGLOBAL:
+			if (top == 4 || !isbreakhere(consts, *pc++))
+				return 0;
+			stack[top++] = 2;
+			break;
+		case CALLFUNC0:
+			if (*pc++ != 0 || top == 0 || stack[--top] != 2)
+				return 0;
+			return (pc == resume && top == 0);
+		case CALLGLOBAL:
+			if (!isbreakhere(consts, *pc++) || *pc++ != 0)
+				return 0;
+			return (pc == resume && top == 0);
+		case SETLINE:
+			pc++;
+			break;
+		case SETLINEW:
+			pc += 2;
+			break;
+		case JMP:
+			aux = *pc++;
+			pc += aux;
+			break;
+		case JMPW:
+			aux = (pc[1] << 8) | pc[0];
+			pc += 2 + aux;
+			break;
+		case IFFJMP: case IFTUPJMP: case IFFUPJMP:
+			aux = *pc++;
+			if (top == 0)
+				return 0;
+			top--;
+			if (op == IFFJMP && !stack[top])
+				pc += aux;
+			else if (op == IFTUPJMP && stack[top])
+				pc -= aux;
+			else if (op == IFFUPJMP && !stack[top])
+				pc -= aux;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 0;
+}
+
 void current_script (void) {
 	if (L->curr_task == L->root_task) {
 		lua_pushnil();
@@ -240,18 +525,25 @@ void current_script (void) {
 }
 
 void lua_runtasks (void) {
-	struct lua_Task *t, *prev;
+	struct lua_Task *t, *next;
 	struct lua_Task *old_task = L->curr_task;
+	int32 ndone = 0;
 	jmp_buf myErrorJmp;
 
-	prev = L->root_task;
-	while ((t = prev->next) != NULL) {
-		luaI_switchtask(t);
-		// Tstate is not available until after switching tasks
-		if (t->Tstate == PAUSE) {
-			prev = t;
+	if (!L->hostclock)
+		L->taskclock++;
+	while (L->nsleep > 0 && (int32)((uint32)L->sleepheap[0]->wake - (uint32)L->taskclock) <= 0) {
+		t = L->sleepheap[0];
+		heapremove(t);
+		runinsert(t);
+	}
+	for (t = L->run_first; t != NULL; t = next) {
+		if (luaI_taskstate(t) == PAUSE) {
+			next = t->runnext;
 			continue;
 		}
+		luaI_switchtask(t);
+		luaP_taskswitch();
 		L->errorJmp = &myErrorJmp;
 		L->Tstate = RUN;
 		if (setjmp(myErrorJmp) == 0) {
@@ -263,29 +555,34 @@ void lua_runtasks (void) {
 			L->Tstate = DONE;
 		}
 		L->errorJmp = NULL;
-		prev = t;
+		next = t->runnext;
+		if (L->Tstate == DONE)
+			ndone++;
+		else if (L->Tstate == YIELD && t->heapidx == TASK_RUNNABLE) {
+			if ((int32)((uint32)t->wake - (uint32)L->taskclock) > 0)
+				sleeptask(t);
+			else if (L->ci->pc != t->idlepc && L->ci->tf != NULL) {
+				if (idleloop(L->ci->pc, L->ci->tf->consts)) {
+					runremove(t);
+					t->heapidx = TASK_PARKED;
+				} else
+					t->idlepc = L->ci->pc;
+			}
+		}
 	}
 	// Free the completed tasks
 	// This MUST occur after all the tasks have been run (not during)
 	// or else when one task is freed right after another the task
 	// execution gets hosed.  Test Case: Switching between tw.set and
 	// tb.set in Rubacava causes a crash without this.
-	prev = L->root_task;
-	while ((t = prev->next) != NULL) {
-		luaI_switchtask(t);
-		if (L->Tstate == DONE) { // Remove from list of active tasks
+	for (t = L->root_task->next; ndone > 0 && t != NULL; t = next) {
+		next = t->next;
+		if (luaI_taskstate(t) == DONE) {
 			luaI_switchtask(old_task);
-			prev->next = t->next;
-			t->next = NULL;
-			if (prev->next == NULL) {
-				L->last_task = prev;
-			}
-			luaM_free(t);
-		} else {
-			prev = t;
+			ndone--;
+			unlinktask(t);
+			luaI_freetask(t);
 		}
 	}
-	if (L->curr_task != old_task) {
-		luaI_switchtask(old_task);
-	}
+	luaI_switchtask(old_task);
 }
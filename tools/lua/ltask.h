@@ -14,6 +14,7 @@ void pause_scripts (void);
 void unpause_scripts (void);
 void find_script (void);
 void break_here (void);
+void sleep_here (void);
 
 void gc_task (void);
 
@@ -55,6 +55,18 @@ static void init_entry (int32 tag)
   int32 i;
   for (i=0; i<IM_N; i++)
     ttype(luaT_getim(tag, i)) = LUA_T_NIL;
+  L->IMtable[-tag].events = 0;
+}
+
+
+/* Every method is stored here, so the events mask stays right */
+static void setim (int32 tag, int32 event, TObject *func)
+{
+  *luaT_getim(tag, event) = *func;
+  if (ttype(func) == LUA_T_NIL)
+    L->IMtable[-tag].events &= ~(1u<<event);
+  else
+    L->IMtable[-tag].events |= 1u<<event;
 }
 
 
@@ -100,7 +112,7 @@ int32 lua_copytagmethods (int32 tagto, int32 tagfrom)
   checktag(tagfrom);
   for (e=0; e<IM_N; e++) {
     if (validevent(tagto, e))
-      *luaT_getim(tagto, e) = *luaT_getim(tagfrom, e);
+      setim(tagto, e, luaT_getim(tagfrom, e));
   }
   return tagto;
 }
@@ -149,7 +161,7 @@ void luaT_settagmethod (int32 t, const char *event, TObject *func)
     luaL_verror("settagmethod: cannot change tag method `%.20s' for tag %d",
                 luaT_eventname[e], t);
   *func = *luaT_getim(t,e);
-  *luaT_getim(t, e) = temp;
+  setim(t, e, &temp);
 }
 
 
@@ -200,7 +212,7 @@ static void fillvalids (IMS e, TObject *func)
   int32 t;
   for (t=LUA_T_NIL; t<=LUA_T_USERDATA; t++)
     if (validevent(t, e))
-      *luaT_getim(t, e) = *func;
+      setim(t, e, func);
 }
 
 
@@ -220,7 +232,7 @@ void luaT_setfallback (void)
       break;
     case 1:  /* old getglobal fallback */
       oldfunc = *luaT_getim(LUA_T_NIL, IM_GETGLOBAL);
-      *luaT_getim(LUA_T_NIL, IM_GETGLOBAL) = *luaA_Address(func);
+      setim(LUA_T_NIL, IM_GETGLOBAL, luaA_Address(func));
       replace = nilFB;
       break;
     case 2: {  /* old arith fallback */
@@ -42,12 +42,17 @@ typedef int32 IMS;
 
 struct IM {
   TObject int_method[IM_N];
+  uint32 events;  /* bit e set while int_method[e] is not nil */
 };
 
 
 #define luaT_getim(tag,event) (&L->IMtable[-(tag)].int_method[event])
 #define luaT_getimbyObj(o,e)  (luaT_getim(luaT_efectivetag(o),(e)))
 
+/* Whether a tag has a method for the event, without reading it */
+#define luaT_hasim(tag,event) (L->IMtable[-(tag)].events & (1u<<(event)))
+#define luaT_hasimbyObj(o,e)  (luaT_hasim(luaT_efectivetag(o),(e)))
+
 extern const char *luaT_eventname[];
 
 
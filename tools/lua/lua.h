@@ -23,8 +23,24 @@
 typedef void (*lua_CFunction)(void);
 typedef uint32 lua_Object;
 
+/*
+** Returns the contents of a file for lua_dofile, or NULL to let it open
+** the file itself; the data must stay valid until the state is closed.
+*/
+typedef const char *(*lua_FileReader)(const char *filename, int32 *size);
+
+/*
+** The current state, and the few globals that go with it, belong to the
+** calling thread: a program may run one state per thread (see luac -j).
+*/
+#ifdef _MSC_VER
+#define LUA_THREAD	__declspec(thread)
+#else
+#define LUA_THREAD	__thread
+#endif
+
 typedef struct lua_State lua_State;
-extern lua_State *lua_state;
+extern LUA_THREAD lua_State *lua_state;
 
 struct PointerId {
 	uint32	low;
@@ -68,6 +84,7 @@ int32            lua_dofile 		(const char *filename); /* Out: returns */
 int32            lua_dostring 		(const char *string); /* Out: returns */
 int32            lua_dobuffer		(const char *buff, int32 size, const char *name);
 					  /* Out: returns */
+lua_FileReader lua_setfilereader	(lua_FileReader reader); /* Out: old reader */
 int32            lua_callfunction		(lua_Object f);
 					  /* In: parameters; Out: returns */
 
@@ -123,8 +140,11 @@ void	       lua_unref		(int32 ref);
 lua_Object     lua_createtable		(void);
 
 int32	       lua_collectgarbage	(int32 limit);
+int32	       lua_gcstep		(int32 work);  /* idle-time GC work */
+void	       lua_setgcstepsize	(int32 work);  /* 0: stop-the-world */
 
 void	       lua_runtasks		(void);
+void	       lua_settaskclock	(int32 now);  /* time base of sleep_here */
 
 void current_script (void);
 
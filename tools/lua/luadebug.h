@@ -24,10 +24,24 @@ const char *lua_getobjname (lua_Object o, const char **name);
 lua_Object lua_getlocal (lua_Function func, int32 local_number, char **name);
 int32 lua_setlocal (lua_Function func, int32 local_number);
 
+int32 lua_startsampling (int32 hz);
+void lua_stopsampling (void);
+int32 lua_dumpsamples (FILE *f);
 
-extern lua_LHFunction lua_linehook;
-extern lua_CHFunction lua_callhook;
-extern int32 lua_debug;
+
+#ifdef LUA_PROFILER
+/* Formats of lua_dumpprofile */
+#define LUA_PROFILE_JSON	0
+#define LUA_PROFILE_STACKS	1  /* folded stacks, as flamegraph.pl reads them */
+
+void lua_resetprofile (void);
+int32 lua_dumpprofile (FILE *f, int32 format);
+#endif
+
+
+extern LUA_THREAD lua_LHFunction lua_linehook;
+extern LUA_THREAD lua_CHFunction lua_callhook;
+extern LUA_THREAD int32 lua_debug;
 
 
 #endif
@@ -8,7 +8,9 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
+#include "lopcodes.h"
 
 #define	LoadBlock(b,size,Z)	ezread(Z,b,size)
 #define	LoadNative(t,Z)		LoadBlock(&t,sizeof(t),Z)
@@ -44,17 +46,38 @@ static void ezread(ZIO* Z, void* b, int32 n)
  if (r!=0) unexpectedEOZ(Z);
 }
 
+/*
+** Fields are big-endian.  When the bytes are already in the ZIO buffer
+** (always, for chunks loaded from memory) they are read in place.
+*/
 static uint16 LoadWord(ZIO* Z)
 {
- uint16 hi=ezgetc(Z);
- uint16 lo=ezgetc(Z);
+ uint16 hi,lo;
+ if (Z->n>=2)
+ {
+  hi=Z->p[0];
+  lo=Z->p[1];
+  Z->p+=2;
+  Z->n-=2;
+  return (hi<<8)|lo;
+ }
+ hi=ezgetc(Z);
+ lo=ezgetc(Z);
  return (hi<<8)|lo;
 }
 
 static uint32 LoadLong(ZIO* Z)
 {
- uint32 hi=LoadWord(Z);
- uint32 lo=LoadWord(Z);
+ uint32 hi,lo;
+ if (Z->n>=4)
+ {
+  const byte* p=Z->p;
+  Z->p+=4;
+  Z->n-=4;
+  return ((uint32)p[0]<<24)|((uint32)p[1]<<16)|((uint32)p[2]<<8)|p[3];
+ }
+ hi=LoadWord(Z);
+ lo=LoadWord(Z);
  return (hi<<16)|lo;
 }
 
@@ -75,18 +98,40 @@ static Byte* LoadCode(ZIO* Z)
  return (Byte *)b;
 }
 
+/* strings are stored with every byte inverted; undo it a word at a time */
+static void DecodeString(char* d, const byte* s, int32 n)
+{
+ int32 i;
+ for (i=0; i+4<=n; i+=4)
+ {
+  uint32 w;
+  memcpy(&w,s+i,4);
+  w=~w;
+  memcpy(d+i,&w,4);
+ }
+ for (; i<n; i++)
+  d[i]=(char)~s[i];
+}
+
 static TaggedString* LoadTString(ZIO* Z)
 {
  int32 size=LoadWord(Z);
- int32 i;
  if (size==0)
   return NULL;
  else
  {
   char* s=luaL_openspace(size);
-  LoadBlock(s,size,Z);
-  for (i=0; i<size; i++)
-   s[i]^=0xff;
+  if (Z->n>=size)
+  {
+   DecodeString(s,Z->p,size);
+   Z->p+=size;
+   Z->n-=size;
+  }
+  else
+  {
+   LoadBlock(s,size,Z);
+   DecodeString(s,(const byte *)s,size);
+  }
   return luaS_newlstr(s,size-1);
  }
 }
@@ -176,6 +221,169 @@ static TProtoFunc* LoadFunction(ZIO* Z)
  return tf;
 }
 
+/*
+** A snapshot (luac -S) is the heap left by running some scripts: every
+** string, prototype, closure and table they reach from the globals, which
+** refer to each other by index.  All objects are created first, so the
+** references can be resolved in one pass whatever cycles there are, and
+** each string is interned only once.
+*/
+typedef struct Snapshot
+{
+ int32 nstrings,nprotos,nclosures,ntables;
+ TaggedString** strings;
+ TProtoFunc** protos;
+ Closure** closures;
+ Hash** tables;
+} Snapshot;
+
+static int32 LoadIndex(ZIO* Z, int32 n)
+{
+ int32 i=LoadLong(Z);
+ if (i<0 || i>=n) luaL_verror("bad reference in snapshot %s",zname(Z));
+ return i;
+}
+
+static TaggedString* LoadSString(ZIO* Z, Snapshot* S)	/* 0 is NULL */
+{
+ int32 i=LoadLong(Z);
+ if (i==0) return NULL;
+ if (i<0 || i>S->nstrings) luaL_verror("bad reference in snapshot %s",zname(Z));
+ return S->strings[i-1];
+}
+
+static void LoadValue(ZIO* Z, Snapshot* S, TObject* o)
+{
+ int32 t=ezgetc(Z);
+ switch (t)
+ {
+  case 'N':
+	ttype(o)=LUA_T_NUMBER;
+	doLoadNumber(nvalue(o),Z);
+	break;
+  case 'S':
+	ttype(o)=LUA_T_STRING;
+	tsvalue(o)=S->strings[LoadIndex(Z,S->nstrings)];
+	break;
+  case 'F':
+	ttype(o)=LUA_T_PROTO;
+	tfvalue(o)=S->protos[LoadIndex(Z,S->nprotos)];
+	break;
+  case 'C':
+	ttype(o)=LUA_T_CLOSURE;
+	clvalue(o)=S->closures[LoadIndex(Z,S->nclosures)];
+	break;
+  case 'T':
+	ttype(o)=LUA_T_ARRAY;
+	avalue(o)=S->tables[LoadIndex(Z,S->ntables)];
+	break;
+  case 'B':				/* builtin, by the name it is predefined as */
+  {
+	TaggedString* name=S->strings[LoadIndex(Z,S->nstrings)];
+	*o=name->u.s.globalval;
+	if (ttype(o)!=LUA_T_CPROTO)
+	 luaL_verror("C function %s used by snapshot %s is not defined",
+		name->str,zname(Z));
+	break;
+  }
+  case '-':
+	ttype(o)=LUA_T_NIL;
+	break;
+  default:
+	luaL_verror("bad value in snapshot %s: type=%d",zname(Z),t);
+	break;
+ }
+}
+
+static void LoadSProto(ZIO* Z, Snapshot* S, TProtoFunc* tf)
+{
+ int32 i,n;
+ tf->lineDefined=LoadWord(Z);
+ tf->fileName=LoadSString(Z,S);
+ tf->code=LoadCode(Z);
+ n=LoadWord(Z);
+ tf->nconsts=n;
+ if (n>0) tf->consts=luaM_newvector(n,TObject);
+ for (i=0; i<n; i++)
+  LoadValue(Z,S,tf->consts+i);
+ n=LoadWord(Z);
+ if (n==0) return;
+ tf->locvars=luaM_newvector(n+1,LocVar);
+ for (i=0; i<n; i++)
+ {
+  tf->locvars[i].line=LoadWord(Z);
+  tf->locvars[i].varname=LoadSString(Z,S);
+ }
+ tf->locvars[i].line=-1;		/* flag end of vector */
+ tf->locvars[i].varname=NULL;
+}
+
+static TProtoFunc* LoadSnapshot(ZIO* Z)
+{
+ static const Byte nocode[]={0,0,ENDCODE};	/* STACK 0; ARGS 0 */
+ Snapshot S;
+ TProtoFunc* Main;
+ int32 i,j,n;
+ S.nstrings=LoadLong(Z);
+ S.nprotos=LoadLong(Z);
+ S.nclosures=LoadLong(Z);
+ S.ntables=LoadLong(Z);
+ if (S.nstrings<0 || S.nprotos<0 || S.nclosures<0 || S.ntables<0)
+  luaL_verror("bad snapshot header in %s",zname(Z));
+ S.strings=luaM_newvector(S.nstrings+1,TaggedString*);
+ S.protos=luaM_newvector(S.nprotos+1,TProtoFunc*);
+ S.closures=luaM_newvector(S.nclosures+1,Closure*);
+ S.tables=luaM_newvector(S.ntables+1,Hash*);
+ for (i=0; i<S.nstrings; i++)
+ {
+  S.strings[i]=LoadTString(Z);
+  if (S.strings[i]==NULL) luaL_verror("bad string in snapshot %s",zname(Z));
+ }
+ for (i=0; i<S.nprotos; i++)
+  S.protos[i]=luaF_newproto();
+ for (i=0; i<S.nclosures; i++)
+  S.closures[i]=luaF_newclosure(LoadWord(Z));
+ for (i=0; i<S.ntables; i++)
+ {
+  int32 na=LoadLong(Z);
+  S.tables[i]=luaH_newsized(na,LoadLong(Z));
+ }
+ for (i=0; i<S.nprotos; i++)
+  LoadSProto(Z,&S,S.protos[i]);
+ for (i=0; i<S.nclosures; i++)
+  for (j=0; j<=S.closures[i]->nelems; j++)
+   LoadValue(Z,&S,S.closures[i]->consts+j);
+ for (i=0; i<S.ntables; i++)
+ {
+  n=LoadLong(Z);
+  for (j=0; j<n; j++)
+  {
+   TObject ref,val;
+   LoadValue(Z,&S,&ref);
+   LoadValue(Z,&S,&val);
+   if (ttype(&ref)==LUA_T_NIL) luaL_verror("bad key in snapshot %s",zname(Z));
+   *luaH_set(S.tables[i],&ref)=val;
+  }
+ }
+ n=LoadLong(Z);
+ for (i=0; i<n; i++)
+ {
+  TaggedString* name=S.strings[LoadIndex(Z,S.nstrings)];
+  TObject val;
+  LoadValue(Z,&S,&val);
+  luaS_rawsetglobal(name,&val);
+ }
+ luaM_free(S.strings);
+ luaM_free(S.protos);
+ luaM_free(S.closures);
+ luaM_free(S.tables);
+ Main=luaF_newproto();			/* nothing left to run */
+ Main->fileName=luaS_new(zname(Z));
+ Main->code=(Byte*)luaM_malloc(sizeof(nocode));
+ memcpy(Main->code,nocode,sizeof(nocode));
+ return Main;
+}
+
 static void LoadSignature(ZIO* Z)
 {
  const char* s=SIGNATURE;
@@ -184,7 +392,7 @@ static void LoadSignature(ZIO* Z)
  if (*s!=0) luaL_verror("bad signature in %s",zname(Z));
 }
 
-static void LoadHeader(ZIO* Z)
+static int32 LoadHeader(ZIO* Z)
 {
  int32 version,id,sizeofR;
 #if 0
@@ -192,10 +400,10 @@ static void LoadHeader(ZIO* Z)
 #endif
  LoadSignature(Z);
  version=ezgetc(Z);
- if (version>VERSION)
+ if (version>VERSION_SNAPSHOT)	/* later versions keep the 3.1 header */
   luaL_verror(
 	"%s too new: version=0x%02x; expected at most 0x%02x",
-	zname(Z),version,VERSION);
+	zname(Z),version,VERSION_SNAPSHOT);
  if (version<VERSION0)			/* check last major change */
   luaL_verror(
 	"%s too old: version=0x%02x; expected at least 0x%02x",
@@ -216,11 +424,13 @@ static void LoadHeader(ZIO* Z)
 	zname(Z),f,tf);
 #endif
   ezgetc(Z); ezgetc(Z); ezgetc(Z);
+  return version;
 }
 
 static TProtoFunc* LoadChunk(ZIO* Z)
 {
- LoadHeader(Z);
+ if (LoadHeader(Z)==VERSION_SNAPSHOT)
+  return LoadSnapshot(Z);
  return LoadFunction(Z);
 }
 
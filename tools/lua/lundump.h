@@ -15,6 +15,8 @@ TProtoFunc* luaU_undump1(ZIO* Z);	/* load one chunk */
 #define	SIGNATURE	"Lua"
 #define	VERSION		0x31		/* last format change was in 3.1 */
 #define	VERSION0	0x31		/* last major  change was in 3.1 */
+#define	VERSION_FUSED	0x32		/* 3.1 plus superinstructions (luac -F) */
+#define	VERSION_SNAPSHOT 0x33		/* heap snapshot (luac -S) */
 #define ID_CHUNK	27		/* ESC */
 
 #define IsMain(f)	(f->lineDefined==0)
@@ -5,12 +5,17 @@
 */
 
 
+#include <ctype.h>
+#include <math.h>
+
 #include "lauxlib.h"
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
 #include "lmem.h"
 #include "lopcodes.h"
+#include "lprofile.h"
+#include "lsample.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -19,6 +24,50 @@
 #include "lvm.h"
 
 
+/*
+** With USE_COMPUTED_GOTO every opcode ends with its own jump to the next
+** one through a table of labels, instead of all of them going back to a
+** single switch, so each jump is predicted from the opcode before it.
+** Either way, 'aux' holds the opcode when its code starts.
+*/
+#ifdef USE_COMPUTED_GOTO
+/* Taking the address of a label is a GNU extension */
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__GNUC__) && !defined(__clang__)
+/* Or GCC merges the jumps ending the opcodes back into a few shared ones */
+#pragma GCC optimize ("no-crossjumping")
+#endif
+#define vmdispatch(o)	goto *disptab[o];
+#define vmcase(op)	L_##op:
+#define vmbreak		goto *disptab[vmfetch()]
+#else
+#define vmdispatch(o)	switch ((OpCode)(o))
+#define vmcase(op)	case op:
+#define vmbreak		break
+#endif
+
+/* Counted per call of luaV_execute and added up when it returns */
+#ifdef LUA_PROFILER
+#define vmfetch()	(ops++, profops[*pc]++, aux = *pc++)
+#else
+#define vmfetch()	(ops++, aux = *pc++)
+#endif
+
+LUA_THREAD uint32 luaV_opcount = 0;
+
+
+/*
+** GETDOTTED and PUSHSELF on a table without a "gettable" method read
+** the field through the node cache of the function (luaH_getfield)
+*/
+#define fieldaccess(o,key)	(ttype(o) == LUA_T_ARRAY && \
+	ttype(key) == LUA_T_STRING && \
+	!luaT_hasim(avalue(o)->htag, IM_GETTABLE))
+
+#define fieldslot(tf,k)	\
+	(((tf)->fieldcache ? (tf)->fieldcache : luaF_newfieldcache(tf)) + (k))
+
+
 #define skip_word(pc)	(pc+=2)
 
 #define get_word(pc)	((*((pc)+1)<<8)|(*(pc)))
@@ -26,24 +75,41 @@
 #define next_word(pc)   (pc+=2, get_word(pc-2))
 
 
-static TaggedString *strconc (TaggedString *l, TaggedString *r)
+/* What luaV_tostring makes of nil, kept from the original engine */
+#define NILSTRING	"(nil)"
+
+
+/*
+** Plain decimal integers, which is what scripts mostly convert, skip sscanf.
+** Up to 9 digits, so the value is exact in a double as sscanf would read it.
+*/
+static int32 readinteger (const char *s, double *t)
 {
-  size_t nl = l->u.s.len;
-  size_t nr = r->u.s.len;
-  char *buffer = luaL_openspace(nl+nr+1);
-  memcpy(buffer, l->str, nl);
-  memcpy(buffer+nl, r->str, nr);
-  return luaS_newlstr(buffer, nl+nr);
+  int32 neg = 0, ndigits = 0;
+  long n = 0;
+  while (isspace((unsigned char)*s)) s++;
+  if (*s == '-' || *s == '+')
+    neg = (*s++ == '-');
+  while (*s >= '0' && *s <= '9') {
+    if (++ndigits > 9)
+      return 0;
+    n = n*10 + (*s++ - '0');
+  }
+  while (isspace((unsigned char)*s)) s++;
+  if (ndigits == 0 || *s != '\0')
+    return 0;
+  *t = neg ? -(double)n : (double)n;
+  return 1;
 }
 
-
 int32 luaV_tonumber (TObject *obj)
 {  /* LUA_NUMBER */
   double t;
   char c;
   if (ttype(obj) != LUA_T_STRING)
     return 1;
-  else if (sscanf(svalue(obj), "%lf %c",&t, &c) == 1) {
+  else if (readinteger(svalue(obj), &t) ||
+           sscanf(svalue(obj), "%lf %c",&t, &c) == 1) {
     nvalue(obj) = (real)t;
     ttype(obj) = LUA_T_NUMBER;
     return 0;
@@ -53,12 +119,105 @@ int32 luaV_tonumber (TObject *obj)
 }
 
 
+/* Digits of n, with a '-' if negative; returns the length */
+static int32 writeinteger (char *s, int32 n)
+{
+  char digits[12];
+  int32 len = 0, nd = 0;
+  uint32 u = n < 0 ? 0U-(uint32)n : (uint32)n;
+  do {
+    digits[nd++] = (char)('0' + u%10);
+    u /= 10;
+  } while (u);
+  if (n < 0)
+    s[len++] = '-';
+  while (nd)
+    s[len++] = digits[--nd];
+  s[len] = '\0';
+  return len;
+}
+
+/*
+** NUMBER_FMT ("%g") for a float whose decimal exponent lies in -4..5, the
+** range where %g prints without an exponent: the six significant digits
+** come from exact integer arithmetic on the float's 24-bit mantissa,
+** rounded to nearest even like printf.  Returns the length, or 0 when
+** the number needs the exponent form and sprintf.
+*/
+static int32 writefloat (char *s, real f)
+{
+  static const double pow10[] = {1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2,
+                                 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+  double v = f < 0 ? -(double)f : (double)f;
+  uint64 m, a, rem, half;
+  uint32 n;
+  int32 e, x, q, i, len = 0, point;
+  char digits[6];
+  if (sizeof(real) != sizeof(float) || !(v >= 1e-4 && v < 1e6))
+    return 0;
+  for (x = 5; v < pow10[x+4]; x--)
+    ;
+  m = (uint64)ldexp(frexp(v, &e), 24);
+  q = 24-e;  /* v == m/2^q, q >= 1 since v is not an integer here */
+  a = m * (uint64)pow10[(5-x)+4];
+  n = (uint32)(a >> q);
+  rem = a & (((uint64)1 << q) - 1);
+  half = (uint64)1 << (q-1);
+  if (rem > half || (rem == half && (n & 1)))
+    n++;
+  if (n == 1000000) {  /* rounded up to the next power of ten */
+    n = 100000;
+    if (++x > 5)
+      return 0;
+  }
+  for (i = 5; i >= 0; i--) {
+    digits[i] = (char)('0' + n%10);
+    n /= 10;
+  }
+  if (f < 0)
+    s[len++] = '-';
+  if (x < 0) {
+    s[len++] = '0';
+    point = len;
+    s[len++] = '.';
+    for (i = x+1; i < 0; i++)
+      s[len++] = '0';
+    for (i = 0; i < 6; i++)
+      s[len++] = digits[i];
+  }
+  else {
+    for (i = 0; i <= x; i++)
+      s[len++] = digits[i];
+    point = len;
+    s[len++] = '.';
+    for (; i < 6; i++)
+      s[len++] = digits[i];
+  }
+  while (s[len-1] == '0')  /* %g drops trailing zeros, then a bare point */
+    len--;
+  if (len-1 == point)
+    len--;
+  s[len] = '\0';
+  return len;
+}
+
+/* NUMBER_FMT of f, or its digits if it is an integer; returns the length */
+static int32 writenumber (char *s, real f)
+{
+  int32 i, len;
+  if ((real)(-MAX_INT) <= f && f <= (real)MAX_INT && (real)(i=(int32)f) == f)
+    return writeinteger(s, i);
+  else if ((len = writefloat(s, f)) == 0)
+    len = sprintf(s, NUMBER_FMT, (double)f);
+  return len;
+}
+
 int32 luaV_tostring (TObject *obj)
 { /* LUA_NUMBER */
   /* The Lua scripts for Grim Fandango sometimes end up executing
      str..nil.  The nil shows up in the original engine as "(nil)"... */
   if (ttype(obj) == LUA_T_NIL) {
-    tsvalue(obj) = luaS_new("(nil)");
+    tsvalue(obj) = luaS_new(NILSTRING);
     ttype(obj) = LUA_T_STRING;
     return 0;
   }
@@ -66,19 +225,54 @@ int32 luaV_tostring (TObject *obj)
     return 1;
   else {
     char s[60];
-    real f = nvalue(obj);
-    int32 i;
-    if ((real)(-MAX_INT) <= f && f <= (real)MAX_INT && (real)(i=(int32)f) == f)
-      sprintf (s, "%d", (int)i);
-    else
-      sprintf (s, NUMBER_FMT, nvalue(obj));
-    tsvalue(obj) = luaS_new(s);
+    int32 len = writenumber(s, nvalue(obj));
+    tsvalue(obj) = luaS_newlstr(s, len);
     ttype(obj) = LUA_T_STRING;
     return 0;
   }
 }
 
 
+#define concatable(o)	(ttype(o) == LUA_T_STRING || \
+	ttype(o) == LUA_T_NUMBER || ttype(o) == LUA_T_NIL)
+
+/*
+** Concatenate the top n values of the stack, all strings, numbers or nil,
+** into one string in their place.  Numbers are printed straight into the
+** buffer, so only the result gets interned.
+*/
+static void concat (int32 n)
+{
+  struct Stack *S = &L->stack;
+  TObject *first = S->top-n;
+  TObject *o;
+  size_t size = 0, len = 0;
+  char *buffer;
+  for (o = first; o < S->top; o++) {
+    if (ttype(o) == LUA_T_STRING)
+      size += tsvalue(o)->u.s.len;
+    else
+      size += 60;  /* as luaV_tostring's buffer; also holds NILSTRING */
+  }
+  buffer = luaL_openspace(size+1);
+  for (o = first; o < S->top; o++) {
+    if (ttype(o) == LUA_T_STRING) {
+      memcpy(buffer+len, tsvalue(o)->str, tsvalue(o)->u.s.len);
+      len += tsvalue(o)->u.s.len;
+    }
+    else if (ttype(o) == LUA_T_NUMBER)
+      len += writenumber(buffer+len, nvalue(o));
+    else {
+      memcpy(buffer+len, NILSTRING, sizeof(NILSTRING)-1);
+      len += sizeof(NILSTRING)-1;
+    }
+  }
+  tsvalue(first) = luaS_newlstr(buffer, len);
+  ttype(first) = LUA_T_STRING;
+  S->top = first+1;
+}
+
+
 void luaV_closure (int32 nelems)
 {
   if (nelems > 0) {
@@ -106,14 +300,14 @@ void luaV_gettable (void)
   else {  /* object is a table... */
     int32 tg = (S->top-2)->value.a->htag;
     im = luaT_getim(tg, IM_GETTABLE);
-    if (ttype(im) == LUA_T_NIL) {  /* and does not have a "gettable" method */
+    if (!luaT_hasim(tg, IM_GETTABLE)) {  /* and does not have a "gettable" method */
       TObject *h = luaH_get(avalue(S->top-2), S->top-1);
       if (h != NULL && ttype(h) != LUA_T_NIL) {
         --S->top;
         *(S->top-1) = *h;
       }
-      else if (ttype(im=luaT_getim(tg, IM_INDEX)) != LUA_T_NIL)
-        luaD_callTM(im, 2, 1);
+      else if (luaT_hasim(tg, IM_INDEX))
+        luaD_callTM(luaT_getim(tg, IM_INDEX), 2, 1);
       else {
         --S->top;
         ttype(S->top-1) = LUA_T_NIL;
@@ -139,14 +333,19 @@ void luaV_gettable (void)
 void luaV_settable (TObject *t, int32 mode)
 {
   struct Stack *S = &L->stack;
-  TObject *im = (mode == 0) ? NULL : luaT_getimbyObj(t, IM_SETTABLE);
-  if (ttype(t) == LUA_T_ARRAY && (im == NULL || ttype(im) == LUA_T_NIL)) {
+  TObject *im = NULL;
+  if (mode != 0) {
+    int32 tg = luaT_efectivetag(t);
+    if (luaT_hasim(tg, IM_SETTABLE))
+      im = luaT_getim(tg, IM_SETTABLE);
+  }
+  if (ttype(t) == LUA_T_ARRAY && im == NULL) {
     TObject *h = luaH_set(avalue(t), t+1);
     *h = *(S->top-1);
     S->top -= (mode == 2) ? 1 : 3;
   }
   else {  /* object is not a table, and/or has a specific "settable" method */
-    if (im && ttype(im) != LUA_T_NIL) {
+    if (im != NULL) {
       if (mode == 2) {
         *(S->top+1) = *(L->stack.top-1);
         *(S->top) = *(t+1);
@@ -165,12 +364,13 @@ void luaV_getglobal (TaggedString *ts)
 {
   /* WARNING: caller must assure stack space */
   TObject *value = &ts->u.s.globalval;
-  TObject *im = luaT_getimbyObj(value, IM_GETGLOBAL);
-  if (ttype(im) == LUA_T_NIL) {  /* default behavior */
+  int32 tg = luaT_efectivetag(value);
+  if (!luaT_hasim(tg, IM_GETGLOBAL)) {  /* default behavior */
     *L->stack.top++ = *value;
   }
   else {
     struct Stack *S = &L->stack;
+    TObject *im = luaT_getim(tg, IM_GETGLOBAL);
     ttype(S->top) = LUA_T_STRING;
     tsvalue(S->top) = ts;
     S->top++;
@@ -183,12 +383,13 @@ void luaV_getglobal (TaggedString *ts)
 void luaV_setglobal (TaggedString *ts)
 {
   TObject *oldvalue = &ts->u.s.globalval;
-  TObject *im = luaT_getimbyObj(oldvalue, IM_SETGLOBAL);
-  if (ttype(im) == LUA_T_NIL)  /* default behavior */
+  int32 tg = luaT_efectivetag(oldvalue);
+  if (!luaT_hasim(tg, IM_SETGLOBAL))  /* default behavior */
     luaS_rawsetglobal(ts, --L->stack.top);
   else {
     /* WARNING: caller must assure stack space */
     struct Stack *S = &L->stack;
+    TObject *im = luaT_getim(tg, IM_SETGLOBAL);
     TObject newvalue = *(S->top-1);
     ttype(S->top-1) = LUA_T_STRING;
     tsvalue(S->top-1) = ts;
@@ -260,6 +461,52 @@ static void comparison (lua_Type ttype_less, lua_Type ttype_equal,
                                 (result == 0) ? ttype_equal : ttype_great;
 }
 
+/*
+** Compare the two values on top of the stack with relational opcode op,
+** pop them and return whether the comparison held.  This is what op
+** followed by a test of the value it leaves would give; it backs the
+** fused compare-and-jump superinstructions.
+*/
+static int32 testcomparison (int32 op)
+{
+  struct Stack *S = &L->stack;
+  TObject *l = S->top-2;
+  TObject *r = S->top-1;
+  if (ttype(l) == LUA_T_NUMBER && ttype(r) == LUA_T_NUMBER) {
+    real a = nvalue(l), b = nvalue(r);
+    int32 result = (a < b) ? -1 : (a == b) ? 0 : 1;
+    S->top -= 2;
+    switch (op) {
+      case EQOP:  return a == b;
+      case NEQOP: return a != b;
+      case LTOP:  return result < 0;
+      case LEOP:  return result <= 0;
+      case GTOP:  return result > 0;
+      default:    return result >= 0;
+    }
+  }
+  switch (op) {
+    case EQOP: case NEQOP: {
+      int32 res = luaO_equalObj(l, r);
+      S->top -= 2;
+      return (op == NEQOP) ? !res : res;
+    }
+    case LTOP:
+      comparison(LUA_T_NUMBER, LUA_T_NIL, LUA_T_NIL, IM_LT);
+      break;
+    case LEOP:
+      comparison(LUA_T_NUMBER, LUA_T_NUMBER, LUA_T_NIL, IM_LE);
+      break;
+    case GTOP:
+      comparison(LUA_T_NIL, LUA_T_NIL, LUA_T_NUMBER, IM_GT);
+      break;
+    default:
+      comparison(LUA_T_NIL, LUA_T_NUMBER, LUA_T_NUMBER, IM_GE);
+      break;
+  }
+  return ttype(--S->top) != LUA_T_NIL;
+}
+
 
 void luaV_pack (StkId firstel, int32 nvararg, TObject *tab)
 {
@@ -300,6 +547,13 @@ StkId luaV_execute (struct CallInfo *ci)
   StkId base;
   Byte *pc;
   TObject *consts;
+  uint32 ops = 0;
+#ifdef LUA_PROFILER
+  uint32 *profops = L->prof->ops;
+#endif
+#ifdef USE_COMPUTED_GOTO
+#include "ljumptab.h"
+#endif
  newfunc:
   cl = L->ci->c;
   tf = L->ci->tf;
@@ -309,153 +563,169 @@ StkId luaV_execute (struct CallInfo *ci)
   pc = L->ci->pc;
   consts = tf->consts;
   while (1) {
-    int32 aux;
-    switch ((OpCode)(aux = *pc++)) {
+    int32 aux, nargs;
+    vmdispatch(vmfetch()) {
 
-      case PUSHNIL0:
+      vmcase(PUSHNIL0)
         ttype(S->top++) = LUA_T_NIL;
-        break;
+        vmbreak;
 
-      case PUSHNIL:
+      vmcase(PUSHNIL)
         aux = *pc++;
         do {
           ttype(S->top++) = LUA_T_NIL;
         } while (aux--);
-        break;
+        vmbreak;
 
-      case PUSHNUMBER:
+      vmcase(PUSHNUMBER)
         aux = *pc++; goto pushnumber;
 
-      case PUSHNUMBERW:
+      vmcase(PUSHNUMBERW)
         aux = next_word(pc); goto pushnumber;
 
-      case PUSHNUMBER0: case PUSHNUMBER1: case PUSHNUMBER2:
+      vmcase(PUSHNUMBER0) vmcase(PUSHNUMBER1) vmcase(PUSHNUMBER2)
         aux -= PUSHNUMBER0;
       pushnumber:
         ttype(S->top) = LUA_T_NUMBER;
         nvalue(S->top) = (real)aux;
         S->top++;
-        break;
+        vmbreak;
 
-      case PUSHLOCAL:
+      vmcase(PUSHLOCAL)
         aux = *pc++; goto pushlocal;
 
-      case PUSHLOCAL0: case PUSHLOCAL1: case PUSHLOCAL2: case PUSHLOCAL3:
-      case PUSHLOCAL4: case PUSHLOCAL5: case PUSHLOCAL6: case PUSHLOCAL7:
+      vmcase(PUSHLOCAL0) vmcase(PUSHLOCAL1) vmcase(PUSHLOCAL2) vmcase(PUSHLOCAL3)
+      vmcase(PUSHLOCAL4) vmcase(PUSHLOCAL5) vmcase(PUSHLOCAL6) vmcase(PUSHLOCAL7)
         aux -= PUSHLOCAL0;
       pushlocal:
         *S->top++ = *((S->stack+base) + aux);
-        break;
+        vmbreak;
 
-      case GETGLOBALW:
+      vmcase(GETGLOBALW)
         aux = next_word(pc); goto getglobal;
 
-      case GETGLOBAL:
+      vmcase(GETGLOBAL)
         aux = *pc++; goto getglobal;
 
-      case GETGLOBAL0: case GETGLOBAL1: case GETGLOBAL2: case GETGLOBAL3:
-      case GETGLOBAL4: case GETGLOBAL5: case GETGLOBAL6: case GETGLOBAL7:
+      vmcase(GETGLOBAL0) vmcase(GETGLOBAL1) vmcase(GETGLOBAL2) vmcase(GETGLOBAL3)
+      vmcase(GETGLOBAL4) vmcase(GETGLOBAL5) vmcase(GETGLOBAL6) vmcase(GETGLOBAL7)
         aux -= GETGLOBAL0;
       getglobal:
         luaV_getglobal(tsvalue(&consts[aux]));
-        break;
+        vmbreak;
 
-      case GETTABLE:
+      vmcase(GETTABLE)
        luaV_gettable();
-       break;
+       vmbreak;
 
-      case GETDOTTEDW:
+      vmcase(GETDOTTEDW)
         aux = next_word(pc); goto getdotted;
 
-      case GETDOTTED:
+      vmcase(GETDOTTED)
         aux = *pc++; goto getdotted;
 
-      case GETDOTTED0: case GETDOTTED1: case GETDOTTED2: case GETDOTTED3:
-      case GETDOTTED4: case GETDOTTED5: case GETDOTTED6: case GETDOTTED7:
+      vmcase(GETDOTTED0) vmcase(GETDOTTED1) vmcase(GETDOTTED2) vmcase(GETDOTTED3)
+      vmcase(GETDOTTED4) vmcase(GETDOTTED5) vmcase(GETDOTTED6) vmcase(GETDOTTED7)
         aux -= GETDOTTED0;
-      getdotted:
+      getdotted: {
+        TObject *o = S->top-1;
+        TObject *v;
+        if (fieldaccess(o, &consts[aux]) &&
+            (v = luaH_getfield(avalue(o), &consts[aux], fieldslot(tf, aux)))) {
+          *o = *v;
+          vmbreak;
+        }
         *S->top++ = consts[aux];
         luaV_gettable();
-        break;
+        vmbreak;
+      }
 
-      case PUSHSELFW:
+      vmcase(PUSHSELFW)
         aux = next_word(pc); goto pushself;
 
-      case PUSHSELF:
+      vmcase(PUSHSELF)
         aux = *pc++; goto pushself;
 
-      case PUSHSELF0: case PUSHSELF1: case PUSHSELF2: case PUSHSELF3:
-      case PUSHSELF4: case PUSHSELF5: case PUSHSELF6: case PUSHSELF7:
+      vmcase(PUSHSELF0) vmcase(PUSHSELF1) vmcase(PUSHSELF2) vmcase(PUSHSELF3)
+      vmcase(PUSHSELF4) vmcase(PUSHSELF5) vmcase(PUSHSELF6) vmcase(PUSHSELF7)
         aux -= PUSHSELF0;
       pushself: {
         TObject receiver = *(S->top-1);
+        TObject *v;
+        if (fieldaccess(&receiver, &consts[aux]) &&
+            (v = luaH_getfield(avalue(&receiver), &consts[aux],
+                               fieldslot(tf, aux)))) {
+          *(S->top-1) = *v;
+          *S->top++ = receiver;
+          vmbreak;
+        }
         *S->top++ = consts[aux];
         luaV_gettable();
         *S->top++ = receiver;
-        break;
+        vmbreak;
       }
 
-      case PUSHCONSTANTW:
+      vmcase(PUSHCONSTANTW)
         aux = next_word(pc); goto pushconstant;
 
-      case PUSHCONSTANT:
+      vmcase(PUSHCONSTANT)
         aux = *pc++; goto pushconstant;
 
-      case PUSHCONSTANT0: case PUSHCONSTANT1: case PUSHCONSTANT2:
-      case PUSHCONSTANT3: case PUSHCONSTANT4: case PUSHCONSTANT5:
-      case PUSHCONSTANT6: case PUSHCONSTANT7:
+      vmcase(PUSHCONSTANT0) vmcase(PUSHCONSTANT1) vmcase(PUSHCONSTANT2)
+      vmcase(PUSHCONSTANT3) vmcase(PUSHCONSTANT4) vmcase(PUSHCONSTANT5)
+      vmcase(PUSHCONSTANT6) vmcase(PUSHCONSTANT7)
         aux -= PUSHCONSTANT0;
       pushconstant:
         *S->top++ = consts[aux];
-        break;
+        vmbreak;
 
-      case PUSHUPVALUE:
+      vmcase(PUSHUPVALUE)
         aux = *pc++; goto pushupvalue;
 
-      case PUSHUPVALUE0: case PUSHUPVALUE1:
+      vmcase(PUSHUPVALUE0) vmcase(PUSHUPVALUE1)
         aux -= PUSHUPVALUE0;
       pushupvalue:
         *S->top++ = cl->consts[aux+1];
-        break;
+        vmbreak;
 
-      case SETLOCAL:
+      vmcase(SETLOCAL)
         aux = *pc++; goto setlocal;
 
-      case SETLOCAL0: case SETLOCAL1: case SETLOCAL2: case SETLOCAL3:
-      case SETLOCAL4: case SETLOCAL5: case SETLOCAL6: case SETLOCAL7:
+      vmcase(SETLOCAL0) vmcase(SETLOCAL1) vmcase(SETLOCAL2) vmcase(SETLOCAL3)
+      vmcase(SETLOCAL4) vmcase(SETLOCAL5) vmcase(SETLOCAL6) vmcase(SETLOCAL7)
         aux -= SETLOCAL0;
       setlocal:
         *((S->stack+base) + aux) = *(--S->top);
-        break;
+        vmbreak;
 
-      case SETGLOBALW:
+      vmcase(SETGLOBALW)
         aux = next_word(pc); goto setglobal;
 
-      case SETGLOBAL:
+      vmcase(SETGLOBAL)
         aux = *pc++; goto setglobal;
 
-      case SETGLOBAL0: case SETGLOBAL1: case SETGLOBAL2: case SETGLOBAL3:
-      case SETGLOBAL4: case SETGLOBAL5: case SETGLOBAL6: case SETGLOBAL7:
+      vmcase(SETGLOBAL0) vmcase(SETGLOBAL1) vmcase(SETGLOBAL2) vmcase(SETGLOBAL3)
+      vmcase(SETGLOBAL4) vmcase(SETGLOBAL5) vmcase(SETGLOBAL6) vmcase(SETGLOBAL7)
         aux -= SETGLOBAL0;
       setglobal:
         luaV_setglobal(tsvalue(&consts[aux]));
-        break;
+        vmbreak;
 
-      case SETTABLE0:
+      vmcase(SETTABLE0)
        luaV_settable(S->top-3, 1);
-       break;
+       vmbreak;
 
-      case SETTABLE:
+      vmcase(SETTABLE)
         luaV_settable(S->top-3-(*pc++), 2);
-        break;
+        vmbreak;
 
-      case SETLISTW:
+      vmcase(SETLISTW)
         aux = next_word(pc); aux *= LFIELDS_PER_FLUSH; goto setlist;
 
-      case SETLIST:
+      vmcase(SETLIST)
         aux = *(pc++) * LFIELDS_PER_FLUSH; goto setlist;
 
-      case SETLIST0:
+      vmcase(SETLIST0)
         aux = 0;
       setlist: {
         int32 n = *(pc++);
@@ -466,13 +736,13 @@ StkId luaV_execute (struct CallInfo *ci)
           *(luaH_set(avalue(arr), S->top)) = *(S->top-1);
           S->top--;
         }
-        break;
+        vmbreak;
       }
 
-      case SETMAP0:
+      vmcase(SETMAP0)
         aux = 0; goto setmap;
 
-      case SETMAP:
+      vmcase(SETMAP)
         aux = *pc++;
       setmap: {
         TObject *arr = S->top-(2*aux)-3;
@@ -480,59 +750,59 @@ StkId luaV_execute (struct CallInfo *ci)
           *(luaH_set(avalue(arr), S->top-2)) = *(S->top-1);
           S->top-=2;
         } while (aux--);
-        break;
+        vmbreak;
       }
 
-      case POP:
+      vmcase(POP)
         aux = *pc++; goto pop;
 
-      case POP0: case POP1:
+      vmcase(POP0) vmcase(POP1)
         aux -= POP0;
       pop:
         S->top -= (aux+1);
-        break;
+        vmbreak;
 
-      case CREATEARRAYW:
+      vmcase(CREATEARRAYW)
         aux = next_word(pc); goto createarray;
 
-      case CREATEARRAY0: case CREATEARRAY1:
+      vmcase(CREATEARRAY0) vmcase(CREATEARRAY1)
         aux -= CREATEARRAY0; goto createarray;
 
-      case CREATEARRAY:
+      vmcase(CREATEARRAY)
         aux = *pc++;
       createarray:
         luaC_checkGC();
         avalue(S->top) = luaH_new(aux);
         ttype(S->top) = LUA_T_ARRAY;
         S->top++;
-        break;
+        vmbreak;
 
-      case EQOP: case NEQOP: {
+      vmcase(EQOP) vmcase(NEQOP) {
         int32 res = luaO_equalObj(S->top-2, S->top-1);
         S->top--;
         if (aux == NEQOP) res = !res;
         ttype(S->top-1) = res ? LUA_T_NUMBER : LUA_T_NIL;
         nvalue(S->top-1) = 1;
-        break;
+        vmbreak;
       }
 
-       case LTOP:
+       vmcase(LTOP)
          comparison(LUA_T_NUMBER, LUA_T_NIL, LUA_T_NIL, IM_LT);
-         break;
+         vmbreak;
 
-      case LEOP:
+      vmcase(LEOP)
         comparison(LUA_T_NUMBER, LUA_T_NUMBER, LUA_T_NIL, IM_LE);
-        break;
+        vmbreak;
 
-      case GTOP:
+      vmcase(GTOP)
         comparison(LUA_T_NIL, LUA_T_NIL, LUA_T_NUMBER, IM_GT);
-        break;
+        vmbreak;
 
-      case GEOP:
+      vmcase(GEOP)
         comparison(LUA_T_NIL, LUA_T_NUMBER, LUA_T_NUMBER, IM_GE);
-        break;
+        vmbreak;
 
-      case ADDOP: {
+      vmcase(ADDOP) {
         TObject *l = S->top-2;
         TObject *r = S->top-1;
         if (tonumber(r) || tonumber(l))
@@ -541,10 +811,10 @@ StkId luaV_execute (struct CallInfo *ci)
           nvalue(l) += nvalue(r);
           --S->top;
         }
-        break;
+        vmbreak;
       }
 
-      case SUBOP: {
+      vmcase(SUBOP) {
         TObject *l = S->top-2;
         TObject *r = S->top-1;
         if (tonumber(r) || tonumber(l))
@@ -553,10 +823,10 @@ StkId luaV_execute (struct CallInfo *ci)
           nvalue(l) -= nvalue(r);
           --S->top;
         }
-        break;
+        vmbreak;
       }
 
-      case MULTOP: {
+      vmcase(MULTOP) {
         TObject *l = S->top-2;
         TObject *r = S->top-1;
         if (tonumber(r) || tonumber(l))
@@ -565,10 +835,10 @@ StkId luaV_execute (struct CallInfo *ci)
           nvalue(l) *= nvalue(r);
           --S->top;
         }
-        break;
+        vmbreak;
       }
 
-      case DIVOP: {
+      vmcase(DIVOP) {
         TObject *l = S->top-2;
         TObject *r = S->top-1;
         if (tonumber(r) || tonumber(l))
@@ -577,27 +847,40 @@ StkId luaV_execute (struct CallInfo *ci)
           nvalue(l) /= nvalue(r);
           --S->top;
         }
-        break;
+        vmbreak;
       }
 
-      case POWOP:
+      vmcase(POWOP)
         call_binTM(IM_POW, "undefined operation");
-        break;
-
-      case CONCOP: {
-        TObject *l = S->top-2;
-        TObject *r = S->top-1;
-        if (tostring(l) || tostring(r))
-          call_binTM(IM_CONCAT, "unexpected type for concatenation");
+        vmbreak;
+
+      vmcase(CONCOP) {
+        /*
+        ** a..b..c is right associative, so its CONCOPs follow each other
+        ** and each one joins the top two values.  Joining at once the top
+        ** values that need no tag method, and skipping their CONCOPs,
+        ** leaves the stack as running them one by one would.
+        */
+        int32 n = 0;
+        while (n < 2 || (pc[n-2] == CONCOP && n < S->top-(S->stack+base))) {
+          if (!concatable(S->top-1-n))
+            break;
+          n++;
+        }
+        if (n >= 2) {
+          concat(n);
+          pc += n-2;
+        }
         else {
-          tsvalue(l) = strconc(tsvalue(l), tsvalue(r));
-          --S->top;
+          if (n == 0)  /* luaV_tostring converted the left one first */
+            tostring(S->top-2);
+          call_binTM(IM_CONCAT, "unexpected type for concatenation");
         }
         luaC_checkGC();
-        break;
+        vmbreak;
       }
 
-      case MINUSOP:
+      vmcase(MINUSOP)
         if (tonumber(S->top-1)) {
           ttype(S->top) = LUA_T_NIL;
           S->top++;
@@ -605,92 +888,96 @@ StkId luaV_execute (struct CallInfo *ci)
         }
         else
           nvalue(S->top-1) = - nvalue(S->top-1);
-        break;
+        vmbreak;
 
-      case NOTOP:
+      vmcase(NOTOP)
         ttype(S->top-1) =
            (ttype(S->top-1) == LUA_T_NIL) ? LUA_T_NUMBER : LUA_T_NIL;
         nvalue(S->top-1) = 1;
-        break;
+        vmbreak;
 
-      case ONTJMPW:
+      vmcase(ONTJMPW)
         aux = next_word(pc); goto ontjmp;
 
-      case ONTJMP:
+      vmcase(ONTJMP)
         aux = *pc++;
       ontjmp:
         if (ttype(S->top-1) != LUA_T_NIL) pc += aux;
         else S->top--;
-        break;
+        vmbreak;
 
-      case ONFJMPW:
+      vmcase(ONFJMPW)
         aux = next_word(pc); goto onfjmp;
 
-      case ONFJMP:
+      vmcase(ONFJMP)
         aux = *pc++;
       onfjmp:
         if (ttype(S->top-1) == LUA_T_NIL) pc += aux;
         else S->top--;
-        break;
+        vmbreak;
 
-      case JMPW:
+      vmcase(JMPW)
         aux = next_word(pc); goto jmp;
 
-      case JMP:
+      vmcase(JMP)
         aux = *pc++;
       jmp:
         pc += aux;
-        break;
+        vmbreak;
 
-      case IFFJMPW:
+      vmcase(IFFJMPW)
         aux = next_word(pc); goto iffjmp;
 
-      case IFFJMP:
+      vmcase(IFFJMP)
         aux = *pc++;
       iffjmp:
         if (ttype(--S->top) == LUA_T_NIL) pc += aux;
-        break;
+        vmbreak;
 
-      case IFTUPJMPW:
+      vmcase(IFTUPJMPW)
         aux = next_word(pc); goto iftupjmp;
 
-      case IFTUPJMP:
+      vmcase(IFTUPJMP)
         aux = *pc++;
       iftupjmp:
         if (ttype(--S->top) != LUA_T_NIL) pc -= aux;
-        break;
+        luaP_checksample();
+        vmbreak;
 
-      case IFFUPJMPW:
+      vmcase(IFFUPJMPW)
         aux = next_word(pc); goto iffupjmp;
 
-      case IFFUPJMP:
+      vmcase(IFFUPJMP)
         aux = *pc++;
       iffupjmp:
         if (ttype(--S->top) == LUA_T_NIL) pc -= aux;
-        break;
+        luaP_checksample();
+        vmbreak;
 
-    case CLOSURE:
+    vmcase(CLOSURE)
       aux = *pc++;
       goto closure;
 
-    case CLOSURE0:
+    vmcase(CLOSURE0)
       aux = 0;
       goto closure;
 
-    case CLOSURE1:
+    vmcase(CLOSURE1)
       aux = 1;
       closure:
         luaV_closure(aux);
         luaC_checkGC();
-        break;
+        vmbreak;
 
-      case CALLFUNC:
+      vmcase(CALLFUNC)
         aux = *pc++; goto callfunc;
 
-      case CALLFUNC0: case CALLFUNC1:
+      vmcase(CALLFUNC0) vmcase(CALLFUNC1)
         aux -= CALLFUNC0;
-      callfunc: {
-        StkId newBase = (S->top-S->stack)-(*pc++);
+      callfunc:
+        nargs = *pc++;
+      docall: {
+        StkId newBase = (S->top-S->stack)-nargs;
 	TObject *func = S->stack+newBase-1;
 	L->ci->pc = pc;
 	if (ttype(func) == LUA_T_PROTO ||
@@ -708,29 +995,34 @@ StkId luaV_execute (struct CallInfo *ci)
 	if (L->Tstate != RUN) {
 	  if (ci_index > 1)	/* C functions detected by break_here */
 	    lua_error("Cannot yield through method call");
+	  luaV_opcount += ops;
 	  return -1;
 	}
-        break;
+        vmbreak;
       }
 
-      case ENDCODE:
+      vmcase(ENDCODE)
         S->top = S->stack + base;
         /* goes through */
-      case RETCODE: {
+      vmcase(RETCODE) {
 	StkId firstResult = (base + ((aux==RETCODE) ? *pc : 0));
+        luaP_return(L->ci);
+        luaP_checksample();
         if (lua_callhook)
           luaD_callHook(base, NULL, 1);
 	/* If returning from the original stack frame, terminate */
-	if (L->ci == L->base_ci + ci_index)
+	if (L->ci == L->base_ci + ci_index) {
+	  luaV_opcount += ops;
 	  return firstResult;
+	}
 	luaD_postret(firstResult);
 	goto newfunc;
       }
 
-      case SETLINEW:
+      vmcase(SETLINEW)
         aux = next_word(pc); goto setline;
 
-      case SETLINE:
+      vmcase(SETLINE)
         aux = *pc++;
       setline:
         if ((S->stack+base-1)->ttype != LUA_T_LINE) {
@@ -742,9 +1034,39 @@ StkId luaV_execute (struct CallInfo *ci)
         (S->stack+base-1)->value.i = aux;
         if (lua_linehook)
           luaD_lineHook(aux);
-        break;
+        vmbreak;
+
+      vmcase(LOCALDOTTED)
+        *S->top++ = *((S->stack+base) + *pc++);
+        aux = *pc++; goto getdotted;
+
+      vmcase(LOCALDOTTEDN)
+        aux = *pc++;
+        *S->top++ = *((S->stack+base) + (aux & 15));
+        aux >>= 4; goto getdotted;
+
+      vmcase(CALLGLOBAL)
+        luaV_getglobal(tsvalue(&consts[*pc++]));
+        aux = *pc++;
+        nargs = 0;
+        goto docall;
+
+      vmcase(IFFCMPJMP) {
+        int32 res = testcomparison(*pc++);
+        aux = *pc++;
+        if (!res) pc += aux;
+        vmbreak;
+      }
+
+      vmcase(IFTCMPUPJMP) {
+        int32 res = testcomparison(*pc++);
+        aux = *pc++;
+        if (res) pc -= aux;
+        luaP_checksample();
+        vmbreak;
+      }
 
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(USE_COMPUTED_GOTO)
       default:
         LUA_INTERNALERROR("opcode doesn't match");
 #endif
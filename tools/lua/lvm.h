@@ -26,4 +26,7 @@ void luaV_setglobal (TaggedString *ts);
 StkId luaV_execute (struct CallInfo *ci);
 void luaV_closure (int32 nelems);
 
+/* Opcodes executed so far, for benchmarks; wraps around */
+extern LUA_THREAD uint32 luaV_opcount;
+
 #endif
@@ -14,6 +14,8 @@ MODULE_OBJS := \
 	lmem.o \
 	lobject.o \
 	lparser.o \
+	lprofile.o \
+	lsample.o \
 	lstate.o \
 	lstring.o \
 	lstrlib.o \
@@ -0,0 +1,357 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+// Times the Lua VM on code shaped like the Grim Fandango scripts: method
+// calls on actor tables, global and dotted lookups, and calls of small
+// helpers, and reports the opcodes executed per second. Build with
+// ./configure --disable-computed-goto to compare against the plain switch.
+// With -s it instead times luaS_newlstr on names and dialogue lines, half
+// already interned and half new, with collections leaving EMPTY slots.
+// A build with ./configure --enable-lua-profiler can also write the VM's
+// profile of the workloads with -p (JSON) or -f (folded stacks). Any
+// build can sample the workloads' Lua stacks with -S into folded stacks.
+
+#include <tools/lua/lua.h>
+#include <tools/lua/lualib.h>
+#include <tools/lua/lvm.h>
+#include <tools/lua/lstring.h>
+#include <tools/lua/luadebug.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef POSIX
+#include <sys/time.h>
+#endif
+#include "common/getopt.h"
+
+static const char *script =
+	"Actor = { }\n"
+	"function Actor:walk(dx, dy, dz)\n"
+	"  local pos = self.pos\n"
+	"  pos.x = pos.x + dx\n"
+	"  pos.y = pos.y + dy\n"
+	"  pos.z = pos.z + dz\n"
+	"  if pos.x > 10 then pos.x = 0 end\n"
+	"  self.steps = self.steps + 1\n"
+	"end\n"
+	"function Actor:is_visible()\n"
+	"  return self.visible\n"
+	"end\n"
+	"function Actor:create(name)\n"
+	"  local a = { name = name, pos = { x = 0, y = 0, z = 0 }, steps = 0, visible = 1 }\n"
+	"  a.walk = Actor.walk\n"
+	"  a.is_visible = Actor.is_visible\n"
+	"  return a\n"
+	"end\n"
+	"actors = { n = 0 }\n"
+	"actors.n = 8\n"
+	"actors[1] = Actor:create(\"manny\")\n"
+	"actors[2] = Actor:create(\"glottis\")\n"
+	"actors[3] = Actor:create(\"meche\")\n"
+	"actors[4] = Actor:create(\"domino\")\n"
+	"actors[5] = Actor:create(\"eva\")\n"
+	"actors[6] = Actor:create(\"salvador\")\n"
+	"actors[7] = Actor:create(\"olivia\")\n"
+	"actors[8] = Actor:create(\"velasco\")\n"
+	"\n"
+	"function bench_actors(n)\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    local j = 1\n"
+	"    while j <= actors.n do\n"
+	"      local a = actors[j]\n"
+	"      if a:is_visible() then a:walk(0.1, 0, 0.05) end\n"
+	"      j = j + 1\n"
+	"    end\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n"
+	"\n"
+	"system = { currentSet = { name = \"mo.set\", setups = { mo_ddtws = 0, mo_winws = 1, mo_comin = 2 } } }\n"
+	"mo = { name = \"mo.set\", door_open = nil, visits = 0 }\n"
+	"function bench_sets(n)\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    if system.currentSet.name == mo.name then\n"
+	"      mo.visits = mo.visits + 1\n"
+	"      if system.currentSet.setups.mo_winws == 1 and not mo.door_open then\n"
+	"        mo.door_open = nil\n"
+	"      end\n"
+	"    end\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n"
+	"\n"
+	"function next_state(state, line)\n"
+	"  if state < 10 then return state + 1 end\n"
+	"  if line == \"wait\" then return state + 2 end\n"
+	"  return state + 3\n"
+	"end\n"
+	"function bench_cutscene(n)\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    local state = 0\n"
+	"    while state < 60 do\n"
+	"      state = next_state(state, \"talk\")\n"
+	"    end\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n"
+	"\n"
+	"dialog_flags = { }\n"
+	"topics = { \"sprouts\", \"coffee\", \"lamancha\", \"bonewagon\", \"scythe\" }\n"
+	"function bench_dialog(n)\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    local t = topics[mod(i, 5) + 1]\n"
+	"    dialog_flags[t] = (dialog_flags[t] or 0) + 1\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n"
+	"\n"
+	"lines = { \"Hey, that's not a costume.\",\n"
+	"  \"I'm Manny Calavera, travel agent at the Department of Death, and you look like you could use a vacation.\",\n"
+	"  \"Glottis, where did you put the bone wagon?\",\n"
+	"  \"Nobody ever takes the number nine train anymore, not since the union shut the line down last year.\" }\n"
+	"function bench_strings(n)\n"
+	"  local i = 0\n"
+	"  while i < n do\n"
+	"    local s = \"line \" .. i .. \": \" .. lines[mod(i, 4) + 1]\n"
+	"    if strlen(s) > 200 then s = \"\" end\n"
+	"    i = i + 1\n"
+	"  end\n"
+	"end\n";
+
+struct Workload {
+	const char *name;
+	const char *function;
+	int iterations;
+};
+
+static const Workload workloads[] = {
+	{ "actors", "bench_actors", 200 },
+	{ "sets", "bench_sets", 2000 },
+	{ "cutscene", "bench_cutscene", 100 },
+	{ "dialog", "bench_dialog", 2000 },
+	{ "strings", "bench_strings", 500 }
+};
+static const int numWorkloads = sizeof(workloads) / sizeof(workloads[0]);
+
+static double now() {
+#ifdef POSIX
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static bool callWorkload(const Workload &w) {
+	lua_beginblock();
+	lua_pushnumber(w.iterations);
+	bool ok = lua_callfunction(lua_getglobal(w.function)) == 0;
+	lua_endblock();
+	return ok;
+}
+
+// Interns a fixed set of strings (hits) and as many fresh ones (misses)
+// per round, collecting every few rounds so the tables gain EMPTYs.
+static void benchInterning(double duration) {
+	const int numStrings = 2048;
+	static char fixed[numStrings][160];
+	static char fresh[192];
+	for (int i = 0; i < numStrings; i++) {
+		if (i & 1)
+			sprintf(fixed[i], "Line %d: I'm Manny Calavera, travel agent at the Department of Death, and you look like you could use a vacation.", i);
+		else
+			sprintf(fixed[i], "actor_%d", i);
+		luaS_newfixedstring(fixed[i]);
+	}
+
+	double calls = 0, start = now(), elapsed = 0;
+	int round = 0;
+	while (elapsed < duration) {
+		for (int i = 0; i < numStrings; i++) {
+			luaS_newlstr(fixed[i], strlen(fixed[i]));
+			int l = sprintf(fresh, "%s#%d", fixed[i], round);
+			luaS_newlstr(fresh, l);
+		}
+		calls += 2 * numStrings;
+		if (++round % 4 == 0)
+			lua_collectgarbage(0);
+		elapsed = now() - start;
+	}
+	printf("%-10s %12s %8s %10s\n", "test", "strings", "seconds", "M/s");
+	printf("%-10s %12.0f %8.3f %10.2f\n", "newlstr", calls, elapsed, calls / elapsed / 1e6);
+}
+
+static const int sampleRate = 2000;
+
+static void usage() {
+	printf("Usage: luabench [-t seconds] [-s] [-S file] [workload...]\n");
+	printf("Runs each workload for the given time (default 1 second) and prints\n");
+	printf("the Lua opcodes executed per second. The workloads are:\n");
+	for (int i = 0; i < numWorkloads; i++)
+		printf("\t%s\n", workloads[i].name);
+	printf("With -s, times string interning (luaS_newlstr) instead.\n");
+	printf("-S FILE samples the Lua stack %d times a second and writes the\n", sampleRate);
+	printf("samples to FILE as folded stacks.\n");
+#ifdef LUA_PROFILER
+	printf("-p FILE writes the profile of the workloads as JSON to FILE,\n");
+	printf("-f FILE as folded stacks for flamegraph.pl.\n");
+#endif
+}
+
+static bool writeSamples(const char *filename) {
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		perror(filename);
+		return false;
+	}
+	bool ok = lua_dumpsamples(f) == 0;
+	return fclose(f) == 0 && ok;
+}
+
+#ifdef LUA_PROFILER
+static bool writeProfile(const char *filename, int format) {
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		perror(filename);
+		return false;
+	}
+	bool ok = lua_dumpprofile(f, format) == 0;
+	return fclose(f) == 0 && ok;
+}
+#endif
+
+int main(int argc, char **argv) {
+	double duration = 1.0;
+	bool interning = false;
+	const char *jsonFile = NULL, *stacksFile = NULL, *samplesFile = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "t:sS:p:f:h")) != -1) {
+		switch (c) {
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 's':
+			interning = true;
+			break;
+		case 'S':
+			samplesFile = optarg;
+			break;
+#ifdef LUA_PROFILER
+		case 'p':
+			jsonFile = optarg;
+			break;
+		case 'f':
+			stacksFile = optarg;
+			break;
+#endif
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (duration <= 0) {
+		usage();
+		return 1;
+	}
+
+	lua_open();
+	lua_strlibopen();
+	lua_mathlibopen();
+	if (interning) {
+		benchInterning(duration);
+		lua_close();
+		return 0;
+	}
+	if (lua_dostring(script) != 0) {
+		fprintf(stderr, "The benchmark script failed to load\n");
+		return 1;
+	}
+
+#ifdef USE_COMPUTED_GOTO
+	printf("dispatch: computed goto\n");
+#else
+	printf("dispatch: switch\n");
+#endif
+#ifdef LUA_PROFILER
+	lua_resetprofile();	// leave loading the script out
+#endif
+	if (samplesFile && lua_startsampling(sampleRate) != 0) {
+		fprintf(stderr, "Sampling is not supported on this system\n");
+		return 1;
+	}
+	printf("%-10s %12s %8s %10s\n", "workload", "opcodes", "seconds", "Mops/s");
+	double totalOps = 0, totalTime = 0;
+	for (int i = 0; i < numWorkloads; i++) {
+		const Workload &w = workloads[i];
+		bool selected = argc < 2;
+		for (int a = 1; a < argc; a++)
+			selected |= strcmp(argv[a], w.name) == 0;
+		if (!selected)
+			continue;
+
+		// Warm up the tables and the collector before timing
+		if (!callWorkload(w)) {
+			fprintf(stderr, "%s failed\n", w.name);
+			return 1;
+		}
+		double ops = 0, start = now(), elapsed = 0;
+		while (elapsed < duration) {
+			uint32 before = luaV_opcount;
+			callWorkload(w);
+			ops += (uint32)(luaV_opcount - before);
+			elapsed = now() - start;
+		}
+		printf("%-10s %12.0f %8.3f %10.2f\n", w.name, ops, elapsed, ops / elapsed / 1e6);
+		totalOps += ops;
+		totalTime += elapsed;
+	}
+	if (totalTime > 0)
+		printf("%-10s %12.0f %8.3f %10.2f\n", "total", totalOps, totalTime, totalOps / totalTime / 1e6);
+
+	if (samplesFile) {
+		lua_stopsampling();
+		if (!writeSamples(samplesFile)) {
+			lua_close();
+			return 1;
+		}
+	}
+#ifdef LUA_PROFILER
+	if ((jsonFile && !writeProfile(jsonFile, LUA_PROFILE_JSON)) ||
+	    (stacksFile && !writeProfile(stacksFile, LUA_PROFILE_STACKS))) {
+		lua_close();
+		return 1;
+	}
+#else
+	(void)jsonFile;
+	(void)stacksFile;
+#endif
+	lua_close();
+	return 0;
+}
@@ -6,33 +6,60 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "luac.h"
+#include "common/stats.h"
 
 #define NotWord(x)		((unsigned short)x!=x)
-#define DumpBlock(b,size,D)	fwrite(b,size,1,D)
+#define DumpBlock(b,size,D)	memcpy(DumpSpace(D,size),b,size)
 #define	DumpNative(t,D)		DumpBlock(&t,sizeof(t),D)
 
-static void DumpWord(int i, FILE* D) {
- byte out[2];
- WRITE_BE_UINT16(out, i);
- DumpBlock(out,2,D);
+/*
+** Chunks are built in memory and written with a single fwrite.  A buffer
+** can be reused after DumpFlush, so it only grows to the largest chunk.
+*/
+byte* DumpSpace(DumpBuffer* D, size_t n) {
+ byte* p;
+ if (D->n+n > D->size) {
+  size_t size = D->size ? D->size : 4096;
+  while (size < D->n+n) size *= 2;
+  D->b = (byte*)realloc(D->b,size);
+  if (D->b == NULL)
+   luaL_verror("not enough memory to dump chunk (%lu bytes)",(unsigned long)size);
+  D->size = size;
+ }
+ p = D->b+D->n;
+ D->n += n;
+ return p;
+}
+
+void DumpFlush(DumpBuffer* D, FILE* f) {
+ Common::StatsPhase phase(Common::kStatsWrite);
+ if (D->n > 0 && fwrite(D->b,D->n,1,f) != 1)
+  luaL_verror("cannot write output file");
+ Common::addStatsWritten(D->n);
+ D->n = 0;
 }
 
-static void DumpLong(long i, FILE* D) {
- byte out[4];
- WRITE_BE_UINT32(out, i);
- DumpBlock(out,4,D);
+void DumpByte(int c, DumpBuffer* D) {
+ *DumpSpace(D,1) = (byte)c;
+}
+
+void DumpWord(int i, DumpBuffer* D) {
+ WRITE_BE_UINT16(DumpSpace(D,2), i);
+}
+
+void DumpLong(long i, DumpBuffer* D) {
+ WRITE_BE_UINT32(DumpSpace(D,4), i);
 }
 
 /* LUA_NUMBER */
 /* assumes sizeof(long)==4 and sizeof(float)==4 (IEEE) */
-static void DumpFloat(float f, FILE* D) {
-	byte out[4];
-	WRITE_LE_UINT32(out, *(uint32*)(&f));
-	DumpBlock(out, 4, D);
+void DumpFloat(float f, DumpBuffer* D) {
+	WRITE_LE_UINT32(DumpSpace(D,4), *(uint32*)(&f));
 }
 
-static void DumpCode(TProtoFunc* tf, FILE* D) {
+void DumpCode(TProtoFunc* tf, DumpBuffer* D) {
  int size=CodeSize(tf);
  if (NotWord(size))
   fprintf(stderr,"luac: warning: "
@@ -42,23 +69,32 @@ static void DumpCode(TProtoFunc* tf, FILE* D) {
  DumpBlock(tf->code,size,D);
 }
 
-static void DumpString(char* s, int size, FILE* D) {
+static void DumpString(char* s, int size, DumpBuffer* D) {
  if (s == NULL)
   DumpWord(0,D);
  else {
   if (NotWord(size))
    luaL_verror("string too long (%d bytes): \"%.32s...\"",size,s);
+  byte* d;
+  int i;
   DumpWord(size,D);
-  for(int i = 0; i < size; ++i)
-	  fputc(s[i] ^ 0xFF, D);
+  d = DumpSpace(D,size);
+  for (i = 0; i+4 <= size; i += 4) {	/* invert a word at a time */
+   uint32 w;
+   memcpy(&w,s+i,4);
+   w = ~w;
+   memcpy(d+i,&w,4);
+  }
+  for (; i < size; ++i)
+   d[i] = (byte)~s[i];
  }
 }
 
-static void DumpTString(TaggedString* s, FILE* D) {
+void DumpTString(TaggedString* s, DumpBuffer* D) {
  if (s == NULL) DumpString(NULL,0,D); else DumpString(s->str,s->u.s.len+1,D);
 }
 
-static void DumpLocals(TProtoFunc* tf, FILE* D) {
+static void DumpLocals(TProtoFunc* tf, DumpBuffer* D) {
  int n;
  LocVar* lv;
  for (n=0,lv=tf->locvars; lv && lv->line>=0; lv++) ++n;
@@ -69,23 +105,23 @@ static void DumpLocals(TProtoFunc* tf, FILE* D) {
  }
 }
 
-static void DumpFunction(TProtoFunc* tf, FILE* D);
+static void DumpFunction(TProtoFunc* tf, DumpBuffer* D);
 
-static void DumpSubFunctions(TProtoFunc* tf, FILE* D) {
+static void DumpSubFunctions(TProtoFunc* tf, DumpBuffer* D) {
 	int i,n;
 	n = tf->nconsts;
 	for (i=0; i<n; i++) {
 		TObject* o=tf->consts+i;
 		if (ttype(o) == LUA_T_PROTO) {
-			fputc('#',D);
+			DumpByte('#',D);
 			DumpWord(i,D);
 			DumpFunction(tfvalue(o),D);
 		}
 	}
-	fputc('$',D);
+	DumpByte('$',D);
 }
 
-static void DumpConstants(TProtoFunc* tf, FILE* D) {
+static void DumpConstants(TProtoFunc* tf, DumpBuffer* D) {
  int i,n;
  n = tf->nconsts;
  DumpWord(n,D);
@@ -93,18 +129,18 @@ static void DumpConstants(TProtoFunc* tf, FILE* D) {
   TObject* o=tf->consts+i;
   switch (ttype(o)) {
    case LUA_T_NUMBER:
-	fputc('N',D);
+	DumpByte('N',D);
 	DumpNumber(nvalue(o),D);
 	break;
    case LUA_T_STRING:
-	fputc('S',D);
+	DumpByte('S',D);
 	DumpTString(tsvalue(o),D);
 	break;
    case LUA_T_PROTO:
-	fputc('F',D);
+	DumpByte('F',D);
 	break;
    case LUA_T_NIL:
-	fputc(-ttype(o),D);
+	DumpByte(-ttype(o),D);
 	break;
    default:				/* cannot happen */
 	luaL_verror("cannot dump constant #%d: type=%d [%s]",
@@ -114,7 +150,7 @@ static void DumpConstants(TProtoFunc* tf, FILE* D) {
  }
 }
 
-static void DumpFunction(TProtoFunc* tf, FILE* D) {
+static void DumpFunction(TProtoFunc* tf, DumpBuffer* D) {
  DumpWord(tf->lineDefined,D);
  DumpTString(tf->fileName,D);
  DumpCode(tf,D);
@@ -123,17 +159,17 @@ static void DumpFunction(TProtoFunc* tf, FILE* D) {
  DumpSubFunctions(tf,D);
 }
 
-static void DumpHeader(TProtoFunc* Main, FILE* D) {
+void DumpHeader(int version, DumpBuffer* D) {
  real t=TEST_NUMBER;
- fputc(ID_CHUNK,D);
- fputs(SIGNATURE,D);
- fputc(VERSION,D);
- fputc(sizeof(t),D);
- fputc(ID_NUMBER,D);
+ DumpByte(ID_CHUNK,D);
+ DumpBlock(SIGNATURE,strlen(SIGNATURE),D);
+ DumpByte(version,D);
+ DumpByte(sizeof(t),D);
+ DumpByte(ID_NUMBER,D);
  DumpBlock("\x0A\xBF\x17",3,D);		//Instead TEST_NUMBER, it dumps the same sequence found in GF scripts
 }
 
-void DumpChunk(TProtoFunc* Main, FILE* D) {
- DumpHeader(Main,D);
+void DumpChunk(TProtoFunc* Main, DumpBuffer* D, int fused) {
+ DumpHeader(fused ? VERSION_FUSED : VERSION,D);
  DumpFunction(Main,D);
 }
@@ -11,57 +11,179 @@
 #include "tools/lua/lparser.h"
 #include "tools/lua/lzio.h"
 #include "tools/lua/luadebug.h"
+#include "tools/lab.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
 #define	OUTPUT	"luac.out"		/* default output file */
 
-extern void DumpChunk(TProtoFunc* Main, FILE* D);
+extern void DumpChunk(TProtoFunc* Main, DumpBuffer* D, int fused);
 extern void PrintChunk(TProtoFunc* Main);
-extern void OptChunk(TProtoFunc* Main);
+extern void OptChunk(TProtoFunc* Main, int fuse);
 extern void rebase(TProtoFunc* Main, TProtoFunc* base);
+extern void BeginSnapshot(void);
+extern void DumpSnapshot(FILE* D);
 
 static void load_base_script(const char* fname);
 static FILE* efopen(const char* name, const char* mode);
-static void doit(int undump, const char* filename);
+static void doit(int undump, const char* filename, DumpBuffer* out);
 
 static int listing=0;			/* list bytecodes? */
 static int debugging=0;			/* debug? */
 static int dumping=1;			/* dump bytecodes? */
 static int undumping=0;			/* undump bytecodes? */
 static int optimizing=0;		/* optimize? */
+static int fusing=0;			/* fuse opcodes into superinstructions? */
 static int parsing=0;			/* parse only? */
+static int snapshotting=0;		/* run files and save the heap? */
 static int verbose=0;			/* tell user what is done */
+static int jobs=1;			/* files compiled at once */
 static FILE* D;				/* output file */
-static TProtoFunc *bs = NULL;
+static const char* base_s = NULL;	/* base script file name */
+static const char* lab_s = NULL;	/* archive -S runs files from */
+static Lab* lab = NULL;
+static const char** defines;		/* names given with -D */
+static int ndefines=0;
+static LUA_THREAD TProtoFunc *bs = NULL;	/* base script, loaded by each state */
 
 static void usage(void)
 {
  fprintf(stderr,"usage: "
- "luac [-c | -u] [-D name] [-d] [-l] [-o output] [-O] [-p] [-q] [-v] [-V] [-b base] [files]\n"
+ "luac [-c | -u | -S] [-D name] [-d] [-l] [-o output] [-O] [-F] [-p] [-q] [-v] [-V] [-b base] [-j jobs] [-L lab] [files]\n"
  " -c\tcompile (default)\n"
  " -u\tundump\n"
+ " -S\trun files and save the globals they leave as a snapshot\n"
  " -d\tgenerate debugging information\n"
  " -D\tpredefine symbol for conditional compilation\n"
  " -l\tlist (default for -u)\n"
- " -o\toutput file for -c (default is \"" OUTPUT "\")\n"
+ " -o\toutput file for -c and -S (default is \"" OUTPUT "\")\n"
  " -O\toptimize\n"
+ " -F\toptimize and fuse opcode pairs (needs an engine that loads version 0x32)\n"
  " -p\tparse only\n"
  " -q\tquiet (default for -c)\n"
  " -v\tshow version information\n"
  " -V\tverbose\n"
  " -b\tused the specified script as base for compiling (useful for patch, see diffr manual)\n"
+ " -j\tcompile this many files at once, each in its own Lua state (not with -l)\n"
+ " -L\twith -S, run the files and those they dofile from this lab where it has them\n"
  " -\tcompile \"stdin\"\n"
  );
  exit(1);
 }
 
+/* $define name for conditional compilation in the current state */
+static void predefine(const char* name)
+{
+ TaggedString* s=luaS_new(name);
+ s->u.s.globalval.ttype=LUA_T_NUMBER;
+ s->u.s.globalval.value.n=1;
+}
+
+/*
+** lua_dofile reads the entries of the -L lab in place from its mapping, so
+** running a game's scripts needs no copy of them on disk.  Without mmap the
+** lab hands out one buffer it reuses, so each entry gets its own copy.
+*/
+static const char* labreader(const char* filename, int32* size)
+{
+ uint32 n;
+ const char* data=lab->getData(filename,n);
+ if (data!=NULL && !lab->isMapped())
+ {
+  char* copy=(char*)malloc(n>0 ? n : 1);	/* kept until exit */
+  memcpy(copy,data,n);
+  data=copy;
+ }
+ *size=(int32)n;
+ return data;
+}
+
 #define	IS(s)	(strcmp(argv[i],s)==0)
 
+#ifdef POSIX
+/*
+** Files are handed out to the workers through next.  Each worker compiles
+** in a Lua state of its own and every file into its own buffer, which are
+** written out in the order the files were given once all are done.
+*/
+typedef struct
+{
+ int argc;
+ char** argv;
+ int next;
+ DumpBuffer* out;
+ pthread_mutex_t lock;
+} CompileJob;
+
+static void* compile_worker(void* arg)
+{
+ CompileJob* job=(CompileJob*)arg;
+ int i;
+ lua_open();
+ for (i=0; i<ndefines; i++)
+  predefine(defines[i]);
+ if (dumping && base_s != NULL)
+  load_base_script(base_s);
+ for (;;)
+ {
+  char** argv=job->argv;
+  pthread_mutex_lock(&job->lock);
+  i=job->next++;
+  pthread_mutex_unlock(&job->lock);
+  if (i>=job->argc)
+   break;
+  doit(0, IS("-")? NULL : argv[i], job->out+i);
+ }
+ lua_close();
+ return NULL;
+}
+
+static void compile_parallel(int argc, char* argv[])
+{
+ CompileJob job;
+ pthread_t* threads;
+ int i,started=0;
+ job.argc=argc;
+ job.argv=argv;
+ job.next=1;
+ job.out=(DumpBuffer*)calloc(argc,sizeof(DumpBuffer));
+ pthread_mutex_init(&job.lock,NULL);
+ if (jobs>argc-1)
+  jobs=argc-1;
+ threads=(pthread_t*)malloc(jobs*sizeof(pthread_t));
+ for (i=0; i<jobs; i++)
+  if (pthread_create(&threads[started],NULL,compile_worker,&job)==0)
+   ++started;
+ if (started==0)				/* do the work on this thread */
+ {
+  lua_State* main=lua_setstate(NULL);
+  compile_worker(&job);
+  lua_setstate(main);
+ }
+ for (i=0; i<started; i++)
+  pthread_join(threads[i],NULL);
+ for (i=1; i<argc; i++)
+ {
+  if (dumping)
+   DumpFlush(job.out+i,D);
+  free(job.out[i].b);
+ }
+ free(threads);
+ free(job.out);
+ pthread_mutex_destroy(&job.lock);
+}
+#endif
+
 int main(int argc, char* argv[])
 {
  const char* d = OUTPUT;			/* output file name */
- const char* base_s = NULL;			/* base script file name */
  int i;
+ Common::initStats("luac",argc,argv);
  lua_open();
+ defines = (const char**)malloc(argc*sizeof(const char*));
  for (i=1; i<argc; i++)
  {
   if (argv[i][0]!='-')			/* end of options */
@@ -75,9 +197,8 @@ int main(int argc, char* argv[])
   }
   else if (IS("-D"))			/* $define */
   {
-   TaggedString* s=luaS_new(argv[++i]);
-   s->u.s.globalval.ttype=LUA_T_NUMBER;
-   s->u.s.globalval.value.n=1;
+   defines[ndefines]=argv[++i];
+   predefine(defines[ndefines++]);
   }
   else if (IS("-d"))			/* debug */
    debugging=1;
@@ -85,10 +206,19 @@ int main(int argc, char* argv[])
    listing=1;
   else if (IS("-b"))			/* base script */
    base_s=argv[++i];
+  else if (IS("-j"))			/* parallel jobs */
+  {
+   jobs=atoi(argv[++i]);
+   if (jobs<1) usage();
+  }
+  else if (IS("-L"))			/* lab to run files from */
+   lab_s=argv[++i];
   else if (IS("-o"))			/* output file */
    d=argv[++i];
   else if (IS("-O"))			/* optimize */
    optimizing=1; 
+  else if (IS("-F"))			/* fuse superinstructions */
+   optimizing=fusing=1;
   else if (IS("-p"))			/* parse only */
   {
    dumping=0;
@@ -96,6 +226,12 @@ int main(int argc, char* argv[])
   }
   else if (IS("-q"))			/* quiet */
    listing=0;
+  else if (IS("-S"))			/* snapshot */
+  {
+   dumping=0;
+   undumping=0;
+   snapshotting=1;
+  }
   else if (IS("-u"))			/* undump */
   {
    dumping=0;
@@ -124,21 +260,58 @@ int main(int argc, char* argv[])
 			D = efopen(d,"wb");			/* must open in binary mode */
 		}
 
-		if (dumping && base_s != NULL)
-			load_base_script(base_s);
-
-		for (i = 1; i < argc; i++)
-			doit(0, IS("-")? NULL : argv[i]);
+#ifdef POSIX
+		if (jobs > 1 && !listing && argc > 2)
+			compile_parallel(argc, argv);
+		else
+#endif
+		{
+			DumpBuffer out={NULL,0,0};
+			if (dumping && base_s != NULL)
+				load_base_script(base_s);
+			for (i = 1; i < argc; i++) {
+				doit(0, IS("-")? NULL : argv[i], &out);
+				if (dumping)
+					DumpFlush(&out, D);
+			}
+			free(out.b);
+		}
 		if (dumping)
 			fclose(D);
 	}
 
+	if (snapshotting) {
+		if (argc < 2)
+			usage();
+		for (i = 1; i < argc; i++)
+			if (IS(d))
+				luaL_verror("will not overwrite input file \"%s\"",d);
+		if (lab_s != NULL) {
+			lab = new Lab(lab_s, true, true);
+			lua_setfilereader(labreader);
+		}
+		BeginSnapshot();
+		for (i = 1; i < argc; i++) {
+			const char* fn = IS("-") ? NULL : argv[i];
+			if (verbose)
+				fprintf(stderr,"%s\n",fn ? fn : "(stdin)");
+			if (lua_dofile(fn) != 0) {
+				fprintf(stderr,"luac: cannot run %s\n",fn ? fn : "(stdin)");
+				exit(1);
+			}
+		}
+		D = efopen(d,"wb");
+		DumpSnapshot(D);
+		fclose(D);
+		delete lab;
+	}
+
 	if (undumping) {
 		if (argc < 2)
-			doit(1, OUTPUT);
+			doit(1, OUTPUT, NULL);
 		else
 		for (i = 1; i < argc; i++)
-			doit(1,IS("-")? NULL : argv[i]);
+			doit(1,IS("-")? NULL : argv[i], NULL);
 	}
 	return 0;
 }
@@ -152,16 +325,16 @@ static void load_base_script(const char* fname) {
 	fclose(f);
 }
 
-static void do_compile(ZIO* z)
+static void do_compile(ZIO* z, DumpBuffer* out)
 {
  TProtoFunc* Main;
  if (optimizing) lua_debug=0;		/* set debugging before parsing */
  if (debugging)  lua_debug=1;
  Main=luaY_parser(z);
  if (bs) rebase(Main, bs);
- if (optimizing) OptChunk(Main);
+ if (optimizing) OptChunk(Main,fusing);
  if (listing) PrintChunk(Main);
- if (dumping) DumpChunk(Main,D);
+ if (dumping) DumpChunk(Main,out,fusing);
 }
 
 static void do_undump(ZIO* z)
@@ -170,12 +343,12 @@ static void do_undump(ZIO* z)
  {
   TProtoFunc* Main=luaU_undump1(z);
   if (Main==NULL) break;
-  if (optimizing) OptChunk(Main);
+  if (optimizing) OptChunk(Main,fusing);
   if (listing) PrintChunk(Main);
  }
 }
 
-static void doit(int undump, const char* filename) {
+static void doit(int undump, const char* filename, DumpBuffer* out) {
 	FILE* f;
 	ZIO z;
 	char *fn;
@@ -189,12 +362,20 @@ static void doit(int undump, const char* filename) {
 	zFopen(&z,f,fn);
 	if (verbose)
 		fprintf(stderr,"%s\n",fn);
-	if (undump)
-		do_undump(&z);
-	else
-		do_compile(&z);
-	if (f != stdin)
+	{
+		Common::StatsPhase phase(undump ? Common::kStatsDecode : Common::kStatsConvert);
+		if (undump)
+			do_undump(&z);
+		else
+			do_compile(&z, out);
+	}
+	if (f != stdin) {
+		long size = ftell(f);
+		if (size > 0)
+			Common::addStatsRead(size);
 		fclose(f);
+	}
+	Common::addStatsFiles();
 }
 
 static FILE* efopen(const char* name, const char* mode) {
@@ -4,6 +4,7 @@
 ** See Copyright Notice in lua.h
 */
 
+#include <stdio.h>
 #include "tools/lua/lauxlib.h"
 #include "tools/lua/lfunc.h"
 #include "tools/lua/lobject.h"
@@ -25,6 +26,23 @@ typedef struct
 int OpcodeInfo(TProtoFunc* tf, Byte* p, Opcode* I, const char* xFILE, int xLINE);
 int CodeSize(TProtoFunc* tf);
 
+typedef struct
+{
+ byte* b;
+ size_t n;				/* bytes used */
+ size_t size;				/* bytes allocated */
+} DumpBuffer;
+
+byte* DumpSpace(DumpBuffer* D, size_t n);
+void DumpFlush(DumpBuffer* D, FILE* f);
+void DumpByte(int c, DumpBuffer* D);
+void DumpWord(int i, DumpBuffer* D);
+void DumpLong(long i, DumpBuffer* D);
+void DumpFloat(float f, DumpBuffer* D);
+void DumpCode(TProtoFunc* tf, DumpBuffer* D);
+void DumpTString(TaggedString* s, DumpBuffer* D);
+void DumpHeader(int version, DumpBuffer* D);
+
 #define INFO(tf,p,I)	OpcodeInfo(tf,p,I,__FILE__,__LINE__)
 #define fileName(tf)	( (tf->fileName)==NULL ? NULL : tf->fileName->str )
 
@@ -7,10 +7,12 @@ TOOL_OBJS := \
 	opt.o \
 	print.o \
 	rebase.o \
+	snapshot.o \
+	../lab.o \
 
 TOOL := luac
 TOOL_DEPS := tools/lua
-TOOL_LDFLAGS := -Ltools/lua -llua
+TOOL_LDFLAGS := -lcommon -Ltools/lua -llua -lpthread
 
 MAKE := luac
 
@@ -53,11 +53,17 @@ int OpcodeInfo(TProtoFunc* tf, Byte* p, Opcode* I, const char* xFILE, int xLINE)
  else
  {
   OP=Info[op];
-  if (op==SETLIST || op==CLOSURE || op==CALLFUNC)
+  if (op==SETLIST || op==CLOSURE || op==CALLFUNC ||
+      op==LOCALDOTTED || op==CALLGLOBAL || op==IFFCMPJMP || op==IFTCMPUPJMP)
   {
    OP.arg=p[1];
    OP.arg2=p[2];
   }
+  else if (op==LOCALDOTTEDN)
+  {
+   OP.arg=p[1]&15;
+   OP.arg2=p[1]>>4;
+  }
   else if (OP.size == 2) OP.arg = p[1];
   else if (OP.size >= 3) OP.arg = READ_LE_UINT16(p + 1);
   if (op == SETLISTW) OP.arg2 = p[3];
@@ -133,3 +133,8 @@
 { "POP", 2, POP, POP, POP-POP-1, 0 },
 { "POP0", 1, POP0, POP, POP0-POP-1, 0 },
 { "POP1", 1, POP1, POP, POP1-POP-1, 0 },
+{ "LOCALDOTTED", 3, LOCALDOTTED, LOCALDOTTED, LOCALDOTTED-LOCALDOTTED-1, 0 },
+{ "LOCALDOTTEDN", 2, LOCALDOTTEDN, LOCALDOTTED, LOCALDOTTEDN-LOCALDOTTED-1, 0 },
+{ "CALLGLOBAL", 3, CALLGLOBAL, CALLGLOBAL, CALLGLOBAL-CALLGLOBAL-1, 0 },
+{ "IFFCMPJMP", 3, IFFCMPJMP, IFFCMPJMP, IFFCMPJMP-IFFCMPJMP-1, 0 },
+{ "IFTCMPUPJMP", 3, IFTCMPUPJMP, IFTCMPUPJMP, IFTCMPUPJMP-IFTCMPUPJMP-1, 0 },
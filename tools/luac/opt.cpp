@@ -53,7 +53,7 @@ static void FixConstants(TProtoFunc* tf, int* C)
  }
 }
 
-static TProtoFunc* TF;
+static LUA_THREAD TProtoFunc* TF;
 
 static int compare(const void* a, const void *b)
 {
@@ -69,8 +69,8 @@ static int compare(const void* a, const void *b)
 
 static void OptConstants(TProtoFunc* tf)
 {
- static int* C=NULL;
- static int* D=NULL;
+ static LUA_THREAD int* C=NULL;
+ static LUA_THREAD int* D=NULL;
  int i,k;
  int n=tf->nconsts;
  if (n==0) return;
@@ -145,12 +145,16 @@ static void FixJumps(TProtoFunc* tf)
   int nop;
   if (op==ENDCODE) break;
   nop=0;
-  if (op==IFTUPJMP || op==IFFUPJMP) nop=FixJump(tf,p-i+n,p); else
-  if (op==ONTJMP || op==ONFJMP || op==JMP || op==IFFJMP) nop=FixJump(tf,p,p+i+n);
+  if (op==IFFCMPJMP || op==IFTCMPUPJMP) i=OP.arg2;
+  if (op==IFTUPJMP || op==IFFUPJMP || op==IFTCMPUPJMP) nop=FixJump(tf,p-i+n,p); else
+  if (op==ONTJMP || op==ONFJMP || op==JMP || op==IFFJMP || op==IFFCMPJMP)
+   nop=FixJump(tf,p,p+i+n);
   if (nop>0)
   {
    int j=i-nop;
-   if (n==2)
+   if (op==IFFCMPJMP || op==IFTCMPUPJMP)
+    p[2]=j;
+   else if (n==2)
     p[1]=j;
    else
 #if 0
@@ -194,6 +198,96 @@ printf("\t\"%s\":%d reduced code from %d to %d\n",
 	tf->fileName->str,tf->lineDefined,(int)(p-code),(int)(q-code));
 }
 
+static Byte* JumpTarget(Byte* p, Opcode* OP)
+{
+ int op=OP->op_class;
+ int n=OP->size;
+ if (op==IFTUPJMP || op==IFFUPJMP) return p-OP->arg+n;
+ if (op==ONTJMP || op==ONFJMP || op==JMP || op==IFFJMP) return p+OP->arg+n;
+ return NULL;
+}
+
+/*
+** Rewrite the pair at p (A) and q (B) as one superinstruction, padding
+** with NOP up to the end of B.  Fused jumps end where B did, so their
+** offsets carry over unchanged.  Returns 0 if the pair does not fuse.
+*/
+static int FusePair(Byte* p, Opcode* A, Opcode* B)
+{
+ int n=A->size+B->size;
+ Byte f[3];
+ int m;
+ if (A->op_class==PUSHLOCAL && B->op_class==GETDOTTED)
+ {
+  if (n==2 && A->arg<16 && B->arg<16)
+  {
+   f[0]=LOCALDOTTEDN; f[1]=A->arg|(B->arg<<4); m=2;
+  }
+  else if (n>=3 && A->arg<=255 && B->arg<=255)
+  {
+   f[0]=LOCALDOTTED; f[1]=A->arg; f[2]=B->arg; m=3;
+  }
+  else
+   return 0;
+ }
+ else if (A->op_class==GETGLOBAL && B->op_class==CALLFUNC)
+ {
+  int results = (B->op==CALLFUNC) ? B->arg : B->op-CALLFUNC0;
+  int nargs = (B->op==CALLFUNC) ? B->arg2 : B->arg;
+  if (nargs!=0 || A->arg>255) return 0;
+  f[0]=CALLGLOBAL; f[1]=A->arg; f[2]=results; m=3;
+ }
+ else if (A->op>=EQOP && A->op<=GEOP && (B->op==IFFJMP || B->op==IFTUPJMP))
+ {
+  f[0]=(B->op==IFFJMP) ? IFFCMPJMP : IFTCMPUPJMP; f[1]=A->op; f[2]=B->arg; m=3;
+ }
+ else
+  return 0;
+ memcpy(p,f,m);
+ memset(p+m,NOP,n-m);
+ return 1;
+}
+
+static void FuseCode(TProtoFunc* tf)
+{
+ Byte* code=tf->code;
+ Byte* p=code;
+ int size=CodeSize(tf);
+ char* target=(char*)luaM_malloc(size);
+ int fused=0;
+ memset(target,0,size);
+ while (1)				/* mark jump targets */
+ {
+  Opcode OP;
+  int n=INFO(tf,p,&OP);
+  Byte* t;
+  if (OP.op_class==ENDCODE) break;
+  t=JumpTarget(p,&OP);
+  if (t!=NULL && t>=code && t<code+size) target[t-code]=1;
+  p+=n;
+ }
+ p=code;
+ while (1)				/* fuse pairs not split by a jump target */
+ {
+  Opcode A,B;
+  int n=INFO(tf,p,&A);
+  Byte* q=p+n;
+  if (A.op_class==ENDCODE) break;
+  INFO(tf,q,&B);
+  if (!target[q-code] && FusePair(p,&A,&B))
+  {
+   ++fused;
+   p=q+B.size;
+  }
+  else
+   p=q;
+ }
+ luaM_free(target);
+ if (fused==0) return;
+printf("\t\"%s\":%d fused %d opcode pairs\n",
+	tf->fileName->str,tf->lineDefined,fused);
+}
+
 static void OptCode(TProtoFunc* tf)
 {
  int nop=NoDebug(tf);
@@ -202,27 +296,28 @@ static void OptCode(TProtoFunc* tf)
  PackCode(tf);
 }
 
-static void OptFunction(TProtoFunc* tf);
+static void OptFunction(TProtoFunc* tf, int fuse);
 
-static void OptFunctions(TProtoFunc* tf)
+static void OptFunctions(TProtoFunc* tf, int fuse)
 {
  int i,n=tf->nconsts;
  for (i=0; i<n; i++)
  {
   TObject* o=tf->consts+i;
-  if (ttype(o)==LUA_T_PROTO) OptFunction(tfvalue(o));
+  if (ttype(o)==LUA_T_PROTO) OptFunction(tfvalue(o),fuse);
  }
 }
 
-static void OptFunction(TProtoFunc* tf)
+static void OptFunction(TProtoFunc* tf, int fuse)
 {
  tf->locvars=NULL;			/* remove local variables table */
  OptConstants(tf);
+ if (fuse) FuseCode(tf);		/* leaves NOPs for OptCode to pack */
  OptCode(tf);
- OptFunctions(tf);
+ OptFunctions(tf,fuse);
 }
 
-void OptChunk(TProtoFunc* Main)
+void OptChunk(TProtoFunc* Main, int fuse)
 {
- OptFunction(Main);
+ OptFunction(Main,fuse);
 }
@@ -119,6 +119,23 @@ static void PrintCode(TProtoFunc* tf)
 		printf("\t; %s",VarStr(i));
 		break;
 
+	case LOCALDOTTED:
+		printf(" %d\t; ",OP.arg2);
+		PrintConstant(tf,OP.arg2);
+		break;
+
+	case CALLGLOBAL:
+		printf(" %d\t; %s",OP.arg2,VarStr(i));
+		break;
+
+	case IFTCMPUPJMP:
+		printf(" %d\t; to %d",OP.arg2,(int)(p-code)-OP.arg2+n);
+		break;
+
+	case IFFCMPJMP:
+		printf(" %d\t; to %d",OP.arg2,(int)(p-code)+OP.arg2+n);
+		break;
+
 	case SETLIST:
 	case CALLFUNC:
 		if (n>=3) printf(" %d",OP.arg2);
@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
+#include <map>
+#include <vector>
 #include "luac.h"
 #include "tools/lua/lmem.h"
 #include "tools/lua/lstring.h"
@@ -37,29 +41,125 @@ void rebase(TProtoFunc* func, TProtoFunc* base) {
 			rebase(tfvalue(&func->consts[j]), tfvalue(&base->consts[j]));
 }
 
+//Constants are looked up by bucket: a string's bucket is the (interned)
+//string itself, numbers that cmp() could find equal are in the same or a
+//neighbouring bucket, and all functions share one. The indices in a bucket
+//are ascending, and the ones before 'first' are no longer wanted.
+struct ConstKey {
+	int type;
+	long value;
+
+	bool operator<(const ConstKey &k) const {
+		return type != k.type ? type < k.type : value < k.value;
+	}
+};
+
+struct ConstBucket {
+	std::vector<int> index;
+	size_t first;
+
+	ConstBucket() : first(0) {}
+};
+
+typedef std::map<ConstKey, ConstBucket> ConstIndex;
+
+//2^15 buckets per power of two are wider than cmp()'s tolerance
+#define NUM_BUCKET_BITS		15
+#define NUM_BUCKET_OFFSET	(256L << NUM_BUCKET_BITS)
+
+static bool const_key(const TObject *o, ConstKey *k) {
+	k->type = ttype(o);
+	switch (ttype(o)) {
+	case LUA_T_NUMBER: {
+		real n = nvalue(o);
+		int e;
+		double m;
+		if (n == 0) {
+			k->value = 0;
+			return true;
+		}
+		if (!(fabs(n) <= FLT_MAX))	//inf and nan never compare equal
+			return false;
+		m = frexp(fabs(n), &e);
+		k->value = ((long)e << NUM_BUCKET_BITS) + (long)((m - 0.5) * (2L << NUM_BUCKET_BITS)) + NUM_BUCKET_OFFSET;
+		if (n < 0)
+			k->value = -k->value;
+		return true;
+	}
+	case LUA_T_STRING:
+		k->value = (long)(IntPoint)tsvalue(o);
+		return true;
+	case LUA_T_PROTO:
+		k->value = 0;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void index_const(ConstIndex &index, const TObject *o, int i) {
+	ConstKey k;
+	if (const_key(o, &k))
+		index[k].index.push_back(i);
+}
+
+//Smallest index in the buckets of 'o' that passes cmp() and is at least
+//'from' (or not used, if 'used' is given); -1 if there is none.
+static int find_const(ConstIndex &index, const TObject *o, const TObject *list, int from, const bool *used) {
+	ConstKey k;
+	int best = -1;
+	if (!const_key(o, &k))
+		return -1;
+	long v = k.value;
+	int nbuckets = (k.type == LUA_T_NUMBER && v != 0) ? 3 : 1;
+	for (int b = 0; b < nbuckets; ++b) {
+		k.value = (nbuckets == 1) ? v : v - 1 + b;
+		ConstIndex::iterator it = index.find(k);
+		if (it == index.end())
+			continue;
+		ConstBucket &bucket = it->second;
+		while (bucket.first < bucket.index.size() &&
+		       (bucket.index[bucket.first] < from || (used && used[bucket.index[bucket.first]])))
+			++bucket.first;
+		for (size_t e = bucket.first; e < bucket.index.size(); ++e) {
+			int i = bucket.index[e];
+			if (best != -1 && i >= best)
+				break;
+			if (used && used[i])
+				continue;
+			if (cmp(o, &list[i])) {
+				best = i;
+				break;
+			}
+		}
+	}
+	return best;
+}
+
 void uniform_const_list(TProtoFunc* func, TProtoFunc* base) {
 	int i, j, k, j0;
 	j0 = 0;
 
 	//Part1: Add back the deleted constant into the new function
+	ConstIndex func_index;
+	for (j = 0; j < func->nconsts; ++j)
+		index_const(func_index, &func->consts[j], j);
+
 	int max_const = func->nconsts;
 	for (i = 0; i < base->nconsts; ++i) {
 		//Ignore functions
 		if (ttype(&base->consts[i]) == LUA_T_PROTO)
 			continue;
 
-		for (j = j0; j < func->nconsts; ++j)
-			if (cmp(&base->consts[i], &func->consts[j])) {
-				j0 = j + 1;
+		j = find_const(func_index, &base->consts[i], func->consts, j0, NULL);
+		if (j != -1) {
+			j0 = j + 1;
 
-				//Set the value of numbers to the value of base functions
-				//since they could be sligthly differents (rounding errors)
-				if (ttype(&base->consts[i]) == LUA_T_NUMBER)
-					nvalue(&func->consts[j]) = nvalue(&base->consts[i]);
-				break;
-			}
-
-		if (j == func->nconsts) { //Const not found, re-add it
+			//Set the value of numbers to the value of base functions
+			//since they could be sligthly differents (rounding errors)
+			if (ttype(&base->consts[i]) == LUA_T_NUMBER)
+				nvalue(&func->consts[j]) = nvalue(&base->consts[i]);
+		} else { //Const not found, re-add it
 			if (func->nconsts + 1 >= max_const)
 				max_const = increase_const_list(func);
 			++func->nconsts;
@@ -69,6 +169,8 @@ void uniform_const_list(TProtoFunc* func, TProtoFunc* base) {
 				nvalue(&func->consts[func->nconsts - 1]) = nvalue(&base->consts[i]);
 			else if (ttype(&base->consts[i]) == LUA_T_STRING)
 				tsvalue(&func->consts[func->nconsts - 1]) = tsvalue(&base->consts[i]);
+			//A later base constant may match the copy
+			index_const(func_index, &func->consts[func->nconsts - 1], func->nconsts - 1);
 		}
 	}
 
@@ -77,21 +179,22 @@ void uniform_const_list(TProtoFunc* func, TProtoFunc* base) {
 	int *inst;
 	TObject *new_const_list;
 	bool *already_used;
+	ConstIndex base_index;
 
 	inst = luaM_newvector(func->nconsts, int);
 	new_const_list = luaM_newvector(func->nconsts, TObject);
 	already_used = luaM_newvector(base->nconsts, bool);
-	for (i = 0; i < base->nconsts; ++i)
+	for (i = 0; i < base->nconsts; ++i) {
 		already_used[i] = false;
+		index_const(base_index, &base->consts[i], i);
+	}
 
 	k = func->nconsts;
 	assert(func->nconsts >= base->nconsts);
 	for (j = 0; j < func->nconsts; ++j) {
-		for (i = 0; i < base->nconsts; ++i)
-			if (!already_used[i] && cmp(&base->consts[i], &func->consts[j]))
-				break;
+		i = find_const(base_index, &func->consts[j], base->consts, 0, already_used);
 
-		if (i != base->nconsts) {
+		if (i != -1) {
 			inst[j] = i;
 			already_used[i] = true;
 		} else
@@ -338,9 +441,9 @@ bool cmp(const TObject *a, const TObject *b) {
 			return false;
 	}
 
+	//Strings are interned, so equal ones are the same string
 	if (ttype(a) == LUA_T_STRING)
-		if (strncmp(svalue(a), svalue(b), tsvalue(a)->u.s.len) == 0)
-			return true;
+		return tsvalue(a) == tsvalue(b);
 
 	return false;
 }
@@ -0,0 +1,250 @@
+/*
+** $Id$
+** save the heap left by running scripts (luac -S)
+** See Copyright Notice in lua.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include "luac.h"
+#include "tools/lua/lstate.h"
+#include "tools/lua/ltable.h"
+
+/*
+** Every string, prototype, closure and table reachable from the globals
+** gets an index in the order it is first reached; the snapshot refers to
+** objects by these indices, so it can be loaded anywhere.  C functions are
+** saved by the name of the global they were predefined as.
+*/
+
+typedef std::map<const void*,long> Index;
+
+static std::map<lua_CFunction,TaggedString*> builtins;
+static Index stringindex,protoindex,closureindex,tableindex;
+static std::vector<TaggedString*> strings;
+static std::vector<TProtoFunc*> protos;
+static std::vector<Closure*> closures;
+static std::vector<Hash*> tables;
+static std::vector<TaggedString*> globals;
+
+void BeginSnapshot(void) {
+ TaggedString* g;
+ for (g=(TaggedString*)L->rootglobal.next; g; g=(TaggedString*)g->head.next)
+  if (ttype(&g->u.s.globalval)==LUA_T_CPROTO)
+   builtins[fvalue(&g->u.s.globalval)]=g;
+}
+
+template<class T>
+static void add(Index& index, std::vector<T*>& list, T* p) {
+ if (p!=NULL && index.find(p)==index.end()) {
+  index[p]=list.size();
+  list.push_back(p);
+ }
+}
+
+static void Walk(TObject* o) {
+ switch (ttype(o)) {
+  case LUA_T_NUMBER:
+  case LUA_T_NIL:
+	break;
+  case LUA_T_STRING:
+	add(stringindex,strings,tsvalue(o));
+	break;
+  case LUA_T_PROTO:
+	add(protoindex,protos,tfvalue(o));
+	break;
+  case LUA_T_CLOSURE:
+	add(closureindex,closures,clvalue(o));
+	break;
+  case LUA_T_ARRAY:
+	if (avalue(o)->htag!=LUA_T_ARRAY)
+	 luaL_verror("cannot snapshot a table with tag %d",avalue(o)->htag);
+	add(tableindex,tables,avalue(o));
+	break;
+  case LUA_T_CPROTO:
+	if (builtins.find(fvalue(o))==builtins.end())
+	 luaL_verror("cannot snapshot a C function that is not predefined");
+	add(stringindex,strings,builtins[fvalue(o)]);
+	break;
+  default:
+	luaL_verror("cannot snapshot a value of type %s",
+		ttype(o)>=0 ? "userdata" : luaO_typename(o));
+	break;
+ }
+}
+
+static void WalkProto(TProtoFunc* tf) {
+ LocVar* lv;
+ int i;
+ add(stringindex,strings,tf->fileName);
+ for (i=0; i<tf->nconsts; i++)
+  Walk(tf->consts+i);
+ for (lv=tf->locvars; lv && lv->line>=0; lv++)
+  add(stringindex,strings,lv->varname);
+}
+
+static void WalkTable(Hash* h) {
+ int i;
+ for (i=0; i<narray(h); i++)
+  Walk(val(anode(h,i)));
+ for (i=0; i<nhash(h); i++) {
+  Node* n=node(h,i);
+  if (ttype(ref(n))!=LUA_T_NIL && ttype(val(n))!=LUA_T_NIL) {
+   Walk(ref(n));
+   Walk(val(n));
+  }
+ }
+}
+
+/* globals still holding the C function they were predefined with are left out */
+static void WalkGlobals(void) {
+ TaggedString* g;
+ size_t p=0,c=0,t=0;
+ for (g=(TaggedString*)L->rootglobal.next; g; g=(TaggedString*)g->head.next) {
+  TObject* o=&g->u.s.globalval;
+  if (ttype(o)==LUA_T_NIL)
+   continue;
+  if (ttype(o)==LUA_T_CPROTO && builtins.find(fvalue(o))!=builtins.end() &&
+      builtins[fvalue(o)]==g)
+   continue;
+  add(stringindex,strings,g);
+  Walk(o);
+  globals.push_back(g);
+ }
+ while (p<protos.size() || c<closures.size() || t<tables.size()) {
+  while (p<protos.size())
+   WalkProto(protos[p++]);
+  while (c<closures.size()) {
+   Closure* cl=closures[c++];
+   int i;
+   for (i=0; i<=cl->nelems; i++)
+    Walk(cl->consts+i);
+  }
+  while (t<tables.size())
+   WalkTable(tables[t++]);
+ }
+}
+
+static void DumpSString(TaggedString* s, DumpBuffer* D) {	/* 0 is NULL */
+ DumpLong(s==NULL ? 0 : stringindex[s]+1,D);
+}
+
+static void DumpValue(TObject* o, DumpBuffer* D) {
+ switch (ttype(o)) {
+  case LUA_T_NUMBER:
+	DumpByte('N',D);
+	DumpNumber(nvalue(o),D);
+	break;
+  case LUA_T_STRING:
+	DumpByte('S',D);
+	DumpLong(stringindex[tsvalue(o)],D);
+	break;
+  case LUA_T_PROTO:
+	DumpByte('F',D);
+	DumpLong(protoindex[tfvalue(o)],D);
+	break;
+  case LUA_T_CLOSURE:
+	DumpByte('C',D);
+	DumpLong(closureindex[clvalue(o)],D);
+	break;
+  case LUA_T_ARRAY:
+	DumpByte('T',D);
+	DumpLong(tableindex[avalue(o)],D);
+	break;
+  case LUA_T_CPROTO:
+	DumpByte('B',D);
+	DumpLong(stringindex[builtins[fvalue(o)]],D);
+	break;
+  default:
+	DumpByte('-',D);
+	break;
+ }
+}
+
+static void DumpProto(TProtoFunc* tf, DumpBuffer* D) {
+ LocVar* lv;
+ int i,n;
+ DumpWord(tf->lineDefined,D);
+ DumpSString(tf->fileName,D);
+ DumpCode(tf,D);
+ DumpWord(tf->nconsts,D);
+ for (i=0; i<tf->nconsts; i++)
+  DumpValue(tf->consts+i,D);
+ for (n=0,lv=tf->locvars; lv && lv->line>=0; lv++) ++n;
+ DumpWord(n,D);
+ for (lv=tf->locvars; lv && lv->line>=0; lv++) {
+  DumpWord(lv->line,D);
+  DumpSString(lv->varname,D);
+ }
+}
+
+static long HashCount(Hash* h) {
+ long n=0;
+ int i;
+ for (i=0; i<nhash(h); i++)
+  if (ttype(ref(node(h,i)))!=LUA_T_NIL && ttype(val(node(h,i)))!=LUA_T_NIL)
+   ++n;
+ return n;
+}
+
+static void DumpTable(Hash* h, DumpBuffer* D) {
+ long n=HashCount(h);
+ int i;
+ for (i=0; i<narray(h); i++)
+  if (ttype(val(anode(h,i)))!=LUA_T_NIL)
+   ++n;
+ DumpLong(n,D);
+ for (i=0; i<narray(h); i++)
+  if (ttype(val(anode(h,i)))!=LUA_T_NIL) {
+   DumpValue(ref(anode(h,i)),D);
+   DumpValue(val(anode(h,i)),D);
+  }
+ for (i=0; i<nhash(h); i++) {
+  Node* nd=node(h,i);
+  if (ttype(ref(nd))!=LUA_T_NIL && ttype(val(nd))!=LUA_T_NIL) {
+   DumpValue(ref(nd),D);
+   DumpValue(val(nd),D);
+  }
+ }
+}
+
+static void DumpHeap(DumpBuffer* D) {
+ size_t i;
+ DumpHeader(VERSION_SNAPSHOT,D);
+ DumpLong(strings.size(),D);
+ DumpLong(protos.size(),D);
+ DumpLong(closures.size(),D);
+ DumpLong(tables.size(),D);
+ for (i=0; i<strings.size(); i++)
+  DumpTString(strings[i],D);
+ for (i=0; i<closures.size(); i++)
+  DumpWord(closures[i]->nelems,D);
+ for (i=0; i<tables.size(); i++) {
+  DumpLong(narray(tables[i]),D);
+  DumpLong(HashCount(tables[i]),D);
+ }
+ for (i=0; i<protos.size(); i++)
+  DumpProto(protos[i],D);
+ for (i=0; i<closures.size(); i++) {
+  int j;
+  for (j=0; j<=closures[i]->nelems; j++)
+   DumpValue(closures[i]->consts+j,D);
+ }
+ for (i=0; i<tables.size(); i++)
+  DumpTable(tables[i],D);
+ DumpLong(globals.size(),D);
+ for (i=0; i<globals.size(); i++) {
+  DumpLong(stringindex[globals[i]],D);
+  DumpValue(&globals[i]->u.s.globalval,D);
+ }
+}
+
+void DumpSnapshot(FILE* f) {
+ DumpBuffer D={NULL,0,0};
+ WalkGlobals();
+ DumpHeap(&D);
+ DumpFlush(&D,f);
+ free(D.b);
+}
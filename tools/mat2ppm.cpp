@@ -20,114 +20,286 @@
  *
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
+/**
+ * A tool that converts Grim's mat materials to binary ppm images, one per
+ * image of the material, through the colours of a cmp colormap.
+ */
 
-#include <ppm.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "common/endian.h"
+#include "lab.h"
+#include "assetloader.h"
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
-static pixel cmap[256];
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
-int32_t read_LEint32(FILE *f) {
-	unsigned char c[4];
-	int i;
+/**
+ * The colours of a cmp as 4 bytes each, RGB and a pad byte, so every
+ * pixel is expanded with one 32-bit load and store.
+ */
+struct Colormap {
+	uint8 rgbx[256 * 4];
 
-	fread(c, 1, 4, f);
-	return (c[0]) | (c[1] << 8) | (c[2] << 16) | (c[3] << 24);
-}
+	// Greyscale, for when no cmp is given
+	Colormap() {
+		for (int i = 0; i < 256; i++) {
+			rgbx[i * 4] = rgbx[i * 4 + 1] = rgbx[i * 4 + 2] = i;
+			rgbx[i * 4 + 3] = 0;
+		}
+	}
 
-void read_cmp(const char *fname) {
-	unsigned char col[3];
-	FILE *cmp;
-	int i;
+	bool load(const char *data, uint32 size) {
+		if (size < 48 + 256 * 3)
+			return false;
+		for (int i = 0; i < 256; i++)
+			memcpy(rgbx + i * 4, data + 48 + i * 3, 3);
+		return true;
+	}
+};
 
-	cmp = fopen(fname, "r");
-	if (cmp == NULL) {
-		perror(fname);
-		exit(1);
+// Writes count pixels as RGB. Each store is 4 bytes wide and the next one
+// overwrites its pad byte, so dst needs one spare byte past the end.
+static void expandPixels(const Colormap &cmap, const uint8 *src, uint8 *dst, uint32 count) {
+	uint32 i = 0;
+	for (; i + 4 <= count; i += 4, dst += 12) {
+		memcpy(dst, cmap.rgbx + src[i] * 4, 4);
+		memcpy(dst + 3, cmap.rgbx + src[i + 1] * 4, 4);
+		memcpy(dst + 6, cmap.rgbx + src[i + 2] * 4, 4);
+		memcpy(dst + 9, cmap.rgbx + src[i + 3] * 4, 4);
 	}
-	fseek(cmp, 48, SEEK_SET);
-	for (i = 0; i < 256; i++) {
-		col[0] = getc(cmp); col[1] = getc(cmp); col[2] = getc(cmp);
-		PPM_ASSIGN(cmap[i], col[0], col[1], col[2]);
+	for (; i < count; i++, dst += 3)
+		memcpy(dst, cmap.rgbx + src[i] * 4, 4);
+}
+
+static bool writeWholeFile(const std::string &name, const char *data, uint32 size) {
+	Common::StatsPhase phase(Common::kStatsWrite);
+	FILE *file = fopen(name.c_str(), "wb");
+	if (!file) {
+		printf("Could not open file %s for writing\n", name.c_str());
+		return false;
 	}
-	fclose(cmp);
+	bool success = fwrite(data, 1, size, file) == size;
+	if (fclose(file) != 0)
+		success = false;
+	if (!success)
+		printf("Could not write file %s\n", name.c_str());
+	else
+		Common::addStatsWritten(size);
+	return success;
 }
 
-void write_img(FILE *f, const char *fname, int n, int num_img) {
-	FILE *out;
-	int32_t width, height;
-	int x, y;
-	unsigned char p;
-	pixel **img;
-	char newname[1024];
-	const char *basename;
-
-	fseek(f, 116 + 40 * (num_img - 1), SEEK_SET);
-	width = read_LEint32(f);
-	height = read_LEint32(f);
-	img = ppm_allocarray(width, height);
-	fseek(f, 100 + 40 * num_img + (width * height + 24) * n, SEEK_SET);
-	for (y = 0; y < height; y++)
-		for (x = 0; x < width; x++) {
-			p = getc(f);
-			img[y][x] = cmap[p];
-		}
+/**
+ * Converts every image of the material, which all have the size given in
+ * the last image header, to fname_N.ppm. The files are assembled in out,
+ * reused across materials, and each is written at once.
+ */
+static bool convertMaterial(const char *data, uint32 size, const std::string &fname, const Colormap &cmap,
+		std::vector<char> &out) {
+	if (size < 100) {
+		printf("Truncated material %s\n", fname.c_str());
+		return false;
+	}
+	// The image headers, 40 bytes each, come before the first image
+	uint32 numImages = READ_LE_UINT32(data + 12);
+	if (numImages == 0 || numImages > (size - 100) / 40) {
+		printf("Invalid material %s\n", fname.c_str());
+		return false;
+	}
+	uint32 width = READ_LE_UINT32(data + 116 + 40 * (numImages - 1));
+	uint32 height = READ_LE_UINT32(data + 120 + 40 * (numImages - 1));
+	uint32 stride = width * height + 24;
+	uint32 first = 100 + 40 * numImages;
+	// The images are 24 bytes apart, the last one can end the file
+	if (width == 0 || height == 0 || width > 4096 || height > 4096 || (size - first + 24) / stride < numImages) {
+		printf("Invalid material %s\n", fname.c_str());
+		return false;
+	}
 
-		basename = strrchr(fname, '/');
-		if (basename != NULL)
-			basename++;
-		else
-			basename = fname;
-		strcpy(newname, basename);
-		if (strlen(newname) > 4 &&
-			strcasecmp(newname + strlen(newname) - 4, ".mat") == 0)
-			newname[strlen(newname) - 4] = '\0';
-		sprintf(newname + strlen(newname), "_%d.ppm", n);
-
-		out = fopen(newname, "wb");
-		if (out == NULL) {
-			perror(newname);
-			exit(1);
+	std::stringstream header;
+	header << "P6\n" << width << " " << height << "\n255\n";
+	const std::string &h = header.str();
+	const uint32 fileSize = h.size() + width * height * 3;
+	{
+		Common::StatsPhase phase(Common::kStatsConvert);
+		out.resize(fileSize * numImages + 1);
+		for (uint32 n = 0; n < numImages; n++) {
+			char *file = &out[n * fileSize];
+			memcpy(file, h.data(), h.size());
+			expandPixels(cmap, (const uint8 *)data + first + stride * n, (uint8 *)file + h.size(), width * height);
 		}
+	}
+
+	std::string base = fname.substr(fname.rfind('/') + 1);
+	if (base.size() > 4 && Common::matchPattern("*.mat", base.c_str()))
+		base.erase(base.size() - 4);
+	bool success = true;
+	for (uint32 n = 0; n < numImages; n++) {
+		std::stringstream name;
+		name << base << '_' << n << ".ppm";
+		printf("Saving image %d to file %s\n", n, name.str().c_str());
+		success = writeWholeFile(name.str(), &out[n * fileSize], fileSize) && success;
+	}
+	Common::addStatsFiles();
+	return success;
+}
 
-		ppm_writeppm(out, img, width, height, 255, 0);
-		ppm_freearray(img, height);
-		fclose(out);
+void usage() {
+	printf("Usage: mat2ppm [-c CMP] [labfilename] <filename>\n");
+	printf("       mat2ppm -b [-c CMP] [-j N] <labfilename> <pattern>\n");
+	printf("\t-c CMP\tThe colormap to use, from the lab if one is given, greyscale without one\n");
+	printf("\t-b\tConvert every entry of the lab matching pattern (e.g. '*.mat')\n");
+	printf("\t-j N\tConvert with N threads in batch mode\n");
 }
 
-void process_file(const char *fname) {
-	FILE *in;
-	int32_t num_img;
-	int i;
+struct BatchJob {
+	Lab *lab;
+	const char *pattern;
+	const Colormap *cmap;
+	uint32 nextEntry;
+	int failed;
+#ifdef POSIX
+	pthread_mutex_t lock;
+#endif
+};
 
-	in = fopen(fname, "rb");
-	if (in == NULL) {
-		perror(fname);
-		exit(1);
+static void *batchWorker(void *arg) {
+	BatchJob *job = (BatchJob *)arg;
+	std::vector<char> out;
+	for (;;) {
+#ifdef POSIX
+		pthread_mutex_lock(&job->lock);
+#endif
+		uint32 index = job->nextEntry++;
+#ifdef POSIX
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (index >= job->lab->getNumEntries())
+			break;
+
+		const char *name = job->lab->getEntryName(index);
+		if (!Common::matchPattern(job->pattern, name))
+			continue;
+
+		uint32 length;
+		const char *data = job->lab->getData(name, length);
+		if (!data || !convertMaterial(data, length, name, *job->cmap, out)) {
+#ifdef POSIX
+			pthread_mutex_lock(&job->lock);
+#endif
+			++job->failed;
+#ifdef POSIX
+			pthread_mutex_unlock(&job->lock);
+#endif
+		}
+	}
+	return NULL;
+}
+
+// Converts every matching entry of the lab, parsing the lab only once
+static int convertBatch(Lab *lab, const char *pattern, int jobs, const Colormap &cmap) {
+	BatchJob job;
+	job.lab = lab;
+	job.pattern = pattern;
+	job.cmap = &cmap;
+	job.nextEntry = 0;
+	job.failed = 0;
+
+#ifdef POSIX
+	pthread_mutex_init(&job.lock, NULL);
+	// Without a mapping all reads go through one shared buffer
+	if (!job.lab->isMapped())
+		jobs = 1;
+	pthread_t *threads = new pthread_t[jobs];
+	int started = 0;
+	for (int t = 1; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, batchWorker, &job) == 0)
+			++started;
 	}
-	fseek(in, 12, SEEK_SET);
-	num_img = read_LEint32(in);
-	for (i = 0; i < num_img; i++)
-		write_img(in, fname, i, num_img);
-	fclose(in);
+	batchWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	delete[] threads;
+	pthread_mutex_destroy(&job.lock);
+#else
+	batchWorker(&job);
+#endif
+
+	return job.failed ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
-	int i;
+	bool batch = false;
+	const char *cmpName = NULL;
+	int jobs = 1;
+	int c;
+	Common::initStats("mat2ppm", argc, argv);
+	while ((c = getopt(argc, argv, "bc:j:h")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = true;
+			break;
+		case 'c':
+			cmpName = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 2 || (batch && argc < 3)) {
+		usage();
+		return 1;
+	}
 
-	ppm_init(&argc, argv);
-	for (i = 0; i < 256; i++)
-		PPM_ASSIGN(cmap[i], i, i, i);
+	Lab *lab = argc > 2 ? new Lab(argv[1], false, true) : NULL;
+	AssetLoader loader(lab);
 
-	i = 1;
-	if (argc >= 3 && strncmp(argv[1], "-c", 2) == 0) {
-		read_cmp(argv[2]);
-		i = 3;
+	Colormap cmap;
+	if (cmpName) {
+		const Asset *cmp = loader.load(cmpName);
+		if (!cmp || !cmap.load(cmp->data, cmp->size)) {
+			printf("Could not read colormap %s\n", cmpName);
+			return 1;
+		}
+		loader.release(cmp);
+	}
+
+	int result;
+	if (batch) {
+		result = convertBatch(lab, argv[2], jobs, cmap);
+	} else {
+		const char *filename = argc > 2 ? argv[2] : argv[1];
+		const Asset *asset = loader.load(filename);
+		if (!asset) {
+			printf("Could not open file %s\n", filename);
+			return 1;
+		}
+		std::vector<char> out;
+		result = convertMaterial(asset->data, asset->size, filename, cmap, out) ? 0 : 1;
+		loader.release(asset);
 	}
-	for (; i < argc; i++)
-		process_file(argv[i]);
 
-	return 0;
+	loader.flush();
+	delete lab;
+	return result;
 }
@@ -0,0 +1,422 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "tools/mcmp.h"
+#include "common/endian.h"
+
+#include <cstring>
+
+static int16 imcTable1[] = {
+	  7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+	 19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+	 50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+	130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+	337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+	876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+	2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+	5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static int8 imcTable2[] = {
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
+};
+
+static int8 imcOtherTable1[] = {
+	-1, 4, -1, 4
+};
+
+static int8 imcOtherTable2[] = {
+	-1, -1, 2, 6, -1, -1, 2, 6
+};
+
+static int8 imcOtherTable3[] = {
+	-1, -1, -1, -1, 1, 2, 4, 6,
+	-1, -1, -1, -1, 1, 2, 4, 6
+};
+
+static int8 imcOtherTable4[] = {
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	1, 1, 1, 2, 2, 4, 5, 6,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	1, 1, 1, 2, 2, 4, 5, 6
+};
+
+static int8 imcOtherTable5[] = {
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	 1, 1, 1, 1, 1, 2, 2, 2,
+	 2, 4, 4, 4, 5, 5, 6, 6,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	 1, 1, 1, 1, 1, 2, 2, 2,
+	 2, 4, 4, 4, 5, 5, 6, 6
+};
+
+static int8 imcOtherTable6[] = {
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 2, 2, 2, 2, 2, 2,
+	 2, 2, 4, 4, 4, 4, 4, 4,
+	 5, 5, 5, 5, 6, 6, 6, 6,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,
+	 1, 1, 1, 1, 1, 1, 1, 1,
+	 1, 1, 2, 2, 2, 2, 2, 2,
+	 2, 2, 4, 4, 4, 4, 4, 4,
+	 5, 5, 5, 5, 6, 6, 6, 6
+};
+
+static int8 *offsets[] = {
+	imcOtherTable1, imcOtherTable2, imcOtherTable3,
+	imcOtherTable4, imcOtherTable5, imcOtherTable6
+};
+
+/**
+ * One decoder step: the delta to add for a code read at a given table
+ * position, and the table position the next sample is decoded with.
+ * Codes with all value bits set are escapes carrying a literal sample. The
+ * delta can exceed the 16-bit sample range before clamping.
+ */
+struct VimaStep {
+	int32 delta;
+	uint8 nextPos;
+	uint8 escape;
+};
+
+static VimaStep stepTable[89][128];
+
+void vimaInit() {
+	static bool initialized = false;
+	static uint16 destTable[5786];
+	int destTableStartPos, incer;
+
+	if (initialized)
+		return;
+	initialized = true;
+
+	for (destTableStartPos = 0, incer = 0; destTableStartPos < 64; destTableStartPos++, incer++) {
+		unsigned int destTablePos, imcTable1Pos;
+		for (imcTable1Pos = 0, destTablePos = destTableStartPos;
+				imcTable1Pos < sizeof(imcTable1) / sizeof(imcTable1[0]); imcTable1Pos++, destTablePos += 64) {
+			int put = 0, count, tableValue;
+			for (count = 32, tableValue = imcTable1[imcTable1Pos]; count != 0; count >>= 1, tableValue >>= 1) {
+				if (incer & count) {
+					put += tableValue;
+				}
+			}
+			destTable[destTablePos] = put;
+		}
+	}
+
+	// Fold the bit width, sign, step size and table position update for
+	// every (position, code) pair into one lookup
+	for (int pos = 0; pos < 89; pos++) {
+		int numBits = imcTable2[pos];
+		int highBit = 1 << (numBits - 1);
+		int lowBits = highBit - 1;
+
+		for (int code = 0; code < (1 << numBits); code++) {
+			VimaStep &step = stepTable[pos][code];
+			int val = code & lowBits;
+
+			int delta = destTable[(val << (7 - numBits)) | (pos << 6)];
+			if (val)
+				delta += (imcTable1[pos] >> (numBits - 1));
+			if (code & highBit)
+				delta = -delta;
+
+			int nextPos = pos + offsets[numBits - 2][val];
+			if (nextPos < 0)
+				nextPos = 0;
+			else if (nextPos > 88)
+				nextPos = 88;
+
+			step.delta = delta;
+			step.nextPos = nextPos;
+			step.escape = (val == lowBits);
+		}
+	}
+}
+
+void decompressVima(const byte *src, uint32 srcLen, int16 *dest, int destLen) {
+	const byte *srcEnd = src + srcLen;
+	int numChannels = 1;
+	byte sBytes[2];
+	int16 sWords[2];
+
+	if (srcLen < 5)
+		return;
+
+	sBytes[0] = *src++;
+	if (sBytes[0] & 0x80) {
+		sBytes[0] = ~sBytes[0];
+		numChannels = 2;
+	}
+	sWords[0] = (src[0] << 8) | src[1];
+	src += 2;
+	if (numChannels > 1) {
+		if (srcEnd - src < 3)
+			return;
+		sBytes[1] = *src++;
+		sWords[1] = (src[0] << 8) | src[1];
+		src += 2;
+	}
+
+	int numSamples = destLen / (numChannels * 2);
+
+	// The next unread bits of the stream, most significant first
+	uint32 bits = 0;
+	int numAvail = 0;
+
+	for (int channel = 0; channel < numChannels; channel++) {
+		int16 *destPos = dest + channel;
+		int currTablePos = sBytes[channel];
+		int outputWord = sWords[channel];
+
+		if (currTablePos > 88)
+			currTablePos = 88;
+
+		for (int sample = 0; sample < numSamples; sample++) {
+			// A sample takes at most 7 + 16 bits
+			while (numAvail <= 24) {
+				bits |= (uint32)(src < srcEnd ? *src++ : 0) << (24 - numAvail);
+				numAvail += 8;
+			}
+
+			int numBits = imcTable2[currTablePos];
+			const VimaStep &step = stepTable[currTablePos][bits >> (32 - numBits)];
+			bits <<= numBits;
+			numAvail -= numBits;
+
+			if (step.escape) {
+				outputWord = (int16)(bits >> 16);
+				bits <<= 16;
+				numAvail -= 16;
+			} else {
+				outputWord += step.delta;
+				if (outputWord < -0x8000)
+					outputWord = -0x8000;
+				else if (outputWord > 0x7fff)
+					outputWord = 0x7fff;
+			}
+
+			*destPos = TO_LE_16(outputWord);
+			destPos += numChannels;
+			currTablePos = step.nextPos;
+		}
+	}
+}
+
+void decodeMcmpBlock(const McmpBlock &block, const byte *src, byte *dest) {
+	if (block.codec == MCMP_CODEC_VIMA) {
+		decompressVima(src, block.compSize, (int16 *)dest, block.uncompSize);
+	} else {
+		uint32 size = block.uncompSize < block.compSize ? block.uncompSize : block.compSize;
+		memcpy(dest, src, size);
+		memset(dest + size, 0, block.uncompSize - size);
+	}
+}
+
+McmpStream::McmpStream() :
+	_file(NULL), _blocks(NULL), _numBlocks(0), _decodedSize(0), _compressedSize(0),
+	_codecs(NULL), _badCodec(NULL), _src(NULL), _srcSize(0), _cachedBlock(-1), _cache(NULL), _cacheSize(0) {
+}
+
+McmpStream::~McmpStream() {
+	close();
+	delete[] _src;
+	delete[] _cache;
+}
+
+void McmpStream::close() {
+	if (_file)
+		fclose(_file);
+	_file = NULL;
+	delete[] _blocks;
+	_blocks = NULL;
+	delete[] _codecs;
+	_codecs = NULL;
+	_numBlocks = 0;
+	_decodedSize = 0;
+	_compressedSize = 0;
+	_badCodec = NULL;
+	_cachedBlock = -1;
+}
+
+bool McmpStream::open(const char *filename) {
+	close();
+	vimaInit();
+
+	_file = fopen(filename, "rb");
+	if (!_file)
+		return false;
+
+	byte header[6];
+	if (fread(header, 6, 1, _file) != 1 || memcmp(header, "MCMP", 4) != 0) {
+		close();
+		return false;
+	}
+	uint16 numBlocks = READ_BE_UINT16(header + 4);
+	byte *blockTable = new byte[9 * numBlocks];
+	if (fread(blockTable, 9, numBlocks, _file) != numBlocks || fread(header, 2, 1, _file) != 1) {
+		delete[] blockTable;
+		close();
+		return false;
+	}
+
+	uint16 numCodecs = READ_BE_UINT16(header) / 5;
+	_codecs = new char[5 * numCodecs + 1];
+	if (fread(_codecs, 5, numCodecs, _file) != numCodecs) {
+		delete[] blockTable;
+		close();
+		return false;
+	}
+	_codecs[5 * numCodecs] = '\0';
+
+	// A block with an unknown codec ends the index, the ones before it can
+	// still be decoded
+	uint32 fileOffset = 6 + 9 * numBlocks + 2 + 5 * numCodecs;
+	_blocks = new McmpBlock[numBlocks];
+	for (; _numBlocks < numBlocks; _numBlocks++) {
+		McmpBlock &block = _blocks[_numBlocks];
+		const byte *entry = blockTable + 9 * _numBlocks;
+		int codec = (int8)entry[0];
+		if (codec < 0 || codec >= numCodecs) {
+			_badCodec = "(out of range)";
+			break;
+		}
+		if (strcmp(_codecs + 5 * codec, "NULL") == 0)
+			block.codec = MCMP_CODEC_NULL;
+		else if (strcmp(_codecs + 5 * codec, "VIMA") == 0)
+			block.codec = MCMP_CODEC_VIMA;
+		else {
+			_badCodec = _codecs + 5 * codec;
+			break;
+		}
+		block.uncompSize = READ_BE_UINT32(entry + 1);
+		block.compSize = READ_BE_UINT32(entry + 5);
+		block.fileOffset = fileOffset;
+		block.decodedOffset = _decodedSize;
+		fileOffset += block.compSize;
+		_compressedSize += block.compSize;
+		_decodedSize += block.uncompSize;
+	}
+	delete[] blockTable;
+	return true;
+}
+
+int McmpStream::findBlock(uint32 offset) const {
+	if (offset >= _decodedSize)
+		return -1;
+
+	// Last block starting at or before offset, empty blocks are skipped
+	int lo = 0, hi = _numBlocks - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (_blocks[mid].decodedOffset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+bool McmpStream::readRange(uint32 offset, byte *dest, uint32 size) {
+	// A truncated file decodes as if it were padded with zeros
+	size_t numRead = 0;
+	if (fseek(_file, offset, SEEK_SET) == 0)
+		numRead = fread(dest, 1, size, _file);
+	memset(dest + numRead, 0, size - numRead);
+	return numRead > 0 || size == 0;
+}
+
+bool McmpStream::readCompressed(byte *dest) {
+	if (!_file)
+		return false;
+	if (_numBlocks == 0)
+		return true;
+	return readRange(_blocks[0].fileOffset, dest, _compressedSize);
+}
+
+bool McmpStream::decodeBlock(int i, byte *dest) {
+	if (!_file || i < 0 || i >= _numBlocks)
+		return false;
+
+	const McmpBlock &block = _blocks[i];
+	if (_srcSize < block.compSize) {
+		delete[] _src;
+		_srcSize = block.compSize;
+		_src = new byte[_srcSize];
+	}
+	if (!readRange(block.fileOffset, _src, block.compSize))
+		return false;
+	decodeMcmpBlock(block, _src, dest);
+	return true;
+}
+
+uint32 McmpStream::read(uint32 offset, byte *dest, uint32 size) {
+	int i = findBlock(offset);
+	if (i < 0)
+		return 0;
+	if (size > _decodedSize - offset)
+		size = _decodedSize - offset;
+
+	uint32 done = 0;
+	for (; done < size; i++) {
+		const McmpBlock &block = _blocks[i];
+		uint32 start = offset + done - block.decodedOffset;
+		uint32 count = block.uncompSize - start;
+		if (count > size - done)
+			count = size - done;
+
+		if (count == block.uncompSize) {
+			// Whole blocks go straight to the caller
+			if (!decodeBlock(i, dest + done))
+				break;
+		} else {
+			if (_cachedBlock != i) {
+				if (_cacheSize < block.uncompSize) {
+					delete[] _cache;
+					_cacheSize = block.uncompSize;
+					_cache = new byte[_cacheSize];
+				}
+				_cachedBlock = -1;
+				if (!decodeBlock(i, _cache))
+					break;
+				_cachedBlock = i;
+			}
+			memcpy(dest + done, _cache + start, count);
+		}
+		done += count;
+	}
+	return done;
+}
@@ -0,0 +1,123 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef MCMP_H
+#define MCMP_H
+
+#include "config.h"
+#include <cstdio>
+
+/**
+ * MCMP is the block-compressed container around the iMUS audio in the
+ * voice and music files. Every block is compressed on its own, either
+ * stored (NULL) or VIMA ADPCM.
+ */
+
+enum {
+	MCMP_CODEC_NULL,
+	MCMP_CODEC_VIMA
+};
+
+struct McmpBlock {
+	int codec;
+	uint32 uncompSize;
+	uint32 compSize;
+	uint32 fileOffset;		// of the compressed data in the MCMP file
+	uint32 decodedOffset;	// of the decoded data in the iMUS stream
+};
+
+/**
+ * Builds the VIMA decoder tables. Must be called once before decoding, and
+ * before decoding from several threads.
+ */
+void vimaInit();
+
+/**
+ * Decodes one VIMA block of srcLen bytes into destLen bytes of little-endian
+ * 16-bit PCM. Stereo blocks hold the left channel followed by the right one
+ * in the same bit stream, so the channels are decoded one after the other.
+ * Reads past the end of the block see zero bits.
+ */
+void decompressVima(const byte *src, uint32 srcLen, int16 *dest, int destLen);
+
+/**
+ * Decodes block from its compressed data at src into block.uncompSize bytes
+ * at dest.
+ */
+void decodeMcmpBlock(const McmpBlock &block, const byte *src, byte *dest);
+
+/**
+ * Random access to the decoded iMUS stream of an MCMP file. The block table
+ * is indexed when the file is opened, read() then only decodes the blocks
+ * covering the requested range. The last partially read block is kept, so
+ * scrubbing through a track in small steps decodes each block once.
+ *
+ * Sample n of the sound data starts n * channels * 2 bytes after the iMUS
+ * header, which fits in the first block.
+ */
+class McmpStream {
+public:
+	McmpStream();
+	~McmpStream();
+
+	bool open(const char *filename);
+	void close();
+
+	int getNumBlocks() const { return _numBlocks; }
+	const McmpBlock &getBlock(int i) const { return _blocks[i]; }
+	/** Size of the whole decoded stream, iMUS header included */
+	uint32 getDecodedSize() const { return _decodedSize; }
+	/** Size of the compressed data, which follows the tables back to back */
+	uint32 getCompressedSize() const { return _compressedSize; }
+	/** Name of the codec the index stopped at, NULL when all blocks are known */
+	const char *getBadCodec() const { return _badCodec; }
+
+	/** Index of the block holding decoded offset, -1 past the end */
+	int findBlock(uint32 offset) const;
+	/** Reads the compressed data of all blocks, getCompressedSize() bytes */
+	bool readCompressed(byte *dest);
+	/** Decodes block i into dest */
+	bool decodeBlock(int i, byte *dest);
+	/** Decodes size bytes from offset in the decoded stream, returns the number of bytes read */
+	uint32 read(uint32 offset, byte *dest, uint32 size);
+
+private:
+	bool readRange(uint32 offset, byte *dest, uint32 size);
+
+	FILE *_file;
+	McmpBlock *_blocks;
+	int _numBlocks;
+	uint32 _decodedSize;
+	uint32 _compressedSize;
+	char *_codecs;
+	const char *_badCodec;
+
+	// Grow-only scratch for one block's compressed data
+	byte *_src;
+	uint32 _srcSize;
+	// The last block decoded for a partial read
+	int _cachedBlock;
+	byte *_cache;
+	uint32 _cacheSize;
+};
+
+#endif
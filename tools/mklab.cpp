@@ -26,11 +26,19 @@
 #include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <map>
+#include <string>
+#include "common/md5.h"
+#include "common/xxhash.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 
 #define GT_GRIM 1
 #define GT_EMI 2
 
+#define MAX_ALIGN (1024 * 1024)
+
 typedef struct {
 	uint32_t magic;
 	uint32_t magic2;
@@ -77,7 +85,9 @@ void writeUint32(FILE *file, uint32_t value) {
 }
 
 void usage() {
-	printf("Usage: mklab --grim/--emi DIRECTORY FILE\n");
+	printf("Usage: mklab --grim/--emi [--dedup] [--align=N] [--order=LIST] DIRECTORY FILE\n");
+	printf("       mklab --update DIRECTORY FILE\n");
+	printf("       mklab --compact FILE\n");
 }
 
 void help() {
@@ -85,6 +95,14 @@ void help() {
 	printf("Create a lab file containing all the files into the specified directory\n\n");
 	printf("\t--grim\tCreate a Grim-compatible lab.\n");
 	printf("\t--emi\tCreate an EMI-compatible lab.\n");
+	printf("\t--dedup\tStore byte-identical files only once.\n");
+	printf("\t--align=N\tStart every file on a multiple of N bytes, a power of two\n");
+	printf("\t\tup to 1048576 (e.g. 2048 or 4096).\n");
+	printf("\t--order=LIST\tLay out the files named in LIST first, in that order.\n");
+	printf("\t\tLIST holds one file name per line, e.g. a trace of the engine's loads.\n");
+	printf("\t--update\tAdd new and changed files of DIRECTORY to the existing lab FILE.\n");
+	printf("\t\tOnly their payloads are appended, the tables are rewritten in place.\n");
+	printf("\t--compact\tRewrite FILE without the space left behind by --update.\n");
 	printf("\t--help\tPrint this help.\n");
 	exit(0);
 }
@@ -99,194 +117,631 @@ static char *appendPath(const char *name, const char *dir) {
 	return path;
 }
 
-static void countFiles(lab_header *head, DIR *dir, const char *dirname, int additionalLen) {
-	struct stat s;
-	struct dirent *dirfile;
-	while ((dirfile = readdir(dir))) {
-		if (!strcmp(dirfile->d_name, ".") || !strcmp(dirfile->d_name, ".."))
-			continue;
-
-		if (s.st_mode & S_IFDIR) {
-			char *d = appendPath(dirfile->d_name, dirname);
-			DIR *subdir = opendir(d);
-			countFiles(head, subdir, d, additionalLen + strlen(dirfile->d_name) + 1);
-			free(d);
-			closedir(subdir);
-		} else {
-			++head->num_entries;
-			head->string_table_size += strlen(dirfile->d_name) + 1 + additionalLen;
+// Entry table built up while walking the directory, grown as needed
+struct EntryList {
+	lab_entry *entries;
+	char **paths;
+	uint32_t num_entries;
+	uint32_t capacity;
+	char *str_table;
+	uint32_t string_table_size;
+	uint32_t str_capacity;
+};
+
+static void addEntry(EntryList *list, char *path, const char *name, uint32_t size) {
+	if (list->num_entries == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 256;
+		list->entries = (lab_entry *)realloc(list->entries, list->capacity * sizeof(lab_entry));
+		list->paths = (char **)realloc(list->paths, list->capacity * sizeof(char *));
+		if (!list->entries || !list->paths) {
+			printf("Could not allocate memory\n");
+			exit(3);
 		}
 	}
+	uint32_t namelen = strlen(name) + 1;
+	while (list->string_table_size + namelen > list->str_capacity) {
+		list->str_capacity = list->str_capacity ? list->str_capacity * 2 : 4096;
+		list->str_table = (char *)realloc(list->str_table, list->str_capacity);
+		if (!list->str_table) {
+			printf("Could not allocate memory\n");
+			exit(3);
+		}
+	}
+
+	lab_entry &entry = list->entries[list->num_entries];
+	WRITE_LE_UINT32(&entry.fname_offset, list->string_table_size);
+	entry.start = 0; // Assigned once the size of the tables is known
+	WRITE_LE_UINT32(&entry.size, size);
+	entry.reserved = 0; //What is this??
+	list->paths[list->num_entries] = path;
+	++list->num_entries;
+
+	memcpy(list->str_table + list->string_table_size, name, namelen);
+	list->string_table_size += namelen;
 }
 
-static void createEntries(DIR *dir, lab_entry *entries, char *str_table, const char *dirname, uint32_t &offset) {
-	static uint32_t num_entry = 0;
-	static uint32_t name_offset = 0;
-	static char *str_offset = str_table;
-	struct stat s;
+static void collectEntries(EntryList *list, DIR *dir, const char *dirname) {
 	struct dirent *dirfile;
 	while ((dirfile = readdir(dir))) {
 		if (!strcmp(dirfile->d_name, ".") || !strcmp(dirfile->d_name, ".."))
 			continue;
 
-		if (s.st_mode & S_IFDIR) {
-			char *d = appendPath(dirfile->d_name, dirname);
-			DIR *subdir = opendir(d);
-			createEntries(subdir, entries, str_table, d, offset);
-			free(d);
-			closedir(subdir);
+		char *path = appendPath(dirfile->d_name, dirname);
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			printf("Can not stat %s, skipping it\n", path);
+			free(path);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			DIR *subdir = opendir(path);
+			if (subdir) {
+				collectEntries(list, subdir, path);
+				closedir(subdir);
+			}
+			free(path);
 		} else {
-			lab_entry &entry = entries[num_entry++];
+			// 		printf("entry of file %s of size %d\n", path, st.st_size);
+			addEntry(list, path, dirfile->d_name, st.st_size);
+		}
+	}
+}
 
-			WRITE_LE_UINT32(&entry.fname_offset, name_offset);
-			WRITE_LE_UINT32(&entry.start, offset);
-			entry.reserved = 0; //What is this??
+// Copy size bytes from the current position of infile through a fixed size
+// buffer, so memory use does not depend on the size of the assets.
+static bool copyStream(FILE *outfile, FILE *infile, uint32_t size, char *buf, uint32_t bufsize) {
+	while (size > 0) {
+		uint32_t chunk = size < bufsize ? size : bufsize;
+		if (fread(buf, 1, chunk, infile) != chunk)
+			return false;
+		fwrite(buf, 1, chunk, outfile);
+		Common::addStatsRead(chunk);
+		Common::addStatsWritten(chunk);
+		size -= chunk;
+	}
+	return true;
+}
 
-			char *path = appendPath(dirfile->d_name, dirname);
-			char *name = strrchr(path, '/') + 1;
-			strcpy(str_offset, name);
-			str_offset[strlen(name)] = 0;
-			name_offset += strlen(name) + 1;
-			str_offset = str_table + name_offset;
+static bool copyFile(FILE *outfile, const char *path, uint32_t size, char *buf, uint32_t bufsize) {
+	Common::StatsPhase phase(Common::kStatsWrite);
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		printf("Could not open file %s\n", path);
+		return false;
+	}
+	bool success = copyStream(outfile, file, size, buf, bufsize);
+	if (!success)
+		printf("Could not read file %s\n", path);
+	else
+		Common::addStatsFiles();
+	fclose(file);
+	return success;
+}
 
-			struct stat st;
-			stat(path, &st);
+static uint32_t dataStart(const EntryList *list) {
+	return 16 + list->num_entries * sizeof(lab_entry) + list->string_table_size + 16;
+}
 
-			// 		printf("entry of file %s, at offset %d and of size %d\n", path, offset, st.st_size);
-			free(path);
+static void writeTables(FILE *outfile, uint8_t g_type, const EntryList *list) {
+	Common::StatsPhase phase(Common::kStatsWrite);
+	Common::addStatsWritten(20 + list->num_entries * sizeof(lab_entry) + list->string_table_size);
+	fseek(outfile, 0, SEEK_SET);
+	fwrite("LABN", 1, 4, outfile);
+	fwrite("\x00\x00\x01\x00", 1, 4, outfile); //version
+	writeUint32(outfile, list->num_entries);
+	writeUint32(outfile, list->string_table_size);
 
-			offset += st.st_size;
-			WRITE_LE_UINT32(&entry.size, st.st_size);
+	if (g_type == GT_GRIM) {
+		uint32_t s_offset = 0; // First entry of the table has offset 0 for Grim
+		fwrite(&s_offset, 1, 4, outfile);
+		fseek(outfile, -4, SEEK_CUR);
+	} else { // EMI has an offset instead.
+		writeUint32(outfile, 20 + list->num_entries * sizeof(lab_entry) + 0x13d0f);
+	}
+
+	fwrite(list->entries, 1, list->num_entries * sizeof(lab_entry), outfile);
+	if (g_type == GT_GRIM) {
+		fwrite(list->str_table, 1, list->string_table_size, outfile);
+	} else {
+		char *s = (char *)malloc(list->string_table_size);
+		memset(s, 0, list->string_table_size);
+		for (uint32_t j = 0; j < list->string_table_size; j++) {
+			if (list->str_table[j] != 0)
+				s[j] = list->str_table[j] ^ 0x96;
 		}
+		fwrite(s, 1, list->string_table_size, outfile);
+		free(s);
 	}
 }
 
-int main(int argc, char **argv) {
-	if (argc > 1 && !strcmp(argv[1], "--help")) {
-		help();
+// Parse the tables of an existing lab. The paths of the entries are left NULL.
+static void readLab(FILE *file, const char *filename, uint8_t &g_type, EntryList *list) {
+	Common::StatsPhase phase(Common::kStatsIndex);
+	char header[20];
+	if (fread(header, 1, 20, file) != 20 || memcmp(header, "LABN", 4) != 0) {
+		printf("There is no LABN header in %s\n", filename);
+		exit(2);
 	}
-
-	if (argc < 4) {
-		usage();
-		exit(1);
+	uint32_t num = READ_LE_UINT32(header + 8);
+	uint32_t s_size = READ_LE_UINT32(header + 12);
+	uint32_t typeTest = READ_LE_UINT32(header + 16);
+
+	memset(list, 0, sizeof(*list));
+	list->entries = (lab_entry *)malloc(num * sizeof(lab_entry) + 1);
+	list->paths = (char **)calloc(num + 1, sizeof(char *));
+	list->str_table = (char *)malloc(s_size + 1);
+	if (!list->entries || !list->paths || !list->str_table) {
+		printf("Could not allocate memory\n");
+		exit(3);
 	}
+	list->num_entries = list->capacity = num;
+	list->string_table_size = list->str_capacity = s_size;
+	Common::addStatsRead(20 + num * sizeof(lab_entry) + s_size);
 
-	const char *type = argv[1];
-	const char *dirname = argv[2];
-	const char *out = argv[3];
-
-	uint8_t g_type;
-	if (!strcmp(type, "--grim")) {
+	if (typeTest == 0) { // First entry of the table has offset 0 for Grim
 		g_type = GT_GRIM;
-	} else if (!strcmp(type, "--emi")) {
+		fseek(file, 16, SEEK_SET);
+		fread(list->entries, 1, num * sizeof(lab_entry), file);
+		fread(list->str_table, 1, s_size, file);
+	} else { // EMI has the string table offset instead
 		g_type = GT_EMI;
-	} else {
-		usage();
-		exit(1);
+		fseek(file, typeTest - 0x13d0f, SEEK_SET);
+		fread(list->str_table, 1, s_size, file);
+		for (uint32_t j = 0; j < s_size; j++)
+			if (list->str_table[j] != 0)
+				list->str_table[j] ^= 0x96;
+		fseek(file, 20, SEEK_SET);
+		fread(list->entries, 1, num * sizeof(lab_entry), file);
+	}
+}
+
+static void freeEntries(EntryList *list) {
+	for (uint32_t i = 0; i < list->num_entries; ++i)
+		free(list->paths[i]);
+	free(list->paths);
+	free(list->entries);
+	free(list->str_table);
+}
+
+static bool md5Range(FILE *file, uint32_t start, uint32_t size, uint8 digest[16], char *buf, uint32_t bufsize) {
+	Common::md5_context ctx;
+	Common::md5_starts(&ctx);
+	fseek(file, start, SEEK_SET);
+	while (size > 0) {
+		uint32_t chunk = size < bufsize ? size : bufsize;
+		if (fread(buf, 1, chunk, file) != chunk)
+			return false;
+		Common::md5_update(&ctx, (const uint8 *)buf, chunk);
+		size -= chunk;
+	}
+	Common::md5_finish(&ctx, digest);
+	return true;
+}
+
+// Append the new and changed files of dirname to an existing lab and rewrite
+// its tables. Entries that are not in the directory are kept as they are.
+static void updateLab(const char *dirname, const char *out) {
+	FILE *outfile = fopen(out, "r+b");
+	if (!outfile) {
+		printf("Could not open file %s for updating\n", out);
+		exit(2);
 	}
+	// Old payloads are read through their own handle, they all lie before
+	// anything written through outfile until the tables are rewritten
+	FILE *infile = fopen(out, "rb");
+	if (!infile) {
+		printf("Could not open file %s\n", out);
+		exit(2);
+	}
+	uint8_t g_type;
+	EntryList lab;
+	readLab(infile, out, g_type, &lab);
 
 	DIR *dir = opendir(dirname);
 	if (dir == 0) {
 		printf("Can not open source dir: %s\n", dirname);
 		exit(2);
 	}
+	EntryList files;
+	memset(&files, 0, sizeof(files));
+	collectEntries(&files, dir, dirname);
+	closedir(dir);
 
-	lab_header head;
+	const uint32_t bufsize = 1024*1024;
+	char *buf = (char *)malloc(bufsize);
+	if (!buf) {
+		printf("Could not allocate memory\n");
+		exit(3);
+	}
 
-	head.num_entries = 0;
-	head.string_table_size = 0;
+	std::map<std::string, uint32_t> byName;
+	uint32_t end = 0;
+	for (uint32_t i = 0; i < lab.num_entries; ++i) {
+		byName.insert(std::make_pair(std::string(lab.str_table + READ_LE_UINT32(&lab.entries[i].fname_offset)), i));
+		uint32_t entryEnd = READ_LE_UINT32(&lab.entries[i].start) + READ_LE_UINT32(&lab.entries[i].size);
+		if (entryEnd > end)
+			end = entryEnd;
+	}
 
-	countFiles(&head, dir, dirname, 0);
+	// Match the directory against the table. Changed entries get the path of
+	// their new contents, new files are added at the end of the table.
+	uint32_t oldEntries = lab.num_entries;
+	uint32_t changed = 0;
+	for (uint32_t f = 0; f < files.num_entries; ++f) {
+		const char *name = files.str_table + READ_LE_UINT32(&files.entries[f].fname_offset);
+		uint32_t size = READ_LE_UINT32(&files.entries[f].size);
+		std::map<std::string, uint32_t>::iterator it = byName.find(name);
+		if (it == byName.end()) {
+			addEntry(&lab, files.paths[f], name, size);
+			files.paths[f] = NULL;
+			++changed;
+			continue;
+		}
 
-// 	printf("%d files, string table of size %d\n", head.num_entries, head.string_table_size);
+		lab_entry &entry = lab.entries[it->second];
+		if (READ_LE_UINT32(&entry.size) == size) {
+			uint8 oldDigest[16], newDigest[16];
+			if (md5Range(infile, READ_LE_UINT32(&entry.start), size, oldDigest, buf, bufsize) &&
+			    Common::md5_file(files.paths[f], newDigest) && !memcmp(oldDigest, newDigest, 16))
+				continue;
+		}
+		WRITE_LE_UINT32(&entry.size, size);
+		lab.paths[it->second] = files.paths[f];
+		files.paths[f] = NULL;
+		++changed;
+	}
 
-	lab_entry *entries = (lab_entry *)malloc(head.num_entries * sizeof(lab_entry));
-	char *str_table = (char *)malloc(head.string_table_size);
-	if (!str_table || !entries) {
-		printf("Could not allocate memory\n");
-		exit(3);
+	if (end < dataStart(&lab))
+		end = dataStart(&lab);
+
+	// Payloads which the grown tables would overwrite are moved to the end.
+	// Entries of the same start share the payload of the largest of them:
+	// an empty entry starts where the payload after it does.
+	std::map<uint32_t, uint32_t> moved;
+	for (uint32_t i = 0; i < oldEntries; ++i) {
+		uint32_t start = READ_LE_UINT32(&lab.entries[i].start);
+		if (lab.paths[i] || start >= dataStart(&lab))
+			continue;
+		uint32_t &size = moved[start];
+		if (READ_LE_UINT32(&lab.entries[i].size) > size)
+			size = READ_LE_UINT32(&lab.entries[i].size);
+	}
+	for (std::map<uint32_t, uint32_t>::iterator it = moved.begin(); it != moved.end(); ++it) {
+		uint32_t size = it->second;
+		fseek(infile, it->first, SEEK_SET);
+		fseek(outfile, end, SEEK_SET);
+		if (!copyStream(outfile, infile, size, buf, bufsize)) {
+			printf("Could not move the payload at %u\n", it->first);
+			exit(2);
+		}
+		it->second = end;
+		end += size;
+	}
+	for (uint32_t i = 0; i < oldEntries; ++i) {
+		uint32_t start = READ_LE_UINT32(&lab.entries[i].start);
+		if (!lab.paths[i] && start < dataStart(&lab))
+			WRITE_LE_UINT32(&lab.entries[i].start, moved[start]);
 	}
 
-	rewinddir(dir);
-	uint32_t offset = 16 + head.num_entries * sizeof(lab_entry) + head.string_table_size + 16;
-	createEntries(dir, entries, str_table, dirname, offset);
+	for (uint32_t i = 0; i < lab.num_entries; ++i) {
+		if (!lab.paths[i])
+			continue;
+		uint32_t size = READ_LE_UINT32(&lab.entries[i].size);
+		fseek(outfile, end, SEEK_SET);
+		WRITE_LE_UINT32(&lab.entries[i].start, end);
+		if (!copyFile(outfile, lab.paths[i], size, buf, bufsize)) {
+			fclose(outfile);
+			exit(2);
+		}
+		end += size;
+	}
 
-	closedir(dir);
+	fclose(infile);
+	writeTables(outfile, g_type, &lab);
+	fclose(outfile);
+	printf("%u of %u files updated\n", changed, files.num_entries);
 
-	// Open the output file after we've finished with the dir, so that we're sure
-	// we don't include the lab into itself if it was asked to be created into the same dir.
-	FILE *outfile = fopen(out, "wb");
+	free(buf);
+	freeEntries(&files);
+	freeEntries(&lab);
+}
+
+// Rewrite a lab with its payloads packed right after the tables, dropping
+// the space left behind by updates.
+static void compactLab(const char *out) {
+	FILE *infile = fopen(out, "rb");
+	if (!infile) {
+		printf("Could not open file %s\n", out);
+		exit(2);
+	}
+	uint8_t g_type;
+	EntryList lab;
+	readLab(infile, out, g_type, &lab);
+
+	std::string tmpname = std::string(out) + ".tmp";
+	FILE *outfile = fopen(tmpname.c_str(), "wb");
 	if (!outfile) {
-		printf("Could not open file %s for writing\n", out);
+		printf("Could not open file %s for writing\n", tmpname.c_str());
 		exit(2);
 	}
 
-	fwrite("LABN", 1, 4, outfile);
-	fwrite("\x00\x00\x01\x00", 1, 4, outfile); //version
-	writeUint32(outfile, head.num_entries);
-	writeUint32(outfile, head.string_table_size);
+	const uint32_t bufsize = 1024*1024;
+	char *buf = (char *)malloc(bufsize);
+	if (!buf) {
+		printf("Could not allocate memory\n");
+		exit(3);
+	}
 
-	if (g_type == GT_GRIM) {
-		uint32_t s_offset = 0; // First entry of the table has offset 0 for Grim
-		fwrite(&s_offset, 1, 4, outfile);
-		fseek(outfile, -4, SEEK_CUR);
-	} else { // EMI has an offset instead.
-		writeUint32(outfile, 20 + head.num_entries * sizeof(lab_entry) + 0x13d0f);
+	// Keep the payloads in their current order, each written once. Entries
+	// of the same start share the payload of the largest of them: an empty
+	// entry starts where the payload after it does.
+	std::map<uint32_t, uint32_t> extent;
+	for (uint32_t i = 0; i < lab.num_entries; ++i) {
+		uint32_t &size = extent[READ_LE_UINT32(&lab.entries[i].start)];
+		if (READ_LE_UINT32(&lab.entries[i].size) > size)
+			size = READ_LE_UINT32(&lab.entries[i].size);
 	}
 
-	fwrite(entries, 1, head.num_entries * sizeof(lab_entry), outfile);
-	if (g_type == GT_GRIM) {
-		fwrite(str_table, 1, head.string_table_size, outfile);
-	} else {
-		char *s = (char *)malloc(head.string_table_size);
-		memset(s, 0, head.string_table_size);
-		for (uint32_t j = 0; j < head.string_table_size; j++) {
-			if (str_table[j] != 0)
-				s[j] = str_table[j] ^ 0x96;
+	std::map<uint32_t, uint32_t> newStart;
+	uint32_t offset = dataStart(&lab);
+	fseek(outfile, offset, SEEK_SET);
+	for (std::map<uint32_t, uint32_t>::iterator it = extent.begin(); it != extent.end(); ++it) {
+		fseek(infile, it->first, SEEK_SET);
+		if (!copyStream(outfile, infile, it->second, buf, bufsize)) {
+			printf("Could not read %s\n", out);
+			exit(2);
 		}
-		fwrite(s, 1, head.string_table_size, outfile);
-		free(s);
+		newStart[it->first] = offset;
+		offset += it->second;
 	}
+	fclose(infile);
 
-	uint32_t bufsize = 1024*1024;
-	char *buf = (char *)malloc(bufsize);
+	for (uint32_t i = 0; i < lab.num_entries; ++i)
+		WRITE_LE_UINT32(&lab.entries[i].start, newStart[READ_LE_UINT32(&lab.entries[i].start)]);
 
-	for (uint32_t i = 0; i < head.num_entries; ++i) {
-		lab_entry &entry = entries[i];
-		const char *fname = str_table + READ_LE_UINT32(&entry.fname_offset);
+	writeTables(outfile, g_type, &lab);
+	fclose(outfile);
+	free(buf);
+	freeEntries(&lab);
 
-		char *path = appendPath(fname, dirname);
+	remove(out);
+	if (rename(tmpname.c_str(), out) != 0) {
+		printf("Could not rename %s to %s\n", tmpname.c_str(), out);
+		exit(2);
+	}
+}
 
-		FILE *file = fopen(path, "rb");
-		free(path);
+static bool sameContents(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb");
+	FILE *fb = fopen(b, "rb");
+	bool same = fa && fb;
+	const size_t bufsize = 64 * 1024;
+	char *bufa = (char *)malloc(bufsize), *bufb = (char *)malloc(bufsize);
+	same = same && bufa && bufb;
+	while (same) {
+		size_t na = fread(bufa, 1, bufsize, fa);
+		size_t nb = fread(bufb, 1, bufsize, fb);
+		if (na != nb || memcmp(bufa, bufb, na) != 0)
+			same = false;
+		else if (na == 0)
+			break;
+	}
+	free(bufa);
+	free(bufb);
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return same;
+}
 
-		uint32_t offset = READ_LE_UINT32(&entry.start);
-		uint32_t size = READ_LE_UINT32(&entry.size);
+// For every entry find an entry laid out before it with identical contents,
+// or -1. Only files sharing their size with another file get hashed, with a
+// fast hash; files whose hashes match are compared before being shared.
+static int32_t *findDuplicates(const EntryList *list, const uint32_t *layout) {
+	int32_t *dupOf = (int32_t *)malloc(list->num_entries * sizeof(int32_t));
+	if (!dupOf) {
+		printf("Could not allocate memory\n");
+		exit(3);
+	}
 
-		if (size > bufsize) {
-			char *newbuf = (char *)realloc(buf, size);
-			if (!newbuf) {
-				free(buf);
-				printf("Could not allocate memory\n");
-				exit(3);
+	std::map<uint32_t, uint32_t> sizeCount;
+	for (uint32_t i = 0; i < list->num_entries; ++i)
+		++sizeCount[READ_LE_UINT32(&list->entries[i].size)];
+
+	std::map<std::string, uint32_t> payloads;
+	for (uint32_t n = 0; n < list->num_entries; ++n) {
+		uint32_t i = layout[n];
+		dupOf[i] = -1;
+		uint32_t size = READ_LE_UINT32(&list->entries[i].size);
+		if (sizeCount[size] < 2)
+			continue;
+
+		uint64 hash;
+		if (!Common::xxh64_file(list->paths[i], hash))
+			continue;
+		std::string key((const char *)&hash, sizeof(hash));
+		key.append((const char *)&size, sizeof(size));
+
+		std::map<std::string, uint32_t>::iterator it = payloads.find(key);
+		if (it == payloads.end())
+			payloads[key] = i;
+		else if (sameContents(list->paths[it->second], list->paths[i]))
+			dupOf[i] = it->second;
+	}
+	return dupOf;
+}
+
+// Order in which the payloads are written: the files named in the order
+// list come first, in the order given, the rest follow in directory order.
+static uint32_t *computeLayout(const EntryList *list, const char *orderFile) {
+	uint32_t *layout = (uint32_t *)malloc(list->num_entries * sizeof(uint32_t));
+	bool *placed = (bool *)calloc(list->num_entries, sizeof(bool));
+	if (!layout || !placed) {
+		printf("Could not allocate memory\n");
+		exit(3);
+	}
+	uint32_t n = 0;
+
+	if (orderFile) {
+		FILE *file = fopen(orderFile, "r");
+		if (!file) {
+			printf("Could not open order list %s\n", orderFile);
+			exit(2);
+		}
+		std::map<std::string, uint32_t> byName;
+		for (uint32_t i = 0; i < list->num_entries; ++i)
+			byName.insert(std::make_pair(std::string(list->str_table + READ_LE_UINT32(&list->entries[i].fname_offset)), i));
+
+		char line[1024];
+		while (fgets(line, sizeof(line), file)) {
+			line[strcspn(line, "\r\n")] = 0;
+			std::map<std::string, uint32_t>::iterator it = byName.find(line);
+			if (it == byName.end() || placed[it->second])
+				continue;
+			placed[it->second] = true;
+			layout[n++] = it->second;
+		}
+		fclose(file);
+	}
+
+	for (uint32_t i = 0; i < list->num_entries; ++i) {
+		if (!placed[i])
+			layout[n++] = i;
+	}
+	free(placed);
+	return layout;
+}
+
+int main(int argc, char **argv) {
+	uint8_t g_type = 0;
+	bool dedup = false;
+	uint32_t align = 1;
+	const char *orderFile = NULL;
+	bool update = false, compact = false;
+
+	Common::initStats("mklab", argc, argv);
+	int arg = 1;
+	for (; arg < argc && !strncmp(argv[arg], "--", 2); ++arg) {
+		if (!strcmp(argv[arg], "--help")) {
+			help();
+		} else if (!strcmp(argv[arg], "--grim")) {
+			g_type = GT_GRIM;
+		} else if (!strcmp(argv[arg], "--emi")) {
+			g_type = GT_EMI;
+		} else if (!strcmp(argv[arg], "--dedup")) {
+			dedup = true;
+		} else if (!strncmp(argv[arg], "--align=", 8)) {
+			char *end;
+			unsigned long value = strtoul(argv[arg] + 8, &end, 10);
+			if (end == argv[arg] + 8 || *end || value == 0 || value > MAX_ALIGN || (value & (value - 1))) {
+				printf("The alignment must be a power of two up to %d bytes\n", MAX_ALIGN);
+				exit(1);
 			}
-			bufsize = size;
-			buf = newbuf;
+			align = value;
+		} else if (!strncmp(argv[arg], "--order=", 8)) {
+			orderFile = argv[arg] + 8;
+		} else if (!strcmp(argv[arg], "--update")) {
+			update = true;
+		} else if (!strcmp(argv[arg], "--compact")) {
+			compact = true;
+		} else {
+			usage();
+			exit(1);
 		}
+	}
+
+	if (compact && argc - arg == 1) {
+		compactLab(argv[arg]);
+		return 0;
+	}
+	if (update && argc - arg == 2) {
+		updateLab(argv[arg], argv[arg + 1]);
+		return 0;
+	}
 
-// 		printf("writing file %s, at offset %d and of size %d\n", fname, offset, size);
+	if (g_type == 0 || argc - arg < 2) {
+		usage();
+		exit(1);
+	}
 
-		fread(buf, 1, size, file);
-		fseek(outfile, offset, SEEK_SET);
-		fwrite(buf, 1, size, outfile);
+	const char *dirname = argv[arg];
+	const char *out = argv[arg + 1];
 
-		fclose(file);
+	DIR *dir = opendir(dirname);
+	if (dir == 0) {
+		printf("Can not open source dir: %s\n", dirname);
+		exit(2);
 	}
 
-	fclose(outfile);
+	EntryList list;
+	memset(&list, 0, sizeof(list));
+	{
+		Common::StatsPhase phase(Common::kStatsIndex);
+		collectEntries(&list, dir, dirname);
+		closedir(dir);
+	}
+
+// 	printf("%d files, string table of size %d\n", list.num_entries, list.string_table_size);
+
+	// Open the output file after we've finished with the dir, so that we're sure
+	// we don't include the lab into itself if it was asked to be created into the same dir.
+	FILE *outfile = fopen(out, "wb");
+	if (!outfile) {
+		printf("Could not open file %s for writing\n", out);
+		exit(2);
+	}
+
+	uint32_t *layout = computeLayout(&list, orderFile);
+	int32_t *dupOf = dedup ? findDuplicates(&list, layout) : NULL;
+
+	// Stream the payloads first, the header and tables are written afterwards
+	uint32_t offset = dataStart(&list);
+	fseek(outfile, offset, SEEK_SET);
+
+	const uint32_t bufsize = 1024*1024;
+	char *buf = (char *)malloc(bufsize);
+	if (!buf) {
+		printf("Could not allocate memory\n");
+		exit(3);
+	}
+
+	for (uint32_t n = 0; n < list.num_entries; ++n) {
+		uint32_t i = layout[n];
+		lab_entry &entry = list.entries[i];
+		uint32_t size = READ_LE_UINT32(&entry.size);
+
+// 		printf("writing file %s, at offset %d and of size %d\n", list.paths[i], offset, size);
+
+		if (dupOf && dupOf[i] != -1) {
+			// Point at the payload already written for the identical file
+			entry.start = list.entries[dupOf[i]].start;
+			free(list.paths[i]);
+			continue;
+		}
+
+		if (offset % align) {
+			offset += align - offset % align;
+			fseek(outfile, offset, SEEK_SET);
+		}
+		WRITE_LE_UINT32(&entry.start, offset);
+		if (!copyFile(outfile, list.paths[i], size, buf, bufsize)) {
+			fclose(outfile);
+			exit(2);
+		}
+		offset += size;
+		free(list.paths[i]);
+	}
 	free(buf);
-	free(entries);
-	free(str_table);
+	free(dupOf);
+	free(layout);
+
+	writeTables(outfile, g_type, &list);
+	fclose(outfile);
+	free(list.paths);
+	free(list.entries);
+	free(list.str_table);
 
 	return 0;
 }
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Checks that mklab --compact and --update keep every payload of a lab
+# holding an empty entry, which shares its start with the file after it.
+# Run from the build directory, as make check does.
+
+bin=`pwd`
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+failed=0
+
+# Compare what unlab extracts from lab with the files in directory
+check() {
+	rm -rf "$tmp/out"
+	mkdir "$tmp/out"
+	(cd "$tmp/out" && "$bin/unlab" "$1" >/dev/null)
+	for f in "$2"/*; do
+		if ! cmp -s "$f" "$tmp/out/`basename "$f"`"; then
+			echo "mklabcheck: $3 lost the contents of `basename "$f"`" >&2
+			failed=1
+		fi
+	done
+}
+
+mkdir "$tmp/src"
+: >"$tmp/src/a_empty"
+printf hello >"$tmp/src/b_data"
+printf world! >"$tmp/src/c_data"
+"$bin/mklab" --grim "$tmp/src" "$tmp/t.lab" >/dev/null || exit 1
+check "$tmp/t.lab" "$tmp/src" "mklab"
+
+cp "$tmp/t.lab" "$tmp/c.lab"
+"$bin/mklab" --compact "$tmp/c.lab" >/dev/null || exit 1
+check "$tmp/c.lab" "$tmp/src" "mklab --compact"
+
+# Enough new names to grow the tables over the old payloads
+i=1
+while [ $i -le 20 ]; do
+	echo "file $i" >"$tmp/src/a_long_file_name_which_grows_the_tables_$i.txt"
+	i=`expr $i + 1`
+done
+"$bin/mklab" --update "$tmp/src" "$tmp/t.lab" >/dev/null || exit 1
+check "$tmp/t.lab" "$tmp/src" "mklab --update"
+
+exit $failed
@@ -13,55 +13,120 @@ MAKE := \
 	meshb2obj \
 	sklb2txt \
 	animb2txt \
+	emibatch \
+	emideps \
 	setb2set \
+	sectorquery \
 	set2fig \
 	til2bmp \
 	unlab \
 	mklab \
 	vima \
 	labcopy \
+	labfind \
+	luabench \
+	kernelbench \
+	codec3check \
 	luac \
 	patchex \
 	diffr \
 	patchr \
-	bm2bmp
+	bm2bmp \
+	mat2ppm
 
-# 	these below are not added because they depend on the ppm and bpm libraries
-#	mat2ppm
+# 	this below is not added because it depends on the ppm and bpm libraries,
+#	bm2bmp converts the same bitmaps
 #	bm2ppm
 
+ifdef USE_FUSE
+MAKE += labfs
+endif
+
 
 #
 # Build rules for the tools
 #
 
 TOOL := diffr
-TOOL_OBJS := diffr.o
+TOOL_OBJS := diffr.o lab.o suffixsort.o
 TOOL_LDFLAGS := -lcommon -lz
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
+ifdef USE_LZMA
+TOOL_LDFLAGS += -llzma
+endif
+ifdef USE_ZSTD
+TOOL_LDFLAGS += -lzstd
+endif
 include $(srcdir)/rules.mk
 
 TOOL := patchr
 TOOL_OBJS := patchr.o
 TOOL_LDFLAGS := -lcommon -lz
+ifdef USE_LZMA
+TOOL_LDFLAGS += -llzma
+endif
+ifdef USE_ZSTD
+TOOL_LDFLAGS += -lzstd
+endif
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := delua
-TOOL_OBJS := delua.o
+TOOL_OBJS := delua.o lab.o
+TOOL_LDFLAGS := -lcommon -Ltools/lua -llua
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
+include $(srcdir)/rules.mk
+
+TOOL := luabench
+TOOL_OBJS := luabench.o
 TOOL_LDFLAGS := -Ltools/lua -llua
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
+include $(srcdir)/rules.mk
+
+TOOL := kernelbench
+TOOL_OBJS := kernelbench.o lab.o codec3.o mcmp.o suffixsort.o patchex/mszipd.o luac/dump.o luac/opcode.o
+TOOL_DEPS := tools/lua
+TOOL_LDFLAGS := -lcommon -lz -Ltools/lua -llua
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
+ifdef USE_LZMA
+TOOL_LDFLAGS += -llzma
+endif
+ifdef USE_ZSTD
+TOOL_LDFLAGS += -lzstd
+endif
+include $(srcdir)/rules.mk
+
+TOOL := codec3check
+TOOL_OBJS := codec3check.o codec3.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := mat2ppm
-TOOL_OBJS := mat2ppm.o
-TOOL_LDFLAGS := -lppm -lpbm
+TOOL_OBJS := mat2ppm.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := bmtoppm
-TOOL_OBJS := bmtoppm.o
+TOOL_OBJS := bmtoppm.o codec3.o
 TOOL_LDFLAGS := -lppm -lpbm
 include $(srcdir)/rules.mk
 
 TOOL := imc2wav
 TOOL_OBJS := imc2wav.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := int2flt
@@ -69,56 +134,125 @@ TOOL_OBJS := int2flt.o
 include $(srcdir)/rules.mk
 
 TOOL := cosb2cos
-TOOL_OBJS := emi/cosb2cos.o
+TOOL_OBJS := emi/cosb2cos.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
+include $(srcdir)/rules.mk
+
+TOOL := emideps
+TOOL_OBJS := emi/emideps.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := meshb2obj
-TOOL_OBJS := emi/meshb2obj.o lab.o
+TOOL_OBJS := emi/meshb2obj.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
+include $(srcdir)/rules.mk
+
+TOOL := emibatch
+TOOL_OBJS := emi/emibatch.o lab.o
+TOOL_LDFLAGS := -lcommon
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := animb2txt
-TOOL_OBJS := emi/animb2txt.o lab.o
+TOOL_OBJS := emi/animb2txt.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := setb2set
-TOOL_OBJS := emi/setb2set.o lab.o
+TOOL_OBJS := emi/setb2set.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
+include $(srcdir)/rules.mk
+
+TOOL := sectorquery
+TOOL_OBJS := emi/sectorquery.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := sklb2txt
-TOOL_OBJS := emi/sklb2txt.o lab.o
+TOOL_OBJS := emi/sklb2txt.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := set2fig
-TOOL_OBJS := set2fig.o
+TOOL_OBJS := set2fig.o lab.o assetloader.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := til2bmp
-TOOL_OBJS := emi/til2bmp.o lab.o
-TOOL_LDFLAGS := -lz
+TOOL_OBJS := emi/til2bmp.o lab.o assetloader.o dds.o
+TOOL_LDFLAGS := -lcommon -lz
 include $(srcdir)/rules.mk
 
 TOOL := unlab
 TOOL_OBJS := unlab.o
+TOOL_LDFLAGS := -lcommon
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := mklab
 TOOL_OBJS := mklab.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
 TOOL := vima
-TOOL_OBJS := vima.o
+TOOL_OBJS := vima.o mcmp.o
+TOOL_LDFLAGS := -lcommon
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := labcopy
 TOOL_OBJS := labcopy.o
+TOOL_LDFLAGS := -lcommon
+include $(srcdir)/rules.mk
+
+TOOL := labfind
+TOOL_OBJS := labfind.o labset.o lab.o
+TOOL_LDFLAGS := -lcommon
 include $(srcdir)/rules.mk
 
+ifdef USE_FUSE
+TOOL := labfs
+TOOL_OBJS := labfs.o lab.o
+TOOL_LDFLAGS := -lcommon -lfuse
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
+include $(srcdir)/rules.mk
+endif
+
 TOOL := patchex
 TOOL_OBJS := patchex/patchex.o patchex/mszipd.o patchex/cabd.o
+TOOL_LDFLAGS := -lcommon
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
 TOOL := bm2bmp
-TOOL_OBJS := bm2bmp.o lab.o
+TOOL_OBJS := bm2bmp.o lab.o assetloader.o codec3.o rgb565.o dds.o
+TOOL_LDFLAGS := -lcommon -lz
+ifdef POSIX
+TOOL_LDFLAGS += -lpthread
+endif
 include $(srcdir)/rules.mk
 
-.PHONY: clean-tools tools
+# Times the kernels on BENCH_CORPUS, game files or directories of them, e.g.
+# make bench BENCH_CORPUS=~/grim BENCH_ARGS="-b bench.txt"
+bench: kernelbench
+	./kernelbench $(BENCH_ARGS) $(BENCH_CORPUS)
+
+# The decoders checked against the streams in them, the decoders'
+# own messages on the rejected ones are left out, and the lab rewrites of
+# mklab checked against unlab
+check: codec3check mklab unlab
+	./codec3check >/dev/null
+	sh $(srcdir)/tools/mklabcheck.sh
+
+.PHONY: clean-tools tools bench check
@@ -46,6 +46,13 @@
 #define MSZIP_DISTANCE_MAXSYMBOLS (32)
 #define MSZIP_DISTANCE_TABLEBITS  (6)
 
+/* fast decoding: a table indexed by the next MSZIP_FAST_BITS bits of input
+ * giving the one or two literals, or the length symbol, they start with */
+#define MSZIP_FAST_BITS           (11)
+#define MSZIP_FAST_TABLESIZE      (1 << MSZIP_FAST_BITS)
+#define MSZIP_FAST_INPUT          (8)
+#define MSZIP_FAST_OUTPUT         (258)
+
 #if (1 << MSZIP_LITERAL_TABLEBITS) < (MSZIP_LITERAL_MAXSYMBOLS * 2)
 # define MSZIP_LITERAL_TABLESIZE (MSZIP_LITERAL_MAXSYMBOLS * 4)
 #else
@@ -79,6 +86,10 @@ struct mszipd_stream {
   unsigned short LITERAL_table [MSZIP_LITERAL_TABLESIZE];
   unsigned short DISTANCE_table[MSZIP_DISTANCE_TABLESIZE];
 
+  /* bits 0-4: bits used, 5-6: literal count, 16-31: literals or symbol.
+   * 0 if the first symbol is longer than MSZIP_FAST_BITS. */
+  unsigned int   LITERAL_fast  [MSZIP_FAST_TABLESIZE];
+
   unsigned char window[MSZIP_FRAME_SIZE];
 };
 
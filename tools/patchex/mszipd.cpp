@@ -34,6 +34,8 @@
  * For further details, see the file COPYING.LIB distributed with libmspack
  */
 
+#include "common/scummsys.h"
+#include "common/endian.h"
 #include "tools/patchex/mszip.h"
 
 static const unsigned short lit_lengths[29] = {
@@ -191,6 +193,42 @@ static int make_decode_table(unsigned int nsyms, unsigned int nbits,
   return (pos != table_mask) ? 1 : 0;
 }
 
+/* symbol starting the known low avail bits of bits, as the symbol with its
+ * length in the upper half, or 0 if it has more bits than that */
+static unsigned int fast_lookup(struct mszipd_stream *zip, unsigned int bits,
+				unsigned int avail)
+{
+  unsigned short sym;
+
+  if (avail == 0) return 0;
+  sym = zip->LITERAL_table[bits & ((1 << MSZIP_LITERAL_TABLEBITS) - 1)];
+  if (sym >= MSZIP_LITERAL_MAXSYMBOLS || zip->LITERAL_len[sym] > avail)
+    return 0;
+  return sym | (zip->LITERAL_len[sym] << 16);
+}
+
+static void make_fast_table(struct mszipd_stream *zip) {
+  unsigned int idx, first, second, sym, len;
+
+  for (idx = 0; idx < MSZIP_FAST_TABLESIZE; idx++) {
+    if (!(first = fast_lookup(zip, idx, MSZIP_FAST_BITS))) {
+      zip->LITERAL_fast[idx] = 0;
+      continue;
+    }
+    sym = first & 0xFFFF; len = first >> 16;
+    if (sym >= 256) {
+      zip->LITERAL_fast[idx] = len | (sym << 16);
+      continue;
+    }
+    second = fast_lookup(zip, idx >> len, MSZIP_FAST_BITS - len);
+    if (second && (second & 0xFFFF) < 256)
+      zip->LITERAL_fast[idx] = (len + (second >> 16)) | (2 << 5) |
+	(sym << 16) | ((second & 0xFF) << 24);
+    else
+      zip->LITERAL_fast[idx] = len | (1 << 5) | (sym << 16);
+  }
+}
+
 #define READ_HUFFSYM(tbl, var) do {                                     \
   ENSURE_BITS(MSZIP_MAX_HUFFBITS);                                      \
   sym = zip->tbl##_table[PEEK_BITS(MSZIP_##tbl##_TABLEBITS)];		\
@@ -208,6 +246,118 @@ static int make_decode_table(unsigned int nsyms, unsigned int nbits,
   REMOVE_BITS(i);                                                       \
 } while (0)
 
+/* tree walk of READ_HUFFSYM, on bits that are known to be there */
+#define FAST_HUFFSYM(tbl, var) do {                                     \
+  sym = zip->tbl##_table[bit_buffer & ((1 << MSZIP_##tbl##_TABLEBITS) - 1)]; \
+  if (sym >= MSZIP_##tbl##_MAXSYMBOLS) {                                \
+    i = MSZIP_##tbl##_TABLEBITS - 1;					\
+    do {                                                                \
+      if (i++ > MSZIP_MAX_HUFFBITS) {					\
+        result = INF_ERR_HUFFSYM;                                       \
+        goto done;                                                      \
+      }                                                                 \
+      sym = zip->tbl##_table[(sym << 1) | ((bit_buffer >> i) & 1)];	\
+    } while (sym >= MSZIP_##tbl##_MAXSYMBOLS);                          \
+  }                                                                     \
+  (var) = sym;                                                          \
+  i = zip->tbl##_len[sym];                                              \
+  REMOVE_BITS(i);                                                       \
+} while (0)
+
+/* Decodes a Huffman block while at least MSZIP_FAST_INPUT bytes of input
+ * and MSZIP_FAST_OUTPUT bytes of window are left, so no symbol needs a check
+ * on either. The bit buffer is refilled to at least 56 bits at a time, which
+ * is enough for a whole length and distance pair. Returns 1 at the end of the
+ * block, 0 when the slow path must take over, or an error. */
+static int inflate_fast(struct mszipd_stream *zip) {
+  uint64 bit_buffer = zip->bit_buffer;
+  unsigned int bits_left = zip->bits_left;
+  unsigned char *i_ptr = zip->i_ptr, *i_start = zip->i_ptr, *i_end = zip->i_end;
+  unsigned char *window = &zip->window[0];
+  unsigned int window_posn = zip->window_posn;
+  unsigned int entry, length, distance, match_posn, code, n, i;
+  unsigned short sym;
+  int result = 0;
+
+  while ((i_end - i_ptr) >= MSZIP_FAST_INPUT &&
+	 window_posn <= MSZIP_FRAME_SIZE - MSZIP_FAST_OUTPUT)
+  {
+    n = (63 - bits_left) >> 3;
+    bit_buffer |= (((uint64)READ_LE_UINT32(i_ptr) |
+		    ((uint64)READ_LE_UINT32(i_ptr + 4) << 32)) &
+		   (((uint64)1 << (n << 3)) - 1)) << bits_left;
+    i_ptr += n; bits_left += n << 3;
+
+    entry = zip->LITERAL_fast[bit_buffer & (MSZIP_FAST_TABLESIZE - 1)];
+    if (entry & (3 << 5)) {
+      window[window_posn++] = (unsigned char)(entry >> 16);
+      if (entry & (2 << 5)) window[window_posn++] = (unsigned char)(entry >> 24);
+      REMOVE_BITS(entry & 0x1F);
+      continue;
+    }
+    if (entry) {
+      sym = (unsigned short)(entry >> 16);
+      REMOVE_BITS(entry & 0x1F);
+    }
+    else FAST_HUFFSYM(LITERAL, sym);
+
+    if (sym < 256) {
+      window[window_posn++] = (unsigned char) sym;
+      continue;
+    }
+    if (sym == 256) {
+      result = 1;
+      break;
+    }
+
+    code = sym - 257;
+    if (code > 29) { result = INF_ERR_LITCODE; break; }
+    length = lit_lengths[code] + (unsigned int)(bit_buffer & bit_mask[lit_extrabits[code]]);
+    REMOVE_BITS(lit_extrabits[code]);
+
+    FAST_HUFFSYM(DISTANCE, code);
+    if (code > 30) { result = INF_ERR_DISTCODE; break; }
+    distance = dist_offsets[code] + (unsigned int)(bit_buffer & bit_mask[dist_extrabits[code]]);
+    REMOVE_BITS(dist_extrabits[code]);
+
+    match_posn = ((distance > window_posn) ? MSZIP_FRAME_SIZE : 0)
+      + window_posn - distance;
+
+    /* eight bytes at a time when no word can overlap the bytes it reads,
+     * the rest of the match must not be written past */
+    if (distance >= 8 && (match_posn + length) <= MSZIP_FRAME_SIZE) {
+      unsigned char *runsrc = &window[match_posn], *rundest = &window[window_posn];
+      uint64 word;
+      window_posn += length;
+      for (; length >= 8; length -= 8) {
+	memcpy(&word, runsrc, 8);
+	memcpy(rundest, &word, 8);
+	runsrc += 8; rundest += 8;
+      }
+      while (length--) *rundest++ = *runsrc++;
+    }
+    else {
+      while (length--) {
+	window[window_posn++] = window[match_posn++];
+	match_posn &= MSZIP_FRAME_SIZE - 1;
+      }
+    }
+  }
+
+done:
+  /* hand back the whole bytes read ahead, as the bit buffer outside has
+   * only 32 bits */
+  n = bits_left >> 3;
+  if (n > (unsigned int)(i_ptr - i_start)) n = i_ptr - i_start;
+  i_ptr -= n; bits_left -= n << 3;
+
+  zip->i_ptr       = i_ptr;
+  zip->bit_buffer  = (unsigned int)(bit_buffer & (((uint64)1 << bits_left) - 1));
+  zip->bits_left   = bits_left;
+  zip->window_posn = window_posn;
+  return result;
+}
+
 static int zip_read_lens(struct mszipd_stream *zip) {
   register unsigned int bit_buffer;
   register int bits_left;
@@ -349,6 +499,7 @@ static int inflate(struct mszipd_stream *zip) {
       {
 	return INF_ERR_LITERALTBL;
       }
+      make_fast_table(zip);
 
       if (make_decode_table(MSZIP_DISTANCE_MAXSYMBOLS,MSZIP_DISTANCE_TABLEBITS,
 			    &zip->DISTANCE_len[0], &zip->DISTANCE_table[0]))
@@ -358,6 +509,19 @@ static int inflate(struct mszipd_stream *zip) {
 
       window_posn = zip->window_posn;
       while (1) {
+	if ((i_end - i_ptr) >= MSZIP_FAST_INPUT &&
+	    window_posn <= MSZIP_FRAME_SIZE - MSZIP_FAST_OUTPUT)
+	{
+	  int fast;
+	  STORE_BITS;
+	  zip->window_posn = window_posn;
+	  fast = inflate_fast(zip);
+	  if (fast < 0) return fast;
+	  RESTORE_BITS;
+	  window_posn = zip->window_posn;
+	  if (fast) break;
+	}
+
 	READ_HUFFSYM(LITERAL, code);
 	if (code < 256) {
 	  zip->window[window_posn++] = (unsigned char) code;
@@ -39,9 +39,16 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <map>
+#include <string>
+#ifdef POSIX
+#include <pthread.h>
+#endif
 
 #include "tools/patchex/mspack.h"
 #include "common/endian.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 // Languages codes
 #define LANG_ALL "@@"
@@ -54,40 +61,127 @@ const char *kLanguages_code[] = { "US", "FR", "GE", "IT", "PT", "SP",  NULL };
 #define CODE_TABLE_SIZE		(0x100)
 
 #define BUFFER_SIZE 		102400
+#define READ_BUFFER_SIZE	(64 * 1024)
 int lang = -1;
 struct mscab_decompressor *cabd = NULL;
 struct mscabd_cabinet *cab = NULL;
 
+// Decryption keys of a cabinet, every byte is XORed with one and then has
+// the other subtracted. Both are stored twice over, so the keys for any run
+// of up to CODE_TABLE_SIZE bytes are contiguous whatever its start.
+struct code_table {
+	uint8 xorKey[2 * CODE_TABLE_SIZE];
+	uint8 subKey[2 * CODE_TABLE_SIZE];
+};
+
 struct mspack_file_p {
 	FILE *fh;
 	const char *name;
-	uint16 *CodeTable;
+	code_table *CodeTable;
 	off_t cabinet_offset;
+	// Read buffer, holding bufLen decoded bytes from file offset bufStart
+	uint8 *buf;
+	off_t bufStart;
+	size_t bufLen;
+	off_t pos;		// File offset of the next read
 };
 
-uint16 *create_dec_table(uint32 key) {
+code_table *create_dec_table(uint32 key) {
 	uint32 value;
-	uint16 *dectable;
+	code_table *dectable;
 	unsigned int i;
 
 	value = key;
-	dectable = (uint16 *)malloc(CODE_TABLE_SIZE * 2);
+	dectable = (code_table *)malloc(sizeof(code_table));
 
 	for (i = 0; i < CODE_TABLE_SIZE; i++) {
 		value = RAND_A * value + RAND_B;
-		dectable[i] = (uint16)((value >> 16) & 0x7FFF);
+		uint16 code = (uint16)((value >> 16) & 0x7FFF);
+		dectable->xorKey[i] = dectable->xorKey[i + CODE_TABLE_SIZE] = (uint8)code;
+		dectable->subKey[i] = dectable->subKey[i + CODE_TABLE_SIZE] = (uint8)(code >> 8);
 	}
 
 	return dectable;
 }
 
+// Where the encrypted cabinet of a file starts and its key, found once per
+// file as the decompressor opens the same executable many times
+struct cabinet_info {
+	bool found;
+	off_t offset;
+	uint32 key;
+};
+static std::map<std::string, cabinet_info> cabinet_cache;
+
+void decode(uint8 *data, unsigned int size, const code_table *dectable, unsigned int start_point);
+
+/**
+ * Looks for the '1CNT' content signature followed by a key and a cabinet
+ * that decrypts to 'MSCF', reading the file in large blocks. Blocks overlap
+ * by the length of a match less one so none is split.
+ */
+static cabinet_info find_cabinet(FILE *fh) {
+	const size_t matchLen = 12;
+	const size_t blockSize = 1024 * 1024;
+	cabinet_info info;
+	info.found = false;
+	info.offset = 0;
+	info.key = 0;
+
+	uint8 *block = (uint8 *)malloc(blockSize);
+	if (!block)
+		return info;
+
+	off_t blockStart = 0;
+	size_t kept = 0;
+	for (;;) {
+		if (fseek(fh, (long)(blockStart + kept), SEEK_SET))
+			break;
+		size_t len = kept + fread(block + kept, 1, blockSize - kept, fh);
+		if (len < matchLen)
+			break;
+
+		const uint8 *p = block, *end = block + len - matchLen + 1;
+		while ((p = (const uint8 *)memchr(p, '1', end - p)) != NULL) {
+			if (READ_BE_UINT32(p) == MKTAG('1','C','N','T')) {
+				uint32 key = READ_LE_UINT32(p + 4);
+				code_table *table = create_dec_table(key);
+				uint8 magic[4];
+				memcpy(magic, p + 8, 4);
+				decode(magic, 4, table, 0);
+				free(table);
+				if (READ_BE_UINT32(magic) == MKTAG('M','S','C','F')) {
+					info.found = true;
+					info.offset = blockStart + (p - block) + 8;
+					info.key = key;
+					free(block);
+					return info;
+				}
+			}
+			p++;
+		}
+
+		if (len < blockSize)
+			break;
+		kept = matchLen - 1;
+		memmove(block, block + len - kept, kept);
+		blockStart += len - kept;
+	}
+	free(block);
+	return info;
+}
+
+// Switching keys makes whatever was buffered under the old ones stale
+static void set_code_table(struct mspack_file_p *fh, code_table *table) {
+	if (fh->CodeTable)
+		free(fh->CodeTable);
+	fh->CodeTable = table;
+	fh->bufLen = 0;
+}
+
 static struct mspack_file *res_open(struct mspack_system *handle, const char *filename, int mode) {
 	struct mspack_file_p *fh;
 	const char *fmode;
-	char magic[4];
-	uint32 key;
-	uint8 count;
-	
 	switch (mode) {
 		case MSPACK_SYS_OPEN_READ:   fmode = "rb";  break;
 		case MSPACK_SYS_OPEN_WRITE:  fmode = "wb";  break;
@@ -105,30 +199,29 @@ static struct mspack_file *res_open(struct mspack_system *handle, const char *fi
 	}
 	
 	fh->CodeTable = NULL;
+	fh->cabinet_offset = 0;
+	fh->buf = NULL;
+	fh->bufStart = 0;
+	fh->bufLen = 0;
+	fh->pos = 0;
 	
 	if (mode != MSPACK_SYS_OPEN_READ)
 		return (struct mspack_file *)fh;
 
-	//Search for data
-	while(!feof(fh->fh)) {
-		//Check for content signature
-		count = handle->read((struct mspack_file *) fh, magic, 4);
-		if (count == 4 && READ_BE_UINT32(magic) == MKTAG('1','C','N','T')) {
-			handle->read((struct mspack_file *)fh, &key, 4);
-			key = READ_LE_UINT32(&key);
-			fh->CodeTable = create_dec_table(key);
-			fh->cabinet_offset = ftell(fh->fh);
-
-			//Check for cabinet signature
-			count = handle->read((struct mspack_file *) fh, magic, 4);
-			if (count == 4 && READ_BE_UINT32(magic) == MKTAG('M','S','C','F')) {
-				break;
-			} else {
-				free(fh->CodeTable);
-				fh->CodeTable = NULL;
-				continue;
-			}
-		}
+	// Only files being read are buffered
+	if (!(fh->buf = (uint8 *)malloc(READ_BUFFER_SIZE))) {
+		fclose(fh->fh);
+		free(fh);
+		return NULL;
+	}
+
+	//Search for data, unless this file has been searched already
+	std::map<std::string, cabinet_info>::iterator it = cabinet_cache.find(filename);
+	if (it == cabinet_cache.end())
+		it = cabinet_cache.insert(std::make_pair(std::string(filename), find_cabinet(fh->fh))).first;
+	if (it->second.found) {
+		set_code_table(fh, create_dec_table(it->second.key));
+		fh->cabinet_offset = it->second.offset;
 	}
 
 	handle->seek((struct mspack_file *)fh, (off_t) 0, MSPACK_SYS_SEEK_START);
@@ -142,6 +235,7 @@ static void res_close(struct mspack_file *file) {
 	if (handle) {
 		if (handle->CodeTable)
 			free(handle->CodeTable);
+		free(handle->buf);
 		fclose(handle->fh);
 		free(handle);
 	}
@@ -161,7 +255,20 @@ static int res_seek(struct mspack_file *file, off_t offset, int mode) {
 		case MSPACK_SYS_SEEK_END:   mode = SEEK_END; break;
 		default: return -1;
 		}
-		return fseek(handle->fh, (int)offset, mode);
+		if (!handle->buf)
+			return fseek(handle->fh, (int)offset, mode);
+
+		// Reads go through the buffer, only the position is tracked here
+		if (mode == SEEK_SET)
+			handle->pos = offset;
+		else if (mode == SEEK_CUR)
+			handle->pos += offset;
+		else {
+			if (fseek(handle->fh, (int)offset, SEEK_END))
+				return -1;
+			handle->pos = ftell(handle->fh);
+		}
+		return 0;
 	}
 	return -1;
 }
@@ -170,7 +277,7 @@ static off_t res_tell(struct mspack_file *file) {
 	struct mspack_file_p *handle = (struct mspack_file_p *)file;
 
 	if (handle) {
-		off_t offset = ftell(handle->fh);
+		off_t offset = handle->buf ? handle->pos : ftell(handle->fh);
 		if (handle->CodeTable)
 			offset -= handle->cabinet_offset;
 		return offset;
@@ -178,26 +285,73 @@ static off_t res_tell(struct mspack_file *file) {
 		return 0;
 }
 
-void decode(uint8 *data, unsigned int size, uint16 *dectable, unsigned int start_point) {
-	unsigned int i;
-	for (i = 0; i < size; i++)
-		data[i] = (data[i] ^ (uint8) dectable[(i + start_point) % CODE_TABLE_SIZE]) - (uint8)(dectable[(i + start_point) % CODE_TABLE_SIZE] >> 8);
+void decode(uint8 *data, unsigned int size, const code_table *dectable, unsigned int start_point) {
+	// Whole periods of the keys at a time, from where the data starts in
+	// them. The loop has no modulo or table lookup left to keep it from
+	// being vectorized.
+	const uint8 *xorKey = dectable->xorKey + start_point % CODE_TABLE_SIZE;
+	const uint8 *subKey = dectable->subKey + start_point % CODE_TABLE_SIZE;
+	while (size > 0) {
+		unsigned int run = size < CODE_TABLE_SIZE ? size : CODE_TABLE_SIZE;
+		for (unsigned int i = 0; i < run; i++)
+			data[i] = (data[i] ^ xorKey[i]) - subKey[i];
+		data += run;
+		size -= run;
+	}
+}
+
+// Reads and decodes size bytes from the current position of the handle
+static int read_at(struct mspack_file_p *handle, uint8 *dest, size_t size) {
+	if (fseek(handle->fh, (long)handle->pos, SEEK_SET))
+		return -1;
+	size_t count = fread(dest, 1, size, handle->fh);
+	if (ferror(handle->fh))
+		return -1;
+	Common::addStatsRead(count);
+	if (handle->CodeTable)
+		decode(dest, count, handle->CodeTable, (unsigned int)(handle->pos - handle->cabinet_offset));
+	return (int)count;
 }
 
 static int res_read(struct mspack_file *file, void *buffer, int bytes) {
 	struct mspack_file_p *handle = (struct mspack_file_p *)file;
 
-	if (handle) {
-		unsigned int start_point = (unsigned int)res_tell(file);
-		size_t count = fread(buffer, 1, (size_t) bytes, handle->fh);
+	if (!handle || !handle->buf || bytes < 0)
+		return -1;
+
+	uint8 *dest = (uint8 *)buffer;
+	int copied = 0;
+	while (copied < bytes) {
+		size_t wanted = (size_t)(bytes - copied);
+		if (handle->pos >= handle->bufStart && handle->pos < handle->bufStart + (off_t)handle->bufLen) {
+			size_t offset = (size_t)(handle->pos - handle->bufStart);
+			size_t count = handle->bufLen - offset < wanted ? handle->bufLen - offset : wanted;
+			memcpy(dest + copied, handle->buf + offset, count);
+			handle->pos += count;
+			copied += count;
+			continue;
+		}
 
-		if (!ferror(handle->fh)) {
-			if (handle->CodeTable)
-				decode((uint8*)buffer, count, handle->CodeTable, start_point);
-			return (int) count;
+		// Large reads skip the buffer
+		int count;
+		if (wanted >= READ_BUFFER_SIZE) {
+			if ((count = read_at(handle, dest + copied, wanted)) < 0)
+				return -1;
+			handle->pos += count;
+			copied += count;
+			if ((size_t)count < wanted)
+				break;
+			continue;
 		}
+
+		if ((count = read_at(handle, handle->buf, READ_BUFFER_SIZE)) < 0)
+			return -1;
+		handle->bufStart = handle->pos;
+		handle->bufLen = count;
+		if (count == 0)
+			break;
 	}
-	return -1;
+	return copied;
 }
 
 static int res_write(struct mspack_file *file, void *buffer, int bytes) {
@@ -207,6 +361,7 @@ static int res_write(struct mspack_file *file, void *buffer, int bytes) {
 		if (handle->CodeTable)
 			return -1;
 		size_t count = fwrite(buffer, 1, (size_t)bytes, handle->fh);
+		Common::addStatsWritten(count);
 		if (!ferror(handle->fh)) return (int) count;
 	}
 	return -1;
@@ -302,12 +457,14 @@ void extract_files(struct mscab_decompressor *cabd, struct mscabd_cabinet *cab)
 
 	for (file = cab->files; file; file = file->next) {
 		if ((filename = file_filter(file))) {
+			Common::StatsPhase phase(Common::kStatsDecode);
 			if (cabd->extract(cabd, file, filename) != MSPACK_ERR_OK) {
 				printf("Extract error on %s!\n", file->filename);
 				free(filename);
 				continue;
 			}
 			printf("%s extracted as %s\n", file->filename, filename);
+			Common::addStatsFiles();
 			++files_extracted;
 			free(filename);
 		}
@@ -316,6 +473,145 @@ void extract_files(struct mscab_decompressor *cabd, struct mscabd_cabinet *cab)
 	printf("%d file(s) extracted.\n", files_extracted);
 }
 
+#ifdef POSIX
+// A file of the cabinet, in the order of cab->files
+struct extract_job {
+	char *filename;		// Name to extract as, NULL if filtered out
+	int folder;			// Index of the folder holding the file
+	int result;
+};
+
+// Folders are handed out one at a time to the threads, which each have
+// their own decompressor and cabinet so no decompression state is shared
+struct extract_pool {
+	struct extract_job *jobs;
+	int numFolders;
+	int nextFolder;
+	pthread_mutex_t lock;
+};
+
+struct extract_worker {
+	struct extract_pool *pool;
+	struct mscab_decompressor *cabd;
+	struct mscabd_cabinet *cab;
+};
+
+static int folder_index(const struct mscabd_cabinet *c, const struct mscabd_folder *folder) {
+	int index = 0;
+	for (const struct mscabd_folder *f = c->folders; f; f = f->next, index++)
+		if (f == folder)
+			return index;
+	return -1;
+}
+
+static void *extract_folders(void *arg) {
+	struct extract_worker *worker = (struct extract_worker *)arg;
+	struct extract_pool *pool = worker->pool;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		int folder = pool->nextFolder++;
+		pthread_mutex_unlock(&pool->lock);
+		if (folder >= pool->numFolders)
+			break;
+
+		// Files of a folder in order, so its stream is decompressed once
+		Common::StatsPhase phase(Common::kStatsDecode);
+		unsigned int i = 0;
+		for (struct mscabd_file *file = worker->cab->files; file; file = file->next, i++) {
+			struct extract_job *job = &pool->jobs[i];
+			if (job->folder == folder && job->filename)
+				job->result = worker->cabd->extract(worker->cabd, file, job->filename);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Extracts the files of the cabinet in cab_name with up to num_threads
+ * folders being decompressed at once. Messages are printed afterwards in
+ * the same order as extract_files does.
+ */
+void extract_files_parallel(char *cab_name, int num_threads) {
+	unsigned int num_files = 0, files_extracted = 0, i;
+	int num_folders = 0;
+	struct mscabd_file *file;
+
+	for (file = cab->files; file; file = file->next)
+		num_files++;
+	for (struct mscabd_folder *f = cab->folders; f; f = f->next)
+		num_folders++;
+	if (num_threads > num_folders)
+		num_threads = num_folders;
+
+	// Filtering can exit, so it is all done before any thread starts
+	struct extract_pool pool;
+	pool.jobs = (struct extract_job *)malloc(num_files * sizeof(struct extract_job));
+	pool.numFolders = num_folders;
+	pool.nextFolder = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (file = cab->files, i = 0; file; file = file->next, i++) {
+		pool.jobs[i].filename = file_filter(file);
+		pool.jobs[i].folder = folder_index(cab, file->folder);
+		pool.jobs[i].result = MSPACK_ERR_OK;
+	}
+
+	struct extract_worker *workers = (struct extract_worker *)malloc(num_threads * sizeof(struct extract_worker));
+	pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	int started = 0;
+	for (int t = 0; t < num_threads; t++) {
+		workers[t].pool = &pool;
+		workers[t].cab = NULL;
+		if ((workers[t].cabd = mspack_create_cab_decompressor(&res_system)) == NULL)
+			break;
+		workers[t].cab = workers[t].cabd->open(workers[t].cabd, cab_name);
+		if (workers[t].cabd->last_error(workers[t].cabd) != MSPACK_ERR_OK ||
+				pthread_create(&threads[t], NULL, extract_folders, &workers[t])) {
+			if (workers[t].cab)
+				workers[t].cabd->close(workers[t].cabd, workers[t].cab);
+			mspack_destroy_cab_decompressor(workers[t].cabd);
+			break;
+		}
+		started++;
+	}
+
+	// Without any thread the work is done here, otherwise the started ones
+	// share every folder between them
+	if (started == 0) {
+		struct extract_worker self;
+		self.pool = &pool;
+		self.cabd = cabd;
+		self.cab = cab;
+		extract_folders(&self);
+	}
+
+	for (int t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+		workers[t].cabd->close(workers[t].cabd, workers[t].cab);
+		mspack_destroy_cab_decompressor(workers[t].cabd);
+	}
+	free(threads);
+	free(workers);
+	pthread_mutex_destroy(&pool.lock);
+
+	for (file = cab->files, i = 0; file; file = file->next, i++) {
+		if (!pool.jobs[i].filename)
+			continue;
+		if (pool.jobs[i].result != MSPACK_ERR_OK) {
+			printf("Extract error on %s!\n", file->filename);
+		} else {
+			printf("%s extracted as %s\n", file->filename, pool.jobs[i].filename);
+			Common::addStatsFiles();
+			++files_extracted;
+		}
+		free(pool.jobs[i].filename);
+	}
+	free(pool.jobs);
+
+	printf("%d file(s) extracted.\n", files_extracted);
+}
+#endif
+
 void cleanup() {
 	if (cabd) {
 		if (cab)
@@ -328,10 +624,24 @@ int main(int argc, char *argv[]) {
 	int i;
 	unsigned int length;
 	bool wholeCabinet = false;
+	int threads = 1;
+
+	Common::initStats("patchex", argc, argv);
+	// Thread count, shifting the other arguments down
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		threads = atoi(argv[2]);
+		if (threads < 1) {
+			printf("Invalid number of threads: %s\n", argv[2]);
+			exit(1);
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
 
 	// Argument checks and usage display
 	if (argc < 2) {
-		printf("Usage: patchex PATCH_EXECUTABLE [LANGUAGE]\n\n");
+		printf("Usage: patchex [-j THREADS] PATCH_EXECUTABLE [LANGUAGE]\n\n");
 		printf("Extract update files of game update from PATCH_EXECUTABLE\n");
 		printf("-For GrimFandango (gfupd101.exe) you must specify a language,\n");
 		printf("-For Monkey Island (MonkeyUpdate[_LANG].exe) this parameter is ignored,\n");
@@ -340,6 +650,7 @@ int main(int argc, char *argv[]) {
 		for (i = 0; kLanguages_code[i]; i++)
 			printf("- %s\n", kLanguages_ext[i]);
 		printf("Alternately original archive could be extracted as original.cab with CABINET keyword instead of language.\n");
+		printf("-j THREADS extracts that many of the cabinet's folders at once.\n");
 		exit(1);
 	}
 
@@ -378,8 +689,15 @@ int main(int argc, char *argv[]) {
 		cabd->close(cabd, cab);
 		cab = NULL;
 		extract_cabinet(argv[1], length);
-	} else
+	} else {
+#ifdef POSIX
+		if (threads > 1) {
+			extract_files_parallel(argv[1], threads);
+			return 0;
+		}
+#endif
 		extract_files(cabd, cab);
+	}
 
 	return 0;
 }
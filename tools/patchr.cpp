@@ -49,27 +49,213 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <cstdlib>
 #include "common/endian.h"
 #include "common/zlib.h"
+#include "common/compress.h"
 #include "common/md5.h"
+#include "common/xxhash.h"
+#include "common/xor.h"
 #include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+#ifdef POSIX
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+// Patch flags and the codec fields of version x.1 patches, see diffr
+enum {
+	FLAG_MIX = 1 << 0,
+	FLAG_COMP_CTRL = 1 << 1,
+	FLAG_FINGERPRINT = 1 << 2,
+	CODEC_SHIFT_CTRL = 8,
+	CODEC_SHIFT_DIFF = 12,
+	CODEC_SHIFT_EXTRA = 16
+};
+
+// Record types of PATL lab patches, see diffr
+enum {
+	LAB_LITERAL = 0,
+	LAB_COPY = 1,
+	LAB_PATCH = 2
+};
+
+// Codec of the stream whose ID is at shift in the flags of header
+static int streamCodec(const uint8 *header, int shift) {
+	if (READ_LE_UINT16(header + 6) == 0)
+		return CODEC_GZIP;
+	return (READ_LE_UINT32(header + 8) >> shift) & 0xf;
+}
 
-uint8 *old_block, *new_block;
-GZipReadStream *ctrlDec, *diffDec, *extraDec;
+/**
+ * Opens a compressed stream of the patch, complaining if its codec is not
+ * one of those this build supports.
+ */
+static DecompressStream *openStream(const uint8 *header, int shift, const uint8 *data, uint32 size) {
+	int codec = streamCodec(header, shift);
+	DecompressStream *stream = openDecompressStream(codec, data, size);
+	if (!stream) {
+		const char *name = codecName(codec);
+		std::cerr << "Patch uses " << (name ? name : "unknown") << " compression, which is not supported by this build\n";
+	}
+	return stream;
+}
 
-void free_memory() {
-	if (old_block)
-		delete[] old_block;
-	if (new_block)
-		delete[] new_block;
+#ifdef POSIX
+/**
+ * Inflates a stream on a thread of its own into a ring buffer, so the
+ * diff and extra streams are decompressed while the main thread applies
+ * the control tuples. Reads take the data from the ring, waiting for the
+ * thread when it is empty. Once started, the wrapped stream is deleted
+ * with this one.
+ */
+class PipelinedStream : public DecompressStream {
+	enum {
+		RING_SIZE = 4 * 1024 * 1024,
+		CHUNK_SIZE = 256 * 1024	// Most inflated by the thread between wakeups
+	};
 
-	if (ctrlDec)
-		delete ctrlDec;
-	if (diffDec)
-		delete diffDec;
-	if (extraDec && extraDec != diffDec)
-		delete extraDec;
+	DecompressStream *_stream;
+	uint8 *_ring;
+	// Total bytes inflated into the ring and read out of it, the ring holds
+	// the difference
+	uint64 _written, _read;
+	bool _done;	// The thread has reached the end of the stream
+	bool _failed;	// and the stream reported an error there
+	bool _stop;	// The reader is gone, the thread has to finish
+	bool _eos;
+	bool _started;
+	pthread_t _thread;
+	pthread_mutex_t _lock;
+	pthread_cond_t _filled, _drained;
+
+	static void *run(void *arg) {
+		((PipelinedStream *)arg)->produce();
+		return NULL;
+	}
+
+	void produce() {
+		pthread_mutex_lock(&_lock);
+		for (;;) {
+			while (!_stop && _written - _read == RING_SIZE)
+				pthread_cond_wait(&_drained, &_lock);
+			if (_stop)
+				break;
+			// Only the thread moves _written, so the free part stays free
+			// while the lock is released for inflating
+			uint32 offset = (uint32)(_written % RING_SIZE);
+			uint32 space = MIN((uint32)(RING_SIZE - (_written - _read)), (uint32)RING_SIZE - offset);
+			pthread_mutex_unlock(&_lock);
+			uint32 count = _stream->read(_ring + offset, MIN(space, (uint32)CHUNK_SIZE));
+			bool end = count < MIN(space, (uint32)CHUNK_SIZE) || _stream->err();
+			bool failed = _stream->err();
+			pthread_mutex_lock(&_lock);
+			_written += count;
+			if (end) {
+				_done = true;
+				_failed = failed;
+			}
+			pthread_cond_signal(&_filled);
+			if (end)
+				break;
+		}
+		pthread_mutex_unlock(&_lock);
+	}
+
+public:
+	PipelinedStream(DecompressStream *stream) : _stream(stream), _written(0), _read(0),
+			_done(false), _failed(false), _stop(false), _eos(false), _started(false) {
+		_ring = new uint8[RING_SIZE];
+		pthread_mutex_init(&_lock, NULL);
+		pthread_cond_init(&_filled, NULL);
+		pthread_cond_init(&_drained, NULL);
+	}
+
+	~PipelinedStream() {
+		if (_started) {
+			pthread_mutex_lock(&_lock);
+			_stop = true;
+			pthread_cond_signal(&_drained);
+			pthread_mutex_unlock(&_lock);
+			pthread_join(_thread, NULL);
+			delete _stream;
+		}
+		pthread_cond_destroy(&_drained);
+		pthread_cond_destroy(&_filled);
+		pthread_mutex_destroy(&_lock);
+		delete[] _ring;
+	}
+
+	/** Starts the thread, on failure the wrapped stream is left as it was */
+	bool start() {
+		_started = pthread_create(&_thread, NULL, run, this) == 0;
+		return _started;
+	}
+
+	// An error only shows once the data before it has been read, as it
+	// would reading the stream directly
+	bool err() const {
+		pthread_mutex_lock(const_cast<pthread_mutex_t *>(&_lock));
+		bool failed = _failed && _read == _written;
+		pthread_mutex_unlock(const_cast<pthread_mutex_t *>(&_lock));
+		return failed;
+	}
+	bool eos() const { return _eos; }
+
+	uint32 read(void *dataPtr, uint32 dataSize) {
+		uint8 *dest = (uint8 *)dataPtr;
+		uint32 total = 0;
+		pthread_mutex_lock(&_lock);
+		while (total < dataSize) {
+			while (_written == _read && !_done)
+				pthread_cond_wait(&_filled, &_lock);
+			if (_written == _read) {
+				_eos = true;
+				break;
+			}
+			uint32 offset = (uint32)(_read % RING_SIZE);
+			uint32 count = MIN(MIN((uint32)(_written - _read), (uint32)RING_SIZE - offset), dataSize - total);
+			// The thread doesn't touch the filled part, copy it unlocked
+			pthread_mutex_unlock(&_lock);
+			memcpy(dest + total, _ring + offset, count);
+			pthread_mutex_lock(&_lock);
+			_read += count;
+			total += count;
+			pthread_cond_signal(&_drained);
+		}
+		pthread_mutex_unlock(&_lock);
+		return total;
+	}
+};
+#endif
+
+/**
+ * Moves the inflating of stream to a thread of its own when pipelined is
+ * set and this build can, returning the stream to read from instead.
+ */
+static DecompressStream *pipelineStream(DecompressStream *stream, bool pipelined) {
+#ifdef POSIX
+	if (pipelined) {
+		PipelinedStream *piped = new PipelinedStream(stream);
+		if (piped->start())
+			return piped;
+		// Without the thread the stream is still good to read directly
+		delete piped;
+	}
+#endif
+	return stream;
+}
+
+static uint64 readLE64(const uint8 *buf) {
+	return (uint64)READ_LE_UINT32(buf) | ((uint64)READ_LE_UINT32(buf + 4) << 32);
 }
 
 void show_header_info(uint8 *header) {
@@ -80,16 +266,33 @@ void show_header_info(uint8 *header) {
 	printf("\n");
 
 	uint32 flags = READ_LE_UINT32(header + 8);
-	printf("MIX_DIFF_EXTRA %s\n", (flags & 1 << 0) ? "YES" : "NO");
-	printf("COMPRESS_CTRL %s\n", (flags & 1 << 1) ? "YES" : "NO");
+	printf("MIX_DIFF_EXTRA %s\n", (flags & FLAG_MIX) ? "YES" : "NO");
+	printf("COMPRESS_CTRL %s\n", (flags & FLAG_COMP_CTRL) ? "YES" : "NO");
+	printf("FINGERPRINT %s\n", (flags & FLAG_FINGERPRINT) ? "YES" : "NO");
+	if (READ_LE_UINT16(header + 6) > 0) {
+		const char *name = codecName(streamCodec(header, CODEC_SHIFT_DIFF));
+		printf("CODEC %s\n", name ? name : "UNKNOWN");
+	}
 	printf("\n");
 
+	bool lab = READ_BE_UINT32(header) == MKTAG('P','A','T','L');
+	if (!lab && READ_LE_UINT16(header + 4) == 3) {
+		// The sizes of windowed patches are 64-bit
+		std::cout << "OLD FILE SIZE " << readLE64(header + 28) << "\n";
+		std::cout << "NEW FILE SIZE " << readLE64(header + 36) << "\n\n";
+		std::cout << "WINDOWS " << READ_LE_UINT32(header + 44) << "\n\n";
+		return;
+	}
 	printf("OLD FILE SIZE %d\n", READ_LE_UINT32(header + 28));
 	printf("NEW FILE SIZE %d\n", READ_LE_UINT32(header + 32));
 	printf("\n");
-	printf("CTRL STREAM SIZE %d\n", READ_LE_UINT32(header + 36));
-	printf("DIFF STREAM SIZE %d\n", READ_LE_UINT32(header + 40));
-	printf("EXTRA STREAM SIZE %d\n", READ_LE_UINT32(header + 44));
+	if (lab) {
+		printf("RECORDS %d\n", READ_LE_UINT32(header + 36));
+	} else {
+		printf("CTRL STREAM SIZE %d\n", READ_LE_UINT32(header + 36));
+		printf("DIFF STREAM SIZE %d\n", READ_LE_UINT32(header + 40));
+		printf("EXTRA STREAM SIZE %d\n", READ_LE_UINT32(header + 44));
+	}
 	printf("\n");
 }
 
@@ -98,22 +301,29 @@ typedef struct {
 	char *newfile;
 	char *patchfile;
 	bool show_info;
+	bool pipelined;
 } arguments;
 
 void show_usage(char *name) {
-	printf("usage: %s [-a] oldfile newfile patchfile\n", name);
+	printf("usage: %s [-a] [-s] oldfile newfile patchfile\n", name);
+	printf("\t-a\tShow the patch header and what each control tuple does\n");
+	printf("\t-s\tInflate the diff and extra streams on the main thread\n");
 }
 
 arguments parse_args(int argc, char *argv[]) {
 	arguments arg;
 	arg.show_info = false;
+	arg.pipelined = true;
 
 	int c;
-	while ((c = getopt (argc, argv, "a")) != -1)
+	while ((c = getopt (argc, argv, "as")) != -1)
 		switch (c) {
 		case 'a':
 			arg.show_info = true;
 			break;
+		case 's':
+			arg.pipelined = false;
+			break;
 		case '?':
 			show_usage(argv[0]);
 			exit(0);
@@ -134,78 +344,241 @@ arguments parse_args(int argc, char *argv[]) {
 	return arg;
 }
 
-int main(int argc,char * argv[]) {
-	uint32 oldsize, newsize;
-	uint32 zctrllen, zdatalen, zextralen;
-	uint8 header[48], buf[4];
-	uint32 oldpos, newpos;
-	uint32 ctrl[3];
-	uint32 lenread;
-	uint32 flags;
-	uint8 md5[16];
-	std::ifstream oldfile, patch, ctrlStream, diffStream, extraStream;
-	std::ofstream newfile;
-	bool comp_ctrl, mix;
-	arguments args;
+static bool corrupt() {
+	std::cerr << "Corrupt patch\n";
+	return false;
+}
 
-	old_block = 0;
-	new_block = 0;
-	atexit(free_memory);
+/**
+ * The whole patch file, mapped where possible. The sub-streams of a patch
+ * are read as ranges of it, so a patch is opened once and reading control
+ * words costs no system calls.
+ */
+class PatchFile {
+	const uint8 *_data;
+	uint64 _size;
+	bool _mapped;
+public:
+	PatchFile() : _data(0), _size(0), _mapped(false) {}
+	~PatchFile();
+
+	bool open(const char *filename);
+	const uint8 *data() const { return _data; }
+	uint64 size() const { return _size; }
+	/** True if size bytes from offset are in the file */
+	bool contains(uint64 offset, uint64 size) const { return offset <= _size && size <= _size - offset; }
+};
+
+PatchFile::~PatchFile() {
+#ifdef POSIX
+	if (_mapped) {
+		munmap((void *)const_cast<uint8 *>(_data), _size);
+		return;
+	}
+#endif
+	delete[] _data;
+}
 
-	args = parse_args(argc, argv);
+bool PatchFile::open(const char *filename) {
+	Common::StatsPhase phase(Common::kStatsOpen);
+#ifdef POSIX
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			_data = (const uint8 *)map;
+			_size = st.st_size;
+			_mapped = true;
+			close(fd);
+			Common::addStatsRead(_size);
+			return true;
+		}
+	}
+	close(fd);
+#endif
+	// Without mmap the patch is read into memory in one go
+	std::ifstream in(filename, std::ios::in | std::ios::binary);
+	if (in.fail())
+		return false;
+	in.seekg(0, std::ios::end);
+	_size = (std::streamoff)in.tellg();
+	in.seekg(0, std::ios::beg);
+	if ((size_t)_size != _size)
+		return false;
+	uint8 *data = new uint8[_size + 1];
+	in.read((char *)data, _size);
+	_data = data;
+	Common::addStatsRead(_size);
+	return !in.fail();
+}
 
-	/* Opens the old file */
-	oldfile.open(args.oldfile, std::ios::in | std::ios::binary);
-	if (oldfile.fail()) {
-		std::cerr << "Unable to open" << args.oldfile << std::endl;
-		return 1;
+// Data is streamed through buffers of this size, whatever the file sizes
+#define PIECE_SIZE (1024 * 1024)
+
+/**
+ * On demand reads of a range of the old file. Positions follow the uint32
+ * arithmetic of the control jumps, bytes outside of the range read as 0 so
+ * XORing them leaves the diff bytes as they are.
+ */
+class OldReader {
+	std::ifstream *_file;
+	uint64 _base;
+	uint32 _size;
+public:
+	OldReader(std::ifstream *file, uint64 base, uint32 size) : _file(file), _base(base), _size(size) {}
+
+	uint32 size() const { return _size; }
+
+	bool read(uint32 pos, uint8 *dest, uint32 len) {
+		while (len > 0) {
+			uint32 count;
+			if (pos < _size) {
+				count = MIN(len, _size - pos);
+				_file->clear();
+				_file->seekg((std::streamoff)_base + pos, std::ios::beg);
+				_file->read((char *)dest, count);
+				if (_file->fail()) {
+					std::cerr << "Input error\n";
+					return false;
+				}
+				Common::addStatsRead(count);
+			} else {
+				// Up to where pos wraps around to 0
+				count = (uint32)MIN((uint64)len, ((uint64)1 << 32) - pos);
+				memset(dest, 0, count);
+			}
+			dest += count;
+			pos += count;
+			len -= count;
+		}
+		return true;
 	}
 
-	//Get the file size
-	oldfile.seekg(0, std::ios::end);
-	oldsize = oldfile.tellg();
+	/**
+	 * XORs len bytes of the old file from pos into dest, going through
+	 * scratch. Only the part inside the old file is read; the rest would
+	 * XOR with zeros and is left alone.
+	 */
+	bool xorInto(uint32 pos, uint8 *dest, uint32 len, uint8 *scratch) {
+		while (len > 0) {
+			uint32 count;
+			if (pos < _size) {
+				count = MIN(len, _size - pos);
+				if (!read(pos, scratch, count))
+					return false;
+				Common::xorBuffer(dest, scratch, count);
+			} else {
+				count = (uint32)MIN((uint64)len, ((uint64)1 << 32) - pos);
+			}
+			dest += count;
+			pos += count;
+			len -= count;
+		}
+		return true;
+	}
+};
 
-	/* Open patch file */
-	patch.open(args.patchfile, std::ios::in | std::ios::binary);
-	ctrlStream.open(args.patchfile, std::ios::in | std::ios::binary);
-	diffStream.open(args.patchfile, std::ios::in | std::ios::binary);
-	extraStream.open(args.patchfile, std::ios::in | std::ios::binary);
+static bool writeOutput(std::ofstream &newfile, const uint8 *data, uint32 size) {
+	Common::StatsPhase phase(Common::kStatsWrite);
+	newfile.write((const char *)data, size);
+	if (newfile.bad()) {
+		std::cerr << "Output error.\n";
+		return false;
+	}
+	Common::addStatsWritten(size);
+	return true;
+}
 
-	if (patch.fail() || ctrlStream.fail() || diffStream.fail() || extraStream.fail()) {
-		std::cerr << "Unable to open " << args.patchfile << std::endl;
-		return 1;
+// Prints the XOR and COPY runs of a diff string fed in pieces
+class DiffInfo {
+	int _state;	// 0 nothing pending, 1 in an XOR line, 2 counting a COPY
+	uint _count;
+public:
+	DiffInfo() : _state(0), _count(0) {}
+
+	void feed(const uint8 *data, uint32 size) {
+		for (uint32 i = 0; i < size; i++) {
+			if (data[i] != 0) {
+				if (_state == 2)
+					printf("COPY %d\n", _count);
+				if (_state != 1)
+					printf("XOR");
+				printf(" %02x", data[i]);
+				_state = 1;
+			} else {
+				if (_state == 1)
+					printf("\n");
+				if (_state != 2)
+					_count = 0;
+				_count++;
+				_state = 2;
+			}
+		}
 	}
 
-	/* Read header */
-	patch.read((char*)header, 48);
-	if (patch.eof() || patch.bad() || patch.fail()) {
-		std::cerr << "Corrupt patch\n";
-		return 1;
+	void end() {
+		if (_state == 1)
+			printf("\n");
+		else if (_state == 2)
+			printf("COPY %d\n", _count);
+		_state = 0;
 	}
+};
+
+static bool md5Matches(OldReader &old, const uint8 *expected, uint8 *buf) {
+	// Same as Common::md5_file(name, digest, 5000) on the old range
+	uint8 md5[16];
+	uint32 size = MIN(old.size(), (uint32)5000);
+	if (!old.read(0, buf, size))
+		return false;
+	Common::md5_context ctx;
+	Common::md5_starts(&ctx);
+	Common::md5_update(&ctx, buf, size);
+	Common::md5_finish(&ctx, md5);
+	return memcmp(md5, expected, 16) == 0;
+}
+
+/**
+ * Checks the PATR header at the start of header, read from offset base of
+ * the patch file, and applies the patch to old, writing the new data to
+ * newfile as it goes. piece and oldPiece are PIECE_SIZE scratch buffers.
+ * When pipelined, the diff and extra streams are inflated on threads of
+ * their own.
+ */
+static bool applyPatr(const PatchFile &patch, uint64 base, OldReader &old, std::ofstream &newfile,
+                      uint8 *piece, uint8 *oldPiece, bool show_info, bool pipelined) {
+	Common::StatsPhase phase(Common::kStatsDecode);
+	const uint8 *header = patch.data() + base;
+	uint32 newsize;
+	uint32 zctrllen, zdatalen, zextralen;
+	uint8 buf[12];
+	uint32 oldpos, newpos;
+	uint32 ctrl[3];
+	uint32 lenread;
+	uint32 flags;
+	bool comp_ctrl, mix;
+	bool ok = false;
+
+	if (!patch.contains(base, 48))
+		return corrupt();
 
 	/* Check for appropriate signature */
-	if (READ_BE_UINT32(header) != MKTAG('P','A','T','R')) {
-		std::cerr << "Corrupt patch\n";
-		return 1;
-	}
+	if (READ_BE_UINT32(header) != MKTAG('P','A','T','R'))
+		return corrupt();
 
 	/* Check the version */
-	if (READ_LE_UINT16(header + 4) != 2 || READ_LE_UINT16(header + 6) > 0) {
+	if (READ_LE_UINT16(header + 4) != 2 || READ_LE_UINT16(header + 6) > 1) {
 		std::cerr << "Wrong version number\n";
-		return 1;
+		return false;
 	}
 
 	//Set flags
 	flags = READ_LE_UINT32(header + 8);
-	mix = (flags & 1 << 0) ? true : false;
-	comp_ctrl = (flags & 1 << 1) ? true : false;
-
-	/* Check if the file to patch match */
-	Common::md5_file(args.oldfile, md5, 5000);
-	if (memcmp(md5, header + 12, 16) != 0 || oldsize != READ_LE_UINT32(header + 28)) {
-		std::cerr << args.patchfile << " targets a different file\n";
-		return 1;
-	}
+	mix = (flags & FLAG_MIX) ? true : false;
+	comp_ctrl = (flags & FLAG_COMP_CTRL) ? true : false;
 
 	/* Read lengths from header */
 	newsize = READ_LE_UINT32(header + 32);
@@ -213,120 +586,116 @@ int main(int argc,char * argv[]) {
 	zdatalen = READ_LE_UINT32(header + 40);
 	zextralen = READ_LE_UINT32(header + 44);
 
-	patch.close();
-	if (args.show_info)
-		show_header_info(header);
+	if (show_info)
+		show_header_info(const_cast<uint8 *>(header));
+
+	// The three sub-streams are consecutive ranges of the patch
+	const uint8 *ctrlData = header + 48;
+	if (!patch.contains(base + 48, zctrllen) || !patch.contains(base + 48 + zctrllen, zdatalen) ||
+	        !patch.contains(base + 48 + zctrllen + zdatalen, mix ? 0 : zextralen) ||
+	        (comp_ctrl && zctrllen < 2) || zdatalen < 2 || (!mix && zextralen < 2))
+		return corrupt();
+
+	// Uncompressed control words are read in place
+	uint32 ctrlPos = 0;
+
+	DiffInfo info;
 
 	// Open the compressed sub-streams
 	//Check if the ctrl is compressed
-	ctrlStream.seekg(48, std::ios::beg);
-	if (comp_ctrl)
-		ctrlDec = new GZipReadStream(&ctrlStream, 48, zctrllen);
+	DecompressStream *ctrlDec = NULL, *diffDec = NULL, *extraDec = NULL;
+	if (comp_ctrl && !(ctrlDec = openStream(header, CODEC_SHIFT_CTRL, ctrlData, zctrllen)))
+		goto done;
 
-	diffDec = new GZipReadStream(&diffStream, 48 + zctrllen, zdatalen);
+	if (!(diffDec = openStream(header, CODEC_SHIFT_DIFF, ctrlData + zctrllen, zdatalen)))
+		goto done;
+	diffDec = pipelineStream(diffDec, pipelined);
 	if (mix)
 		extraDec = diffDec;
+	else if (!(extraDec = openStream(header, CODEC_SHIFT_EXTRA, ctrlData + zctrllen + zdatalen, zextralen)))
+		goto done;
 	else
-		extraDec = new GZipReadStream(&extraStream, 48 + zctrllen + zdatalen, zextralen);
-
-	old_block = new uint8[oldsize];
-	new_block = new byte[newsize];
-	if (old_block == NULL || new_block == NULL) {
-		std::cerr << "Not enough memory\n";
-		return 1;
-	}
-	
-	//Read the oldfile
-	oldfile.seekg(0, std::ios::beg);
-	oldfile.read((char*)old_block, oldsize);
-	oldfile.close();
-	if (oldfile.bad() || oldfile.fail()) {
-		std::cerr << "Input error\n";
-		return 1;
-	}
+		extraDec = pipelineStream(extraDec, pipelined);
 
 	oldpos=0;
 	newpos=0;
 	while(newpos < newsize) {
 		/* Read control data */
-		for (uint i = 0; i < 3; i++) {
-			if (comp_ctrl)
-				lenread = ctrlDec->read(buf, 4);
-			else {
-				ctrlStream.read((char*)buf, 4);
-				lenread = ctrlStream.gcount();
-			}
-			if (lenread < 4) {
-				std::cerr << "Corrupt patch\n";
-				return 1;
-			}
-			ctrl[i] = READ_LE_UINT32(buf);
-		};
-
-		/* Sanity-check */
-		if (newpos + ctrl[0] > newsize) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
+		const uint8 *words = buf;
+		if (comp_ctrl) {
+			lenread = ctrlDec->read(buf, 12);
+		} else {
+			lenread = MIN(zctrllen - ctrlPos, (uint32)12);
+			words = ctrlData + ctrlPos;
+			ctrlPos += lenread;
+		}
+		if (lenread < 12) {
+			corrupt();
+			goto done;
 		}
+		for (uint i = 0; i < 3; i++)
+			ctrl[i] = READ_LE_UINT32(words + 4 * i);
 
-		/* Read diff string */
-		lenread = diffDec->read(new_block + newpos, ctrl[0]);
-		if ((lenread < ctrl[0]) || diffDec->err()) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
+		/* Sanity-check */
+		if (ctrl[0] > newsize - newpos) {
+			corrupt();
+			goto done;
 		}
 
-		//Show info
-		if (args.show_info && ctrl[0] > 0) {
-			uint i = 0;
-			while (i < ctrl[0]) {
-				if (*(new_block + newpos + i) != 0) {
-					printf("XOR");
-					do {
-						printf(" %02x", *(new_block + newpos + i));
-						++i;
-					} while (i < ctrl[0] && *(new_block + newpos + i) != 0);
-					printf("\n");
-				} else {
-					uint pos = i;
-					while (i < ctrl[0] && *(new_block + newpos + i) == 0)
-						++i;
-					printf("COPY %d\n", i - pos);
-				}
+		/* Read the diff string and add old data to it, a piece at a time */
+		for (uint32 copied = 0; copied < ctrl[0]; ) {
+			uint32 count = MIN(ctrl[0] - copied, (uint32)PIECE_SIZE);
+			lenread = diffDec->read(piece, count);
+			if ((lenread < count) || diffDec->err()) {
+				corrupt();
+				goto done;
 			}
-		}
+			if (show_info)
+				info.feed(piece, count);
+
+			if (!old.xorInto(oldpos + copied, piece, count, oldPiece))
+				goto done;
 
-		/* Add old data to diff string */
-		for (uint i = 0; i < ctrl[0]; i++)
-			if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-				new_block[newpos + i] ^= old_block[oldpos + i];
+			if (!writeOutput(newfile, piece, count))
+				goto done;
+			copied += count;
+		}
+		if (show_info)
+			info.end();
 
 		/* Adjust pointers */
 		newpos += ctrl[0];
 		oldpos += ctrl[0];
 
 		/* Sanity-check */
-		if (newpos + ctrl[1] > newsize) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
+		if (ctrl[1] > newsize - newpos) {
+			corrupt();
+			goto done;
 		}
 
 		/* Read extra string */
-		lenread = extraDec->read(new_block + newpos, ctrl[1]);
-		if ((lenread < ctrl[1]) || extraDec->err()) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
+		if (show_info && ctrl[1] > 0)
+			printf("INSERT");
+		for (uint32 copied = 0; copied < ctrl[1]; ) {
+			uint32 count = MIN(ctrl[1] - copied, (uint32)PIECE_SIZE);
+			lenread = extraDec->read(piece, count);
+			if ((lenread < count) || extraDec->err()) {
+				corrupt();
+				goto done;
+			}
+			if (show_info)
+				for (uint i = 0; i < count; i++)
+					printf(" %02x", piece[i]);
+
+			if (!writeOutput(newfile, piece, count))
+				goto done;
+			copied += count;
 		}
 
 		//Show info
-		if (args.show_info) {
-			if (ctrl[1] > 0) {
-				printf("INSERT");
-				for (uint i = 0; i < ctrl[1]; i++)
-					printf(" %02x", *(new_block + newpos + i));
+		if (show_info) {
+			if (ctrl[1] > 0)
 				printf("\n");
-			}
-
 			if (ctrl[2] != 0)
 				printf("JUMP %d\n", ctrl[2]);
 		}
@@ -335,22 +704,295 @@ int main(int argc,char * argv[]) {
 		newpos += ctrl[1];
 		oldpos += int32(ctrl[2]);
 	};
+	ok = true;
+	Common::addStatsFiles();
+
+done:
+	delete ctrlDec;
+	delete diffDec;
+	if (extraDec != diffDec)
+		delete extraDec;
+	return ok;
+}
+
+/**
+ * Rebuilds a lab from a PATL patch record by record, streaming each record
+ * through the piece buffers like a PATR patch.
+ */
+static bool applyPatl(const arguments &args, std::ifstream &oldfile, const PatchFile &patch,
+                      std::ofstream &newfile, uint8 *piece, uint8 *oldPiece) {
+	const uint8 *header = patch.data();
+	uint32 oldsize = READ_LE_UINT32(header + 28);
+	uint32 newsize = READ_LE_UINT32(header + 32);
+	uint32 numRecords = READ_LE_UINT32(header + 36);
+	uint32 pos = 48, written = 0;
+
+	if (READ_LE_UINT16(header + 4) != 1 || READ_LE_UINT16(header + 6) > 1) {
+		std::cerr << "Wrong version number\n";
+		return false;
+	}
+	if (args.show_info)
+		show_header_info(const_cast<uint8 *>(header));
+
+	for (uint32 r = 0; r < numRecords; r++) {
+		if (!patch.contains(pos, 16))
+			return corrupt();
+		const uint8 *rec = patch.data() + pos;
+		uint32 type = READ_LE_UINT32(rec);
+		uint32 size = READ_LE_UINT32(rec + 4);
+		uint32 oldOffset = READ_LE_UINT32(rec + 8);
+		uint32 dataSize = READ_LE_UINT32(rec + 12);
+		if (size > newsize - written || !patch.contains(pos + 16, dataSize))
+			return corrupt();
+
+		if (type == LAB_LITERAL) {
+			if (args.show_info)
+				printf("LITERAL %d\n", size);
+			if (dataSize < 2)
+				return corrupt();
+			DecompressStream *literal = openStream(header, CODEC_SHIFT_DIFF, rec + 16, dataSize);
+			if (!literal)
+				return false;
+			for (uint32 copied = 0; copied < size; ) {
+				uint32 count = MIN(size - copied, (uint32)PIECE_SIZE);
+				if (literal->read(piece, count) != count || literal->err()) {
+					delete literal;
+					return corrupt();
+				}
+				if (!writeOutput(newfile, piece, count)) {
+					delete literal;
+					return false;
+				}
+				copied += count;
+			}
+			delete literal;
+		} else if (type == LAB_COPY) {
+			if (args.show_info)
+				printf("COPY %d FROM %d\n", size, oldOffset);
+			if (oldOffset > oldsize || size > oldsize - oldOffset)
+				return corrupt();
+			OldReader old(&oldfile, oldOffset, size);
+			for (uint32 copied = 0; copied < size; ) {
+				uint32 count = MIN(size - copied, (uint32)PIECE_SIZE);
+				if (!old.read(copied, piece, count) || !writeOutput(newfile, piece, count))
+					return false;
+				copied += count;
+			}
+		} else if (type == LAB_PATCH) {
+			const uint8 *sub = rec + 16;
+			if (dataSize < 48)
+				return corrupt();
+			uint32 subOld = READ_LE_UINT32(sub + 28);
+			if (READ_LE_UINT32(sub + 32) != size || oldOffset > oldsize || subOld > oldsize - oldOffset)
+				return corrupt();
+			if (args.show_info)
+				printf("PATCH %d FROM %d\n", size, oldOffset);
+
+			OldReader old(&oldfile, oldOffset, subOld);
+			if (!md5Matches(old, sub + 12, oldPiece)) {
+				std::cerr << args.patchfile << " targets a different file\n";
+				return false;
+			}
+			if (!applyPatr(patch, pos + 16, old, newfile, piece, oldPiece, args.show_info, args.pipelined))
+				return false;
+		} else {
+			return corrupt();
+		}
+
+		written += size;
+		pos += 16 + dataSize;
+	}
+
+	if (written != newsize)
+		return corrupt();
+	return true;
+}
+
+/**
+ * Rebuilds a file from a PATR v3 patch, applying the v2 patch of each
+ * window to its range of the old file in turn.
+ */
+static bool applyWindows(const arguments &args, std::ifstream &oldfile, const PatchFile &patch,
+                         std::ofstream &newfile, uint8 *piece, uint8 *oldPiece) {
+	const uint8 *header = patch.data();
+	uint64 oldsize = readLE64(header + 28);
+	uint64 newsize = readLE64(header + 36);
+	uint32 numWindows = READ_LE_UINT32(header + 44);
+	uint64 pos = 48, written = 0;
+
+	if (READ_LE_UINT16(header + 6) > 1) {
+		std::cerr << "Wrong version number\n";
+		return false;
+	}
+	if (args.show_info)
+		show_header_info(const_cast<uint8 *>(header));
+
+	for (uint32 w = 0; w < numWindows; w++) {
+		if (!patch.contains(pos, 24))
+			return corrupt();
+		const uint8 *win = patch.data() + pos;
+		uint64 oldOffset = readLE64(win);
+		uint32 oldSize = READ_LE_UINT32(win + 8);
+		uint32 size = READ_LE_UINT32(win + 12);
+		uint64 dataSize = readLE64(win + 16);
+		if (size > newsize - written || oldOffset > oldsize || oldSize > oldsize - oldOffset ||
+		        !patch.contains(pos + 24, dataSize) || dataSize < 48)
+			return corrupt();
+		const uint8 *sub = win + 24;
+		if (READ_LE_UINT32(sub + 28) != oldSize || READ_LE_UINT32(sub + 32) != size)
+			return corrupt();
+		if (args.show_info)
+			std::cout << "WINDOW " << size << " FROM " << oldOffset << std::endl;
+
+		OldReader old(&oldfile, oldOffset, oldSize);
+		if (!md5Matches(old, sub + 12, oldPiece)) {
+			std::cerr << args.patchfile << " targets a different file\n";
+			return false;
+		}
+		if (!applyPatr(patch, pos + 24, old, newfile, piece, oldPiece, args.show_info, args.pipelined))
+			return false;
+
+		written += size;
+		pos += 24 + dataSize;
+	}
+
+	if (written != newsize)
+		return corrupt();
+	return true;
+}
+
+/**
+ * Checks the fingerprint of the whole old file stored by diffr -f. It
+ * follows the streams of a PATR v2 patch and the records of a PATL or
+ * the windows of a PATR v3 patch, which are the end of the file.
+ */
+static bool fingerprintMatches(const char *oldname, const PatchFile &patch, bool atEnd) {
+	const uint8 *header = patch.data();
+	uint64 offset;
+	if (atEnd) {
+		offset = patch.size() - 8;
+	} else {
+		offset = 48 + READ_LE_UINT32(header + 36) + READ_LE_UINT32(header + 40);
+		if (!(READ_LE_UINT32(header + 8) & FLAG_MIX))
+			offset += READ_LE_UINT32(header + 44);
+	}
+	if (patch.size() < 56 || !patch.contains(offset, 8))
+		return false;
+
+	uint64 expected = readLE64(patch.data() + offset);
+	uint64 fingerprint;
+	return Common::xxh64_file(oldname, fingerprint) && fingerprint == expected;
+}
+
+// Patching a file in place has to go through a temporary file, as the
+// old data is read while the new data is written
+static bool sameFile(const char *a, const char *b) {
+#ifdef POSIX
+	struct stat sa, sb;
+	if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+		return false;
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#else
+	return strcmp(a, b) == 0;
+#endif
+}
+
+int main(int argc,char * argv[]) {
+	uint64 oldsize;
+	uint8 md5[16];
+	std::ifstream oldfile;
+	std::ofstream newfile;
+	PatchFile patch;
+	arguments args;
 
-	/* Clean up the bzip2 reads */
-	ctrlStream.close();
-	diffStream.close();
-	extraStream.close();
+	Common::initStats("patchr", argc, argv);
+	args = parse_args(argc, argv);
 
-	/* Write the new file */
-	newfile.open(args.newfile, std::ios::out | std::ios::binary);
+	/* Opens the old file */
+	oldfile.open(args.oldfile, std::ios::in | std::ios::binary);
+	if (oldfile.fail()) {
+		std::cerr << "Unable to open" << args.oldfile << std::endl;
+		return 1;
+	}
+
+	//Get the file size
+	oldfile.seekg(0, std::ios::end);
+	oldsize = (std::streamoff)oldfile.tellg();
+
+	/* Open patch file */
+	if (!patch.open(args.patchfile)) {
+		std::cerr << "Unable to open " << args.patchfile << std::endl;
+		return 1;
+	}
+
+	/* Read header */
+	if (!patch.contains(0, 48)) {
+		std::cerr << "Corrupt patch\n";
+		return 1;
+	}
+	const uint8 *header = patch.data();
+
+	/* Check for appropriate signature */
+	bool lab = READ_BE_UINT32(header) == MKTAG('P','A','T','L');
+	if (!lab && READ_BE_UINT32(header) != MKTAG('P','A','T','R')) {
+		std::cerr << "Corrupt patch\n";
+		return 1;
+	}
+
+	// Version 3 patches are diffed in windows and have 64-bit sizes
+	bool windowed = !lab && READ_LE_UINT16(header + 4) == 3;
+	if (!windowed && oldsize > 0xffffffff) {
+		std::cerr << args.patchfile << " targets a different file\n";
+		return 1;
+	}
+
+	/* Check if the file to patch match */
+	Common::md5_file(args.oldfile, md5, 5000);
+	if (memcmp(md5, header + 12, 16) != 0 || oldsize != (windowed ? readLE64(header + 28) : READ_LE_UINT32(header + 28))) {
+		std::cerr << args.patchfile << " targets a different file\n";
+		return 1;
+	}
+	if ((READ_LE_UINT32(header + 8) & FLAG_FINGERPRINT) && !fingerprintMatches(args.oldfile, patch, lab || windowed)) {
+		std::cerr << args.patchfile << " targets a different file\n";
+		return 1;
+	}
+
+	/* Write the new file as the patch is applied */
+	std::string outname = args.newfile;
+	if (sameFile(args.oldfile, args.newfile))
+		outname += ".tmp";
+	newfile.open(outname.c_str(), std::ios::out | std::ios::binary);
 	if (newfile.fail()) {
-		std::cerr << "Unable to open" << args.newfile << std::endl;
+		std::cerr << "Unable to open" << outname << std::endl;
 		return 1;
 	}
 
-	newfile.write((char*)new_block, newsize);
-	if (patch.bad()) {
+	uint8 *piece = new uint8[PIECE_SIZE];
+	uint8 *oldPiece = new uint8[PIECE_SIZE];
+	bool ok;
+	if (lab) {
+		ok = applyPatl(args, oldfile, patch, newfile, piece, oldPiece);
+	} else if (windowed) {
+		ok = applyWindows(args, oldfile, patch, newfile, piece, oldPiece);
+	} else {
+		OldReader old(&oldfile, 0, (uint32)oldsize);
+		ok = applyPatr(patch, 0, old, newfile, piece, oldPiece, args.show_info, args.pipelined);
+	}
+	delete[] piece;
+	delete[] oldPiece;
+
+	newfile.close();
+	oldfile.close();
+	if (ok && newfile.fail()) {
 		std::cerr << "Output error.\n";
+		ok = false;
+	}
+	if (!ok) {
+		remove(outname.c_str());
+		return 1;
+	}
+	if (outname != args.newfile && rename(outname.c_str(), args.newfile) != 0) {
+		std::cerr << "Unable to rename " << outname << " to " << args.newfile << std::endl;
 		return 1;
 	}
 
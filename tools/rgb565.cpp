@@ -0,0 +1,81 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include "rgb565.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif (defined(__ARM_NEON__) || defined(__ARM_NEON)) && defined(SCUMM_LITTLE_ENDIAN)
+#define USE_RGB565_NEON
+#include <arm_neon.h>
+#endif
+
+static inline void convertPixel(const uint8 *src, uint8 *dst) {
+	uint16 pixel = src[0] | (src[1] << 8);
+	int r = pixel >> 11;
+	int g = (pixel >> 5) & 0x3f;
+	int b = pixel & 0x1f;
+	dst[0] = (b << 3) | (b >> 2);
+	dst[1] = (g << 2) | (g >> 4);
+	dst[2] = (r << 3) | (r >> 2);
+	dst[3] = 0xff;
+}
+
+void convertRGB565ToBGRA(const uint8 *src, uint8 *dst, uint32 count) {
+	uint32 i = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask5 = _mm_set1_epi16(0x1f);
+	const __m128i mask6 = _mm_set1_epi16(0x3f);
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	for (; i + 8 <= count; i += 8, src += 16, dst += 32) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)src);
+		__m128i r = _mm_srli_epi16(pixels, 11);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(pixels, 5), mask6);
+		__m128i b = _mm_and_si128(pixels, mask5);
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+		// 16-bit lanes of B | G << 8 and R | A << 8, interleaved into BGRA
+		__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		__m128i ra = _mm_or_si128(r, alpha);
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+#elif defined(USE_RGB565_NEON)
+	for (; i + 8 <= count; i += 8, src += 16, dst += 32) {
+		uint16x8_t pixels = vld1q_u16((const uint16_t *)src);
+		uint8x8x4_t out;
+		uint8x8_t r = vmovn_u16(vshrq_n_u16(pixels, 11));
+		uint8x8_t g = vmovn_u16(vandq_u16(vshrq_n_u16(pixels, 5), vdupq_n_u16(0x3f)));
+		uint8x8_t b = vmovn_u16(vandq_u16(pixels, vdupq_n_u16(0x1f)));
+		out.val[0] = vorr_u8(vshl_n_u8(b, 3), vshr_n_u8(b, 2));
+		out.val[1] = vorr_u8(vshl_n_u8(g, 2), vshr_n_u8(g, 4));
+		out.val[2] = vorr_u8(vshl_n_u8(r, 3), vshr_n_u8(r, 2));
+		out.val[3] = vdup_n_u8(0xff);
+		vst4_u8(dst, out);
+	}
+#endif
+
+	for (; i < count; i++, src += 2, dst += 4)
+		convertPixel(src, dst);
+}
@@ -0,0 +1,35 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RGB565_H
+#define RGB565_H
+
+#include "common/scummsys.h"
+
+/**
+ * Expands count little-endian RGB565 pixels to 32-bit BGRA, the order used by
+ * 32-bit BMPs. The high bits of each channel are replicated into the low ones
+ * so full intensity stays full intensity, alpha is set to opaque.
+ */
+void convertRGB565ToBGRA(const uint8 *src, uint8 *dst, uint32 count);
+
+#endif
@@ -20,19 +20,176 @@
  *
  */
 
-// Utility to dump drawing of the sectors in a set file to an xfig file
+// Utility to dump drawing of the sectors in a set file to an xfig or svg
+// file. Grim's text sets and EMI's binary ones are both read.
 
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string>
+#include <vector>
+#include "lab.h"
+#include "assetloader.h"
+#include "emi/setb.h"
+#include "emi/textwriter.h"
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
-int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: set2fig mo.set >mo.fig\n");
-		exit(1);
+struct FigSector {
+	std::string name;
+	int color;	// An xfig colour index
+	bool visible;
+	std::vector<float> vertices;	// x, y, z of each
+};
+
+static int typeColor(const char *type, size_t len) {
+	if (len == 6 && memcmp(type, "camera", 6) == 0)
+		return 1;
+	if (len == 7 && memcmp(type, "special", 7) == 0)
+		return 5;
+	if (len == 9 && memcmp(type, "chernobyl", 9) == 0)
+		return 4;
+	// walk and funnel
+	return 0;
+}
+
+/**
+ * Splits the text of a set into the words between whitespace, in place.
+ */
+class Tokenizer {
+	const char *_p;
+	const char *_end;
+public:
+	Tokenizer(const char *data, uint32 size) : _p(data), _end(data + size) {}
+
+	bool next(const char *&word, size_t &len) {
+		while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n'))
+			_p++;
+		if (_p == _end)
+			return false;
+		word = _p;
+		while (_p < _end && *_p != ' ' && *_p != '\t' && *_p != '\r' && *_p != '\n')
+			_p++;
+		len = _p - word;
+		return true;
+	}
+
+	bool nextInt(int &value) {
+		float f;
+		if (!nextFloat(f))
+			return false;
+		value = (int)f;
+		return true;
+	}
+
+	bool nextFloat(float &value) {
+		const char *word;
+		size_t len;
+		if (!next(word, len) || len >= 64)
+			return false;
+		char buf[64];
+		memcpy(buf, word, len);
+		buf[len] = 0;
+		value = (float)strtod(buf, NULL);
+		return true;
+	}
+};
+
+static bool isWord(const char *word, size_t len, const char *keyword) {
+	return strlen(keyword) == len && memcmp(word, keyword, len) == 0;
+}
+
+// The sectors of a text set, the keywords of each may come in any order
+static bool readTextSet(const char *data, uint32 size, std::vector<FigSector> &sectors) {
+	Tokenizer text(data, size);
+	const char *word;
+	size_t len;
+	bool found = false;
+	while (!found && text.next(word, len)) {
+		if (isWord(word, len, "section:") && text.next(word, len))
+			found = isWord(word, len, "sectors");
 	}
-	printf("#FIG 3.2\n"
+	if (!found)
+		return false;
+
+	FigSector *sector = NULL;
+	int numVertices = 0;
+	while (text.next(word, len)) {
+		if (isWord(word, len, "section:"))
+			break;
+		if (isWord(word, len, "sector")) {
+			sectors.push_back(FigSector());
+			sector = &sectors.back();
+			sector->color = 0;
+			sector->visible = true;
+			if (text.next(word, len))
+				sector->name.assign(word, len);
+		} else if (!sector) {
+			continue;
+		} else if (isWord(word, len, "type")) {
+			if (text.next(word, len))
+				sector->color = typeColor(word, len);
+		} else if (isWord(word, len, "visibility")) {
+			if (text.next(word, len))
+				sector->visible = !isWord(word, len, "invisible");
+		} else if (isWord(word, len, "numvertices")) {
+			if (!text.nextInt(numVertices) || numVertices < 0)
+				numVertices = 0;
+		} else if (isWord(word, len, "vertices:")) {
+			sector->vertices.resize(3 * numVertices);
+			for (int i = 0; i < 3 * numVertices; i++) {
+				if (!text.nextFloat(sector->vertices[i])) {
+					sector->vertices.resize(i - i % 3);
+					break;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+static bool readBinarySet(const char *data, uint32 size, std::vector<FigSector> &sectors) {
+	Data reader(data, size);
+	Set set(&reader);
+	const std::vector<Sector *> &in = set.getSectors();
+	for (size_t i = 0; i < in.size(); i++) {
+		FigSector s;
+		s.name = in[i]->getName();
+		switch (in[i]->getType()) {
+		case CameraType:
+			s.color = 1;
+			break;
+		case SpecialType:
+			s.color = 5;
+			break;
+		case HotType:
+			s.color = 4;
+			break;
+		default:
+			s.color = 0;
+			break;
+		}
+		s.visible = in[i]->isVisible();
+		s.vertices.assign(in[i]->getVertices(), in[i]->getVertices() + 3 * in[i]->getNumVertices());
+		sectors.push_back(s);
+	}
+	return !reader.eos();
+}
+
+// In xfig units, a thousandth of the set's, with y growing down
+static int figX(float x) {
+	return (int)round(x * 1000);
+}
+
+static int figY(float y) {
+	return -(int)round(y * 1000);
+}
+
+static void writeFig(TextWriter &out, const std::vector<FigSector> &sectors) {
+	out << "#FIG 3.2\n"
 		"Landscape\n"
 		"Center\n"
 		"Metric\n"
@@ -40,66 +197,166 @@ int main(int argc, char *argv[]) {
 		"100.00\n"
 		"Single\n"
 		"-2\n"
-		"1200 2\n");
+		"1200 2\n";
+	for (size_t i = 0; i < sectors.size(); i++) {
+		const FigSector &s = sectors[i];
+		int numVertices = s.vertices.size() / 3;
+		if (!numVertices)
+			continue;
+		out << "# " << s.name << "\n2 3 " << (s.visible ? 0 : 1) << " 1 " << s.color << " 7 " << s.color * 10
+			<< " -1 -1 0.000 0 0 -1 0 0 " << numVertices + 1 << "\n\t";
+		for (int j = 0; j < numVertices; j++)
+			out << ' ' << figX(s.vertices[3 * j]) << ' ' << figY(s.vertices[3 * j + 1]);
+		out << ' ' << figX(s.vertices[0]) << ' ' << figY(s.vertices[1]) << '\n';
+	}
+}
 
-	FILE *in = fopen(argv[1], "r");
-	if (in == NULL) {
-		perror(argv[1]);
-		exit(1);
+static void writeSvg(TextWriter &out, const std::vector<FigSector> &sectors) {
+	static const char *const colors[] = { "#000000", "#0000ff", "#00ff00", "#00ffff", "#ff0000", "#ff00ff" };
+
+	int minX = 0, minY = 0, maxX = 0, maxY = 0;
+	bool first = true;
+	for (size_t i = 0; i < sectors.size(); i++) {
+		for (size_t j = 0; j + 2 < sectors[i].vertices.size(); j += 3) {
+			int x = figX(sectors[i].vertices[j]), y = figY(sectors[i].vertices[j + 1]);
+			if (first || x < minX)
+				minX = x;
+			if (first || x > maxX)
+				maxX = x;
+			if (first || y < minY)
+				minY = y;
+			if (first || y > maxY)
+				maxY = y;
+			first = false;
+		}
 	}
+	int margin = ((maxX - minX) > (maxY - minY) ? maxX - minX : maxY - minY) / 20 + 1;
 
-	char line[1024];
-	do {
-		fgets(line, 1024, in);
-	} while (strcmp(line, "section: sectors\r\n") != 0);
-
-	int numSectors = -1, numRead = 0;
-	do {
-		char sectorName[256];
-		fscanf(in, " sector %256s", sectorName);
-
-		int id;
-		fscanf(in, " ID %d", &id);
-		if (numSectors < 0)
-			numSectors = id + 1;
-
-		char buf[256];
-		int color = 0;
-		fscanf(in, " type %256s", buf);
-		if (strcmp(buf, "walk") == 0)
-			color = 0;
-		else if (strcmp(buf, "funnel") == 0)
-			color = 0;
-		else if (strcmp(buf, "camera") == 0)
-			color = 1;
-		else if (strcmp(buf, "special") == 0)
-			color = 5;
-		else if (strcmp(buf, "chernobyl") == 0)
-			color = 4;
-
-		int linetype = 0;
-		fscanf(in, " default visibility %256s", buf);
-		if (strcmp(buf, "visible") == 0)
-			linetype = 0;
-		else if (strcmp(buf, "invisible") == 0)
-			linetype = 1;
-
-		float dummy;
-		fscanf(in, " height %f", &dummy);
-
-		int numVertices;
-		fscanf(in, " numvertices %d", &numVertices);
-
-		printf("# %s\n2 3 %d 1 %d 7 %d -1 -1 0.000 0 0 -1 0 0 %d\n\t", sectorName, linetype, color, color * 10, numVertices + 1);
-
-		float vertices[300];
-		fscanf(in, " vertices:");
-		for (int i = 0; i < numVertices; i++) {
-			fscanf(in, " %f %f %f", vertices + 3*i, vertices + (3 * i + 1), vertices + (3 * i + 2));
-			printf(" %d %d", (int) round(vertices[3 * i] * 1000), -(int)round(vertices[3 * i + 1] * 1000));
+	out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"" << minX - margin << ' ' << minY - margin << ' '
+		<< maxX - minX + 2 * margin << ' ' << maxY - minY + 2 * margin << "\">\n";
+	for (size_t i = 0; i < sectors.size(); i++) {
+		const FigSector &s = sectors[i];
+		if (s.vertices.size() < 3)
+			continue;
+		out << "<polygon fill=\"none\" stroke=\"" << colors[s.color] << "\" vector-effect=\"non-scaling-stroke\"";
+		if (!s.visible)
+			out << " stroke-dasharray=\"4 2\"";
+		out << " points=\"";
+		for (size_t j = 0; j + 2 < s.vertices.size(); j += 3) {
+			if (j)
+				out << ' ';
+			out << figX(s.vertices[j]) << ',' << figY(s.vertices[j + 1]);
 		}
-		printf(" %d %d\n", (int) round(vertices[0] * 1000), -(int)round(vertices[1] * 1000));
+		out << "\"><title>";
+		for (size_t j = 0; j < s.name.size(); j++) {
+			if (s.name[j] == '<')
+				out << "&lt;";
+			else if (s.name[j] == '>')
+				out << "&gt;";
+			else if (s.name[j] == '&')
+				out << "&amp;";
+			else
+				out << s.name[j];
+		}
+		out << "</title></polygon>\n";
+	}
+	out << "</svg>\n";
+}
 
-		numRead++;
-	} while (numRead < numSectors);
+static bool convertSet(const char *data, uint32 size, const std::string &name, bool svg, TextWriter &out) {
+	std::vector<FigSector> sectors;
+	bool success;
+	{
+		Common::StatsPhase phase(Common::kStatsDecode);
+		if (Common::matchPattern("*.setb", name.c_str()))
+			success = readBinarySet(data, size, sectors);
+		else
+			success = readTextSet(data, size, sectors);
+	}
+	if (!success) {
+		fprintf(stderr, "%s is truncated or has no sectors\n", name.c_str());
+		if (sectors.empty())
+			return false;
+	}
+	Common::StatsPhase phase(Common::kStatsConvert);
+	if (svg)
+		writeSvg(out, sectors);
+	else
+		writeFig(out, sectors);
+	Common::addStatsFiles();
+	return success;
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: set2fig [-s] [LAB] SET >mo.fig\n");
+	fprintf(stderr, "       set2fig -b [-s] LAB PATTERN\n");
+	fprintf(stderr, "\t-s\tWrite SVG instead of xfig\n");
+	fprintf(stderr, "\t-b\tConvert every set of the lab matching PATTERN (e.g. '*.set*') to files named after them\n");
+}
+
+int main(int argc, char *argv[]) {
+	bool batch = false, svg = false;
+	int c;
+	Common::initStats("set2fig", argc, argv);
+	while ((c = getopt(argc, argv, "bsh")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = true;
+			break;
+		case 's':
+			svg = true;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2 || argc > 3 || (batch && argc != 3)) {
+		usage();
+		exit(1);
+	}
+
+	Lab *lab = argc > 2 ? new Lab(argv[1], false, true) : NULL;
+	int failed = 0;
+	if (batch) {
+		// All the sets of a game in one run, each to its own file
+		for (uint32 i = 0; i < lab->getNumEntries(); i++) {
+			const char *name = lab->getEntryName(i);
+			if (!Common::matchPattern(argv[2], name))
+				continue;
+			uint32 size;
+			const char *data = lab->getData(name, size);
+			std::string outName = std::string(name) + (svg ? ".svg" : ".fig");
+			FILE *file = data ? fopen(outName.c_str(), "wb") : NULL;
+			if (!file) {
+				fprintf(stderr, "Could not convert %s\n", name);
+				failed++;
+				continue;
+			}
+			{
+				TextWriter out(file);
+				if (!convertSet(data, size, name, svg, out))
+					failed++;
+			}
+			if (fclose(file) != 0)
+				failed++;
+		}
+	} else {
+		AssetLoader loader(lab);
+		const char *filename = argv[argc - 1];
+		const Asset *asset = loader.load(filename);
+		if (!asset) {
+			perror(filename);
+			exit(1);
+		}
+		TextWriter out(stdout);
+		if (!convertSet(asset->data, asset->size, filename, svg, out))
+			failed++;
+		loader.release(asset);
+	}
+	delete lab;
+	return failed ? 1 : 0;
 }
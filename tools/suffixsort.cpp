@@ -0,0 +1,356 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+//Large parts of this program have been taken from bsdiff written by Colin Percival:
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include "tools/suffixsort.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+static void split(int32 *I, int32 *V, int32 start, int32 len, int32 h) {
+	int32 i, j, k, x, tmp, jj, kk;
+
+	if (len < 16) {
+		for (k = start; k < start + len; k += j) {
+			j = 1;
+			x = V[I[k] + h];
+			for (i = 1; k + i < start + len; i++) {
+				if (V[I[k + i] + h] < x) {
+					x = V[I[k + i] + h];
+					j = 0;
+				};
+				if (V[I[k + i] + h] == x) {
+					tmp = I[k + j];
+					I[k + j] = I[k + i];
+					I[k + i] = tmp;
+					j++;
+				};
+			};
+			for (i = 0; i < j; i++) V[I[k + i]] = k + j - 1;
+			if (j == 1) I[k] = -1;
+		};
+		return;
+	};
+
+	x = V[I[start + len/2] + h];
+	jj = 0;
+	kk = 0;
+	for (i = start; i < start + len; i++) {
+		if (V[I[i] + h] < x) jj++;
+		if (V[I[i] + h] == x) kk++;
+	};
+	jj += start;
+	kk += jj;
+
+	i = start;
+	j = 0;
+	k = 0;
+	while (i < jj) {
+		if (V[I[i] + h] < x) {
+			i++;
+		} else if (V[I[i] + h] == x) {
+			tmp = I[i];
+			I[i] = I[jj + j];
+			I[jj + j] = tmp;
+			j++;
+		} else {
+			tmp = I[i];
+			I[i] = I[kk + k];
+			I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	while (jj + j < kk) {
+		if (V[I[jj + j] + h] == x) {
+			j++;
+		} else {
+			tmp = I[jj + j];
+			I[jj + j] = I[kk + k];
+			I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	if (jj > start) split(I, V, start, jj - start, h);
+
+	for (i = 0; i < kk - jj; i++) V[I[jj + i]] = kk - 1;
+	if (jj == kk - 1) I[jj] = -1;
+
+	if (start + len > kk) split(I, V, kk, start + len - kk, h);
+}
+
+void qsufsort(int32 *I, int32 *V, byte *old, int32 oldsize) {
+	int32 buckets[256];
+	int32 i, h, len;
+
+	for (i = 0; i < 256; i++) buckets[i] = 0;
+	for (i = 0; i < oldsize; i++) buckets[old[i]]++;
+	for (i = 1; i < 256; i++) buckets[i] += buckets[i-1];
+	for (i = 255; i > 0; i--) buckets[i] = buckets[i-1];
+	buckets[0] = 0;
+
+	for (i = 0; i < oldsize; i++) I[++buckets[old[i]]] = i;
+	I[0] = oldsize;
+	for (i = 0; i < oldsize; i++) V[i] = buckets[old[i]];
+	V[oldsize] = 0;
+	for (i = 1; i < 256; i++) if (buckets[i] == buckets[i-1] + 1) I[buckets[i]] = -1;
+	I[0] = -1;
+
+	for (h = 1; I[0] != -(oldsize + 1); h += h) {
+		len = 0;
+		for (i = 0; i < oldsize + 1;) {
+			if (I[i] < 0) {
+				len -= I[i];
+				i -= I[i];
+			} else {
+				if (len) I[i-len] = -len;
+				len = V[I[i]] + 1 - i;
+				split(I, V, i, len, h);
+				i += len;
+				len = 0;
+			};
+		};
+		if (len) I[i-len] = -len;
+	};
+
+	for (i = 0; i < oldsize + 1; i++)
+		I[V[i]] = i;
+}
+
+// Linear time suffix sorting by induced sorting (SA-IS, Nong, Zhang and Chan).
+// The string has a virtual sentinel after its end, smaller than any symbol,
+// so binary data needs no reserved byte. Besides SA it only needs a bit per
+// symbol for the suffix types and one bucket table per level.
+
+#define SAIS_TGET(t, i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define SAIS_TSET(t, i, b) (t[(i) >> 3] = (b) ? (t[(i) >> 3] | (1 << ((i) & 7))) : (t[(i) >> 3] & ~(1 << ((i) & 7))))
+#define SAIS_ISLMS(t, i) ((i) > 0 && SAIS_TGET(t, i) && !SAIS_TGET(t, (i) - 1))
+
+template<typename T>
+static void saisBuckets(const T *s, int32 *bkt, int32 n, int32 K, bool end) {
+	int32 i, sum = 0;
+
+	for (i = 0; i < K; i++) bkt[i] = 0;
+	for (i = 0; i < n; i++) bkt[s[i]]++;
+	for (i = 0; i < K; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+template<typename T>
+static void saisInduce(const byte *t, int32 *SA, const T *s, int32 *bkt, int32 n, int32 K) {
+	int32 i, j;
+
+	// L-type suffixes, the sentinel comes first and induces n - 1
+	saisBuckets(s, bkt, n, K, false);
+	SA[bkt[s[n - 1]]++] = n - 1;
+	for (i = 0; i < n; i++) {
+		j = SA[i] - 1;
+		if (j >= 0 && !SAIS_TGET(t, j)) SA[bkt[s[j]]++] = j;
+	}
+
+	// S-type suffixes
+	saisBuckets(s, bkt, n, K, true);
+	for (i = n - 1; i >= 0; i--) {
+		j = SA[i] - 1;
+		if (j >= 0 && SAIS_TGET(t, j)) SA[--bkt[s[j]]] = j;
+	}
+}
+
+template<typename T>
+static void sais(const T *s, int32 *SA, int32 n, int32 K) {
+	int32 i, j;
+
+	if (n == 0)
+		return;
+	if (n == 1) {
+		SA[0] = 0;
+		return;
+	}
+
+	// Classify the suffixes, S-type is 1. The last one is L-type as it is
+	// followed by the sentinel.
+	byte *t = new byte[n / 8 + 1];
+	SAIS_TSET(t, n - 1, 0);
+	for (i = n - 2; i >= 0; i--)
+		SAIS_TSET(t, i, (s[i] < s[i + 1] || (s[i] == s[i + 1] && SAIS_TGET(t, i + 1))) ? 1 : 0);
+
+	// Stage 1: sort the LMS substrings
+	int32 *bkt = new int32[K];
+	saisBuckets(s, bkt, n, K, true);
+	for (i = 0; i < n; i++) SA[i] = -1;
+	for (i = 1; i < n; i++)
+		if (SAIS_ISLMS(t, i)) SA[--bkt[s[i]]] = i;
+	saisInduce(t, SA, s, bkt, n, K);
+	delete[] bkt;
+
+	// Compact the sorted LMS substrings into the first n1 items
+	int32 n1 = 0;
+	for (i = 0; i < n; i++)
+		if (SAIS_ISLMS(t, SA[i])) SA[n1++] = SA[i];
+
+	// Name the LMS substrings, equal ones get the same name. The last one
+	// runs into the sentinel and so is unique.
+	for (i = n1; i < n; i++) SA[i] = -1;
+	int32 name = 0, prev = -1;
+	for (i = 0; i < n1; i++) {
+		int32 pos = SA[i];
+		bool diff = false;
+		for (int32 d = 0; ; d++) {
+			if (prev == -1 || pos + d == n || prev + d == n ||
+			        s[pos + d] != s[prev + d] || SAIS_TGET(t, pos + d) != SAIS_TGET(t, prev + d)) {
+				diff = true;
+				break;
+			} else if (d > 0 && (SAIS_ISLMS(t, pos + d) || SAIS_ISLMS(t, prev + d))) {
+				break;
+			}
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		SA[n1 + pos / 2] = name - 1;
+	}
+	for (i = n - 1, j = n - 1; i >= n1; i--)
+		if (SA[i] >= 0) SA[j--] = SA[i];
+
+	// Stage 2: sort the reduced string, recursing if the names aren't unique
+	int32 *SA1 = SA, *s1 = SA + n - n1;
+	if (name < n1)
+		sais(s1, SA1, n1, name);
+	else
+		for (i = 0; i < n1; i++) SA1[s1[i]] = i;
+
+	// Stage 3: induce the full order from the sorted LMS suffixes
+	bkt = new int32[K];
+	saisBuckets(s, bkt, n, K, true);
+	for (i = 1, j = 0; i < n; i++)
+		if (SAIS_ISLMS(t, i)) s1[j++] = i;
+	for (i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+	for (i = n1; i < n; i++) SA[i] = -1;
+	for (i = n1 - 1; i >= 0; i--) {
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[s[j]]] = j;
+	}
+	saisInduce(t, SA, s, bkt, n, K);
+
+	delete[] bkt;
+	delete[] t;
+}
+
+// Same result as qsufsort, the empty suffix sorts first
+void saissort(int32 *I, const byte *old, int32 oldsize) {
+	I[0] = oldsize;
+	sais(old, I + 1, oldsize, 256);
+}
+
+// Compares a word at a time, the first differing byte of a word is found
+// from the lowest set bit of the XOR on little endian machines
+static int32 matchlen(const byte *old, int32 oldsize, const byte *new_block, int32 new_size) {
+	int32 n = MIN(oldsize, new_size);
+	int32 i = 0;
+
+#if defined(__GNUC__) && defined(SCUMM_LITTLE_ENDIAN)
+	for (; i + 8 <= n; i += 8) {
+		uint64 a, b;
+		memcpy(&a, old + i, 8);
+		memcpy(&b, new_block + i, 8);
+		if (a != b)
+			return i + __builtin_ctzll(a ^ b) / 8;
+	}
+#endif
+	for (; i < n; i++)
+		if (old[i] != new_block[i])
+			break;
+
+	return i;
+}
+
+/**
+ * Binary search of the suffix array for the longest match of new_block.
+ * lcpSt and lcpEn are how many bytes the suffixes at st and en are known to
+ * share with new_block. Every suffix sorted between them shares at least the
+ * smaller of the two, so each step only compares the bytes past it.
+ */
+static int32 searchRange(int32 *I, byte *old, int32 oldsize,
+                         byte *new_block, int32 newsize, int32 st, int32 en,
+                         int32 lcpSt, int32 lcpEn, int32 *pos) {
+	int32 x, y;
+
+	if (en - st < 2) {
+		x = lcpSt + matchlen(old + I[st] + lcpSt, oldsize - I[st] - lcpSt, new_block + lcpSt, newsize - lcpSt);
+		y = lcpEn + matchlen(old + I[en] + lcpEn, oldsize - I[en] - lcpEn, new_block + lcpEn, newsize - lcpEn);
+
+		if (x > y) {
+			*pos = I[st];
+			return x;
+		} else {
+			*pos = I[en];
+			return y;
+		}
+	};
+
+	x = st + (en - st) / 2;
+	int32 skip = MIN(lcpSt, lcpEn);
+	int32 n = MIN(oldsize - I[x], newsize);
+	int32 len = skip + matchlen(old + I[x] + skip, n - skip, new_block + skip, newsize - skip);
+	// The same order memcmp() over the first n bytes gives
+	if (len < n && old[I[x] + len] < new_block[len]) {
+		return searchRange(I, old, oldsize, new_block, newsize, x, en, len, lcpEn, pos);
+	} else {
+		return searchRange(I, old, oldsize, new_block, newsize, st, x, lcpSt, len, pos);
+	};
+}
+
+
+int32 search(int32 *I, byte *old, int32 oldsize, byte *new_block, int32 newsize, int32 *pos) {
+	return searchRange(I, old, oldsize, new_block, newsize, 0, oldsize, 0, 0, pos);
+}
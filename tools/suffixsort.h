@@ -0,0 +1,44 @@
+/* ResidualVM - A 3D game interpreter
+ *
+ * ResidualVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SUFFIXSORT_H
+#define SUFFIXSORT_H
+
+#include "common/scummsys.h"
+
+/**
+ * Suffix sorting of diffr's old files. Both fill I with the oldsize + 1
+ * suffixes of old in order, the empty one first. qsufsort (Larsson and
+ * Sadakane) needs V, as large as I, for its work; saissort runs in linear
+ * time without it.
+ */
+void qsufsort(int32 *I, int32 *V, byte *old, int32 oldsize);
+void saissort(int32 *I, const byte *old, int32 oldsize);
+
+/**
+ * Finds the longest prefix of new_block that is in old by binary search of
+ * its sorted suffixes I. Returns its length and sets pos to where in old it
+ * is.
+ */
+int32 search(int32 *I, byte *old, int32 oldsize, byte *new_block, int32 newsize, int32 *pos);
+
+#endif
@@ -24,12 +24,22 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include "common/getopt.h"
+#include "common/pattern.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #endif
 
+#ifdef POSIX
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #define GT_GRIM 1
 #define GT_EMI 2
 
@@ -57,6 +67,14 @@ uint32_t READ_LE_UINT32(const void *ptr) {
 	return (b[3] << 24) + (b[2] << 16) + (b[1] << 8) + (b[0]);
 }
 
+// Whether the entry lies within a lab of filesize bytes, without letting
+// start + size wrap for a corrupt entry
+static bool entryFits(const struct lab_entry *entry, uint32_t filesize) {
+	uint32_t offset = READ_LE_UINT32(&entry->start);
+	uint32_t size = READ_LE_UINT32(&entry->size);
+	return size <= filesize && offset <= filesize - size;
+}
+
 static void createDirectoryStructure(char *name) {
 #ifdef WIN32
 	char *dir = strrchr(name, '\\');
@@ -68,6 +86,153 @@ static void createDirectoryStructure(char *name) {
 #endif
 }
 
+#define MAX_PATTERNS 64
+
+static const char *includePatterns[MAX_PATTERNS];
+static const char *excludePatterns[MAX_PATTERNS];
+static int numIncludes = 0, numExcludes = 0;
+
+static bool isSelected(const char *fname) {
+	int i;
+	for (i = 0; i < numExcludes; i++)
+		if (Common::matchPattern(excludePatterns[i], fname))
+			return false;
+	if (numIncludes == 0)
+		return true;
+	for (i = 0; i < numIncludes; i++)
+		if (Common::matchPattern(includePatterns[i], fname))
+			return true;
+	return false;
+}
+
+static void addPattern(const char **patterns, int &count, const char *pattern) {
+	if (count == MAX_PATTERNS) {
+		printf("Too many patterns, at most %d are supported\n", MAX_PATTERNS);
+		exit(1);
+	}
+	patterns[count++] = pattern;
+}
+
+static void usage() {
+	printf("Usage: unlab [-l] [-j N] [-i PATTERN]... [-x PATTERN]... LABFILE\n");
+	printf("\t-l\t\tList name, offset and size of the entries instead of extracting\n");
+	printf("\t-j N\t\tExtract with N writer threads\n");
+	printf("\t-i PATTERN\tOnly extract entries matching PATTERN (e.g. '*.bm')\n");
+	printf("\t-x PATTERN\tSkip entries matching PATTERN\n");
+}
+
+#ifdef POSIX
+// Work shared by the writer threads. Entries are handed out in table order
+// through nextEntry, each thread reads its entries with pread() so they can
+// share one descriptor without fighting over the file position.
+struct ExtractJob {
+	int fd;
+	const struct lab_entry *entries;
+	const char *str_table;
+	uint32_t num_entries;
+	uint32_t nextEntry;
+	pthread_mutex_t lock;
+};
+
+static bool preadFull(int fd, char *buf, uint32_t size, uint32_t offset) {
+	while (size > 0) {
+		ssize_t count = pread(fd, buf, size, offset);
+		if (count <= 0)
+			return false;
+		buf += count;
+		size -= count;
+		offset += count;
+	}
+	return true;
+}
+
+static void *extractWorker(void *arg) {
+	ExtractJob *job = (ExtractJob *)arg;
+	uint32_t bufSize = 1024*1024;
+	char *buf = (char *)malloc(bufSize);
+	if (!buf) {
+		printf("Could not allocate memory\n");
+		exit(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		uint32_t i = job->nextEntry++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->num_entries)
+			break;
+
+		const char *fname = job->str_table + READ_LE_UINT32(&job->entries[i].fname_offset);
+		if (!isSelected(fname))
+			continue;
+		uint32_t offset = READ_LE_UINT32(&job->entries[i].start);
+		uint32_t size = READ_LE_UINT32(&job->entries[i].size);
+
+		if (bufSize < size) {
+			char *newBuf = (char *)realloc(buf, size);
+			if (!newBuf) {
+				printf("Could not reallocate memory\n");
+				exit(1);
+			}
+			buf = newBuf;
+			bufSize = size;
+		}
+		{
+			Common::StatsPhase phase(Common::kStatsOpen);
+			if (!preadFull(job->fd, buf, size, offset)) {
+				printf("Could not read file: %s\n", fname);
+				continue;
+			}
+			Common::addStatsRead(size);
+		}
+
+		Common::StatsPhase phase(Common::kStatsWrite);
+		FILE *outfile = fopen(fname, "wb");
+		if (!outfile) {
+			printf("Could not open file: %s\n", fname);
+			continue;
+		}
+		fwrite(buf, 1, size, outfile);
+		fclose(outfile);
+		Common::addStatsWritten(size);
+		Common::addStatsFiles();
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void extractParallel(const char *filename, const struct lab_entry *entries, const char *str_table, uint32_t num_entries, int jobs) {
+	ExtractJob job;
+	job.fd = open(filename, O_RDONLY);
+	if (job.fd < 0) {
+		printf("Can not open source file: %s\n", filename);
+		exit(1);
+	}
+	job.entries = entries;
+	job.str_table = str_table;
+	job.num_entries = num_entries;
+	job.nextEntry = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	pthread_t *threads = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+	int started = 0;
+	for (int t = 0; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, extractWorker, &job) == 0)
+			++started;
+	}
+	// If no thread could be spawned do the work on this one
+	if (started == 0)
+		extractWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+	close(job.fd);
+}
+#endif
+
 int main(int argc, char **argv) {
 	FILE *infile, *outfile;
 	struct lab_header head;
@@ -76,12 +241,41 @@ int main(int argc, char **argv) {
 	uint32_t i;
 	uint32_t offset;
 	uint8_t g_type;
+	int jobs = 1;
+	bool listOnly = false;
 
-	if (argc < 2) {
+	int c;
+	Common::initStats("unlab", argc, argv);
+	while ((c = getopt(argc, argv, "lj:i:x:h")) != -1) {
+		switch (c) {
+		case 'l':
+			listOnly = true;
+			break;
+		case 'i':
+			addPattern(includePatterns, numIncludes, optarg);
+			break;
+		case 'x':
+			addPattern(excludePatterns, numExcludes, optarg);
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				exit(1);
+			}
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind >= argc) {
 		printf("No file specified\n");
+		usage();
 		exit(1);
 	}
-	const char *filename = argv[1];
+	const char *filename = argv[optind];
 
 	infile = fopen(filename, "rb");
 	if (infile == 0) {
@@ -121,28 +315,62 @@ int main(int argc, char **argv) {
 		printf("Could not allocate memory\n");
 		exit(1);
 	}
-	// Grim-stuff
-	if(g_type == GT_GRIM) {
-		fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
+	{
+		Common::StatsPhase phase(Common::kStatsIndex);
+		// Grim-stuff
+		if(g_type == GT_GRIM) {
+			fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
+
+			fread(str_table, 1, head.string_table_size, infile);
+		} else if(g_type == GT_EMI) { // EMI-stuff
+			// EMI has a string-table-offset
+			head.string_table_offset = READ_LE_UINT32(&s_offset) - 0x13d0f;
+			// Find the string-table
+			fseek(infile, head.string_table_offset, SEEK_SET);
+			// Read the entire string table into str-table
+			fread(str_table, 1, head.string_table_size, infile);
+			fseek(infile, 20, SEEK_SET);
 
-		fread(str_table, 1, head.string_table_size, infile);
-	} else if(g_type == GT_EMI) { // EMI-stuff
-		// EMI has a string-table-offset
-		head.string_table_offset = READ_LE_UINT32(&s_offset) - 0x13d0f;
-		// Find the string-table
-		fseek(infile, head.string_table_offset, SEEK_SET);
-		// Read the entire string table into str-table
-		fread(str_table, 1, head.string_table_size, infile);
-		fseek(infile, 20, SEEK_SET);
+			// Decrypt the string table
+			uint32_t j;
+			for (j = 0; j < head.string_table_size; j++)
+				if (str_table[j] != 0)
+					str_table[j] ^= 0x96;
+			fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
+
+		}
+		Common::addStatsRead(20 + head.num_entries * sizeof(struct lab_entry) + head.string_table_size);
+	}
 
-		// Decrypt the string table
-		uint32_t j;
-		for (j = 0; j < head.string_table_size; j++)
-			if (str_table[j] != 0)
-				str_table[j] ^= 0x96;
-		fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
+	if (listOnly) {
+		for (i = 0; i < head.num_entries; i++) {
+			const char *fname = str_table + READ_LE_UINT32(&entries[i].fname_offset);
+			if (isSelected(fname))
+				printf("%s\t%u\t%u\n", fname, READ_LE_UINT32(&entries[i].start), READ_LE_UINT32(&entries[i].size));
+		}
+		free(entries);
+		free(str_table);
+		fclose(infile);
+		return 0;
+	}
 
+#ifdef POSIX
+	if (jobs > 1) {
+		// Stop at the first entry past the end of the lab, like the serial loop does
+		uint32_t count;
+		for (count = 0; count < head.num_entries; count++) {
+			if (!entryFits(&entries[count], (uint32_t)filesize)) {
+				printf("File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.", str_table + READ_LE_UINT32(&entries[count].fname_offset), filename);
+				break;
+			}
+		}
+		fclose(infile);
+		extractParallel(filename, entries, str_table, count, jobs);
+		free(entries);
+		free(str_table);
+		return 0;
 	}
+#endif
 	// allocate a 1mb buffer to start with
 	uint32_t bufSize = 1024*1024;
 	char *buf = (char *)malloc(bufSize);
@@ -156,10 +384,12 @@ int main(int argc, char **argv) {
 		offset = READ_LE_UINT32(&entries[i].start);
 		uint32_t size = READ_LE_UINT32(&entries[i].size);
 
-		if (offset + size > filesize) {
+		if (!entryFits(&entries[i], (uint32_t)filesize)) {
 			printf("File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.", fname, filename);
 			break;
 		}
+		if (!isSelected(fname))
+			continue;
 
 		createDirectoryStructure(fname);
 		outfile = fopen(fname, "wb");
@@ -178,10 +408,19 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		fseek(infile, offset, SEEK_SET);
-		fread(buf, 1, READ_LE_UINT32(&entries[i].size), infile);
-		fwrite(buf, 1, READ_LE_UINT32(&entries[i].size), outfile);
-		fclose(outfile);
+		{
+			Common::StatsPhase phase(Common::kStatsOpen);
+			fseek(infile, offset, SEEK_SET);
+			fread(buf, 1, READ_LE_UINT32(&entries[i].size), infile);
+			Common::addStatsRead(size);
+		}
+		{
+			Common::StatsPhase phase(Common::kStatsWrite);
+			fwrite(buf, 1, READ_LE_UINT32(&entries[i].size), outfile);
+			fclose(outfile);
+			Common::addStatsWritten(size);
+		}
+		Common::addStatsFiles();
 
 	}
 	free(buf);
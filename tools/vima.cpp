@@ -20,246 +20,340 @@
  *
  */
 
-#include <stdint.h>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
-
-
-typedef unsigned char byte;
-typedef unsigned char uint8;
-typedef signed char int8;
-typedef signed short int16;
-typedef unsigned short uint16;
-
-uint32_t get_be_uint32(char *p) {
-	unsigned char *pos = reinterpret_cast<unsigned char *>(p);
-	return (pos[0] << 24) | (pos[1] << 16) | (pos[2] << 8) | pos[3];
+#include <string>
+
+#include "tools/mcmp.h"
+#include "common/endian.h"
+#include "common/getopt.h"
+#include "common/stats.h"
+#include "common/statsalloc.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#endif
+
+// Decoded output is gathered and written in batches of about this size
+#define OUTPUT_CHUNK 0x400000
+
+// data holds all compressed blocks, output the batch starting at decoded
+// offset batchStart
+static void decodeBatchBlock(const byte *data, const McmpBlock *blocks, int i, byte *output, uint32 batchStart) {
+	const McmpBlock &block = blocks[i];
+	decodeMcmpBlock(block, data + (block.fileOffset - blocks[0].fileOffset), output + (block.decodedOffset - batchStart));
 }
 
-static int16 imcTable1[] = {
-	  7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
-	 19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
-	 50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
-	130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
-	337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
-	876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
-	2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
-	5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
-	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+#ifdef POSIX
+// One batch of blocks shared by the decoder threads. Blocks are handed out
+// through nextBlock, every block decodes into its own part of output.
+struct DecodeJob {
+	const byte *data;
+	const McmpBlock *blocks;
+	int endBlock;
+	int nextBlock;
+	byte *output;
+	uint32 batchStart;
+	pthread_mutex_t lock;
 };
 
-static int8 imcTable2[] = {
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-	5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-	6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
-};
+static void *decodeWorker(void *arg) {
+	DecodeJob *job = (DecodeJob *)arg;
 
-static int8 imcOtherTable1[] = {
-	-1, 4, -1, 4
-};
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int i = job->nextBlock++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->endBlock)
+			break;
 
-static int8 imcOtherTable2[] = {
-	-1, -1, 2, 6, -1, -1, 2, 6
-};
+		decodeBatchBlock(job->data, job->blocks, i, job->output, job->batchStart);
+	}
+	return NULL;
+}
 
-static int8 imcOtherTable3[] = {
-	-1, -1, -1, -1, 1, 2, 4, 6,
-	-1, -1, -1, -1, 1, 2, 4, 6
-};
+static void decodeParallel(const byte *data, const McmpBlock *blocks, int first, int end, byte *output, uint32 batchStart, int jobs) {
+	DecodeJob job;
+	job.data = data;
+	job.blocks = blocks;
+	job.endBlock = end;
+	job.nextBlock = first;
+	job.output = output;
+	job.batchStart = batchStart;
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (jobs > end - first)
+		jobs = end - first;
+	pthread_t *threads = new pthread_t[jobs];
+	int started = 0;
+	for (int t = 0; t < jobs; t++) {
+		if (pthread_create(&threads[started], NULL, decodeWorker, &job) == 0)
+			++started;
+	}
+	// If no thread could be spawned do the work on this one
+	if (started == 0)
+		decodeWorker(&job);
+	for (int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+	delete[] threads;
+	pthread_mutex_destroy(&job.lock);
+}
+#endif
 
-static int8 imcOtherTable4[] = {
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	1, 1, 1, 2, 2, 4, 5, 6,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	1, 1, 1, 2, 2, 4, 5, 6
+/**
+ * Turns the decoded iMUS stream into a WAV file. The iMUS header is
+ * collected until its DATA chunk starts, the format in its FRMT chunk is
+ * then written as a WAV header and the sample data is passed through.
+ */
+class WavWriter {
+public:
+	WavWriter(const char *name, FILE *out, uint32 decodedSize) :
+		_name(name), _out(out), _decodedSize(decodedSize), _headerSize(0), _dataLeft(0), _started(false), _failed(false) {}
+
+	bool write(const byte *data, uint32 size);
+	bool finish() const { return _started && !_failed; }
+
+private:
+	bool parseHeader();
+
+	const char *_name;
+	FILE *_out;
+	uint32 _decodedSize;
+	byte _header[1024];
+	uint32 _headerSize;
+	uint32 _dataLeft;
+	bool _started;
+	bool _failed;
 };
 
-static int8 imcOtherTable5[] = {
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	 1, 1, 1, 1, 1, 2, 2, 2,
-	 2, 4, 4, 4, 5, 5, 6, 6,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	 1, 1, 1, 1, 1, 2, 2, 2,
-	 2, 4, 4, 4, 5, 5, 6, 6
-};
+bool WavWriter::write(const byte *data, uint32 size) {
+	if (_failed)
+		return false;
 
-static int8 imcOtherTable6[] = {
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	 1, 1, 1, 1, 1, 1, 1, 1,
-	 1, 1, 2, 2, 2, 2, 2, 2,
-	 2, 2, 4, 4, 4, 4, 4, 4,
-	 5, 5, 5, 5, 6, 6, 6, 6,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1,
-	 1, 1, 1, 1, 1, 1, 1, 1,
-	 1, 1, 2, 2, 2, 2, 2, 2,
-	 2, 2, 4, 4, 4, 4, 4, 4,
-	 5, 5, 5, 5, 6, 6, 6, 6
-};
+	while (!_started && size > 0) {
+		if (_headerSize == sizeof(_header)) {
+			fprintf(stderr, "%s: iMUS header too large\n", _name);
+			_failed = true;
+			return false;
+		}
+		_header[_headerSize++] = *data++;
+		size--;
+		if (!parseHeader())
+			return false;
+	}
 
-static int8 *offsets[] = {
-	imcOtherTable1, imcOtherTable2, imcOtherTable3,
-	imcOtherTable4, imcOtherTable5, imcOtherTable6
-};
+	if (size > _dataLeft)
+		size = _dataLeft;
+	if (size > 0 && fwrite(data, 1, size, _out) != size) {
+		_failed = true;
+		return false;
+	}
+	Common::addStatsWritten(size);
+	_dataLeft -= size;
+	return true;
+}
 
-static uint16 destTable[5786];
-byte *sourceBuffer;
-
-void vimaInit(uint16 *destTable) {
-	int destTableStartPos, incer;
-
-	for (destTableStartPos = 0, incer = 0; destTableStartPos < 64; destTableStartPos++, incer++) {
-		unsigned int destTablePos, imcTable1Pos;
-		for (imcTable1Pos = 0, destTablePos = destTableStartPos;
-				imcTable1Pos < sizeof(imcTable1) / sizeof(imcTable1[0]); imcTable1Pos++, destTablePos += 64) {
-			int put = 0, count, tableValue;
-			for (count = 32, tableValue = imcTable1[imcTable1Pos]; count != 0; count >>= 1, tableValue >>= 1) {
-				if (incer & count) {
-					put += tableValue;
-				}
-			}
-			destTable[destTablePos] = put;
+bool WavWriter::parseHeader() {
+	if (_headerSize < 16)
+		return true;
+	if (memcmp(_header, "iMUS", 4) != 0 || memcmp(_header + 8, "MAP ", 4) != 0) {
+		fprintf(stderr, "%s: Not an iMUS stream\n", _name);
+		_failed = true;
+		return false;
+	}
+	uint32 mapSize = READ_BE_UINT32(_header + 12);
+	if (mapSize > sizeof(_header) - 24) {
+		fprintf(stderr, "%s: iMUS header too large\n", _name);
+		_failed = true;
+		return false;
+	}
+	if (_headerSize < 24 + mapSize)
+		return true;
+
+	unsigned int numBits = 16, rate = 22050, channels = 2;
+	for (uint32 mapPos = 0; mapPos + 8 <= mapSize; ) {
+		const byte *chunk = _header + 16 + mapPos;
+		uint32 chunkSize = READ_BE_UINT32(chunk + 4);
+		if (memcmp(chunk, "FRMT", 4) == 0 && chunkSize >= 20 && mapPos + 8 + chunkSize <= mapSize) {
+			numBits = READ_BE_UINT32(chunk + 16);
+			rate = READ_BE_UINT32(chunk + 20);
+			channels = READ_BE_UINT32(chunk + 24);
 		}
+		if (chunkSize > mapSize)
+			break;
+		mapPos += chunkSize + 8;
 	}
+
+	// Trust the block table over a DATA size that runs past the stream
+	_dataLeft = READ_BE_UINT32(_header + 16 + mapSize + 4);
+	if (_dataLeft > _decodedSize - _headerSize)
+		_dataLeft = _decodedSize - _headerSize;
+
+	byte wav[44];
+	memcpy(wav, "RIFF", 4);
+	WRITE_LE_UINT32(wav + 4, _dataLeft + 36);
+	memcpy(wav + 8, "WAVEfmt ", 8);
+	WRITE_LE_UINT32(wav + 16, 16);
+	WRITE_LE_UINT16(wav + 20, 1);
+	WRITE_LE_UINT16(wav + 22, channels);
+	WRITE_LE_UINT32(wav + 24, rate);
+	WRITE_LE_UINT32(wav + 28, channels * rate * (numBits / 8));
+	WRITE_LE_UINT16(wav + 32, channels * (numBits / 8));
+	WRITE_LE_UINT16(wav + 34, numBits);
+	memcpy(wav + 36, "data", 4);
+	WRITE_LE_UINT32(wav + 40, _dataLeft);
+	if (fwrite(wav, 1, sizeof(wav), _out) != sizeof(wav)) {
+		_failed = true;
+		return false;
+	}
+	Common::addStatsWritten(sizeof(wav));
+	_started = true;
+	return true;
 }
 
-void decompressVima(byte *src, int16 *dest, int destLen, uint16 *destTable) {
-	int numChannels = 1;
-	byte sBytes[2];
-	int16 sWords[2];
+static void usage() {
+	fprintf(stderr, "Usage: vima [-j N] FILE\n");
+	fprintf(stderr, "       vima -w [-j N] FILE...\n");
+	fprintf(stderr, "\t-j N\tDecode with N threads\n");
+	fprintf(stderr, "\t-w\tWrite each FILE as a WAV file next to it instead of\n");
+	fprintf(stderr, "\t\twriting the decoded iMUS stream to stdout\n");
+}
 
-	sBytes[0] = *(uint8 *)(src++);
-	if (sBytes[0] & 0x80) {
-		sBytes[0] = ~sBytes[0];
-		numChannels = 2;
-	}
-	sWords[0] = (src[0] << 8) | src[1];
-	src += 2;
-	if (numChannels > 1) {
-		sBytes[1] = *(uint8 *)(src++);
-		sWords[1] = (src[0] << 8) | src[1];
-		src += 2;
-	}
+/**
+ * Decodes one MCMP file, writing the iMUS stream to out or, when wav is
+ * set, its contents as a WAV file.
+ */
+static bool decodeFile(const char *filename, FILE *out, bool wav, int jobs) {
+	McmpStream stream;
+	byte *data;
+	{
+		Common::StatsPhase phase(Common::kStatsOpen);
+		if (!stream.open(filename)) {
+			fprintf(stderr, "%s: Not a valid file\n", filename);
+			return false;
+		}
 
-	int numSamples = destLen / (numChannels * 2);
-	int bits = (src[0] << 8) | src[1];
-	int bitPtr = 0;
-	src += 2;
-
-	for (int channel = 0; channel < numChannels; channel++) {
-		int16 *destPos = dest + channel;
-		int currTablePos = sBytes[channel];
-		int outputWord = sWords[channel];
-
-		for (int sample = 0; sample < numSamples; sample++) {
-			int numBits = imcTable2[currTablePos];
-			bitPtr += numBits;
-			int highBit = 1 << (numBits - 1);
-			int lowBits = highBit - 1;
-			int val = (bits >> (16 - bitPtr)) & (highBit | lowBits);
-
-			if (bitPtr > 7) {
-				bits = ((bits & 0xff) << 8) | *(uint8 *)(src++);
-				bitPtr -= 8;
-			}
+		// The compressed blocks follow the tables back to back, read them in
+		// one go rather than block by block
+		data = new byte[stream.getCompressedSize()];
+		stream.readCompressed(data);
+		Common::addStatsRead(stream.getCompressedSize());
+	}
+	const McmpBlock *blocks = &stream.getBlock(0);
+	int numBlocks = stream.getNumBlocks();
+
+	uint32 outputSize = OUTPUT_CHUNK;
+	byte *output = new byte[outputSize];
+	WavWriter wavWriter(filename, out, stream.getDecodedSize());
+	bool ok = true;
+
+	for (int first = 0; ok && first < numBlocks; ) {
+		// Gather as many blocks as fit in the output buffer, growing it
+		// when a single block does not
+		uint32 batchStart = blocks[first].decodedOffset;
+		int end = first + 1;
+		while (end < numBlocks && blocks[end].decodedOffset + blocks[end].uncompSize - batchStart <= outputSize)
+			end++;
+		uint32 batchSize = blocks[end - 1].decodedOffset + blocks[end - 1].uncompSize - batchStart;
+		if (batchSize > outputSize) {
+			delete[] output;
+			outputSize = batchSize;
+			output = new byte[outputSize];
+		}
 
-			if (val & highBit)
-				val ^= highBit;
+		{
+			Common::StatsPhase phase(Common::kStatsDecode);
+#ifdef POSIX
+			if (jobs > 1 && end - first > 1)
+				decodeParallel(data, blocks, first, end, output, batchStart, jobs);
 			else
-				highBit = 0;
-
-			if (val == lowBits) {
-				outputWord = ((int16)(bits << bitPtr) & 0xffffff00);
-				bits = ((bits & 0xff) << 8) | *(uint8 *)(src++);
-				outputWord |= ((bits >> (8 - bitPtr)) & 0xff);
-				bits = ((bits & 0xff) << 8) | *(uint8 *)(src++);
-			} else {
-				int index = (val << (7 - numBits)) | (currTablePos << 6);
-				int delta = destTable[index];
-
-				if (val)
-					delta += (imcTable1[currTablePos] >> (numBits - 1));
-				if (highBit)
-					delta = -delta;
-
-				outputWord += delta;
-				if (outputWord < -0x8000)
-					outputWord = -0x8000;
-				else if (outputWord > 0x7fff)
-					outputWord = 0x7fff;
-			}
+#endif
+			for (int i = first; i < end; i++)
+				decodeBatchBlock(data, blocks, i, output, batchStart);
+		}
 
-			byte *b = (byte *)destPos;
-			b[0] = (byte)(outputWord >> 0);
-			b[1] = (byte)(outputWord >> 8);
-			destPos += numChannels;
+		Common::StatsPhase phase(Common::kStatsWrite);
+		if (wav) {
+			ok = wavWriter.write(output, batchSize);
+		} else {
+			ok = fwrite(output, 1, batchSize, out) == batchSize;
+			Common::addStatsWritten(batchSize);
+		}
+		first = end;
+	}
 
-			currTablePos += offsets[numBits - 2][val];
+	delete[] output;
+	delete[] data;
 
-			if (currTablePos < 0)
-				currTablePos = 0;
-			else if (currTablePos > 88)
-				currTablePos = 88;
-		}
+	if (stream.getBadCodec()) {
+		fprintf(stderr, "%s: Unrecognized codec %s\n", filename, stream.getBadCodec());
+		return false;
+	}
+	if (wav && ok && !wavWriter.finish()) {
+		fprintf(stderr, "%s: No sample data found\n", filename);
+		return false;
 	}
+	if (ok)
+		Common::addStatsFiles();
+	return ok;
 }
 
-int main(int /* argc */, char *argv[]) {
-	vimaInit(destTable);
-
-	FILE *f = fopen(argv[1], "rb");
-	if (f == NULL) {
-		perror(argv[1]);
-		return 1;
+int main(int argc, char *argv[]) {
+	int jobs = 1;
+	bool wav = false;
+
+	int c;
+	Common::initStats("vima", argc, argv);
+	while ((c = getopt(argc, argv, "j:wh")) != -1) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'w':
+			wav = true;
+			break;
+		default:
+			usage();
+			return 1;
+		}
 	}
 
-	char magic[4];
-	fread(magic, 4, 1, f);
-	if (memcmp(magic, "MCMP", 4) != 0) {
-		fprintf(stderr, "Not a valid file\n");
+	if (optind >= argc || (!wav && optind + 1 < argc)) {
+		usage();
 		return 1;
 	}
-	uint16_t numBlocks = getc(f) << 8;
-	numBlocks |= getc(f);
-	char *blocks = new char[9 * numBlocks];
-	fread(blocks, 9, numBlocks, f);
-
-	uint16_t numCodecs = getc(f) << 8;
-	numCodecs |= getc(f);
-	numCodecs /= 5;
-	char *codecs = new char[5 * numCodecs];
-	fread(codecs, 5, numCodecs, f);
-
-	for (int i = 0; i < numBlocks; i++) {
-		int codec = blocks[9 * i];
-		int uncompSize = get_be_uint32(blocks + 9 * i + 1);
-		int compSize = get_be_uint32(blocks + 9 * i + 5);
-
-		sourceBuffer = new byte[compSize];
-		fread(sourceBuffer, 1, compSize, f);
-
-		if (strcmp(codecs + 5 * codec, "NULL") == 0)
-			fwrite(sourceBuffer, 1, uncompSize, stdout);
-		else if (strcmp(codecs + 5 * codec, "VIMA") == 0) {
-			char *buffer = new char[uncompSize];
-			decompressVima(sourceBuffer, (int16 *)buffer, uncompSize, destTable);
-			fwrite(buffer, 1, uncompSize, stdout);
-			delete[] buffer;
-		} else {
-			fprintf(stderr, "Unrecognized codec %s\n", codecs + 5 * codec);
-			return 1;
+
+	if (!wav)
+		return decodeFile(argv[optind], stdout, false, jobs) ? 0 : 1;
+
+	int failed = 0;
+	for (int i = optind; i < argc; i++) {
+		// foo.imc becomes foo.wav
+		std::string outname = argv[i];
+		std::string::size_type dot = outname.rfind('.');
+		if (dot != std::string::npos && outname.find('/', dot) == std::string::npos)
+			outname.erase(dot);
+		outname += ".wav";
+
+		FILE *out = fopen(outname.c_str(), "wb");
+		if (!out) {
+			perror(outname.c_str());
+			failed++;
+			continue;
+		}
+		bool ok = decodeFile(argv[i], out, true, jobs);
+		if (fclose(out) != 0)
+			ok = false;
+		if (!ok) {
+			remove(outname.c_str());
+			failed++;
 		}
-		delete[] sourceBuffer;
 	}
-
-	return 0;
+	return failed ? 1 : 0;
 }